@@ -0,0 +1,89 @@
+#include <gpt-oss.h>
+#include <internal/metal.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+constexpr size_t kBufferSize = 64 * 1024 * 1024;
+// Each launch touches only the start of its buffer, so that the GPU time is negligible next to the submission.
+constexpr size_t kNumChannels = 256;
+
+// Measures the wall-clock time of submitting and completing one command buffer with a tiny kernel launch on each of
+// a number of large buffers, as process_tokens references every weight and KV cache buffer. With a residency set
+// holding the buffers, the time should stay flat as the number of buffers grows; without one, Metal makes every
+// buffer resident again on each submission.
+// Arguments: number of buffers, and whether the command buffers use a residency set with the buffers.
+static void command_buffer_submission(benchmark::State& state) {
+    const size_t num_buffers = state.range(0);
+    const bool use_residency_set = state.range(1) != 0;
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    std::vector<Buffer> buffers;
+    buffers.reserve(num_buffers);
+    for (size_t i = 0; i < num_buffers; i++) {
+        buffers.emplace_back(device, kBufferSize);
+    }
+
+    gptoss_metal_residency_set residency_set{};
+    if (use_residency_set) {
+        if (gptoss_metal_residency_set_create(device.handle(), num_buffers, &residency_set) != gptoss_status_success) {
+            state.SkipWithError("residency sets are not supported on this system");
+            return;
+        }
+        for (const Buffer& buffer : buffers) {
+            gptoss_metal_residency_set_add_buffer(&residency_set, buffer.handle());
+        }
+        gptoss_metal_residency_set_commit(&residency_set);
+    }
+
+    uint64_t rng_offset = 0;
+    for (auto _ : state) {
+        const auto start_time = std::chrono::steady_clock::now();
+
+        CommandBuffer command_buffer{command_queue};
+        if (use_residency_set) {
+            gptoss_metal_command_buffer_use_residency_set(command_buffer.handle(), &residency_set);
+        }
+        for (const Buffer& buffer : buffers) {
+            command_buffer.encode_launch_f32_fill_random(
+                f32_fill_random_fn,
+                /*threadgroup_size=*/0,
+                /*max_threadgroups=*/1,
+                /*output_buffer=*/buffer,
+                /*output_offset=*/0,
+                kNumChannels, kSeed, rng_offset, /*min=*/-1.0f, /*max=*/1.0f);
+        }
+        rng_offset += kNumChannels;
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const auto end_time = std::chrono::steady_clock::now();
+        state.SetIterationTime(std::chrono::duration<double>(end_time - start_time).count());
+    }
+
+    gptoss_metal_residency_set_release(&residency_set);
+
+    state.counters["buffers"] = num_buffers;
+    state.counters["submissions"] =
+        benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(command_buffer_submission)
+    ->ArgNames({"buffers", "residency_set"})
+    ->ArgsProduct({{1, 8, 32, 64}, {0, 1}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,71 @@
+#include <gpt-oss.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include <benchmark/benchmark.h>
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+// Each launch writes a few elements, so that the time goes to encoding and encoder transitions rather than the kernel.
+constexpr size_t kNumElements = 256;
+
+// Measures a command buffer of small kernel launches, with all of the launches in one shared compute encoder, or with
+// an encoder per launch, as every launch had before encoders were shared. A decode step runs about 10 launches per
+// transformer block, so 240 launches corresponds to gpt-oss-20b and 360 to gpt-oss-120b. The "encode" counter is the
+// CPU time to encode and commit the command buffer, and the iteration time is the wall-clock time until completion.
+// Arguments: number of launches, and whether each launch gets its own encoder.
+static void compute_encoder(benchmark::State& state) {
+    const size_t num_launches = state.range(0);
+    const bool encoder_per_launch = state.range(1) != 0;
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    Buffer output_buffer{device, num_launches * kNumElements * sizeof(float)};
+
+    double encode_seconds = 0.0;
+    uint64_t rng_offset = 0;
+    for (auto _ : state) {
+        const auto start_time = std::chrono::steady_clock::now();
+
+        CommandBuffer command_buffer{command_queue};
+        for (size_t i = 0; i < num_launches; i++) {
+            command_buffer.encode_launch_f32_fill_random(
+                f32_fill_random_fn,
+                /*threadgroup_size=*/0,
+                /*max_threadgroups=*/1,
+                output_buffer,
+                /*output_offset=*/i * kNumElements * sizeof(float),
+                kNumElements, kSeed, rng_offset, /*min=*/-1.0f, /*max=*/1.0f);
+            if (encoder_per_launch) {
+                command_buffer.end_compute_encoder();
+            }
+        }
+        rng_offset += kNumElements;
+        command_buffer.commit();
+        const auto commit_time = std::chrono::steady_clock::now();
+        command_buffer.wait_completion();
+
+        const auto end_time = std::chrono::steady_clock::now();
+        encode_seconds += std::chrono::duration<double>(commit_time - start_time).count();
+        state.SetIterationTime(std::chrono::duration<double>(end_time - start_time).count());
+    }
+
+    state.counters["encode"] = benchmark::Counter(encode_seconds, benchmark::Counter::kAvgIterations);
+    state.counters["launches"] =
+        benchmark::Counter(state.iterations() * num_launches, benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(compute_encoder)
+    ->ArgNames({"launches", "encoder_per_launch"})
+    ->ArgsProduct({{240, 360}, {0, 1}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,305 @@
+#include <gpt-oss.h>
+#include <internal/model.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <internal/rng.hpp>
+
+constexpr std::uint64_t kSeed = UINT64_C(7289384735992596581);
+constexpr std::uint32_t kNumDecodeTokens = 32;
+
+namespace {
+
+using ModelPtr = std::unique_ptr<std::remove_pointer_t<gptoss_model_t>, decltype(&gptoss_model_release)>;
+using ContextPtr = std::unique_ptr<std::remove_pointer_t<gptoss_context_t>, decltype(&gptoss_context_release)>;
+
+// Models are cached across benchmark runs, as loading dominates the run time of short benchmarks.
+gptoss_model_t load_model(benchmark::State& state, const char* env_var_name, std::size_t max_batch_tokens) {
+    static std::map<std::string, ModelPtr> models;
+
+    const char* model_path = getenv(env_var_name);
+    if (model_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set", env_var_name));
+        return nullptr;
+    }
+
+    const std::string key = std::format("{}:{}", model_path, max_batch_tokens);
+    auto it = models.find(key);
+    if (it == models.end()) {
+        gptoss_model_t model_ptr = nullptr;
+        const gptoss_status status = gptoss_model_create_from_file(model_path, &model_ptr, max_batch_tokens);
+        if (status != gptoss_status_success) {
+            state.SkipWithError(std::format("failed to load model from file {}", model_path));
+            return nullptr;
+        }
+        it = models.emplace(key, ModelPtr(model_ptr, gptoss_model_release)).first;
+    }
+    return it->second.get();
+}
+
+// Synthetic prompt of random text tokens: attention and MoE costs do not depend on the prompt contents, and this
+// scales to the full context length without a prompt file.
+std::vector<std::uint32_t> random_prompt(gptoss_model_t model, std::size_t num_tokens, std::uint64_t seed = kSeed) {
+    const std::uint32_t num_text_tokens = model->tokenizer->num_text_tokens;
+    std::vector<std::uint32_t> tokens(num_tokens);
+    for (std::size_t i = 0; i < num_tokens; i++) {
+        tokens[i] = gptoss::rng::squares32(i, seed) % num_text_tokens;
+    }
+    return tokens;
+}
+
+ContextPtr create_context(benchmark::State& state, gptoss_model_t model, std::size_t context_length) {
+    gptoss_context_t context_ptr = nullptr;
+    const gptoss_status status = gptoss_context_create(model, context_length, &context_ptr);
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to create Context object");
+    }
+    return ContextPtr(context_ptr, gptoss_context_release);
+}
+
+// Bytes of MoE expert weights in all blocks for the given number of distinct experts per block.
+double expert_weight_bytes(gptoss_model_t model, std::size_t num_experts) {
+    return static_cast<double>(model->num_blocks) * static_cast<double>(std::min<std::size_t>(num_experts, model->num_experts)) *
+        static_cast<double>(model->per_expert_block_weight_size);
+}
+
+// Bytes of KV cache read by one decoding step at the given position. Even blocks use sliding-window attention.
+double kvcache_read_bytes(gptoss_context_t context, std::size_t num_kv_tokens) {
+    const gptoss_model* model = context->model;
+    std::size_t element_size = sizeof(float);
+    switch (context->kvcache_type) {
+        case gptoss_kvcache_type_bf16:
+            element_size = 2;
+            break;
+        case gptoss_kvcache_type_i8:
+            element_size = 1;
+            break;
+        default:
+            break;
+    }
+    const double token_bytes = 2.0 * model->num_kv_heads * model->head_dim * element_size;
+    double num_block_tokens = 0.0;
+    for (std::uint32_t n = 0; n < model->num_blocks; n++) {
+        const bool sliding_window = n % 2 == 0;
+        num_block_tokens += static_cast<double>(sliding_window ? std::min<std::size_t>(num_kv_tokens, model->attention_window) : num_kv_tokens);
+    }
+    return num_block_tokens * token_bytes;
+}
+
+}  // namespace
+
+// Prefill throughput for a synthetic prompt of state.range(0) tokens.
+static void end2end_prompt_prefill(benchmark::State& state, const char* env_var_name) {
+    const std::size_t num_prompt_tokens = static_cast<std::size_t>(state.range(0));
+    gptoss_model_t model = load_model(state, env_var_name, /*max_batch_tokens=*/1024);
+    if (model == nullptr) {
+        return;
+    }
+    if (num_prompt_tokens > model->context_length) {
+        state.SkipWithError(std::format("prompt length {} exceeds the model context length {}", num_prompt_tokens, model->context_length));
+        return;
+    }
+
+    ContextPtr context = create_context(state, model, num_prompt_tokens);
+    if (context == nullptr) {
+        return;
+    }
+
+    const std::vector<std::uint32_t> prompt = random_prompt(model, num_prompt_tokens);
+    gptoss_status status = gptoss_context_append_tokens(context.get(), prompt.size(), prompt.data());
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to append tokens to the Context object");
+        return;
+    }
+
+    for (auto _ : state) {
+        status = gptoss_context_process(context.get());
+        if (status != gptoss_status_success) {
+            state.SkipWithError("failed to prefill Context object");
+            return;
+        }
+        context->num_kv_tokens = 0;
+    }
+
+    // Every batch streams the shared weights and, with a batch large enough to route to all of them, all experts.
+    const double num_batches = static_cast<double>((num_prompt_tokens + model->max_batch_tokens - 1) / model->max_batch_tokens);
+    const double weight_bytes = num_batches *
+        (static_cast<double>(model->shared_weight_buffer.size) + expert_weight_bytes(model, model->max_batch_tokens * model->num_active_experts));
+    state.counters["tokens"] = num_prompt_tokens;
+    state.counters["tokens/s"] = benchmark::Counter(
+        state.iterations() * num_prompt_tokens, benchmark::Counter::kIsRate);
+    state.counters["weights"] = benchmark::Counter(
+        state.iterations() * weight_bytes, benchmark::Counter::kIsRate, benchmark::Counter::kIs1024);
+    state.counters["kvcache_bytes"] = benchmark::Counter(
+        kvcache_read_bytes(context.get(), num_prompt_tokens), benchmark::Counter::kDefaults, benchmark::Counter::kIs1024);
+}
+
+// Decode latency after a synthetic prompt of state.range(0) tokens.
+static void end2end_deep_decode(benchmark::State& state, const char* env_var_name) {
+    const std::size_t num_prompt_tokens = static_cast<std::size_t>(state.range(0));
+    gptoss_model_t model = load_model(state, env_var_name, /*max_batch_tokens=*/0);
+    if (model == nullptr) {
+        return;
+    }
+    const std::size_t context_length = num_prompt_tokens + kNumDecodeTokens;
+    if (context_length > model->context_length) {
+        state.SkipWithError(std::format("context length {} exceeds the model context length {}", context_length, model->context_length));
+        return;
+    }
+
+    ContextPtr context = create_context(state, model, context_length);
+    if (context == nullptr) {
+        return;
+    }
+
+    const std::vector<std::uint32_t> prompt = random_prompt(model, num_prompt_tokens);
+    gptoss_status status = gptoss_context_append_tokens(context.get(), prompt.size(), prompt.data());
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to append tokens to the Context object");
+        return;
+    }
+    status = gptoss_context_process(context.get());
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to prefill Context object");
+        return;
+    }
+    const std::size_t num_kvcache_tokens = context->num_kv_tokens;
+
+    std::uint64_t rng_seed = 0;
+    std::vector<std::uint32_t> tokens(kNumDecodeTokens);
+    for (auto _ : state) {
+        context->num_kv_tokens = num_kvcache_tokens;
+        context->num_tokens = num_prompt_tokens;
+
+        std::size_t num_generated_tokens = 0;
+        do {
+            std::size_t num_current_generated_tokens = 0;
+            status = gptoss_context_sample(context.get(), /*temperature=*/1.0f, /*seed=*/rng_seed,
+                /*max_tokens=*/kNumDecodeTokens - num_generated_tokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr,
+                tokens.data(), &num_current_generated_tokens);
+            if (status != gptoss_status_success) {
+                state.SkipWithError("failed to sample from the Context object");
+                return;
+            }
+            num_generated_tokens += num_current_generated_tokens;
+        } while (num_generated_tokens < kNumDecodeTokens);
+        rng_seed++;
+    }
+
+    const double weight_bytes = static_cast<double>(model->shared_weight_buffer.size) + expert_weight_bytes(model, model->num_active_experts);
+    const double kvcache_bytes = kvcache_read_bytes(context.get(), num_prompt_tokens + kNumDecodeTokens / 2);
+    state.counters["tokens/s"] = benchmark::Counter(
+        state.iterations() * kNumDecodeTokens, benchmark::Counter::kIsRate);
+    state.counters["weights"] = benchmark::Counter(
+        state.iterations() * kNumDecodeTokens * weight_bytes, benchmark::Counter::kIsRate, benchmark::Counter::kIs1024);
+    state.counters["kvcache"] = benchmark::Counter(
+        state.iterations() * kNumDecodeTokens * kvcache_bytes, benchmark::Counter::kIsRate, benchmark::Counter::kIs1024);
+    state.counters["kvcache_bytes"] = benchmark::Counter(
+        kvcache_bytes, benchmark::Counter::kDefaults, benchmark::Counter::kIs1024);
+}
+
+// Batched decode of state.range(0) independent contexts, each after a short synthetic prompt.
+static void end2end_batch_decode(benchmark::State& state, const char* env_var_name) {
+    constexpr std::size_t kNumPromptTokens = 128;
+    const std::size_t num_contexts = static_cast<std::size_t>(state.range(0));
+    gptoss_model_t model = load_model(state, env_var_name, /*max_batch_tokens=*/0);
+    if (model == nullptr) {
+        return;
+    }
+
+    std::vector<ContextPtr> contexts;
+    std::vector<gptoss_context_t> context_ptrs;
+    for (std::size_t i = 0; i < num_contexts; i++) {
+        ContextPtr context = create_context(state, model, kNumPromptTokens + kNumDecodeTokens);
+        if (context == nullptr) {
+            return;
+        }
+
+        const std::vector<std::uint32_t> prompt = random_prompt(model, kNumPromptTokens, kSeed + i);
+        gptoss_status status = gptoss_context_append_tokens(context.get(), prompt.size(), prompt.data());
+        if (status != gptoss_status_success) {
+            state.SkipWithError("failed to append tokens to the Context object");
+            return;
+        }
+        status = gptoss_context_process(context.get());
+        if (status != gptoss_status_success) {
+            state.SkipWithError("failed to prefill Context object");
+            return;
+        }
+        context_ptrs.push_back(context.get());
+        contexts.push_back(std::move(context));
+    }
+    const std::size_t num_kvcache_tokens = contexts[0]->num_kv_tokens;
+
+    std::uint64_t rng_seed = 0;
+    std::vector<std::uint32_t> tokens(num_contexts);
+    for (auto _ : state) {
+        for (gptoss_context_t context : context_ptrs) {
+            context->num_kv_tokens = num_kvcache_tokens;
+            context->num_tokens = kNumPromptTokens;
+        }
+
+        for (std::uint32_t t = 0; t < kNumDecodeTokens; t++) {
+            const gptoss_status status = gptoss_context_batch_sample(
+                context_ptrs.data(), num_contexts, /*temperature=*/1.0f, /*seed=*/rng_seed++, tokens.data());
+            if (status != gptoss_status_success) {
+                state.SkipWithError("failed to sample from the Context objects");
+                return;
+            }
+        }
+    }
+
+    const double weight_bytes = static_cast<double>(model->shared_weight_buffer.size) +
+        expert_weight_bytes(model, num_contexts * model->num_active_experts);
+    state.counters["tokens/s"] = benchmark::Counter(
+        state.iterations() * kNumDecodeTokens * num_contexts, benchmark::Counter::kIsRate);
+    state.counters["steps/s"] = benchmark::Counter(
+        state.iterations() * kNumDecodeTokens, benchmark::Counter::kIsRate);
+    state.counters["weights"] = benchmark::Counter(
+        state.iterations() * kNumDecodeTokens * weight_bytes, benchmark::Counter::kIsRate, benchmark::Counter::kIs1024);
+    state.counters["kvcache_bytes"] = benchmark::Counter(
+        num_contexts * kvcache_read_bytes(context_ptrs[0], kNumPromptTokens + kNumDecodeTokens / 2),
+        benchmark::Counter::kDefaults, benchmark::Counter::kIs1024);
+}
+
+// Prefill throughput at growing prompt lengths
+BENCHMARK_CAPTURE(end2end_prompt_prefill, gpt_oss_20b, "GPT_OSS_20B_PATH")
+    ->Arg(1024)->Arg(8192)->Arg(32768)->Arg(131072)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_prompt_prefill, gpt_oss_120b, "GPT_OSS_120B_PATH")
+    ->Arg(1024)->Arg(8192)->Arg(32768)->Arg(131072)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Decode latency at deep KV cache positions
+BENCHMARK_CAPTURE(end2end_deep_decode, gpt_oss_20b, "GPT_OSS_20B_PATH")
+    ->Arg(1024)->Arg(8192)->Arg(32768)->Arg(131072 - kNumDecodeTokens)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_deep_decode, gpt_oss_120b, "GPT_OSS_120B_PATH")
+    ->Arg(1024)->Arg(8192)->Arg(32768)->Arg(131072 - kNumDecodeTokens)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Multi-context batched decode
+BENCHMARK_CAPTURE(end2end_batch_decode, gpt_oss_20b, "GPT_OSS_20B_PATH")
+    ->RangeMultiplier(2)->Range(1, 32)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_batch_decode, gpt_oss_120b, "GPT_OSS_120B_PATH")
+    ->RangeMultiplier(2)->Range(1, 32)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
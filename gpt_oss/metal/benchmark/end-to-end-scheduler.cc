@@ -0,0 +1,186 @@
+#include <gpt-oss.h>
+#include <internal/model.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <internal/rng.hpp>
+
+constexpr std::uint64_t kSeed = UINT64_C(2873930584757109623);
+constexpr std::size_t kNumPromptTokens = 256;
+constexpr std::size_t kNumDecodeTokens = 32;
+
+namespace {
+
+using ModelPtr = std::unique_ptr<std::remove_pointer_t<gptoss_model_t>, decltype(&gptoss_model_release)>;
+using ContextPtr = std::unique_ptr<std::remove_pointer_t<gptoss_context_t>, decltype(&gptoss_context_release)>;
+using SchedulerPtr = std::unique_ptr<std::remove_pointer_t<gptoss_scheduler_t>, decltype(&gptoss_scheduler_release)>;
+
+ModelPtr load_model(benchmark::State& state, const char* env_var_name) {
+    const char* model_path = getenv(env_var_name);
+    if (model_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set", env_var_name));
+        return ModelPtr(nullptr, gptoss_model_release);
+    }
+
+    gptoss_model_t model_ptr = nullptr;
+    const gptoss_status status = gptoss_model_create_from_file(model_path, &model_ptr, /*max_batch_tokens=*/0);
+    if (status != gptoss_status_success) {
+        state.SkipWithError(std::format("failed to load model from file {}", model_path));
+        return ModelPtr(nullptr, gptoss_model_release);
+    }
+    return ModelPtr(model_ptr, gptoss_model_release);
+}
+
+// Contexts with synthetic prompts of random text tokens, different for every request, appended but not processed.
+bool create_contexts(
+    benchmark::State& state,
+    gptoss_model_t model,
+    std::size_t num_requests,
+    std::vector<ContextPtr>& contexts)
+{
+    contexts.clear();
+    std::vector<std::uint32_t> tokens(kNumPromptTokens);
+    for (std::size_t r = 0; r < num_requests; r++) {
+        gptoss_context_t context_ptr = nullptr;
+        gptoss_status status = gptoss_context_create(model, kNumPromptTokens + kNumDecodeTokens, &context_ptr);
+        if (status != gptoss_status_success) {
+            state.SkipWithError("failed to create Context object");
+            return false;
+        }
+        contexts.emplace_back(context_ptr, gptoss_context_release);
+
+        for (std::size_t i = 0; i < kNumPromptTokens; i++) {
+            tokens[i] = gptoss::rng::squares32(i, kSeed + r) % model->tokenizer->num_text_tokens;
+        }
+        status = gptoss_context_append_tokens(context_ptr, tokens.size(), tokens.data());
+        if (status != gptoss_status_success) {
+            state.SkipWithError("failed to append tokens to the Context object");
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+// Baseline: every request is pre-filled and decoded on its own, one after another.
+static void end2end_sequential_requests(benchmark::State& state, const char* env_var_name) {
+    ModelPtr model = load_model(state, env_var_name);
+    if (model == nullptr) {
+        return;
+    }
+    const std::size_t num_requests = static_cast<std::size_t>(state.range(0));
+
+    std::vector<ContextPtr> contexts;
+    std::vector<std::uint32_t> tokens(kNumDecodeTokens);
+    std::uint64_t rng_seed = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        if (!create_contexts(state, model.get(), num_requests, contexts)) {
+            return;
+        }
+        state.ResumeTiming();
+
+        for (ContextPtr& context : contexts) {
+            std::size_t num_generated_tokens = 0;
+            const gptoss_status status = gptoss_context_sample(context.get(), /*temperature=*/1.0f, rng_seed++,
+                kNumDecodeTokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, tokens.data(), &num_generated_tokens);
+            if (status != gptoss_status_success) {
+                state.SkipWithError("failed to sample from the Context object");
+                return;
+            }
+        }
+    }
+
+    state.counters["requests/s"] = benchmark::Counter(state.iterations() * num_requests, benchmark::Counter::kIsRate);
+    state.counters["tokens/s"] = benchmark::Counter(
+        state.iterations() * num_requests * kNumDecodeTokens, benchmark::Counter::kIsRate);
+}
+
+// The same requests, pre-filled and decoded together by continuous batching.
+static void end2end_scheduler_requests(benchmark::State& state, const char* env_var_name) {
+    ModelPtr model = load_model(state, env_var_name);
+    if (model == nullptr) {
+        return;
+    }
+    const std::size_t num_requests = static_cast<std::size_t>(state.range(0));
+
+    gptoss_scheduler_t scheduler_ptr = nullptr;
+    if (gptoss_scheduler_create(model.get(), /*max_batch_tokens=*/0, &scheduler_ptr) != gptoss_status_success) {
+        state.SkipWithError("failed to create Scheduler object");
+        return;
+    }
+    SchedulerPtr scheduler(scheduler_ptr, gptoss_scheduler_release);
+
+    std::vector<ContextPtr> contexts;
+    std::vector<std::uint64_t> request_ids(num_requests);
+    std::vector<std::uint32_t> tokens(num_requests);
+    std::vector<std::uint8_t> finished(num_requests);
+    std::uint64_t rng_seed = 0;
+    std::size_t num_steps = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        if (!create_contexts(state, model.get(), num_requests, contexts)) {
+            return;
+        }
+        state.ResumeTiming();
+
+        for (ContextPtr& context : contexts) {
+            std::uint64_t request_id = 0;
+            const gptoss_status status = gptoss_scheduler_submit(scheduler.get(), context.get(), /*temperature=*/1.0f,
+                rng_seed++, kNumDecodeTokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, &request_id);
+            if (status != gptoss_status_success) {
+                state.SkipWithError("failed to submit a request to the Scheduler object");
+                return;
+            }
+        }
+        for (;;) {
+            std::size_t num_pending_requests = 0;
+            gptoss_scheduler_get_num_requests(scheduler.get(), &num_pending_requests);
+            if (num_pending_requests == 0) {
+                break;
+            }
+
+            std::size_t num_outputs = 0;
+            const gptoss_status status = gptoss_scheduler_step(scheduler.get(), num_requests, request_ids.data(),
+                tokens.data(), finished.data(), &num_outputs);
+            if (status != gptoss_status_success) {
+                state.SkipWithError("failed to run a Scheduler step");
+                return;
+            }
+            num_steps += 1;
+        }
+    }
+
+    state.counters["requests/s"] = benchmark::Counter(state.iterations() * num_requests, benchmark::Counter::kIsRate);
+    state.counters["tokens/s"] = benchmark::Counter(
+        state.iterations() * num_requests * kNumDecodeTokens, benchmark::Counter::kIsRate);
+    state.counters["steps"] = benchmark::Counter(num_steps, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK_CAPTURE(end2end_sequential_requests, gpt_oss_20b, "GPT_OSS_20B_PATH")
+    ->RangeMultiplier(4)->Range(1, 64)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_scheduler_requests, gpt_oss_20b, "GPT_OSS_20B_PATH")
+    ->RangeMultiplier(4)->Range(1, 64)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_sequential_requests, gpt_oss_120b, "GPT_OSS_120B_PATH")
+    ->RangeMultiplier(4)->Range(1, 64)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_scheduler_requests, gpt_oss_120b, "GPT_OSS_120B_PATH")
+    ->RangeMultiplier(4)->Range(1, 64)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,174 @@
+#include <gpt-oss.h>
+#include <internal/model.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <internal/rng.hpp>
+
+constexpr std::uint64_t kSeed = UINT64_C(2873930584757109623);
+constexpr std::size_t kNumPromptTokens = 1024;
+constexpr std::size_t kNumLongPromptTokens = 8192;
+constexpr std::uint32_t kNumDecodeTokens = 32;
+
+namespace {
+
+using ModelPtr = std::unique_ptr<std::remove_pointer_t<gptoss_model_t>, decltype(&gptoss_model_release)>;
+using ContextPtr = std::unique_ptr<std::remove_pointer_t<gptoss_context_t>, decltype(&gptoss_context_release)>;
+
+// All benchmark threads share one model, loaded by whichever thread gets there first.
+gptoss_model_t load_model(benchmark::State& state, const char* env_var_name) {
+    static std::mutex mutex;
+    static ModelPtr model{nullptr, gptoss_model_release};
+
+    const char* model_path = getenv(env_var_name);
+    if (model_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set", env_var_name));
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock{mutex};
+    if (model == nullptr) {
+        gptoss_model_t model_ptr = nullptr;
+        const gptoss_status status = gptoss_model_create_from_file(model_path, &model_ptr, /*max_batch_tokens=*/0);
+        if (status != gptoss_status_success) {
+            state.SkipWithError(std::format("failed to load model from file {}", model_path));
+            return nullptr;
+        }
+        model.reset(model_ptr);
+    }
+    return model.get();
+}
+
+// Context with a prefilled synthetic prompt of random text tokens, different for every thread.
+ContextPtr create_prefilled_context(benchmark::State& state, gptoss_model_t model, std::size_t num_prompt_tokens) {
+    gptoss_context_t context_ptr = nullptr;
+    gptoss_status status = gptoss_context_create(model, num_prompt_tokens + kNumDecodeTokens, &context_ptr);
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to create Context object");
+        return ContextPtr(nullptr, gptoss_context_release);
+    }
+    ContextPtr context(context_ptr, gptoss_context_release);
+
+    const std::uint64_t seed = kSeed + static_cast<std::uint64_t>(state.thread_index());
+    std::vector<std::uint32_t> tokens(num_prompt_tokens);
+    for (std::size_t i = 0; i < num_prompt_tokens; i++) {
+        tokens[i] = gptoss::rng::squares32(i, seed) % model->tokenizer->num_text_tokens;
+    }
+    status = gptoss_context_append_tokens(context.get(), tokens.size(), tokens.data());
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to append tokens to the Context object");
+        return ContextPtr(nullptr, gptoss_context_release);
+    }
+    status = gptoss_context_process(context.get());
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to prefill Context object");
+        return ContextPtr(nullptr, gptoss_context_release);
+    }
+    return context;
+}
+
+bool decode(benchmark::State& state, gptoss_context_t context, std::size_t num_prompt_tokens, std::uint64_t seed) {
+    context->num_tokens = num_prompt_tokens;
+    std::size_t num_generated_tokens = 0;
+    std::vector<std::uint32_t> tokens(kNumDecodeTokens);
+    do {
+        std::size_t num_current_generated_tokens = 0;
+        const gptoss_status status = gptoss_context_sample(context, /*temperature=*/1.0f, seed,
+            /*max_tokens=*/kNumDecodeTokens - num_generated_tokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr,
+            tokens.data(), &num_current_generated_tokens);
+        if (status != gptoss_status_success) {
+            state.SkipWithError("failed to sample from the Context object");
+            return false;
+        }
+        num_generated_tokens += num_current_generated_tokens;
+    } while (num_generated_tokens < kNumDecodeTokens);
+    return true;
+}
+
+}  // namespace
+
+// Every thread decodes from its own context of one shared model.
+static void end2end_concurrent_decode(benchmark::State& state, const char* env_var_name) {
+    gptoss_model_t model = load_model(state, env_var_name);
+    if (model == nullptr) {
+        return;
+    }
+    ContextPtr context = create_prefilled_context(state, model, kNumPromptTokens);
+    if (context == nullptr) {
+        return;
+    }
+
+    std::uint64_t rng_seed = 0;
+    for (auto _ : state) {
+        context->num_kv_tokens = kNumPromptTokens;
+        if (!decode(state, context.get(), kNumPromptTokens, rng_seed++)) {
+            return;
+        }
+    }
+
+    // Counters are summed over threads: tokens/s is the aggregate throughput.
+    state.counters["tokens/s"] = benchmark::Counter(
+        state.iterations() * kNumDecodeTokens, benchmark::Counter::kIsRate);
+}
+
+// Thread 0 repeatedly prefills a long prompt while the other threads decode, to check that decoding isn't starved.
+static void end2end_prefill_decode_mix(benchmark::State& state, const char* env_var_name) {
+    gptoss_model_t model = load_model(state, env_var_name);
+    if (model == nullptr) {
+        return;
+    }
+    const bool prefill_thread = state.thread_index() == 0;
+    const std::size_t num_prompt_tokens = prefill_thread ? kNumLongPromptTokens : kNumPromptTokens;
+    ContextPtr context = create_prefilled_context(state, model, num_prompt_tokens);
+    if (context == nullptr) {
+        return;
+    }
+
+    std::uint64_t rng_seed = 0;
+    for (auto _ : state) {
+        if (prefill_thread) {
+            context->num_tokens = num_prompt_tokens;
+            context->num_kv_tokens = 0;
+            if (gptoss_context_process(context.get()) != gptoss_status_success) {
+                state.SkipWithError("failed to prefill Context object");
+                return;
+            }
+        } else {
+            context->num_kv_tokens = num_prompt_tokens;
+            if (!decode(state, context.get(), num_prompt_tokens, rng_seed++)) {
+                return;
+            }
+        }
+    }
+
+    state.counters[prefill_thread ? "prefill_tokens/s" : "decode_tokens/s"] = benchmark::Counter(
+        state.iterations() * (prefill_thread ? num_prompt_tokens : kNumDecodeTokens), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK_CAPTURE(end2end_concurrent_decode, gpt_oss_20b, "GPT_OSS_20B_PATH")
+    ->ThreadRange(1, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_concurrent_decode, gpt_oss_120b, "GPT_OSS_120B_PATH")
+    ->ThreadRange(1, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_prefill_decode_mix, gpt_oss_20b, "GPT_OSS_20B_PATH")
+    ->ThreadRange(2, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_prefill_decode_mix, gpt_oss_120b, "GPT_OSS_120B_PATH")
+    ->ThreadRange(2, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
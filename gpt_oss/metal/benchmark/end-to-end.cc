@@ -1,7 +1,9 @@
 #include <gpt-oss.h>
 #include <internal/model.h>
 
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <format>
@@ -10,6 +12,7 @@
 #include <memory>
 #include <string>
 #include <type_traits>
+#include <vector>
 
 #include <benchmark/benchmark.h>
 
@@ -65,7 +68,7 @@ static void end2end_decode(benchmark::State& state, const char* env_var_name) {
         do {
             std::size_t num_current_generated_tokens = 0;
             status = gptoss_context_sample(context.get(), /*temperature=*/1.0f, /*rng_state=*/current_rng_seed,
-                                           /*max_tokens=*/kNumGeneratedTokens - num_generated_tokens, tokens.data(), &num_current_generated_tokens);
+                                           /*max_tokens=*/kNumGeneratedTokens - num_generated_tokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, tokens.data(), &num_current_generated_tokens);
             if (status != gptoss_status_success) {
                 state.SkipWithError("failed to sample from the Context object");
                 return;
@@ -84,7 +87,7 @@ static void end2end_decode(benchmark::State& state, const char* env_var_name) {
         do {
             std::size_t num_current_generated_tokens = 0;
             status = gptoss_context_sample(context.get(), /*temperature=*/1.0f, /*rng_state=*/current_rng_seed,
-                                           /*max_tokens=*/kNumGeneratedTokens - num_generated_tokens, tokens.data(), &num_current_generated_tokens);
+                                           /*max_tokens=*/kNumGeneratedTokens - num_generated_tokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, tokens.data(), &num_current_generated_tokens);
             if (status != gptoss_status_success) {
                 state.SkipWithError("failed to sample from the Context object");
                 return;
@@ -99,39 +102,21 @@ static void end2end_decode(benchmark::State& state, const char* env_var_name) {
         benchmark::Counter(state.iterations() * kNumGeneratedTokens, benchmark::Counter::kIsRate);
 }
 
-static void end2end_prefill(benchmark::State& state,
-                            const char* model_path_env_var_name,
-                            const char* prompt_env_var_name,
-                            size_t context_length = 0) {
-    const char* model_path = getenv(model_path_env_var_name);
-    if (model_path == NULL) {
-        state.SkipWithError(std::format("environment variable {} is not set",
-                                        model_path_env_var_name));
-        return;
-    }
-
-    const char* prompt_file_path = getenv(prompt_env_var_name);
-    if (prompt_file_path == NULL) {
-        state.SkipWithError(std::format("environment variable {} is not set",
-                                        prompt_env_var_name));
-        return;
-    }
-
-    // Read prompt contents from file into a std::string
+// Reads prompt contents from file into a std::string
+static bool read_prompt_file(benchmark::State& state, const char* prompt_file_path, std::string& prompt_str) {
     std::ifstream prompt_file(prompt_file_path,
                               std::ios::in | std::ios::binary);
     if (!prompt_file) {
         state.SkipWithError(
             std::format("failed to open prompt file {}", prompt_file_path));
-        return;
+        return false;
     }
-    std::string prompt_str;
     prompt_file.seekg(0, std::ios::end);
     std::streampos file_size = prompt_file.tellg();
     if (file_size < 0) {
         state.SkipWithError(std::format("failed to read prompt file size {}",
                                         prompt_file_path));
-        return;
+        return false;
     }
     prompt_str.resize(static_cast<std::size_t>(file_size));
     prompt_file.seekg(0, std::ios::beg);
@@ -141,6 +126,31 @@ static void end2end_prefill(benchmark::State& state,
     if (!prompt_file) {
         state.SkipWithError(
             std::format("failed to read prompt file {}", prompt_file_path));
+        return false;
+    }
+    return true;
+}
+
+static void end2end_prefill(benchmark::State& state,
+                            const char* model_path_env_var_name,
+                            const char* prompt_env_var_name,
+                            size_t context_length = 0) {
+    const char* model_path = getenv(model_path_env_var_name);
+    if (model_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set",
+                                        model_path_env_var_name));
+        return;
+    }
+
+    const char* prompt_file_path = getenv(prompt_env_var_name);
+    if (prompt_file_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set",
+                                        prompt_env_var_name));
+        return;
+    }
+
+    std::string prompt_str;
+    if (!read_prompt_file(state, prompt_file_path, prompt_str)) {
         return;
     }
 
@@ -209,6 +219,117 @@ static void end2end_prefill(benchmark::State& state,
     state.counters["tokens"] = num_tokens;
     state.counters["tokens/s"] = benchmark::Counter(
         state.iterations() * num_tokens, benchmark::Counter::kIsRate);
+    // Fraction of the prefill wall time (on the GPU clock) during which the GPU was executing command buffers
+    const double gpu_span = context->gpu_end_time - context->gpu_start_time;
+    if (gpu_span > 0.0) {
+        state.counters["gpu_busy"] = context->gpu_busy_time / gpu_span;
+    }
+}
+
+// Teacher-forced perplexity of the model over the first num_tokens tokens of the prompt file.
+// Used to evaluate the accuracy impact of reduced-precision KV cache formats.
+static void end2end_perplexity(benchmark::State& state,
+                               const char* model_path_env_var_name,
+                               const char* prompt_env_var_name,
+                               gptoss_kvcache_type kvcache_type,
+                               size_t num_tokens = 512) {
+    const char* model_path = getenv(model_path_env_var_name);
+    if (model_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set",
+                                        model_path_env_var_name));
+        return;
+    }
+
+    const char* prompt_file_path = getenv(prompt_env_var_name);
+    if (prompt_file_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set",
+                                        prompt_env_var_name));
+        return;
+    }
+
+    std::string prompt_str;
+    if (!read_prompt_file(state, prompt_file_path, prompt_str)) {
+        return;
+    }
+
+    gptoss_model_t model_ptr = nullptr;
+    gptoss_status status = gptoss_model_create_from_file(model_path, &model_ptr, 0);
+    if (status != gptoss_status_success) {
+        state.SkipWithError(std::format("failed to load model from file {}", model_path));
+        return;
+    }
+    std::unique_ptr<std::remove_pointer_t<gptoss_model_t>, decltype(&gptoss_model_release)> model(model_ptr, gptoss_model_release);
+
+    gptoss_context_t context_ptr = nullptr;
+    status = gptoss_context_create_with_kvcache_type(model.get(), /*context_length=*/0, kvcache_type, &context_ptr);
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to create Context object");
+        return;
+    }
+    std::unique_ptr<std::remove_pointer_t<gptoss_context_t>, decltype(&gptoss_context_release)> context(context_ptr, gptoss_context_release);
+
+    status = gptoss_context_append_chars(context.get(), prompt_str.data(), prompt_str.size(), nullptr);
+    if (status != gptoss_status_success) {
+        state.SkipWithError(std::format("failed to tokenize prompt from file {}", prompt_file_path));
+        return;
+    }
+
+    std::vector<std::uint32_t> tokens(context->num_tokens);
+    std::size_t num_prompt_tokens = 0;
+    status = gptoss_context_get_tokens(context.get(), tokens.data(), tokens.size(), &num_prompt_tokens);
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to get tokens from the Context object");
+        return;
+    }
+    num_tokens = std::min(num_tokens, num_prompt_tokens);
+    if (num_tokens < 2) {
+        state.SkipWithError(std::format("prompt file {} is too short", prompt_file_path));
+        return;
+    }
+
+    const std::uint32_t vocabulary_size = model->vocabulary_size;
+    double perplexity = 0.0;
+    for (auto _ : state) {
+        gptoss_context_reset(context.get());
+        context->num_kv_tokens = 0;
+        status = gptoss_context_append_tokens(context.get(), 1, tokens.data());
+        if (status != gptoss_status_success) {
+            state.SkipWithError("failed to append token to the Context object");
+            return;
+        }
+
+        double nll = 0.0;
+        for (std::size_t t = 1; t < num_tokens; t++) {
+            std::uint32_t predicted_token = 0;
+            std::size_t num_predicted_tokens = 0;
+            status = gptoss_context_sample(context.get(), /*temperature=*/0.0f, /*seed=*/0,
+                                           /*max_tokens=*/1, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, &predicted_token, &num_predicted_tokens);
+            if (status != gptoss_status_success) {
+                state.SkipWithError("failed to sample from the Context object");
+                return;
+            }
+
+            const float* scores = static_cast<const float*>(context->score_buffer.ptr);
+            const float max_score = *std::max_element(scores, scores + vocabulary_size);
+            double sum_exp = 0.0;
+            for (std::uint32_t i = 0; i < vocabulary_size; i++) {
+                sum_exp += std::exp(static_cast<double>(scores[i] - max_score));
+            }
+            nll -= static_cast<double>(scores[tokens[t]] - max_score) - std::log(sum_exp);
+
+            // Replace the predicted token with the reference one.
+            context->num_tokens -= num_predicted_tokens;
+            status = gptoss_context_append_tokens(context.get(), 1, &tokens[t]);
+            if (status != gptoss_status_success) {
+                state.SkipWithError("failed to append token to the Context object");
+                return;
+            }
+        }
+        perplexity = std::exp(nll / static_cast<double>(num_tokens - 1));
+    }
+
+    state.counters["tokens"] = num_tokens;
+    state.counters["perplexity"] = perplexity;
 }
 
 // Decode end-to-end benchmark
@@ -238,4 +359,21 @@ BENCHMARK_CAPTURE(end2end_prefill, gpt_oss_20b_prefill_3072, "GPT_OSS_20B_PATH",
     ->UseRealTime()
     ->Unit(benchmark::kMillisecond);
 
+// Perplexity with different KV cache formats
+BENCHMARK_CAPTURE(end2end_perplexity, gpt_oss_20b_perplexity_f32kv, "GPT_OSS_20B_PATH",
+                  "GPT_OSS_PROMPT_FILE_PATH", gptoss_kvcache_type_f32)
+    ->Iterations(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_perplexity, gpt_oss_20b_perplexity_bf16kv, "GPT_OSS_20B_PATH",
+                  "GPT_OSS_PROMPT_FILE_PATH", gptoss_kvcache_type_bf16)
+    ->Iterations(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(end2end_perplexity, gpt_oss_20b_perplexity_i8kv, "GPT_OSS_20B_PATH",
+                  "GPT_OSS_PROMPT_FILE_PATH", gptoss_kvcache_type_i8)
+    ->Iterations(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
 BENCHMARK_MAIN();
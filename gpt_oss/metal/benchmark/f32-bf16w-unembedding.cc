@@ -0,0 +1,100 @@
+#include <gpt-oss.h>
+#include <internal/datatype.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "memory-bandwidth.hpp"
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+constexpr uint32_t kEmbeddingDim = 2880;  // gpt-oss-20b and gpt-oss-120b
+constexpr uint32_t kVocabularySize = 201088;
+constexpr size_t kMaxThreadgroups = 1024;
+
+// The model passes the dense kernel too, which the launcher picks from GPTOSS_DENSE_MATMUL_MIN_TOKENS tokens on.
+// Arguments: number of tokens.
+static void f32_bf16w_unembedding(benchmark::State& state) {
+    const uint32_t num_tokens = state.range(0);
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    Function bf16_fill_random_fn{library, "gptoss_bf16_fill_random"};
+    Function f32_bf16w_unembedding_fn{library, "gptoss_f32_bf16w_unembedding"};
+    Function f32_bf16w_dense_unembedding_fn{library, "gptoss_f32_bf16w_dense_unembedding"};
+    Buffer input_buffer{device, num_tokens * kEmbeddingDim * sizeof(float)};
+    Buffer weight_buffer{device, (size_t) kVocabularySize * kEmbeddingDim * sizeof(gptoss_bfloat16)};
+    Buffer output_buffer{device, (size_t) num_tokens * kVocabularySize * sizeof(float)};
+    Buffer argmax_buffer{device, num_tokens * sizeof(uint64_t)};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+    {
+        CommandBuffer command_buffer{command_queue};
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_tokens * kEmbeddingDim, kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/weight_buffer,
+            /*output_offset=*/0,
+            (size_t) kVocabularySize * kEmbeddingDim, kSeed + 1, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+
+    for (auto _ : state) {
+        // The argmax is reduced with atomic min, so it has to be reset before every launch
+        std::memset(argmax_buffer.ptr(), 0xFF, argmax_buffer.size());
+
+        CommandBuffer command_buffer{command_queue};
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
+                command_buffer.handle(),
+                f32_bf16w_unembedding_fn.handle(),
+                f32_bf16w_dense_unembedding_fn.handle(),
+                /*threadgroup_size=*/256,
+                kMaxThreadgroups,
+                input_buffer.handle(), /*input_offset=*/0,
+                weight_buffer.handle(), /*weight_offset=*/0,
+                output_buffer.handle(), /*output_offset=*/0,
+                argmax_buffer.handle(), /*argmax_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                /*mask_buffer=*/nullptr, /*mask_offset=*/0,
+                num_tokens,
+                kEmbeddingDim,
+                kVocabularySize),
+            "gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding");
+
+        command_buffer.commit();
+        const double elapsed_seconds = command_buffer.wait_completion();
+        state.SetIterationTime(elapsed_seconds);
+    }
+
+    const int64_t bytes_per_iteration = input_buffer.size() + weight_buffer.size() + output_buffer.size();
+    gptoss::SetBandwidthCounters(state, bytes_per_iteration);
+}
+
+BENCHMARK(f32_bf16w_unembedding)
+    ->ArgName("tokens")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(16)->Arg(64)
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
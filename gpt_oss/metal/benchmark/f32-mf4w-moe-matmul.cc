@@ -0,0 +1,344 @@
+#include <gpt-oss.h>
+#include <internal/datatype.h>
+#include <internal/kernel-args.h>
+#include <internal/math.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "memory-bandwidth.hpp"
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+constexpr uint32_t kEmbeddingDim = 2880;  // gpt-oss-20b and gpt-oss-120b
+constexpr uint32_t kMLPDim = 2880;
+constexpr uint32_t kNumActiveExperts = 4;
+constexpr float kSwiGLULimit = 7.0f;
+
+namespace {
+
+// Per-expert MXFP4 weight blocks, block scales, and bf16 biases of a num_rows x num_cols matrix, laid out like an MoE
+// block of the model file in the row-major or the tiled layout. Weights are random, so the tiled copy doesn't have to
+// match the row-major one.
+struct ExpertWeights {
+    ExpertWeights(const Device& device, const CommandQueue& command_queue, const Library& library,
+        uint32_t num_experts, uint32_t num_rows, uint32_t num_cols, bool tiled) :
+        scale_offset(tiled ? GPTOSS_MF4_TILE_ROWS * 16 : num_rows * (num_cols / 32) * 16),
+        bias_offset(tiled ? math_round_up_po2(num_rows * (num_cols / 32) * 17, 16) : num_rows * (num_cols / 32) * 17),
+        matrix_size(bias_offset + num_rows * sizeof(gptoss_bfloat16)),
+        expert_stride(math_round_up_po2(matrix_size, 16)),
+        buffer(device, (size_t) num_experts * expert_stride)
+    {
+        const Function u32_fill_random_fn{library, "gptoss_u32_fill_random"};
+        CommandBuffer command_buffer{command_queue};
+        command_buffer.encode_launch_u32_fill_random(
+            u32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/buffer,
+            /*output_offset=*/0,
+            buffer.size() / sizeof(uint32_t), kSeed, /*offset=*/0);
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        // Keep the weights within a few powers of 2 of 1.0 (block scales are biased by 14 in the model file), and
+        // zero the biases.
+        char* ptr = static_cast<char*>(buffer.ptr());
+        for (uint32_t e = 0; e < num_experts; e++) {
+            char* expert_ptr = ptr + (size_t) e * expert_stride;
+            for (size_t i = tiled ? 0 : scale_offset; i < bias_offset; i++) {
+                // In the tiled layout, the last GPTOSS_MF4_TILE_ROWS bytes of every tile are scales
+                if (!tiled || i % GPTOSS_MF4_TILE_SIZE >= GPTOSS_MF4_TILE_ROWS * 16) {
+                    expert_ptr[i] = static_cast<char>(127 + 14 - (expert_ptr[i] & 3));
+                }
+            }
+            std::memset(expert_ptr + bias_offset, 0, expert_stride - bias_offset);
+        }
+    }
+
+    uint32_t scale_offset;
+    uint32_t bias_offset;
+    uint32_t matrix_size;
+    uint32_t expert_stride;
+    Buffer buffer;
+};
+
+// Each token picks distinct random experts with random scores. Returns the number of distinct experts picked.
+size_t fill_experts(const Buffer& expert_buffer, uint32_t num_tokens, uint32_t num_experts) {
+    std::mt19937 rng(kSeed + 1);
+    std::uniform_real_distribution<float> score_distribution(0.0f, 1.0f);
+    std::vector<uint32_t> experts(num_experts);
+    std::vector<bool> used(num_experts);
+    gptoss_expert_prediction* expert_ptr = static_cast<gptoss_expert_prediction*>(expert_buffer.ptr());
+    for (uint32_t t = 0; t < num_tokens; t++) {
+        std::iota(experts.begin(), experts.end(), 0);
+        std::shuffle(experts.begin(), experts.end(), rng);
+        for (uint32_t k = 0; k < kNumActiveExperts; k++) {
+            expert_ptr[t * kNumActiveExperts + k] = gptoss_expert_prediction{
+                .expert_id = experts[k],
+                .score = score_distribution(rng),
+            };
+            used[experts[k]] = true;
+        }
+    }
+    return std::count(used.begin(), used.end(), true);
+}
+
+}  // namespace
+
+// MoE gate/up projection with SwiGLU: num_tokens x kEmbeddingDim inputs, kNumActiveExperts x num_tokens x kMLPDim
+// outputs. The grouped variant includes the expert routing kernel it depends on.
+// Arguments: number of tokens and number of experts.
+static void f32_mf4w_moe_matmul_swiglu(benchmark::State& state, bool grouped, bool tiled) {
+    const uint32_t num_tokens = state.range(0);
+    const uint32_t num_experts = state.range(1);
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    const gptoss_metal_function_constant layout_constant{GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT,
+        static_cast<uint32_t>(tiled ? GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED : GPTOSS_EXPERT_WEIGHT_LAYOUT_ROW_MAJOR)};
+    Function f32_mf4w_moe_matmul_swiglu_fn{library, "gptoss_f32_mf4w_moe_matmul_swiglu", {layout_constant}};
+    Function f32_mf4w_moe_dense_matmul_swiglu_fn{library, "gptoss_f32_mf4w_moe_dense_matmul_swiglu", {layout_constant}};
+    Function expert_route_fn{library, "gptoss_expert_route"};
+    const ExpertWeights weights{device, command_queue, library, num_experts, 2 * kMLPDim, kEmbeddingDim, tiled};
+    Buffer input_buffer{device, num_tokens * kEmbeddingDim * sizeof(float)};
+    Buffer output_buffer{device, kNumActiveExperts * num_tokens * kMLPDim * sizeof(float)};
+    Buffer expert_buffer{device, num_tokens * kNumActiveExperts * sizeof(gptoss_expert_prediction)};
+    const size_t assignment_offset = (num_experts + 1) * sizeof(uint32_t);
+    Buffer route_buffer{device, assignment_offset + num_tokens * kNumActiveExperts * sizeof(uint32_t)};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+    const size_t num_used_experts = fill_experts(expert_buffer, num_tokens, num_experts);
+
+    {
+        CommandBuffer command_buffer{command_queue};
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_tokens * kEmbeddingDim, kSeed + 2, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+
+    for (auto _ : state) {
+        CommandBuffer command_buffer{command_queue};
+
+        if (grouped) {
+            Check(gptoss_metal_command_buffer_encode_launch_expert_route(
+                    command_buffer.handle(),
+                    expert_route_fn.handle(),
+                    expert_buffer.handle(), /*expert_offset=*/0,
+                    route_buffer.handle(), /*expert_offsets_offset=*/0,
+                    route_buffer.handle(), assignment_offset,
+                    control_buffer.handle(), /*control_offset=*/0,
+                    num_tokens,
+                    num_experts,
+                    kNumActiveExperts),
+                "gptoss_metal_command_buffer_encode_launch_expert_route");
+
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul_swiglu(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_dense_matmul_swiglu_fn.handle(),
+                    input_buffer.handle(), /*input_offset=*/0,
+                    route_buffer.handle(), /*expert_offsets_offset=*/0,
+                    route_buffer.handle(), assignment_offset,
+                    weights.buffer.handle(), /*weight_block_offset=*/0,
+                    weights.buffer.handle(), weights.scale_offset,
+                    weights.buffer.handle(), weights.bias_offset,
+                    output_buffer.handle(), /*output_offset=*/0,
+                    control_buffer.handle(), /*control_offset=*/0,
+                    kSwiGLULimit,
+                    weights.expert_stride,
+                    num_tokens,
+                    num_experts,
+                    kNumActiveExperts,
+                    kEmbeddingDim,
+                    kMLPDim),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul_swiglu");
+        } else {
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_matmul_swiglu_fn.handle(),
+                    /*threadgroup_size=*/512,
+                    input_buffer.handle(), /*input_offset=*/0,
+                    expert_buffer.handle(), /*expert_offset=*/0,
+                    weights.buffer.handle(), /*weight_block_offset=*/0,
+                    weights.buffer.handle(), weights.scale_offset,
+                    weights.buffer.handle(), weights.bias_offset,
+                    output_buffer.handle(), /*output_offset=*/0,
+                    control_buffer.handle(), /*control_offset=*/0,
+                    kSwiGLULimit,
+                    weights.expert_stride,
+                    num_tokens,
+                    kNumActiveExperts,
+                    kEmbeddingDim,
+                    kMLPDim),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu");
+        }
+
+        command_buffer.commit();
+        const double elapsed_seconds = command_buffer.wait_completion();
+        state.SetIterationTime(elapsed_seconds);
+    }
+
+    // Weights of every expert picked by any token are read at least once.
+    const int64_t bytes_per_iteration = num_used_experts * weights.matrix_size + input_buffer.size() + output_buffer.size();
+    gptoss::SetBandwidthCounters(state, bytes_per_iteration);
+}
+
+// MoE output projection: kNumActiveExperts x num_tokens x kMLPDim inputs, kNumActiveExperts x num_tokens x
+// kEmbeddingDim outputs. The grouped variant includes the expert routing kernel it depends on.
+// Arguments: number of tokens and number of experts.
+static void f32_mf4w_moe_matmul(benchmark::State& state, bool grouped, bool tiled) {
+    const uint32_t num_tokens = state.range(0);
+    const uint32_t num_experts = state.range(1);
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    const gptoss_metal_function_constant layout_constant{GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT,
+        static_cast<uint32_t>(tiled ? GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED : GPTOSS_EXPERT_WEIGHT_LAYOUT_ROW_MAJOR)};
+    Function f32_mf4w_moe_matmul_fn{library, "gptoss_f32_mf4w_moe_matmul", {layout_constant}};
+    Function f32_mf4w_moe_dense_matmul_fn{library, "gptoss_f32_mf4w_moe_dense_matmul", {layout_constant}};
+    Function expert_route_fn{library, "gptoss_expert_route"};
+    const ExpertWeights weights{device, command_queue, library, num_experts, kEmbeddingDim, kMLPDim, tiled};
+    Buffer input_buffer{device, kNumActiveExperts * num_tokens * kMLPDim * sizeof(float)};
+    Buffer output_buffer{device, kNumActiveExperts * num_tokens * kEmbeddingDim * sizeof(float)};
+    Buffer expert_buffer{device, num_tokens * kNumActiveExperts * sizeof(gptoss_expert_prediction)};
+    const size_t assignment_offset = (num_experts + 1) * sizeof(uint32_t);
+    Buffer route_buffer{device, assignment_offset + num_tokens * kNumActiveExperts * sizeof(uint32_t)};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+    const size_t num_used_experts = fill_experts(expert_buffer, num_tokens, num_experts);
+
+    {
+        CommandBuffer command_buffer{command_queue};
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            kNumActiveExperts * num_tokens * kMLPDim, kSeed + 2, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+
+    for (auto _ : state) {
+        CommandBuffer command_buffer{command_queue};
+
+        if (grouped) {
+            Check(gptoss_metal_command_buffer_encode_launch_expert_route(
+                    command_buffer.handle(),
+                    expert_route_fn.handle(),
+                    expert_buffer.handle(), /*expert_offset=*/0,
+                    route_buffer.handle(), /*expert_offsets_offset=*/0,
+                    route_buffer.handle(), assignment_offset,
+                    control_buffer.handle(), /*control_offset=*/0,
+                    num_tokens,
+                    num_experts,
+                    kNumActiveExperts),
+                "gptoss_metal_command_buffer_encode_launch_expert_route");
+
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_dense_matmul_fn.handle(),
+                    input_buffer.handle(), /*input_offset=*/0,
+                    route_buffer.handle(), /*expert_offsets_offset=*/0,
+                    route_buffer.handle(), assignment_offset,
+                    weights.buffer.handle(), /*weight_block_offset=*/0,
+                    weights.buffer.handle(), weights.scale_offset,
+                    weights.buffer.handle(), weights.bias_offset,
+                    output_buffer.handle(), /*output_offset=*/0,
+                    control_buffer.handle(), /*control_offset=*/0,
+                    weights.expert_stride,
+                    num_tokens,
+                    num_experts,
+                    kNumActiveExperts,
+                    kMLPDim,
+                    kEmbeddingDim),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul");
+        } else {
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_matmul_fn.handle(),
+                    /*threadgroup_size=*/512,
+                    input_buffer.handle(), /*input_offset=*/0,
+                    expert_buffer.handle(), /*expert_offset=*/0,
+                    weights.buffer.handle(), /*weight_block_offset=*/0,
+                    weights.buffer.handle(), weights.scale_offset,
+                    weights.buffer.handle(), weights.bias_offset,
+                    output_buffer.handle(), /*output_offset=*/0,
+                    control_buffer.handle(), /*control_offset=*/0,
+                    weights.expert_stride,
+                    num_tokens,
+                    kNumActiveExperts,
+                    kMLPDim,
+                    kEmbeddingDim),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul");
+        }
+
+        command_buffer.commit();
+        const double elapsed_seconds = command_buffer.wait_completion();
+        state.SetIterationTime(elapsed_seconds);
+    }
+
+    // Weights of every expert picked by any token are read at least once.
+    const int64_t bytes_per_iteration = num_used_experts * weights.matrix_size + input_buffer.size() + output_buffer.size();
+    gptoss::SetBandwidthCounters(state, bytes_per_iteration);
+}
+
+// The model switches from the per-token to the grouped kernels at GPTOSS_MOE_GROUPED_MIN_TOKENS tokens; both are
+// measured across the crossover, on weights in the row-major and the tiled layout. Decoding runs the per-token kernels
+// on one token, so the per_token_tiled/tokens:1 cases must not regress against per_token/tokens:1 for the tiled layout
+// to pay off. 32 experts for gpt-oss-20b, 128 for gpt-oss-120b.
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul_swiglu, per_token, /*grouped=*/false, /*tiled=*/false)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{1, 2, 4, 8, 16, 32, 64, 128}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul_swiglu, per_token_tiled, /*grouped=*/false, /*tiled=*/true)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{1, 2, 4, 8, 16, 32, 64, 128}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul_swiglu, grouped, /*grouped=*/true, /*tiled=*/false)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{8, 16, 32, 64, 128, 512, 2048}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul_swiglu, grouped_tiled, /*grouped=*/true, /*tiled=*/true)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{8, 16, 32, 64, 128, 512, 2048}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul, per_token, /*grouped=*/false, /*tiled=*/false)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{1, 2, 4, 8, 16, 32, 64, 128}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul, per_token_tiled, /*grouped=*/false, /*tiled=*/true)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{1, 2, 4, 8, 16, 32, 64, 128}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul, grouped, /*grouped=*/true, /*tiled=*/false)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{8, 16, 32, 64, 128, 512, 2048}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(f32_mf4w_moe_matmul, grouped_tiled, /*grouped=*/true, /*tiled=*/true)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{8, 16, 32, 64, 128, 512, 2048}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
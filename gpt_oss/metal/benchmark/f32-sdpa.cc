@@ -0,0 +1,136 @@
+#include <gpt-oss.h>
+#include <internal/datatype.h>
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "memory-bandwidth.hpp"
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+constexpr uint32_t kNumKVHeads = 8;  // gpt-oss-20b and gpt-oss-120b
+constexpr uint32_t kNumQHeads = 8 * kNumKVHeads;
+constexpr uint32_t kHeadDim = 64;
+constexpr size_t kMaxThreadgroups = 1024;
+
+// Arguments: number of Q tokens, number of KV tokens before them, and attention window (0 for full attention).
+static void f32_sdpa(benchmark::State& state) {
+    const uint32_t num_q_tokens = state.range(0);
+    const uint32_t num_kv_tokens = state.range(1);
+    const uint32_t window = state.range(2) != 0 ? state.range(2) : UINT32_MAX;
+    const uint32_t kv_capacity = std::min<uint64_t>(
+        (uint64_t) num_q_tokens + num_kv_tokens, (uint64_t) window + num_q_tokens - 1);
+    const uint32_t qkv_dim = kHeadDim * (kNumQHeads + 2 * kNumKVHeads);
+    const size_t token_stride = 2 * kNumKVHeads * kHeadDim * sizeof(float);
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    Function bf16_fill_random_fn{library, "gptoss_bf16_fill_random"};
+    Function f32_sdpa_fn{library, "gptoss_f32_sdpa_q8_d64", {{GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS, kNumKVHeads}}};
+    Function f32_sdpa_reduce_fn{library, "gptoss_f32_sdpa_reduce_q8_d64", {{GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS, kNumKVHeads}}};
+    Buffer q_buffer{device, num_q_tokens * qkv_dim * sizeof(float)};
+    Buffer kvcache_buffer{device, kv_capacity * token_stride};
+    Buffer sink_buffer{device, kNumQHeads * sizeof(gptoss_bfloat16)};
+    Buffer output_buffer{device, num_q_tokens * kNumQHeads * kHeadDim * sizeof(float)};
+    Buffer partial_buffer{device, GPTOSS_SDPA_PARTIAL_SIZE(kNumKVHeads, kHeadDim)};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+    {
+        CommandBuffer command_buffer{command_queue};
+
+        // Q is pre-scaled by 1/sqrt(head_dim) in the model
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/q_buffer,
+            /*output_offset=*/0,
+            num_q_tokens * qkv_dim, kSeed, /*offset=*/0, /*min=*/-0.125f, /*max=*/0.125f);
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/kvcache_buffer,
+            /*output_offset=*/0,
+            kvcache_buffer.size() / sizeof(float), kSeed + 1, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/sink_buffer,
+            /*output_offset=*/0,
+            kNumQHeads, kSeed + 2, /*offset=*/0, /*min=*/-2.0f, /*max=*/2.0f);
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+
+    for (auto _ : state) {
+        CommandBuffer command_buffer{command_queue};
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_sdpa(
+                command_buffer.handle(),
+                f32_sdpa_fn.handle(),
+                f32_sdpa_reduce_fn.handle(),
+                kMaxThreadgroups,
+                q_buffer.handle(), /*q_offset=*/0,
+                kvcache_buffer.handle(), /*k_offset=*/0,
+                kvcache_buffer.handle(), /*v_offset=*/kNumKVHeads * kHeadDim * sizeof(float),
+                sink_buffer.handle(), /*s_offset=*/0,
+                output_buffer.handle(), /*output_offset=*/0,
+                partial_buffer.handle(), /*partial_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                kvcache_buffer.handle(), /*prefix_k_offset=*/0,
+                kvcache_buffer.handle(), /*prefix_v_offset=*/kNumKVHeads * kHeadDim * sizeof(float),
+                /*page_table_buffer=*/nullptr, /*page_table_offset=*/0,
+                window,
+                kv_capacity,
+                /*num_prefix_tokens=*/0,
+                /*prefix_capacity=*/0,
+                num_q_tokens,
+                num_kv_tokens,
+                kNumQHeads,
+                kNumKVHeads,
+                kHeadDim),
+            "gptoss_metal_command_buffer_encode_launch_f32_sdpa");
+
+        command_buffer.commit();
+        const double elapsed_seconds = command_buffer.wait_completion();
+        state.SetIterationTime(elapsed_seconds);
+    }
+
+    // Every attended KV token is read at least once; Q heads are read and outputs written once.
+    const int64_t bytes_per_iteration = q_buffer.size() + kvcache_buffer.size() + output_buffer.size();
+    gptoss::SetBandwidthCounters(state, bytes_per_iteration);
+}
+
+// Decoding, with full attention and with the sliding window of gpt-oss models.
+BENCHMARK(f32_sdpa)
+    ->ArgNames({"q_tokens", "kv_tokens", "window"})
+    ->ArgsProduct({{1}, {128, 1024, 4096, 16384, 65536}, {0, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+// Speculative verification and small batches.
+BENCHMARK(f32_sdpa)
+    ->ArgNames({"q_tokens", "kv_tokens", "window"})
+    ->ArgsProduct({{4, 8}, {1024, 16384}, {0, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+// Prefill.
+BENCHMARK(f32_sdpa)
+    ->ArgNames({"q_tokens", "kv_tokens", "window"})
+    ->ArgsProduct({{512, 2048}, {0, 4096}, {0, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,151 @@
+#include <gpt-oss.h>
+#include <internal/datatype.h>
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+// Vocabulary size of gpt-oss-20b and gpt-oss-120b.
+constexpr uint32_t kNumChannels = 201088;
+// Default number of softmax threadgroups per GPU core of a model, and default threadgroup sizes of the kernels.
+constexpr size_t kThreadgroupsPerCore = 3;
+constexpr size_t kThreadgroupSize = 512;
+
+// Times a sampled decoding step past the unembedding: softmax and sampling of one token, followed by reporting of the
+// most likely tokens and their log-probabilities, as encode_sample_step does. Compare the time for 1 or more top
+// tokens against 0, which leaves out the top log-probabilities kernel, to get its cost relative to sampling itself.
+// Arguments: number of top tokens.
+static void f32_sample_top_logprobs(benchmark::State& state) {
+    const uint32_t num_top = state.range(0);
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    Function f32_softmax_fn{library, "gptoss_f32_softmax"};
+    Function f32_sample_fn{library, "gptoss_f32_sample"};
+    Function f32_top_logprobs_fn{library, "gptoss_f32_top_logprobs"};
+    const size_t max_threadgroups = std::min<size_t>(device.handle()->num_cores * kThreadgroupsPerCore, 1024);
+    Buffer score_buffer{device, kNumChannels * sizeof(float)};
+    Buffer argmax_buffer{device, sizeof(uint64_t)};
+    Buffer prob_buffer{device, kNumChannels * sizeof(float)};
+    Buffer sum_buffer{device, max_threadgroups * sizeof(float)};
+    Buffer token_buffer{device, sizeof(uint32_t)};
+    Buffer top_logprob_buffer{device, GPTOSS_MAX_TOP_LOGPROBS * (sizeof(uint32_t) + sizeof(float))};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+    {
+        CommandBuffer command_buffer{command_queue};
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/score_buffer,
+            /*output_offset=*/0,
+            kNumChannels, kSeed, /*offset=*/0, /*min=*/-8.0f, /*max=*/8.0f);
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+
+    // Argmax in the format produced by the unembedding kernels: the index, then the score bits remapped so that the
+    // maximum score has the minimum key.
+    const float* score_ptr = static_cast<const float*>(score_buffer.ptr());
+    const uint32_t argmax_index = std::max_element(score_ptr, score_ptr + kNumChannels) - score_ptr;
+    uint32_t argmax_bits;
+    std::memcpy(&argmax_bits, &score_ptr[argmax_index], sizeof(argmax_bits));
+    if (static_cast<int32_t>(argmax_bits) >= 0) {
+        argmax_bits ^= UINT32_C(0x7FFFFFFF);
+    }
+    *static_cast<uint64_t*>(argmax_buffer.ptr()) =
+        static_cast<uint64_t>(argmax_index) | (static_cast<uint64_t>(argmax_bits) << 32);
+
+    uint32_t token_index = 0;
+    for (auto _ : state) {
+        CommandBuffer command_buffer{command_queue};
+
+        uint32_t num_threadgroups = 0;
+        uint32_t num_dims_per_threadgroup = 0;
+        Check(gptoss_metal_command_buffer_encode_launch_f32_softmax(
+                command_buffer.handle(),
+                f32_softmax_fn.handle(),
+                kThreadgroupSize,
+                max_threadgroups,
+                score_buffer.handle(),
+                /*score_offset=*/0,
+                argmax_buffer.handle(),
+                /*argmax_offset=*/0,
+                prob_buffer.handle(),
+                /*prob_offset=*/0,
+                sum_buffer.handle(),
+                /*sum_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                kNumChannels,
+                /*num_tokens=*/1,
+                /*temperature=*/1.0f,
+                &num_threadgroups,
+                &num_dims_per_threadgroup),
+            "gptoss_metal_command_buffer_encode_launch_f32_softmax");
+        Check(gptoss_metal_command_buffer_encode_launch_f32_sample(
+                command_buffer.handle(),
+                f32_sample_fn.handle(),
+                /*min_threadgroup_size=*/kThreadgroupSize,
+                prob_buffer.handle(),
+                /*prob_offset=*/0,
+                sum_buffer.handle(),
+                /*sum_offset=*/0,
+                token_buffer.handle(),
+                /*token_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                /*rng_seed=*/kSeed,
+                /*rng_offset=*/token_index++,
+                /*num_blocks=*/num_threadgroups,
+                /*num_channels=*/kNumChannels,
+                /*num_channels_per_block=*/num_dims_per_threadgroup),
+            "gptoss_metal_command_buffer_encode_launch_f32_sample");
+        if (num_top != 0) {
+            Check(gptoss_metal_command_buffer_encode_launch_f32_top_logprobs(
+                    command_buffer.handle(),
+                    f32_top_logprobs_fn.handle(),
+                    kThreadgroupSize,
+                    score_buffer.handle(),
+                    /*score_offset=*/0,
+                    argmax_buffer.handle(),
+                    /*argmax_offset=*/0,
+                    top_logprob_buffer.handle(),
+                    /*top_token_offset=*/0,
+                    top_logprob_buffer.handle(),
+                    /*top_logprob_offset=*/num_top * sizeof(uint32_t),
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    kNumChannels,
+                    /*num_tokens=*/1,
+                    num_top),
+                "gptoss_metal_command_buffer_encode_launch_f32_top_logprobs");
+        }
+
+        command_buffer.commit();
+        const double elapsed_seconds = command_buffer.wait_completion();
+        state.SetIterationTime(elapsed_seconds);
+    }
+
+    state.counters["tokens"] =
+        benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(f32_sample_top_logprobs)
+    ->ArgName("top")->Arg(0)->Arg(1)->Arg(5)->Arg(GPTOSS_MAX_TOP_LOGPROBS)
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,91 @@
+#include <gpt-oss.h>
+#include <internal/datatype.h>
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "memory-bandwidth.hpp"
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+// Vocabulary size of gpt-oss-20b and gpt-oss-120b.
+constexpr uint32_t kNumChannels = 201088;
+
+// Times top-k / top-p sampling of one token straight from the scores, which runs in a single threadgroup. The
+// untruncated path runs softmax over many threadgroups and then samples: compare against f32_sample_top_logprobs with
+// no top tokens in f32-top-logprobs-bench, which times that path on the same vocabulary.
+// Arguments: top-k (0 for top-p over the GPTOSS_MAX_TOP_K most likely tokens), and top-p in percent.
+static void f32_topk_sample(benchmark::State& state) {
+    const uint32_t top_k = state.range(0);
+    const float top_p = static_cast<float>(state.range(1)) * 0.01f;
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    Function f32_topk_sample_fn{library, "gptoss_f32_topk_sample"};
+    Buffer score_buffer{device, kNumChannels * sizeof(float)};
+    Buffer token_buffer{device, sizeof(uint32_t)};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+    {
+        CommandBuffer command_buffer{command_queue};
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/score_buffer,
+            /*output_offset=*/0,
+            kNumChannels, kSeed, /*offset=*/0, /*min=*/-8.0f, /*max=*/8.0f);
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+
+    uint32_t rng_offset = 0;
+    for (auto _ : state) {
+        CommandBuffer command_buffer{command_queue};
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_topk_sample(
+                command_buffer.handle(),
+                f32_topk_sample_fn.handle(),
+                score_buffer.handle(),
+                /*score_offset=*/0,
+                token_buffer.handle(),
+                /*token_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                kSeed,
+                rng_offset++,
+                kNumChannels,
+                top_k,
+                top_p,
+                /*temperature=*/1.0f),
+            "gptoss_metal_command_buffer_encode_launch_f32_topk_sample");
+
+        command_buffer.commit();
+        const double elapsed_seconds = command_buffer.wait_completion();
+        state.SetIterationTime(elapsed_seconds);
+    }
+
+    state.counters["tokens"] =
+        benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+
+    const int64_t bytes_per_iteration = score_buffer.size() + token_buffer.size();
+    gptoss::SetBandwidthCounters(state, bytes_per_iteration);
+}
+
+BENCHMARK(f32_topk_sample)
+    ->ArgNames({"top_k", "top_p"})
+    ->ArgsProduct({{1, 50, GPTOSS_MAX_TOP_K}, {100, 90}})
+    ->Args({0, 90})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
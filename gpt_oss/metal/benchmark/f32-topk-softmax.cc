@@ -0,0 +1,82 @@
+#include <gpt-oss.h>
+#include <internal/datatype.h>
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "memory-bandwidth.hpp"
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+constexpr uint32_t kNumActiveExperts = 4;
+
+// Arguments: number of tokens and number of experts.
+static void f32_topk_softmax(benchmark::State& state) {
+    const uint32_t num_tokens = state.range(0);
+    const uint32_t num_experts = state.range(1);
+
+    Device device;
+    CommandQueue command_queue{device};
+    Library library{device};
+    Function f32_fill_random_fn{library, "gptoss_f32_fill_random"};
+    Function f32_topk_softmax_fn{library, "gptoss_f32_topk_softmax",
+        {{GPTOSS_FUNCTION_CONSTANT_NUM_EXPERTS, num_experts}, {GPTOSS_FUNCTION_CONSTANT_NUM_ACTIVE_EXPERTS, kNumActiveExperts}}};
+    Buffer input_buffer{device, num_tokens * num_experts * sizeof(float)};
+    Buffer output_buffer{device, num_tokens * kNumActiveExperts * sizeof(gptoss_expert_prediction)};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+    {
+        CommandBuffer command_buffer{command_queue};
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/10,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_tokens * num_experts, kSeed, /*offset=*/0, /*min=*/-4.0f, /*max=*/4.0f);
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+
+    for (auto _ : state) {
+        CommandBuffer command_buffer{command_queue};
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_topk(
+                command_buffer.handle(),
+                f32_topk_softmax_fn.handle(),
+                input_buffer.handle(), /*input_offset=*/0,
+                output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                num_tokens,
+                num_experts,
+                kNumActiveExperts),
+            "gptoss_metal_command_buffer_encode_launch_f32_topk");
+
+        command_buffer.commit();
+        const double elapsed_seconds = command_buffer.wait_completion();
+        state.SetIterationTime(elapsed_seconds);
+    }
+
+    state.counters["tokens"] =
+        benchmark::Counter(state.iterations() * num_tokens,
+                           benchmark::Counter::kIsRate);
+
+    const int64_t bytes_per_iteration = input_buffer.size() + output_buffer.size();
+    gptoss::SetBandwidthCounters(state, bytes_per_iteration);
+}
+
+// 32 experts for gpt-oss-20b, 128 for gpt-oss-120b.
+BENCHMARK(f32_topk_softmax)
+    ->ArgNames({"tokens", "experts"})
+    ->ArgsProduct({{1, 16, 256, 4096}, {32, 128}})
+    ->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
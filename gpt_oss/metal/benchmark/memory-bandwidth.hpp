@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <benchmark/benchmark.h>
+
+
+namespace gptoss {
+
+// Reports the memory traffic of a kernel benchmark as the "bytes" rate counter. Metal does not expose the memory
+// bandwidth of the GPU, so the fraction of peak bandwidth ("peak" counter) is only reported when the
+// GPTOSS_PEAK_BANDWIDTH environment variable specifies the peak in GB/s (e.g. 400 for M1 Max).
+inline void SetBandwidthCounters(benchmark::State& state, std::int64_t bytes_per_iteration) {
+    state.counters["bytes"] =
+        benchmark::Counter(state.iterations() * bytes_per_iteration,
+                           benchmark::Counter::kIsRate);
+
+    const char* peak_bandwidth_env = std::getenv("GPTOSS_PEAK_BANDWIDTH");
+    if (peak_bandwidth_env != nullptr) {
+        const double peak_bandwidth = std::strtod(peak_bandwidth_env, nullptr) * 1.0e+9;
+        if (peak_bandwidth > 0.0) {
+            state.counters["peak"] =
+                benchmark::Counter(static_cast<double>(state.iterations() * bytes_per_iteration) / peak_bandwidth,
+                                   benchmark::Counter::kIsRate);
+        }
+    }
+}
+
+}  // namespace gptoss
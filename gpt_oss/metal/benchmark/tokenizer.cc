@@ -0,0 +1,80 @@
+#include <gpt-oss.h>
+#include <internal/model.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#include <benchmark/benchmark.h>
+
+
+static void tokenizer_encode(benchmark::State& state,
+                             const char* model_path_env_var_name,
+                             const char* prompt_env_var_name) {
+    const char* model_path = getenv(model_path_env_var_name);
+    if (model_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set",
+                                        model_path_env_var_name));
+        return;
+    }
+
+    const char* prompt_file_path = getenv(prompt_env_var_name);
+    if (prompt_file_path == NULL) {
+        state.SkipWithError(std::format("environment variable {} is not set",
+                                        prompt_env_var_name));
+        return;
+    }
+
+    std::ifstream prompt_file(prompt_file_path, std::ios::in | std::ios::binary);
+    if (!prompt_file) {
+        state.SkipWithError(std::format("failed to open prompt file {}", prompt_file_path));
+        return;
+    }
+    const std::string prompt_str{std::istreambuf_iterator<char>(prompt_file), std::istreambuf_iterator<char>()};
+    if (!prompt_file && !prompt_file.eof()) {
+        state.SkipWithError(std::format("failed to read prompt file {}", prompt_file_path));
+        return;
+    }
+
+    gptoss_model_t model_ptr = nullptr;
+    gptoss_status status = gptoss_model_create_from_file(model_path, &model_ptr, 0);
+    if (status != gptoss_status_success) {
+        state.SkipWithError(std::format("failed to load model from file {}", model_path));
+        return;
+    }
+    std::unique_ptr<std::remove_pointer_t<gptoss_model_t>, decltype(&gptoss_model_release)> model(model_ptr, gptoss_model_release);
+
+    gptoss_context_t context_ptr = nullptr;
+    status = gptoss_context_create(model.get(), /*context_length=*/0, &context_ptr);
+    if (status != gptoss_status_success) {
+        state.SkipWithError("failed to create Context object");
+        return;
+    }
+    std::unique_ptr<std::remove_pointer_t<gptoss_context_t>, decltype(&gptoss_context_release)> context(context_ptr, gptoss_context_release);
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        gptoss_context_reset(context.get());
+        status = gptoss_context_append_chars(context.get(), prompt_str.data(), prompt_str.size(), &num_tokens);
+        if (status != gptoss_status_success) {
+            state.SkipWithError(std::format("failed to tokenize prompt from file {}", prompt_file_path));
+            return;
+        }
+    }
+
+    state.counters["tokens"] = num_tokens;
+    state.counters["bytes/s"] = benchmark::Counter(
+        state.iterations() * prompt_str.size(), benchmark::Counter::kIsRate);
+    state.counters["tokens/s"] = benchmark::Counter(
+        state.iterations() * num_tokens, benchmark::Counter::kIsRate);
+}
+
+BENCHMARK_CAPTURE(tokenizer_encode, gpt_oss_20b_encode, "GPT_OSS_20B_PATH", "GPT_OSS_PROMPT_FILE_PATH")
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -27,6 +27,143 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     gptoss_model_t* model_out,
     size_t max_batch_tokens);
 
+/*
+ * Creates a Model object from a file in the filesystem without waiting for its weights to be paged in.
+ *
+ * The weights are paged in and locked in memory in the background, in file order, the same way as in
+ * gptoss_model_create_from_file. Work submitted to the model waits on the GPU for the weights of each block to be
+ * resident right before the block runs, so the first tokens can be processed while later blocks are still loading.
+ *
+ * @param path Path to the file containing the model in GPT-OSS format.
+ * @param model_out Pointer to the Model object that will be created. Must be released with gptoss_release_model.
+ * @param max_batch_tokens Maximum number of tokens that can be processed in a single batch.
+ *                        Specify 0 to use the default value.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Model in the model_out argument.
+ * On failure, returns an error code and stores null pointer in the model_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file_lazy(
+    const char* path,
+    gptoss_model_t* model_out,
+    size_t max_batch_tokens);
+
+/*
+ * Creates a Model object from a file in the filesystem, keeping only a budget of MoE expert weights resident in memory.
+ *
+ * Unlike gptoss_model_create_from_file, the MoE expert weights are neither prefetched nor locked when the model is
+ * loaded, and are paged in from the file on first use. The routing decisions of the model are counted on the GPU, and
+ * the most frequently used experts of each block are locked in memory while the rest are advised out, so that models
+ * larger than the available memory degrade gracefully rather than thrash.
+ *
+ * @param path Path to the file containing the model in GPT-OSS format.
+ * @param model_out Pointer to the Model object that will be created. Must be released with gptoss_release_model.
+ * @param max_batch_tokens Maximum number of tokens that can be processed in a single batch.
+ *                        Specify 0 to use the default value.
+ * @param expert_budget_bytes Maximum size of MoE expert weights kept resident in memory, in bytes. Specify 0, or a
+ *                            budget that fits all experts, to load the model the same way as
+ *                            gptoss_model_create_from_file.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Model in the model_out argument.
+ * On failure, returns an error code and stores null pointer in the model_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file_with_expert_budget(
+    const char* path,
+    gptoss_model_t* model_out,
+    size_t max_batch_tokens,
+    size_t expert_budget_bytes);
+
+/*
+ * Query how often the MoE experts of a Model were used while resident in memory.
+ *
+ * @param model Pointer to the Model object created by gptoss_model_create_from_file_with_expert_budget with a
+ *              non-zero expert budget.
+ * @param hits_out Pointer to an array of max_experts elements where the number of token routings to each expert while
+ *                 it was resident will be stored. Experts are ordered by block, then by expert index in the block.
+ * @param misses_out Pointer to an array of max_experts elements where the number of token routings to each expert
+ *                   while it was not resident will be stored, in the same order as hits_out.
+ * @param max_experts Number of elements in each of the hits_out and misses_out arrays.
+ * @param num_experts_out Pointer to the variable where the total number of experts (number of blocks times the number
+ *                        of experts per block) will be stored.
+ *
+ * On success, returns gptoss_status_success and stores the counters in the hits_out and misses_out arrays.
+ * If max_experts is smaller than the total number of experts, returns gptoss_status_insufficient_memory and stores the
+ * total number of experts in num_experts_out.
+ * If the Model does not manage expert residency, returns gptoss_status_invalid_state.
+ * On other failures, returns an error code and leaves the arrays unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_get_expert_residency_stats(
+    gptoss_model_t model,
+    uint64_t* hits_out,
+    uint64_t* misses_out,
+    size_t max_experts,
+    size_t* num_experts_out);
+
+/*
+ * Starts counting the tokens routed to each MoE expert of the Model, over all of its Contexts.
+ *
+ * Counting adds a kernel launch per transformer block to every batch of tokens, so it is off by default. Models that
+ * manage expert residency always count routings. Counts accumulate over all intervals where counting is on, and are
+ * queried with gptoss_model_get_expert_stats.
+ *
+ * @param model Pointer to the Model object created by gptoss_model_create_from_file.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code. Takes effect for command buffers
+ * encoded after the call.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_start_expert_stats(
+    gptoss_model_t model);
+
+/*
+ * Stops counting the tokens routed to each MoE expert of the Model. The counts collected so far remain available
+ * through gptoss_model_get_expert_stats.
+ *
+ * @param model Pointer to the Model object created by gptoss_model_create_from_file.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_stop_expert_stats(
+    gptoss_model_t model);
+
+/*
+ * Query the number of tokens routed to each MoE expert of the Model, over all its Contexts while routings were counted:
+ * between gptoss_model_start_expert_stats and gptoss_model_stop_expert_stats, or always if the Model manages expert
+ * residency.
+ *
+ * @param model Pointer to the Model object created by gptoss_model_create_from_file.
+ * @param num_selections_out Pointer to an array of max_experts elements where the number of token routings to each
+ *                           expert will be stored. Experts are ordered by block, then by expert index in the block.
+ * @param max_experts Number of elements in the num_selections_out array.
+ * @param num_experts_out Pointer to the variable where the total number of experts (number of blocks times the number
+ *                        of experts per block) will be stored.
+ *
+ * Only routings in completed command buffers are counted. May be called concurrently with other uses of the Model.
+ *
+ * On success, returns gptoss_status_success and stores the counters in the num_selections_out array.
+ * If max_experts is smaller than the total number of experts, returns gptoss_status_insufficient_memory and stores the
+ * total number of experts in num_experts_out.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_get_expert_stats(
+    gptoss_model_t model,
+    uint64_t* num_selections_out,
+    size_t max_experts,
+    size_t* num_experts_out);
+
+/*
+ * Query the runtime statistics of the Model, summed over all of its Contexts since the Model was created.
+ *
+ * @param model Pointer to the Model object created by gptoss_model_create_from_file.
+ * @param stats_out Pointer to the structure where the statistics will be stored.
+ *
+ * Counters are updated without locks as command buffers complete, and may be read concurrently with other uses of the
+ * Model: this function only briefly takes the Model lock to inspect the KV cache pools.
+ *
+ * On success, returns gptoss_status_success and stores the statistics in stats_out.
+ * On failure, returns an error code and leaves stats_out unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_get_stats(
+    gptoss_model_t model,
+    struct gptoss_model_stats* stats_out);
+
 /*
  * Query the Tokenizer object associated with the Model.
  *
@@ -53,6 +190,24 @@ enum gptoss_status GPTOSS_ABI gptoss_model_get_max_context_length(
     gptoss_model_t model,
     size_t* max_context_length_out);
 
+/*
+ * Tune the kernel launch parameters of the Model for the GPU, and save them as the launch profile of the device.
+ *
+ * @param model Pointer to the Model object created by gptoss_model_create_from_file.
+ *
+ * Times the candidate threadgroup sizes of the main kernels, and the number of threadgroups of device-wide kernels, on
+ * the shapes of the Model. Threadgroup sizes are tuned separately for decoding a single token and for processing a
+ * batch of tokens, over a full batch scored in a scratch context. Models created later for the same device and model
+ * shape load the saved profile instead of the default launch parameters. The profile is stored next to the Metal
+ * pipeline cache, and is not saved if GPTOSS_PIPELINE_CACHE_DIR is set to an empty string. Takes from a fraction of a
+ * second to a few seconds, and must not be called while any Context of the Model is in use.
+ *
+ * On success, returns gptoss_status_success and the Model uses the tuned launch parameters.
+ * On failure, returns an error code and leaves the launch parameters of the Model unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_model_autotune(
+    gptoss_model_t model);
+
 /*
  * Increments a Model object's reference count.
  *
@@ -146,6 +301,62 @@ enum gptoss_status GPTOSS_ABI gptoss_tokenizer_decode(
     const void** token_ptr_out,
     size_t* token_size_out);
 
+/*
+ * Convert a sequence of text token IDs to their concatenated byte representation.
+ *
+ * @param tokenizer Pointer to the Tokenizer object returned by gptoss_model_get_tokenizer.
+ * @param num_tokens Number of tokens in the token_ids array.
+ * @param token_ids Pointer to the array of text token IDs to decode.
+ * @param buffer_size Size of the buffer, in bytes.
+ * @param buffer Pointer to the buffer where the byte representation of the tokens will be written. May be NULL if
+ *               buffer_size is 0.
+ * @param num_bytes_out Pointer to the variable where the total size of the byte representation will be stored.
+ *
+ * On success, returns gptoss_status_success, writes the byte representation of the tokens to the buffer, and stores
+ * its size in the num_bytes_out argument.
+ * If the buffer is too small, returns gptoss_status_insufficient_memory, stores the required buffer size in the
+ * num_bytes_out argument, and leaves the buffer unchanged.
+ * On other failures, returns an error code and leaves the values specified in buffer and num_bytes_out unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_tokenizer_decode_batch(
+    gptoss_tokenizer_t tokenizer,
+    size_t num_tokens,
+    const uint32_t* token_ids,
+    size_t buffer_size,
+    void* buffer,
+    size_t* num_bytes_out);
+
+/*
+ * Encode a UTF-8 string into text tokens.
+ *
+ * The text is split into pieces with the pre-tokenization regex of the tokenizer, and each piece is encoded with BPE
+ * merges, matching the reference tiktoken encoding. Encodings of short pieces are memoized in a per-tokenizer word
+ * cache, and long texts are encoded by several threads in chunks split at piece boundaries. Special tokens in the text
+ * are not recognized and encode as regular text. If the text is not valid UTF-8 or the tokenizer has no usable regex,
+ * the text is encoded by greedy longest-match instead.
+ *
+ * @param tokenizer Tokenizer object returned by gptoss_model_get_tokenizer.
+ * @param text Pointer to the character string to encode.
+ * @param text_length Length of the string, in chars.
+ * @param max_tokens Maximum capacity of the buffer specified by tokens_out.
+ * @param tokens_out Pointer to the array where up to max_tokens encoded tokens will be stored.
+ * @param num_tokens_out Pointer to the variable where the number of encoded tokens will be stored.
+ *                       This value can exceed max_tokens if the buffer capacity is insufficient.
+ *
+ * On success, returns gptoss_status_success, stores the encoded tokens in tokens_out, and their number in
+ * num_tokens_out.
+ * If the buffer is too small, returns gptoss_status_insufficient_memory, stores the required number of tokens in
+ * num_tokens_out, and leaves the buffer unchanged.
+ * On other failures, returns an error code and leaves the values specified by tokens_out and num_tokens_out unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_tokenizer_encode(
+    gptoss_tokenizer_t tokenizer,
+    const char* text,
+    size_t text_length,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out);
+
 /*
  * Increments a Tokenizer object's reference count.
  *
@@ -169,6 +380,15 @@ enum gptoss_status GPTOSS_ABI gptoss_tokenizer_release(
 /*
  * Creates a Context object for use with the particular Model object.
  *
+ * KV cache of full-attention layers is allocated in pages from a pool shared by all contexts of the Model as tokens
+ * are added to the Context, so memory use scales with the number of tokens rather than the context length.
+ *
+ * Different contexts of one Model can be used concurrently from different threads, and their work overlaps on the
+ * GPU: contexts are spread over several command queues of the Model. A single Context must not be used from multiple
+ * threads at the same time, and contexts passed together to gptoss_context_batch_sample or
+ * gptoss_context_sample_speculative must not be used elsewhere during the call. While decoding is in progress in any
+ * context, prefill of long prompts submits one batch at a time, so that it doesn't starve decoding.
+ *
  * @param model Model object to create a context for.
  * @param context_length Maximum number of tokens in the context.
  *                       Specify 0 to use the maximum context length supported by the model.
@@ -185,6 +405,61 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     size_t context_length,
     gptoss_context_t* context_out);
 
+/*
+ * Creates a Context object for use with the particular Model object, with the specified KV cache storage format.
+ *
+ * @param model Model object to create a context for.
+ * @param context_length Maximum number of tokens in the context.
+ *                       Specify 0 to use the maximum context length supported by the model.
+ * @param kvcache_type Storage format of the KV cache. Reduced-precision formats decrease memory footprint and bandwidth
+ *                     of the KV cache at the cost of accuracy.
+ * @param context_out Pointer to the Context object that will be created.
+ *                    Must be released with gptoss_release_context.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Context in the context_out argument.
+ * On failure, returns an error code and stores null pointer in the context_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_create_with_kvcache_type(
+    gptoss_model_t model,
+    size_t context_length,
+    enum gptoss_kvcache_type kvcache_type,
+    gptoss_context_t* context_out);
+
+/*
+ * Creates a streaming Context object, which makes room for new tokens by evicting old ones instead of overflowing.
+ *
+ * When appending or sampling tokens would overflow the Context, it keeps the first tokens (the attention sinks) and the
+ * most recent tokens, and evicts the oldest tokens in between. The remaining tokens move down to fill the gap, so
+ * that the Context continues as if the evicted tokens were never there: gptoss_context_get_num_tokens and
+ * gptoss_context_get_tokens report only the remaining tokens. Eviction does not recompute the KV cache: the keys of
+ * the remaining tokens are rotated to their new positions in place, which slightly perturbs them with reduced-precision
+ * KV cache formats. Tokens are evicted in large chunks, at least a quarter of the tokens after the sinks, so that
+ * eviction is rare.
+ *
+ * gptoss_context_sample and gptoss_context_stream_begin evict tokens before generating, and generate at most as many
+ * tokens as then fit into the Context. Other functions that would overflow the Context, such as
+ * gptoss_context_score and gptoss_context_sample_speculative, still fail with gptoss_status_context_overflow.
+ *
+ * @param model Model object to create a context for.
+ * @param context_length Maximum number of tokens in the context.
+ *                       Specify 0 to use the maximum context length supported by the model.
+ * @param kvcache_type Storage format of the KV cache.
+ * @param num_sink_tokens Number of leading tokens that are never evicted. Must be non-zero, and is rounded up to a
+ *                        multiple of the KV cache page size. The context length must exceed the sinks by at least
+ *                        twice the attention window plus the maximum batch size of the Model.
+ * @param context_out Pointer to the Context object that will be created.
+ *                    Must be released with gptoss_release_context.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Context in the context_out argument.
+ * On failure, returns an error code and stores null pointer in the context_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_create_streaming(
+    gptoss_model_t model,
+    size_t context_length,
+    enum gptoss_kvcache_type kvcache_type,
+    size_t num_sink_tokens,
+    gptoss_context_t* context_out);
+
 /*
  * Query the current number of tokens cached in the Context.
  *
@@ -233,6 +508,8 @@ enum gptoss_status GPTOSS_ABI gptoss_context_get_tokens(
 /*
  * Tokenize and appends a character string to the Context object.
  *
+ * The string is tokenized as with gptoss_tokenizer_encode.
+ *
  * @param context Context object created by gptoss_context_create.
  * @param text Pointer to the character string to tokenizer and append.
  * @param text_length Length of the string, in chars.
@@ -260,9 +537,94 @@ enum gptoss_status GPTOSS_ABI gptoss_context_append_tokens(
     size_t num_tokens,
     const uint32_t* tokens);
 
+/*
+ * Starts collecting a GPU time profile of the kernels launched on behalf of the Context.
+ *
+ * GPU timestamps are sampled at the start and end of every kernel launch, and accumulated per kernel and per
+ * transformer block. Any previously collected profile is discarded. Profiling adds overhead to every command buffer,
+ * so absolute timings are only indicative; the split between kernels is the intended use. Timed kernels run one at a
+ * time, so kernels that otherwise overlap on the GPU are timed in isolation; the GPU busy time of gptoss_context_get_stats
+ * reflects the overlap.
+ *
+ * @param context Context object created by gptoss_context_create.
+ *
+ * On success, returns gptoss_status_success.
+ * If the GPU does not support timestamp sampling at kernel boundaries, returns gptoss_status_unsupported_system.
+ * On other failures, returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_start_profiling(
+    gptoss_context_t context);
+
+/*
+ * Stops collecting the GPU time profile of the Context. The profile collected so far remains available through
+ * gptoss_context_get_profile.
+ *
+ * @param context Context object created by gptoss_context_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_stop_profiling(
+    gptoss_context_t context);
+
+/*
+ * Query the GPU time profile collected since the last call to gptoss_context_start_profiling.
+ *
+ * Each profile entry accumulates the launches of one kernel in one transformer block. Before the first call to
+ * gptoss_context_start_profiling, the profile is empty.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param kernel_names_out Pointer to an array of max_entries elements where the kernel name of each entry will be
+ *                         stored. The names remain valid for the lifetime of the Model.
+ * @param blocks_out Pointer to an array of max_entries elements where the transformer block index of each entry will
+ *                   be stored, or UINT32_MAX for kernels launched outside of transformer blocks (e.g. embeddings,
+ *                   unembedding, and sampling).
+ * @param num_launches_out Pointer to an array of max_entries elements where the number of timed launches of each entry
+ *                         will be stored.
+ * @param gpu_seconds_out Pointer to an array of max_entries elements where the total GPU time of each entry, in
+ *                        seconds, will be stored.
+ * @param max_entries Number of elements in each of the output arrays.
+ * @param num_entries_out Pointer to the variable where the number of profile entries will be stored.
+ * @param num_untimed_launches_out Pointer to the variable where the number of kernel launches that were not timed,
+ *                                 because their command buffer held too many launches, will be stored.
+ *
+ * On success, returns gptoss_status_success and stores the profile in the output arrays.
+ * If max_entries is smaller than the number of profile entries, returns gptoss_status_insufficient_memory and stores
+ * the number of profile entries in num_entries_out.
+ * On other failures, returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_get_profile(
+    gptoss_context_t context,
+    const char** kernel_names_out,
+    uint32_t* blocks_out,
+    uint64_t* num_launches_out,
+    double* gpu_seconds_out,
+    size_t max_entries,
+    size_t* num_entries_out,
+    uint64_t* num_untimed_launches_out);
+
+/*
+ * Query the runtime statistics of the Context since it was created.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param stats_out Pointer to the structure where the statistics will be stored.
+ *
+ * Counters are read without locks, and may be read while the Context is in use on another thread; the KV cache
+ * occupancy and allocation size are then snapshots that may be slightly out of date.
+ *
+ * On success, returns gptoss_status_success and stores the statistics in stats_out.
+ * On failure, returns an error code and leaves stats_out unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_get_stats(
+    gptoss_context_t context,
+    struct gptoss_context_stats* stats_out);
+
 /*
  * Resets the context, clearing its state.
  *
+ * The KV cache is retained so that it can be reused if the same tokens are appended again. KV cache pages are returned
+ * to the Model's pool once appended tokens diverge from the retained ones, and when the Context is released. The token
+ * automaton, if any, returns to its initial state.
+ *
  * @param context Context object created by gptoss_context_create.
  *
  * On success, returns gptoss_status_success, otherwise returns an error code.
@@ -280,13 +642,121 @@ enum gptoss_status GPTOSS_ABI gptoss_context_reset(
 enum gptoss_status GPTOSS_ABI gptoss_context_process(
     gptoss_context_t context);
 
+/*
+ * Pre-process up to max_tokens of the tokens in the Context that are not yet in its KV cache, and return.
+ *
+ * Unlike gptoss_context_process, which pre-processes all pending tokens in one blocking call, this bounds the time
+ * the call occupies the GPU, so that a long prompt can be pre-processed in several calls interleaved with decoding
+ * steps of other Contexts. Processing continues from where the previous call stopped.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param max_tokens Maximum number of tokens to pre-process in this call. Must be positive. Multiples of the maximum
+ *                   batch size of the Model make the most efficient use of the GPU.
+ * @param num_remaining_tokens_out Pointer to the variable where the number of tokens that remain to be pre-processed
+ *                                 will be stored; 0 when the Context is fully pre-processed. May be NULL.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_process_partial(
+    gptoss_context_t context,
+    size_t max_tokens,
+    size_t* num_remaining_tokens_out);
+
+/*
+ * Set truncation of the token probability distribution for subsequent sampling from the Context.
+ *
+ * With non-zero temperature, tokens are sampled only among the top_k most likely tokens, and among them, only from
+ * the smallest set of most likely tokens whose cumulative probability is at least top_p. Top-p truncation alone
+ * considers the 1024 most likely tokens. Truncation applies to gptoss_context_sample, streaming generation, and
+ * gptoss_context_batch_sample, but is not supported by gptoss_context_sample_speculative.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param top_k Number of most likely tokens to sample from, at most 1024. 0 disables top-k truncation.
+ * @param top_p Cumulative probability of the most likely tokens to sample from. Must be in (0, 1]; 1 disables top-p
+ *              truncation.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_sampling_params(
+    gptoss_context_t context,
+    uint32_t top_k,
+    float top_p);
+
+/*
+ * Set the storage format of intermediate activations for subsequent prefill of the Context.
+ *
+ * In half precision, the MoE activations between the SwiGLU and output projections of batches large enough for the
+ * grouped MoE kernels are stored as IEEE half-precision values, halving their memory traffic. Accumulation and the
+ * residual stream remain in single precision, and decoding of single tokens is unaffected.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param activation_type Storage format of the MoE activations. Defaults to gptoss_activation_type_f32.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_prefill_activation_type(
+    gptoss_context_t context,
+    enum gptoss_activation_type activation_type);
+
+/*
+ * Constrain subsequent sampling from the Context with a token automaton.
+ *
+ * Each state of the automaton allows a subset of tokens, and only allowed tokens are sampled. After every sampled
+ * token the automaton moves to the next state of the matching transition, or to the default next state of the current
+ * state when no transition matches. The automaton is evaluated on the GPU, so a constrained generation needs no host
+ * round-trip per token. Constraints apply to gptoss_context_sample and streaming generation; gptoss_context_batch_sample
+ * and gptoss_context_sample_speculative reject constrained contexts. Tokens appended with gptoss_context_append_tokens
+ * or gptoss_context_append_chars do not advance the automaton.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param num_states Number of states in the automaton. 0 removes the automaton and lifts the constraints.
+ * @param initial_state Current state of the automaton, less than num_states. gptoss_context_reset returns the automaton
+ *                      to this state.
+ * @param allow_masks Bitsets of allowed tokens, one per state. Each bitset has ceil(num_tokens / 32) 32-bit words,
+ *                    where num_tokens is the vocabulary size of the model, i.e. the number of text and special tokens
+ *                    returned by gptoss_tokenizer_get_num_tokens for its tokenizer, and token t is allowed if bit
+ *                    (t % 32) of word (t / 32) is set. Every state must allow at least one token.
+ * @param default_states Default next state for each state.
+ * @param num_transitions Number of explicit transitions.
+ * @param transitions Explicit transitions as (state, token, next state) triples, sorted by state, then by token.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_token_automaton(
+    gptoss_context_t context,
+    uint32_t num_states,
+    uint32_t initial_state,
+    const uint32_t* allow_masks,
+    const uint32_t* default_states,
+    size_t num_transitions,
+    const uint32_t* transitions);
+
+/*
+ * Query the current state of the token automaton constraining sampling from the Context.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param state_out Pointer to the variable where the current state of the automaton will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code. Returns gptoss_status_invalid_state if
+ * the Context has no token automaton.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_get_token_automaton_state(
+    gptoss_context_t context,
+    uint32_t* state_out);
+
 /*
  * Generate a token probability distribution over the next token conditioned on the Context.
  *
  * @param context Context object created by gptoss_context_create.
  * @param temperature Sampling temperature. Must be non-negative.
  * @param seed Random number generator seed to use for sampling.
- * @param token_out Pointer to the variable where the token ID will be stored.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param num_stop_tokens Number of token IDs in the stop_tokens array. At most 32 stop tokens are supported.
+ * @param stop_tokens Pointer to the array of token IDs which terminate generation. Generation stops after the first
+ *                    stop token is produced; the stop token is included in the output. May be NULL if num_stop_tokens
+ *                    is 0.
+ * @param tokens_out Pointer to the array of at least max_tokens elements where the generated token IDs will be stored.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
  *
  * On success, returns gptoss_status_success, otherwise returns an error code.
  */
@@ -295,9 +765,244 @@ enum gptoss_status GPTOSS_ABI gptoss_context_sample(
     float temperature,
     uint64_t seed,
     size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out);
+
+/*
+ * Generate tokens like gptoss_context_sample, and report the most likely tokens with their log-probabilities at each
+ * step.
+ *
+ * The most likely tokens are selected on the GPU, in the same pass that computes the softmax denominator, so only
+ * num_top_logprobs pairs per generated token are copied back. Log-probabilities are computed at temperature 1,
+ * independently of the sampling temperature and the top-k/top-p truncation, but reflect the constraints of the token
+ * automaton, if any. Ties are broken in favor of lower token IDs.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param num_stop_tokens Number of token IDs in the stop_tokens array. At most 32 stop tokens are supported.
+ * @param stop_tokens Pointer to the array of token IDs which terminate generation. May be NULL if num_stop_tokens
+ *                    is 0.
+ * @param num_top_logprobs Number of most likely tokens to report for each generated token, between 1 and 20.
+ * @param tokens_out Pointer to the array of at least max_tokens elements where the generated token IDs will be stored.
+ * @param top_tokens_out Pointer to the array of at least max_tokens * num_top_logprobs elements where the IDs of the
+ *                       most likely tokens at each step will be stored, in order of decreasing probability.
+ * @param top_logprobs_out Pointer to the array of at least max_tokens * num_top_logprobs elements where the natural
+ *                         logarithms of the probabilities of the tokens in top_tokens_out will be stored.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_with_top_logprobs(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    size_t num_top_logprobs,
     uint32_t* tokens_out,
+    uint32_t* top_tokens_out,
+    float* top_logprobs_out,
+    size_t* num_tokens_out);
+
+/*
+ * Start streaming generation of tokens conditioned on the Context.
+ *
+ * Decoding steps are submitted to the GPU ahead of time, and each generated token can be retrieved with
+ * gptoss_context_stream_next as soon as it is computed. The stream ends when max_tokens tokens are generated, when a
+ * stop token is generated, when gptoss_context_stream_end is called, or when any other function modifying the
+ * Context is called.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param num_stop_tokens Number of token IDs in the stop_tokens array. At most 32 stop tokens are supported.
+ * @param stop_tokens Pointer to the array of token IDs which terminate generation. May be NULL if num_stop_tokens is 0.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_stream_begin(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens);
+
+/*
+ * Wait for the next token of the stream started with gptoss_context_stream_begin.
+ *
+ * @param context Context object with an active stream.
+ * @param token_out Pointer to the variable where the generated token ID will be stored.
+ * @param num_tokens_out Pointer to the variable where the number of returned tokens (0 or 1) will be stored.
+ *                       0 indicates that the stream has ended.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_stream_next(
+    gptoss_context_t context,
+    uint32_t* token_out,
     size_t* num_tokens_out);
 
+/*
+ * End the stream started with gptoss_context_stream_begin, if any.
+ *
+ * Tokens generated on the GPU but not yet returned by gptoss_context_stream_next are discarded from the Context.
+ *
+ * @param context Context object created by gptoss_context_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_stream_end(
+    gptoss_context_t context);
+
+/*
+ * Sample one token for each of several independent Contexts in a single batched pass through the model.
+ *
+ * The last token of every Context is processed as one batch, so that model weights are read once for all Contexts,
+ * while attention for each Context runs against its own KV cache. Tokens that are not yet in the KV cache of a
+ * Context are pre-processed first. The sampled token is appended to each Context.
+ *
+ * @param contexts Pointer to the array of distinct Context objects created by gptoss_context_create for the same Model.
+ *                 Each Context must contain at least one token.
+ * @param num_contexts Number of Context objects in the contexts array. Must not exceed the maximum batch size of the Model.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param tokens_out Pointer to the array of num_contexts elements where the token ID sampled for each Context will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_batch_sample(
+    const gptoss_context_t* contexts,
+    size_t num_contexts,
+    float temperature,
+    uint64_t seed,
+    uint32_t* tokens_out);
+
+/*
+ * Generate tokens conditioned on the target Context using speculative decoding with a smaller draft model.
+ *
+ * In each round, the draft Context samples num_draft_tokens tokens one by one, and the target Context then processes
+ * all of them in a single pass. Draft tokens are accepted with probability min(1, p/q), where p and q are the target
+ * and draft probabilities of the token, and the first rejected token is replaced with a sample from the normalized
+ * max(p - q, 0) distribution, so that generated tokens follow the distribution of the target model. If all draft
+ * tokens are accepted, one more token is sampled from the target model. With zero temperature, draft tokens are
+ * accepted while they match the argmax of the target model. Both Contexts are rolled back to the accepted tokens,
+ * and on return contain the same tokens.
+ *
+ * @param target_context Context object of the target model.
+ * @param draft_context Context object of the draft model. The model must have the same vocabulary as the target
+ *                      model, and the Context must contain the same tokens as the target Context.
+ * @param num_draft_tokens Number of tokens to draft in each round. Limited by the maximum batch size of both Models.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param num_stop_tokens Number of token IDs in the stop_tokens array.
+ * @param stop_tokens Pointer to the array of token IDs which terminate generation. Generation stops after the first
+ *                    stop token is produced; the stop token is included in the output. May be NULL if num_stop_tokens
+ *                    is 0.
+ * @param tokens_out Pointer to the array of at least max_tokens elements where the generated token IDs will be stored.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_speculative(
+    gptoss_context_t target_context,
+    gptoss_context_t draft_context,
+    size_t num_draft_tokens,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out);
+
+/*
+ * Append tokens to the Context and compute the log-probability of each of them conditioned on the preceding tokens.
+ *
+ * All tokens are processed in batches of up to the maximum batch size of the Model, and log-probabilities are computed
+ * on the GPU, so that only one value per token is copied back. Tokens that are not yet in the KV cache are processed
+ * first. Log-probabilities are computed at temperature 1.
+ *
+ * @param context Context object created by gptoss_context_create. Must contain at least one token.
+ * @param num_tokens Number of tokens to score and append to the Context.
+ * @param tokens Pointer to the array of num_tokens token IDs.
+ * @param logprobs_out Pointer to the array of num_tokens elements where the natural logarithm of the probability of
+ *                     each token will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code. On failure, the tokens of the Context
+ * are not modified, but part of its KV cache may be recomputed when processing resumes.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_score(
+    gptoss_context_t context,
+    size_t num_tokens,
+    const uint32_t* tokens,
+    float* logprobs_out);
+
+/*
+ * Write the tokens of the Context and the part of the KV cache in use to a file.
+ *
+ * Only the KV cache of processed tokens is written: the tokens kept by the ring buffers of sliding-window attention
+ * blocks, and all processed tokens for full-attention blocks. The data is written at the current offset of the file
+ * descriptor, which advances past it, and can be restored with gptoss_context_load. KV cache of the shared prefix of a
+ * Context created with gptoss_context_create_from_prefix is written as well.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param fd File descriptor open for writing.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_save(
+    gptoss_context_t context,
+    int fd);
+
+/*
+ * Replace the tokens and the KV cache of the Context with ones written by gptoss_context_save.
+ *
+ * The data is read at the current offset of the file descriptor. It must have been saved for a Model with the same
+ * weights, identified by a hash of samples of the weights, and the same KV cache storage format, and must fit in the
+ * length of the Context. KV cache is read directly into the memory of the
+ * Context, so restoring a long Context is much faster than processing its tokens again. A Context created from a
+ * Prefix can be restored only from a file whose tokens start with the prefix tokens, and reads only the KV cache of
+ * the tokens after them.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param fd File descriptor open for reading. Must support seeking if the Context was created from a Prefix, or has a
+ *           shorter sliding-window KV cache than the saved Context.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code. If the file is rejected before any
+ * data other than the header is read, the Context is not modified; on later failures, the Context keeps only the
+ * prefix tokens, if any.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_load(
+    gptoss_context_t context,
+    int fd);
+
+/*
+ * Creates a new Context object with the same tokens and KV cache as the Context.
+ *
+ * The new Context has the same Model, length, KV cache storage format, Prefix (if any), sampling parameters, and token
+ * automaton state. Only the KV cache rows in use are copied, with a GPU copy into newly allocated pages: the tokens of
+ * the shared Prefix stay shared. Forks of a processed prompt can then generate different completions, e.g. sampled
+ * together with gptoss_context_batch_sample.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param context_out Pointer to the Context object that will be created.
+ *                    Must be released with gptoss_release_context.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Context in the context_out argument.
+ * On failure, returns an error code and stores null pointer in the context_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_fork(
+    gptoss_context_t context,
+    gptoss_context_t* context_out);
+
 /*
  * Increments a Context object's reference count.
  *
@@ -318,6 +1023,204 @@ enum gptoss_status GPTOSS_ABI gptoss_context_retain(
 enum gptoss_status GPTOSS_ABI gptoss_context_release(
     gptoss_context_t context);
 
+/*
+ * Creates a Prefix object with a snapshot of the KV cache of the tokens in the Context.
+ *
+ * Tokens in the Context that are not yet in the KV cache are processed first. The Context itself is not modified
+ * and remains usable.
+ *
+ * @param context Context object created by gptoss_context_create or gptoss_context_create_with_kvcache_type.
+ *                Must contain at least one token, and must not be created from a Prefix itself.
+ * @param prefix_out Pointer to the Prefix object that will be created.
+ *                   Must be released with gptoss_prefix_release.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Prefix in the prefix_out argument.
+ * On failure, returns an error code and stores null pointer in the prefix_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_create_prefix(
+    gptoss_context_t context,
+    gptoss_prefix_t* prefix_out);
+
+/*
+ * Creates a Context object that starts with the tokens of the Prefix and shares its KV cache.
+ *
+ * The Context uses the Model and the KV cache storage format of the Prefix, and only allocates KV cache for the
+ * tokens after the prefix. The prefix tokens can't be replaced: appending tokens that diverge from the prefix fails
+ * with gptoss_status_invalid_argument.
+ *
+ * @param prefix Prefix object created by gptoss_context_create_prefix.
+ * @param context_length Maximum number of tokens in the context, including the prefix tokens.
+ *                       Specify 0 to use the maximum context length supported by the model.
+ * @param context_out Pointer to the Context object that will be created.
+ *                    Must be released with gptoss_release_context.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Context in the context_out argument.
+ * On failure, returns an error code and stores null pointer in the context_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_create_from_prefix(
+    gptoss_prefix_t prefix,
+    size_t context_length,
+    gptoss_context_t* context_out);
+
+/*
+ * Query the number of tokens in the Prefix.
+ *
+ * @param prefix Prefix object created by gptoss_context_create_prefix.
+ * @param num_tokens_out Pointer to the variable where the number of tokens will be stored.
+ *
+ * On success, returns gptoss_status_success and stores the number of tokens in the num_tokens_out argument.
+ * On failure, returns an error code and leaves the value specified by num_tokens_out unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_prefix_get_num_tokens(
+    gptoss_prefix_t prefix,
+    size_t* num_tokens_out);
+
+/*
+ * Increments a Prefix object's reference count.
+ *
+ * @param prefix Pointer to the Prefix object created by gptoss_context_create_prefix.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_prefix_retain(
+    gptoss_prefix_t prefix);
+
+/*
+ * Decrements a Prefix object's reference count and possibly release associated resources.
+ *
+ * Contexts created from the Prefix keep it alive until they are released.
+ *
+ * @param prefix Pointer to the Prefix object created by gptoss_context_create_prefix.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_prefix_release(
+    gptoss_prefix_t prefix);
+
+/*
+ * Creates a Scheduler object for continuous batching of generation requests on Contexts of the Model.
+ *
+ * Every call to gptoss_scheduler_step runs one batched pass through the model. Requests are admitted in submission
+ * order, up to max_batch_tokens at a time. In each step, every admitted request whose prompt is processed decodes one
+ * token, and the remaining tokens of the step are filled with chunks of the prompts of the other admitted requests.
+ * A finished request is retired at the end of the step that produces its last token, and the next waiting request is
+ * admitted in its place.
+ *
+ * @param model Model object created by gptoss_model_create_from_file.
+ * @param max_batch_tokens Maximum number of tokens to process in one step. Must not exceed the maximum batch size of
+ *                         the Model; 0 selects the maximum batch size of the Model.
+ * @param scheduler_out Pointer to the Scheduler object that will be created. Must be released with
+ *                      gptoss_scheduler_release.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Scheduler in the scheduler_out argument.
+ * On failure, returns an error code and stores a null pointer in the scheduler_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_create(
+    gptoss_model_t model,
+    size_t max_batch_tokens,
+    gptoss_scheduler_t* scheduler_out);
+
+/*
+ * Submits a generation request to the Scheduler.
+ *
+ * The Scheduler retains the Context until the request is finished or cancelled, and appends the generated tokens to
+ * it. Until then, the Context must not be used outside of the Scheduler. Top-k and top-p truncation is taken from
+ * the Context, as set with gptoss_context_set_sampling_params. Contexts constrained by a token automaton are not
+ * supported.
+ *
+ * @param scheduler Scheduler object created by gptoss_scheduler_create.
+ * @param context Context object created for the same Model as the Scheduler, with the prompt tokens appended.
+ *                The Context must contain at least one token and must not be used by another request.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param max_tokens Maximum number of tokens to generate. Must be positive.
+ * @param num_stop_tokens Number of token IDs in the stop_tokens array.
+ * @param stop_tokens Pointer to the array of token IDs which finish the request; the stop token is included in the
+ *                    output. May be NULL if num_stop_tokens is 0.
+ * @param request_id_out Pointer to the variable where the ID of the request will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_submit(
+    gptoss_scheduler_t scheduler,
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint64_t* request_id_out);
+
+/*
+ * Cancels a request of the Scheduler and releases its Context. Tokens generated so far stay in the Context.
+ *
+ * @param scheduler Scheduler object created by gptoss_scheduler_create.
+ * @param request_id ID of a request that is not finished yet, as returned by gptoss_scheduler_submit.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_cancel(
+    gptoss_scheduler_t scheduler,
+    uint64_t request_id);
+
+/*
+ * Query the number of requests in the Scheduler that are waiting or running.
+ *
+ * @param scheduler Scheduler object created by gptoss_scheduler_create.
+ * @param num_requests_out Pointer to the variable where the number of requests will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_get_num_requests(
+    gptoss_scheduler_t scheduler,
+    size_t* num_requests_out);
+
+/*
+ * Runs one step of the Scheduler: a single batched pass through the model which pre-fills chunks of the prompts of
+ * newly admitted requests and decodes one token for each running request.
+ *
+ * @param scheduler Scheduler object created by gptoss_scheduler_create.
+ * @param max_outputs Maximum number of tokens to generate in this step, and the number of elements in each of the
+ *                    output arrays.
+ * @param request_ids_out Pointer to the array where the request ID of each generated token will be stored.
+ * @param tokens_out Pointer to the array where the generated tokens will be stored.
+ * @param finished_out Pointer to the array where for each generated token, 1 will be stored if the token finishes its
+ *                     request, or 0 otherwise. A request finishes with a stop token, after max_tokens generated tokens,
+ *                     or when its Context is full; finished requests are retired and release their Context.
+ * @param num_outputs_out Pointer to the variable where the number of generated tokens will be stored. Can be 0 if the
+ *                        step only pre-filled prompts, or if the Scheduler has no requests.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_step(
+    gptoss_scheduler_t scheduler,
+    size_t max_outputs,
+    uint64_t* request_ids_out,
+    uint32_t* tokens_out,
+    uint8_t* finished_out,
+    size_t* num_outputs_out);
+
+/*
+ * Increments a Scheduler object's reference count.
+ *
+ * @param scheduler Pointer to the Scheduler object created by gptoss_scheduler_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_retain(
+    gptoss_scheduler_t scheduler);
+
+/*
+ * Decrements a Scheduler object's reference count and possibly releases associated resources, including the
+ * references to the Contexts of its unfinished requests.
+ *
+ * @param scheduler Pointer to the Scheduler object created by gptoss_scheduler_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_release(
+    gptoss_scheduler_t scheduler);
+
 /*
  * Creates a Sampler object.
  *
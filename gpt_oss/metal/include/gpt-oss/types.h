@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 /*
  * Status codes returned by GPT-OSS API functions.
  */
@@ -30,6 +33,85 @@ enum gptoss_special_token {
     gptoss_special_token_max,
 };
 
+/*
+ * Storage formats for the KV cache of a Context.
+ */
+enum gptoss_kvcache_type {
+    // IEEE single-precision K and V values.
+    gptoss_kvcache_type_f32 = 0,
+    // BFloat16 K and V values.
+    gptoss_kvcache_type_bf16 = 1,
+    // Symmetrically quantized 8-bit integer K and V values with a single-precision scale per token and head.
+    gptoss_kvcache_type_i8 = 2,
+};
+
+/*
+ * Storage formats for intermediate activations of a Context.
+ */
+enum gptoss_activation_type {
+    // IEEE single-precision activations.
+    gptoss_activation_type_f32 = 0,
+    // IEEE half-precision activations, with single-precision arithmetic.
+    gptoss_activation_type_f16 = 1,
+};
+
+/*
+ * Runtime statistics of a Model, summed over all of its Contexts. See gptoss_model_get_stats.
+ */
+struct gptoss_model_stats {
+    // Number of tokens prefilled into the KV caches of Contexts, i.e. processed without sampling a token after them.
+    uint64_t num_prefill_tokens;
+    // Number of tokens generated by sampling.
+    uint64_t num_decode_tokens;
+    // Number of command buffers completed on the GPU.
+    uint64_t num_command_buffers;
+    // GPU execution time of the completed command buffers, in seconds. Command buffers of different Contexts may
+    // execute concurrently, so the busy time may exceed wall-clock time.
+    double gpu_busy_seconds;
+    // Time that calling threads spent waiting for command buffers to complete, in seconds.
+    double wait_seconds;
+    // Number of tokens of full-attention KV cache in the Model's shared KV cache pools, and the number of them that
+    // are allocated to Contexts.
+    size_t num_kvcache_pool_tokens;
+    size_t num_used_kvcache_pool_tokens;
+    // Size of the shared KV cache pools, in bytes.
+    size_t kvcache_pool_size;
+    // Size of the Model weights, in bytes.
+    size_t weights_size;
+    // Size of all Metal memory allocated by the process on the Model's device, in bytes.
+    size_t metal_allocation_size;
+    // Number of MoE experts, over all blocks, currently locked in memory by expert residency management. Zero if the
+    // Model does not manage expert residency.
+    size_t num_resident_experts;
+};
+
+/*
+ * Runtime statistics of a Context. See gptoss_context_get_stats.
+ */
+struct gptoss_context_stats {
+    // Number of tokens prefilled into the KV cache, i.e. processed without sampling a token after them.
+    uint64_t num_prefill_tokens;
+    // Number of tokens generated by sampling.
+    uint64_t num_decode_tokens;
+    // Number of command buffers completed on the GPU. Steps that batch several Contexts are accounted to one of them.
+    uint64_t num_command_buffers;
+    // GPU execution time of the completed command buffers, in seconds.
+    double gpu_busy_seconds;
+    // Time that calling threads spent waiting for command buffers to complete, in seconds.
+    double wait_seconds;
+    // Number of tokens in the KV cache, number of tokens the KV cache has memory allocated for, and the maximum number
+    // of tokens in the Context.
+    size_t num_kv_tokens;
+    size_t num_allocated_kv_tokens;
+    size_t max_kv_tokens;
+    // Size of the KV cache memory of the Context, including pages drawn from the Model's KV cache pool but excluding
+    // a shared prefix, in bytes.
+    size_t kvcache_size;
+    // Size of the Metal memory allocated by the Context itself (activations, inputs/outputs, sliding-window KV cache),
+    // in bytes.
+    size_t allocation_size;
+};
+
 /*
  * Model object is an opaque container comprised of:
  * - Weights
@@ -50,6 +132,20 @@ typedef struct gptoss_tokenizer* gptoss_tokenizer_t;
  */
 typedef struct gptoss_context* gptoss_context_t;
 
+/*
+ * Prefix is an opaque, immutable snapshot of a Context's KV cache for a sequence of leading tokens, e.g. a shared
+ * system prompt. Contexts created from a Prefix reference its KV cache instead of recomputing and storing their own.
+ *
+ * A single prefix can be shared by multiple contexts of the same model.
+ */
+typedef struct gptoss_prefix* gptoss_prefix_t;
+
+/*
+ * Scheduler is an opaque container for generation requests on Contexts of one Model, which it advances together in
+ * iteration-level batches: each step mixes chunked prefill of newly admitted requests with decoding of running ones.
+ */
+typedef struct gptoss_scheduler* gptoss_scheduler_t;
+
 /*
  * Sampler is an opaque container for sampling parameters:
  * - Temperature
@@ -1,17 +1,41 @@
 #include <Python.h>
 
+#include <stdbool.h>
+#include <string.h>
+
 #include <gpt-oss.h>
 
 #include "module.h"
 
 
+// Methods release the GIL during GPU work, which would let another Python thread call into the same Context meanwhile,
+// while the C API requires Contexts to be used by one thread at a time. Methods claim the Context object (shared by its
+// copies) for the duration of the call instead, and raise RuntimeError if another call holds it. The claim is only
+// examined and changed with the GIL held.
+bool claim_context(PyGPTOSSContext* self) {
+    PyGPTOSSContext* owner = self->owner != NULL ? self->owner : self;
+    if (owner->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Context is in use by another thread");
+        return false;
+    }
+    owner->busy = true;
+    return true;
+}
+
+void unclaim_context(PyGPTOSSContext* self) {
+    PyGPTOSSContext* owner = self->owner != NULL ? self->owner : self;
+    owner->busy = false;
+}
+
+
 static int PyGPTOSSContext_init(PyGPTOSSContext* self, PyObject* args, PyObject* kwargs) {
-    static char *kwlist[] = {"model", "context_length", NULL};
+    static char *kwlist[] = {"model", "context_length", "sink_tokens", NULL};
     PyObject* model = NULL;
     Py_ssize_t context_length = 0; // Default to 0 if None
+    int sink_tokens = 0; // 0 creates a regular context that overflows when full
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$i", kwlist,
-                                     &model, &context_length)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$ii", kwlist,
+                                     &model, &context_length, &sink_tokens)) {
         return -1;
     }
     if (!PyObject_TypeCheck(model, &PyGPTOSSModel_Type)) {
@@ -22,11 +46,27 @@ static int PyGPTOSSContext_init(PyGPTOSSContext* self, PyObject* args, PyObject*
         PyErr_SetString(PyExc_ValueError, "context_length must be a positive integer");
         return -1;
     }
+    if (sink_tokens < 0) {
+        PyErr_SetString(PyExc_ValueError, "sink_tokens must be a non-negative integer");
+        return -1;
+    }
 
-    enum gptoss_status status = gptoss_context_create(
-        ((const PyGPTOSSModel*) model)->handle,
-        (size_t) context_length,
-        &self->handle);
+    self->busy = false;
+    self->owner = NULL;
+    enum gptoss_status status;
+    if (sink_tokens != 0) {
+        status = gptoss_context_create_streaming(
+            ((const PyGPTOSSModel*) model)->handle,
+            (size_t) context_length,
+            gptoss_kvcache_type_f32,
+            (size_t) sink_tokens,
+            &self->handle);
+    } else {
+        status = gptoss_context_create(
+            ((const PyGPTOSSModel*) model)->handle,
+            (size_t) context_length,
+            &self->handle);
+    }
     if (status != gptoss_status_success) {
         // TODO: set exception
         goto error;
@@ -43,6 +83,7 @@ error:
 static void PyGPTOSSContext_dealloc(PyGPTOSSContext* self) {
     (void) gptoss_context_release(self->handle);
     self->handle = NULL;
+    Py_CLEAR(self->owner);
     PyObject_Del((PyObject*) self);
 }
 
@@ -54,9 +95,39 @@ static PyObject* PyGPTOSSContext_copy(PyGPTOSSContext *self) {
 
     (void) gptoss_context_retain(self->handle);
     copy->handle = self->handle;
+    // Copies share the handle, and thus the claim of the original object.
+    copy->busy = false;
+    copy->owner = self->owner != NULL ? self->owner : self;
+    Py_INCREF(copy->owner);
     return (PyObject*) copy;
 }
 
+static PyObject* PyGPTOSSContext_fork(PyGPTOSSContext* self) {
+    PyGPTOSSContext* fork = (PyGPTOSSContext*) PyObject_New(PyGPTOSSContext, Py_TYPE(self));
+    if (fork == NULL) {
+        return NULL;
+    }
+    fork->handle = NULL;
+    fork->busy = false;
+    fork->owner = NULL;
+    if (!claim_context(self)) {
+        Py_DECREF(fork);
+        return NULL;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_fork(self->handle, &fork->handle);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to fork context (status %d)", (int) status);
+        Py_DECREF(fork);
+        return NULL;
+    }
+    return (PyObject*) fork;
+}
+
 static PyObject* PyGPTOSSContext_append(PyGPTOSSContext* self, PyObject* arg) {
     if (PyBytes_Check(arg)) {
         char* string_ptr = NULL;
@@ -65,8 +136,12 @@ static PyObject* PyGPTOSSContext_append(PyGPTOSSContext* self, PyObject* arg) {
             return NULL;
         }
 
+        if (!claim_context(self)) {
+            return NULL;
+        }
         const enum gptoss_status status = gptoss_context_append_chars(
             self->handle, string_ptr, string_size, /*num_tokens_out=*/NULL);
+        unclaim_context(self);
         if (status != gptoss_status_success) {
             // TODO: set exception
             return NULL;
@@ -80,8 +155,12 @@ static PyObject* PyGPTOSSContext_append(PyGPTOSSContext* self, PyObject* arg) {
             return NULL;
         }
 
+        if (!claim_context(self)) {
+            return NULL;
+        }
         const enum gptoss_status status = gptoss_context_append_chars(
             self->handle, string_ptr, string_size, /*num_tokens_out=*/NULL);
+        unclaim_context(self);
         if (status != gptoss_status_success) {
             // TODO: set exception
             return NULL;
@@ -95,8 +174,12 @@ static PyObject* PyGPTOSSContext_append(PyGPTOSSContext* self, PyObject* arg) {
         }
 
         const uint32_t token = (uint32_t) token_as_ulong;
+        if (!claim_context(self)) {
+            return NULL;
+        }
         const enum gptoss_status status = gptoss_context_append_tokens(
             self->handle, /*num_tokens=*/1, &token);
+        unclaim_context(self);
         if (status != gptoss_status_success) {
             // TODO: set exception
             return NULL;
@@ -109,8 +192,120 @@ static PyObject* PyGPTOSSContext_append(PyGPTOSSContext* self, PyObject* arg) {
     }
 }
 
+// Array of token IDs taken from a Python object: either a view of a buffer of 32-bit integers, or a
+// PyMem_Malloc-allocated copy of a sequence of integers.
+struct token_array {
+    Py_buffer view;
+    uint32_t* copy;
+    const uint32_t* tokens;
+    size_t num_tokens;
+};
+
+static bool is_uint32_buffer(const Py_buffer* view) {
+    if (view->itemsize != sizeof(uint32_t) || view->ndim > 1) {
+        return false;
+    }
+    const char* format = view->format != NULL ? view->format : "B";
+    if (*format == '@' || *format == '=' || *format == '<') {
+        format += 1;
+    }
+    return (format[0] == 'I' || format[0] == 'i' || format[0] == 'L' || format[0] == 'l') && format[1] == '\0';
+}
+
+static bool get_token_array(PyObject* obj, const char* name, bool writable, struct token_array* array) {
+    memset(array, 0, sizeof(struct token_array));
+    if (PyObject_CheckBuffer(obj)) {
+        const int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+        if (PyObject_GetBuffer(obj, &array->view, flags) < 0) {
+            return false;
+        }
+        if (is_uint32_buffer(&array->view)) {
+            array->tokens = (const uint32_t*) array->view.buf;
+            array->num_tokens = (size_t) (array->view.len / sizeof(uint32_t));
+            return true;
+        }
+        PyBuffer_Release(&array->view);
+        if (writable) {
+            PyErr_Format(PyExc_TypeError, "%s must be a buffer of 32-bit integers", name);
+            return false;
+        }
+    } else if (writable) {
+        PyErr_Format(PyExc_TypeError, "%s must be a writable buffer of 32-bit integers", name);
+        return false;
+    }
+
+    PyObject* tokens_fast = PySequence_Fast(obj, "tokens must be a buffer or sequence of integers");
+    if (tokens_fast == NULL) {
+        return false;
+    }
+    const size_t num_tokens = (size_t) PySequence_Fast_GET_SIZE(tokens_fast);
+    array->copy = (uint32_t*) PyMem_Malloc(num_tokens * sizeof(uint32_t));
+    if (array->copy == NULL && num_tokens != 0) {
+        PyErr_NoMemory();
+        Py_DECREF(tokens_fast);
+        return false;
+    }
+    for (size_t t = 0; t < num_tokens; t++) {
+        const unsigned long token = PyLong_AsUnsignedLong(PySequence_Fast_GET_ITEM(tokens_fast, (Py_ssize_t) t));
+        if (token == (unsigned long) -1 && PyErr_Occurred()) {
+            PyMem_Free(array->copy);
+            array->copy = NULL;
+            Py_DECREF(tokens_fast);
+            return false;
+        }
+        array->copy[t] = (uint32_t) token;
+    }
+    Py_DECREF(tokens_fast);
+
+    array->tokens = array->copy;
+    array->num_tokens = num_tokens;
+    return true;
+}
+
+static void release_token_array(struct token_array* array) {
+    if (array->copy != NULL) {
+        PyMem_Free(array->copy);
+    } else if (array->view.obj != NULL) {
+        PyBuffer_Release(&array->view);
+    }
+    memset(array, 0, sizeof(struct token_array));
+}
+
+static PyObject* PyGPTOSSContext_append_tokens(PyGPTOSSContext* self, PyObject* arg) {
+    struct token_array array;
+    if (!get_token_array(arg, "tokens", /*writable=*/false, &array)) {
+        return NULL;
+    }
+
+    if (!claim_context(self)) {
+        release_token_array(&array);
+        return NULL;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_append_tokens(self->handle, array.num_tokens, array.tokens);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    release_token_array(&array);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to append tokens (status %d)", (int) status);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
 static PyObject* PyGPTOSSContext_process(PyGPTOSSContext* self) {
-    const enum gptoss_status status = gptoss_context_process(self->handle);
+    if (!claim_context(self)) {
+        return NULL;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_process(self->handle);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
     if (status != gptoss_status_success) {
         // TODO: set exception
         return NULL;
@@ -119,34 +314,136 @@ static PyObject* PyGPTOSSContext_process(PyGPTOSSContext* self) {
     Py_RETURN_NONE;
 }
 
+static PyObject* PyGPTOSSContext_process_partial(PyGPTOSSContext* self, PyObject* arg) {
+    const size_t max_tokens = PyLong_AsSize_t(arg);
+    if (max_tokens == (size_t) -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if (!claim_context(self)) {
+        return NULL;
+    }
+
+    size_t num_remaining_tokens = 0;
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_process_partial(self->handle, max_tokens, &num_remaining_tokens);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to process tokens (status %d)", (int) status);
+        return NULL;
+    }
+
+    return PyLong_FromSize_t(num_remaining_tokens);
+}
+
+bool parse_stop_tokens(PyObject* stop_tokens_obj, uint32_t** stop_tokens_out, size_t* num_stop_tokens_out) {
+    *stop_tokens_out = NULL;
+    *num_stop_tokens_out = 0;
+    if (stop_tokens_obj == NULL || stop_tokens_obj == Py_None) {
+        return true;
+    }
+
+    PyObject* stop_tokens_fast = PySequence_Fast(stop_tokens_obj, "stop_tokens must be a sequence of integers");
+    if (stop_tokens_fast == NULL) {
+        return false;
+    }
+    const size_t num_stop_tokens = (size_t) PySequence_Fast_GET_SIZE(stop_tokens_fast);
+    uint32_t* stop_tokens = (uint32_t*) PyMem_Malloc(num_stop_tokens * sizeof(uint32_t));
+    if (stop_tokens == NULL) {
+        PyErr_NoMemory();
+        Py_DECREF(stop_tokens_fast);
+        return false;
+    }
+    for (size_t t = 0; t < num_stop_tokens; t++) {
+        const unsigned long stop_token = PyLong_AsUnsignedLong(PySequence_Fast_GET_ITEM(stop_tokens_fast, (Py_ssize_t) t));
+        if (stop_token == (unsigned long) -1 && PyErr_Occurred()) {
+            PyMem_Free(stop_tokens);
+            Py_DECREF(stop_tokens_fast);
+            return false;
+        }
+        stop_tokens[t] = (uint32_t) stop_token;
+    }
+    Py_DECREF(stop_tokens_fast);
+
+    *stop_tokens_out = stop_tokens;
+    *num_stop_tokens_out = num_stop_tokens;
+    return true;
+}
+
 static PyObject* PyGPTOSSContext_sample(PyGPTOSSContext* self, PyObject* args, PyObject* kwargs) {
-    static char *kwlist[] = {"max_output_tokens", "temperature", "seed", NULL};
+    static char *kwlist[] = {"max_output_tokens", "temperature", "seed", "stop_tokens", "top_k", "top_p", "out", NULL};
     PyObject* token_list_obj = NULL;
     uint32_t* token_ptr = NULL;
+    uint32_t* stop_token_ptr = NULL;
+    struct token_array out_array = {0};
+    bool claimed = false;
 
     unsigned int max_output_tokens = 0;
     unsigned long long seed = 0;
     float temperature = 1.0f;
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|$fK", kwlist,
-            &max_output_tokens, &temperature, &seed))
+    PyObject* stop_tokens_obj = NULL;
+    unsigned int top_k = 0;
+    float top_p = 1.0f;
+    PyObject* out_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|$fKOIfO", kwlist,
+            &max_output_tokens, &temperature, &seed, &stop_tokens_obj, &top_k, &top_p, &out_obj))
     {
         return NULL;
     }
 
-    token_ptr = (uint32_t*) PyMem_Malloc(max_output_tokens * sizeof(uint32_t));
-    if (token_ptr == NULL) {
+    if (!claim_context(self)) {
+        return NULL;
+    }
+    claimed = true;
+    if (gptoss_context_set_sampling_params(self->handle, (uint32_t) top_k, top_p) != gptoss_status_success) {
+        PyErr_SetString(PyExc_ValueError, "top_k must not exceed 1024 and top_p must be in (0, 1]");
+        goto error;
+    }
+
+    if (out_obj != NULL && out_obj != Py_None) {
+        // Sample straight into the caller's buffer and return the number of sampled tokens
+        if (!get_token_array(out_obj, "out", /*writable=*/true, &out_array)) {
+            goto error;
+        }
+        if (out_array.num_tokens < (size_t) max_output_tokens) {
+            PyErr_Format(PyExc_ValueError, "out must hold at least max_output_tokens (%u) tokens", max_output_tokens);
+            goto error;
+        }
+        token_ptr = (uint32_t*) out_array.view.buf;
+    } else {
+        token_ptr = (uint32_t*) PyMem_Malloc(max_output_tokens * sizeof(uint32_t));
+        if (token_ptr == NULL) {
+            goto error;
+        }
+    }
+
+    size_t num_stop_tokens = 0;
+    if (!parse_stop_tokens(stop_tokens_obj, &stop_token_ptr, &num_stop_tokens)) {
         goto error;
     }
 
     size_t num_tokens = 0;
-    const enum gptoss_status status = gptoss_context_sample(
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_sample(
         self->handle, temperature, (uint64_t) seed,
-        (size_t) max_output_tokens, token_ptr, &num_tokens);
+        (size_t) max_output_tokens, num_stop_tokens, stop_token_ptr, token_ptr, &num_tokens);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    claimed = false;
     if (status != gptoss_status_success) {
-        // TODO: set exception
+        PyErr_Format(PyExc_RuntimeError, "failed to sample tokens (status %d)", (int) status);
         goto error;
     }
 
+    if (out_array.view.obj != NULL) {
+        release_token_array(&out_array);
+        PyMem_Free(stop_token_ptr);
+        return PyLong_FromSize_t(num_tokens);
+    }
+
     token_list_obj = PyList_New((Py_ssize_t) num_tokens);
     if (token_list_obj == NULL) {
         goto error;
@@ -162,16 +459,381 @@ static PyObject* PyGPTOSSContext_sample(PyGPTOSSContext* self, PyObject* args, P
     }
     
     PyMem_Free(token_ptr);
+    PyMem_Free(stop_token_ptr);
     return token_list_obj;
     
+error:
+    if (claimed) {
+        unclaim_context(self);
+    }
+    if (out_array.view.obj != NULL) {
+        release_token_array(&out_array);
+    } else {
+        PyMem_Free(token_ptr);
+    }
+    PyMem_Free(stop_token_ptr);
+    Py_XDECREF(token_list_obj);
+    return NULL;
+}
+
+static PyObject* PyGPTOSSContext_sample_speculative(PyGPTOSSContext* self, PyObject* args, PyObject* kwargs) {
+    static char *kwlist[] = {"draft", "max_output_tokens", "num_draft_tokens", "temperature", "seed", "stop_tokens", NULL};
+    PyObject* token_list_obj = NULL;
+    uint32_t* token_ptr = NULL;
+    uint32_t* stop_token_ptr = NULL;
+
+    PyGPTOSSContext* draft = NULL;
+    unsigned int max_output_tokens = 0;
+    unsigned int num_draft_tokens = 4;
+    float temperature = 1.0f;
+    unsigned long long seed = 0;
+    PyObject* stop_tokens_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!I|$IfKO", kwlist,
+            &PyGPTOSSContext_Type, &draft, &max_output_tokens, &num_draft_tokens, &temperature, &seed, &stop_tokens_obj))
+    {
+        return NULL;
+    }
+    if (draft->handle == self->handle) {
+        PyErr_SetString(PyExc_ValueError, "draft must be a different Context");
+        return NULL;
+    }
+
+    size_t num_stop_tokens = 0;
+    if (!parse_stop_tokens(stop_tokens_obj, &stop_token_ptr, &num_stop_tokens)) {
+        return NULL;
+    }
+
+    token_ptr = (uint32_t*) PyMem_Malloc(max_output_tokens * sizeof(uint32_t));
+    if (token_ptr == NULL && max_output_tokens != 0) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    if (!claim_context(self)) {
+        goto error;
+    }
+    if (!claim_context(draft)) {
+        unclaim_context(self);
+        goto error;
+    }
+
+    size_t num_tokens = 0;
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_sample_speculative(
+        self->handle, draft->handle, (size_t) num_draft_tokens, temperature, (uint64_t) seed,
+        (size_t) max_output_tokens, num_stop_tokens, stop_token_ptr, token_ptr, &num_tokens);
+    Py_END_ALLOW_THREADS
+    unclaim_context(draft);
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to sample tokens speculatively (status %d)", (int) status);
+        goto error;
+    }
+
+    token_list_obj = PyList_New((Py_ssize_t) num_tokens);
+    if (token_list_obj == NULL) {
+        goto error;
+    }
+
+    for (size_t t = 0; t < num_tokens; t++) {
+        PyObject* token_obj = PyLong_FromUnsignedLong((unsigned long) token_ptr[t]);
+        if (token_obj == NULL) {
+            goto error;
+        }
+
+        PyList_SET_ITEM(token_list_obj, (Py_ssize_t) t, token_obj);
+    }
+
+    PyMem_Free(token_ptr);
+    PyMem_Free(stop_token_ptr);
+    return token_list_obj;
+
 error:
     PyMem_Free(token_ptr);
+    PyMem_Free(stop_token_ptr);
     Py_XDECREF(token_list_obj);
     return NULL;
 }
 
+static PyObject* PyGPTOSSContext_sample_stream(PyGPTOSSContext* self, PyObject* args, PyObject* kwargs) {
+    static char *kwlist[] = {"max_output_tokens", "temperature", "seed", "stop_tokens", "top_k", "top_p", NULL};
+    uint32_t* stop_token_ptr = NULL;
+
+    unsigned int max_output_tokens = 0;
+    unsigned long long seed = 0;
+    float temperature = 1.0f;
+    PyObject* stop_tokens_obj = NULL;
+    unsigned int top_k = 0;
+    float top_p = 1.0f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|$fKOIf", kwlist,
+            &max_output_tokens, &temperature, &seed, &stop_tokens_obj, &top_k, &top_p))
+    {
+        return NULL;
+    }
+
+    size_t num_stop_tokens = 0;
+    if (!parse_stop_tokens(stop_tokens_obj, &stop_token_ptr, &num_stop_tokens)) {
+        return NULL;
+    }
+
+    PyGPTOSSTokenStream* stream = PyObject_New(PyGPTOSSTokenStream, &PyGPTOSSTokenStream_Type);
+    if (stream == NULL) {
+        PyMem_Free(stop_token_ptr);
+        return NULL;
+    }
+    Py_INCREF(self);
+    stream->context = self;
+
+    if (!claim_context(self)) {
+        PyMem_Free(stop_token_ptr);
+        Py_DECREF(stream);
+        return NULL;
+    }
+    if (gptoss_context_set_sampling_params(self->handle, (uint32_t) top_k, top_p) != gptoss_status_success) {
+        unclaim_context(self);
+        PyErr_SetString(PyExc_ValueError, "top_k must not exceed 1024 and top_p must be in (0, 1]");
+        PyMem_Free(stop_token_ptr);
+        Py_DECREF(stream);
+        return NULL;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_stream_begin(
+        self->handle, temperature, (uint64_t) seed,
+        (size_t) max_output_tokens, num_stop_tokens, stop_token_ptr);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    PyMem_Free(stop_token_ptr);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to start token stream (status %d)", (int) status);
+        Py_DECREF(stream);
+        return NULL;
+    }
+
+    return (PyObject*) stream;
+}
+
+static PyObject* PyGPTOSSContext_score(PyGPTOSSContext* self, PyObject* arg) {
+    PyObject* logprob_list_obj = NULL;
+    float* logprob_ptr = NULL;
+
+    struct token_array array;
+    if (!get_token_array(arg, "tokens", /*writable=*/false, &array)) {
+        return NULL;
+    }
+    const size_t num_tokens = array.num_tokens;
+    logprob_ptr = (float*) PyMem_Malloc(num_tokens * sizeof(float));
+    if (logprob_ptr == NULL && num_tokens != 0) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    if (!claim_context(self)) {
+        goto error;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_score(self->handle, num_tokens, array.tokens, logprob_ptr);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to score tokens (status %d)", (int) status);
+        goto error;
+    }
+
+    logprob_list_obj = PyList_New((Py_ssize_t) num_tokens);
+    if (logprob_list_obj == NULL) {
+        goto error;
+    }
+
+    for (size_t t = 0; t < num_tokens; t++) {
+        PyObject* logprob_obj = PyFloat_FromDouble((double) logprob_ptr[t]);
+        if (logprob_obj == NULL) {
+            goto error;
+        }
+
+        PyList_SET_ITEM(logprob_list_obj, (Py_ssize_t) t, logprob_obj);
+    }
+
+    release_token_array(&array);
+    PyMem_Free(logprob_ptr);
+    return logprob_list_obj;
+
+error:
+    release_token_array(&array);
+    PyMem_Free(logprob_ptr);
+    Py_XDECREF(logprob_list_obj);
+    return NULL;
+}
+
+static PyObject* PyGPTOSSContext_start_profiling(PyGPTOSSContext* self) {
+    if (!claim_context(self)) {
+        return NULL;
+    }
+    const enum gptoss_status status = gptoss_context_start_profiling(self->handle);
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to start profiling (status %d)", (int) status);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyGPTOSSContext_stop_profiling(PyGPTOSSContext* self) {
+    if (!claim_context(self)) {
+        return NULL;
+    }
+    const enum gptoss_status status = gptoss_context_stop_profiling(self->handle);
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to stop profiling (status %d)", (int) status);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyGPTOSSContext_get_profile(PyGPTOSSContext* self) {
+    const char** kernel_names = NULL;
+    uint32_t* blocks = NULL;
+    uint64_t* num_launches = NULL;
+    double* gpu_seconds = NULL;
+    PyObject* profile_list_obj = NULL;
+    bool claimed = false;
+
+    if (!claim_context(self)) {
+        return NULL;
+    }
+    claimed = true;
+
+    size_t num_entries = 0;
+    uint64_t num_untimed_launches = 0;
+    enum gptoss_status status = gptoss_context_get_profile(
+        self->handle, NULL, NULL, NULL, NULL, /*max_entries=*/0, &num_entries, &num_untimed_launches);
+    if (status != gptoss_status_success && status != gptoss_status_insufficient_memory) {
+        PyErr_Format(PyExc_RuntimeError, "failed to query profile (status %d)", (int) status);
+        goto error;
+    }
+
+    const size_t max_entries = num_entries;
+    if (max_entries != 0) {
+        kernel_names = (const char**) PyMem_Malloc(max_entries * sizeof(const char*));
+        blocks = (uint32_t*) PyMem_Malloc(max_entries * sizeof(uint32_t));
+        num_launches = (uint64_t*) PyMem_Malloc(max_entries * sizeof(uint64_t));
+        gpu_seconds = (double*) PyMem_Malloc(max_entries * sizeof(double));
+        if (kernel_names == NULL || blocks == NULL || num_launches == NULL || gpu_seconds == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+
+        status = gptoss_context_get_profile(
+            self->handle, kernel_names, blocks, num_launches, gpu_seconds, max_entries, &num_entries, &num_untimed_launches);
+        if (status != gptoss_status_success) {
+            PyErr_Format(PyExc_RuntimeError, "failed to query profile (status %d)", (int) status);
+            goto error;
+        }
+    }
+    // Kernel names are static strings, so the profile can be converted after the Context is released.
+    unclaim_context(self);
+    claimed = false;
+
+    profile_list_obj = PyList_New((Py_ssize_t) num_entries);
+    if (profile_list_obj == NULL) {
+        goto error;
+    }
+
+    for (size_t i = 0; i < num_entries; i++) {
+        PyObject* entry_obj = NULL;
+        if (blocks[i] == UINT32_MAX) {
+            entry_obj = Py_BuildValue("(sOKd)", kernel_names[i], Py_None, (unsigned long long) num_launches[i], gpu_seconds[i]);
+        } else {
+            entry_obj = Py_BuildValue("(sIKd)", kernel_names[i], (unsigned int) blocks[i], (unsigned long long) num_launches[i], gpu_seconds[i]);
+        }
+        if (entry_obj == NULL) {
+            goto error;
+        }
+
+        PyList_SET_ITEM(profile_list_obj, (Py_ssize_t) i, entry_obj);
+    }
+
+    PyMem_Free(kernel_names);
+    PyMem_Free(blocks);
+    PyMem_Free(num_launches);
+    PyMem_Free(gpu_seconds);
+    return profile_list_obj;
+
+error:
+    if (claimed) {
+        unclaim_context(self);
+    }
+    PyMem_Free(kernel_names);
+    PyMem_Free(blocks);
+    PyMem_Free(num_launches);
+    PyMem_Free(gpu_seconds);
+    Py_XDECREF(profile_list_obj);
+    return NULL;
+}
+
+static PyObject* PyGPTOSSContext_save(PyGPTOSSContext* self, PyObject* file) {
+    const int fd = PyObject_AsFileDescriptor(file);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (!claim_context(self)) {
+        return NULL;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_save(self->handle, fd);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to save the Context (status %d)", (int) status);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyGPTOSSContext_load(PyGPTOSSContext* self, PyObject* file) {
+    const int fd = PyObject_AsFileDescriptor(file);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (!claim_context(self)) {
+        return NULL;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_load(self->handle, fd);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to load the Context (status %d)", (int) status);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
 static PyObject* PyGPTOSSContext_reset(PyGPTOSSContext* self) {
-    const enum gptoss_status status = gptoss_context_reset(self->handle);
+    if (!claim_context(self)) {
+        return NULL;
+    }
+
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_reset(self->handle);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self);
     if (status != gptoss_status_success) {
         // TODO: set exception
         return NULL;
@@ -182,16 +844,31 @@ static PyObject* PyGPTOSSContext_reset(PyGPTOSSContext* self) {
 
 static PyMethodDef PyGPTOSSContext_methods[] = {
     {"__copy__", (PyCFunction) PyGPTOSSContext_copy, METH_NOARGS, "Create a copy of the Context"},
+    {"fork", (PyCFunction) PyGPTOSSContext_fork, METH_NOARGS, "Create an independent copy of the Context with the same tokens and KV cache"},
     {"append", (PyCFunction) PyGPTOSSContext_append, METH_O, "Append bytes to the Context"},
+    {"append_tokens", (PyCFunction) PyGPTOSSContext_append_tokens, METH_O, "Append a buffer or sequence of token IDs to the Context"},
     {"process", (PyCFunction) PyGPTOSSContext_process, METH_NOARGS, "Process tokens in the Context"},
+    {"process_partial", (PyCFunction) PyGPTOSSContext_process_partial, METH_O, "Process up to the given number of pending tokens and return the number of tokens left"},
     {"sample", (PyCFunction) PyGPTOSSContext_sample, METH_VARARGS | METH_KEYWORDS, "Sample token predictions from the Context"},
+    {"sample_speculative", (PyCFunction) PyGPTOSSContext_sample_speculative, METH_VARARGS | METH_KEYWORDS, "Sample token predictions using a draft Context with the same tokens for speculative decoding"},
+    {"sample_stream", (PyCFunction) PyGPTOSSContext_sample_stream, METH_VARARGS | METH_KEYWORDS, "Iterate over token predictions as they are generated"},
+    {"score", (PyCFunction) PyGPTOSSContext_score, METH_O, "Append tokens to the Context and return their log-probabilities"},
+    {"start_profiling", (PyCFunction) PyGPTOSSContext_start_profiling, METH_NOARGS, "Start collecting a per-kernel GPU time profile"},
+    {"stop_profiling", (PyCFunction) PyGPTOSSContext_stop_profiling, METH_NOARGS, "Stop collecting the GPU time profile"},
+    {"get_profile", (PyCFunction) PyGPTOSSContext_get_profile, METH_NOARGS, "Return the GPU time profile as a list of (kernel, block, launches, seconds) tuples"},
+    {"save", (PyCFunction) PyGPTOSSContext_save, METH_O, "Write the tokens and KV cache of the Context to a file"},
+    {"load", (PyCFunction) PyGPTOSSContext_load, METH_O, "Replace the content of the Context with one saved to a file"},
     {"reset", (PyCFunction) PyGPTOSSContext_reset, METH_NOARGS, "Discard the content of the Context"},
     {NULL},
 };
 
 static PyObject* PyGPTOSSContext_get_num_tokens(PyGPTOSSContext* self, void* closure) {
+    if (!claim_context(self)) {
+        return NULL;
+    }
     size_t num_tokens = 0;
     const enum gptoss_status status = gptoss_context_get_num_tokens(self->handle, &num_tokens);
+    unclaim_context(self);
     if (status != gptoss_status_success) {
         // TODO: set exception
         return NULL;
@@ -214,6 +891,12 @@ static PyObject* PyGPTOSSContext_get_max_tokens(PyGPTOSSContext* self, void* clo
 static PyObject* PyGPTOSSContext_get_tokens(PyGPTOSSContext* self, void* closure) {
     PyObject* token_list_obj = NULL;
     uint32_t* token_ptr = NULL;
+    bool claimed = false;
+
+    if (!claim_context(self)) {
+        return NULL;
+    }
+    claimed = true;
 
     size_t num_tokens = 0;
     gptoss_context_get_tokens(self->handle, /*tokens_out=*/NULL, /*max_tokens=*/0, &num_tokens);
@@ -231,6 +914,8 @@ static PyObject* PyGPTOSSContext_get_tokens(PyGPTOSSContext* self, void* closure
             goto error;
         }
     }
+    unclaim_context(self);
+    claimed = false;
 
     token_list_obj = PyList_New((Py_ssize_t) num_tokens);
     if (token_list_obj == NULL) {
@@ -250,11 +935,35 @@ static PyObject* PyGPTOSSContext_get_tokens(PyGPTOSSContext* self, void* closure
     return token_list_obj;
 
 error:
+    if (claimed) {
+        unclaim_context(self);
+    }
     PyMem_Free(token_ptr);
     Py_XDECREF(token_list_obj);
     return NULL;
 }
 
+static PyObject* PyGPTOSSContext_get_stats(PyGPTOSSContext* self, void* closure) {
+    struct gptoss_context_stats stats;
+    const enum gptoss_status status = gptoss_context_get_stats(self->handle, &stats);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to query Context statistics (status %d)", (int) status);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:d,s:d,s:n,s:n,s:n,s:n,s:n}",
+        "num_prefill_tokens", (unsigned long long) stats.num_prefill_tokens,
+        "num_decode_tokens", (unsigned long long) stats.num_decode_tokens,
+        "num_command_buffers", (unsigned long long) stats.num_command_buffers,
+        "gpu_busy_seconds", stats.gpu_busy_seconds,
+        "wait_seconds", stats.wait_seconds,
+        "num_kv_tokens", (Py_ssize_t) stats.num_kv_tokens,
+        "num_allocated_kv_tokens", (Py_ssize_t) stats.num_allocated_kv_tokens,
+        "max_kv_tokens", (Py_ssize_t) stats.max_kv_tokens,
+        "kvcache_size", (Py_ssize_t) stats.kvcache_size,
+        "allocation_size", (Py_ssize_t) stats.allocation_size);
+}
+
 static PyGetSetDef PyGPTOSSContext_getseters[] = {
     (PyGetSetDef) {
         .name = "num_tokens",
@@ -271,6 +980,11 @@ static PyGetSetDef PyGPTOSSContext_getseters[] = {
         .get = (getter) PyGPTOSSContext_get_tokens,
         .doc = "List of token IDs in the context",
     },
+    (PyGetSetDef) {
+        .name = "stats",
+        .get = (getter) PyGPTOSSContext_get_stats,
+        .doc = "Dictionary of runtime statistics of the context",
+    },
     {NULL}  /* Sentinel */
 };
 
@@ -288,3 +1002,49 @@ PyTypeObject PyGPTOSSContext_Type = {
     .tp_init = (initproc) PyGPTOSSContext_init,
     .tp_dealloc = (destructor) PyGPTOSSContext_dealloc,
 };
+
+static void PyGPTOSSTokenStream_dealloc(PyGPTOSSTokenStream* self) {
+    // Note: a newer stream on the same Context would also be ended here. If another thread is using the Context, the
+    // call it is in has already ended the stream, as every Context call but streaming itself ends the active stream.
+    PyGPTOSSContext* owner = self->context->owner != NULL ? self->context->owner : self->context;
+    if (!owner->busy) {
+        (void) gptoss_context_stream_end(self->context->handle);
+    }
+    Py_CLEAR(self->context);
+    PyObject_Del((PyObject*) self);
+}
+
+static PyObject* PyGPTOSSTokenStream_next(PyGPTOSSTokenStream* self) {
+    if (!claim_context(self->context)) {
+        return NULL;
+    }
+
+    uint32_t token = 0;
+    size_t num_tokens = 0;
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_context_stream_next(self->context->handle, &token, &num_tokens);
+    Py_END_ALLOW_THREADS
+    unclaim_context(self->context);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to generate token (status %d)", (int) status);
+        return NULL;
+    }
+    if (num_tokens == 0) {
+        // Returning NULL without an exception set signals StopIteration
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLong((unsigned long) token);
+}
+
+PyTypeObject PyGPTOSSTokenStream_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gptoss.TokenStream",
+    .tp_basicsize = sizeof(PyGPTOSSTokenStream),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Iterator over tokens generated by Context.sample_stream",
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc) PyGPTOSSTokenStream_next,
+    .tp_dealloc = (destructor) PyGPTOSSTokenStream_dealloc,
+};
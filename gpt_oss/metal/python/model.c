@@ -6,13 +6,21 @@
 
 
 static int PyGPTOSSModel_init(PyGPTOSSModel* self, PyObject* args, PyObject* kwargs) {
+    static char *kwlist[] = {"path", "expert_budget_bytes", NULL};
     enum gptoss_status status;
     const char* filepath;
+    Py_ssize_t expert_budget_bytes = 0;
 
-    if (!PyArg_ParseTuple(args, "s", &filepath)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|$n", kwlist, &filepath, &expert_budget_bytes)) {
         return -1;
     }
-    status = gptoss_model_create_from_file(filepath, &self->handle, 0);
+    if (expert_budget_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "expert_budget_bytes must be non-negative");
+        return -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_model_create_from_file_with_expert_budget(filepath, &self->handle, 0, (size_t) expert_budget_bytes);
+    Py_END_ALLOW_THREADS
     if (status != gptoss_status_success) {
         // TODO: set exception
         return -1;
@@ -37,8 +45,30 @@ static PyObject* PyGPTOSSModel_copy(PyGPTOSSModel* self) {
     return (PyObject*) copy;
 }
 
+static PyObject* PyGPTOSSModel_start_expert_stats(PyGPTOSSModel* self) {
+    const enum gptoss_status status = gptoss_model_start_expert_stats(self->handle);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to start counting expert routings (status %d)", (int) status);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyGPTOSSModel_stop_expert_stats(PyGPTOSSModel* self) {
+    const enum gptoss_status status = gptoss_model_stop_expert_stats(self->handle);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to stop counting expert routings (status %d)", (int) status);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef PyGPTOSSModel_methods[] = {
     {"__copy__", (PyCFunction) PyGPTOSSModel_copy, METH_NOARGS, "Create a copy of the Model"},
+    {"start_expert_stats", (PyCFunction) PyGPTOSSModel_start_expert_stats, METH_NOARGS, "Start counting the tokens routed to each MoE expert"},
+    {"stop_expert_stats", (PyCFunction) PyGPTOSSModel_stop_expert_stats, METH_NOARGS, "Stop counting the tokens routed to each MoE expert"},
     {NULL},
 };
 
@@ -64,6 +94,121 @@ static PyObject *PyGPTOSSModel_get_tokenizer(PyGPTOSSModel* self, void* closure)
     return tokenizer;
 }
 
+static PyObject *PyGPTOSSModel_get_stats(PyGPTOSSModel* self, void* closure) {
+    struct gptoss_model_stats stats;
+    const enum gptoss_status status = gptoss_model_get_stats(self->handle, &stats);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to query Model statistics (status %d)", (int) status);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:d,s:d,s:n,s:n,s:n,s:n,s:n,s:n}",
+        "num_prefill_tokens", (unsigned long long) stats.num_prefill_tokens,
+        "num_decode_tokens", (unsigned long long) stats.num_decode_tokens,
+        "num_command_buffers", (unsigned long long) stats.num_command_buffers,
+        "gpu_busy_seconds", stats.gpu_busy_seconds,
+        "wait_seconds", stats.wait_seconds,
+        "num_kvcache_pool_tokens", (Py_ssize_t) stats.num_kvcache_pool_tokens,
+        "num_used_kvcache_pool_tokens", (Py_ssize_t) stats.num_used_kvcache_pool_tokens,
+        "kvcache_pool_size", (Py_ssize_t) stats.kvcache_pool_size,
+        "weights_size", (Py_ssize_t) stats.weights_size,
+        "metal_allocation_size", (Py_ssize_t) stats.metal_allocation_size,
+        "num_resident_experts", (Py_ssize_t) stats.num_resident_experts);
+}
+
+static PyObject *PyGPTOSSModel_get_expert_stats(PyGPTOSSModel* self, void* closure) {
+    PyObject* expert_list_obj = NULL;
+    uint64_t* num_selections = NULL;
+
+    size_t num_experts = 0;
+    gptoss_model_get_expert_stats(self->handle, /*num_selections_out=*/NULL, /*max_experts=*/0, &num_experts);
+
+    num_selections = (uint64_t*) PyMem_Malloc(num_experts * sizeof(uint64_t));
+    if (num_selections == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    const enum gptoss_status status = gptoss_model_get_expert_stats(self->handle, num_selections, num_experts, &num_experts);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to query expert statistics (status %d)", (int) status);
+        goto error;
+    }
+
+    expert_list_obj = PyList_New((Py_ssize_t) num_experts);
+    if (expert_list_obj == NULL) {
+        goto error;
+    }
+
+    for (size_t i = 0; i < num_experts; i++) {
+        PyObject* count_obj = PyLong_FromUnsignedLongLong((unsigned long long) num_selections[i]);
+        if (count_obj == NULL) {
+            goto error;
+        }
+
+        PyList_SET_ITEM(expert_list_obj, (Py_ssize_t) i, count_obj);
+    }
+
+    PyMem_Free(num_selections);
+    return expert_list_obj;
+
+error:
+    PyMem_Free(num_selections);
+    Py_XDECREF(expert_list_obj);
+    return NULL;
+}
+
+static PyObject *PyGPTOSSModel_get_expert_residency_stats(PyGPTOSSModel* self, void* closure) {
+    PyObject* expert_list_obj = NULL;
+    uint64_t* hits = NULL;
+    uint64_t* misses = NULL;
+
+    size_t num_experts = 0;
+    enum gptoss_status status = gptoss_model_get_expert_residency_stats(self->handle,
+        /*hits_out=*/NULL, /*misses_out=*/NULL, /*max_experts=*/0, &num_experts);
+    if (status == gptoss_status_invalid_state) {
+        PyErr_SetString(PyExc_RuntimeError, "Model does not manage expert residency");
+        goto error;
+    }
+
+    hits = (uint64_t*) PyMem_Malloc(num_experts * sizeof(uint64_t));
+    misses = (uint64_t*) PyMem_Malloc(num_experts * sizeof(uint64_t));
+    if (hits == NULL || misses == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    status = gptoss_model_get_expert_residency_stats(self->handle, hits, misses, num_experts, &num_experts);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to query expert residency statistics (status %d)", (int) status);
+        goto error;
+    }
+
+    expert_list_obj = PyList_New((Py_ssize_t) num_experts);
+    if (expert_list_obj == NULL) {
+        goto error;
+    }
+
+    for (size_t i = 0; i < num_experts; i++) {
+        PyObject* counts_obj = Py_BuildValue("(KK)", (unsigned long long) hits[i], (unsigned long long) misses[i]);
+        if (counts_obj == NULL) {
+            goto error;
+        }
+
+        PyList_SET_ITEM(expert_list_obj, (Py_ssize_t) i, counts_obj);
+    }
+
+    PyMem_Free(hits);
+    PyMem_Free(misses);
+    return expert_list_obj;
+
+error:
+    PyMem_Free(hits);
+    PyMem_Free(misses);
+    Py_XDECREF(expert_list_obj);
+    return NULL;
+}
+
 static PyGetSetDef PyGPTOSSModel_getseters[] = {
     (PyGetSetDef) {
         .name = "max_context_length",
@@ -75,6 +220,22 @@ static PyGetSetDef PyGPTOSSModel_getseters[] = {
         .get = (getter) PyGPTOSSModel_get_tokenizer,
         .doc = "Tokenizer object associated with the model",
     },
+    (PyGetSetDef) {
+        .name = "stats",
+        .get = (getter) PyGPTOSSModel_get_stats,
+        .doc = "Dictionary of runtime statistics of the model, summed over all its contexts",
+    },
+    (PyGetSetDef) {
+        .name = "expert_stats",
+        .get = (getter) PyGPTOSSModel_get_expert_stats,
+        .doc = "List of the number of tokens routed to each MoE expert while counted, ordered by block, then by expert index",
+    },
+    (PyGetSetDef) {
+        .name = "expert_residency_stats",
+        .get = (getter) PyGPTOSSModel_get_expert_residency_stats,
+        .doc = "List of (hits, misses) tuples of token routings to each MoE expert while it was and wasn't resident, "
+            "for models created with an expert budget",
+    },
     {NULL}  // Sentinel
 };
 
@@ -20,6 +20,7 @@ PyMODINIT_FUNC PyInit__metal(void) {
     PyObject* model_type = NULL;
     PyObject* tokenizer_type = NULL;
     PyObject* context_type = NULL;
+    PyObject* scheduler_type = NULL;
 
     if (PyType_Ready(&PyGPTOSSModel_Type) < 0) {
         goto error;
@@ -39,6 +40,16 @@ PyMODINIT_FUNC PyInit__metal(void) {
     context_type = (PyObject*) &PyGPTOSSContext_Type;
     Py_INCREF(context_type);
 
+    if (PyType_Ready(&PyGPTOSSTokenStream_Type) < 0) {
+        goto error;
+    }
+
+    if (PyType_Ready(&PyGPTOSSScheduler_Type) < 0) {
+        goto error;
+    }
+    scheduler_type = (PyObject*) &PyGPTOSSScheduler_Type;
+    Py_INCREF(scheduler_type);
+
     module = PyModule_Create(&metal_module);
     if (module == NULL) {
         goto error;
@@ -56,9 +67,14 @@ PyMODINIT_FUNC PyInit__metal(void) {
         goto error;
     }
 
+    if (PyModule_AddObject(module, "Scheduler", scheduler_type) < 0) {
+        goto error;
+    }
+
     return module;
 
 error:
+    Py_XDECREF(scheduler_type);
     Py_XDECREF(context_type);
     Py_XDECREF(tokenizer_type);
     Py_XDECREF(model_type);
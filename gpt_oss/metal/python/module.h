@@ -1,5 +1,7 @@
 #include <Python.h>
 
+#include <stdbool.h>
+
 #include <gpt-oss.h>
 
 typedef struct {
@@ -12,11 +14,38 @@ typedef struct {
     gptoss_tokenizer_t handle;
 } PyGPTOSSTokenizer;
 
-typedef struct {
+typedef struct PyGPTOSSContext {
     PyObject_HEAD
     gptoss_context_t handle;
+    // Whether a method call is using the handle, see claim_context. Only meaningful in objects that own their claim.
+    bool busy;
+    // Object whose claim this object shares, or NULL if it owns its claim. Copies share the claim of the original.
+    struct PyGPTOSSContext* owner;
 } PyGPTOSSContext;
 
 extern PyTypeObject PyGPTOSSModel_Type;
 extern PyTypeObject PyGPTOSSTokenizer_Type;
+typedef struct {
+    PyObject_HEAD
+    PyGPTOSSContext* context;
+} PyGPTOSSTokenStream;
+
+typedef struct {
+    PyObject_HEAD
+    gptoss_scheduler_t handle;
+    // Contexts of the unfinished requests, keyed by request ID. Each of them is claimed until its request finishes.
+    PyObject* requests;
+    // Whether a method call is using the handle with the GIL released.
+    bool busy;
+} PyGPTOSSScheduler;
+
 extern PyTypeObject PyGPTOSSContext_Type;
+extern PyTypeObject PyGPTOSSTokenStream_Type;
+extern PyTypeObject PyGPTOSSScheduler_Type;
+
+// Claims the Context object for the duration of a call, see python/context.c. On failure, raises RuntimeError.
+bool claim_context(PyGPTOSSContext* self);
+void unclaim_context(PyGPTOSSContext* self);
+
+// Converts an optional sequence of integers into a PyMem_Malloc-allocated array of token IDs.
+bool parse_stop_tokens(PyObject* stop_tokens_obj, uint32_t** stop_tokens_out, size_t* num_stop_tokens_out);
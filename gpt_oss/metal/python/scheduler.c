@@ -0,0 +1,268 @@
+#include <Python.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <gpt-oss.h>
+
+#include "module.h"
+
+
+// Like Contexts, the Scheduler is claimed for the duration of calls, as step releases the GIL.
+static bool claim_scheduler(PyGPTOSSScheduler* self) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Scheduler is in use by another thread");
+        return false;
+    }
+    self->busy = true;
+    return true;
+}
+
+// Removes a request from the requests dictionary and unclaims its Context.
+static int finish_request(PyGPTOSSScheduler* self, PyObject* request_id_obj) {
+    PyObject* context = PyDict_GetItemWithError(self->requests, request_id_obj);
+    if (context == NULL) {
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    unclaim_context((PyGPTOSSContext*) context);
+    return PyDict_DelItem(self->requests, request_id_obj);
+}
+
+static int PyGPTOSSScheduler_init(PyGPTOSSScheduler* self, PyObject* args, PyObject* kwargs) {
+    static char *kwlist[] = {"model", "max_batch_tokens", NULL};
+    PyObject* model = NULL;
+    Py_ssize_t max_batch_tokens = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$n", kwlist, &model, &max_batch_tokens)) {
+        return -1;
+    }
+    if (!PyObject_TypeCheck(model, &PyGPTOSSModel_Type)) {
+        PyErr_SetString(PyExc_TypeError, "model must be an gptoss.Model object");
+        return -1;
+    }
+    if (max_batch_tokens < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_batch_tokens must be a non-negative integer");
+        return -1;
+    }
+
+    self->busy = false;
+    self->requests = PyDict_New();
+    if (self->requests == NULL) {
+        return -1;
+    }
+
+    const enum gptoss_status status = gptoss_scheduler_create(
+        ((const PyGPTOSSModel*) model)->handle, (size_t) max_batch_tokens, &self->handle);
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to create the Scheduler (status %d)", (int) status);
+        return -1;
+    }
+    return 0;
+}
+
+static void PyGPTOSSScheduler_dealloc(PyGPTOSSScheduler* self) {
+    (void) gptoss_scheduler_release(self->handle);
+    self->handle = NULL;
+    if (self->requests != NULL) {
+        PyObject* request_id_obj = NULL;
+        PyObject* context = NULL;
+        Py_ssize_t pos = 0;
+        while (PyDict_Next(self->requests, &pos, &request_id_obj, &context)) {
+            unclaim_context((PyGPTOSSContext*) context);
+        }
+        Py_CLEAR(self->requests);
+    }
+    PyObject_Del((PyObject*) self);
+}
+
+static PyObject* PyGPTOSSScheduler_submit(PyGPTOSSScheduler* self, PyObject* args, PyObject* kwargs) {
+    static char *kwlist[] = {"context", "max_output_tokens", "temperature", "seed", "stop_tokens", NULL};
+    PyObject* context = NULL;
+    unsigned int max_output_tokens = 0;
+    float temperature = 1.0f;
+    unsigned long long seed = 0;
+    PyObject* stop_tokens_obj = NULL;
+    uint32_t* stop_token_ptr = NULL;
+    PyObject* request_id_obj = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OI|$fKO", kwlist,
+            &context, &max_output_tokens, &temperature, &seed, &stop_tokens_obj))
+    {
+        return NULL;
+    }
+    if (!PyObject_TypeCheck(context, &PyGPTOSSContext_Type)) {
+        PyErr_SetString(PyExc_TypeError, "context must be an gptoss.Context object");
+        return NULL;
+    }
+
+    size_t num_stop_tokens = 0;
+    if (!parse_stop_tokens(stop_tokens_obj, &stop_token_ptr, &num_stop_tokens)) {
+        return NULL;
+    }
+
+    if (!claim_scheduler(self)) {
+        PyMem_Free(stop_token_ptr);
+        return NULL;
+    }
+    // The Context stays claimed until its request finishes or is cancelled, as it must not be used meanwhile.
+    if (!claim_context((PyGPTOSSContext*) context)) {
+        self->busy = false;
+        PyMem_Free(stop_token_ptr);
+        return NULL;
+    }
+
+    uint64_t request_id = 0;
+    const enum gptoss_status status = gptoss_scheduler_submit(self->handle, ((PyGPTOSSContext*) context)->handle,
+        temperature, (uint64_t) seed, (size_t) max_output_tokens, num_stop_tokens, stop_token_ptr, &request_id);
+    PyMem_Free(stop_token_ptr);
+    if (status != gptoss_status_success) {
+        unclaim_context((PyGPTOSSContext*) context);
+        self->busy = false;
+        PyErr_Format(PyExc_RuntimeError, "failed to submit the request (status %d)", (int) status);
+        return NULL;
+    }
+
+    request_id_obj = PyLong_FromUnsignedLongLong((unsigned long long) request_id);
+    if (request_id_obj == NULL || PyDict_SetItem(self->requests, request_id_obj, context) < 0) {
+        (void) gptoss_scheduler_cancel(self->handle, request_id);
+        unclaim_context((PyGPTOSSContext*) context);
+        self->busy = false;
+        Py_XDECREF(request_id_obj);
+        return NULL;
+    }
+    self->busy = false;
+    return request_id_obj;
+}
+
+static PyObject* PyGPTOSSScheduler_cancel(PyGPTOSSScheduler* self, PyObject* request_id_obj) {
+    const unsigned long long request_id = PyLong_AsUnsignedLongLong(request_id_obj);
+    if (request_id == (unsigned long long) -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if (!claim_scheduler(self)) {
+        return NULL;
+    }
+    const enum gptoss_status status = gptoss_scheduler_cancel(self->handle, (uint64_t) request_id);
+    self->busy = false;
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_KeyError, "Scheduler has no request %llu", request_id);
+        return NULL;
+    }
+    if (finish_request(self, request_id_obj) < 0) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyGPTOSSScheduler_step(PyGPTOSSScheduler* self) {
+    PyObject* output_list_obj = NULL;
+    uint64_t* request_ids = NULL;
+    uint32_t* tokens = NULL;
+    uint8_t* finished = NULL;
+    bool claimed = false;
+
+    if (!claim_scheduler(self)) {
+        return NULL;
+    }
+    claimed = true;
+
+    // Every request produces at most one token per step.
+    size_t max_outputs = 0;
+    gptoss_scheduler_get_num_requests(self->handle, &max_outputs);
+    if (max_outputs == 0) {
+        self->busy = false;
+        return PyList_New(0);
+    }
+
+    request_ids = (uint64_t*) PyMem_Malloc(max_outputs * sizeof(uint64_t));
+    tokens = (uint32_t*) PyMem_Malloc(max_outputs * sizeof(uint32_t));
+    finished = (uint8_t*) PyMem_Malloc(max_outputs * sizeof(uint8_t));
+    if (request_ids == NULL || tokens == NULL || finished == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    size_t num_outputs = 0;
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_scheduler_step(self->handle, max_outputs, request_ids, tokens, finished, &num_outputs);
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+    claimed = false;
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_RuntimeError, "failed to run a Scheduler step (status %d)", (int) status);
+        goto error;
+    }
+
+    output_list_obj = PyList_New((Py_ssize_t) num_outputs);
+    if (output_list_obj == NULL) {
+        goto error;
+    }
+
+    for (size_t i = 0; i < num_outputs; i++) {
+        PyObject* output_obj = Py_BuildValue("(KkO)", (unsigned long long) request_ids[i], (unsigned long) tokens[i],
+            finished[i] != 0 ? Py_True : Py_False);
+        if (output_obj == NULL) {
+            goto error;
+        }
+        PyList_SET_ITEM(output_list_obj, (Py_ssize_t) i, output_obj);
+
+        if (finished[i] != 0 && finish_request(self, PyTuple_GET_ITEM(output_obj, 0)) < 0) {
+            goto error;
+        }
+    }
+
+    PyMem_Free(request_ids);
+    PyMem_Free(tokens);
+    PyMem_Free(finished);
+    return output_list_obj;
+
+error:
+    if (claimed) {
+        self->busy = false;
+    }
+    PyMem_Free(request_ids);
+    PyMem_Free(tokens);
+    PyMem_Free(finished);
+    Py_XDECREF(output_list_obj);
+    return NULL;
+}
+
+static PyMethodDef PyGPTOSSScheduler_methods[] = {
+    {"submit", (PyCFunction) PyGPTOSSScheduler_submit, METH_VARARGS | METH_KEYWORDS, "Submit a generation request on a Context and return its ID"},
+    {"cancel", (PyCFunction) PyGPTOSSScheduler_cancel, METH_O, "Cancel an unfinished request"},
+    {"step", (PyCFunction) PyGPTOSSScheduler_step, METH_NOARGS, "Run one batched step and return a list of (request_id, token, finished) tuples"},
+    {NULL},
+};
+
+static PyObject* PyGPTOSSScheduler_get_num_requests(PyGPTOSSScheduler* self, void* closure) {
+    size_t num_requests = 0;
+    gptoss_scheduler_get_num_requests(self->handle, &num_requests);
+    return PyLong_FromSize_t(num_requests);
+}
+
+static PyGetSetDef PyGPTOSSScheduler_getseters[] = {
+    (PyGetSetDef) {
+        .name = "num_requests",
+        .get = (getter) PyGPTOSSScheduler_get_num_requests,
+        .doc = "Number of requests that are waiting or running",
+    },
+    {NULL}  // Sentinel
+};
+
+PyTypeObject PyGPTOSSScheduler_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gptoss.Scheduler",
+    .tp_basicsize = sizeof(PyGPTOSSScheduler),
+    .tp_flags = 0
+        | Py_TPFLAGS_DEFAULT
+        | Py_TPFLAGS_BASETYPE,
+    .tp_doc = "Continuous-batching scheduler of generation requests on Contexts of one Model",
+    .tp_methods = PyGPTOSSScheduler_methods,
+    .tp_getset = PyGPTOSSScheduler_getseters,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) PyGPTOSSScheduler_init,
+    .tp_dealloc = (destructor) PyGPTOSSScheduler_dealloc,
+};
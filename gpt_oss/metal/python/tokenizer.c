@@ -92,6 +92,59 @@ static PyObject* PyGPTOSSTokenizer_encode_special_token(PyGPTOSSTokenizer* self,
     }
 }
 
+static PyObject* PyGPTOSSTokenizer_encode(PyGPTOSSTokenizer* self, PyObject* arg) {
+    const char* text = NULL;
+    Py_ssize_t text_length = 0;
+    if (PyUnicode_Check(arg)) {
+        text = PyUnicode_AsUTF8AndSize(arg, &text_length);
+        if (text == NULL) {
+            return NULL;
+        }
+    } else if (PyBytes_Check(arg)) {
+        if (PyBytes_AsStringAndSize(arg, (char**) &text, &text_length) != 0) {
+            return NULL;
+        }
+    } else {
+        PyErr_SetString(PyExc_TypeError, "text must be a str or bytes object");
+        return NULL;
+    }
+
+    // Every token covers at least one byte of text
+    uint32_t* token_ids = NULL;
+    if (text_length != 0) {
+        token_ids = (uint32_t*) PyMem_Malloc((size_t) text_length * sizeof(uint32_t));
+        if (token_ids == NULL) {
+            return PyErr_NoMemory();
+        }
+    }
+
+    size_t num_tokens = 0;
+    enum gptoss_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = gptoss_tokenizer_encode(
+        self->handle, text, (size_t) text_length, (size_t) text_length, token_ids, &num_tokens);
+    Py_END_ALLOW_THREADS
+    if (status != gptoss_status_success) {
+        PyErr_Format(PyExc_ValueError, "failed to encode text (status %d)", (int) status);
+        PyMem_Free(token_ids);
+        return NULL;
+    }
+
+    PyObject* result = PyList_New((Py_ssize_t) num_tokens);
+    if (result != NULL) {
+        for (size_t t = 0; t < num_tokens; t++) {
+            PyObject* token = PyLong_FromUnsignedLong((unsigned long) token_ids[t]);
+            if (token == NULL) {
+                Py_CLEAR(result);
+                break;
+            }
+            PyList_SET_ITEM(result, (Py_ssize_t) t, token);
+        }
+    }
+    PyMem_Free(token_ids);
+    return result;
+}
+
 static PyObject* PyGPTOSSTokenizer_decode(PyGPTOSSTokenizer* self, PyObject* args, PyObject* kwargs) {
     static char *kwlist[] = {"token", NULL};
     unsigned int token = 0; // Default to 0 if None
@@ -111,10 +164,75 @@ static PyObject* PyGPTOSSTokenizer_decode(PyGPTOSSTokenizer* self, PyObject* arg
     return PyBytes_FromStringAndSize((const char*) token_ptr, (Py_ssize_t) token_size);
 }
 
+static PyObject* PyGPTOSSTokenizer_decode_batch(PyGPTOSSTokenizer* self, PyObject* args, PyObject* kwargs) {
+    static char *kwlist[] = {"tokens", NULL};
+    PyObject* tokens_arg = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &tokens_arg)) {
+        return NULL;
+    }
+
+    PyObject* tokens_fast = PySequence_Fast(tokens_arg, "tokens must be a sequence of integers");
+    if (tokens_fast == NULL) {
+        return NULL;
+    }
+
+    PyObject* result = NULL;
+    uint32_t* token_ids = NULL;
+    const Py_ssize_t num_tokens = PySequence_Fast_GET_SIZE(tokens_fast);
+    PyObject** tokens_items = PySequence_Fast_ITEMS(tokens_fast);
+    if (num_tokens != 0) {
+        token_ids = (uint32_t*) PyMem_Malloc((size_t) num_tokens * sizeof(uint32_t));
+        if (token_ids == NULL) {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+    }
+    for (Py_ssize_t t = 0; t < num_tokens; t++) {
+        const unsigned long token = PyLong_AsUnsignedLong(tokens_items[t]);
+        if (token == (unsigned long) -1 && PyErr_Occurred()) {
+            goto cleanup;
+        }
+        if (token > UINT32_MAX) {
+            PyErr_Format(PyExc_OverflowError, "token %lu at index %zd is out of range", token, t);
+            goto cleanup;
+        }
+        token_ids[t] = (uint32_t) token;
+    }
+
+    // First query the total size of the byte representation, then decode directly into the bytes object
+    size_t num_bytes = 0;
+    enum gptoss_status status = gptoss_tokenizer_decode_batch(
+        self->handle, (size_t) num_tokens, token_ids, /*buffer_size=*/0, /*buffer=*/NULL, &num_bytes);
+    if (status != gptoss_status_success && status != gptoss_status_insufficient_memory) {
+        PyErr_SetString(PyExc_ValueError, "failed to decode tokens");
+        goto cleanup;
+    }
+
+    result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) num_bytes);
+    if (result == NULL) {
+        goto cleanup;
+    }
+    status = gptoss_tokenizer_decode_batch(
+        self->handle, (size_t) num_tokens, token_ids, num_bytes, PyBytes_AS_STRING(result), &num_bytes);
+    if (status != gptoss_status_success) {
+        PyErr_SetString(PyExc_ValueError, "failed to decode tokens");
+        Py_CLEAR(result);
+        goto cleanup;
+    }
+
+cleanup:
+    PyMem_Free(token_ids);
+    Py_DECREF(tokens_fast);
+    return result;
+}
+
 static PyMethodDef PyGPTOSSTokenizer_methods[] = {
     {"__copy__", (PyCFunction) PyGPTOSSTokenizer_copy, METH_NOARGS, "Create a copy of the Tokenizer"},
     {"encode_special_token", (PyCFunction) PyGPTOSSTokenizer_encode_special_token, METH_O, "Query ID of a special token"},
+    {"encode", (PyCFunction) PyGPTOSSTokenizer_encode, METH_O, "Convert text to text token IDs"},
     {"decode", (PyCFunction) PyGPTOSSTokenizer_decode, METH_VARARGS | METH_KEYWORDS, "Convert text token ID to bytes"},
+    {"decode_batch", (PyCFunction) PyGPTOSSTokenizer_decode_batch, METH_VARARGS | METH_KEYWORDS, "Convert a sequence of text token IDs to concatenated bytes"},
     {NULL},
 };
 
@@ -17,6 +17,11 @@ from openai_harmony import load_harmony_encoding, HarmonyEncodingName
 parser = argparse.ArgumentParser(prog='check-mxfp4-weights.py', description='Validated MXFP4 weights')
 parser.add_argument('-s', '--src', metavar='DIR', type=str, required=True, help='Path to the input checkpoint directory')
 parser.add_argument('-d', '--dst', metavar='FILE', type=str, required=True, help='Path to the output model file')
+parser.add_argument('--layout', choices=['row-major', 'tiled'], default='row-major',
+                    help='Layout of MXFP4 expert weights: row-major blocks followed by scales, or tiles of 32 rows with co-located scales. '
+                         'Tiles target batched prefill; f32-mf4w-moe-matmul-bench compares both layouts on decode')
+parser.add_argument('--unembedding', choices=['bf16', 'int8'], default='bf16',
+                    help='Storage of the unembedding matrix: bf16, or int8 with a float32 scale per row')
 
 
 o200k_base = tiktoken.get_encoding("o200k_base")
@@ -76,9 +81,13 @@ INCLUDE_SPECIAL_TOKENS = [
 
 GPTOSS_MODEL_UUID = UUID('df52dc86-1789-4ed0-a295-66f10508145b').bytes
 APPLE_GPU_LAYOUT_UUID = UUID('229177a8-5775-4268-bfd8-d588b351c56d').bytes
+APPLE_GPU_TILED_LAYOUT_UUID = UUID('6b3e0c51-d247-4a9f-8e15-3ac4729db018').bytes
+APPLE_GPU_I8_UNEMBEDDING_LAYOUT_UUID = UUID('3c851f2a-906d-4e31-b74a-0ed258c9167b').bytes
+APPLE_GPU_TILED_I8_UNEMBEDDING_LAYOUT_UUID = UUID('a407e963-5b12-47c8-9d2f-814be630d59a').bytes
 TIKTOKEN_TOKENIZER_UUID = UUID('7401aded-2a95-40cb-b782-9ccebaafe72b').bytes
 
 UE8_OFFSET = 14  # bias to MXFP4 block scales
+MXFP4_TILE_ROWS = 32  # rows per tile in the tiled expert weight layout
 
 def write_file_header(f):
     f.write(FILE_MAGIC)
@@ -111,7 +120,8 @@ def write_model_header(f,
                        yarn_offset : float,
                        yarn_scale : float,
                        yarn_multiplier : float,
-                       rmsnorm_epsilon : float):
+                       rmsnorm_epsilon : float,
+                       layout_uuid : bytes):
     f.write(GPTOSS_MODEL_UUID)
     f.write(struct.pack('<I', context_length))
     f.write(struct.pack('<I', num_blocks))
@@ -130,7 +140,7 @@ def write_model_header(f,
     f.write(struct.pack('<f', yarn_scale))
     f.write(struct.pack('<f', yarn_multiplier))
     f.write(struct.pack('<f', rmsnorm_epsilon))
-    f.write(APPLE_GPU_LAYOUT_UUID)
+    f.write(layout_uuid)
 
 
 def write_padding(out_file, alignment_multiple=16384):
@@ -162,6 +172,38 @@ def write_attn_sink(out_file, sink):
     out_file.write(sink.view(torch.uint8).numpy().tobytes())
 
 
+def write_mxfp4_weight(out_file, blocks, scales, tiled : bool):
+    scales = (scales + UE8_OFFSET).view(torch.uint8)
+    blocks = blocks.view(torch.uint8)
+    if tiled:
+        # For every group of 32 rows and every block column: 32 blocks of 16 bytes, then their 32 scales
+        num_rows, num_column_vecs = scales.shape
+        assert num_rows % MXFP4_TILE_ROWS == 0
+        num_tile_rows = num_rows // MXFP4_TILE_ROWS
+        tile_blocks = blocks.reshape(num_tile_rows, MXFP4_TILE_ROWS, num_column_vecs, 16).permute(0, 2, 1, 3)
+        tile_blocks = tile_blocks.reshape(num_tile_rows, num_column_vecs, MXFP4_TILE_ROWS * 16)
+        tile_scales = scales.reshape(num_tile_rows, MXFP4_TILE_ROWS, num_column_vecs).permute(0, 2, 1)
+        write_padding(out_file, alignment_multiple=16)
+        out_file.write(torch.cat((tile_blocks, tile_scales), dim=2).contiguous().numpy().tobytes())
+    else:
+        write_padding(out_file, alignment_multiple=16)
+        out_file.write(blocks.numpy().tobytes())
+
+        write_padding(out_file, alignment_multiple=16)
+        out_file.write(scales.numpy().tobytes())
+
+
+def write_i8_weight(out_file, weight):
+    # Each row of int8 values is followed by its float32 scale
+    weight = weight.to(torch.float32)
+    scales = weight.abs().amax(dim=1).clamp(min=torch.finfo(torch.float32).tiny) / 127.0
+    quantized = torch.round(weight / scales[:, None]).clamp(-127, 127).to(torch.int8)
+    rows = torch.cat((quantized.view(torch.uint8), scales.view(torch.uint8).reshape(-1, 4)), dim=1)
+
+    write_padding(out_file, alignment_multiple=16)
+    out_file.write(rows.numpy().tobytes())
+
+
 def write_linear_weight(out_file, *args):
     write_padding(out_file, alignment_multiple=16)
 
@@ -171,6 +213,14 @@ def write_linear_weight(out_file, *args):
 
 def main(args):
     options = parser.parse_args(args)
+    tiled = options.layout == 'tiled'
+    i8_unembedding = options.unembedding == 'int8'
+    layout_uuid = {
+        (False, False): APPLE_GPU_LAYOUT_UUID,
+        (True, False): APPLE_GPU_TILED_LAYOUT_UUID,
+        (False, True): APPLE_GPU_I8_UNEMBEDDING_LAYOUT_UUID,
+        (True, True): APPLE_GPU_TILED_I8_UNEMBEDDING_LAYOUT_UUID,
+    }[(tiled, i8_unembedding)]
 
     with open(os.path.join(options.src, "config.json"), "r") as f:
         config = json.load(f)
@@ -237,7 +287,8 @@ def main(args):
                                yarn_offset=-yarn_low / (yarn_high - yarn_low),
                                yarn_scale=1.0 / (yarn_high - yarn_low),
                                yarn_multiplier=0.1 * math.log(rope_scaling_factor) + 1.0,
-                               rmsnorm_epsilon=1.0e-5)
+                               rmsnorm_epsilon=1.0e-5,
+                               layout_uuid=layout_uuid)
 
             write_tokenizer_header(dst,
                                    num_special_tokens=num_included_tokens - num_text_tokens,
@@ -304,7 +355,10 @@ def main(args):
 
             unembedding_weight = src.get_tensor("unembedding.weight")
             unembedding_weight = unembedding_weight[:num_included_tokens, :]
-            write_linear_weight(dst, unembedding_weight)
+            if i8_unembedding:
+                write_i8_weight(dst, unembedding_weight)
+            else:
+                write_linear_weight(dst, unembedding_weight)
 
             for n in tqdm(range(num_blocks)):
                 mlp1_blocks = src.get_tensor(f"block.{n}.mlp.mlp1_weight.blocks")
@@ -321,20 +375,12 @@ def main(args):
                 write_padding(dst)
 
                 for e in range(num_experts):
-                    write_padding(dst, alignment_multiple=16)                    
-                    dst.write(mlp1_blocks[e, ...].view(torch.uint8).numpy().tobytes())
-
-                    write_padding(dst, alignment_multiple=16)
-                    dst.write((mlp1_scales + UE8_OFFSET)[e, ...].view(torch.uint8).numpy().tobytes())
+                    write_mxfp4_weight(dst, mlp1_blocks[e, ...], mlp1_scales[e, ...], tiled)
 
                     write_padding(dst, alignment_multiple=16)
                     dst.write(mlp1_bias[e, ...].view(torch.uint8).numpy().tobytes())
 
-                    write_padding(dst, alignment_multiple=16)                    
-                    dst.write(mlp2_blocks[e, ...].view(torch.uint8).numpy().tobytes())
-
-                    write_padding(dst, alignment_multiple=16)
-                    dst.write((mlp2_scales + UE8_OFFSET)[e, ...].view(torch.uint8).numpy().tobytes())
+                    write_mxfp4_weight(dst, mlp2_blocks[e, ...], mlp2_scales[e, ...], tiled)
 
                     write_padding(dst, alignment_multiple=16)
                     dst.write(mlp2_bias[e, ...].view(torch.uint8).numpy().tobytes())
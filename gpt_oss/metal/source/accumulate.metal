@@ -7,7 +7,12 @@
 #pragma METAL fp contract(off)
 
 
-kernel void gptoss_f32_accumulate_e4(
+constant uint gptoss_fc_num_active_experts [[function_constant(GPTOSS_FUNCTION_CONSTANT_NUM_ACTIVE_EXPERTS)]];
+
+// Accumulates the num_active_experts expert outputs of each token, weighted by their scores, into the output.
+// The number of active experts is a function constant, so the accumulation loop is fully unrolled.
+
+kernel void gptoss_f32_accumulate(
     constant gptoss_accumulate_args& args [[ buffer(0) ]],
     const device float4* input [[ buffer(1) ]],
     const device gptoss_expert_prediction* expert [[ buffer(2) ]],
@@ -17,7 +22,7 @@ kernel void gptoss_f32_accumulate_e4(
     uint tid [[thread_index_in_threadgroup]],
     uint2 threadgroup_size [[ threads_per_threadgroup ]])
 {
-    const uint num_active_experts = 4;
+    const uint num_active_experts = gptoss_fc_num_active_experts;
     if (control->abort != 0) {
         return;
     }
@@ -30,30 +35,19 @@ kernel void gptoss_f32_accumulate_e4(
     uint num_iter = static_cast<uint>((threadgroup_end - thread_start + (threadgroup_size.x - 1)) / threadgroup_size.x);
 
     const uint num_vecs_per_expert = args.num_vecs_per_expert;
-    const float scale0 = expert[gid.y * num_active_experts + 0].score;
-    const device float4* input0 = input + gid.y * num_vecs + thread_start;
-    const float scale1 = expert[gid.y * num_active_experts + 1].score;
-    const device float4* input1 = input0 + num_vecs_per_expert;
-    const float scale2 = expert[gid.y * num_active_experts + 2].score;
-    const device float4* input2 = input1 + num_vecs_per_expert;
-    const float scale3 = expert[gid.y * num_active_experts + 3].score;
-    const device float4* input3 = input2 + num_vecs_per_expert;
+    float scale[GPTOSS_MAX_ACTIVE_EXPERTS];
+    for (uint e = 0; e < num_active_experts; e++) {
+        scale[e] = expert[gid.y * num_active_experts + e].score;
+    }
+    input += gid.y * num_vecs + thread_start;
     output += gid.y * num_vecs + thread_start;
     for (; num_iter != 0; num_iter--) {
         float4 acc = *output;
-        const float4 val0 = *input0;
-        const float4 val1 = *input1;
-        const float4 val2 = *input2;
-        const float4 val3 = *input3;
-        input0 += threadgroup_size.x;
-        acc = metal::fma(val0, scale0, acc);
-        input1 += threadgroup_size.x;
-        acc = metal::fma(val1, scale1, acc);
-        input2 += threadgroup_size.x;
-        acc = metal::fma(val2, scale2, acc);
-        input3 += threadgroup_size.x;
-        acc = metal::fma(val3, scale3, acc);
+        for (uint e = 0; e < num_active_experts; e++) {
+            acc = metal::fma(input[e * num_vecs_per_expert], scale[e], acc);
+        }
         *output = acc;
+        input += threadgroup_size.x;
         output += threadgroup_size.x;
     }
 }
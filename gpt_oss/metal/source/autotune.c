@@ -0,0 +1,739 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gpt-oss.h>
+
+#include "internal/log.h"
+#include "internal/math.h"
+#include "internal/metal.h"
+#include "internal/metal-kernels.h"
+#include "internal/model.h"
+
+#define GPTOSS_LAUNCH_PROFILE_MAGIC UINT32_C(0x4C54504F)  // "OPTL"
+#define GPTOSS_LAUNCH_PROFILE_VERSION 3
+
+// Kernel launches encoded per timed command buffer, and timed command buffers per candidate after one warmup.
+#define GPTOSS_AUTOTUNE_LAUNCHES 16
+#define GPTOSS_AUTOTUNE_TRIALS 3
+// A candidate replaces the default launch parameters only if it is faster by at least this fraction, so that timing
+// noise doesn't churn the profile.
+#define GPTOSS_AUTOTUNE_MIN_SPEEDUP 0.03
+
+static const uint32_t default_threadgroup_sizes[GPTOSS_LAUNCH_KERNEL_COUNT] = {
+    [gptoss_launch_kernel_embeddings] = 512,
+    [gptoss_launch_kernel_qkv] = 256,
+    [gptoss_launch_kernel_attn_out] = 256,
+    [gptoss_launch_kernel_gate] = 256,
+    [gptoss_launch_kernel_moe_swiglu] = 512,
+    [gptoss_launch_kernel_moe_out] = 512,
+    [gptoss_launch_kernel_accumulate] = 256,
+    [gptoss_launch_kernel_unembedding] = 256,
+    [gptoss_launch_kernel_softmax] = 512,
+    [gptoss_launch_kernel_top_logprobs] = 512,
+};
+
+static const char* const launch_kernel_names[GPTOSS_LAUNCH_KERNEL_COUNT] = {
+    [gptoss_launch_kernel_embeddings] = "embeddings",
+    [gptoss_launch_kernel_qkv] = "qkv",
+    [gptoss_launch_kernel_attn_out] = "attn_out",
+    [gptoss_launch_kernel_gate] = "gate",
+    [gptoss_launch_kernel_moe_swiglu] = "moe_swiglu",
+    [gptoss_launch_kernel_moe_out] = "moe_out",
+    [gptoss_launch_kernel_accumulate] = "accumulate",
+    [gptoss_launch_kernel_unembedding] = "unembedding",
+    [gptoss_launch_kernel_softmax] = "softmax",
+    [gptoss_launch_kernel_top_logprobs] = "top_logprobs",
+};
+
+static const char* const launch_shape_names[GPTOSS_LAUNCH_SHAPE_COUNT] = {
+    [gptoss_launch_shape_decode] = "decode",
+    [gptoss_launch_shape_prefill] = "prefill",
+};
+
+static const uint32_t candidate_threadgroup_sizes[] = {64, 128, 256, 512, 1024};
+static const uint32_t candidate_threadgroups_per_core[] = {1, 2, 3, 4, 6, 8};
+
+static const struct gptoss_metal_function* get_launch_function(
+    const struct gptoss_model* model,
+    enum gptoss_launch_kernel kernel)
+{
+    switch (kernel) {
+        case gptoss_launch_kernel_embeddings:
+            return &model->bf16_f32_embeddings_fn;
+        case gptoss_launch_kernel_qkv:
+            return &model->f32_bf16w_rmsnorm_matmul_fn;
+        case gptoss_launch_kernel_attn_out:
+        case gptoss_launch_kernel_gate:
+            return &model->f32_bf16w_matmul_fn;
+        case gptoss_launch_kernel_moe_swiglu:
+            return &model->f32_mf4w_moe_matmul_swiglu_fn;
+        case gptoss_launch_kernel_moe_out:
+            return &model->f32_mf4w_moe_matmul_accumulate_fn;
+        case gptoss_launch_kernel_accumulate:
+            return &model->f32_accumulate_fn;
+        case gptoss_launch_kernel_unembedding:
+            return model->i8_unembedding ? &model->f32_i8w_unembedding_fn : &model->f32_bf16w_unembedding_fn;
+        case gptoss_launch_kernel_softmax:
+            return &model->f32_softmax_fn;
+        case gptoss_launch_kernel_top_logprobs:
+            return &model->f32_top_logprobs_fn;
+    }
+    return NULL;
+}
+
+// Checks a threadgroup size against the constraints the kernel launcher enforces for the model's shapes.
+static bool is_valid_threadgroup_size(
+    const struct gptoss_model* model,
+    enum gptoss_launch_kernel kernel,
+    size_t threadgroup_size)
+{
+    const struct gptoss_metal_function* function = get_launch_function(model, kernel);
+    if (threadgroup_size == 0 || threadgroup_size > function->max_threadgroup_threads ||
+        threadgroup_size % function->simdgroup_threads != 0)
+    {
+        return false;
+    }
+
+    const size_t num_simdgroups = threadgroup_size / function->simdgroup_threads;
+    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+    switch (kernel) {
+        case gptoss_launch_kernel_qkv:
+            return attn_qkv_dim % num_simdgroups == 0;
+        case gptoss_launch_kernel_attn_out:
+        case gptoss_launch_kernel_moe_out:
+            return model->embedding_dim % num_simdgroups == 0;
+        case gptoss_launch_kernel_gate:
+            return model->num_experts % num_simdgroups == 0;
+        case gptoss_launch_kernel_moe_swiglu:
+            return threadgroup_size % (2 * function->simdgroup_threads) == 0 &&
+                (2 * model->mlp_dim) % num_simdgroups == 0;
+        default:
+            return true;
+    }
+}
+
+// Key of the launch profile: the kernel library and every model dimension the launch shapes depend on.
+static uint64_t get_launch_profile_key(const struct gptoss_model* model) {
+    const uint64_t values[] = {
+        model->library.hash,
+        model->embedding_dim,
+        model->mlp_dim,
+        model->num_experts,
+        model->num_active_experts,
+        model->expert_weight_layout,
+        model->i8_unembedding,
+        model->head_dim,
+        model->num_heads,
+        model->num_kv_heads,
+        model->vocabulary_size,
+        model->max_batch_tokens,
+    };
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        hash = (hash ^ values[i]) * UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+static enum gptoss_status get_launch_profile_path(
+    const struct gptoss_model* model,
+    char* path_out,
+    size_t path_size)
+{
+    if (model->library.hash == 0) {
+        // Without a library hash, a profile can't be invalidated when the kernels change
+        return gptoss_status_unsupported_system;
+    }
+    return gptoss_metal_device_get_cache_path(&model->device, "launch", get_launch_profile_key(model), path_out, path_size);
+}
+
+void gptoss_model_load_launch_profile(struct gptoss_model* model) {
+    model->max_threadgroups_limit = math_min(math_min(model->device.num_cores * GPTOSS_MAX_THREADGROUPS_PER_CORE,
+        GPTOSS_MAX_THREADGROUPS), model->f32_sample_fn.max_threadgroup_threads);
+    model->max_threadgroups = math_min(model->device.num_cores * GPTOSS_DEFAULT_THREADGROUPS_PER_CORE,
+        model->max_threadgroups_limit);
+    for (size_t k = 0; k < GPTOSS_LAUNCH_KERNEL_COUNT; k++) {
+        assert(is_valid_threadgroup_size(model, (enum gptoss_launch_kernel) k, default_threadgroup_sizes[k]));
+    }
+    for (size_t s = 0; s < GPTOSS_LAUNCH_SHAPE_COUNT; s++) {
+        memcpy(model->threadgroup_size[s], default_threadgroup_sizes, sizeof(model->threadgroup_size[s]));
+    }
+
+    char path[1024];
+    if (get_launch_profile_path(model, path, sizeof(path)) != gptoss_status_success) {
+        return;
+    }
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    struct gptoss_launch_profile profile;
+    const ssize_t bytes_read = read(fd, &profile, sizeof(profile));
+    close(fd);
+    if (bytes_read != (ssize_t) sizeof(profile) ||
+        profile.magic != GPTOSS_LAUNCH_PROFILE_MAGIC || profile.version != GPTOSS_LAUNCH_PROFILE_VERSION)
+    {
+        GPTOSS_LOG_WARNING("ignoring invalid launch profile %s", path);
+        return;
+    }
+    if (profile.max_threadgroups == 0 || profile.max_threadgroups > model->max_threadgroups_limit) {
+        GPTOSS_LOG_WARNING("ignoring launch profile %s: invalid number of threadgroups (%" PRIu32 ")",
+            path, profile.max_threadgroups);
+        return;
+    }
+    for (size_t s = 0; s < GPTOSS_LAUNCH_SHAPE_COUNT; s++) {
+        for (size_t k = 0; k < GPTOSS_LAUNCH_KERNEL_COUNT; k++) {
+            if (!is_valid_threadgroup_size(model, (enum gptoss_launch_kernel) k, profile.threadgroup_size[s][k])) {
+                GPTOSS_LOG_WARNING("ignoring launch profile %s: invalid threadgroup size (%" PRIu32 ") for %s %s kernel",
+                    path, profile.threadgroup_size[s][k], launch_shape_names[s], launch_kernel_names[k]);
+                return;
+            }
+        }
+    }
+
+    model->max_threadgroups = profile.max_threadgroups;
+    memcpy(model->threadgroup_size, profile.threadgroup_size, sizeof(model->threadgroup_size));
+}
+
+static enum gptoss_status save_launch_profile(const struct gptoss_model* model) {
+    char path[1024];
+    enum gptoss_status status = get_launch_profile_path(model, path, sizeof(path));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    struct gptoss_launch_profile profile = {
+        .magic = GPTOSS_LAUNCH_PROFILE_MAGIC,
+        .version = GPTOSS_LAUNCH_PROFILE_VERSION,
+        .max_threadgroups = (uint32_t) model->max_threadgroups,
+    };
+    memcpy(profile.threadgroup_size, model->threadgroup_size, sizeof(profile.threadgroup_size));
+
+    // Write a temporary file and rename it over the profile, so that concurrent loads never see a partial profile
+    char temp_path[1024 + 16];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int) getpid());
+    const int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        GPTOSS_LOG_WARNING("failed to create launch profile %s: error %d", temp_path, errno);
+        return gptoss_status_io_error;
+    }
+    const ssize_t bytes_written = write(fd, &profile, sizeof(profile));
+    close(fd);
+    if (bytes_written != (ssize_t) sizeof(profile) || rename(temp_path, path) != 0) {
+        GPTOSS_LOG_WARNING("failed to write launch profile %s: error %d", path, errno);
+        unlink(temp_path);
+        return gptoss_status_io_error;
+    }
+    return gptoss_status_success;
+}
+
+// Number of tokens a kernel is tuned on for a launch shape, or 0 if the kernel never runs with tunable launch
+// parameters for that shape. Decoding runs every kernel but accumulate on a single token, and top_logprobs runs only
+// when decoding. Prefill runs on the largest batches that still take the tunable kernel rather than the dense matmul or
+// grouped MoE kernels, which have fixed launch parameters. The scratch context of gptoss_model_autotune has valid
+// activations and output rows for num_output_rows tokens.
+static size_t get_launch_num_tokens(
+    gptoss_context_t context,
+    enum gptoss_launch_kernel kernel,
+    enum gptoss_launch_shape shape)
+{
+    const struct gptoss_model* model = context->model;
+    const size_t num_batch_tokens = math_min(model->max_batch_tokens, context->num_output_rows);
+    if (shape == gptoss_launch_shape_decode) {
+        return kernel == gptoss_launch_kernel_accumulate ? 0 : 1;
+    }
+    switch (kernel) {
+        case gptoss_launch_kernel_qkv:
+        case gptoss_launch_kernel_attn_out:
+        case gptoss_launch_kernel_gate:
+            return math_min(num_batch_tokens, GPTOSS_DENSE_MATMUL_MIN_TOKENS - 1);
+        case gptoss_launch_kernel_unembedding:
+            return model->i8_unembedding ? num_batch_tokens : math_min(num_batch_tokens, GPTOSS_DENSE_MATMUL_MIN_TOKENS - 1);
+        case gptoss_launch_kernel_moe_swiglu:
+        case gptoss_launch_kernel_moe_out:
+            return math_min(num_batch_tokens, GPTOSS_MOE_GROUPED_MIN_TOKENS - 1);
+        case gptoss_launch_kernel_accumulate:
+            return num_batch_tokens >= GPTOSS_MOE_GROUPED_MIN_TOKENS ? num_batch_tokens : 0;
+        case gptoss_launch_kernel_top_logprobs:
+            return 0;
+        default:
+            return num_batch_tokens;
+    }
+}
+
+// Encodes one launch of the kernel with the given threadgroup size on the shapes of block 0, for the number of tokens
+// get_launch_num_tokens returns.
+static enum gptoss_status encode_kernel_launch(
+    gptoss_context_t context,
+    const struct gptoss_metal_command_buffer* command_buffer,
+    enum gptoss_launch_kernel kernel,
+    enum gptoss_launch_shape shape,
+    size_t threadgroup_size)
+{
+    const struct gptoss_model* model = context->model;
+    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+    const size_t num_tokens = get_launch_num_tokens(context, kernel, shape);
+    assert(num_tokens != 0);
+    switch (kernel) {
+        case gptoss_launch_kernel_embeddings:
+            return gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings(
+                command_buffer,
+                &model->bf16_f32_embeddings_fn,
+                threadgroup_size,
+                &context->token_buffer,
+                /*token_offset=*/0,
+                &model->shared_weight_buffer,
+                /*weight_offset=*/0,
+                &context->residual_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                num_tokens,
+                /*num_channels=*/model->embedding_dim);
+        case gptoss_launch_kernel_qkv:
+            return gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_matmul(
+                command_buffer,
+                &model->f32_bf16w_rmsnorm_matmul_fn,
+                &model->f32_bf16w_rmsnorm_dense_matmul_fn,
+                threadgroup_size,
+                &context->residual_activation_buffer,
+                /*input_offset=*/0,
+                &model->shared_weight_buffer,
+                /*gain_offset=*/model->attn_rmsnorm_gain_offset,
+                &model->shared_weight_buffer,
+                /*weight_offset=*/model->attn_qkv_weight_offset,
+                &model->shared_weight_buffer,
+                /*bias_offset=*/model->attn_qkv_bias_offset,
+                &context->qkv_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                num_tokens,
+                /*num_cols=*/model->embedding_dim,
+                /*num_rows=*/attn_qkv_dim,
+                model->rmsnorm_epsilon);
+        case gptoss_launch_kernel_attn_out:
+            return gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
+                command_buffer,
+                &model->f32_bf16w_matmul_fn,
+                &model->f32_bf16w_dense_matmul_fn,
+                threadgroup_size,
+                &context->sdpa_activation_buffer,
+                /*input_offset=*/0,
+                &model->shared_weight_buffer,
+                /*weight_offset=*/model->attn_out_weight_offset,
+                &model->shared_weight_buffer,
+                /*bias_offset=*/model->attn_out_bias_offset,
+                &context->residual_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                num_tokens,
+                /*num_cols=*/model->num_heads * model->head_dim,
+                /*num_rows=*/model->embedding_dim);
+        case gptoss_launch_kernel_gate:
+            return gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
+                command_buffer,
+                &model->f32_bf16w_matmul_fn,
+                &model->f32_bf16w_dense_matmul_fn,
+                threadgroup_size,
+                &context->rmsnorm_activation_buffer,
+                /*input_offset=*/0,
+                &model->shared_weight_buffer,
+                /*weight_offset=*/model->mlp_gate_weight_offset,
+                &model->shared_weight_buffer,
+                /*bias_offset=*/model->mlp_gate_bias_offset,
+                &context->gate_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                num_tokens,
+                /*num_cols=*/model->embedding_dim,
+                /*num_rows=*/model->num_experts);
+        case gptoss_launch_kernel_moe_swiglu:
+            return gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
+                command_buffer,
+                &model->f32_mf4w_moe_matmul_swiglu_fn,
+                threadgroup_size,
+                &context->rmsnorm_activation_buffer,
+                /*input_offset=*/0,
+                &context->expert_activation_buffer,
+                /*expert_offset=*/0,
+                &model->block_weight_buffers[0],
+                /*weight_block_offset=*/0,
+                &model->block_weight_buffers[0],
+                /*weight_scale_offset=*/model->mlp_swiglu_scale_offset,
+                &model->block_weight_buffers[0],
+                /*bias_offset=*/model->mlp_swiglu_bias_offset,
+                &context->swiglu_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                model->swiglu_limit,
+                model->per_expert_block_weight_size,
+                num_tokens,
+                model->num_active_experts,
+                model->embedding_dim,
+                model->mlp_dim);
+        case gptoss_launch_kernel_moe_out:
+            return gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_accumulate(
+                command_buffer,
+                &model->f32_mf4w_moe_matmul_accumulate_fn,
+                threadgroup_size,
+                &context->swiglu_activation_buffer,
+                /*input_offset=*/0,
+                &context->expert_activation_buffer,
+                /*expert_offset=*/0,
+                &model->block_weight_buffers[0],
+                /*weight_block_offset=*/model->mlp_out_block_offset,
+                &model->block_weight_buffers[0],
+                /*weight_scale_offset=*/model->mlp_out_scale_offset,
+                &model->block_weight_buffers[0],
+                /*bias_offset=*/model->mlp_out_bias_offset,
+                &context->residual_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                model->per_expert_block_weight_size,
+                num_tokens,
+                model->num_active_experts,
+                model->mlp_dim,
+                model->embedding_dim);
+        case gptoss_launch_kernel_accumulate:
+            return gptoss_metal_command_buffer_encode_launch_f32_accumulate(
+                command_buffer,
+                &model->f32_accumulate_fn,
+                threadgroup_size,
+                model->max_threadgroups,
+                &context->moe_activation_buffer,
+                /*input_offset=*/0,
+                &context->expert_activation_buffer,
+                /*expert_offset=*/0,
+                &context->residual_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                model->embedding_dim,
+                num_tokens,
+                model->num_active_experts);
+        case gptoss_launch_kernel_unembedding:
+            if (model->i8_unembedding) {
+                return gptoss_metal_command_buffer_encode_launch_f32_i8w_unembedding(
+                    command_buffer,
+                    &model->f32_i8w_unembedding_fn,
+                    threadgroup_size,
+                    model->max_threadgroups,
+                    &context->rmsnorm_activation_buffer,
+                    /*input_offset=*/0,
+                    &model->shared_weight_buffer,
+                    /*weight_offset=*/model->unembedding_weight_offset,
+                    &context->score_buffer,
+                    /*output_offset=*/0,
+                    &context->argmax_buffer,
+                    /*argmax_offset=*/0,
+                    &context->control_buffer,
+                    /*control_offset=*/0,
+                    /*mask_buffer=*/NULL,
+                    /*mask_offset=*/0,
+                    num_tokens,
+                    /*num_cols=*/model->embedding_dim,
+                    /*num_rows=*/model->vocabulary_size);
+            } else {
+                return gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
+                    command_buffer,
+                    &model->f32_bf16w_unembedding_fn,
+                    &model->f32_bf16w_dense_unembedding_fn,
+                    threadgroup_size,
+                    model->max_threadgroups,
+                    &context->rmsnorm_activation_buffer,
+                    /*input_offset=*/0,
+                    &model->shared_weight_buffer,
+                    /*weight_offset=*/model->unembedding_weight_offset,
+                    &context->score_buffer,
+                    /*output_offset=*/0,
+                    &context->argmax_buffer,
+                    /*argmax_offset=*/0,
+                    &context->control_buffer,
+                    /*control_offset=*/0,
+                    /*mask_buffer=*/NULL,
+                    /*mask_offset=*/0,
+                    num_tokens,
+                    /*num_cols=*/model->embedding_dim,
+                    /*num_rows=*/model->vocabulary_size);
+            }
+        case gptoss_launch_kernel_softmax:
+        {
+            uint32_t num_threadgroups = 0;
+            uint32_t num_dims_per_threadgroup = 0;
+            return gptoss_metal_command_buffer_encode_launch_f32_softmax(
+                command_buffer,
+                &model->f32_softmax_fn,
+                threadgroup_size,
+                model->max_threadgroups,
+                &context->score_buffer,
+                /*score_offset=*/0,
+                &context->argmax_buffer,
+                /*argmax_offset=*/0,
+                &context->prob_buffer,
+                /*prob_offset=*/0,
+                &context->sum_buffer,
+                /*sum_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                model->vocabulary_size,
+                num_tokens,
+                /*temperature=*/1.0f,
+                &num_threadgroups,
+                &num_dims_per_threadgroup);
+        }
+        case gptoss_launch_kernel_top_logprobs:
+            // The scratch context has no top log-probability buffer, so the most likely tokens and their
+            // log-probabilities are written over the probabilities of the first row
+            return gptoss_metal_command_buffer_encode_launch_f32_top_logprobs(
+                command_buffer,
+                &model->f32_top_logprobs_fn,
+                threadgroup_size,
+                &context->score_buffer,
+                /*score_offset=*/0,
+                &context->argmax_buffer,
+                /*argmax_offset=*/0,
+                &context->prob_buffer,
+                /*top_token_offset=*/0,
+                &context->prob_buffer,
+                /*top_logprob_offset=*/GPTOSS_MAX_TOP_LOGPROBS * sizeof(uint32_t),
+                &context->control_buffer,
+                /*control_offset=*/0,
+                model->vocabulary_size,
+                num_tokens,
+                /*num_top=*/GPTOSS_MAX_TOP_LOGPROBS);
+    }
+    return gptoss_status_invalid_argument;
+}
+
+// Measures the GPU time of GPTOSS_AUTOTUNE_LAUNCHES launches of each of the kernels on the launch shape with the current
+// launch parameters of the model: the fastest of GPTOSS_AUTOTUNE_TRIALS command buffers, after a warmup one.
+static enum gptoss_status time_kernel_launches(
+    gptoss_context_t context,
+    enum gptoss_launch_shape shape,
+    size_t num_kernels,
+    const enum gptoss_launch_kernel* kernels,
+    double* gpu_seconds_out)
+{
+    const struct gptoss_model* model = context->model;
+    double min_gpu_seconds = 0.0;
+    for (size_t trial = 0; trial <= GPTOSS_AUTOTUNE_TRIALS; trial++) {
+        struct gptoss_metal_command_buffer command_buffer = {0};
+        enum gptoss_status status = gptoss_metal_command_buffer_create(context->command_queue, &command_buffer);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        gptoss_metal_command_buffer_use_residency_set(&command_buffer, &context->residency_set);
+        for (size_t i = 0; i < GPTOSS_AUTOTUNE_LAUNCHES && status == gptoss_status_success; i++) {
+            for (size_t k = 0; k < num_kernels && status == gptoss_status_success; k++) {
+                status = encode_kernel_launch(context, &command_buffer, kernels[k], shape,
+                    model->threadgroup_size[shape][kernels[k]]);
+            }
+        }
+        if (status == gptoss_status_success) {
+            status = gptoss_metal_command_buffer_commit(&command_buffer);
+        }
+        if (status == gptoss_status_success) {
+            status = gptoss_metal_command_buffer_wait_completion(&command_buffer, NULL);
+        }
+        double gpu_start_time = 0.0;
+        double gpu_end_time = 0.0;
+        if (status == gptoss_status_success) {
+            status = gptoss_metal_command_buffer_get_gpu_timestamps(&command_buffer, &gpu_start_time, &gpu_end_time);
+        }
+        gptoss_metal_command_buffer_release(&command_buffer);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+
+        const double gpu_seconds = gpu_end_time - gpu_start_time;
+        if (trial == 1 || (trial > 1 && gpu_seconds < min_gpu_seconds)) {
+            min_gpu_seconds = gpu_seconds;
+        }
+    }
+    *gpu_seconds_out = min_gpu_seconds;
+    return gptoss_status_success;
+}
+
+// Measures the GPU time of the kernels with a grid bounded by max_threadgroups: unembedding and softmax when decoding,
+// which dominate the cost of sampling a token, and accumulate on a batch, the only shape it runs on.
+static enum gptoss_status time_max_threadgroups_kernels(
+    gptoss_context_t context,
+    double* gpu_seconds_out)
+{
+    static const enum gptoss_launch_kernel decode_kernels[] = {
+        gptoss_launch_kernel_unembedding,
+        gptoss_launch_kernel_softmax,
+    };
+    double decode_gpu_seconds = 0.0;
+    enum gptoss_status status = time_kernel_launches(context, gptoss_launch_shape_decode,
+        sizeof(decode_kernels) / sizeof(decode_kernels[0]), decode_kernels, &decode_gpu_seconds);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    double prefill_gpu_seconds = 0.0;
+    const enum gptoss_launch_kernel prefill_kernel = gptoss_launch_kernel_accumulate;
+    if (get_launch_num_tokens(context, prefill_kernel, gptoss_launch_shape_prefill) != 0) {
+        status = time_kernel_launches(context, gptoss_launch_shape_prefill, 1, &prefill_kernel, &prefill_gpu_seconds);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+    *gpu_seconds_out = decode_gpu_seconds + prefill_gpu_seconds;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status tune_max_threadgroups(gptoss_context_t context) {
+    struct gptoss_model* model = context->model;
+    const size_t default_max_threadgroups = model->max_threadgroups;
+    double default_gpu_seconds = 0.0;
+    enum gptoss_status status = time_max_threadgroups_kernels(context, &default_gpu_seconds);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    size_t best_max_threadgroups = default_max_threadgroups;
+    double best_gpu_seconds = default_gpu_seconds * (1.0 - GPTOSS_AUTOTUNE_MIN_SPEEDUP);
+    for (size_t i = 0; i < sizeof(candidate_threadgroups_per_core) / sizeof(candidate_threadgroups_per_core[0]); i++) {
+        const size_t max_threadgroups = model->device.num_cores * candidate_threadgroups_per_core[i];
+        if (max_threadgroups == default_max_threadgroups || max_threadgroups > model->max_threadgroups_limit) {
+            continue;
+        }
+        model->max_threadgroups = max_threadgroups;
+        double gpu_seconds = 0.0;
+        status = time_max_threadgroups_kernels(context, &gpu_seconds);
+        if (status != gptoss_status_success) {
+            model->max_threadgroups = default_max_threadgroups;
+            return status;
+        }
+        if (gpu_seconds < best_gpu_seconds) {
+            best_max_threadgroups = max_threadgroups;
+            best_gpu_seconds = gpu_seconds;
+        }
+    }
+    model->max_threadgroups = best_max_threadgroups;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status tune_threadgroup_size(
+    gptoss_context_t context,
+    enum gptoss_launch_kernel kernel,
+    enum gptoss_launch_shape shape)
+{
+    struct gptoss_model* model = context->model;
+    if (get_launch_num_tokens(context, kernel, shape) == 0) {
+        return gptoss_status_success;
+    }
+
+    const uint32_t default_threadgroup_size = model->threadgroup_size[shape][kernel];
+    double default_gpu_seconds = 0.0;
+    enum gptoss_status status = time_kernel_launches(context, shape, 1, &kernel, &default_gpu_seconds);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    uint32_t best_threadgroup_size = default_threadgroup_size;
+    double best_gpu_seconds = default_gpu_seconds * (1.0 - GPTOSS_AUTOTUNE_MIN_SPEEDUP);
+    for (size_t i = 0; i < sizeof(candidate_threadgroup_sizes) / sizeof(candidate_threadgroup_sizes[0]); i++) {
+        const uint32_t threadgroup_size = candidate_threadgroup_sizes[i];
+        if (threadgroup_size == default_threadgroup_size || !is_valid_threadgroup_size(model, kernel, threadgroup_size)) {
+            continue;
+        }
+        model->threadgroup_size[shape][kernel] = threadgroup_size;
+        double gpu_seconds = 0.0;
+        status = time_kernel_launches(context, shape, 1, &kernel, &gpu_seconds);
+        if (status != gptoss_status_success) {
+            model->threadgroup_size[shape][kernel] = default_threadgroup_size;
+            return status;
+        }
+        if (gpu_seconds < best_gpu_seconds) {
+            best_threadgroup_size = threadgroup_size;
+            best_gpu_seconds = gpu_seconds;
+        }
+    }
+    model->threadgroup_size[shape][kernel] = best_threadgroup_size;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_autotune(
+    gptoss_model_t model)
+{
+    gptoss_context_t context = NULL;
+    uint32_t* tokens = NULL;
+    float* logprobs = NULL;
+    const size_t saved_max_threadgroups = model->max_threadgroups;
+    uint32_t saved_threadgroup_sizes[GPTOSS_LAUNCH_SHAPE_COUNT][GPTOSS_LAUNCH_KERNEL_COUNT];
+    memcpy(saved_threadgroup_sizes, model->threadgroup_size, sizeof(saved_threadgroup_sizes));
+
+    // Tune from the defaults rather than from a previously saved profile
+    model->max_threadgroups = math_min(model->device.num_cores * GPTOSS_DEFAULT_THREADGROUPS_PER_CORE,
+        model->max_threadgroups_limit);
+    for (size_t s = 0; s < GPTOSS_LAUNCH_SHAPE_COUNT; s++) {
+        memcpy(model->threadgroup_size[s], default_threadgroup_sizes, sizeof(model->threadgroup_size[s]));
+    }
+
+    // Score a full batch of tokens in a scratch context, so that activations, expert predictions, and output rows are
+    // realistic and valid for every token of the batch
+    enum gptoss_status status = gptoss_context_create(model,
+        math_min(model->max_batch_tokens + 1, model->context_length), &context);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    const size_t num_batch_tokens = context->max_tokens - 1;
+    tokens = calloc(context->max_tokens, sizeof(uint32_t));
+    logprobs = malloc(num_batch_tokens * sizeof(float));
+    if (tokens == NULL || logprobs == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu scratch tokens for autotuning", context->max_tokens);
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    status = gptoss_context_append_tokens(context, 1, tokens);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_context_score(context, num_batch_tokens, tokens + 1, logprobs);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = tune_max_threadgroups(context);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    for (size_t s = 0; s < GPTOSS_LAUNCH_SHAPE_COUNT; s++) {
+        for (size_t k = 0; k < GPTOSS_LAUNCH_KERNEL_COUNT; k++) {
+            status = tune_threadgroup_size(context, (enum gptoss_launch_kernel) k, (enum gptoss_launch_shape) s);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+        }
+    }
+
+    // The tuned parameters take effect even if they can't be persisted
+    if (save_launch_profile(model) != gptoss_status_success) {
+        GPTOSS_LOG_WARNING("launch profile not saved; tuned launch parameters apply to this model only");
+    }
+
+cleanup:
+    if (status != gptoss_status_success) {
+        model->max_threadgroups = saved_max_threadgroups;
+        memcpy(model->threadgroup_size, saved_threadgroup_sizes, sizeof(model->threadgroup_size));
+    }
+    gptoss_context_release(context);  // does nothing if context is NULL
+    free(tokens);
+    free(logprobs);
+    return status;
+}
@@ -1,11 +1,18 @@
 #include <assert.h>
 #include <float.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>  // errno, EINTR
+#include <sys/types.h>  // off_t, ssize_t
+#include <unistd.h>  // read, write, lseek
+
+#include <mach/mach_time.h>
+
 #include <gpt-oss.h>
 
 #include "internal/datatype.h"
@@ -14,18 +21,237 @@
 #include "internal/metal-kernels.h"
 #include "internal/log.h"
 #include "internal/rng.h"
+#include "internal/storage.h"
+
+
+// Size of a single K or V head of a token in the KV cache, in bytes.
+static size_t get_kvcache_head_size(
+    enum gptoss_kvcache_type kvcache_type,
+    uint32_t head_dim)
+{
+    switch (kvcache_type) {
+        case gptoss_kvcache_type_bf16:
+            return head_dim * sizeof(gptoss_bfloat16);
+        case gptoss_kvcache_type_i8:
+            // int8 values followed by a float scale
+            return head_dim * sizeof(int8_t) + sizeof(float);
+        case gptoss_kvcache_type_f32:
+        default:
+            return head_dim * sizeof(float);
+    }
+}
+
+// Creates a command buffer for work on the context, timing its kernel launches if the context is being profiled.
+// Until the command buffer is committed with commit_command_buffer, or encoding is abandoned with end_encoding, the
+// KV cache pool buffers it may reference can't be replaced. A context encodes at most one command buffer at a time.
+static enum gptoss_status create_command_buffer(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer_out)
+{
+    assert(!context->encoding);
+    enum gptoss_status status = gptoss_metal_command_buffer_create(context->command_queue, command_buffer_out);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    gptoss_metal_command_buffer_use_residency_set(command_buffer_out, &context->residency_set);
+    // Kernel launches are ordered by barriers, except where the encoding functions mark them as independent.
+    gptoss_metal_command_buffer_enable_concurrent_dispatch(command_buffer_out);
+    if (context->profiling) {
+        status = gptoss_metal_command_buffer_enable_timing(command_buffer_out, GPTOSS_PROFILE_MAX_LAUNCHES);
+        if (status != gptoss_status_success) {
+            gptoss_metal_command_buffer_release(command_buffer_out);
+            return status;
+        }
+    }
+    pthread_rwlock_rdlock(&context->model->kvcache_pool_lock);
+    context->encoding = true;
+    return gptoss_status_success;
+}
+
+// Ends encoding of the context's command buffer, if any.
+static void end_encoding(
+    gptoss_context_t context)
+{
+    if (context->encoding) {
+        context->encoding = false;
+        pthread_rwlock_unlock(&context->model->kvcache_pool_lock);
+    }
+}
+
+static enum gptoss_status commit_command_buffer(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    const enum gptoss_status status = gptoss_metal_command_buffer_commit(command_buffer);
+    end_encoding(context);
+    return status;
+}
+
+// Decoding command buffers are counted as pending from their commit until they are retired: while any are pending,
+// prefills of other contexts keep no more than one batch in flight, so that decoding is not starved.
+static void begin_decode_step(
+    struct gptoss_model* model)
+{
+    atomic_fetch_add_explicit(&model->num_pending_decode_steps, 1, memory_order_relaxed);
+}
+
+static void end_decode_step(
+    struct gptoss_model* model)
+{
+    atomic_fetch_sub_explicit(&model->num_pending_decode_steps, 1, memory_order_relaxed);
+}
+
+static void accumulate_profile(
+    gptoss_context_t context,
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    const struct gptoss_metal_launch_timing* launches = NULL;
+    size_t num_launches = 0, num_untimed_launches = 0;
+    if (gptoss_metal_command_buffer_get_launch_timings(command_buffer, &launches, &num_launches, &num_untimed_launches) != gptoss_status_success) {
+        return;
+    }
+
+    context->num_untimed_launches += num_untimed_launches;
+    for (size_t i = 0; i < num_launches; i++) {
+        size_t e = 0;
+        for (; e < context->num_profile_entries; e++) {
+            const struct gptoss_profile_entry* entry = &context->profile_entries[e];
+            // Kernel names are the string literals of the model's function table, so pointer comparison suffices.
+            if (entry->kernel_name == launches[i].kernel_name && entry->block == launches[i].tag) {
+                break;
+            }
+        }
+        if (e == context->num_profile_entries) {
+            if (context->num_profile_entries == context->max_profile_entries) {
+                const size_t max_entries = math_max(context->max_profile_entries * 2, 64);
+                struct gptoss_profile_entry* entries = realloc(context->profile_entries, max_entries * sizeof(struct gptoss_profile_entry));
+                if (entries == NULL) {
+                    GPTOSS_LOG_WARNING("failed to allocate %zu bytes for profile entries", max_entries * sizeof(struct gptoss_profile_entry));
+                    context->num_untimed_launches += 1;
+                    continue;
+                }
+                context->profile_entries = entries;
+                context->max_profile_entries = max_entries;
+            }
+            context->profile_entries[context->num_profile_entries++] = (struct gptoss_profile_entry) {
+                .kernel_name = launches[i].kernel_name,
+                .block = launches[i].tag,
+            };
+        }
+        context->profile_entries[e].num_launches += 1;
+        context->profile_entries[e].gpu_seconds += launches[i].gpu_seconds;
+    }
+}
+
+// Initialized once, as contexts on different threads convert their wait times concurrently.
+static pthread_once_t timebase_info_once = PTHREAD_ONCE_INIT;
+static mach_timebase_info_data_t timebase_info;
+
+static void init_timebase_info(void) {
+    mach_timebase_info(&timebase_info);
+}
+
+static uint64_t mach_timestamp_diff_to_nanoseconds(uint64_t start_timestamp, uint64_t end_timestamp) {
+    pthread_once(&timebase_info_once, init_timebase_info);
+    const uint64_t elapsed_mach_time = end_timestamp - start_timestamp;
+    return (uint64_t) ((double) elapsed_mach_time * (double) timebase_info.numer / (double) timebase_info.denom);
+}
+
+static void add_runtime_counters(
+    struct gptoss_runtime_counters* counters,
+    uint64_t num_prefill_tokens,
+    uint64_t num_decode_tokens,
+    uint64_t num_command_buffers,
+    uint64_t gpu_busy_nanoseconds,
+    uint64_t wait_nanoseconds)
+{
+    atomic_fetch_add_explicit(&counters->num_prefill_tokens, num_prefill_tokens, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->num_decode_tokens, num_decode_tokens, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->num_command_buffers, num_command_buffers, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->gpu_busy_nanoseconds, gpu_busy_nanoseconds, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->wait_nanoseconds, wait_nanoseconds, memory_order_relaxed);
+}
+
+// Counts prefilled and generated tokens in the runtime counters of the context and its model.
+static void count_tokens(
+    gptoss_context_t context,
+    size_t num_prefill_tokens,
+    size_t num_decode_tokens)
+{
+    add_runtime_counters(&context->counters, num_prefill_tokens, num_decode_tokens, 0, 0, 0);
+    add_runtime_counters(&context->model->counters, num_prefill_tokens, num_decode_tokens, 0, 0, 0);
+}
+
+// Collects statistics from a successfully completed command buffer of the context.
+static void collect_command_buffer_stats(
+    gptoss_context_t context,
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    gptoss_model_update_expert_residency(context->model);
+    if (command_buffer->timings != NULL) {
+        accumulate_profile(context, command_buffer);
+    }
+}
 
+// Waits for completion of a committed command buffer of the context, counting the wait and the GPU execution time,
+// and collects statistics from the command buffer if it completed successfully.
+static enum gptoss_status wait_command_buffer(
+    gptoss_context_t context,
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    const uint64_t wait_start_time = mach_absolute_time();
+    const enum gptoss_status status = gptoss_metal_command_buffer_wait_completion(command_buffer, NULL);
+    const uint64_t wait_nanoseconds = mach_timestamp_diff_to_nanoseconds(wait_start_time, mach_absolute_time());
+
+    uint64_t num_command_buffers = 0, gpu_busy_nanoseconds = 0;
+    if (status == gptoss_status_success) {
+        double gpu_start_time = 0.0, gpu_end_time = 0.0;
+        if (gptoss_metal_command_buffer_get_gpu_timestamps(command_buffer, &gpu_start_time, &gpu_end_time) == gptoss_status_success &&
+            gpu_end_time > gpu_start_time)
+        {
+            gpu_busy_nanoseconds = (uint64_t) ((gpu_end_time - gpu_start_time) * 1.0e+9);
+        }
+        num_command_buffers = 1;
+        collect_command_buffer_stats(context, command_buffer);
+    }
+    add_runtime_counters(&context->counters, 0, 0, num_command_buffers, gpu_busy_nanoseconds, wait_nanoseconds);
+    add_runtime_counters(&context->model->counters, 0, 0, num_command_buffers, gpu_busy_nanoseconds, wait_nanoseconds);
+    return status;
+}
 
 enum gptoss_status GPTOSS_ABI gptoss_context_create(
     gptoss_model_t model,
     size_t context_length,
     gptoss_context_t* context_out)
+{
+    return gptoss_context_create_with_kvcache_type(model, context_length, gptoss_kvcache_type_f32, context_out);
+}
+
+// Creates a context with a private KV cache for tokens after the shared prefix (if any).
+static enum gptoss_status create_context(
+    gptoss_model_t model,
+    size_t context_length,
+    enum gptoss_kvcache_type kvcache_type,
+    struct gptoss_prefix* prefix,
+    size_t num_sink_tokens,
+    gptoss_context_t* context_out)
 {
     *context_out = NULL;
 
     enum gptoss_status status = gptoss_status_success;
     struct gptoss_context* context = NULL;
 
+    switch (kvcache_type) {
+        case gptoss_kvcache_type_f32:
+        case gptoss_kvcache_type_bf16:
+        case gptoss_kvcache_type_i8:
+            break;
+        default:
+            GPTOSS_LOG_ERROR("unsupported KV cache type %d", (int) kvcache_type);
+            status = gptoss_status_unsupported_argument;
+            goto cleanup;
+    }
+
     if (context_length == 0) {
         context_length = model->context_length;
     } else if (context_length > model->context_length) {
@@ -35,6 +261,33 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
         goto cleanup;
     }
 
+    const size_t num_prefix_tokens = prefix != NULL ? prefix->num_tokens : 0;
+    if (num_prefix_tokens >= context_length) {
+        GPTOSS_LOG_ERROR("context length %zu must exceed the number of prefix tokens %zu",
+            context_length, num_prefix_tokens);
+        status = gptoss_status_invalid_argument;
+        goto cleanup;
+    }
+
+    // Sliding-window blocks need the last attention_window tokens for every token in a batch.
+    size_t num_window_kv_slots = math_min(context_length, (size_t) model->attention_window + model->max_batch_tokens);
+    if (num_sink_tokens != 0) {
+        if (prefix != NULL) {
+            GPTOSS_LOG_ERROR("streaming contexts can't be created from a prefix");
+            status = gptoss_status_unsupported_argument;
+            goto cleanup;
+        }
+        // Tokens are evicted in multiples of the ring buffer size, starting at a page boundary.
+        num_sink_tokens = math_round_up_po2(num_sink_tokens, GPTOSS_KVCACHE_PAGE_TOKENS);
+        num_window_kv_slots = math_round_up_po2((size_t) model->attention_window + model->max_batch_tokens, GPTOSS_KVCACHE_PAGE_TOKENS);
+        if (num_sink_tokens > context_length || context_length - num_sink_tokens < 2 * num_window_kv_slots) {
+            GPTOSS_LOG_ERROR("context length %zu is too short for %zu sink tokens and %zu recent tokens",
+                context_length, num_sink_tokens, 2 * num_window_kv_slots);
+            status = gptoss_status_invalid_argument;
+            goto cleanup;
+        }
+    }
+
     context = malloc(sizeof(struct gptoss_context));
     if (context == NULL) {
         GPTOSS_LOG_ERROR("failed to allocate %zu bytes for Context object",
@@ -45,40 +298,61 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     memset(context, 0, sizeof(struct gptoss_context));
 
     atomic_store_explicit(&context->ref_count, 1, memory_order_relaxed);
+    const uint_least32_t queue_index = atomic_fetch_add_explicit(&model->next_command_queue, 1, memory_order_relaxed);
+    context->command_queue = &model->command_queues[queue_index % GPTOSS_NUM_COMMAND_QUEUES];
     context->max_tokens = context_length;
+    context->kvcache_type = kvcache_type;
+    context->num_window_kv_slots = num_window_kv_slots;
+    context->num_sink_tokens = num_sink_tokens;
 
     // Activation buffers
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->embedding_dim * sizeof(float), NULL, &context->residual_activation_buffer);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->embedding_dim * sizeof(float), NULL, &context->rmsnorm_activation_buffer);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->head_dim * (model->num_heads + 2 * model->num_kv_heads) * sizeof(float), NULL, &context->qkv_activation_buffer);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->head_dim * model->num_heads * sizeof(float), NULL, &context->sdpa_activation_buffer);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->num_experts * sizeof(float), NULL, &context->gate_activation_buffer);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->num_experts * sizeof(struct gptoss_expert_prediction), NULL, &context->expert_activation_buffer);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->num_active_experts * model->mlp_dim * sizeof(float), NULL, &context->swiglu_activation_buffer);
+    const size_t residual_size = model->max_batch_tokens * model->embedding_dim * sizeof(float);
+    const size_t rmsnorm_size = model->max_batch_tokens * model->embedding_dim * sizeof(float);
+    const size_t qkv_size = model->max_batch_tokens * model->head_dim * (model->num_heads + 2 * model->num_kv_heads) * sizeof(float);
+    const size_t sdpa_size = model->max_batch_tokens * model->head_dim * model->num_heads * sizeof(float);
+    const size_t gate_size = model->max_batch_tokens * model->num_experts * sizeof(float);
+    const size_t expert_size = model->max_batch_tokens * model->num_experts * sizeof(struct gptoss_expert_prediction);
+    const size_t expert_route_size = ((model->num_experts + 1) + model->max_batch_tokens * model->num_active_experts) * sizeof(uint32_t);
+    const size_t swiglu_size = model->max_batch_tokens * model->num_active_experts * model->mlp_dim * sizeof(float);
+    const size_t moe_size = model->max_batch_tokens * model->num_active_experts * model->embedding_dim * sizeof(float);
+    const size_t sdpa_partial_size = GPTOSS_SDPA_PARTIAL_SIZE(model->num_kv_heads, model->head_dim);
+    // Within a block, QKV is live from the QKV projection to SDPA, SDPA output until the attention output projection,
+    // split SDPA partial results until their reduction, RMSNorm output from the MLP RMSNorm to the SwiGLU matmul,
+    // gating output until the Top-K, SwiGLU output until the MLP output matmul, and MoE output of the grouped MoE
+    // kernels until its accumulation into the residual stream.
+    const size_t residual_offset = 0;
+    const size_t qkv_moe_offset = residual_offset + math_round_up_po2(residual_size, GPTOSS_METAL_HEAP_ALIGNMENT);
+    const size_t sdpa_rmsnorm_offset = qkv_moe_offset + math_round_up_po2(math_max(qkv_size, moe_size), GPTOSS_METAL_HEAP_ALIGNMENT);
+    const size_t gate_swiglu_offset = sdpa_rmsnorm_offset + math_round_up_po2(math_max(sdpa_size, rmsnorm_size), GPTOSS_METAL_HEAP_ALIGNMENT);
+    const size_t expert_offset = gate_swiglu_offset + math_round_up_po2(math_max(math_max(gate_size, swiglu_size), sdpa_partial_size), GPTOSS_METAL_HEAP_ALIGNMENT);
+    const size_t expert_route_offset = expert_offset + math_round_up_po2(expert_size, GPTOSS_METAL_HEAP_ALIGNMENT);
+    const size_t activation_heap_size = expert_route_offset + math_round_up_po2(expert_route_size, GPTOSS_METAL_HEAP_ALIGNMENT);
+    status = gptoss_metal_heap_create(&model->device, activation_heap_size, &context->activation_heap);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->num_active_experts * model->embedding_dim * sizeof(float), NULL, &context->moe_activation_buffer);
-    if (status != gptoss_status_success) {
-        goto cleanup;
+    const struct {
+        size_t offset;
+        size_t size;
+        struct gptoss_metal_buffer* buffer;
+    } activation_buffers[] = {
+        {residual_offset, residual_size, &context->residual_activation_buffer},
+        {qkv_moe_offset, qkv_size, &context->qkv_activation_buffer},
+        {qkv_moe_offset, moe_size, &context->moe_activation_buffer},
+        {sdpa_rmsnorm_offset, sdpa_size, &context->sdpa_activation_buffer},
+        {sdpa_rmsnorm_offset, rmsnorm_size, &context->rmsnorm_activation_buffer},
+        {gate_swiglu_offset, sdpa_partial_size, &context->sdpa_partial_buffer},
+        {gate_swiglu_offset, gate_size, &context->gate_activation_buffer},
+        {gate_swiglu_offset, swiglu_size, &context->swiglu_activation_buffer},
+        {expert_offset, expert_size, &context->expert_activation_buffer},
+        {expert_route_offset, expert_route_size, &context->expert_route_buffer},
+    };
+    for (size_t i = 0; i < sizeof(activation_buffers) / sizeof(activation_buffers[0]); i++) {
+        status = gptoss_metal_heap_create_buffer(&context->activation_heap,
+            activation_buffers[i].offset, activation_buffers[i].size, activation_buffers[i].buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
     }
 
     // Input/output buffers
@@ -90,15 +364,17 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->vocabulary_size * sizeof(float), NULL, &context->score_buffer);
+    // A single decoding step needs one row of scores and probabilities; more rows are allocated on first use.
+    context->num_output_rows = 1;
+    status = gptoss_metal_buffer_create(&model->device, context->num_output_rows * model->vocabulary_size * sizeof(float), NULL, &context->score_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->vocabulary_size * sizeof(float), NULL, &context->prob_buffer);
+    status = gptoss_metal_buffer_create(&model->device, context->num_output_rows * model->vocabulary_size * sizeof(float), NULL, &context->prob_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->max_threadgroups * sizeof(float), NULL, &context->sum_buffer);
+    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->max_threadgroups_limit * sizeof(float), NULL, &context->sum_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
@@ -106,17 +382,62 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->num_blocks * context_length * 2 * model->num_kv_heads * model->head_dim * sizeof(float), NULL, &context->kvcache_buffer);
+    const size_t num_window_blocks = math_ceil_div(model->num_blocks, 2);
+    const size_t kvcache_token_size = 2 * model->num_kv_heads * get_kvcache_head_size(kvcache_type, model->head_dim);
+    status = gptoss_metal_buffer_create(&model->device, num_window_blocks * context->num_window_kv_slots * kvcache_token_size, NULL, &context->kvcache_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    // KV cache pages of full-attention blocks are allocated on demand
+    context->max_kv_pages = math_ceil_div(context_length - num_prefix_tokens, GPTOSS_KVCACHE_PAGE_TOKENS);
+    status = gptoss_metal_buffer_create(&model->device, (model->num_blocks - num_window_blocks) * context->max_kv_pages * sizeof(uint32_t), NULL, &context->kvcache_page_table_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
 
+    // Buffers used by every command buffer of the context are made resident once, rather than on each submission.
+    // Buffers allocated or grown later (output rows, token automaton, top log-probabilities) replace their previous
+    // allocation in the set.
+    if (gptoss_metal_residency_set_create(&model->device, 16, &context->residency_set) == gptoss_status_success) {
+        gptoss_metal_residency_set_add_heap(&context->residency_set, &context->activation_heap);
+        const struct gptoss_metal_buffer* resident_buffers[] = {
+            &context->control_buffer,
+            &context->token_buffer,
+            &context->score_buffer,
+            &context->prob_buffer,
+            &context->sum_buffer,
+            &context->argmax_buffer,
+            &context->kvcache_buffer,
+            &context->kvcache_page_table_buffer,
+        };
+        for (size_t i = 0; i < sizeof(resident_buffers) / sizeof(resident_buffers[0]); i++) {
+            gptoss_metal_residency_set_add_buffer(&context->residency_set, resident_buffers[i]);
+        }
+        if (prefix != NULL) {
+            gptoss_metal_residency_set_add_buffer(&context->residency_set, &prefix->kvcache_buffer);
+        }
+        gptoss_metal_residency_set_commit(&context->residency_set);
+    }
+
     context->kvcache_size = context->kvcache_buffer.size;
-    context->allocation_size = 
-        context->residual_activation_buffer.size + context->rmsnorm_activation_buffer.size +
-        context->qkv_activation_buffer.size + context->sdpa_activation_buffer.size +
-        context->gate_activation_buffer.size + context->expert_activation_buffer.size + context->swiglu_activation_buffer.size + context->moe_activation_buffer.size +
-        context->token_buffer.size + context->kvcache_buffer.size + context->score_buffer.size + context->argmax_buffer.size;
+    context->allocation_size =
+        context->activation_heap.size +
+        context->token_buffer.size + context->kvcache_buffer.size + context->kvcache_page_table_buffer.size +
+        context->score_buffer.size + context->prob_buffer.size + context->sum_buffer.size + context->argmax_buffer.size;
+
+    if (prefix != NULL) {
+        // The prefix tokens are already in the (shared) KV cache.
+        memcpy(context->token_buffer.ptr, prefix->tokens, num_prefix_tokens * sizeof(uint32_t));
+        context->num_tokens = num_prefix_tokens;
+        context->num_kv_tokens = num_prefix_tokens;
+        context->kvcache_watermark = num_prefix_tokens;
+        context->num_prefix_tokens = num_prefix_tokens;
+        context->prefix = prefix;
+        gptoss_prefix_retain(prefix);
+    }
+
+    context->top_k = 0;
+    context->top_p = 1.0f;
 
     context->model = model;
     gptoss_model_retain(model);
@@ -128,6 +449,38 @@ cleanup:
     return status;
 }
 
+enum gptoss_status GPTOSS_ABI gptoss_context_create_with_kvcache_type(
+    gptoss_model_t model,
+    size_t context_length,
+    enum gptoss_kvcache_type kvcache_type,
+    gptoss_context_t* context_out)
+{
+    return create_context(model, context_length, kvcache_type, /*prefix=*/NULL, /*num_sink_tokens=*/0, context_out);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_create_streaming(
+    gptoss_model_t model,
+    size_t context_length,
+    enum gptoss_kvcache_type kvcache_type,
+    size_t num_sink_tokens,
+    gptoss_context_t* context_out)
+{
+    if (num_sink_tokens == 0) {
+        *context_out = NULL;
+        GPTOSS_LOG_ERROR("streaming contexts need at least one sink token");
+        return gptoss_status_invalid_argument;
+    }
+    return create_context(model, context_length, kvcache_type, /*prefix=*/NULL, num_sink_tokens, context_out);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_create_from_prefix(
+    gptoss_prefix_t prefix,
+    size_t context_length,
+    gptoss_context_t* context_out)
+{
+    return create_context(prefix->model, context_length, prefix->kvcache_type, prefix, /*num_sink_tokens=*/0, context_out);
+}
+
 enum gptoss_status GPTOSS_ABI gptoss_context_get_num_tokens(
     gptoss_context_t context,
     size_t* num_tokens_out)
@@ -161,681 +514,3589 @@ enum gptoss_status GPTOSS_ABI gptoss_context_get_tokens(
     return gptoss_status_success;
 }
 
-// Prefill: input_tokens_offset = number of tokens in KV cache, num_input_tokens > 0, num_output_tokens = 0.
-// Sampling: input_tokens_offset = number of tokens in the context - 1, num_input_tokens = 1, num_output_tokens = 1.
-// Perplexity: input_tokens_offset = 0, num_input_tokens > 1, num_output_tokens = num_input_tokens.
-static enum gptoss_status process_tokens(
-    gptoss_context_t context,
-    struct gptoss_metal_command_buffer* command_buffer,
-    size_t input_tokens_offset,
-    size_t num_input_tokens,
-    size_t num_output_tokens)
+// Even blocks use sliding-window attention and store their KV cache in a ring buffer of num_window_kv_slots tokens.
+// Odd blocks use full attention and store KV cache for tokens after the shared prefix in pages of the model's KV cache
+// pool; their capacity is the number of tokens in the allocated pages.
+static size_t get_block_kvcache_capacity(
+    const struct gptoss_context* context,
+    uint32_t n)
 {
-    assert(num_input_tokens != 0);
-    assert(num_input_tokens <= context->max_batch_tokens);
-    assert(num_output_tokens <= context->max_batch_tokens);
-    assert(num_input_tokens >= num_output_tokens);
+    return n % 2 == 0 ? context->num_window_kv_slots : context->num_kv_pages * GPTOSS_KVCACHE_PAGE_TOKENS;
+}
 
-    enum gptoss_status status = gptoss_status_success;
+// Offset of the ring buffer of a sliding-window block in the context's KV cache buffer.
+static size_t get_block_kvcache_offset(
+    const struct gptoss_context* context,
+    uint32_t n)
+{
+    assert(n % 2 == 0);
     const struct gptoss_model* model = context->model;
+    const size_t num_preceding_window_blocks = n / 2;
+    return num_preceding_window_blocks * context->num_window_kv_slots *
+        2 * model->num_kv_heads * get_kvcache_head_size(context->kvcache_type, model->head_dim);
+}
 
-    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+// Page indices of full-attention block n in the context's page table.
+static uint32_t* get_block_page_table(
+    const struct gptoss_context* context,
+    uint32_t n)
+{
+    assert(n % 2 == 1);
+    return (uint32_t*) context->kvcache_page_table_buffer.ptr + (n / 2) * context->max_kv_pages;
+}
 
-    const size_t input_tokens_end = input_tokens_offset + num_input_tokens;
-    for (size_t input_batch_start = input_tokens_offset;
-        input_batch_start < input_tokens_end;
-        input_batch_start += model->max_batch_tokens)
-    {
-        const size_t input_batch_size = math_min(model->max_batch_tokens, input_tokens_end - input_batch_start);
-        const size_t input_batch_end = input_batch_start + input_batch_size;
-        const size_t output_batch_size = math_sub_sat(num_output_tokens, input_tokens_end - input_batch_end);
+// Grows the pool to hold at least num_required_free_pages free pages. The pool buffer is reallocated, so all
+// previously committed work that may reference it must complete first: command buffers on each of the model's queues
+// execute in order, so waiting for an empty command buffer on every queue suffices. Must be called with the pool lock
+// held for writing, so that no other command buffer is being encoded, and with the model lock held.
+static enum gptoss_status grow_kvcache_pool(
+    struct gptoss_model* model,
+    struct gptoss_kvcache_pool* pool,
+    size_t num_required_free_pages)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_buffer buffer = {0};
+    struct gptoss_metal_command_buffer command_buffer = {0};
 
-        status = gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings(
-            command_buffer,
-            &model->bf16_f32_embeddings_fn,
-            /*threadgroup_size=*/512,
-            &context->token_buffer,
-            input_batch_start * sizeof(uint32_t),
-            &model->shared_weight_buffer,
-            /*weight_offset=*/0,
-            &context->residual_activation_buffer,
-            /*output_offset=*/0,
-            &context->control_buffer,
-            /*control_offset=*/0,
-            /*num_tokens=*/input_batch_size,
-            /*num_channels=*/model->embedding_dim);
-        if (status != gptoss_status_success) {
-            GPTOSS_LOG_ERROR("failed to encode bf16_f32_embeddings kernel launch");
-            return status;
-        }
-        for (uint32_t n = 0; n < model->num_blocks; n++) {
-            const bool last_block = n + 1 == model->num_blocks;
-            const size_t num_block_output_tokens = last_block ? output_batch_size : input_batch_size;
+    const size_t num_full_blocks = model->num_blocks / 2;
+    const size_t min_pages = num_full_blocks * math_ceil_div(GPTOSS_KVCACHE_POOL_MIN_TOKENS, GPTOSS_KVCACHE_PAGE_TOKENS);
+    size_t num_pages = math_max(pool->num_pages * 2, min_pages);
+    num_pages = math_max(num_pages, pool->num_pages + num_required_free_pages - pool->num_free_pages);
+    if (num_pages > UINT32_MAX) {
+        GPTOSS_LOG_ERROR("KV cache pool can't exceed %" PRIu32 " pages", UINT32_MAX);
+        return gptoss_status_insufficient_resources;
+    }
 
-            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
-                command_buffer,
-                &model->f32_bf16w_rmsnorm_fn,
-                &context->residual_activation_buffer,
-                /*input_offset=*/0,
-                &model->shared_weight_buffer,
-                /*weight_offset=*/model->attn_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
-                &context->rmsnorm_activation_buffer,
-                /*output_offset=*/0,
-                &context->control_buffer,
-                /*control_offset=*/0,
-                /*num_tokens=*/input_batch_size,
-                /*num_channels=*/model->embedding_dim,
-                model->rmsnorm_epsilon);
+    uint32_t* free_pages = realloc(pool->free_pages, num_pages * sizeof(uint32_t));
+    if (free_pages == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for KV cache pool free list", num_pages * sizeof(uint32_t));
+        return gptoss_status_insufficient_memory;
+    }
+    pool->free_pages = free_pages;
+
+    status = gptoss_metal_buffer_create(&model->device, num_pages * pool->page_size, NULL, &buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    if (pool->num_pages != 0) {
+        for (size_t i = 0; i < GPTOSS_NUM_COMMAND_QUEUES; i++) {
+            status = gptoss_metal_command_buffer_create(&model->command_queues[i], &command_buffer);
             if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
-                return status;
+                goto cleanup;
             }
-
-            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
-                command_buffer,
-                &model->f32_bf16w_matmul_fn,
-                /*threadgroup_size=*/256,
-                &context->rmsnorm_activation_buffer,
-                /*input_offset=*/0,
-                &model->shared_weight_buffer,
-                /*weight_offset=*/model->attn_qkv_weight_offset + model->per_block_shared_weights_size * n,
-                &model->shared_weight_buffer,
-                /*bias_offset=*/model->attn_qkv_bias_offset + model->per_block_shared_weights_size * n,
-                &context->qkv_activation_buffer,
-                /*output_offset=*/0,
-                &context->control_buffer,
-                /*control_offset=*/0,
-                /*num_tokens=*/input_batch_size,
-                /*num_cols=*/model->embedding_dim,
-                /*num_rows=*/attn_qkv_dim);
+            status = gptoss_metal_command_buffer_commit(&command_buffer);
             if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul kernel launch");
-                return status;
+                goto cleanup;
             }
-
-            status = gptoss_metal_command_buffer_encode_launch_f32_rope(
-                command_buffer,
-                &model->f32_rope_fn,
-                /*threadgroup_size=*/32,
-                &context->qkv_activation_buffer,
-                /*input_offset=*/0,
-                &context->control_buffer,
-                /*control_offset=*/0,
-                model->rope_theta,
-                model->interpolation_scale,
-                model->yarn_offset,
-                model->yarn_scale,
-                model->yarn_multiplier,
-                input_batch_size,
-                model->num_heads,
-                model->num_kv_heads,
-                model->head_dim,
-                /*token_offset=*/input_batch_start);
+            status = gptoss_metal_command_buffer_wait_completion(&command_buffer, NULL);
             if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_rope kernel launch");
-                return status;
+                goto cleanup;
             }
+            gptoss_metal_command_buffer_release(&command_buffer);
+        }
+        memcpy(buffer.ptr, pool->buffer.ptr, pool->num_pages * pool->page_size);
+    }
 
-            for (uint32_t t = 0; t < input_batch_size; t++) {
-                status = gptoss_metal_command_buffer_encode_copy_buffer(
-                    command_buffer,
-                    &context->qkv_activation_buffer,
-                    /*input_offset=*/(t * attn_qkv_dim + model->num_heads * model->head_dim) * sizeof(float),
-                    &context->kvcache_buffer,
-                    /*output_offset=*/(n * context->max_tokens + input_batch_start + t) * 2 * model->num_kv_heads * model->head_dim * sizeof(float),
-                    /*size=*/2 * model->num_kv_heads * model->head_dim * sizeof(float));
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode copy of token %" PRIu32 " to KV cache", t);
-                    return status;
-                }
-            }
+    // Push new pages in reverse order so that lower-indexed pages are allocated first.
+    for (size_t page = num_pages; page > pool->num_pages; page--) {
+        pool->free_pages[pool->num_free_pages++] = (uint32_t) (page - 1);
+    }
+    pool->num_pages = num_pages;
 
-            if (num_block_output_tokens != 0) {
-                status = gptoss_metal_command_buffer_encode_launch_f32_sdpa(
-                    command_buffer,
-                    &model->f32_sdpa_q8_d64_fn,
-                    &context->qkv_activation_buffer,
-                    /*q_offset=*/attn_qkv_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                    &context->kvcache_buffer,
-                    /*k_offset=*/n * context->max_tokens * 2 * model->num_kv_heads * model->head_dim * sizeof(float),
-                    &context->kvcache_buffer,
-                    /*v_offset=*/(n * context->max_tokens * 2 + 1) * model->num_kv_heads * model->head_dim * sizeof(float),
-                    &model->shared_weight_buffer,
-                    /*s_offset=*/model->attn_sdpa_sink_offset + model->per_block_shared_weights_size * n,
-                    &context->sdpa_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    /*window=*/n % 2 == 0 ? model->attention_window : UINT32_MAX,
-                    num_block_output_tokens,
-                    input_batch_start + input_batch_size - num_block_output_tokens,
-                    model->num_heads, model->num_kv_heads, model->head_dim);
+    gptoss_metal_residency_set_remove_buffer(&model->residency_set, &pool->buffer);
+    gptoss_metal_residency_set_add_buffer(&model->residency_set, &buffer);
+    gptoss_metal_residency_set_commit(&model->residency_set);
+    gptoss_metal_buffer_release(&pool->buffer);
+    pool->buffer = buffer;
+    memset(&buffer, 0, sizeof(buffer));
+
+cleanup:
+    gptoss_metal_command_buffer_release(&command_buffer);
+    gptoss_metal_buffer_release(&buffer);
+    return status;
+}
+
+// Allocates KV cache pages of full-attention blocks for all tokens before num_tokens. Must not be called while the
+// context encodes a command buffer.
+static enum gptoss_status reserve_kvcache_pages(
+    gptoss_context_t context,
+    size_t num_tokens)
+{
+    assert(!context->encoding);
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_model* model = context->model;
+    struct gptoss_kvcache_pool* pool = &model->kvcache_pools[context->kvcache_type];
+
+    const size_t num_pages = math_min(
+        math_ceil_div(math_sub_sat(num_tokens, context->num_prefix_tokens), GPTOSS_KVCACHE_PAGE_TOKENS),
+        context->max_kv_pages);
+    if (num_pages <= context->num_kv_pages) {
+        return gptoss_status_success;
+    }
+
+    const size_t num_full_blocks = model->num_blocks / 2;
+    const size_t num_new_pages = (num_pages - context->num_kv_pages) * num_full_blocks;
+    pthread_mutex_lock(&model->lock);
+    if (pool->num_free_pages < num_new_pages) {
+        // Growing replaces the pool buffer: wait for other contexts to finish encoding, then check again, as they may
+        // have grown the pool meanwhile.
+        pthread_mutex_unlock(&model->lock);
+        pthread_rwlock_wrlock(&model->kvcache_pool_lock);
+        pthread_mutex_lock(&model->lock);
+        if (pool->num_free_pages < num_new_pages) {
+            pool->page_size = GPTOSS_KVCACHE_PAGE_TOKENS * 2 * model->num_kv_heads * get_kvcache_head_size(context->kvcache_type, model->head_dim);
+            status = grow_kvcache_pool(model, pool, num_new_pages);
+        }
+        pthread_rwlock_unlock(&model->kvcache_pool_lock);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    for (uint32_t n = 1; n < model->num_blocks; n += 2) {
+        uint32_t* page_table = get_block_page_table(context, n);
+        for (size_t p = context->num_kv_pages; p < num_pages; p++) {
+            page_table[p] = pool->free_pages[--pool->num_free_pages];
+        }
+    }
+    context->kvcache_size += num_new_pages * pool->page_size;
+    context->num_kv_pages = num_pages;
+
+cleanup:
+    pthread_mutex_unlock(&model->lock);
+    return status;
+}
+
+// Returns KV cache pages of full-attention blocks not needed for tokens before num_tokens to the model's pool.
+static void release_kvcache_pages(
+    gptoss_context_t context,
+    size_t num_tokens)
+{
+    const size_t num_pages = math_ceil_div(math_sub_sat(num_tokens, context->num_prefix_tokens), GPTOSS_KVCACHE_PAGE_TOKENS);
+    if (num_pages >= context->num_kv_pages) {
+        return;
+    }
+
+    struct gptoss_model* model = context->model;
+    struct gptoss_kvcache_pool* pool = &model->kvcache_pools[context->kvcache_type];
+    pthread_mutex_lock(&model->lock);
+    for (uint32_t n = 1; n < model->num_blocks; n += 2) {
+        const uint32_t* page_table = get_block_page_table(context, n);
+        for (size_t p = context->num_kv_pages; p > num_pages; p--) {
+            pool->free_pages[pool->num_free_pages++] = page_table[p - 1];
+        }
+    }
+    pthread_mutex_unlock(&model->lock);
+    context->kvcache_size -= (context->num_kv_pages - num_pages) * (model->num_blocks / 2) * pool->page_size;
+    context->num_kv_pages = num_pages;
+}
+
+// Layout of the prefix KV cache mirrors the context KV cache: sliding-window blocks keep a ring buffer of
+// num_window_kv_slots tokens, and full-attention blocks store all num_tokens tokens.
+static size_t get_prefix_block_kvcache_capacity(
+    const struct gptoss_prefix* prefix,
+    uint32_t n)
+{
+    return n % 2 == 0 ? prefix->num_window_kv_slots : prefix->num_tokens;
+}
+
+static size_t get_prefix_block_kvcache_offset(
+    const struct gptoss_prefix* prefix,
+    uint32_t n)
+{
+    const struct gptoss_model* model = prefix->model;
+    const size_t num_preceding_window_blocks = (n + 1) / 2;
+    const size_t num_preceding_full_blocks = n / 2;
+    const size_t num_preceding_tokens =
+        num_preceding_window_blocks * prefix->num_window_kv_slots + num_preceding_full_blocks * prefix->num_tokens;
+    return num_preceding_tokens * 2 * model->num_kv_heads * get_kvcache_head_size(prefix->kvcache_type, model->head_dim);
+}
+
+// Encodes RoPE, the KV cache write, and (for the last num_output_tokens tokens) SDPA of block n for num_tokens
+// consecutive tokens of the context's sequence, starting at position token_offset. The QKV projections of these
+// tokens are read from activation_context's QKV activation buffer starting at row qkv_row, and SDPA outputs are
+// written to activation_context's SDPA activation buffer starting at row sdpa_row.
+static enum gptoss_status process_block_attention(
+    gptoss_context_t context,
+    gptoss_context_t activation_context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    uint32_t n,
+    size_t qkv_row,
+    size_t sdpa_row,
+    size_t token_offset,
+    size_t num_tokens,
+    size_t num_output_tokens)
+{
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+
+    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+    const size_t kvcache_head_size = get_kvcache_head_size(context->kvcache_type, model->head_dim);
+    const size_t kvcache_capacity = get_block_kvcache_capacity(context, n);
+    // Sliding-window blocks use a ring buffer in the context's KV cache buffer, full-attention blocks use pages of the
+    // model's KV cache pool.
+    const struct gptoss_metal_buffer* kvcache_buffer = &context->kvcache_buffer;
+    size_t kvcache_offset = 0;
+    const struct gptoss_metal_buffer* page_table_buffer = NULL;
+    size_t page_table_offset = 0;
+    if (n % 2 == 0) {
+        kvcache_offset = get_block_kvcache_offset(context, n);
+    } else {
+        kvcache_buffer = &model->kvcache_pools[context->kvcache_type].buffer;
+        page_table_buffer = &context->kvcache_page_table_buffer;
+        page_table_offset = (n / 2) * context->max_kv_pages * sizeof(uint32_t);
+    }
+
+    const struct gptoss_metal_function* rope_kv_store_fn = &model->f32_rope_kv_store_fn;
+    const struct gptoss_metal_function* sdpa_fn = &model->f32_sdpa_q8_d64_fn;
+    const struct gptoss_metal_function* sdpa_reduce_fn = &model->f32_sdpa_reduce_q8_d64_fn;
+    switch (context->kvcache_type) {
+        case gptoss_kvcache_type_f32:
+            break;
+        case gptoss_kvcache_type_bf16:
+            rope_kv_store_fn = &model->f32_rope_bf16kv_store_fn;
+            sdpa_fn = &model->f32_bf16kv_sdpa_q8_d64_fn;
+            break;
+        case gptoss_kvcache_type_i8:
+            rope_kv_store_fn = &model->f32_rope_i8kv_store_fn;
+            sdpa_fn = &model->f32_i8kv_sdpa_q8_d64_fn;
+            break;
+    }
+
+    // RoPE is applied to Q in place, while rotated K and V go straight into the KV cache.
+    // KV of tokens in the shared prefix is immutable, and identical to what would be stored, so it is not stored.
+    context->kvcache_watermark = math_max(context->kvcache_watermark, token_offset + num_tokens);
+    const size_t num_prefix_tokens = context->num_prefix_tokens;
+    status = gptoss_metal_command_buffer_encode_launch_f32_rope_kv_store(
+        command_buffer,
+        rope_kv_store_fn,
+        &activation_context->qkv_activation_buffer,
+        /*activations_offset=*/attn_qkv_dim * qkv_row * sizeof(float),
+        kvcache_buffer,
+        kvcache_offset,
+        &activation_context->control_buffer,
+        /*control_offset=*/0,
+        page_table_buffer,
+        page_table_offset,
+        model->rope_theta,
+        model->interpolation_scale,
+        model->yarn_offset,
+        model->yarn_scale,
+        model->yarn_multiplier,
+        num_tokens,
+        model->num_heads,
+        model->num_kv_heads,
+        model->head_dim,
+        token_offset,
+        /*kv_token_offset=*/num_prefix_tokens,
+        kvcache_capacity);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_rope_kv_store kernel launch");
+        return status;
+    }
+
+    // Without a prefix, the private KV cache stands in for the (unused) prefix KV cache bindings.
+    const struct gptoss_metal_buffer* prefix_kvcache_buffer = kvcache_buffer;
+    size_t prefix_kvcache_offset = kvcache_offset;
+    size_t prefix_kvcache_capacity = 0;
+    if (context->prefix != NULL) {
+        prefix_kvcache_buffer = &context->prefix->kvcache_buffer;
+        prefix_kvcache_offset = get_prefix_block_kvcache_offset(context->prefix, n);
+        prefix_kvcache_capacity = get_prefix_block_kvcache_capacity(context->prefix, n);
+    }
+
+    if (num_output_tokens != 0) {
+        status = gptoss_metal_command_buffer_encode_launch_f32_sdpa(
+            command_buffer,
+            sdpa_fn,
+            sdpa_reduce_fn,
+            model->max_threadgroups,
+            &activation_context->qkv_activation_buffer,
+            /*q_offset=*/attn_qkv_dim * (qkv_row + num_tokens - num_output_tokens) * sizeof(float),
+            kvcache_buffer,
+            /*k_offset=*/kvcache_offset,
+            kvcache_buffer,
+            /*v_offset=*/kvcache_offset + model->num_kv_heads * kvcache_head_size,
+            &model->shared_weight_buffer,
+            /*s_offset=*/model->attn_sdpa_sink_offset + model->per_block_shared_weights_size * n,
+            &activation_context->sdpa_activation_buffer,
+            /*output_offset=*/model->num_heads * model->head_dim * sdpa_row * sizeof(float),
+            &activation_context->sdpa_partial_buffer,
+            /*partial_offset=*/0,
+            &activation_context->control_buffer,
+            /*control_offset=*/0,
+            prefix_kvcache_buffer,
+            /*prefix_k_offset=*/prefix_kvcache_offset,
+            prefix_kvcache_buffer,
+            /*prefix_v_offset=*/prefix_kvcache_offset + model->num_kv_heads * kvcache_head_size,
+            page_table_buffer,
+            page_table_offset,
+            /*window=*/n % 2 == 0 ? model->attention_window : UINT32_MAX,
+            /*kv_capacity=*/kvcache_capacity,
+            num_prefix_tokens,
+            /*prefix_capacity=*/prefix_kvcache_capacity,
+            num_output_tokens,
+            token_offset + num_tokens - num_output_tokens,
+            model->num_heads, model->num_kv_heads, model->head_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_sdpa kernel launch");
+            return status;
+        }
+    }
+    return gptoss_status_success;
+}
+
+// Encodes the attention output projection and the MoE MLP of block n for num_tokens tokens. The SDPA outputs are read
+// from the SDPA activation buffer starting at row 0, and the results are accumulated into the residual activation
+// buffer starting at row residual_row.
+static enum gptoss_status process_block_mlp(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    uint32_t n,
+    size_t residual_row,
+    size_t num_tokens)
+{
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+
+    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
+        command_buffer,
+        &model->f32_bf16w_matmul_fn,
+        &model->f32_bf16w_dense_matmul_fn,
+        model->threadgroup_size[gptoss_get_launch_shape(num_tokens)][gptoss_launch_kernel_attn_out],
+        &context->sdpa_activation_buffer,
+        /*input_offset=*/0,
+        &model->shared_weight_buffer,
+        /*weight_offset=*/model->attn_out_weight_offset + model->per_block_shared_weights_size * n,
+        &model->shared_weight_buffer,
+        /*bias_offset=*/model->attn_out_bias_offset + model->per_block_shared_weights_size * n,
+        &context->residual_activation_buffer,
+        /*output_offset=*/model->embedding_dim * residual_row * sizeof(float),
+        &context->control_buffer,
+        /*control_offset=*/0,
+        num_tokens,
+        /*num_cols=*/model->num_heads * model->head_dim,
+        /*num_rows=*/model->embedding_dim);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_add kernel launch");
+        return status;
+    }
+
+    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
+        command_buffer,
+        &model->f32_bf16w_rmsnorm_fn,
+        &context->residual_activation_buffer,
+        /*input_offset=*/model->embedding_dim * residual_row * sizeof(float),
+        &model->shared_weight_buffer,
+        /*weight_offset=*/model->mlp_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
+        &context->rmsnorm_activation_buffer,
+        /*output_offset=*/0,
+        &context->control_buffer,
+        /*control_offset=*/0,
+        num_tokens,
+        model->embedding_dim,
+        model->rmsnorm_epsilon);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
+        return status;
+    }
+
+    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
+        command_buffer,
+        &model->f32_bf16w_matmul_fn,
+        &model->f32_bf16w_dense_matmul_fn,
+        model->threadgroup_size[gptoss_get_launch_shape(num_tokens)][gptoss_launch_kernel_gate],
+        &context->rmsnorm_activation_buffer,
+        /*input_offset=*/0,
+        &model->shared_weight_buffer,
+        /*weight_offset=*/model->mlp_gate_weight_offset + model->per_block_shared_weights_size * n,
+        &model->shared_weight_buffer,
+        /*bias_offset=*/model->mlp_gate_bias_offset + model->per_block_shared_weights_size * n,
+        &context->gate_activation_buffer,
+        /*output_offset=*/0,
+        &context->control_buffer,
+        /*control_offset=*/0,
+        num_tokens,
+        /*num_cols=*/model->embedding_dim,
+        /*num_rows=*/model->num_experts);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul kernel launch");
+        return status;
+    }
+
+    status = gptoss_metal_command_buffer_encode_launch_f32_topk(
+        command_buffer,
+        &model->f32_topk_softmax_fn,
+        &context->gate_activation_buffer, /*input_offset=*/0,
+        &context->expert_activation_buffer, /*output_offset=*/0,
+        &context->control_buffer, /*control_offset=*/0,
+        num_tokens,
+        model->num_experts,
+        model->num_active_experts);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_topk_softmax kernel launch");
+        return status;
+    }
+
+    // Count the tokens routed to each expert, for expert residency management and routing statistics if requested.
+    if (model->manage_expert_residency || atomic_load_explicit(&model->count_expert_usage, memory_order_relaxed)) {
+        status = gptoss_metal_command_buffer_encode_launch_expert_usage(
+            command_buffer,
+            &model->expert_usage_fn,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &model->expert_usage_buffer,
+            /*usage_offset=*/(size_t) n * model->num_experts * sizeof(uint32_t),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            num_tokens,
+            model->num_experts,
+            model->num_active_experts);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode expert_usage kernel launch");
+            return status;
+        }
+        // Only the usage counters depend on the expert counting, so the expert MLP may start alongside it.
+        gptoss_metal_command_buffer_overlap_next_launch(command_buffer);
+    }
+
+    if (num_tokens >= GPTOSS_MOE_GROUPED_MIN_TOKENS) {
+        // Group the tokens by expert, so that each expert's weights are read once per tile of its tokens.
+        const size_t assignment_offset = (model->num_experts + 1) * sizeof(uint32_t);
+        status = gptoss_metal_command_buffer_encode_launch_expert_route(
+            command_buffer,
+            &model->expert_route_fn,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &context->expert_route_buffer,
+            /*expert_offsets_offset=*/0,
+            &context->expert_route_buffer,
+            assignment_offset,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            num_tokens,
+            model->num_experts,
+            model->num_active_experts);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode expert_route kernel launch");
+            return status;
+        }
+
+        // In half precision, the SwiGLU activations are stored as halves between the two grouped matmuls
+        const bool half_activations = context->prefill_activation_type == gptoss_activation_type_f16;
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul_swiglu(
+            command_buffer,
+            half_activations ? &model->f16_mf4w_moe_dense_matmul_swiglu_fn : &model->f32_mf4w_moe_dense_matmul_swiglu_fn,
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_route_buffer,
+            /*expert_offsets_offset=*/0,
+            &context->expert_route_buffer,
+            assignment_offset,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_swiglu_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_swiglu_bias_offset,
+            &context->swiglu_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->swiglu_limit,
+            model->per_expert_block_weight_size,
+            num_tokens,
+            model->num_experts,
+            model->num_active_experts,
+            model->embedding_dim,
+            model->mlp_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_dense_matmul_swiglu kernel launch");
+            return status;
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul(
+            command_buffer,
+            half_activations ? &model->f16_mf4w_moe_dense_matmul_fn : &model->f32_mf4w_moe_dense_matmul_fn,
+            &context->swiglu_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_route_buffer,
+            /*expert_offsets_offset=*/0,
+            &context->expert_route_buffer,
+            assignment_offset,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/model->mlp_out_block_offset,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_out_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_out_bias_offset,
+            &context->moe_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->per_expert_block_weight_size,
+            num_tokens,
+            model->num_experts,
+            model->num_active_experts,
+            model->mlp_dim,
+            model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_dense_matmul kernel launch");
+            return status;
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_accumulate(
+            command_buffer,
+            &model->f32_accumulate_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(num_tokens)][gptoss_launch_kernel_accumulate],
+            model->max_threadgroups,
+            &context->moe_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &context->residual_activation_buffer,
+            /*output_offset=*/model->embedding_dim * residual_row * sizeof(float),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->embedding_dim,
+            num_tokens,
+            model->num_active_experts);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_accumulate kernel launch");
+            return status;
+        }
+    } else {
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
+            command_buffer,
+            &model->f32_mf4w_moe_matmul_swiglu_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(num_tokens)][gptoss_launch_kernel_moe_swiglu],
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_swiglu_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_swiglu_bias_offset,
+            &context->swiglu_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->swiglu_limit,
+            model->per_expert_block_weight_size,
+            num_tokens,
+            model->num_active_experts,
+            model->embedding_dim,
+            model->mlp_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_swiglu kernel launch");
+            return status;
+        }
+
+        // The output projection accumulates the score-weighted expert outputs straight into the residual stream
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_accumulate(
+            command_buffer,
+            &model->f32_mf4w_moe_matmul_accumulate_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(num_tokens)][gptoss_launch_kernel_moe_out],
+            &context->swiglu_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/model->mlp_out_block_offset,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_out_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_out_bias_offset,
+            &context->residual_activation_buffer,
+            /*output_offset=*/model->embedding_dim * residual_row * sizeof(float),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->per_expert_block_weight_size,
+            num_tokens,
+            model->num_active_experts,
+            model->mlp_dim,
+            model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_accumulate kernel launch");
+            return status;
+        }
+    }
+    return gptoss_status_success;
+}
+
+// Grows the score and prob buffers to hold at least num_rows rows. Must not be called while command buffers using them
+// are in flight; the contents of the buffers are not preserved.
+static enum gptoss_status reserve_output_rows(
+    gptoss_context_t context,
+    size_t num_rows)
+{
+    if (num_rows <= context->num_output_rows) {
+        return gptoss_status_success;
+    }
+
+    const struct gptoss_model* model = context->model;
+    const size_t buffer_size = num_rows * model->vocabulary_size * sizeof(float);
+    struct gptoss_metal_buffer score_buffer = {0};
+    struct gptoss_metal_buffer prob_buffer = {0};
+    enum gptoss_status status = gptoss_metal_buffer_create(&model->device, buffer_size, NULL, &score_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_buffer_create(&model->device, buffer_size, NULL, &prob_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    context->allocation_size += 2 * buffer_size;
+    context->allocation_size -= context->score_buffer.size + context->prob_buffer.size;
+    gptoss_metal_residency_set_remove_buffer(&context->residency_set, &context->score_buffer);
+    gptoss_metal_residency_set_remove_buffer(&context->residency_set, &context->prob_buffer);
+    gptoss_metal_residency_set_add_buffer(&context->residency_set, &score_buffer);
+    gptoss_metal_residency_set_add_buffer(&context->residency_set, &prob_buffer);
+    gptoss_metal_residency_set_commit(&context->residency_set);
+    gptoss_metal_buffer_release(&context->score_buffer);
+    gptoss_metal_buffer_release(&context->prob_buffer);
+    context->score_buffer = score_buffer;
+    context->prob_buffer = prob_buffer;
+    context->num_output_rows = num_rows;
+    memset(&score_buffer, 0, sizeof(score_buffer));
+    memset(&prob_buffer, 0, sizeof(prob_buffer));
+
+cleanup:
+    gptoss_metal_buffer_release(&score_buffer);
+    gptoss_metal_buffer_release(&prob_buffer);
+    return status;
+}
+
+// Encodes the final RMSNorm and unembedding for num_tokens tokens of the residual activation buffer starting at row
+// residual_row. Scores and argmax values are written to the score and argmax buffers starting at row 0. With
+// apply_token_mask, tokens not allowed in the current state of the context's token automaton are masked out.
+static enum gptoss_status process_unembedding(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t residual_row,
+    size_t num_tokens,
+    bool apply_token_mask)
+{
+    assert(num_tokens <= context->num_output_rows);
+
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+
+    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
+        command_buffer,
+        &model->f32_bf16w_rmsnorm_fn,
+        &context->residual_activation_buffer,
+        /*input_offset=*/model->embedding_dim * residual_row * sizeof(float),
+        &model->shared_weight_buffer,
+        /*weight_offset=*/model->rmsnorm_weight_offset,
+        &context->rmsnorm_activation_buffer,
+        /*output_offset=*/0,
+        &context->control_buffer,
+        /*control_offset=*/0,
+        num_tokens,
+        /*num_channels=*/model->embedding_dim,
+        model->rmsnorm_epsilon);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
+        return status;
+    }
+
+    status = gptoss_metal_command_buffer_encode_fill_buffer(
+        command_buffer,
+        &context->argmax_buffer,
+        /*offset=*/0,
+        /*size=*/sizeof(uint64_t) * num_tokens,
+        /*fill_value=*/0xFF);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode fill buffer command");
+        return status;
+    }
+
+    if (model->i8_unembedding) {
+        status = gptoss_metal_command_buffer_encode_launch_f32_i8w_unembedding(
+            command_buffer,
+            &model->f32_i8w_unembedding_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(num_tokens)][gptoss_launch_kernel_unembedding],
+            model->max_threadgroups,
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->unembedding_weight_offset,
+            &context->score_buffer,
+            /*output_offset=*/0,
+            &context->argmax_buffer,
+            /*argmax_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            apply_token_mask ? &context->token_mask_buffer : NULL,
+            /*mask_offset=*/0,
+            num_tokens,
+            /*num_cols=*/model->embedding_dim,
+            /*num_rows=*/model->vocabulary_size);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_i8w_unembedding kernel launch");
+            return status;
+        }
+    } else {
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
+            command_buffer,
+            &model->f32_bf16w_unembedding_fn,
+            &model->f32_bf16w_dense_unembedding_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(num_tokens)][gptoss_launch_kernel_unembedding],
+            model->max_threadgroups,
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->unembedding_weight_offset,
+            &context->score_buffer,
+            /*output_offset=*/0,
+            &context->argmax_buffer,
+            /*argmax_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            apply_token_mask ? &context->token_mask_buffer : NULL,
+            /*mask_offset=*/0,
+            num_tokens,
+            /*num_cols=*/model->embedding_dim,
+            /*num_rows=*/model->vocabulary_size);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch");
+            return status;
+        }
+    }
+    return gptoss_status_success;
+}
+
+// For lazily loaded models, makes the command buffer wait until the weight region (0: expert-shared weights,
+// 1 + n: MoE weights of block n) is paged in.
+static enum gptoss_status encode_wait_for_weights(
+    const struct gptoss_model* model,
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t region)
+{
+    if (atomic_load_explicit(&model->weight_loader.num_ready_regions, memory_order_acquire) > region) {
+        return gptoss_status_success;
+    }
+    const enum gptoss_status status = gptoss_metal_command_buffer_encode_wait_event(
+        command_buffer, &model->weight_loader.event, (uint64_t) region + 1);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode wait for weight region #%zu", region);
+    }
+    return status;
+}
+
+// Prefill: input_tokens_offset = number of tokens in KV cache, num_input_tokens > 0, num_output_tokens = 0.
+// Sampling: input_tokens_offset = number of tokens in the context - 1, num_input_tokens = 1, num_output_tokens = 1.
+// Perplexity: input_tokens_offset = 0, num_input_tokens > 1, num_output_tokens = num_input_tokens.
+static enum gptoss_status process_tokens(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t input_tokens_offset,
+    size_t num_input_tokens,
+    size_t num_output_tokens,
+    bool apply_token_mask)
+{
+    assert(num_input_tokens != 0);
+    assert(num_output_tokens <= context->model->max_batch_tokens);
+    assert(num_input_tokens >= num_output_tokens);
+
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+
+    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+
+    const size_t input_tokens_end = input_tokens_offset + num_input_tokens;
+    for (size_t input_batch_start = input_tokens_offset;
+        input_batch_start < input_tokens_end;
+        input_batch_start += model->max_batch_tokens)
+    {
+        const size_t input_batch_size = math_min(model->max_batch_tokens, input_tokens_end - input_batch_start);
+        const size_t input_batch_end = input_batch_start + input_batch_size;
+        const size_t output_batch_size = math_sub_sat(num_output_tokens, input_tokens_end - input_batch_end);
+
+        status = encode_wait_for_weights(model, command_buffer, /*region=*/0);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        gptoss_metal_command_buffer_set_timing_tag(command_buffer, GPTOSS_PROFILE_NO_BLOCK);
+        status = gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings(
+            command_buffer,
+            &model->bf16_f32_embeddings_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(input_batch_size)][gptoss_launch_kernel_embeddings],
+            &context->token_buffer,
+            input_batch_start * sizeof(uint32_t),
+            &model->shared_weight_buffer,
+            /*weight_offset=*/0,
+            &context->residual_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/input_batch_size,
+            /*num_channels=*/model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode bf16_f32_embeddings kernel launch");
+            return status;
+        }
+        for (uint32_t n = 0; n < model->num_blocks; n++) {
+            const bool last_block = n + 1 == model->num_blocks;
+            const size_t num_block_output_tokens = last_block ? output_batch_size : input_batch_size;
+
+            status = encode_wait_for_weights(model, command_buffer, /*region=*/1 + n);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+            gptoss_metal_command_buffer_set_timing_tag(command_buffer, n);
+            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_matmul(
+                command_buffer,
+                &model->f32_bf16w_rmsnorm_matmul_fn,
+                &model->f32_bf16w_rmsnorm_dense_matmul_fn,
+                model->threadgroup_size[gptoss_get_launch_shape(input_batch_size)][gptoss_launch_kernel_qkv],
+                &context->residual_activation_buffer,
+                /*input_offset=*/0,
+                &model->shared_weight_buffer,
+                /*gain_offset=*/model->attn_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
+                &model->shared_weight_buffer,
+                /*weight_offset=*/model->attn_qkv_weight_offset + model->per_block_shared_weights_size * n,
+                &model->shared_weight_buffer,
+                /*bias_offset=*/model->attn_qkv_bias_offset + model->per_block_shared_weights_size * n,
+                &context->qkv_activation_buffer,
+                /*output_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                /*num_tokens=*/input_batch_size,
+                /*num_cols=*/model->embedding_dim,
+                /*num_rows=*/attn_qkv_dim,
+                model->rmsnorm_epsilon);
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_matmul kernel launch");
+                return status;
+            }
+
+            status = process_block_attention(
+                context,
+                /*activation_context=*/context,
+                command_buffer,
+                n,
+                /*qkv_row=*/0,
+                /*sdpa_row=*/0,
+                /*token_offset=*/input_batch_start,
+                /*num_tokens=*/input_batch_size,
+                /*num_output_tokens=*/num_block_output_tokens);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+
+            if (num_block_output_tokens != 0) {
+                status = process_block_mlp(
+                    context,
+                    command_buffer,
+                    n,
+                    /*residual_row=*/input_batch_size - num_block_output_tokens,
+                    /*num_tokens=*/num_block_output_tokens);
                 if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_sdpa kernel launch");
                     return status;
                 }
+            }
+        }
+
+        gptoss_metal_command_buffer_set_timing_tag(command_buffer, GPTOSS_PROFILE_NO_BLOCK);
+        if (output_batch_size != 0) {
+            status = process_unembedding(
+                context,
+                command_buffer,
+                /*residual_row=*/input_batch_size - output_batch_size,
+                /*num_tokens=*/output_batch_size,
+                apply_token_mask);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+        }
+    }
+    return gptoss_status_success;
+}
+
+// Tokens [token_offset, token_offset + num_tokens) of a context, processed as a part of a batch.
+struct batch_segment {
+    gptoss_context_t context;
+    size_t token_offset;
+    size_t num_tokens;
+};
+
+// Batched processing of token segments from several contexts in a single pass through the model. Activations of the
+// whole batch live in the activation buffers of activation_context, with the segments occupying consecutive rows,
+// while RoPE, the KV cache write, and SDPA run per segment against the KV cache of the segment's context. The last
+// num_output_segments segments must consist of a single token each, and row i of the score and argmax buffers of
+// activation_context receives the outputs for the i-th of them. Segments of the same context must be ordered by
+// token offset.
+static enum gptoss_status process_batch_tokens(
+    gptoss_context_t activation_context,
+    const struct batch_segment* segments,
+    size_t num_segments,
+    size_t num_output_segments,
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    assert(num_segments != 0);
+    assert(num_output_segments <= num_segments);
+
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = activation_context->model;
+
+    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+
+    status = encode_wait_for_weights(model, command_buffer, /*region=*/0);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    size_t num_batch_tokens = 0;
+    gptoss_metal_command_buffer_set_timing_tag(command_buffer, GPTOSS_PROFILE_NO_BLOCK);
+    for (size_t i = 0; i < num_segments; i++) {
+        assert(i + num_output_segments < num_segments || segments[i].num_tokens == 1);
+        const enum gptoss_launch_shape segment_shape = gptoss_get_launch_shape(segments[i].num_tokens);
+        status = gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings(
+            command_buffer,
+            &model->bf16_f32_embeddings_fn,
+            model->threadgroup_size[segment_shape][gptoss_launch_kernel_embeddings],
+            &segments[i].context->token_buffer,
+            segments[i].token_offset * sizeof(uint32_t),
+            &model->shared_weight_buffer,
+            /*weight_offset=*/0,
+            &activation_context->residual_activation_buffer,
+            /*output_offset=*/model->embedding_dim * num_batch_tokens * sizeof(float),
+            &activation_context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/segments[i].num_tokens,
+            /*num_channels=*/model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode bf16_f32_embeddings kernel launch");
+            return status;
+        }
+        num_batch_tokens += segments[i].num_tokens;
+    }
+    assert(num_batch_tokens <= model->max_batch_tokens);
+
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        status = encode_wait_for_weights(model, command_buffer, /*region=*/1 + n);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        gptoss_metal_command_buffer_set_timing_tag(command_buffer, n);
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_matmul(
+            command_buffer,
+            &model->f32_bf16w_rmsnorm_matmul_fn,
+            &model->f32_bf16w_rmsnorm_dense_matmul_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(num_batch_tokens)][gptoss_launch_kernel_qkv],
+            &activation_context->residual_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*gain_offset=*/model->attn_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->attn_qkv_weight_offset + model->per_block_shared_weights_size * n,
+            &model->shared_weight_buffer,
+            /*bias_offset=*/model->attn_qkv_bias_offset + model->per_block_shared_weights_size * n,
+            &activation_context->qkv_activation_buffer,
+            /*output_offset=*/0,
+            &activation_context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/num_batch_tokens,
+            /*num_cols=*/model->embedding_dim,
+            /*num_rows=*/attn_qkv_dim,
+            model->rmsnorm_epsilon);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_matmul kernel launch");
+            return status;
+        }
+
+        size_t row = 0;
+        for (size_t i = 0; i < num_segments; i++) {
+            // Attention of different contexts touches disjoint activation rows and KV cache slots, so the RoPE of a
+            // segment may overlap the SDPA of the previous one.
+            if (i != 0 && segments[i].context != segments[i - 1].context) {
+                gptoss_metal_command_buffer_overlap_next_launch(command_buffer);
+            }
+            status = process_block_attention(
+                segments[i].context,
+                activation_context,
+                command_buffer,
+                n,
+                /*qkv_row=*/row,
+                /*sdpa_row=*/row,
+                segments[i].token_offset,
+                segments[i].num_tokens,
+                /*num_output_tokens=*/segments[i].num_tokens);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+            row += segments[i].num_tokens;
+        }
+
+        status = process_block_mlp(
+            activation_context,
+            command_buffer,
+            n,
+            /*residual_row=*/0,
+            /*num_tokens=*/num_batch_tokens);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    gptoss_metal_command_buffer_set_timing_tag(command_buffer, GPTOSS_PROFILE_NO_BLOCK);
+    if (num_output_segments == 0) {
+        return gptoss_status_success;
+    }
+    return process_unembedding(
+        activation_context,
+        command_buffer,
+        /*residual_row=*/num_batch_tokens - num_output_segments,
+        /*num_tokens=*/num_output_segments,
+        /*apply_token_mask=*/false);
+}
+
+// Returns the state of the token automaton after the given token is sampled in the given state. Mirrors
+// gptoss_u32_advance_token_automaton on the CPU.
+static uint32_t get_next_token_state(
+    const struct gptoss_context* context,
+    uint32_t state,
+    uint32_t token)
+{
+    const uint32_t num_states = context->num_token_states;
+    const uint32_t* row_offsets = (const uint32_t*) context->token_transition_buffer.ptr;
+    const uint32_t* default_states = row_offsets + num_states + 1;
+    const uint32_t* transition_tokens = default_states + num_states;
+    const uint32_t* transition_states = transition_tokens + context->num_token_transitions;
+
+    uint32_t lo = row_offsets[state];
+    uint32_t hi = row_offsets[state + 1];
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (transition_tokens[mid] < token) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const bool explicit_transition = lo < row_offsets[state + 1] && transition_tokens[lo] == token;
+    return explicit_transition ? transition_states[lo] : default_states[state];
+}
+
+// Terminates the active stream, if any: waits for the steps still in flight and drops their tokens from the context,
+// keeping only the tokens already delivered by gptoss_context_stream_next. The token automaton is rolled back to its
+// state after the last delivered token.
+static void finish_stream(
+    gptoss_context_t context)
+{
+    struct gptoss_context_stream* stream = &context->stream;
+    if (!stream->active) {
+        return;
+    }
+
+    while (stream->num_inflight_steps != 0) {
+        struct gptoss_metal_command_buffer* command_buffer = &stream->command_buffers[stream->next_command_buffer];
+        wait_command_buffer(context, command_buffer);
+        end_decode_step(context->model);
+        gptoss_metal_command_buffer_release(command_buffer);
+        stream->next_command_buffer = (stream->next_command_buffer + 1) % GPTOSS_STREAM_DEPTH;
+        stream->num_inflight_steps -= 1;
+    }
+
+    context->num_tokens = stream->num_original_tokens + stream->num_delivered_tokens;
+    context->num_kv_tokens = context->num_tokens;
+    release_kvcache_pages(context, context->num_kv_tokens);
+    if (context->num_token_states != 0) {
+        const uint32_t* token_ptr = (const uint32_t*) context->token_buffer.ptr;
+        uint32_t token_state = stream->original_token_state;
+        for (size_t t = stream->num_original_tokens; t < context->num_tokens; t++) {
+            token_state = get_next_token_state(context, token_state, token_ptr[t]);
+        }
+        ((struct gptoss_control*) context->control_buffer.ptr)->token_state = token_state;
+    }
+    stream->active = false;
+}
+
+// Invalidates the KV cache starting with token num_valid_tokens.
+static void truncate_kvcache(
+    gptoss_context_t context,
+    size_t num_valid_tokens)
+{
+    const struct gptoss_model* model = context->model;
+    // Ring buffers of sliding-window blocks retain only the last num_window_kv_slots tokens written to the KV cache.
+    // If tokens within the attention window before the truncation point have been overwritten, the KV cache must be
+    // recomputed from the start, or from the end of the shared prefix, whose KV cache is never overwritten.
+    const size_t first_attended_token = math_sub_sat(num_valid_tokens + 1, model->attention_window);
+    const size_t first_retained_token = math_sub_sat(context->kvcache_watermark, context->num_window_kv_slots);
+    if (first_attended_token < first_retained_token) {
+        num_valid_tokens = context->num_prefix_tokens;
+    }
+    context->num_kv_tokens = num_valid_tokens;
+    release_kvcache_pages(context, num_valid_tokens);
+}
+
+static enum gptoss_status prefill_tokens(
+    gptoss_context_t context,
+    size_t input_tokens_end);
+
+// Makes room for num_required_tokens more tokens in a streaming context by evicting the oldest tokens after the
+// attention sinks. The remaining tokens move down to the positions of the evicted ones, and their keys in the KV cache
+// are rotated to the new positions, so that the context continues as if the evicted tokens were never there. Evicts
+// fewer tokens if more would push the attention window of the last token into the sinks, and fails with
+// gptoss_status_context_overflow only if the context is full and no tokens can be evicted.
+static enum gptoss_status evict_tokens(
+    gptoss_context_t context,
+    size_t num_required_tokens)
+{
+    assert(!context->encoding);
+    assert(context->num_sink_tokens != 0);
+    const size_t num_free_tokens = context->max_tokens - context->num_tokens;
+    if (num_free_tokens >= num_required_tokens) {
+        return gptoss_status_success;
+    }
+
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_model* model = context->model;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+
+    // Evicting whole ring buffers keeps every remaining token of sliding-window blocks in its slot, and, as the sinks
+    // and ring buffers are page-aligned, frees whole KV cache pages of full-attention blocks.
+    const size_t num_sink_tokens = context->num_sink_tokens;
+    const size_t eviction_quantum = context->num_window_kv_slots;
+    const size_t num_recent_tokens = context->num_tokens - num_sink_tokens;
+    num_required_tokens = math_min(num_required_tokens, context->max_tokens);
+    size_t num_evicted_tokens = math_max(num_required_tokens - num_free_tokens, num_recent_tokens / GPTOSS_STREAMING_EVICT_DIVISOR);
+    num_evicted_tokens = math_ceil_div(num_evicted_tokens, eviction_quantum) * eviction_quantum;
+    const size_t max_evicted_tokens = math_sub_sat(num_recent_tokens, model->attention_window) / eviction_quantum * eviction_quantum;
+    num_evicted_tokens = math_min(num_evicted_tokens, max_evicted_tokens);
+    if (num_evicted_tokens == 0) {
+        return num_free_tokens != 0 ? gptoss_status_success : gptoss_status_context_overflow;
+    }
+
+    // The remaining tokens attend to the evicted ones: process all tokens before evicting any.
+    if (context->num_kv_tokens > context->num_tokens) {
+        truncate_kvcache(context, context->num_tokens);
+    }
+    if (context->num_kv_tokens < context->num_tokens) {
+        status = prefill_tokens(context, context->num_tokens);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    // Return the pages of the evicted tokens to the pool, and move the pages of the remaining tokens down.
+    struct gptoss_kvcache_pool* pool = &model->kvcache_pools[context->kvcache_type];
+    const size_t first_evicted_page = num_sink_tokens / GPTOSS_KVCACHE_PAGE_TOKENS;
+    const size_t num_evicted_pages = num_evicted_tokens / GPTOSS_KVCACHE_PAGE_TOKENS;
+    assert(context->num_kv_pages >= first_evicted_page + num_evicted_pages);
+    pthread_mutex_lock(&model->lock);
+    for (uint32_t n = 1; n < model->num_blocks; n += 2) {
+        uint32_t* page_table = get_block_page_table(context, n);
+        for (size_t p = first_evicted_page; p < first_evicted_page + num_evicted_pages; p++) {
+            pool->free_pages[pool->num_free_pages++] = page_table[p];
+        }
+        memmove(page_table + first_evicted_page, page_table + first_evicted_page + num_evicted_pages,
+            (context->num_kv_pages - first_evicted_page - num_evicted_pages) * sizeof(uint32_t));
+    }
+    pthread_mutex_unlock(&model->lock);
+    context->kvcache_size -= num_evicted_pages * (model->num_blocks / 2) * pool->page_size;
+    context->num_kv_pages -= num_evicted_pages;
+
+    uint32_t* tokens = (uint32_t*) context->token_buffer.ptr;
+    memmove(tokens + num_sink_tokens, tokens + num_sink_tokens + num_evicted_tokens,
+        (context->num_tokens - num_sink_tokens - num_evicted_tokens) * sizeof(uint32_t));
+    context->num_tokens -= num_evicted_tokens;
+    context->num_kv_tokens -= num_evicted_tokens;
+    context->kvcache_watermark -= num_evicted_tokens;
+
+    const struct gptoss_metal_function* kv_rope_shift_fn = &model->kv_rope_shift_fn;
+    switch (context->kvcache_type) {
+        case gptoss_kvcache_type_f32:
+            break;
+        case gptoss_kvcache_type_bf16:
+            kv_rope_shift_fn = &model->bf16kv_rope_shift_fn;
+            break;
+        case gptoss_kvcache_type_i8:
+            kv_rope_shift_fn = &model->i8kv_rope_shift_fn;
+            break;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    control->abort = 0;
+
+    status = create_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    // Rotate all slots of the ring buffers of sliding-window blocks, and the remaining tokens after the sinks in
+    // full-attention blocks. KV caches of different blocks are disjoint.
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        if (n != 0) {
+            gptoss_metal_command_buffer_overlap_next_launch(&command_buffer);
+        }
+        if (n % 2 == 0) {
+            status = gptoss_metal_command_buffer_encode_launch_kv_rope_shift(
+                &command_buffer,
+                kv_rope_shift_fn,
+                &context->kvcache_buffer,
+                get_block_kvcache_offset(context, n),
+                &context->control_buffer,
+                /*control_offset=*/0,
+                /*page_table_buffer=*/NULL,
+                /*page_table_offset=*/0,
+                model->rope_theta,
+                model->interpolation_scale,
+                model->yarn_offset,
+                model->yarn_scale,
+                /*num_tokens=*/context->num_window_kv_slots,
+                model->num_kv_heads,
+                model->head_dim,
+                /*token_offset=*/0,
+                /*position_shift=*/-(int32_t) num_evicted_tokens,
+                context->num_window_kv_slots);
+        } else {
+            status = gptoss_metal_command_buffer_encode_launch_kv_rope_shift(
+                &command_buffer,
+                kv_rope_shift_fn,
+                &pool->buffer,
+                /*kvcache_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                &context->kvcache_page_table_buffer,
+                /*page_table_offset=*/(n / 2) * context->max_kv_pages * sizeof(uint32_t),
+                model->rope_theta,
+                model->interpolation_scale,
+                model->yarn_offset,
+                model->yarn_scale,
+                /*num_tokens=*/context->num_kv_tokens - num_sink_tokens,
+                model->num_kv_heads,
+                model->head_dim,
+                /*token_offset=*/num_sink_tokens,
+                /*position_shift=*/-(int32_t) num_evicted_tokens,
+                context->num_kv_pages * GPTOSS_KVCACHE_PAGE_TOKENS);
+        }
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode kv_rope_shift kernel launch");
+            end_encoding(context);
+            goto cleanup;
+        }
+    }
+
+    status = commit_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = wait_command_buffer(context, &command_buffer);
+
+cleanup:
+    if (status != gptoss_status_success) {
+        // Keys of the remaining tokens may be at their old positions: recompute the KV cache.
+        truncate_kvcache(context, 0);
+    }
+    gptoss_metal_command_buffer_release(&command_buffer);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_append_chars(
+    gptoss_context_t context,
+    const char* text,
+    size_t text_length,
+    size_t* num_tokens_out)
+{
+    uint32_t* tokens = NULL;
+    size_t num_tokens = 0;
+    enum gptoss_status status = gptoss_tokenizer_encode_text(
+        context->model->tokenizer, text, text_length, &tokens, &num_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    const size_t old_num_tokens = context->num_tokens;
+    status = gptoss_context_append_tokens(context, num_tokens, tokens);
+    free(tokens);
+    if (num_tokens_out != NULL) {
+        *num_tokens_out = context->num_tokens - old_num_tokens;
+    }
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_append_tokens(
+    gptoss_context_t context,
+    size_t num_tokens,
+    const uint32_t* tokens)
+{
+    const struct gptoss_model* model = context->model;
+
+    // Validate all tokens
+    for (size_t t = 0; t < num_tokens; t++) {
+        const uint32_t token = tokens[t];
+        if (token >= model->vocabulary_size) {
+            GPTOSS_LOG_ERROR("token %" PRIu32 " at index %zu is out of bounds for vocabulary size %" PRIu32,
+                token, t, context->model->vocabulary_size);
+            return gptoss_status_invalid_argument;
+        }
+    }
+
+    finish_stream(context);
+
+    enum gptoss_status status = gptoss_status_success;
+    uint32_t* input_tokens = (uint32_t*) context->token_buffer.ptr;
+    while (num_tokens != 0) {
+        if (context->num_tokens == context->max_tokens) {
+            if (context->num_sink_tokens == 0) {
+                status = gptoss_status_context_overflow;
+                break;
+            }
+            status = evict_tokens(context, num_tokens);
+            if (status != gptoss_status_success) {
+                break;
+            }
+        }
+
+        if (context->num_kv_tokens > context->num_tokens) {
+            const size_t num_tokens_to_verify = math_min(context->num_kv_tokens - context->num_tokens, num_tokens);
+            size_t num_verified_tokens = 0;
+            for (; num_verified_tokens < num_tokens_to_verify; num_verified_tokens++) {
+                if (input_tokens[context->num_tokens + num_verified_tokens] != tokens[num_verified_tokens]) {
+                    if (context->num_tokens + num_verified_tokens < context->num_prefix_tokens) {
+                        GPTOSS_LOG_ERROR("token %" PRIu32 " at position %zu diverges from the shared prefix",
+                            tokens[num_verified_tokens], context->num_tokens + num_verified_tokens);
+                        status = gptoss_status_invalid_argument;
+                    } else {
+                        // Invalidate the KV cache starting with the newly added tokens.
+                        truncate_kvcache(context, context->num_tokens + num_verified_tokens);
+                    }
+                    break;
+                }
+            }
+
+            context->num_tokens += num_verified_tokens;
+            tokens += num_verified_tokens;
+            num_tokens -= num_verified_tokens;
+            if (status != gptoss_status_success) {
+                break;
+            }
+        } else {
+            const size_t num_tokens_to_copy = math_min(context->max_tokens - context->num_tokens, num_tokens);
+            memcpy(input_tokens + context->num_tokens, tokens, num_tokens_to_copy * sizeof(uint32_t));
+            context->num_tokens += num_tokens_to_copy;
+            tokens += num_tokens_to_copy;
+            num_tokens -= num_tokens_to_copy;
+        }
+    }
+
+    if (status == gptoss_status_success) {
+        // Grow the paged KV cache with the context.
+        status = reserve_kvcache_pages(context, context->num_tokens);
+    }
+    return status;
+}
+
+// Waits for completion of a committed command buffer, records its GPU timestamps, and releases it.
+static enum gptoss_status retire_command_buffer(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    enum gptoss_status status = wait_command_buffer(context, command_buffer);
+    if (status == gptoss_status_success) {
+        double gpu_start_time = 0.0, gpu_end_time = 0.0;
+        status = gptoss_metal_command_buffer_get_gpu_timestamps(command_buffer, &gpu_start_time, &gpu_end_time);
+        if (status == gptoss_status_success) {
+            // Command buffers are retired in submission order, so the first one retired started first
+            if (context->gpu_start_time == 0.0) {
+                context->gpu_start_time = gpu_start_time;
+            }
+            context->gpu_end_time = gpu_end_time;
+            context->gpu_busy_time += gpu_end_time - gpu_start_time;
+        }
+    }
+    gptoss_metal_command_buffer_release(command_buffer);
+    return status;
+}
+
+// Processes tokens [num_kv_tokens, input_tokens_end) into the KV cache without producing outputs.
+// Each batch of max_batch_tokens tokens is submitted in its own command buffer, and up to two command buffers are in
+// flight at a time, so the CPU encodes batch k+1 while the GPU executes batch k, unless decoding steps of any context
+// are pending. Command buffers on the same queue execute in submission order, so all batches share one set of
+// activation buffers.
+static enum gptoss_status prefill_tokens(
+    gptoss_context_t context,
+    size_t input_tokens_end)
+{
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+    struct gptoss_metal_command_buffer command_buffers[2] = {0};
+    size_t num_batches = 0;
+
+    context->gpu_start_time = 0.0;
+    context->gpu_end_time = 0.0;
+    context->gpu_busy_time = 0.0;
+
+    status = reserve_kvcache_pages(context, input_tokens_end);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    control->abort = 0;
+
+    for (size_t input_batch_start = context->num_kv_tokens;
+        input_batch_start < input_tokens_end;
+        input_batch_start += model->max_batch_tokens)
+    {
+        const size_t input_batch_size = math_min(model->max_batch_tokens, input_tokens_end - input_batch_start);
+
+        struct gptoss_metal_command_buffer* command_buffer = &command_buffers[num_batches % 2];
+        if (command_buffer->object != NULL) {
+            status = retire_command_buffer(context, command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+        }
+        // Yield the GPU to decoding: let the previous batch complete before the next one is submitted.
+        struct gptoss_metal_command_buffer* previous_command_buffer = &command_buffers[(num_batches + 1) % 2];
+        if (previous_command_buffer->object != NULL &&
+            atomic_load_explicit(&context->model->num_pending_decode_steps, memory_order_relaxed) != 0)
+        {
+            status = retire_command_buffer(context, previous_command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+        }
+
+        status = create_command_buffer(context, command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        status = process_tokens(
+            context,
+            command_buffer,
+            /*input_tokens_offset=*/input_batch_start,
+            /*num_input_tokens=*/input_batch_size,
+            /*num_output_tokens=*/0,
+            /*apply_token_mask=*/false);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        status = commit_command_buffer(context, command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        num_batches += 1;
+    }
+
+cleanup:
+    end_encoding(context);
+    // Retire in-flight command buffers in submission order. Uncommitted command buffers are released without waiting.
+    for (size_t i = 0; i < 2; i++) {
+        struct gptoss_metal_command_buffer* command_buffer = &command_buffers[(num_batches + i) % 2];
+        if (command_buffer->object != NULL) {
+            const enum gptoss_status retire_status = status == gptoss_status_success ?
+                retire_command_buffer(context, command_buffer) : gptoss_metal_command_buffer_release(command_buffer);
+            if (status == gptoss_status_success) {
+                status = retire_status;
+            }
+        }
+    }
+    if (status == gptoss_status_success) {
+        count_tokens(context, input_tokens_end - context->num_kv_tokens, 0);
+        context->num_kv_tokens = input_tokens_end;
+    }
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_process(
+    gptoss_context_t context)
+{
+    finish_stream(context);
+
+    if (context->num_tokens > context->num_kv_tokens) {
+        return prefill_tokens(context, context->num_tokens);
+    }
+    
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_process_partial(
+    gptoss_context_t context,
+    size_t max_tokens,
+    size_t* num_remaining_tokens_out)
+{
+    if (max_tokens == 0) {
+        GPTOSS_LOG_ERROR("maximum number of tokens to process must be positive");
+        return gptoss_status_invalid_argument;
+    }
+
+    finish_stream(context);
+
+    enum gptoss_status status = gptoss_status_success;
+    if (context->num_tokens > context->num_kv_tokens) {
+        status = prefill_tokens(context, math_min(context->num_tokens, context->num_kv_tokens + max_tokens));
+    }
+    if (num_remaining_tokens_out != NULL) {
+        *num_remaining_tokens_out = math_sub_sat(context->num_tokens, context->num_kv_tokens);
+    }
+    return status;
+}
+
+// Encodes sampling of the next token from row `row` of the activation context's score buffer and stores the sampled
+// token ID at index token_index of token_buffer. Temperature 0 selects the argmax token. With top-k or top-p
+// truncation, the token is sampled among the top candidates directly from the scores.
+static enum gptoss_status sample_token(
+    gptoss_context_t activation_context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t row,
+    float temperature,
+    uint32_t top_k,
+    float top_p,
+    uint64_t seed,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_index)
+{
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = activation_context->model;
+
+    if (temperature != 0.0f && (top_k != 0 || top_p < 1.0f)) {
+        status = gptoss_metal_command_buffer_encode_launch_f32_topk_sample(
+            command_buffer,
+            &model->f32_topk_sample_fn,
+            &activation_context->score_buffer,
+            /*score_offset=*/model->vocabulary_size * row * sizeof(float),
+            token_buffer,
+            /*token_offset=*/token_index * sizeof(uint32_t),
+            &activation_context->control_buffer,
+            /*control_offset=*/0,
+            /*rng_seed=*/seed + UINT64_C(0x123456789ABCDEF),
+            /*rng_offset=*/token_index,
+            /*num_channels=*/model->vocabulary_size,
+            top_k,
+            top_p,
+            temperature);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_topk_sample kernel launch");
+            return status;
+        }
+    } else if (temperature != 0.0f) {
+        uint32_t num_threadgroups = 0;
+        uint32_t num_dims_per_threadgroup = 0;
+        status = gptoss_metal_command_buffer_encode_launch_f32_softmax(
+            command_buffer,
+            &model->f32_softmax_fn,
+            model->threadgroup_size[gptoss_launch_shape_decode][gptoss_launch_kernel_softmax],
+            model->max_threadgroups,
+            &activation_context->score_buffer,
+            /*score_offset=*/model->vocabulary_size * row * sizeof(float),
+            &activation_context->argmax_buffer,
+            /*argmax_offset=*/row * sizeof(uint64_t),
+            &activation_context->prob_buffer,
+            /*prob_offset=*/model->vocabulary_size * row * sizeof(float),
+            &activation_context->sum_buffer,
+            /*sum_offset=*/model->max_threadgroups * row * sizeof(float),
+            &activation_context->control_buffer,
+            /*control_offset=*/0,
+            model->vocabulary_size,
+            /*num_tokens=*/1,
+            temperature,
+            &num_threadgroups,
+            &num_dims_per_threadgroup);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_softmax kernel launch");
+            return status;
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_sample(
+            command_buffer,
+            &model->f32_sample_fn,
+            /*min_threadgroup_size=*/512,
+            &activation_context->prob_buffer,
+            /*prob_offset=*/model->vocabulary_size * row * sizeof(float),
+            &activation_context->sum_buffer,
+            /*sum_offset=*/model->max_threadgroups * row * sizeof(float),
+            token_buffer,
+            /*token_offset=*/token_index * sizeof(uint32_t),
+            &activation_context->control_buffer,
+            /*control_offset=*/0,
+            /*rng_seed=*/seed + UINT64_C(0x123456789ABCDEF),
+            /*rng_offset=*/token_index,
+            /*num_blocks=*/num_threadgroups,
+            /*num_channels=*/model->vocabulary_size,
+            /*num_channels_per_block=*/num_dims_per_threadgroup);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_sample kernel launch");
+            return status;
+        }
+    } else {
+        status = gptoss_metal_command_buffer_encode_copy_buffer(
+            command_buffer,
+            &activation_context->argmax_buffer,
+            /*input_offset=*/row * sizeof(uint64_t),
+            token_buffer,
+            /*output_offset=*/token_index * sizeof(uint32_t),
+            /*size=*/sizeof(uint32_t));
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode copy buffer");
+            return status;
+        }
+    }
+    return gptoss_status_success;
+}
+
+// For long prompts, pipelines all but the last batch of the prefill. The last batch is then encoded together with
+// sampling of the first token.
+static enum gptoss_status prefill_for_sampling(
+    gptoss_context_t context)
+{
+    if (context->num_tokens < context->num_prefix_tokens) {
+        GPTOSS_LOG_ERROR("context must start with all %zu shared prefix tokens before sampling", context->num_prefix_tokens);
+        return gptoss_status_invalid_state;
+    }
+
+    const size_t max_batch_tokens = context->model->max_batch_tokens;
+    if (context->num_tokens > context->num_kv_tokens + max_batch_tokens) {
+        const size_t num_last_batch_tokens = (context->num_tokens - context->num_kv_tokens - 1) % max_batch_tokens + 1;
+        return prefill_tokens(context, context->num_tokens - num_last_batch_tokens);
+    }
+    return gptoss_status_success;
+}
+
+// Encodes one decoding step: processing of the pending tokens, sampling of the next token into token_buffer, advancing
+// the token automaton (if any), and, if stop tokens are specified, raising of the abort flag when the sampled token is
+// a stop token. With num_top_logprobs != 0, the most likely tokens and their log-probabilities are also written to
+// top_logprob_buffer at top_token_offset and top_logprob_offset.
+static enum gptoss_status encode_sample_step(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    float temperature,
+    uint64_t seed,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint32_t num_top_logprobs,
+    size_t top_token_offset,
+    size_t top_logprob_offset)
+{
+    enum gptoss_status status = gptoss_status_success;
+    if (context->num_kv_tokens < context->num_tokens) {
+        status = process_tokens(
+            context,
+            command_buffer,
+            /*input_tokens_offset=*/context->num_kv_tokens,
+            /*num_input_tokens=*/context->num_tokens - context->num_kv_tokens,
+            /*num_output_tokens=*/1,
+            /*apply_token_mask=*/context->num_token_states != 0);
+        context->num_kv_tokens = context->num_tokens;
+    } else {
+        status = process_tokens(
+            context,
+            command_buffer,
+            /*input_tokens_offset=*/context->num_tokens - 1,
+            /*num_input_tokens=*/1,
+            /*num_output_tokens=*/1,
+            /*apply_token_mask=*/context->num_token_states != 0);
+    }
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    if (num_top_logprobs != 0) {
+        status = gptoss_metal_command_buffer_encode_launch_f32_top_logprobs(
+            command_buffer,
+            &context->model->f32_top_logprobs_fn,
+            context->model->threadgroup_size[gptoss_launch_shape_decode][gptoss_launch_kernel_top_logprobs],
+            &context->score_buffer,
+            /*score_offset=*/0,
+            &context->argmax_buffer,
+            /*argmax_offset=*/0,
+            &context->top_logprob_buffer,
+            top_token_offset,
+            &context->top_logprob_buffer,
+            top_logprob_offset,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            context->model->vocabulary_size,
+            /*num_tokens=*/1,
+            num_top_logprobs);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_top_logprobs kernel launch");
+            return status;
+        }
+    }
+
+    status = sample_token(
+        context,
+        command_buffer,
+        /*row=*/0,
+        temperature,
+        context->top_k,
+        context->top_p,
+        seed,
+        &context->token_buffer,
+        /*token_index=*/context->num_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    if (context->num_token_states != 0) {
+        status = gptoss_metal_command_buffer_encode_launch_u32_advance_token_automaton(
+            command_buffer,
+            &context->model->u32_advance_token_automaton_fn,
+            &context->token_buffer,
+            /*token_offset=*/context->num_tokens * sizeof(uint32_t),
+            &context->token_transition_buffer,
+            /*transition_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            context->num_token_states,
+            context->num_token_transitions);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode u32_advance_token_automaton kernel launch");
+            return status;
+        }
+    }
+
+    if (num_stop_tokens != 0) {
+        // Raise the abort flag on a stop token, so that kernels for the remaining steps exit early
+        status = gptoss_metal_command_buffer_encode_launch_u32_check_stop_tokens(
+            command_buffer,
+            &context->model->u32_check_stop_tokens_fn,
+            &context->token_buffer,
+            /*token_offset=*/context->num_tokens * sizeof(uint32_t),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            num_stop_tokens,
+            stop_tokens);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode u32_check_stop_tokens kernel launch");
+            return status;
+        }
+    }
+    context->num_tokens += 1;
+    context->num_kv_tokens = context->num_tokens;
+    return gptoss_status_success;
+}
+
+static bool is_stop_token(
+    uint32_t token,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens)
+{
+    for (size_t i = 0; i < num_stop_tokens; i++) {
+        if (stop_tokens[i] == token) {
+            return true;
+        }
+    }
+    return false;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_sampling_params(
+    gptoss_context_t context,
+    uint32_t top_k,
+    float top_p)
+{
+    if (top_k > GPTOSS_MAX_TOP_K) {
+        GPTOSS_LOG_ERROR("top-k (%" PRIu32 ") exceeds the maximum supported (%d)", top_k, GPTOSS_MAX_TOP_K);
+        return gptoss_status_unsupported_argument;
+    }
+    if (!(top_p > 0.0f && top_p <= 1.0f)) {
+        GPTOSS_LOG_ERROR("top-p (%f) must be in (0, 1]", top_p);
+        return gptoss_status_invalid_argument;
+    }
+
+    finish_stream(context);
+    context->top_k = top_k;
+    context->top_p = top_p;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_prefill_activation_type(
+    gptoss_context_t context,
+    enum gptoss_activation_type activation_type)
+{
+    switch (activation_type) {
+        case gptoss_activation_type_f32:
+        case gptoss_activation_type_f16:
+            break;
+        default:
+            GPTOSS_LOG_ERROR("invalid activation type %d", (int) activation_type);
+            return gptoss_status_invalid_argument;
+    }
+
+    context->prefill_activation_type = activation_type;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_token_automaton(
+    gptoss_context_t context,
+    uint32_t num_states,
+    uint32_t initial_state,
+    const uint32_t* allow_masks,
+    const uint32_t* default_states,
+    size_t num_transitions,
+    const uint32_t* transitions)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_buffer token_mask_buffer = {0};
+    struct gptoss_metal_buffer token_transition_buffer = {0};
+    const struct gptoss_model* model = context->model;
+
+    if (num_states != 0) {
+        if (initial_state >= num_states) {
+            GPTOSS_LOG_ERROR("initial state (%" PRIu32 ") must be less than the number of states (%" PRIu32 ")",
+                initial_state, num_states);
+            return gptoss_status_invalid_argument;
+        }
+        if (num_transitions > UINT32_MAX) {
+            GPTOSS_LOG_ERROR("number of transitions (%zu) exceeds the maximum supported", num_transitions);
+            return gptoss_status_unsupported_argument;
+        }
+        for (uint32_t s = 0; s < num_states; s++) {
+            if (default_states[s] >= num_states) {
+                GPTOSS_LOG_ERROR("default next state (%" PRIu32 ") of state %" PRIu32 " is out of range",
+                    default_states[s], s);
+                return gptoss_status_invalid_argument;
+            }
+        }
+        for (size_t i = 0; i < num_transitions; i++) {
+            const uint32_t* transition = transitions + 3 * i;
+            if (transition[0] >= num_states || transition[1] >= model->vocabulary_size || transition[2] >= num_states) {
+                GPTOSS_LOG_ERROR("transition %zu (%" PRIu32 ", %" PRIu32 ", %" PRIu32 ") is out of range",
+                    i, transition[0], transition[1], transition[2]);
+                return gptoss_status_invalid_argument;
+            }
+            if (i != 0 && (transition[0] < transition[-3] || (transition[0] == transition[-3] && transition[1] <= transition[-2]))) {
+                GPTOSS_LOG_ERROR("transitions must be sorted by state, then by token, without duplicates");
+                return gptoss_status_invalid_argument;
+            }
+        }
+
+        // The vocabulary of the model comprises all text and special tokens of its tokenizer, i.e. the num_tokens
+        // returned by gptoss_tokenizer_get_num_tokens, as documented for the masks.
+        const size_t num_mask_words = math_ceil_div(model->vocabulary_size, 32);
+        for (uint32_t s = 0; s < num_states; s++) {
+            // Bits past the last token of the vocabulary are ignored.
+            const uint32_t* mask = allow_masks + (size_t) s * num_mask_words;
+            bool allows_token = false;
+            for (size_t w = 0; w < num_mask_words && !allows_token; w++) {
+                const uint32_t num_word_tokens = (uint32_t) math_min(model->vocabulary_size - w * 32, 32);
+                const uint32_t valid_bits = num_word_tokens == 32 ? UINT32_MAX : (UINT32_C(1) << num_word_tokens) - 1;
+                allows_token = (mask[w] & valid_bits) != 0;
+            }
+            if (!allows_token) {
+                GPTOSS_LOG_ERROR("state %" PRIu32 " of the token automaton allows no tokens", s);
+                return gptoss_status_invalid_argument;
+            }
+        }
+        status = gptoss_metal_buffer_create(&model->device, (size_t) num_states * num_mask_words * sizeof(uint32_t),
+            allow_masks, &token_mask_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        const size_t transition_table_size = (2 * (size_t) num_states + 1 + 2 * num_transitions) * sizeof(uint32_t);
+        status = gptoss_metal_buffer_create(&model->device, transition_table_size, NULL, &token_transition_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        uint32_t* row_offsets = (uint32_t*) token_transition_buffer.ptr;
+        uint32_t* table_default_states = row_offsets + num_states + 1;
+        uint32_t* transition_tokens = table_default_states + num_states;
+        uint32_t* transition_states = transition_tokens + num_transitions;
+        size_t i = 0;
+        for (uint32_t s = 0; s < num_states; s++) {
+            row_offsets[s] = (uint32_t) i;
+            while (i < num_transitions && transitions[3 * i] == s) {
+                transition_tokens[i] = transitions[3 * i + 1];
+                transition_states[i] = transitions[3 * i + 2];
+                i++;
+            }
+        }
+        row_offsets[num_states] = (uint32_t) num_transitions;
+        memcpy(table_default_states, default_states, num_states * sizeof(uint32_t));
+    }
+
+    finish_stream(context);
+    context->allocation_size -= context->token_mask_buffer.size + context->token_transition_buffer.size;
+    context->allocation_size += token_mask_buffer.size + token_transition_buffer.size;
+    gptoss_metal_residency_set_remove_buffer(&context->residency_set, &context->token_mask_buffer);
+    gptoss_metal_residency_set_remove_buffer(&context->residency_set, &context->token_transition_buffer);
+    gptoss_metal_residency_set_add_buffer(&context->residency_set, &token_mask_buffer);
+    gptoss_metal_residency_set_add_buffer(&context->residency_set, &token_transition_buffer);
+    gptoss_metal_residency_set_commit(&context->residency_set);
+    gptoss_metal_buffer_release(&context->token_mask_buffer);
+    gptoss_metal_buffer_release(&context->token_transition_buffer);
+    context->token_mask_buffer = token_mask_buffer;
+    context->token_transition_buffer = token_transition_buffer;
+    context->num_token_states = num_states;
+    context->num_token_transitions = (uint32_t) num_transitions;
+    context->initial_token_state = initial_state;
+    ((struct gptoss_control*) context->control_buffer.ptr)->token_state = initial_state;
+    memset(&token_mask_buffer, 0, sizeof(token_mask_buffer));
+    memset(&token_transition_buffer, 0, sizeof(token_transition_buffer));
+
+cleanup:
+    gptoss_metal_buffer_release(&token_mask_buffer);
+    gptoss_metal_buffer_release(&token_transition_buffer);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_get_token_automaton_state(
+    gptoss_context_t context,
+    uint32_t* state_out)
+{
+    if (context->num_token_states == 0) {
+        GPTOSS_LOG_ERROR("context has no token automaton");
+        return gptoss_status_invalid_state;
+    }
+
+    finish_stream(context);
+    *state_out = ((const struct gptoss_control*) context->control_buffer.ptr)->token_state;
+    return gptoss_status_success;
+}
+
+// Grows the buffer of the most likely tokens and their log-probabilities to at least size bytes.
+static enum gptoss_status reserve_top_logprob_buffer(
+    gptoss_context_t context,
+    size_t size)
+{
+    if (size <= context->top_logprob_buffer.size) {
+        return gptoss_status_success;
+    }
+
+    struct gptoss_metal_buffer top_logprob_buffer = {0};
+    const enum gptoss_status status = gptoss_metal_buffer_create(&context->model->device, size, NULL, &top_logprob_buffer);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    context->allocation_size += top_logprob_buffer.size;
+    context->allocation_size -= context->top_logprob_buffer.size;
+    gptoss_metal_residency_set_remove_buffer(&context->residency_set, &context->top_logprob_buffer);
+    gptoss_metal_residency_set_add_buffer(&context->residency_set, &top_logprob_buffer);
+    gptoss_metal_residency_set_commit(&context->residency_set);
+    gptoss_metal_buffer_release(&context->top_logprob_buffer);
+    context->top_logprob_buffer = top_logprob_buffer;
+    return gptoss_status_success;
+}
+
+// Generates up to max_tokens tokens in a single command buffer. With num_top_logprobs != 0, also reports the
+// num_top_logprobs most likely tokens at each step: the GPU writes the token IDs of all steps followed by their
+// log-probabilities to top_logprob_buffer, and only the rows of generated tokens are copied out.
+static enum gptoss_status sample_tokens(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint32_t num_top_logprobs,
+    uint32_t* tokens_out,
+    uint32_t* top_tokens_out,
+    float* top_logprobs_out,
+    size_t* num_tokens_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+
+    *num_tokens_out = 0;
+
+    if (num_stop_tokens > GPTOSS_MAX_STOP_TOKENS) {
+        GPTOSS_LOG_ERROR("number of stop tokens (%zu) exceeds the maximum supported (%d)",
+            num_stop_tokens, GPTOSS_MAX_STOP_TOKENS);
+        return gptoss_status_unsupported_argument;
+    }
+
+    finish_stream(context);
+
+    if (context->num_sink_tokens != 0) {
+        status = evict_tokens(context, max_tokens);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        max_tokens = math_min(max_tokens, context->max_tokens - context->num_tokens);
+    }
+
+    const uint32_t num_original_tokens = context->num_tokens;
+
+    status = prefill_for_sampling(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    // All steps are encoded into a single command buffer: reserve KV cache pages for all of them upfront.
+    status = reserve_kvcache_pages(context, context->num_tokens + max_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    if (num_top_logprobs != 0) {
+        status = reserve_top_logprob_buffer(context, max_tokens * num_top_logprobs * (sizeof(uint32_t) + sizeof(float)));
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    status = create_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    control->abort = 0;
+
+    for (size_t t = 0; t < max_tokens; t++) {
+        status = encode_sample_step(context, &command_buffer, temperature, seed, num_stop_tokens, stop_tokens,
+            num_top_logprobs,
+            /*top_token_offset=*/t * num_top_logprobs * sizeof(uint32_t),
+            /*top_logprob_offset=*/max_tokens * num_top_logprobs * sizeof(uint32_t) + t * num_top_logprobs * sizeof(float));
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    commit_command_buffer(context, &command_buffer);
+    begin_decode_step(context->model);
+    wait_command_buffer(context, &command_buffer);
+    end_decode_step(context->model);
+
+    const uint32_t* token_ptr = (const uint32_t*) context->token_buffer.ptr;
+    uint32_t num_generated_tokens = context->num_tokens - num_original_tokens;
+    if (control->abort != 0) {
+        // Tokens after the first stop token were never computed: drop them from the context
+        for (uint32_t t = 0; t < num_generated_tokens; t++) {
+            if (is_stop_token(token_ptr[num_original_tokens + t], num_stop_tokens, stop_tokens)) {
+                num_generated_tokens = t + 1;
+                break;
+            }
+        }
+        context->num_tokens = num_original_tokens + num_generated_tokens;
+        context->num_kv_tokens = context->num_tokens;
+    }
+    memcpy(tokens_out, token_ptr + num_original_tokens, num_generated_tokens * sizeof(uint32_t));
+    if (num_top_logprobs != 0) {
+        const char* top_logprob_ptr = (const char*) context->top_logprob_buffer.ptr;
+        memcpy(top_tokens_out, top_logprob_ptr, num_generated_tokens * num_top_logprobs * sizeof(uint32_t));
+        memcpy(top_logprobs_out, top_logprob_ptr + max_tokens * num_top_logprobs * sizeof(uint32_t),
+            num_generated_tokens * num_top_logprobs * sizeof(float));
+    }
+    *num_tokens_out = num_generated_tokens;
+    count_tokens(context, 0, num_generated_tokens);
+
+cleanup:
+    end_encoding(context);
+    gptoss_metal_command_buffer_release(&command_buffer);
+    // Return the pages reserved for steps after an early stop, or never encoded after a failure.
+    release_kvcache_pages(context, context->num_kv_tokens);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    return sample_tokens(context, temperature, seed, max_tokens, num_stop_tokens, stop_tokens,
+        /*num_top_logprobs=*/0, tokens_out, /*top_tokens_out=*/NULL, /*top_logprobs_out=*/NULL, num_tokens_out);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_with_top_logprobs(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    size_t num_top_logprobs,
+    uint32_t* tokens_out,
+    uint32_t* top_tokens_out,
+    float* top_logprobs_out,
+    size_t* num_tokens_out)
+{
+    if (num_top_logprobs == 0 || num_top_logprobs > GPTOSS_MAX_TOP_LOGPROBS ||
+        num_top_logprobs > context->model->vocabulary_size)
+    {
+        *num_tokens_out = 0;
+        GPTOSS_LOG_ERROR("number of top log-probabilities (%zu) must be between 1 and %d",
+            num_top_logprobs, GPTOSS_MAX_TOP_LOGPROBS);
+        return gptoss_status_invalid_argument;
+    }
+    return sample_tokens(context, temperature, seed, max_tokens, num_stop_tokens, stop_tokens,
+        (uint32_t) num_top_logprobs, tokens_out, top_tokens_out, top_logprobs_out, num_tokens_out);
+}
+
+// Encodes and commits the next decoding step of the active stream.
+static enum gptoss_status submit_stream_step(
+    gptoss_context_t context)
+{
+    struct gptoss_context_stream* stream = &context->stream;
+    assert(stream->num_inflight_steps < GPTOSS_STREAM_DEPTH);
+    assert(stream->num_remaining_steps != 0);
+
+    enum gptoss_status status = reserve_kvcache_pages(context, context->num_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    struct gptoss_metal_command_buffer* command_buffer =
+        &stream->command_buffers[(stream->next_command_buffer + stream->num_inflight_steps) % GPTOSS_STREAM_DEPTH];
+    status = create_command_buffer(context, command_buffer);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    status = encode_sample_step(
+        context, command_buffer, stream->temperature, stream->seed, stream->num_stop_tokens, stream->stop_tokens,
+        /*num_top_logprobs=*/0, /*top_token_offset=*/0, /*top_logprob_offset=*/0);
+    if (status != gptoss_status_success) {
+        end_encoding(context);
+        gptoss_metal_command_buffer_release(command_buffer);
+        return status;
+    }
+
+    status = commit_command_buffer(context, command_buffer);
+    if (status != gptoss_status_success) {
+        gptoss_metal_command_buffer_release(command_buffer);
+        return status;
+    }
+    begin_decode_step(context->model);
+    stream->num_inflight_steps += 1;
+    stream->num_remaining_steps -= 1;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_stream_begin(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens)
+{
+    if (num_stop_tokens > GPTOSS_MAX_STOP_TOKENS) {
+        GPTOSS_LOG_ERROR("number of stop tokens (%zu) exceeds the maximum supported (%d)",
+            num_stop_tokens, GPTOSS_MAX_STOP_TOKENS);
+        return gptoss_status_unsupported_argument;
+    }
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("cannot sample from an empty context");
+        return gptoss_status_invalid_state;
+    }
+
+    finish_stream(context);
+
+    enum gptoss_status status = gptoss_status_success;
+    if (context->num_sink_tokens != 0) {
+        status = evict_tokens(context, max_tokens);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    status = prefill_for_sampling(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    control->abort = 0;
+
+    struct gptoss_context_stream* stream = &context->stream;
+    stream->active = true;
+    stream->temperature = temperature;
+    stream->seed = seed;
+    stream->num_stop_tokens = num_stop_tokens;
+    if (num_stop_tokens != 0) {
+        memcpy(stream->stop_tokens, stop_tokens, num_stop_tokens * sizeof(uint32_t));
+    }
+    stream->num_original_tokens = context->num_tokens;
+    stream->original_token_state = control->token_state;
+    stream->num_delivered_tokens = 0;
+    stream->num_remaining_steps = math_min(max_tokens, context->max_tokens - context->num_tokens);
+    stream->num_inflight_steps = 0;
+    stream->next_command_buffer = 0;
+
+    // Keep up to GPTOSS_STREAM_DEPTH steps in flight: each step reads the token sampled by the previous one directly
+    // from token_buffer, so the GPU never waits for the CPU between steps.
+    while (stream->num_inflight_steps < GPTOSS_STREAM_DEPTH && stream->num_remaining_steps != 0) {
+        status = submit_stream_step(context);
+        if (status != gptoss_status_success) {
+            finish_stream(context);
+            return status;
+        }
+    }
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_stream_next(
+    gptoss_context_t context,
+    uint32_t* token_out,
+    size_t* num_tokens_out)
+{
+    *num_tokens_out = 0;
+
+    struct gptoss_context_stream* stream = &context->stream;
+    if (!stream->active) {
+        return gptoss_status_success;
+    }
+    if (stream->num_inflight_steps == 0) {
+        finish_stream(context);
+        return gptoss_status_success;
+    }
+
+    struct gptoss_metal_command_buffer* command_buffer = &stream->command_buffers[stream->next_command_buffer];
+    enum gptoss_status status = wait_command_buffer(context, command_buffer);
+    end_decode_step(context->model);
+    gptoss_metal_command_buffer_release(command_buffer);
+    stream->next_command_buffer = (stream->next_command_buffer + 1) % GPTOSS_STREAM_DEPTH;
+    stream->num_inflight_steps -= 1;
+    if (status != gptoss_status_success) {
+        finish_stream(context);
+        return status;
+    }
+
+    const uint32_t* token_ptr = (const uint32_t*) context->token_buffer.ptr;
+    const uint32_t token = token_ptr[stream->num_original_tokens + stream->num_delivered_tokens];
+    stream->num_delivered_tokens += 1;
+    count_tokens(context, 0, 1);
+
+    if (is_stop_token(token, stream->num_stop_tokens, stream->stop_tokens)) {
+        // Steps still in flight were turned into no-ops by the abort flag
+        stream->num_remaining_steps = 0;
+    } else if (stream->num_remaining_steps != 0) {
+        status = submit_stream_step(context);
+        if (status != gptoss_status_success) {
+            finish_stream(context);
+            return status;
+        }
+    }
+    if (stream->num_remaining_steps == 0) {
+        finish_stream(context);
+    }
+
+    *token_out = token;
+    *num_tokens_out = 1;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_stream_end(
+    gptoss_context_t context)
+{
+    finish_stream(context);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_batch_sample(
+    const gptoss_context_t* contexts,
+    size_t num_contexts,
+    float temperature,
+    uint64_t seed,
+    uint32_t* tokens_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+    struct batch_segment* segments = NULL;
+
+    if (num_contexts == 0) {
+        return gptoss_status_success;
+    }
+
+    const struct gptoss_model* model = contexts[0]->model;
+    if (num_contexts > model->max_batch_tokens) {
+        GPTOSS_LOG_ERROR("number of contexts (%zu) exceeds the maximum batch size (%zu)",
+            num_contexts, model->max_batch_tokens);
+        return gptoss_status_invalid_argument;
+    }
+    for (size_t i = 0; i < num_contexts; i++) {
+        gptoss_context_t context = contexts[i];
+        finish_stream(context);
+        if (context->model != model) {
+            GPTOSS_LOG_ERROR("context %zu was created for a different model", i);
+            return gptoss_status_invalid_argument;
+        }
+        if (context->num_tokens == 0) {
+            GPTOSS_LOG_ERROR("context %zu is empty", i);
+            return gptoss_status_invalid_argument;
+        }
+        if (context->num_tokens < context->num_prefix_tokens) {
+            GPTOSS_LOG_ERROR("context %zu does not contain all shared prefix tokens", i);
+            return gptoss_status_invalid_state;
+        }
+        if (context->num_tokens == context->max_tokens && context->num_sink_tokens != 0) {
+            status = evict_tokens(context, 1);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+        }
+        if (context->num_tokens == context->max_tokens) {
+            GPTOSS_LOG_ERROR("context %zu is full", i);
+            return gptoss_status_context_overflow;
+        }
+        if (context->num_token_states != 0) {
+            GPTOSS_LOG_ERROR("context %zu is constrained by a token automaton, which batched sampling does not support", i);
+            return gptoss_status_unsupported_argument;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (contexts[j] == context) {
+                GPTOSS_LOG_ERROR("context %zu is the same as context %zu", i, j);
+                return gptoss_status_invalid_argument;
+            }
+        }
+        status = reserve_kvcache_pages(context, context->num_tokens);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    status = reserve_output_rows(contexts[0], num_contexts);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    segments = malloc(num_contexts * sizeof(struct batch_segment));
+    if (segments == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for batch segments", num_contexts * sizeof(struct batch_segment));
+        return gptoss_status_insufficient_memory;
+    }
+    for (size_t i = 0; i < num_contexts; i++) {
+        segments[i] = (struct batch_segment) {
+            .context = contexts[i],
+            .token_offset = contexts[i]->num_tokens - 1,
+            .num_tokens = 1,
+        };
+    }
+
+    status = create_command_buffer(contexts[0], &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < num_contexts; i++) {
+        gptoss_context_t context = contexts[i];
+
+        struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+        control->abort = 0;
+
+        // Pre-fill all but the last token of the context; the last token is processed as part of the batch.
+        if (context->num_kv_tokens + 1 < context->num_tokens) {
+            status = process_tokens(
+                context,
+                &command_buffer,
+                /*input_tokens_offset=*/context->num_kv_tokens,
+                /*num_input_tokens=*/context->num_tokens - 1 - context->num_kv_tokens,
+                /*num_output_tokens=*/0,
+                /*apply_token_mask=*/false);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+        }
+    }
+
+    status = process_batch_tokens(contexts[0], segments, num_contexts, /*num_output_segments=*/num_contexts, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < num_contexts; i++) {
+        status = sample_token(
+            contexts[0],
+            &command_buffer,
+            /*row=*/i,
+            temperature,
+            contexts[i]->top_k,
+            contexts[i]->top_p,
+            seed,
+            &contexts[i]->token_buffer,
+            /*token_index=*/contexts[i]->num_tokens);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    status = commit_command_buffer(contexts[0], &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    begin_decode_step(contexts[0]->model);
+    status = wait_command_buffer(contexts[0], &command_buffer);
+    end_decode_step(contexts[0]->model);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < num_contexts; i++) {
+        gptoss_context_t context = contexts[i];
+        // KV cache now covers all tokens but the newly sampled one.
+        context->num_kv_tokens = context->num_tokens;
+        tokens_out[i] = ((const uint32_t*) context->token_buffer.ptr)[context->num_tokens];
+        context->num_tokens += 1;
+        count_tokens(context, 0, 1);
+    }
+
+cleanup:
+    end_encoding(contexts[0]);
+    gptoss_metal_command_buffer_release(&command_buffer);
+    free(segments);
+    return status;
+}
+
+enum gptoss_status gptoss_context_batch_step(
+    size_t num_prefill_contexts,
+    const gptoss_context_t* prefill_contexts,
+    const size_t* num_prefill_tokens,
+    size_t num_sample_contexts,
+    const gptoss_context_t* sample_contexts,
+    const float* temperatures,
+    const uint64_t* seeds,
+    uint32_t* tokens_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+    struct batch_segment* segments = NULL;
+
+    const size_t num_segments = num_prefill_contexts + num_sample_contexts;
+    if (num_segments == 0) {
+        return gptoss_status_success;
+    }
+    gptoss_context_t activation_context = num_sample_contexts != 0 ? sample_contexts[0] : prefill_contexts[0];
+    struct gptoss_model* model = activation_context->model;
+
+    segments = malloc(num_segments * sizeof(struct batch_segment));
+    if (segments == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for batch segments", num_segments * sizeof(struct batch_segment));
+        return gptoss_status_insufficient_memory;
+    }
+
+    // Prefill chunks come first, so that the tokens they add to the KV cache are visible to the sampled tokens of the
+    // same contexts, which are processed last.
+    for (size_t i = 0; i < num_prefill_contexts; i++) {
+        gptoss_context_t context = prefill_contexts[i];
+        finish_stream(context);
+        assert(context->model == model);
+        assert(num_prefill_tokens[i] != 0);
+        assert(context->num_kv_tokens + num_prefill_tokens[i] < context->num_tokens);
+        segments[i] = (struct batch_segment) {
+            .context = context,
+            .token_offset = context->num_kv_tokens,
+            .num_tokens = num_prefill_tokens[i],
+        };
+        status = reserve_kvcache_pages(context, context->num_kv_tokens + num_prefill_tokens[i]);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+    for (size_t i = 0; i < num_sample_contexts; i++) {
+        gptoss_context_t context = sample_contexts[i];
+        finish_stream(context);
+        assert(context->model == model);
+        assert(context->num_tokens < context->max_tokens);
+        segments[num_prefill_contexts + i] = (struct batch_segment) {
+            .context = context,
+            .token_offset = context->num_tokens - 1,
+            .num_tokens = 1,
+        };
+        status = reserve_kvcache_pages(context, context->num_tokens);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    status = reserve_output_rows(activation_context, num_sample_contexts);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = create_command_buffer(activation_context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    ((struct gptoss_control*) activation_context->control_buffer.ptr)->abort = 0;
+
+    status = process_batch_tokens(activation_context, segments, num_segments, num_sample_contexts, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < num_sample_contexts; i++) {
+        status = sample_token(
+            activation_context,
+            &command_buffer,
+            /*row=*/i,
+            temperatures[i],
+            sample_contexts[i]->top_k,
+            sample_contexts[i]->top_p,
+            seeds[i],
+            &sample_contexts[i]->token_buffer,
+            /*token_index=*/sample_contexts[i]->num_tokens);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    status = commit_command_buffer(activation_context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    begin_decode_step(model);
+    status = wait_command_buffer(activation_context, &command_buffer);
+    end_decode_step(model);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < num_prefill_contexts; i++) {
+        prefill_contexts[i]->num_kv_tokens += num_prefill_tokens[i];
+        count_tokens(prefill_contexts[i], num_prefill_tokens[i], 0);
+    }
+    for (size_t i = 0; i < num_sample_contexts; i++) {
+        gptoss_context_t context = sample_contexts[i];
+        context->num_kv_tokens = context->num_tokens;
+        tokens_out[i] = ((const uint32_t*) context->token_buffer.ptr)[context->num_tokens];
+        context->num_tokens += 1;
+        count_tokens(context, 0, 1);
+    }
+
+cleanup:
+    end_encoding(activation_context);
+    gptoss_metal_command_buffer_release(&command_buffer);
+    free(segments);
+    return status;
+}
+
+// Returns the number of leading tokens of the context whose KV cache is known to be valid. When num_kv_tokens covers
+// all tokens, the last token may have been sampled but not yet processed, and is excluded.
+static size_t get_num_valid_kv_tokens(
+    gptoss_context_t context)
+{
+    const size_t num_valid_tokens = context->num_kv_tokens < context->num_tokens ?
+        context->num_kv_tokens : context->num_tokens - 1;
+    // KV cache of the shared prefix is immutable and always valid.
+    return math_max(num_valid_tokens, context->num_prefix_tokens);
+}
+
+static float sum_probs(
+    const float* prob,
+    size_t num_channels)
+{
+    float sum = 0.0f;
+    for (size_t i = 0; i < num_channels; i++) {
+        sum += prob[i];
+    }
+    return sum;
+}
+
+// Samples a token from the distribution max(p - q, 0), where p = target_prob * target_scale and
+// q = draft_prob * draft_scale. Without draft_prob, or if p and q are identical, samples from p.
+static uint32_t sample_residual(
+    const float* target_prob,
+    float target_scale,
+    const float* draft_prob,
+    float draft_scale,
+    size_t num_channels,
+    uint32_t sample_word)
+{
+    float residual_sum = 0.0f;
+    if (draft_prob != NULL) {
+        for (size_t i = 0; i < num_channels; i++) {
+            residual_sum += fmaxf(target_prob[i] * target_scale - draft_prob[i] * draft_scale, 0.0f);
+        }
+    }
+    if (residual_sum == 0.0f) {
+        draft_prob = NULL;
+        residual_sum = 1.0f;
+    }
+
+    const float sample_cdf = (float) (sample_word & 0x00FFFFFFu) * 0x1.0p-24f * residual_sum;
+    float cumsum = 0.0f;
+    uint32_t last_token = 0;
+    for (size_t i = 0; i < num_channels; i++) {
+        float residual = target_prob[i] * target_scale;
+        if (draft_prob != NULL) {
+            residual = fmaxf(residual - draft_prob[i] * draft_scale, 0.0f);
+        }
+        if (residual != 0.0f) {
+            cumsum += residual;
+            last_token = (uint32_t) i;
+            if (cumsum > sample_cdf) {
+                break;
+            }
+        }
+    }
+    return last_token;
+}
+
+// Samples num_draft_tokens tokens with the draft context in a single command buffer. For non-zero temperature, the
+// unnormalized probabilities of the i-th drafted token are saved in row i + 1 of the draft context's prob buffer.
+static enum gptoss_status propose_draft_tokens(
+    gptoss_context_t draft_context,
+    float temperature,
+    uint64_t seed,
+    size_t num_draft_tokens)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+    const struct gptoss_model* model = draft_context->model;
+
+    status = prefill_for_sampling(draft_context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    status = reserve_kvcache_pages(draft_context, draft_context->num_tokens + num_draft_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    // Row 0 of the prob buffer holds the current distribution, rows 1 to num_draft_tokens keep copies of the past ones.
+    status = reserve_output_rows(draft_context, num_draft_tokens + 1);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    status = create_command_buffer(draft_context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) draft_context->control_buffer.ptr;
+    control->abort = 0;
+
+    for (size_t i = 0; i < num_draft_tokens; i++) {
+        status = encode_sample_step(draft_context, &command_buffer, temperature, seed, /*num_stop_tokens=*/0, NULL,
+            /*num_top_logprobs=*/0, /*top_token_offset=*/0, /*top_logprob_offset=*/0);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        if (temperature != 0.0f) {
+            status = gptoss_metal_command_buffer_encode_copy_buffer(
+                &command_buffer,
+                &draft_context->prob_buffer,
+                /*input_offset=*/0,
+                &draft_context->prob_buffer,
+                /*output_offset=*/model->vocabulary_size * (i + 1) * sizeof(float),
+                /*size=*/model->vocabulary_size * sizeof(float));
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode copy buffer");
+                goto cleanup;
+            }
+        }
+    }
+
+    status = commit_command_buffer(draft_context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    begin_decode_step(draft_context->model);
+    status = wait_command_buffer(draft_context, &command_buffer);
+    end_decode_step(draft_context->model);
+
+cleanup:
+    end_encoding(draft_context);
+    gptoss_metal_command_buffer_release(&command_buffer);
+    return status;
+}
+
+// Processes the last num_draft_tokens tokens of the target context, together with the not yet processed tokens before
+// them, in a single pass. Row i of the score, argmax, and (for non-zero temperature) prob buffers of the target
+// context receives the distribution for token num_tokens - num_draft_tokens + i.
+static enum gptoss_status verify_draft_tokens(
+    gptoss_context_t target_context,
+    float temperature,
+    size_t num_draft_tokens)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+    const struct gptoss_model* model = target_context->model;
+
+    const size_t num_tokens = target_context->num_tokens;
+    const size_t num_original_tokens = num_tokens - num_draft_tokens;
+    size_t input_tokens_offset = target_context->num_kv_tokens < num_original_tokens ?
+        target_context->num_kv_tokens : num_original_tokens - 1;
+    if (num_tokens - input_tokens_offset > model->max_batch_tokens) {
+        // Outputs must come from a single batch: pre-fill the pending tokens first.
+        status = prefill_tokens(target_context, num_original_tokens);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        input_tokens_offset = num_original_tokens - 1;
+    }
 
-                status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
-                    command_buffer,
-                    &model->f32_bf16w_matmul_fn,
-                    /*threadgroup_size=*/256,
-                    &context->sdpa_activation_buffer,
-                    /*input_offset=*/0,
-                    &model->shared_weight_buffer,
-                    /*weight_offset=*/model->attn_out_weight_offset + model->per_block_shared_weights_size * n,
-                    &model->shared_weight_buffer,
-                    /*bias_offset=*/model->attn_out_bias_offset + model->per_block_shared_weights_size * n,
-                    &context->residual_activation_buffer,
-                    /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    /*num_tokens=*/num_block_output_tokens,
-                    /*num_cols=*/model->num_heads * model->head_dim,
-                    /*num_rows=*/model->embedding_dim);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_add kernel launch");
-                    return status;
-                }
+    status = reserve_kvcache_pages(target_context, num_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
 
-                status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
-                    command_buffer,
-                    &model->f32_bf16w_rmsnorm_fn,
-                    &context->residual_activation_buffer,
-                    /*input_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                    &model->shared_weight_buffer,
-                    /*weight_offset=*/model->mlp_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
-                    &context->rmsnorm_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    num_block_output_tokens,
-                    model->embedding_dim,
-                    model->rmsnorm_epsilon);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
-                    return status;
-                }
+    status = reserve_output_rows(target_context, num_draft_tokens + 1);
+    if (status != gptoss_status_success) {
+        return status;
+    }
 
-                status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
-                    command_buffer,
-                    &model->f32_bf16w_matmul_fn,
-                    /*threadgroup_size=*/256,
-                    &context->rmsnorm_activation_buffer,
-                    /*input_offset=*/0,
-                    &model->shared_weight_buffer,
-                    /*weight_offset=*/model->mlp_gate_weight_offset + model->per_block_shared_weights_size * n,
-                    &model->shared_weight_buffer,
-                    /*bias_offset=*/model->mlp_gate_bias_offset + model->per_block_shared_weights_size * n,
-                    &context->gate_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    /*num_tokens=*/num_block_output_tokens,
-                    /*num_cols=*/model->embedding_dim,
-                    /*num_rows=*/model->num_experts);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul kernel launch");
-                    return status;
-                }
+    status = create_command_buffer(target_context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
 
-                const char* kernel_name = NULL;
-                switch (model->num_experts) {
-                    case 32:
-                        kernel_name = "f32_topk_softmax_e32_k4_fn";
-                        status = gptoss_metal_command_buffer_encode_launch_f32_topk(
-                            command_buffer,
-                            &model->f32_topk_softmax_e32_k4_fn,
-                            &context->gate_activation_buffer, /*input_offset=*/0,
-                            &context->expert_activation_buffer, /*output_offset=*/0,
-                            &context->control_buffer, /*control_offset=*/0,
-                            num_block_output_tokens,
-                            model->num_experts,
-                            model->num_active_experts);
-                        break;
-                    case 128:
-                        kernel_name = "f32_topk_softmax_e128_k4_fn";
-                        status = gptoss_metal_command_buffer_encode_launch_f32_topk(
-                            command_buffer,
-                            &model->f32_topk_softmax_e128_k4_fn,
-                            &context->gate_activation_buffer, /*input_offset=*/0,
-                            &context->expert_activation_buffer, /*output_offset=*/0,
-                            &context->control_buffer, /*control_offset=*/0,
-                            num_block_output_tokens,
-                            model->num_experts,
-                            model->num_active_experts);
-                        break;
-                    default:
-                        status = gptoss_status_unsupported_argument;
-                        GPTOSS_LOG_ERROR("missing Top-K kernel for %" PRIu32 " experts", model->num_experts);
-                        return status;
-                }
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode %s kernel launch", kernel_name);
-                    return status;
-                }
+    struct gptoss_control* control = (struct gptoss_control*) target_context->control_buffer.ptr;
+    control->abort = 0;
 
-                status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
-                    command_buffer,
-                    &model->f32_mf4w_moe_matmul_swiglu_fn,
-                    /*threadgroup_size=*/512,
-                    &context->rmsnorm_activation_buffer,
-                    /*input_offset=*/0,
-                    &context->expert_activation_buffer,
-                    /*expert_offset=*/0,
-                    &model->block_weight_buffers[n],
-                    /*weight_block_offset=*/0,
-                    &model->block_weight_buffers[n],
-                    /*weight_scale_offset=*/model->mlp_swiglu_scale_offset,
-                    &model->block_weight_buffers[n],
-                    /*bias_offset=*/model->mlp_swiglu_bias_offset,
-                    &context->swiglu_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    model->swiglu_limit,
-                    model->per_expert_block_weight_size,
-                    num_block_output_tokens,
-                    model->num_active_experts,
-                    model->embedding_dim,
-                    model->mlp_dim);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_swiglu kernel launch");
-                    return status;
-                }
+    status = process_tokens(
+        target_context,
+        &command_buffer,
+        input_tokens_offset,
+        /*num_input_tokens=*/num_tokens - input_tokens_offset,
+        /*num_output_tokens=*/num_draft_tokens + 1,
+        /*apply_token_mask=*/false);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
 
-                status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
-                    command_buffer,
-                    &model->f32_mf4w_moe_matmul_fn,
-                    /*threadgroup_size=*/512,
-                    &context->swiglu_activation_buffer,
-                    /*input_offset=*/0,
-                    &context->expert_activation_buffer,
-                    /*expert_offset=*/0,
-                    &model->block_weight_buffers[n],
-                    /*weight_block_offset=*/model->mlp_out_block_offset,
-                    &model->block_weight_buffers[n],
-                    /*weight_scale_offset=*/model->mlp_out_scale_offset,
-                    &model->block_weight_buffers[n],
-                    /*bias_offset=*/model->mlp_out_bias_offset,
-                    &context->moe_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    model->per_expert_block_weight_size,
-                    num_block_output_tokens,
-                    model->num_active_experts,
-                    model->mlp_dim,
-                    model->embedding_dim);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul kernel launch");
-                    return status;
-                }
+    if (temperature != 0.0f) {
+        uint32_t num_threadgroups = 0;
+        uint32_t num_dims_per_threadgroup = 0;
+        status = gptoss_metal_command_buffer_encode_launch_f32_softmax(
+            &command_buffer,
+            &model->f32_softmax_fn,
+            model->threadgroup_size[gptoss_get_launch_shape(num_draft_tokens + 1)][gptoss_launch_kernel_softmax],
+            model->max_threadgroups,
+            &target_context->score_buffer,
+            /*score_offset=*/0,
+            &target_context->argmax_buffer,
+            /*argmax_offset=*/0,
+            &target_context->prob_buffer,
+            /*prob_offset=*/0,
+            &target_context->sum_buffer,
+            /*sum_offset=*/0,
+            &target_context->control_buffer,
+            /*control_offset=*/0,
+            model->vocabulary_size,
+            /*num_tokens=*/num_draft_tokens + 1,
+            temperature,
+            &num_threadgroups,
+            &num_dims_per_threadgroup);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_softmax kernel launch");
+            goto cleanup;
+        }
+    }
 
-                status = gptoss_metal_command_buffer_encode_launch_f32_accumulate(
-                    command_buffer,
-                    &model->f32_accumulate_e4_fn,
-                    /*threadgroup_size=*/256,
-                    model->max_threadgroups,
-                    &context->moe_activation_buffer,
-                    /*input_offset=*/0,
-                    &context->expert_activation_buffer,
-                    /*expert_offset=*/0,
-                    &context->residual_activation_buffer,
-                    /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    model->embedding_dim,
-                    num_block_output_tokens,
-                    model->num_active_experts);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_accumulate kernel launch");
-                    return status;
-                }
-            }
+    status = commit_command_buffer(target_context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = wait_command_buffer(target_context, &command_buffer);
+    if (status == gptoss_status_success) {
+        target_context->num_kv_tokens = num_tokens;
+    }
+
+cleanup:
+    end_encoding(target_context);
+    gptoss_metal_command_buffer_release(&command_buffer);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_speculative(
+    gptoss_context_t target_context,
+    gptoss_context_t draft_context,
+    size_t num_draft_tokens,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+
+    *num_tokens_out = 0;
+
+    const struct gptoss_model* target_model = target_context->model;
+    const struct gptoss_model* draft_model = draft_context->model;
+    if (target_context == draft_context) {
+        GPTOSS_LOG_ERROR("draft context must be different from the target context");
+        return gptoss_status_invalid_argument;
+    }
+    if (target_context->top_k != 0 || target_context->top_p < 1.0f ||
+        draft_context->top_k != 0 || draft_context->top_p < 1.0f)
+    {
+        GPTOSS_LOG_ERROR("speculative sampling does not support top-k or top-p truncation");
+        return gptoss_status_unsupported_argument;
+    }
+    if (target_context->num_token_states != 0 || draft_context->num_token_states != 0) {
+        GPTOSS_LOG_ERROR("speculative sampling does not support token automata");
+        return gptoss_status_unsupported_argument;
+    }
+    if (draft_model->vocabulary_size != target_model->vocabulary_size) {
+        GPTOSS_LOG_ERROR("draft model vocabulary size (%" PRIu32 ") does not match target model vocabulary size (%" PRIu32 ")",
+            draft_model->vocabulary_size, target_model->vocabulary_size);
+        return gptoss_status_invalid_argument;
+    }
+
+    finish_stream(target_context);
+    finish_stream(draft_context);
+
+    if (target_context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("target context is empty");
+        return gptoss_status_invalid_argument;
+    }
+    if (draft_context->num_tokens != target_context->num_tokens ||
+        memcmp(draft_context->token_buffer.ptr, target_context->token_buffer.ptr, target_context->num_tokens * sizeof(uint32_t)) != 0)
+    {
+        GPTOSS_LOG_ERROR("draft context tokens do not match target context tokens");
+        return gptoss_status_invalid_argument;
+    }
+    if (target_context->num_tokens < target_context->num_prefix_tokens ||
+        draft_context->num_tokens < draft_context->num_prefix_tokens)
+    {
+        GPTOSS_LOG_ERROR("contexts must start with all shared prefix tokens before sampling");
+        return gptoss_status_invalid_state;
+    }
+
+    const size_t max_context_tokens = math_min(target_context->max_tokens, draft_context->max_tokens);
+    // Up to num_draft_tokens + 1 rows of the score and prob buffers are used in each round.
+    const size_t max_draft_tokens = math_min(target_model->max_batch_tokens, draft_model->max_batch_tokens) - 1;
+    const uint64_t accept_seed = seed + UINT64_C(0x3C6EF372FE94F82B);
+    const uint64_t residual_seed = seed + UINT64_C(0xA54FF53A5F1D36F1);
+
+    size_t num_generated_tokens = 0;
+    bool stopped = false;
+    while (num_generated_tokens < max_tokens && !stopped) {
+        const size_t num_original_tokens = target_context->num_tokens;
+        if (num_original_tokens == max_context_tokens) {
+            status = gptoss_status_context_overflow;
+            break;
         }
 
-        if (output_batch_size != 0) {
-            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
-                command_buffer,
-                &model->f32_bf16w_rmsnorm_fn,
-                &context->residual_activation_buffer,
-                /*input_offset=*/model->embedding_dim * (input_batch_size - output_batch_size) * sizeof(float),
-                &model->shared_weight_buffer,
-                /*weight_offset=*/model->rmsnorm_weight_offset,
-                &context->rmsnorm_activation_buffer,
-                /*output_offset=*/0,
-                &context->control_buffer,
-                /*control_offset=*/0,
-                /*num_tokens=*/output_batch_size,
-                /*num_channels=*/model->embedding_dim,
-                model->rmsnorm_epsilon);
+        // Each round generates between 1 and k + 1 tokens.
+        size_t k = math_min(num_draft_tokens, max_draft_tokens);
+        k = math_min(k, max_tokens - num_generated_tokens - 1);
+        k = math_min(k, max_context_tokens - num_original_tokens - 1);
+
+        if (k != 0) {
+            status = propose_draft_tokens(draft_context, temperature, seed, k);
             if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
-                return status;
+                draft_context->num_tokens = num_original_tokens;
+                truncate_kvcache(draft_context, math_min(draft_context->num_kv_tokens, num_original_tokens - 1));
+                break;
             }
+        }
+        const size_t num_draft_valid_kv_tokens = get_num_valid_kv_tokens(draft_context);
 
-            status = gptoss_metal_command_buffer_encode_fill_buffer(
-                command_buffer,
-                &context->argmax_buffer,
-                /*offset=*/0,
-                /*size=*/sizeof(uint64_t) * output_batch_size,
-                /*fill_value=*/0xFF);
-            if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode fill buffer command");
-                return status;
+        const uint32_t* draft_tokens = (const uint32_t*) draft_context->token_buffer.ptr + num_original_tokens;
+        uint32_t* target_tokens = (uint32_t*) target_context->token_buffer.ptr;
+        memcpy(target_tokens + num_original_tokens, draft_tokens, k * sizeof(uint32_t));
+        target_context->num_tokens = num_original_tokens + k;
+
+        status = verify_draft_tokens(target_context, temperature, k);
+        if (status != gptoss_status_success) {
+            target_context->num_tokens = num_original_tokens;
+            truncate_kvcache(target_context, math_min(target_context->num_kv_tokens, num_original_tokens - 1));
+            draft_context->num_tokens = num_original_tokens;
+            truncate_kvcache(draft_context, math_min(num_draft_valid_kv_tokens, num_original_tokens - 1));
+            break;
+        }
+
+        // Accept the draft tokens while the target distribution agrees, then replace the first rejected draft token
+        // with a sample from the residual distribution, or append a sample from the target distribution if all
+        // draft tokens are accepted.
+        // This runs on the CPU, reading the probabilities from shared memory: the decisions are sequential and stop at
+        // the first rejection, so a kernel would be a long serial chain of tiny launches behind a full command buffer
+        // round trip. A round reads at most 2k + 2 rows of vocabulary_size floats (k + 1 target and k draft row sums, and
+        // one residual sample), a few megabytes, against a verification pass that streams all weights of the target model.
+        const size_t vocabulary_size = target_model->vocabulary_size;
+        const uint64_t* target_argmax = (const uint64_t*) target_context->argmax_buffer.ptr;
+        const float* target_prob = (const float*) target_context->prob_buffer.ptr;
+        const float* draft_prob = (const float*) draft_context->prob_buffer.ptr;
+        size_t num_accepted_tokens = 0;
+        uint32_t next_token = 0;
+        for (; num_accepted_tokens <= k; num_accepted_tokens++) {
+            const size_t i = num_accepted_tokens;
+            const size_t position = num_original_tokens + i;
+            if (temperature == 0.0f) {
+                next_token = (uint32_t) target_argmax[i];
+                if (i == k || draft_tokens[i] != next_token) {
+                    break;
+                }
+                continue;
             }
 
-            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
-                command_buffer,
-                &model->f32_bf16w_unembedding_fn,
-                /*threadgroup_size=*/256,
-                model->max_threadgroups,
-                &context->rmsnorm_activation_buffer,
-                /*input_offset=*/0,
-                &model->shared_weight_buffer,
-                /*weight_offset=*/model->unembedding_weight_offset,
-                &context->score_buffer,
-                /*output_offset=*/0,
-                &context->argmax_buffer,
-                /*argmax_offset=*/0,
-                &context->control_buffer,
-                /*control_offset=*/0,
-                /*num_tokens=*/output_batch_size,
-                /*num_cols=*/model->embedding_dim,
-                /*num_rows=*/model->vocabulary_size);
-            if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch");
-                return status;
+            const float* target_row = target_prob + vocabulary_size * i;
+            const float target_scale = 1.0f / sum_probs(target_row, vocabulary_size);
+            if (i == k) {
+                next_token = sample_residual(target_row, target_scale, NULL, 0.0f, vocabulary_size,
+                    rng_squares32(position, residual_seed));
+                break;
+            }
+
+            // Accept draft token x with probability min(1, p(x) / q(x))
+            const float* draft_row = draft_prob + vocabulary_size * (i + 1);
+            const float draft_scale = 1.0f / sum_probs(draft_row, vocabulary_size);
+            const uint32_t token = draft_tokens[i];
+            const float p = target_row[token] * target_scale;
+            const float q = draft_row[token] * draft_scale;
+            const float u = (float) (rng_squares32(position, accept_seed) & 0x00FFFFFFu) * 0x1.0p-24f;
+            if (!(u * q < p)) {
+                next_token = sample_residual(target_row, target_scale, draft_row, draft_scale, vocabulary_size,
+                    rng_squares32(position, residual_seed));
+                break;
             }
         }
+
+        size_t num_round_tokens = num_accepted_tokens + 1;
+        target_tokens[num_original_tokens + num_accepted_tokens] = next_token;
+        for (size_t t = 0; t < num_round_tokens; t++) {
+            if (is_stop_token(target_tokens[num_original_tokens + t], num_stop_tokens, stop_tokens)) {
+                num_round_tokens = t + 1;
+                stopped = true;
+                break;
+            }
+        }
+        memcpy(tokens_out + num_generated_tokens, target_tokens + num_original_tokens, num_round_tokens * sizeof(uint32_t));
+        num_generated_tokens += num_round_tokens;
+        count_tokens(target_context, 0, num_round_tokens);
+
+        // Roll back both contexts to the accepted tokens. KV cache is valid for all accepted draft tokens, but not for
+        // the rejected ones, nor for the last token sampled by the target model.
+        const size_t num_valid_tokens = num_original_tokens + math_min(num_accepted_tokens, num_round_tokens);
+        target_context->num_tokens = num_original_tokens + num_round_tokens;
+        truncate_kvcache(target_context, num_valid_tokens);
+
+        memcpy((uint32_t*) draft_context->token_buffer.ptr + num_original_tokens,
+            target_tokens + num_original_tokens, num_round_tokens * sizeof(uint32_t));
+        draft_context->num_tokens = num_original_tokens + num_round_tokens;
+        truncate_kvcache(draft_context, math_min(num_valid_tokens, num_draft_valid_kv_tokens));
     }
-    return gptoss_status_success;
+
+    *num_tokens_out = num_generated_tokens;
+    if (num_generated_tokens != 0 && status == gptoss_status_context_overflow) {
+        status = gptoss_status_success;
+    }
+    return status;
 }
 
-enum gptoss_status GPTOSS_ABI gptoss_context_append_chars(
+enum gptoss_status GPTOSS_ABI gptoss_context_score(
     gptoss_context_t context,
-    const char* text,
-    size_t text_length,
-    size_t* num_tokens_out)
+    size_t num_tokens,
+    const uint32_t* tokens,
+    float* logprobs_out)
 {
     enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_command_buffer command_buffer = {0};
     const struct gptoss_model* model = context->model;
-    const struct gptoss_tokenizer* tokenizer = model->tokenizer;
-    size_t num_appended_tokens = 0;
-    while (text_length != 0) {
-        if (context->num_tokens == context->max_tokens) {
-            status = gptoss_status_context_overflow;
-            break;
+
+    for (size_t t = 0; t < num_tokens; t++) {
+        const uint32_t token = tokens[t];
+        if (token >= model->vocabulary_size) {
+            GPTOSS_LOG_ERROR("token %" PRIu32 " at index %zu is out of bounds for vocabulary size %" PRIu32,
+                token, t, model->vocabulary_size);
+            return gptoss_status_invalid_argument;
         }
-        const char* tokens = tokenizer->tokens_ptr;
-        uint32_t best_token = UINT32_MAX;
-        uint32_t best_token_length = 0;
-        for (size_t t = 0; t < tokenizer->num_text_tokens; t++) {
-            uint16_t token_length;
-            memcpy(&token_length, tokens, sizeof(uint16_t));
-            tokens += sizeof(uint16_t);
-            if (token_length <= text_length && token_length > best_token_length) {
-                if (memcmp(text, tokens, token_length) == 0) {
-                    if (token_length > best_token_length) {
-                        best_token = (uint32_t) t;
-                        best_token_length = token_length;
-                    }
-                }
+    }
+
+    finish_stream(context);
+
+    if (num_tokens == 0) {
+        return gptoss_status_success;
+    }
+
+    const size_t num_original_tokens = context->num_tokens;
+    if (num_original_tokens == 0) {
+        GPTOSS_LOG_ERROR("context must contain at least one token before scoring");
+        return gptoss_status_invalid_state;
+    }
+    if (num_original_tokens < context->num_prefix_tokens) {
+        GPTOSS_LOG_ERROR("context must start with all %zu shared prefix tokens before scoring", context->num_prefix_tokens);
+        return gptoss_status_invalid_state;
+    }
+    if (num_tokens > context->max_tokens - num_original_tokens) {
+        GPTOSS_LOG_ERROR("scoring %zu tokens would overflow the context with %zu of %zu tokens",
+            num_tokens, num_original_tokens, context->max_tokens);
+        return gptoss_status_context_overflow;
+    }
+
+    // The logprob of token t is computed from the output for token t - 1: each scored token is the input for the next.
+    const size_t input_tokens_offset = num_original_tokens - 1;
+    if (context->num_kv_tokens < input_tokens_offset) {
+        status = prefill_tokens(context, input_tokens_offset);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    status = reserve_kvcache_pages(context, num_original_tokens + num_tokens);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    // Scores take one row per token of a batch, and the prob buffer must also fit the logprobs of all tokens.
+    status = reserve_output_rows(context, math_max(math_min(num_tokens, model->max_batch_tokens),
+        math_ceil_div(num_tokens, model->vocabulary_size)));
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    memcpy((uint32_t*) context->token_buffer.ptr + num_original_tokens, tokens, num_tokens * sizeof(uint32_t));
+
+    status = create_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    control->abort = 0;
+
+    // Every input token produces an output, so batches are processed one at a time. Logprobs are gathered on the GPU
+    // into the prob buffer, which is otherwise unused here, so only one float per token is read back.
+    const size_t input_tokens_end = input_tokens_offset + num_tokens;
+    for (size_t input_batch_start = input_tokens_offset;
+        input_batch_start < input_tokens_end;
+        input_batch_start += model->max_batch_tokens)
+    {
+        const size_t input_batch_size = math_min(model->max_batch_tokens, input_tokens_end - input_batch_start);
+
+        status = process_tokens(
+            context,
+            &command_buffer,
+            input_batch_start,
+            /*num_input_tokens=*/input_batch_size,
+            /*num_output_tokens=*/input_batch_size,
+            /*apply_token_mask=*/false);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_gather_logprob(
+            &command_buffer,
+            &model->f32_gather_logprob_fn,
+            /*threadgroup_size=*/512,
+            &context->score_buffer,
+            /*score_offset=*/0,
+            &context->argmax_buffer,
+            /*argmax_offset=*/0,
+            &context->token_buffer,
+            /*token_offset=*/(input_batch_start + 1) * sizeof(uint32_t),
+            &context->prob_buffer,
+            /*logprob_offset=*/(input_batch_start - input_tokens_offset) * sizeof(float),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->vocabulary_size,
+            /*num_tokens=*/input_batch_size);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_gather_logprob kernel launch");
+            goto cleanup;
+        }
+    }
+
+    status = commit_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = wait_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    memcpy(logprobs_out, context->prob_buffer.ptr, num_tokens * sizeof(float));
+    count_tokens(context, num_tokens, 0);
+    // KV cache now covers all tokens but the last scored one.
+    context->num_tokens = num_original_tokens + num_tokens;
+    context->num_kv_tokens = context->num_tokens - 1;
+
+cleanup:
+    end_encoding(context);
+    gptoss_metal_command_buffer_release(&command_buffer);
+    if (status != gptoss_status_success) {
+        // num_tokens and num_kv_tokens only advance on success, but the scored tokens may have overwritten the ring
+        // buffers of sliding-window blocks, and KV cache pages were reserved for them.
+        truncate_kvcache(context, context->num_kv_tokens);
+    }
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_get_stats(
+    gptoss_context_t context,
+    struct gptoss_context_stats* stats_out)
+{
+    const struct gptoss_runtime_counters* counters = &context->counters;
+    const size_t num_kv_tokens = atomic_load_explicit(&context->num_kv_tokens, memory_order_relaxed);
+    const size_t num_kv_pages = atomic_load_explicit(&context->num_kv_pages, memory_order_relaxed);
+    *stats_out = (struct gptoss_context_stats) {
+        .num_prefill_tokens = atomic_load_explicit(&counters->num_prefill_tokens, memory_order_relaxed),
+        .num_decode_tokens = atomic_load_explicit(&counters->num_decode_tokens, memory_order_relaxed),
+        .num_command_buffers = atomic_load_explicit(&counters->num_command_buffers, memory_order_relaxed),
+        .gpu_busy_seconds = (double) atomic_load_explicit(&counters->gpu_busy_nanoseconds, memory_order_relaxed) * 1.0e-9,
+        .wait_seconds = (double) atomic_load_explicit(&counters->wait_nanoseconds, memory_order_relaxed) * 1.0e-9,
+        .num_kv_tokens = num_kv_tokens,
+        // Full-attention blocks bound the number of tokens the KV cache can hold.
+        .num_allocated_kv_tokens = math_min(
+            context->num_prefix_tokens + num_kv_pages * GPTOSS_KVCACHE_PAGE_TOKENS, context->max_tokens),
+        .max_kv_tokens = context->max_tokens,
+        .kvcache_size = context->kvcache_size,
+        .allocation_size = atomic_load_explicit(&context->allocation_size, memory_order_relaxed),
+    };
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_start_profiling(
+    gptoss_context_t context)
+{
+    // Check that the device supports timestamp sampling before committing to profiling.
+    struct gptoss_metal_command_buffer command_buffer = {0};
+    enum gptoss_status status = gptoss_metal_command_buffer_create(context->command_queue, &command_buffer);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    status = gptoss_metal_command_buffer_enable_timing(&command_buffer, GPTOSS_PROFILE_MAX_LAUNCHES);
+    gptoss_metal_command_buffer_release(&command_buffer);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    context->profiling = true;
+    context->num_profile_entries = 0;
+    context->num_untimed_launches = 0;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_stop_profiling(
+    gptoss_context_t context)
+{
+    context->profiling = false;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_get_profile(
+    gptoss_context_t context,
+    const char** kernel_names_out,
+    uint32_t* blocks_out,
+    uint64_t* num_launches_out,
+    double* gpu_seconds_out,
+    size_t max_entries,
+    size_t* num_entries_out,
+    uint64_t* num_untimed_launches_out)
+{
+    *num_entries_out = context->num_profile_entries;
+    *num_untimed_launches_out = context->num_untimed_launches;
+    if (max_entries < context->num_profile_entries) {
+        return gptoss_status_insufficient_memory;
+    }
+
+    for (size_t i = 0; i < context->num_profile_entries; i++) {
+        const struct gptoss_profile_entry* entry = &context->profile_entries[i];
+        kernel_names_out[i] = entry->kernel_name;
+        blocks_out[i] = entry->block;
+        num_launches_out[i] = entry->num_launches;
+        gpu_seconds_out[i] = entry->gpu_seconds;
+    }
+    return gptoss_status_success;
+}
+
+static const char context_file_magic[12] = "GPT-OSS KV";
+
+static enum gptoss_status write_context_file(int fd, const void* data, size_t size) {
+    const char* current_byte = (const char*) data;
+    while (size != 0) {
+        const ssize_t write_result = write(fd, current_byte, size);
+        if (write_result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            GPTOSS_LOG_ERROR("writing %zu bytes to file descriptor %d failed with error %d", size, fd, errno);
+            return gptoss_status_io_error;
+        }
+        current_byte += (size_t) write_result;
+        size -= (size_t) write_result;
+    }
+    return gptoss_status_success;
+}
+
+static enum gptoss_status read_context_file(int fd, void* data, size_t size) {
+    char* current_byte = (char*) data;
+    while (size != 0) {
+        const ssize_t read_result = read(fd, current_byte, size);
+        if (read_result < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            tokens += token_length;
+            GPTOSS_LOG_ERROR("reading %zu bytes from file descriptor %d failed with error %d", size, fd, errno);
+            return gptoss_status_io_error;
         }
-
-        if (best_token == UINT32_MAX) {
-            GPTOSS_LOG_ERROR("failed to tokenize text \"%.*s\"", (int) text_length, text);
-            return gptoss_status_invalid_argument;
+        if (read_result == 0) {
+            GPTOSS_LOG_ERROR("unexpected end of file while reading %zu bytes from file descriptor %d", size, fd);
+            return gptoss_status_io_error;
         }
+        current_byte += (size_t) read_result;
+        size -= (size_t) read_result;
+    }
+    return gptoss_status_success;
+}
 
-        uint32_t* input_tokens = (uint32_t*) context->token_buffer.ptr;
-        if (context->num_kv_tokens > context->num_tokens) {
-            if (input_tokens[context->num_tokens] != best_token) {
-                input_tokens[context->num_tokens] = best_token;
+static enum gptoss_status skip_context_file(int fd, size_t size) {
+    if (size != 0 && lseek(fd, (off_t) size, SEEK_CUR) == (off_t) -1) {
+        GPTOSS_LOG_ERROR("skipping %zu bytes of file descriptor %d failed with error %d", size, fd, errno);
+        return gptoss_status_io_error;
+    }
+    return gptoss_status_success;
+}
 
-                // Invalidate the KV cache starting with the newly added token.
-                context->num_kv_tokens = context->num_tokens;
-            }
-            context->num_tokens++;
-        } else {
-            input_tokens[context->num_tokens++] = best_token;
+// Locates the KV cache of token t in block n: returns a pointer to its row, and stores in num_tokens_out the number of
+// tokens, up to max_tokens, whose rows follow contiguously. Tokens of the shared prefix are located in the prefix.
+static char* locate_kvcache_tokens(
+    const struct gptoss_context* context,
+    uint32_t n,
+    size_t t,
+    size_t max_tokens,
+    size_t* num_tokens_out)
+{
+    const struct gptoss_model* model = context->model;
+    const size_t kvcache_token_size = 2 * model->num_kv_heads * get_kvcache_head_size(context->kvcache_type, model->head_dim);
+    const size_t num_prefix_tokens = context->num_prefix_tokens;
+
+    char* ptr = NULL;
+    size_t num_tokens = 0;
+    if (t < num_prefix_tokens) {
+        const struct gptoss_prefix* prefix = context->prefix;
+        size_t slot = t;
+        num_tokens = num_prefix_tokens - t;
+        if (n % 2 == 0) {
+            slot = t % prefix->num_window_kv_slots;
+            num_tokens = math_min(num_tokens, prefix->num_window_kv_slots - slot);
         }
-        num_appended_tokens++;
-        text += best_token_length;
-        text_length -= best_token_length;
+        ptr = (char*) prefix->kvcache_buffer.ptr + get_prefix_block_kvcache_offset(prefix, n) + slot * kvcache_token_size;
+    } else if (n % 2 == 0) {
+        const size_t slot = (t - num_prefix_tokens) % context->num_window_kv_slots;
+        num_tokens = context->num_window_kv_slots - slot;
+        ptr = (char*) context->kvcache_buffer.ptr + get_block_kvcache_offset(context, n) + slot * kvcache_token_size;
+    } else {
+        const struct gptoss_kvcache_pool* pool = &model->kvcache_pools[context->kvcache_type];
+        const size_t page = (t - num_prefix_tokens) / GPTOSS_KVCACHE_PAGE_TOKENS;
+        const size_t slot = (t - num_prefix_tokens) % GPTOSS_KVCACHE_PAGE_TOKENS;
+        num_tokens = GPTOSS_KVCACHE_PAGE_TOKENS - slot;
+        ptr = (char*) pool->buffer.ptr + get_block_page_table(context, n)[page] * pool->page_size + slot * kvcache_token_size;
     }
-    if (num_tokens_out != NULL) {
-        *num_tokens_out = num_appended_tokens;
-    }
-    return status;
+    *num_tokens_out = math_min(num_tokens, max_tokens);
+    return ptr;
 }
 
-enum gptoss_status GPTOSS_ABI gptoss_context_append_tokens(
+enum gptoss_status GPTOSS_ABI gptoss_context_save(
     gptoss_context_t context,
-    size_t num_tokens,
-    const uint32_t* tokens)
+    int fd)
 {
+    enum gptoss_status status = gptoss_status_success;
     const struct gptoss_model* model = context->model;
 
-    // Validate all tokens
-    for (size_t t = 0; t < num_tokens; t++) {
-        const uint32_t token = tokens[t];
-        if (token >= model->vocabulary_size) {
-            GPTOSS_LOG_ERROR("token %" PRIu32 " at index %zu is out of bounds for vocabulary size %" PRIu32,
-                token, t, context->model->vocabulary_size);
-            return gptoss_status_invalid_argument;
-        }
+    finish_stream(context);
+
+    // Sliding-window blocks retain the tokens after the last num_window_kv_slots tokens written to the private ring
+    // buffer, and, if these don't reach back to the end of the prefix, the tail of the prefix ring buffer.
+    const size_t num_kv_tokens = context->num_kv_tokens;
+    size_t first_window_token = math_sub_sat(context->kvcache_watermark, context->num_window_kv_slots);
+    if (first_window_token < context->num_prefix_tokens) {
+        first_window_token = context->prefix != NULL ?
+            math_sub_sat(context->num_prefix_tokens, context->prefix->num_window_kv_slots) : 0;
     }
+    const size_t num_window_kv_tokens = math_sub_sat(num_kv_tokens, first_window_token);
 
-    enum gptoss_status status = gptoss_status_success;
-    uint32_t* input_tokens = (uint32_t*) context->token_buffer.ptr;
-    while (num_tokens != 0) {
-        if (context->num_tokens == context->max_tokens) {
-            status = gptoss_status_context_overflow;
-            break;
-        }
+    struct gptoss_context_file_header header = {
+        .version = GPTOSS_CONTEXT_FILE_VERSION,
+        .kvcache_type = (uint32_t) context->kvcache_type,
+        .num_blocks = model->num_blocks,
+        .num_kv_heads = model->num_kv_heads,
+        .head_dim = model->head_dim,
+        .attention_window = model->attention_window,
+        .vocabulary_size = model->vocabulary_size,
+        .weights_fingerprint = model->weights_fingerprint,
+        .num_tokens = context->num_tokens,
+        .num_kv_tokens = num_kv_tokens,
+        .num_window_kv_tokens = num_window_kv_tokens,
+    };
+    memcpy(header.magic, context_file_magic, sizeof(header.magic));
+    status = write_context_file(fd, &header, sizeof(header));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    status = write_context_file(fd, context->token_buffer.ptr, context->num_tokens * sizeof(uint32_t));
+    if (status != gptoss_status_success) {
+        return status;
+    }
 
-        if (context->num_kv_tokens > context->num_tokens) {
-            const size_t num_tokens_to_verify = math_min(context->num_kv_tokens - context->num_tokens, num_tokens);
-            size_t num_verified_tokens = 0;
-            for (; num_verified_tokens < num_tokens_to_verify; num_verified_tokens++) {
-                if (input_tokens[context->num_tokens + num_verified_tokens] != tokens[num_verified_tokens]) {
-                    // Invalidate the KV cache starting with the newly added tokens.
-                    context->num_kv_tokens = context->num_tokens + num_verified_tokens;
-                    break;
-                }
+    // All command buffers on the context have completed, and the KV cache lives in shared memory: write it directly.
+    const size_t kvcache_token_size = 2 * model->num_kv_heads * get_kvcache_head_size(context->kvcache_type, model->head_dim);
+    pthread_rwlock_rdlock(&context->model->kvcache_pool_lock);
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        size_t num_block_tokens = 0;
+        for (size_t t = n % 2 == 0 ? num_kv_tokens - num_window_kv_tokens : 0; t < num_kv_tokens; t += num_block_tokens) {
+            const char* ptr = locate_kvcache_tokens(context, n, t, num_kv_tokens - t, &num_block_tokens);
+            status = write_context_file(fd, ptr, num_block_tokens * kvcache_token_size);
+            if (status != gptoss_status_success) {
+                goto cleanup;
             }
-
-            context->num_tokens += num_verified_tokens;
-            tokens += num_verified_tokens;
-            num_tokens -= num_verified_tokens;
-        } else {
-            const size_t num_tokens_to_copy = math_min(context->max_tokens - context->num_tokens, num_tokens);
-            memcpy(input_tokens + context->num_tokens, tokens, num_tokens_to_copy * sizeof(uint32_t));
-            context->num_tokens += num_tokens_to_copy;
-            tokens += num_tokens_to_copy;
-            num_tokens -= num_tokens_to_copy;
         }
     }
 
+cleanup:
+    pthread_rwlock_unlock(&context->model->kvcache_pool_lock);
     return status;
 }
 
-enum gptoss_status GPTOSS_ABI gptoss_context_process(
-    gptoss_context_t context)
+enum gptoss_status GPTOSS_ABI gptoss_context_load(
+    gptoss_context_t context,
+    int fd)
 {
-    if (context->num_tokens > context->num_kv_tokens) {
-        struct gptoss_metal_command_buffer command_buffer = {0};
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+    const size_t num_prefix_tokens = context->num_prefix_tokens;
 
-        enum gptoss_status status = gptoss_metal_command_buffer_create(&context->model->command_queue, &command_buffer);
-        if (status != gptoss_status_success) {
-            goto cleanup;
-        }
+    finish_stream(context);
 
-        struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
-        control->abort = 0;
+    struct gptoss_context_file_header header;
+    status = read_context_file(fd, &header, sizeof(header));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    if (memcmp(header.magic, context_file_magic, sizeof(header.magic)) != 0) {
+        GPTOSS_LOG_ERROR("invalid magic in context file");
+        return gptoss_status_invalid_argument;
+    }
+    if (header.version != GPTOSS_CONTEXT_FILE_VERSION) {
+        GPTOSS_LOG_ERROR("unsupported context file version %" PRIu32, header.version);
+        return gptoss_status_unsupported_argument;
+    }
+    if (header.num_blocks != model->num_blocks || header.num_kv_heads != model->num_kv_heads ||
+        header.head_dim != model->head_dim || header.attention_window != model->attention_window ||
+        header.vocabulary_size != model->vocabulary_size)
+    {
+        GPTOSS_LOG_ERROR("context file was saved for a different model");
+        return gptoss_status_invalid_argument;
+    }
+    if (header.weights_fingerprint != model->weights_fingerprint) {
+        GPTOSS_LOG_ERROR("context file was saved for a model with different weights");
+        return gptoss_status_invalid_argument;
+    }
+    if (header.kvcache_type != (uint32_t) context->kvcache_type) {
+        GPTOSS_LOG_ERROR("context file KV cache type %" PRIu32 " does not match context KV cache type %d",
+            header.kvcache_type, (int) context->kvcache_type);
+        return gptoss_status_invalid_argument;
+    }
+    if (header.num_tokens > context->max_tokens) {
+        GPTOSS_LOG_ERROR("context file with %" PRIu64 " tokens exceeds the context length %zu",
+            header.num_tokens, context->max_tokens);
+        return gptoss_status_context_overflow;
+    }
+    if (header.num_kv_tokens > header.num_tokens || header.num_window_kv_tokens > header.num_kv_tokens) {
+        GPTOSS_LOG_ERROR("invalid token counts in context file");
+        return gptoss_status_invalid_argument;
+    }
+    if (header.num_kv_tokens < num_prefix_tokens) {
+        GPTOSS_LOG_ERROR("context file with %" PRIu64 " tokens in the KV cache does not cover the %zu shared prefix tokens",
+            header.num_kv_tokens, num_prefix_tokens);
+        return gptoss_status_invalid_argument;
+    }
 
-        status = process_tokens(
-            context,
-            &command_buffer,
-            /*input_tokens_offset=*/context->num_kv_tokens,
-            /*num_input_tokens=*/context->num_tokens - context->num_kv_tokens,
-            /*num_output_tokens=*/0);
-        if (status != gptoss_status_success) {
-            goto cleanup;
+    // From here on, the context is restored, or left with only the shared prefix tokens on failure.
+    context->num_tokens = num_prefix_tokens;
+    truncate_kvcache(context, num_prefix_tokens);
+
+    const size_t num_tokens = (size_t) header.num_tokens;
+    const size_t num_kv_tokens = (size_t) header.num_kv_tokens;
+    uint32_t* tokens = (uint32_t*) context->token_buffer.ptr;
+    status = read_context_file(fd, tokens, num_tokens * sizeof(uint32_t));
+    if (status == gptoss_status_success && num_prefix_tokens != 0 &&
+        memcmp(tokens, context->prefix->tokens, num_prefix_tokens * sizeof(uint32_t)) != 0)
+    {
+        GPTOSS_LOG_ERROR("context file tokens do not start with the shared prefix tokens");
+        status = gptoss_status_invalid_argument;
+    }
+    if (status != gptoss_status_success) {
+        if (num_prefix_tokens != 0) {
+            memcpy(tokens, context->prefix->tokens, num_prefix_tokens * sizeof(uint32_t));
         }
+        return status;
+    }
+
+    status = reserve_kvcache_pages(context, num_kv_tokens);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
 
-        status = gptoss_metal_command_buffer_commit(&command_buffer);
+    // Only the private KV cache is restored, and sliding-window blocks keep at most num_window_kv_slots tokens.
+    // Rows are read straight into the (shared memory) KV cache, without intermediate copies.
+    const size_t kvcache_token_size = 2 * model->num_kv_heads * get_kvcache_head_size(context->kvcache_type, model->head_dim);
+    const size_t first_file_window_token = num_kv_tokens - (size_t) header.num_window_kv_tokens;
+    const size_t first_window_token = math_max(math_max(first_file_window_token, num_prefix_tokens),
+        math_sub_sat(num_kv_tokens, context->num_window_kv_slots));
+    pthread_rwlock_rdlock(&context->model->kvcache_pool_lock);
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        const size_t first_file_token = n % 2 == 0 ? first_file_window_token : 0;
+        const size_t first_token = n % 2 == 0 ? first_window_token : num_prefix_tokens;
+        status = skip_context_file(fd, (first_token - first_file_token) * kvcache_token_size);
         if (status != gptoss_status_success) {
-            goto cleanup;
+            break;
+        }
+        size_t num_block_tokens = 0;
+        for (size_t t = first_token; t < num_kv_tokens && status == gptoss_status_success; t += num_block_tokens) {
+            char* ptr = locate_kvcache_tokens(context, n, t, num_kv_tokens - t, &num_block_tokens);
+            status = read_context_file(fd, ptr, num_block_tokens * kvcache_token_size);
         }
-
-        status = gptoss_metal_command_buffer_wait_completion(&command_buffer, NULL);
         if (status != gptoss_status_success) {
-            goto cleanup;
+            break;
         }
+    }
+    pthread_rwlock_unlock(&context->model->kvcache_pool_lock);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
 
-        context->num_kv_tokens = context->num_tokens;
+    context->num_tokens = num_tokens;
+    context->num_kv_tokens = num_kv_tokens;
+    // The ring buffers hold tokens [first_window_token, num_kv_tokens): unless these are all the private tokens, set
+    // the watermark as if the tokens before first_window_token were overwritten.
+    context->kvcache_watermark = first_window_token == num_prefix_tokens ?
+        num_kv_tokens : first_window_token + context->num_window_kv_slots;
+    // Drops the KV cache if the restored tokens don't span the attention window.
+    truncate_kvcache(context, num_kv_tokens);
 
 cleanup:
-        gptoss_metal_command_buffer_release(&command_buffer);
-        return status;
+    if (status != gptoss_status_success) {
+        release_kvcache_pages(context, num_prefix_tokens);
     }
-    
-    return gptoss_status_success;
+    return status;
 }
 
-enum gptoss_status GPTOSS_ABI gptoss_context_sample(
+enum gptoss_status GPTOSS_ABI gptoss_context_fork(
     gptoss_context_t context,
-    float temperature,
-    uint64_t seed,
-    size_t max_tokens,
-    uint32_t* tokens_out,
-    size_t* num_tokens_out)
+    gptoss_context_t* context_out)
 {
+    *context_out = NULL;
+
     enum gptoss_status status = gptoss_status_success;
-    const struct gptoss_model* model = context->model;
+    struct gptoss_context* fork = NULL;
     struct gptoss_metal_command_buffer command_buffer = {0};
+    const struct gptoss_model* model = context->model;
 
-    *num_tokens_out = 0;
-
-    const uint32_t num_original_tokens = context->num_tokens;
+    finish_stream(context);
 
-    status = gptoss_metal_command_buffer_create(&context->model->command_queue, &command_buffer);
+    status = create_context(context->model, context->max_tokens, context->kvcache_type, context->prefix,
+        context->num_sink_tokens, &fork);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
 
-    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
-    control->abort = 0;
-
-    for (size_t t = 0; t < max_tokens; t++) {
-        if (context->num_kv_tokens < context->num_tokens) {
-            status = process_tokens(
-                context,
-                &command_buffer,
-                /*input_tokens_offset=*/context->num_kv_tokens,
-                /*num_input_tokens=*/context->num_tokens - context->num_kv_tokens,
-                /*num_output_tokens=*/1);
-            context->num_kv_tokens = context->num_tokens;
-        } else {
-            status = process_tokens(
-                context,
-                &command_buffer,
-                /*input_tokens_offset=*/context->num_tokens - 1,
-                /*num_input_tokens=*/1,
-                /*num_output_tokens=*/1);
+    const size_t num_tokens = context->num_tokens;
+    memcpy(fork->token_buffer.ptr, context->token_buffer.ptr, num_tokens * sizeof(uint32_t));
+    fork->num_tokens = num_tokens;
+    fork->top_k = context->top_k;
+    fork->top_p = context->top_p;
+    fork->prefill_activation_type = context->prefill_activation_type;
+    if (context->num_token_states != 0) {
+        status = gptoss_metal_buffer_create(&model->device, context->token_mask_buffer.size,
+            context->token_mask_buffer.ptr, &fork->token_mask_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
         }
+        status = gptoss_metal_buffer_create(&model->device, context->token_transition_buffer.size,
+            context->token_transition_buffer.ptr, &fork->token_transition_buffer);
         if (status != gptoss_status_success) {
             goto cleanup;
         }
+        fork->allocation_size += fork->token_mask_buffer.size + fork->token_transition_buffer.size;
+        gptoss_metal_residency_set_add_buffer(&fork->residency_set, &fork->token_mask_buffer);
+        gptoss_metal_residency_set_add_buffer(&fork->residency_set, &fork->token_transition_buffer);
+        gptoss_metal_residency_set_commit(&fork->residency_set);
+        fork->num_token_states = context->num_token_states;
+        fork->num_token_transitions = context->num_token_transitions;
+        fork->initial_token_state = context->initial_token_state;
+        ((struct gptoss_control*) fork->control_buffer.ptr)->token_state =
+            ((const struct gptoss_control*) context->control_buffer.ptr)->token_state;
+    }
 
-        if (temperature != 0.0f) {
-            assert(context->num_processed_tokens != 0);
-            uint32_t num_threadgroups = 0;
-            uint32_t num_dims_per_threadgroup = 0;
-            status = gptoss_metal_command_buffer_encode_launch_f32_softmax(
-                &command_buffer,
-                &model->f32_softmax_fn,
-                /*threadgroup_size=*/512,
-                model->max_threadgroups,
-                &context->score_buffer,
-                /*score_offset=*/0,
-                &context->argmax_buffer,
-                /*argmax_offset=*/0,
-                &context->prob_buffer,
-                /*prob_offset=*/0,
-                &context->sum_buffer,
-                /*sum_offset=*/0,
-                &context->control_buffer,
-                /*control_offset=*/0,
-                model->vocabulary_size,
-                /*num_tokens=*/1,
-                temperature,
-                &num_threadgroups,
-                &num_dims_per_threadgroup);
-            if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_softmax kernel launch");
-                goto cleanup;
-            }
+    status = reserve_kvcache_pages(fork, num_tokens);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
 
-            status = gptoss_metal_command_buffer_encode_launch_f32_sample(
-                &command_buffer,
-                &model->f32_sample_fn,
-                /*min_threadgroup_size=*/512,
-                &context->prob_buffer,
-                /*prob_offset=*/0,
-                &context->sum_buffer,
-                /*sum_offset=*/0,
-                &context->token_buffer,
-                /*token_offset=*/context->num_tokens * sizeof(uint32_t),
-                &context->control_buffer,
-                /*control_offset=*/0,
-                /*rng_seed=*/seed + UINT64_C(0x123456789ABCDEF),
-                /*rng_offset=*/context->num_tokens,
-                /*num_blocks=*/num_threadgroups,
-                /*num_channels=*/model->vocabulary_size,
-                /*num_channels_per_block=*/num_dims_per_threadgroup);
-            if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_sample kernel launch");
-                goto cleanup;
-            }
-        } else {
-            status = gptoss_metal_command_buffer_encode_copy_buffer(
-                &command_buffer,
-                &context->argmax_buffer,
-                /*input_offset=*/0,
-                &context->token_buffer,
-                /*output_offset=*/context->num_tokens * sizeof(uint32_t),
-                /*size=*/sizeof(uint32_t));
-            if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode copy buffer");
-                goto cleanup;
+    // Copy only the private KV cache rows in use on the GPU: the written part of the ring buffers of sliding-window
+    // blocks, and the processed tokens of full-attention blocks, page by page. The shared prefix is not copied.
+    const size_t num_prefix_tokens = context->num_prefix_tokens;
+    const size_t num_kv_tokens = context->num_kv_tokens;
+    if (num_kv_tokens > num_prefix_tokens) {
+        const struct gptoss_kvcache_pool* pool = &model->kvcache_pools[context->kvcache_type];
+        const size_t kvcache_token_size = 2 * model->num_kv_heads * get_kvcache_head_size(context->kvcache_type, model->head_dim);
+        const size_t num_private_kv_tokens = num_kv_tokens - num_prefix_tokens;
+        const size_t num_window_rows = math_min(
+            math_sub_sat(context->kvcache_watermark, num_prefix_tokens), context->num_window_kv_slots);
+
+        status = create_command_buffer(fork, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        for (uint32_t n = 0; n < model->num_blocks && status == gptoss_status_success; n++) {
+            if (n % 2 == 0) {
+                status = gptoss_metal_command_buffer_encode_copy_buffer(
+                    &command_buffer,
+                    &context->kvcache_buffer,
+                    /*input_offset=*/get_block_kvcache_offset(context, n),
+                    &fork->kvcache_buffer,
+                    /*output_offset=*/get_block_kvcache_offset(fork, n),
+                    /*size=*/num_window_rows * kvcache_token_size);
+            } else {
+                const uint32_t* page_table = get_block_page_table(context, n);
+                const uint32_t* fork_page_table = get_block_page_table(fork, n);
+                for (size_t t = 0; t < num_private_kv_tokens && status == gptoss_status_success; t += GPTOSS_KVCACHE_PAGE_TOKENS) {
+                    const size_t page = t / GPTOSS_KVCACHE_PAGE_TOKENS;
+                    const size_t num_page_tokens = math_min(num_private_kv_tokens - t, GPTOSS_KVCACHE_PAGE_TOKENS);
+                    status = gptoss_metal_command_buffer_encode_copy_buffer(
+                        &command_buffer,
+                        &pool->buffer,
+                        /*input_offset=*/page_table[page] * pool->page_size,
+                        &pool->buffer,
+                        /*output_offset=*/fork_page_table[page] * pool->page_size,
+                        /*size=*/num_page_tokens * kvcache_token_size);
+                }
             }
         }
-        context->num_tokens += 1;
-        context->num_kv_tokens = context->num_tokens;
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode KV cache copy");
+            end_encoding(fork);
+            goto cleanup;
+        }
+        status = commit_command_buffer(fork, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        status = wait_command_buffer(fork, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
     }
+    fork->num_kv_tokens = num_kv_tokens;
+    fork->kvcache_watermark = context->kvcache_watermark;
 
-    gptoss_metal_command_buffer_commit(&command_buffer);
-    gptoss_metal_command_buffer_wait_completion(&command_buffer, NULL);
-
-    const uint32_t* token_ptr = (const uint32_t*) context->token_buffer.ptr;
-    const uint32_t num_generated_tokens = context->num_tokens - num_original_tokens;
-    memcpy(tokens_out, token_ptr + num_original_tokens, num_generated_tokens * sizeof(uint32_t));
-    *num_tokens_out = num_generated_tokens;
+    *context_out = fork;
+    fork = NULL;
 
 cleanup:
     gptoss_metal_command_buffer_release(&command_buffer);
+    gptoss_context_release(fork);
     return status;
 }
 
 enum gptoss_status GPTOSS_ABI gptoss_context_reset(
     gptoss_context_t context)
 {
+    finish_stream(context);
+
     context->num_tokens = 0;
+    ((struct gptoss_control*) context->control_buffer.ptr)->token_state = context->initial_token_state;
 
     // Note: context->num_kv_tokens is not reset and context->input_tokens_buffer is not cleared.
     // If the subsequently added tokens match the tokens already in the KV cache, we reuse the KV cache.
@@ -855,15 +4116,20 @@ enum gptoss_status GPTOSS_ABI gptoss_context_release(
 {
     if (context != NULL) {
         if (atomic_fetch_sub_explicit(&context->ref_count, 1, memory_order_acq_rel) == 1) {
+            finish_stream(context);
+
             // Activation buffers
             gptoss_metal_buffer_release(&context->residual_activation_buffer);
             gptoss_metal_buffer_release(&context->rmsnorm_activation_buffer);
             gptoss_metal_buffer_release(&context->qkv_activation_buffer);
             gptoss_metal_buffer_release(&context->sdpa_activation_buffer);
+            gptoss_metal_buffer_release(&context->sdpa_partial_buffer);
             gptoss_metal_buffer_release(&context->gate_activation_buffer);
             gptoss_metal_buffer_release(&context->expert_activation_buffer);
+            gptoss_metal_buffer_release(&context->expert_route_buffer);
             gptoss_metal_buffer_release(&context->swiglu_activation_buffer);
             gptoss_metal_buffer_release(&context->moe_activation_buffer);
+            gptoss_metal_heap_release(&context->activation_heap);
 
             // Input/output buffers
             gptoss_metal_buffer_release(&context->control_buffer);
@@ -872,8 +4138,18 @@ enum gptoss_status GPTOSS_ABI gptoss_context_release(
             gptoss_metal_buffer_release(&context->prob_buffer);
             gptoss_metal_buffer_release(&context->sum_buffer);
             gptoss_metal_buffer_release(&context->argmax_buffer);
+            gptoss_metal_buffer_release(&context->token_mask_buffer);
+            gptoss_metal_buffer_release(&context->top_logprob_buffer);
+            gptoss_metal_buffer_release(&context->token_transition_buffer);
             gptoss_metal_buffer_release(&context->kvcache_buffer);
+            if (context->num_kv_pages != 0) {
+                release_kvcache_pages(context, /*num_tokens=*/0);
+            }
+            gptoss_metal_buffer_release(&context->kvcache_page_table_buffer);
+            gptoss_metal_residency_set_release(&context->residency_set);
 
+            free(context->profile_entries);
+            gptoss_prefix_release(context->prefix);
             gptoss_model_release(context->model);
 
             memset(context, 0, sizeof(struct gptoss_context));
@@ -882,3 +4158,128 @@ enum gptoss_status GPTOSS_ABI gptoss_context_release(
     }
     return gptoss_status_success;
 }
+
+enum gptoss_status GPTOSS_ABI gptoss_context_create_prefix(
+    gptoss_context_t context,
+    gptoss_prefix_t* prefix_out)
+{
+    *prefix_out = NULL;
+
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_prefix* prefix = NULL;
+
+    if (context->prefix != NULL) {
+        GPTOSS_LOG_ERROR("cannot create a prefix from a context created from a prefix");
+        status = gptoss_status_invalid_argument;
+        goto cleanup;
+    }
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("cannot create a prefix from an empty context");
+        status = gptoss_status_invalid_argument;
+        goto cleanup;
+    }
+
+    finish_stream(context);
+
+    // After sampling, the KV cache of the last token is not yet computed: always recompute it.
+    truncate_kvcache(context, math_min(context->num_kv_tokens, context->num_tokens - 1));
+    status = prefill_tokens(context, context->num_tokens);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    const struct gptoss_model* model = context->model;
+    const size_t num_tokens = context->num_tokens;
+
+    prefix = malloc(sizeof(struct gptoss_prefix));
+    if (prefix == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for Prefix object", sizeof(struct gptoss_prefix));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    memset(prefix, 0, sizeof(struct gptoss_prefix));
+    atomic_store_explicit(&prefix->ref_count, 1, memory_order_relaxed);
+    prefix->num_tokens = num_tokens;
+    prefix->kvcache_type = context->kvcache_type;
+    prefix->num_window_kv_slots = context->num_window_kv_slots;
+    prefix->model = context->model;
+    gptoss_model_retain(context->model);
+
+    prefix->tokens = malloc(num_tokens * sizeof(uint32_t));
+    if (prefix->tokens == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for prefix tokens", num_tokens * sizeof(uint32_t));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    memcpy(prefix->tokens, context->token_buffer.ptr, num_tokens * sizeof(uint32_t));
+
+    const size_t num_window_blocks = math_ceil_div(model->num_blocks, 2);
+    const size_t num_kvcache_tokens = num_window_blocks * prefix->num_window_kv_slots + (model->num_blocks - num_window_blocks) * num_tokens;
+    const size_t kvcache_token_size = 2 * model->num_kv_heads * get_kvcache_head_size(prefix->kvcache_type, model->head_dim);
+    status = gptoss_metal_buffer_create(&model->device, num_kvcache_tokens * kvcache_token_size, NULL, &prefix->kvcache_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    // The KV cache lives in shared memory and the prefill has completed: copy on the CPU. Ring buffers of
+    // sliding-window blocks are copied verbatim, full-attention blocks are gathered from their pages.
+    const struct gptoss_kvcache_pool* pool = &model->kvcache_pools[context->kvcache_type];
+    pthread_rwlock_rdlock(&context->model->kvcache_pool_lock);
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        char* prefix_block_ptr = (char*) prefix->kvcache_buffer.ptr + get_prefix_block_kvcache_offset(prefix, n);
+        if (n % 2 == 0) {
+            memcpy(
+                prefix_block_ptr,
+                (const char*) context->kvcache_buffer.ptr + get_block_kvcache_offset(context, n),
+                get_prefix_block_kvcache_capacity(prefix, n) * kvcache_token_size);
+        } else {
+            const uint32_t* page_table = get_block_page_table(context, n);
+            for (size_t t = 0; t < num_tokens; t += GPTOSS_KVCACHE_PAGE_TOKENS) {
+                const size_t num_page_tokens = math_min(num_tokens - t, GPTOSS_KVCACHE_PAGE_TOKENS);
+                memcpy(
+                    prefix_block_ptr + t * kvcache_token_size,
+                    (const char*) pool->buffer.ptr + page_table[t / GPTOSS_KVCACHE_PAGE_TOKENS] * pool->page_size,
+                    num_page_tokens * kvcache_token_size);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&context->model->kvcache_pool_lock);
+
+    *prefix_out = prefix;
+    prefix = NULL;
+
+cleanup:
+    gptoss_prefix_release(prefix);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_prefix_get_num_tokens(
+    gptoss_prefix_t prefix,
+    size_t* num_tokens_out)
+{
+    *num_tokens_out = prefix->num_tokens;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_prefix_retain(
+    gptoss_prefix_t prefix)
+{
+    atomic_fetch_add_explicit(&prefix->ref_count, 1, memory_order_relaxed);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_prefix_release(
+    gptoss_prefix_t prefix)
+{
+    if (prefix != NULL) {
+        if (atomic_fetch_sub_explicit(&prefix->ref_count, 1, memory_order_acq_rel) == 1) {
+            gptoss_metal_buffer_release(&prefix->kvcache_buffer);
+            free(prefix->tokens);
+            gptoss_model_release(prefix->model);
+
+            memset(prefix, 0, sizeof(struct gptoss_prefix));
+            free(prefix);
+        }
+    }
+    return gptoss_status_success;
+}
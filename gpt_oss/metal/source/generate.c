@@ -10,10 +10,15 @@
 #include <string.h>
 
 #include <mach/mach_time.h>
+#include <sys/resource.h>
 
 #include <gpt-oss.h>
 
 #include "internal/model.h"
+#include "internal/rng.h"
+
+// Maximum number of values of each swept parameter in benchmark mode.
+#define MAX_SWEEP_VALUES 16
 
 struct {
     atomic_uint_least64_t inference_bytes;
@@ -21,6 +26,7 @@ struct {
     atomic_uint_least64_t prefill_microseconds;
     atomic_size_t num_generated_tokens;
     atomic_uint_least64_t generation_microseconds;
+    _Atomic(gptoss_model_t) model;
 } globals = {
     .inference_bytes = 0,
     .num_prefill_tokens = 0,
@@ -35,7 +41,24 @@ struct options {
     size_t context_length;
     size_t max_tokens;
     float temperature;
+    bool lazy;
     bool verbose;
+    // Autotune mode: tune the kernel launch parameters for the device, save them, and print them.
+    bool autotune;
+    // Benchmark mode: sweep over all combinations of the listed values, and print results as JSON.
+    bool benchmark;
+    size_t num_prompt_lengths;
+    size_t prompt_lengths[MAX_SWEEP_VALUES];
+    // Context length 0 fits the prompt and the generated tokens.
+    size_t num_context_lengths;
+    size_t context_lengths[MAX_SWEEP_VALUES];
+    size_t num_temperatures;
+    float temperatures[MAX_SWEEP_VALUES];
+    // Batch size 0 selects the default maximum batch size.
+    size_t num_batch_sizes;
+    size_t batch_sizes[MAX_SWEEP_VALUES];
+    size_t num_warmup_trials;
+    size_t num_trials;
 };
 
 static inline double mach_timestamp_diff_to_seconds(uint64_t start_timestamp, uint64_t end_timestamp) {
@@ -58,7 +81,52 @@ static inline uint64_t mach_timestamp_diff_to_microseconds(uint64_t start_timest
 }
 
 static void print_usage(const char* program_name) {
-    printf("Usage: %s <model-path> [-p <prompt>] [-n <tokens>]\n", program_name);
+    printf("Usage: %s <model-path> [-p <prompt>] [-n <tokens>] [--lazy]\n", program_name);
+    printf("       %s <model-path> --benchmark [-n <tokens>] [--prompt-lengths <n,...>] [--context-lengths <n,...>]\n"
+           "           [--temperatures <t,...>] [--batch-sizes <n,...>] [--warmup <trials>] [--trials <trials>]\n", program_name);
+    printf("       %s <model-path> --autotune [--lazy]\n", program_name);
+}
+
+static size_t parse_size_list(const char* option_name, char* list, size_t* values) {
+    size_t num_values = 0;
+    char* value_start = list;
+    while (true) {
+        if (num_values == MAX_SWEEP_VALUES) {
+            fprintf(stderr, "Error: too many values for %s, at most %d are supported\n", option_name, MAX_SWEEP_VALUES);
+            exit(EXIT_FAILURE);
+        }
+        char* value_end = value_start;
+        values[num_values++] = strtoul(value_start, &value_end, 10);
+        if (value_end == value_start || (*value_end != ',' && *value_end != 0)) {
+            fprintf(stderr, "Error: failed to parse %s value \"%s\"\n", option_name, list);
+            exit(EXIT_FAILURE);
+        }
+        if (*value_end == 0) {
+            return num_values;
+        }
+        value_start = value_end + 1;
+    }
+}
+
+static size_t parse_float_list(const char* option_name, char* list, float* values) {
+    size_t num_values = 0;
+    char* value_start = list;
+    while (true) {
+        if (num_values == MAX_SWEEP_VALUES) {
+            fprintf(stderr, "Error: too many values for %s, at most %d are supported\n", option_name, MAX_SWEEP_VALUES);
+            exit(EXIT_FAILURE);
+        }
+        char* value_end = value_start;
+        values[num_values++] = strtof(value_start, &value_end);
+        if (value_end == value_start || (*value_end != ',' && *value_end != 0)) {
+            fprintf(stderr, "Error: failed to parse %s value \"%s\"\n", option_name, list);
+            exit(EXIT_FAILURE);
+        }
+        if (*value_end == 0) {
+            return num_values;
+        }
+        value_start = value_end + 1;
+    }
 }
 
 struct options parse_options(int argc, char** argv) {
@@ -68,7 +136,20 @@ struct options parse_options(int argc, char** argv) {
         .context_length = 0,
         .max_tokens = 0,
         .temperature = 0.0f,
+        .lazy = false,
         .verbose = false,
+        .autotune = false,
+        .benchmark = false,
+        .num_prompt_lengths = 1,
+        .prompt_lengths = {512},
+        .num_context_lengths = 1,
+        .context_lengths = {0},
+        .num_temperatures = 2,
+        .temperatures = {0.0f, 1.0f},
+        .num_batch_sizes = 1,
+        .batch_sizes = {0},
+        .num_warmup_trials = 1,
+        .num_trials = 5,
     };
     if (argc < 2) {
         fprintf(stderr, "Error: missing required command-line argument\n");
@@ -133,6 +214,57 @@ struct options parse_options(int argc, char** argv) {
                 fprintf(stderr, "Error: invalid temperature value %f\n", options.temperature);
                 exit(EXIT_FAILURE);
             }
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            options.lazy = true;
+        } else if (strcmp(argv[i], "--autotune") == 0) {
+            options.autotune = true;
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            options.benchmark = true;
+        } else if (strcmp(argv[i], "--prompt-lengths") == 0 || strcmp(argv[i], "--context-lengths") == 0 ||
+            strcmp(argv[i], "--temperatures") == 0 || strcmp(argv[i], "--batch-sizes") == 0 ||
+            strcmp(argv[i], "--warmup") == 0 || strcmp(argv[i], "--trials") == 0)
+        {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: missing argument for %s\n", argv[i]);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            const char* option_name = argv[i++];
+            if (strcmp(option_name, "--prompt-lengths") == 0) {
+                options.num_prompt_lengths = parse_size_list(option_name, argv[i], options.prompt_lengths);
+                for (size_t j = 0; j < options.num_prompt_lengths; j++) {
+                    if (options.prompt_lengths[j] == 0) {
+                        fprintf(stderr, "Error: invalid prompt length value %zu\n", options.prompt_lengths[j]);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            } else if (strcmp(option_name, "--context-lengths") == 0) {
+                options.num_context_lengths = parse_size_list(option_name, argv[i], options.context_lengths);
+            } else if (strcmp(option_name, "--temperatures") == 0) {
+                options.num_temperatures = parse_float_list(option_name, argv[i], options.temperatures);
+                for (size_t j = 0; j < options.num_temperatures; j++) {
+                    if (signbit(options.temperatures[j]) != 0 || !(options.temperatures[j] <= 2.0f)) {
+                        fprintf(stderr, "Error: invalid temperature value %f\n", options.temperatures[j]);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            } else if (strcmp(option_name, "--batch-sizes") == 0) {
+                options.num_batch_sizes = parse_size_list(option_name, argv[i], options.batch_sizes);
+            } else {
+                size_t num_trials = 0;
+                if (parse_size_list(option_name, argv[i], &num_trials) != 1) {
+                    fprintf(stderr, "Error: expected a single value for %s\n", option_name);
+                    exit(EXIT_FAILURE);
+                }
+                if (strcmp(option_name, "--warmup") == 0) {
+                    options.num_warmup_trials = num_trials;
+                } else if (num_trials != 0) {
+                    options.num_trials = num_trials;
+                } else {
+                    fprintf(stderr, "Error: invalid number of trials %zu\n", num_trials);
+                    exit(EXIT_FAILURE);
+                }
+            }
         } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
             options.verbose = true;
         } else {
@@ -150,7 +282,7 @@ struct options parse_options(int argc, char** argv) {
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
-    if (options.prompt == NULL) {
+    if (options.prompt == NULL && !options.benchmark && !options.autotune) {
         fprintf(stderr, "Error: missing required prompt argument\n");
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
@@ -178,6 +310,295 @@ static void print_profile() {
             num_generated_tokens,
             (double) num_generated_tokens / (double) generation_microseconds * 1.0e+6);
     }
+
+    struct gptoss_model_stats stats;
+    const gptoss_model_t model = atomic_load(&globals.model);
+    if (model != NULL && gptoss_model_get_stats(model, &stats) == gptoss_status_success && stats.num_command_buffers != 0) {
+        printf("GPU busy time: %.3f seconds in %" PRIu64 " command buffers\n", stats.gpu_busy_seconds, stats.num_command_buffers);
+        printf("Time waiting for the GPU: %.3f seconds\n", stats.wait_seconds);
+    }
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Prints mean and nearest-rank percentiles of the values as a JSON object. Sorts the values.
+static void print_distribution(const char* name, double* values, size_t num_values) {
+    double sum = 0.0;
+    for (size_t i = 0; i < num_values; i++) {
+        sum += values[i];
+    }
+    qsort(values, num_values, sizeof(double), compare_doubles);
+    const size_t p50_index = (num_values + 1) / 2 - 1;
+    const size_t p99_index = (size_t) ceil(0.99 * (double) num_values) - 1;
+    printf("      \"%s\": {\"mean\": %.9f, \"p50\": %.9f, \"p99\": %.9f}", name,
+        sum / (double) num_values, values[p50_index], values[p99_index]);
+}
+
+static size_t get_peak_rss() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    // Darwin reports the maximum resident set size in bytes.
+    return (size_t) usage.ru_maxrss;
+}
+
+// Runs warmup and timed trials of one benchmark configuration and prints its results as a JSON object. Every trial
+// prefills a different synthetic prompt, so that the KV cache retained by gptoss_context_reset is not reused.
+static enum gptoss_status run_benchmark_config(
+    gptoss_model_t model,
+    const struct options* options,
+    size_t batch_size,
+    size_t context_length,
+    size_t prompt_length,
+    float temperature,
+    bool first_result)
+{
+    enum gptoss_status status = gptoss_status_success;
+    gptoss_tokenizer_t tokenizer = NULL;
+    gptoss_context_t context = NULL;
+    uint32_t* prompt_tokens = NULL;
+    double* token_latencies = NULL;
+    double* first_token_latencies = NULL;
+    double* prefill_seconds = NULL;
+
+    const size_t num_decode_tokens = options->max_tokens;
+    const size_t num_trials = options->num_trials;
+    uint32_t num_text_tokens = 0;
+    status = gptoss_model_get_tokenizer(model, &tokenizer);
+    if (status != gptoss_status_success) {
+        fprintf(stderr, "Error: failed to retrieve Tokenizer\n");
+        goto cleanup;
+    }
+    status = gptoss_tokenizer_get_num_text_tokens(tokenizer, &num_text_tokens);
+    if (status != gptoss_status_success) {
+        fprintf(stderr, "Error: failed to query the number of text tokens\n");
+        goto cleanup;
+    }
+
+    status = gptoss_context_create(model, context_length, &context);
+    if (status != gptoss_status_success) {
+        fprintf(stderr, "Error: failed to create Context object\n");
+        goto cleanup;
+    }
+
+    prompt_tokens = malloc(prompt_length * sizeof(uint32_t));
+    token_latencies = malloc(num_trials * num_decode_tokens * sizeof(double));
+    first_token_latencies = malloc(num_trials * sizeof(double));
+    prefill_seconds = malloc(num_trials * sizeof(double));
+    if (prompt_tokens == NULL || token_latencies == NULL || first_token_latencies == NULL || prefill_seconds == NULL) {
+        fprintf(stderr, "Error: failed to allocate benchmark buffers\n");
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    size_t num_token_latencies = 0;
+    size_t peak_metal_allocation_size = 0;
+    for (size_t trial = 0; trial < options->num_warmup_trials + num_trials; trial++) {
+        const bool warmup = trial < options->num_warmup_trials;
+        const uint64_t seed = UINT64_C(0x9E3779B97F4A7C15) * (trial + 1);
+        for (size_t t = 0; t < prompt_length; t++) {
+            prompt_tokens[t] = rng_squares32(t, seed) % num_text_tokens;
+        }
+
+        status = gptoss_context_reset(context);
+        if (status != gptoss_status_success) {
+            fprintf(stderr, "Error: failed to reset Context object\n");
+            goto cleanup;
+        }
+        const uint64_t prefill_start_time = mach_continuous_time();
+        status = gptoss_context_append_tokens(context, prompt_length, prompt_tokens);
+        if (status != gptoss_status_success) {
+            fprintf(stderr, "Error: failed to append tokens to the Context object\n");
+            goto cleanup;
+        }
+        status = gptoss_context_process(context);
+        if (status != gptoss_status_success) {
+            fprintf(stderr, "Error: failed to process Context object\n");
+            goto cleanup;
+        }
+        const uint64_t prefill_end_time = mach_continuous_time();
+
+        uint64_t token_start_time = prefill_end_time;
+        for (size_t t = 0; t < num_decode_tokens; t++) {
+            uint32_t token = 0;
+            size_t num_sampled_tokens = 0;
+            status = gptoss_context_sample(context, temperature, seed, /*max_tokens=*/1,
+                /*num_stop_tokens=*/0, /*stop_tokens=*/NULL, &token, &num_sampled_tokens);
+            if (status != gptoss_status_success) {
+                fprintf(stderr, "Error: failed to sample from the Context object\n");
+                goto cleanup;
+            }
+            const uint64_t token_end_time = mach_continuous_time();
+            if (!warmup) {
+                if (t == 0) {
+                    const size_t i = trial - options->num_warmup_trials;
+                    prefill_seconds[i] = mach_timestamp_diff_to_seconds(prefill_start_time, prefill_end_time);
+                    first_token_latencies[i] = mach_timestamp_diff_to_seconds(prefill_start_time, token_end_time);
+                } else {
+                    token_latencies[num_token_latencies++] = mach_timestamp_diff_to_seconds(token_start_time, token_end_time);
+                }
+            }
+
+            // Sample the Metal allocation after every token, as buffers are reallocated and released while decoding,
+            // and restart the timer after sampling, so that the query doesn't count towards the latency of the next token
+            struct gptoss_model_stats stats;
+            if (gptoss_model_get_stats(model, &stats) == gptoss_status_success &&
+                stats.metal_allocation_size > peak_metal_allocation_size)
+            {
+                peak_metal_allocation_size = stats.metal_allocation_size;
+            }
+            token_start_time = mach_continuous_time();
+        }
+    }
+
+    double mean_prefill_seconds = 0.0;
+    for (size_t i = 0; i < num_trials; i++) {
+        mean_prefill_seconds += prefill_seconds[i] / (double) num_trials;
+    }
+    double decode_seconds = 0.0;
+    for (size_t i = 0; i < num_token_latencies; i++) {
+        decode_seconds += token_latencies[i];
+    }
+
+    printf("%s    {\n", first_result ? "" : ",\n");
+    printf("      \"max_batch_tokens\": %zu,\n", batch_size);
+    printf("      \"context_length\": %zu,\n", context_length);
+    printf("      \"prompt_tokens\": %zu,\n", prompt_length);
+    printf("      \"decode_tokens\": %zu,\n", num_decode_tokens);
+    printf("      \"temperature\": %.3f,\n", temperature);
+    printf("      \"warmup_trials\": %zu,\n", options->num_warmup_trials);
+    printf("      \"trials\": %zu,\n", num_trials);
+    printf("      \"prefill_tokens_per_second\": %.3f,\n", (double) prompt_length / mean_prefill_seconds);
+    if (num_token_latencies != 0) {
+        printf("      \"decode_tokens_per_second\": %.3f,\n", (double) num_token_latencies / decode_seconds);
+    }
+    print_distribution("time_to_first_token_seconds", first_token_latencies, num_trials);
+    printf(",\n");
+    if (num_token_latencies != 0) {
+        print_distribution("per_token_latency_seconds", token_latencies, num_token_latencies);
+        printf(",\n");
+    }
+    printf("      \"peak_metal_allocation_bytes\": %zu,\n", peak_metal_allocation_size);
+    printf("      \"peak_rss_bytes\": %zu\n", get_peak_rss());
+    printf("    }");
+
+cleanup:
+    free(prompt_tokens);
+    free(token_latencies);
+    free(first_token_latencies);
+    free(prefill_seconds);
+    gptoss_context_release(context);
+    gptoss_tokenizer_release(tokenizer);
+    return status;
+}
+
+// Tunes the kernel launch parameters of the model for the device, which saves them as the launch profile that later
+// model loads pick up, and prints them as a JSON object.
+static int run_autotune(const struct options* options) {
+    gptoss_model_t model = NULL;
+    enum gptoss_status status = options->lazy ?
+        gptoss_model_create_from_file_lazy(options->model, &model, 0) :
+        gptoss_model_create_from_file(options->model, &model, 0);
+    if (status != gptoss_status_success) {
+        fprintf(stderr, "Error: failed to load model from file %s\n", options->model);
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t autotune_start_time = mach_continuous_time();
+    status = gptoss_model_autotune(model);
+    const double autotune_seconds = mach_timestamp_diff_to_seconds(autotune_start_time, mach_continuous_time());
+    if (status != gptoss_status_success) {
+        fprintf(stderr, "Error: failed to tune kernel launch parameters\n");
+        gptoss_model_release(model);
+        return EXIT_FAILURE;
+    }
+
+    printf("{\"autotune_seconds\": %.3f, \"max_threadgroups\": %zu", autotune_seconds, model->max_threadgroups);
+    static const char* const shape_names[GPTOSS_LAUNCH_SHAPE_COUNT] = {
+        [gptoss_launch_shape_decode] = "decode",
+        [gptoss_launch_shape_prefill] = "prefill",
+    };
+    for (size_t s = 0; s < GPTOSS_LAUNCH_SHAPE_COUNT; s++) {
+        printf(", \"%s_threadgroup_sizes\": [", shape_names[s]);
+        for (size_t k = 0; k < GPTOSS_LAUNCH_KERNEL_COUNT; k++) {
+            printf(k == 0 ? "%" PRIu32 : ", %" PRIu32, model->threadgroup_size[s][k]);
+        }
+        printf("]");
+    }
+    printf("}\n");
+    gptoss_model_release(model);
+    return EXIT_SUCCESS;
+}
+
+// Sweeps all combinations of batch size, context length, prompt length, and temperature, and prints the results as
+// JSON to stdout. The model is reloaded for every batch size, as the maximum batch size is fixed at model creation.
+// The JSON is closed even if a configuration fails, with "complete" set to false, so that the results printed so far
+// can still be parsed.
+static int run_benchmark(const struct options* options) {
+    bool first_result = true;
+    int exit_code = EXIT_SUCCESS;
+    printf("{\n  \"model\": \"");
+    for (const char* c = options->model; *c != 0; c++) {
+        if (*c == '"' || *c == '\\') {
+            putchar('\\');
+        }
+        putchar(*c);
+    }
+    printf("\",\n  \"results\": [\n");
+    for (size_t b = 0; b < options->num_batch_sizes; b++) {
+        const size_t batch_size = options->batch_sizes[b];
+        gptoss_model_t model = NULL;
+        enum gptoss_status status = options->lazy ?
+            gptoss_model_create_from_file_lazy(options->model, &model, batch_size) :
+            gptoss_model_create_from_file(options->model, &model, batch_size);
+        if (status != gptoss_status_success) {
+            fprintf(stderr, "Error: failed to load model from file %s\n", options->model);
+            exit_code = EXIT_FAILURE;
+            goto finish;
+        }
+        atomic_store(&globals.model, model);
+        const size_t model_batch_size = model->max_batch_tokens;
+
+        for (size_t c = 0; c < options->num_context_lengths; c++) {
+            for (size_t p = 0; p < options->num_prompt_lengths; p++) {
+                const size_t prompt_length = options->prompt_lengths[p];
+                size_t context_length = options->context_lengths[c];
+                if (context_length == 0) {
+                    context_length = prompt_length + options->max_tokens;
+                } else if (context_length < prompt_length + options->max_tokens) {
+                    fprintf(stderr, "Skipping prompt length %zu: context length %zu can't fit %zu generated tokens\n",
+                        prompt_length, context_length, options->max_tokens);
+                    continue;
+                }
+                for (size_t t = 0; t < options->num_temperatures; t++) {
+                    const float temperature = options->temperatures[t];
+                    fprintf(stderr, "Benchmarking batch size %zu, context length %zu, prompt length %zu, temperature %.2f\n",
+                        model_batch_size, context_length, prompt_length, temperature);
+                    status = run_benchmark_config(model, options, model_batch_size, context_length, prompt_length,
+                        temperature, first_result);
+                    if (status != gptoss_status_success) {
+                        atomic_store(&globals.model, NULL);
+                        gptoss_model_release(model);
+                        exit_code = EXIT_FAILURE;
+                        goto finish;
+                    }
+                    first_result = false;
+                }
+            }
+        }
+
+        atomic_store(&globals.model, NULL);
+        gptoss_model_release(model);
+    }
+
+finish:
+    printf("\n  ],\n  \"complete\": %s\n}\n", exit_code == EXIT_SUCCESS ? "true" : "false");
+    return exit_code;
 }
 
 static void ctrl_c_handler(int signum) {
@@ -198,13 +619,25 @@ int main(int argc, char *argv[]) {
     setvbuf(stdout, NULL, _IONBF, 0);
 
     struct options options = parse_options(argc, argv);
+    if (options.autotune) {
+        return run_autotune(&options);
+    }
+    if (options.benchmark) {
+        if (options.max_tokens == 0) {
+            options.max_tokens = 128;
+        }
+        return run_benchmark(&options);
+    }
 
     const uint64_t load_start_time = mach_continuous_time();
-    status = gptoss_model_create_from_file(options.model, &model, 0);
+    status = options.lazy ?
+        gptoss_model_create_from_file_lazy(options.model, &model, 0) :
+        gptoss_model_create_from_file(options.model, &model, 0);
     if (status != gptoss_status_success) {
         fprintf(stderr, "Error: failed to load model from file %s\n", options.model);
         goto error;
     }
+    atomic_store(&globals.model, model);
     size_t max_model_context_length = 0;
     status = gptoss_model_get_max_context_length(model, &max_model_context_length);
     if (status != gptoss_status_success) {
@@ -239,7 +672,10 @@ int main(int argc, char *argv[]) {
     }
     if (options.verbose) {
         printf("Model weights size: %.2lf MB\n", (double) model->weights_size * 0x1.0p-20);
-        printf("Model allocation size: %.2lf MB\n", (double) model->allocation_size * 0x1.0p-20);
+        struct gptoss_model_stats stats;
+        if (gptoss_model_get_stats(model, &stats) == gptoss_status_success) {
+            printf("Metal allocation size: %.2lf MB\n", (double) stats.metal_allocation_size * 0x1.0p-20);
+        }
         printf("Context allocation size: %.2lf MB\n", (double) context->allocation_size * 0x1.0p-20);
         printf("  Including KV cache: %.2lf MB\n", (double) context->kvcache_size * 0x1.0p-20);
     }
@@ -248,6 +684,10 @@ int main(int argc, char *argv[]) {
     const double load_elapsed_seconds = mach_timestamp_diff_to_seconds(load_start_time, load_end_time);
     if (options.verbose) {
         printf("Loaded model in %.3f seconds\n", load_elapsed_seconds);
+        printf("  File mapping: %.3f seconds\n", model->load_mapping_seconds);
+        printf("  Weight buffer wrapping: %.3f seconds\n", model->load_buffer_seconds);
+        printf("  Pipeline state creation: %.3f seconds\n", model->load_pipeline_seconds);
+        printf("  Remaining wait for weight prefetch: %.3f seconds\n", model->load_wait_seconds);
     }
 
     const uint64_t prefill_start_time = mach_continuous_time();
@@ -270,7 +710,7 @@ int main(int argc, char *argv[]) {
         uint32_t predicted_token = UINT32_MAX;
         size_t num_predicted_tokens = 0;
         const uint64_t inference_start_timestamp = mach_continuous_time();
-        status = gptoss_context_sample(context, options.temperature, /*rng_state=*/0, /*num_tokens=*/1, &predicted_token, &num_predicted_tokens);
+        status = gptoss_context_sample(context, options.temperature, /*rng_state=*/0, /*num_tokens=*/1, /*num_stop_tokens=*/0, /*stop_tokens=*/NULL, &predicted_token, &num_predicted_tokens);
         if (status != gptoss_status_success) {
             fprintf(stderr, "Error: failed to sample from the Context object\n");
             goto error;
@@ -293,6 +733,10 @@ int main(int argc, char *argv[]) {
         const size_t previous_num_generated_tokens = atomic_fetch_add(&globals.num_generated_tokens, 1);
         if (previous_num_generated_tokens == 0) {
             atomic_fetch_add(&globals.prefill_microseconds, mach_timestamp_diff_to_microseconds(prefill_start_time, prefill_end_time));
+            if (options.verbose) {
+                printf("Time to first token (including model loading): %.3f seconds\n",
+                    mach_timestamp_diff_to_seconds(load_start_time, inference_end_timestamp));
+            }
         } else {
             atomic_fetch_add(&globals.generation_microseconds, mach_timestamp_diff_to_microseconds(inference_start_timestamp, inference_end_timestamp));
         }
@@ -310,6 +754,7 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
 
 error:
+    atomic_store(&globals.model, NULL);
     gptoss_context_release(context);
     gptoss_tokenizer_release(tokenizer);
     gptoss_model_release(model);
@@ -11,16 +11,95 @@ struct gptoss_expert_prediction {
 
 struct gptoss_control {
     uint32_t abort;
+    // Current state of the token automaton constraining sampling, if any.
+    uint32_t token_state;
 };
 
+// Indices of the uint function constants through which kernels are specialized to the shape of the loaded model.
+#define GPTOSS_FUNCTION_CONSTANT_NUM_EXPERTS 0
+#define GPTOSS_FUNCTION_CONSTANT_NUM_ACTIVE_EXPERTS 1
+#define GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS 2
+#define GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT 3
+#define GPTOSS_FUNCTION_CONSTANT_ACTIVATION_TYPE 4
+
+// Layouts of MXFP4 expert weights. In the row-major layout, the 16-byte blocks of each weight matrix are stored row by
+// row, followed by the matrix of their 1-byte scales. In the tiled layout, the matrix is split into tiles of
+// GPTOSS_MF4_TILE_ROWS rows by one block (32 columns): each tile stores the blocks of its rows, then their scales, in
+// GPTOSS_MF4_TILE_SIZE bytes, and tiles are stored column by column within each group of rows.
+#define GPTOSS_EXPERT_WEIGHT_LAYOUT_ROW_MAJOR 0
+#define GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED 1
+#define GPTOSS_MF4_TILE_ROWS 32
+#define GPTOSS_MF4_TILE_SIZE (GPTOSS_MF4_TILE_ROWS * 17)
+
+// Storage formats of the SwiGLU activations between the grouped MoE matmuls; arithmetic stays in single precision.
+#define GPTOSS_ACTIVATION_TYPE_F32 0
+#define GPTOSS_ACTIVATION_TYPE_F16 1
+
+// Top-K softmax runs as a single simdgroup, with up to 4 experts per thread.
+#define GPTOSS_TOPK_MAX_EXPERTS 128
+#define GPTOSS_MAX_ACTIVE_EXPERTS 8
+
+#define GPTOSS_MAX_STOP_TOKENS 32
+// Maximum number of candidate tokens kept by top-k / top-p sampling.
+#define GPTOSS_MAX_TOP_K 1024
+// Maximum number of most likely tokens reported with their log-probabilities for each generated token.
+#define GPTOSS_MAX_TOP_LOGPROBS 20
+
 struct gptoss_topk_args {
     uint32_t num_vecs_per_token;
 };
 
+// Maximum number of experts supported by the expert routing kernel.
+#define GPTOSS_EXPERT_ROUTE_MAX_EXPERTS 128
+
+struct gptoss_expert_route_args {
+    uint32_t num_experts;
+    uint32_t num_assignments;
+};
+
+struct gptoss_expert_usage_args {
+    uint32_t num_experts;
+    uint32_t num_assignments;
+};
+
+// Number of tokens in a page of the paged KV cache of full-attention blocks.
+#define GPTOSS_KVCACHE_PAGE_TOKENS 128
+
 struct gptoss_sdpa_args {
     uint32_t qkv_dim;
     uint32_t num_kv_tokens;
     uint32_t window;
+    // Number of token slots in the KV cache. Token t >= num_prefix_tokens is stored in slot
+    // (t - num_prefix_tokens) % kv_capacity.
+    uint32_t kv_capacity;
+    // If non-zero, the KV cache is paged instead: private token i = t - num_prefix_tokens is stored in slot
+    // page_table[i / GPTOSS_KVCACHE_PAGE_TOKENS] * GPTOSS_KVCACHE_PAGE_TOKENS + i % GPTOSS_KVCACHE_PAGE_TOKENS.
+    uint32_t paged;
+    // Number of leading tokens read from the shared prefix KV cache. Token t < num_prefix_tokens is stored in slot
+    // t % prefix_capacity of the prefix KV cache.
+    uint32_t num_prefix_tokens;
+    uint32_t prefix_capacity;
+    // If greater than 1, the attended KV range of every Q token is split into num_splits chunks of split_tokens tokens,
+    // each processed by a separate threadgroup. Instead of the final output, every threadgroup then writes a partial
+    // record of 8 Q heads x head_dim unnormalized outputs, followed by 8 running maxima and 8 running sums, which the
+    // SDPA reduction kernel combines. Partial records are indexed by (Q token, KV head, split).
+    uint32_t num_splits;
+    uint32_t split_tokens;
+};
+
+struct gptoss_sdpa_reduce_args {
+    uint32_t num_splits;
+};
+
+struct gptoss_kv_store_args {
+    // Distance between consecutive tokens in the input, in floats.
+    uint32_t token_stride;
+    uint32_t token_offset;
+    // Number of token slots in the KV cache. Token t is stored in slot t % kv_capacity.
+    uint32_t kv_capacity;
+    // If non-zero, the KV cache is paged instead: token t is stored in slot
+    // page_table[t / GPTOSS_KVCACHE_PAGE_TOKENS] * GPTOSS_KVCACHE_PAGE_TOKENS + t % GPTOSS_KVCACHE_PAGE_TOKENS.
+    uint32_t paged;
 };
 
 struct gptoss_u32_fill_random_args {
@@ -66,10 +145,33 @@ struct gptoss_matmul_args {
     uint32_t add;
 };
 
+struct gptoss_rmsnorm_matmul_args {
+    uint32_t num_column_vecs;
+    uint32_t num_rows;
+    float num_channels;
+    float epsilon;
+};
+
 struct gptoss_unembedding_args {
     uint32_t num_column_vecs;
     uint32_t num_rows_per_threadgroup;
     uint32_t num_rows;
+    // If non-zero, rows not allowed by the token mask of the current token automaton state (control->token_state) are
+    // skipped: their score is -INFINITY, and they are excluded from the argmax. Masks are bitsets of num_mask_words
+    // words per state.
+    uint32_t num_mask_words;
+};
+
+// Output tile of the dense (simdgroup matrix) matmul kernels: tokens x rows, and the column slice staged per step.
+#define GPTOSS_DENSE_MATMUL_TILE 32
+
+struct gptoss_dense_matmul_args {
+    uint32_t num_tokens;
+    uint32_t num_column_vecs;
+    uint32_t num_rows;
+    uint32_t add;
+    float num_channels;
+    float epsilon;
 };
 
 struct gptoss_moe_matmul_swiglu_args {
@@ -91,6 +193,17 @@ struct gptoss_moe_matmul_args {
     uint32_t output_expert_stride;  // in elements
 };
 
+struct gptoss_moe_dense_matmul_args {
+    uint32_t num_column_vecs;  // in blocks of 32 elements
+    uint32_t num_rows;  // weight rows
+    uint32_t num_active_experts;
+    uint32_t input_expert_stride;  // in elements
+    uint32_t weight_expert_stride;  // in bytes
+    uint32_t output_expert_stride;  // in elements
+    float swiglu_min;
+    float swiglu_max;
+};
+
 struct gptoss_rope_args {
     uint32_t token_stride;
     uint32_t token_offset;
@@ -101,6 +214,41 @@ struct gptoss_rope_args {
     float yarn_multiplier;
 };
 
+struct gptoss_rope_kv_store_args {
+    // Distance between consecutive tokens in the QKV activations, in pairs of floats.
+    uint32_t token_stride;
+    uint32_t token_offset;
+    float freq_scale;
+    float interpolation_scale;
+    float yarn_offset;
+    float yarn_scale;
+    float yarn_multiplier;
+    uint32_t num_q_heads;
+    // Position of the first token stored in the KV cache. K/V of earlier tokens are not stored, and token t is stored
+    // at position t - kv_token_offset of the KV cache.
+    uint32_t kv_token_offset;
+    // Number of token slots in the KV cache. Token at position i is stored in slot i % kv_capacity.
+    uint32_t kv_capacity;
+    // If non-zero, the KV cache is paged instead: token at position i is stored in slot
+    // page_table[i / GPTOSS_KVCACHE_PAGE_TOKENS] * GPTOSS_KVCACHE_PAGE_TOKENS + i % GPTOSS_KVCACHE_PAGE_TOKENS.
+    uint32_t paged;
+};
+
+struct gptoss_kv_rope_shift_args {
+    uint32_t token_offset;
+    // Number of positions to move the keys by (negative to move them towards the start of the sequence).
+    int32_t position_shift;
+    float freq_scale;
+    float interpolation_scale;
+    float yarn_offset;
+    float yarn_scale;
+    // Number of token slots in the KV cache. Token at position i is stored in slot i % kv_capacity.
+    uint32_t kv_capacity;
+    // If non-zero, the KV cache is paged instead: token at position i is stored in slot
+    // page_table[i / GPTOSS_KVCACHE_PAGE_TOKENS] * GPTOSS_KVCACHE_PAGE_TOKENS + i % GPTOSS_KVCACHE_PAGE_TOKENS.
+    uint32_t paged;
+};
+
 struct gptoss_softmax_args {
     uint32_t num_vecs;
     uint32_t num_vecs_per_threadgroup;
@@ -115,3 +263,36 @@ struct gptoss_sample_args {
     uint32_t num_dims;
     uint32_t num_dims_per_block;
 };
+
+struct gptoss_topk_sample_args {
+    uint64_t rng_seed;
+    uint32_t rng_offset;
+    uint32_t num_vecs;
+    // Number of candidates, between 1 and min(GPTOSS_MAX_TOP_K, num_vecs).
+    uint32_t top_k;
+    float top_p;
+    float temperature;
+};
+
+struct gptoss_gather_logprob_args {
+    uint32_t num_vecs;
+};
+
+struct gptoss_top_logprobs_args {
+    uint32_t num_vecs;
+    // Number of most likely tokens to report, between 1 and min(GPTOSS_MAX_TOP_LOGPROBS, num_vecs).
+    uint32_t num_top;
+};
+
+// Transition table of a token automaton: num_states + 1 row offsets into the num_transitions explicit transitions,
+// then num_states default next states, then the tokens and the next states of the explicit transitions. The tokens
+// of each state's row are sorted, and tokens without an explicit transition move to the state's default next state.
+struct gptoss_token_automaton_args {
+    uint32_t num_states;
+    uint32_t num_transitions;
+};
+
+struct gptoss_check_stop_tokens_args {
+    uint32_t num_stop_tokens;
+    uint32_t stop_tokens[GPTOSS_MAX_STOP_TOKENS];
+};
@@ -94,9 +94,15 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
     uint32_t num_channels,
     float epsilon);
 
+// The bf16-weight matmul and unembedding launchers switch to the dense (simdgroup matrix) kernel passed alongside the
+// simdgroup-per-row kernel once a launch covers at least this many tokens and the matrix dimensions are multiples of
+// GPTOSS_DENSE_MATMUL_TILE. The dense kernel may be NULL to always use the simdgroup-per-row kernel.
+#define GPTOSS_DENSE_MATMUL_MIN_TOKENS 16
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
+    const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -112,9 +118,32 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
     uint32_t num_cols,
     uint32_t num_rows);
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_matmul(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_bf16w_rmsnorm_matmul_fn,
+    const struct gptoss_metal_function* f32_bf16w_rmsnorm_dense_matmul_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* gain_buffer,
+    size_t gain_offset,
+    const struct gptoss_metal_buffer* weight_buffer,
+    size_t weight_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows,
+    float epsilon);
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
+    const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -130,9 +159,35 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_ad
     uint32_t num_cols,
     uint32_t num_rows);
 
+// If mask_buffer is not NULL, scores are restricted to the tokens allowed by the token mask of the current token
+// automaton state (see gptoss_unembedding_args), and the simdgroup-per-row kernel is always used.
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
+    const struct gptoss_metal_function* f32_bf16w_dense_unembedding_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* weight_buffer,
+    size_t weight_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* mask_buffer,
+    size_t mask_offset,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows);
+
+// Int8 unembedding weights: each row of num_cols int8 values is followed by its float scale. There is no dense variant,
+// so every batch size uses the simdgroup-per-row kernel.
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_i8w_unembedding(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_i8w_unembedding_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
     const struct gptoss_metal_buffer* input_buffer,
@@ -145,6 +200,8 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembeddi
     size_t argmax_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
+    const struct gptoss_metal_buffer* mask_buffer,
+    size_t mask_offset,
     uint32_t num_tokens,
     uint32_t num_cols,
     uint32_t num_rows);
@@ -198,6 +255,121 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
     uint32_t num_cols,
     uint32_t num_rows);
 
+// Computes the MoE output projection of num_active_experts experts for each of num_tokens tokens and adds the
+// score-weighted sum of the expert outputs to the num_tokens x num_rows output in place. Replaces
+// gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul followed by
+// gptoss_metal_command_buffer_encode_launch_f32_accumulate for the same arguments.
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_accumulate(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_matmul_accumulate_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows);
+
+// Groups the expert predictions of num_tokens tokens by expert for the grouped MoE matmuls below: writes
+// (num_experts + 1) uint32 group offsets to the expert offsets buffer and num_tokens * num_active_experts uint32
+// assignments (token * num_active_experts + slot) to the assignment buffer.
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_expert_route(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* expert_route_fn,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* expert_offsets_buffer,
+    size_t expert_offsets_offset,
+    const struct gptoss_metal_buffer* assignment_buffer,
+    size_t assignment_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts);
+
+// Adds the number of tokens routed to each expert among the predictions of num_tokens tokens to num_experts
+// cumulative uint32 counters in the usage buffer.
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_expert_usage(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* expert_usage_fn,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* usage_buffer,
+    size_t usage_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts);
+
+// Grouped (per-expert GEMM) equivalents of the MoE matmuls above, with identical output layouts.
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul_swiglu(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_dense_matmul_swiglu_fn,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_offsets_buffer,
+    size_t expert_offsets_offset,
+    const struct gptoss_metal_buffer* assignment_buffer,
+    size_t assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    float swiglu_limit,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_dense_matmul_fn,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_offsets_buffer,
+    size_t expert_offsets_offset,
+    const struct gptoss_metal_buffer* assignment_buffer,
+    size_t assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows);
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_rope_fn,
@@ -217,6 +389,68 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope(
     uint32_t attn_head_dim,
     uint32_t token_offset);
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_kv_store(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_kv_store_fn,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* kvcache_buffer,
+    size_t kvcache_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
+    uint32_t num_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t kv_capacity);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope_kv_store(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_rope_kv_store_fn,
+    const struct gptoss_metal_buffer* activations_buffer,
+    size_t activations_offset,
+    const struct gptoss_metal_buffer* kvcache_buffer,
+    size_t kvcache_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
+    float rope_base,
+    float interpolation_scale,
+    float yarn_offset,
+    float yarn_scale,
+    float yarn_multiplier,
+    uint32_t num_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t kv_token_offset,
+    uint32_t kv_capacity);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_kv_rope_shift(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* kv_rope_shift_fn,
+    const struct gptoss_metal_buffer* kvcache_buffer,
+    size_t kvcache_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
+    float rope_base,
+    float interpolation_scale,
+    float yarn_offset,
+    float yarn_scale,
+    uint32_t num_tokens,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    int32_t position_shift,
+    uint32_t kv_capacity);
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_accumulate_fn,
@@ -247,9 +481,21 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
     uint32_t num_experts,
     uint32_t num_active_experts);
 
+// The SDPA launcher splits the attended KV range of every Q token across up to GPTOSS_SDPA_MAX_SPLITS threadgroups, and
+// combines their partial results with the reduction kernel passed alongside the SDPA kernel, once a launch covers at
+// most GPTOSS_SDPA_SPLIT_MAX_TOKENS Q tokens and the range spans at least 2 * GPTOSS_SDPA_MIN_SPLIT_TOKENS tokens.
+// The partial buffer must hold GPTOSS_SDPA_PARTIAL_SIZE bytes. The reduction kernel may be NULL to never split.
+#define GPTOSS_SDPA_SPLIT_MAX_TOKENS 4
+#define GPTOSS_SDPA_MAX_SPLITS 32
+#define GPTOSS_SDPA_MIN_SPLIT_TOKENS 256
+#define GPTOSS_SDPA_PARTIAL_SIZE(num_kv_heads, head_dim) \
+    ((size_t) GPTOSS_SDPA_SPLIT_MAX_TOKENS * GPTOSS_SDPA_MAX_SPLITS * (num_kv_heads) * (8 * (head_dim) + 2 * 8) * sizeof(float))
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_sdpa_fn,
+    const struct gptoss_metal_function* f32_sdpa_reduce_fn,
+    size_t max_threadgroups,
     const struct gptoss_metal_buffer* q_buffer,
     size_t q_offset,
     const struct gptoss_metal_buffer* k_buffer,
@@ -260,9 +506,20 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
     size_t s_offset,
     const struct gptoss_metal_buffer* output_buffer,
     size_t output_offset,
+    const struct gptoss_metal_buffer* partial_buffer,
+    size_t partial_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
+    const struct gptoss_metal_buffer* prefix_k_buffer,
+    size_t prefix_k_offset,
+    const struct gptoss_metal_buffer* prefix_v_buffer,
+    size_t prefix_v_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
     uint32_t window,
+    uint32_t kv_capacity,
+    uint32_t num_prefix_tokens,
+    uint32_t prefix_capacity,
     uint32_t num_q_tokens,
     uint32_t num_kv_tokens,
     uint32_t num_q_heads,
@@ -308,6 +565,79 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample(
     uint32_t num_channels,
     uint32_t num_channels_per_block);
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk_sample(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_topk_sample_fn,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    uint32_t num_channels,
+    uint32_t top_k,
+    float top_p,
+    float temperature);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_top_logprobs(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_top_logprobs_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* top_token_buffer,
+    size_t top_token_offset,
+    const struct gptoss_metal_buffer* top_logprob_buffer,
+    size_t top_logprob_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_channels,
+    uint32_t num_tokens,
+    uint32_t num_top);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_gather_logprob(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_gather_logprob_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* logprob_buffer,
+    size_t logprob_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_channels,
+    uint32_t num_tokens);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_advance_token_automaton(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* u32_advance_token_automaton_fn,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* transition_buffer,
+    size_t transition_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_states,
+    uint32_t num_transitions);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_check_stop_tokens(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* u32_check_stop_tokens_fn,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <gpt-oss/types.h>
 
@@ -24,9 +25,25 @@ enum gptoss_status gptoss_metal_device_create_system_default(
 enum gptoss_status gptoss_metal_device_release(
     struct gptoss_metal_device* device);
 
+// Returns the total size of Metal memory currently allocated on the device by the process, in bytes.
+size_t gptoss_metal_device_get_allocated_size(
+    const struct gptoss_metal_device* device);
+
+// Writes the path of the per-device cache file "<prefix>-<device name>-<key>.bin" to path_out, creating the
+// cache directory if needed. Returns gptoss_status_unsupported_system if caching is disabled via an empty
+// GPTOSS_PIPELINE_CACHE_DIR, and gptoss_status_insufficient_memory if the path doesn't fit in path_size bytes.
+enum gptoss_status gptoss_metal_device_get_cache_path(
+    const struct gptoss_metal_device* device,
+    const char* prefix,
+    uint64_t key,
+    char* path_out,
+    size_t path_size);
+
 
 struct gptoss_metal_library {
     void* object; // id<MTLLibrary>
+    // Hash of the library binary, used to key the on-disk pipeline cache. 0 if unknown.
+    uint64_t hash;
 };
 
 enum gptoss_status gptoss_metal_library_create_default(
@@ -37,6 +54,8 @@ enum gptoss_status gptoss_metal_library_release(
     struct gptoss_metal_library* library);
 
 struct gptoss_metal_function {
+    // Name of the kernel function, as passed on creation. The string is not copied.
+    const char* name;
     void* function_object; // id<MTLFunction>
     void* pipeline_state_object; // id<MTLComputePipelineState>
     size_t max_threadgroup_threads;
@@ -49,6 +68,30 @@ enum gptoss_status gptoss_metal_function_create(
     const char* name,
     struct gptoss_metal_function* function_out);
 
+// Value of a uint function constant, identified by its [[function_constant(index)]] index.
+struct gptoss_metal_function_constant {
+    uint32_t index;
+    uint32_t value;
+};
+
+struct gptoss_metal_function_descriptor {
+    const char* name;
+    struct gptoss_metal_function* function_out;
+    // Function constants to specialize the function with. The array is not retained after creation.
+    size_t num_constants;
+    const struct gptoss_metal_function_constant* constants;
+};
+
+// Creates pipeline states for multiple functions concurrently.
+// Pipeline states are cached on disk in a Metal binary archive keyed by the device and the library hash, under the
+// directory specified in the GPTOSS_PIPELINE_CACHE_DIR environment variable (default: ~/Library/Caches/gpt-oss).
+// Set GPTOSS_PIPELINE_CACHE_DIR to an empty string to disable the cache. Pipeline states missing from the cache are
+// added to it on a background queue after the function returns.
+enum gptoss_status gptoss_metal_function_create_multiple(
+    const struct gptoss_metal_library* library,
+    size_t num_functions,
+    const struct gptoss_metal_function_descriptor* function_descriptors);
+
 enum gptoss_status gptoss_metal_function_release(
     struct gptoss_metal_function* function);
 
@@ -73,6 +116,81 @@ enum gptoss_status gptoss_metal_buffer_wrap(
 enum gptoss_status gptoss_metal_buffer_release(
     struct gptoss_metal_buffer* buffer);
 
+// Placement heap: buffers are created at explicit offsets and may alias each other.
+struct gptoss_metal_heap {
+    void* object; // id<MTLHeap>
+    size_t size;
+};
+
+// Alignment of buffer offsets within a heap, sufficient on all supported devices.
+#define GPTOSS_METAL_HEAP_ALIGNMENT 65536
+
+enum gptoss_status gptoss_metal_heap_create(
+    const struct gptoss_metal_device* device,
+    size_t size,
+    struct gptoss_metal_heap* heap_out);
+
+// Creates a buffer of the given size at a GPTOSS_METAL_HEAP_ALIGNMENT-aligned offset of the heap. Buffers created
+// from the same heap at overlapping offsets share memory. The buffer must be released before the heap.
+enum gptoss_status gptoss_metal_heap_create_buffer(
+    const struct gptoss_metal_heap* heap,
+    size_t offset,
+    size_t size,
+    struct gptoss_metal_buffer* buffer_out);
+
+enum gptoss_status gptoss_metal_heap_release(
+    struct gptoss_metal_heap* heap);
+
+// Set of buffers and heaps that Metal keeps resident for the command buffers using it, so that they don't need to be
+// made resident on each submission. Additions and removals take effect on commit. A zero-initialized residency set,
+// as left by a failed creation, ignores all operations, so callers may treat residency sets as an optimization.
+struct gptoss_metal_residency_set {
+    void* object; // id<MTLResidencySet>
+};
+
+// Returns gptoss_status_unsupported_system if the system doesn't support residency sets (before macOS 15).
+enum gptoss_status gptoss_metal_residency_set_create(
+    const struct gptoss_metal_device* device,
+    size_t initial_capacity,
+    struct gptoss_metal_residency_set* residency_set_out);
+
+void gptoss_metal_residency_set_add_buffer(
+    const struct gptoss_metal_residency_set* residency_set,
+    const struct gptoss_metal_buffer* buffer);
+
+void gptoss_metal_residency_set_add_heap(
+    const struct gptoss_metal_residency_set* residency_set,
+    const struct gptoss_metal_heap* heap);
+
+// The buffer may still be used by command buffers, which make it resident on submission.
+void gptoss_metal_residency_set_remove_buffer(
+    const struct gptoss_metal_residency_set* residency_set,
+    const struct gptoss_metal_buffer* buffer);
+
+// Applies the additions and removals since the last commit to the command buffers subsequently committed.
+void gptoss_metal_residency_set_commit(
+    const struct gptoss_metal_residency_set* residency_set);
+
+enum gptoss_status gptoss_metal_residency_set_release(
+    struct gptoss_metal_residency_set* residency_set);
+
+// Event shared between the CPU and the GPU: command buffers can wait until the CPU signals a value.
+struct gptoss_metal_shared_event {
+    void* object; // id<MTLSharedEvent>
+};
+
+enum gptoss_status gptoss_metal_shared_event_create(
+    const struct gptoss_metal_device* device,
+    struct gptoss_metal_shared_event* event_out);
+
+// Sets the signaled value of the event from the CPU. Values must not decrease.
+enum gptoss_status gptoss_metal_shared_event_signal(
+    const struct gptoss_metal_shared_event* event,
+    uint64_t value);
+
+enum gptoss_status gptoss_metal_shared_event_release(
+    struct gptoss_metal_shared_event* event);
+
 struct gptoss_metal_command_queue {
     void* object; // id<MTLCommandQueue>
 };
@@ -84,14 +202,62 @@ enum gptoss_status gptoss_metal_command_queue_create(
 enum gptoss_status gptoss_metal_command_queue_release(
     struct gptoss_metal_command_queue* command_queue);
 
+// Makes the allocations of the residency set resident for all command buffers subsequently committed to the queue.
+void gptoss_metal_command_queue_add_residency_set(
+    const struct gptoss_metal_command_queue* command_queue,
+    const struct gptoss_metal_residency_set* residency_set);
+
+void gptoss_metal_command_queue_remove_residency_set(
+    const struct gptoss_metal_command_queue* command_queue,
+    const struct gptoss_metal_residency_set* residency_set);
+
+// GPU execution time of a kernel launch, recorded by a command buffer with timing enabled.
+struct gptoss_metal_launch_timing {
+    const char* kernel_name;
+    // Tag of the command buffer at the time the kernel launch was encoded.
+    uint32_t tag;
+    double gpu_seconds;
+};
+
+// GPU timestamps sampled at the start and end of each kernel launch in a command buffer.
+struct gptoss_metal_command_buffer_timings {
+    void* sample_buffer_object; // id<MTLCounterSampleBuffer>
+    // CPU and GPU timestamps sampled together when timing was enabled, to convert GPU timestamps into seconds.
+    uint64_t cpu_timestamp;
+    uint64_t gpu_timestamp;
+    uint32_t tag;
+    size_t max_launches;
+    size_t num_launches;
+    // Number of kernel launches encoded after max_launches launches were recorded.
+    size_t num_untimed_launches;
+    struct gptoss_metal_launch_timing* launches;
+};
+
 struct gptoss_metal_command_buffer {
     void* object; // id<MTLCommandBuffer>
+    // Optional, see gptoss_metal_command_buffer_enable_timing.
+    struct gptoss_metal_command_buffer_timings* timings;
+    // Compute encoder shared by consecutive untimed kernel launches, or NULL. It is ended before any other command is
+    // encoded, on commit, and on release.
+    void* compute_encoder_object; // id<MTLComputeCommandEncoder>
+    // Whether the shared compute encoder dispatches concurrently, see gptoss_metal_command_buffer_enable_concurrent_dispatch.
+    bool concurrent_dispatch;
+    // Set by gptoss_metal_command_buffer_overlap_next_launch, and cleared by the next kernel launch.
+    bool overlap_next_launch;
+    // Number of dispatches in the shared compute encoder.
+    size_t num_encoder_dispatches;
 };
 
 enum gptoss_status gptoss_metal_command_buffer_create(
     const struct gptoss_metal_command_queue* command_queue,
     struct gptoss_metal_command_buffer* command_buffer_out);
 
+// Makes the allocations of the residency set resident while the command buffer executes. Per-submission cost doesn't
+// depend on the number of allocations in the set.
+void gptoss_metal_command_buffer_use_residency_set(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_residency_set* residency_set);
+
 enum gptoss_status gptoss_metal_command_buffer_encode_fill_buffer(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_buffer* buffer,
@@ -123,6 +289,12 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
     const size_t* device_buffer_offsets,
     size_t threadgroup_buffer_size);
 
+// Kernels encoded after the wait don't start until the event is signaled with a value of at least the given value.
+enum gptoss_status gptoss_metal_command_buffer_encode_wait_event(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_shared_event* event,
+    uint64_t value);
+
 enum gptoss_status gptoss_metal_command_buffer_commit(
     const struct gptoss_metal_command_buffer* command_buffer);
 
@@ -130,6 +302,49 @@ enum gptoss_status gptoss_metal_command_buffer_wait_completion(
     const struct gptoss_metal_command_buffer* command_buffer,
     double* elapsed_seconds);
 
+enum gptoss_status gptoss_metal_command_buffer_get_gpu_timestamps(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    double* gpu_start_time_out,
+    double* gpu_end_time_out);
+
+// Ends the compute encoder shared by the kernel launches encoded so far, so that the next launch opens a new one. The
+// encoder is ended as needed by the other commands, so this is only needed to measure the cost of an encoder per launch.
+void gptoss_metal_command_buffer_end_compute_encoder(
+    const struct gptoss_metal_command_buffer* command_buffer);
+
+// Makes kernel launches encoded into the command buffer afterwards share a compute encoder with concurrent dispatch.
+// Metal doesn't order the dispatches of a concurrent encoder, so each launch is preceded by a memory barrier over all
+// buffers, unless gptoss_metal_command_buffer_overlap_next_launch marks it as independent of the launches since the
+// last barrier. Fill, copy, and event wait commands, and timed launches, still get encoders of their own, which Metal
+// orders through hazard tracking of the buffers.
+void gptoss_metal_command_buffer_enable_concurrent_dispatch(
+    struct gptoss_metal_command_buffer* command_buffer);
+
+// Omits the memory barrier before the next kernel launch in concurrent dispatch mode: the caller guarantees that it
+// neither reads nor writes memory written by the launches encoded since the last barrier, nor writes memory they read.
+// Does nothing in serial dispatch mode.
+void gptoss_metal_command_buffer_overlap_next_launch(
+    const struct gptoss_metal_command_buffer* command_buffer);
+
+// Records the GPU execution time of up to max_launches kernel launches encoded into the command buffer afterwards.
+// Returns gptoss_status_unsupported_system if the device cannot sample timestamps at compute encoder boundaries.
+enum gptoss_status gptoss_metal_command_buffer_enable_timing(
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t max_launches);
+
+// Sets the tag recorded with subsequently encoded kernel launches. Does nothing if timing is not enabled.
+void gptoss_metal_command_buffer_set_timing_tag(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    uint32_t tag);
+
+// Resolves the GPU execution times of the kernel launches recorded in a completed command buffer. The returned array
+// remains valid until the command buffer is released.
+enum gptoss_status gptoss_metal_command_buffer_get_launch_timings(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_launch_timing** launches_out,
+    size_t* num_launches_out,
+    size_t* num_untimed_launches_out);
+
 enum gptoss_status gptoss_metal_command_buffer_release(
     struct gptoss_metal_command_buffer* command_buffer);
 
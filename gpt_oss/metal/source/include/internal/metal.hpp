@@ -112,6 +112,15 @@ public:
             "gptoss_metal_function_create");
     }
 
+    // Specializes the function with the given function constants
+    inline Function(const Library& library, const char* name,
+        std::initializer_list<gptoss_metal_function_constant> constants)
+    {
+        const gptoss_metal_function_descriptor descriptor{name, &function_, constants.size(), constants.begin()};
+        Check(gptoss_metal_function_create_multiple(library.handle(), 1, &descriptor),
+            "gptoss_metal_function_create_multiple");
+    }
+
     inline ~Function() {
         gptoss_metal_function_release(&function_);
     }
@@ -322,6 +331,18 @@ public:
             "gptoss_metal_command_buffer_encode_launch_u32_fill_random");
     }
 
+    inline void end_compute_encoder() {
+        gptoss_metal_command_buffer_end_compute_encoder(&command_buffer_);
+    }
+
+    inline void enable_concurrent_dispatch() {
+        gptoss_metal_command_buffer_enable_concurrent_dispatch(&command_buffer_);
+    }
+
+    inline void overlap_next_launch() {
+        gptoss_metal_command_buffer_overlap_next_launch(&command_buffer_);
+    }
+
     inline void commit() {
         Check(gptoss_metal_command_buffer_commit(&command_buffer_), "commit");
     }
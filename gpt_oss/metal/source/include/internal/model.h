@@ -7,8 +7,63 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <pthread.h>
+
+#include <gpt-oss/types.h>
+
+#include "internal/kernel-args.h"
 #include "internal/metal.h"
+#include "internal/regex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
+// Node of the byte-level prefix trie over text tokens. Children of a node form a singly-linked list of siblings.
+// Index 0 is never a valid child, so it doubles as the "no node" marker.
+struct gptoss_tokenizer_trie_node {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    // Text token ID terminating at this node, or UINT32_MAX if the prefix is not a complete token.
+    uint32_t token_id;
+    uint8_t byte;
+};
+
+// Words of up to this many bytes, encoded into up to this many tokens, are memoized in the tokenizer's word cache.
+#define GPTOSS_TOKENIZER_CACHE_MAX_WORD_BYTES 46
+#define GPTOSS_TOKENIZER_CACHE_MAX_WORD_TOKENS 12
+#define GPTOSS_TOKENIZER_CACHE_SHARDS 16
+#define GPTOSS_TOKENIZER_CACHE_SHARD_ENTRIES 1024
+#define GPTOSS_TOKENIZER_CACHE_SHARD_BUCKETS 2048
+
+// Texts of at least this many bytes are BPE-encoded by several threads, in chunks of about the given size.
+#define GPTOSS_TOKENIZER_PARALLEL_MIN_BYTES (64 * 1024)
+#define GPTOSS_TOKENIZER_PARALLEL_CHUNK_BYTES (16 * 1024)
+#define GPTOSS_TOKENIZER_ENCODER_THREADS 4
+
+struct gptoss_tokenizer_cache_entry {
+    uint64_t hash;
+    // Next entry in the same hash bucket, or UINT16_MAX.
+    uint16_t bucket_next;
+    // Neighbours in the least-recently-used list of the shard, or UINT16_MAX.
+    uint16_t lru_prev;
+    uint16_t lru_next;
+    uint8_t word_length;
+    uint8_t num_tokens;
+    char word[GPTOSS_TOKENIZER_CACHE_MAX_WORD_BYTES];
+    uint32_t tokens[GPTOSS_TOKENIZER_CACHE_MAX_WORD_TOKENS];
+};
+
+// Word cache shards are locked independently, so that threads encoding chunks of a document rarely contend.
+struct gptoss_tokenizer_cache_shard {
+    pthread_mutex_t mutex;
+    // Most and least recently used entries, or UINT16_MAX if the shard is empty.
+    uint16_t lru_head;
+    uint16_t lru_tail;
+    uint16_t num_entries;
+    uint16_t buckets[GPTOSS_TOKENIZER_CACHE_SHARD_BUCKETS];
+    struct gptoss_tokenizer_cache_entry entries[GPTOSS_TOKENIZER_CACHE_SHARD_ENTRIES];
+};
 
 struct gptoss_tokenizer {
 #ifndef __cplusplus
@@ -27,15 +82,215 @@ struct gptoss_tokenizer {
     uint32_t num_special_tokens;
 
     uint32_t special_token_id[gptoss_special_token_max - 1];
+
+    // Offset of each text token's length-prefixed record relative to tokens_ptr, built at model load time.
+    uint32_t* token_offsets;
+
+    // Prefix trie for longest-match encoding, built at model load time.
+    // The first byte is resolved through a direct table; deeper levels are stored in trie_nodes.
+    uint32_t trie_root_children[256];
+    struct gptoss_tokenizer_trie_node* trie_nodes;
+    size_t num_trie_nodes;
+
+    // Open-addressing hash table from token bytes to text token ID (UINT32_MAX marks empty slots), built at model load
+    // time. Text token IDs double as BPE merge ranks.
+    uint32_t* token_hash_table;
+    uint32_t token_hash_mask;
+
+    // Pre-tokenization regex. If it failed to compile, text is encoded by greedy longest-match instead.
+    struct gptoss_regex regex;
+
+    struct gptoss_tokenizer_cache_shard* cache_shards;
+};
+
+// FNV-1a hash of token bytes, shared by the token hash table and the word cache.
+static inline uint64_t gptoss_tokenizer_hash(const char* data, size_t size) {
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (uint64_t) (uint8_t) data[i]) * UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+#define GPTOSS_KVCACHE_TYPE_COUNT 3
+
+// Initial number of tokens per full-attention block in a KV cache pool. The pool doubles in size when it runs out of
+// pages.
+#define GPTOSS_KVCACHE_POOL_MIN_TOKENS 4096
+
+// Model-wide pool of KV cache pages. Each page stores GPTOSS_KVCACHE_PAGE_TOKENS tokens of one full-attention block,
+// in the same layout as a non-paged KV cache.
+struct gptoss_kvcache_pool {
+    struct gptoss_metal_buffer buffer;
+    // Size of a page in bytes.
+    size_t page_size;
+    size_t num_pages;
+    // Stack of free page indices.
+    uint32_t* free_pages;
+    size_t num_free_pages;
+};
+
+// Decay applied to the routing frequency score of an expert per update with any routing activity in its block.
+#define GPTOSS_EXPERT_USAGE_DECAY 0.98f
+// Factor by which a non-resident expert's score must exceed a resident expert's score for the two to swap residency.
+#define GPTOSS_EXPERT_RESIDENCY_HYSTERESIS 1.5f
+
+// Routing statistics of one MoE expert in one block, folded from the expert usage counters on the GPU.
+struct gptoss_expert_stats {
+    // Value of the expert's usage counter when it was last folded.
+    uint32_t last_usage;
+    // Total number of tokens routed to the expert.
+    uint64_t num_selections;
+};
+
+// Residency state of the weights of one MoE expert in one block.
+struct gptoss_expert_residency {
+    // Exponentially decayed number of tokens routed to the expert.
+    float score;
+    bool resident;
+    // Number of tokens routed to the expert while it was (hits) or was not (misses) resident.
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Lock-free counters of the work done by a context or, summed over all its contexts, by a model. Updated as command
+// buffers complete, and read by gptoss_model_get_stats and gptoss_context_get_stats from any thread.
+struct gptoss_runtime_counters {
+#ifndef __cplusplus
+    atomic_uint_least64_t num_prefill_tokens;
+    atomic_uint_least64_t num_decode_tokens;
+    atomic_uint_least64_t num_command_buffers;
+    // GPU execution time of completed command buffers.
+    atomic_uint_least64_t gpu_busy_nanoseconds;
+    // Time the CPU spent waiting for command buffers to complete.
+    atomic_uint_least64_t wait_nanoseconds;
+#else
+    uint_least64_t num_prefill_tokens;
+    uint_least64_t num_decode_tokens;
+    uint_least64_t num_command_buffers;
+    uint_least64_t gpu_busy_nanoseconds;
+    uint_least64_t wait_nanoseconds;
+#endif
+};
+
+// Number of command queues of a model. Contexts are assigned to the queues round-robin, so that contexts used from
+// different threads submit work independently and overlap on the GPU.
+#define GPTOSS_NUM_COMMAND_QUEUES 4
+
+// Kernels with a tunable threadgroup size. Each value indexes threadgroup_size of a model and of a launch profile.
+enum gptoss_launch_kernel {
+    gptoss_launch_kernel_embeddings = 0,
+    gptoss_launch_kernel_qkv = 1,
+    gptoss_launch_kernel_attn_out = 2,
+    gptoss_launch_kernel_gate = 3,
+    gptoss_launch_kernel_moe_swiglu = 4,
+    gptoss_launch_kernel_moe_out = 5,
+    gptoss_launch_kernel_accumulate = 6,
+    gptoss_launch_kernel_unembedding = 7,
+    gptoss_launch_kernel_softmax = 8,
+    gptoss_launch_kernel_top_logprobs = 9,
+};
+
+#define GPTOSS_LAUNCH_KERNEL_COUNT 10
+
+// Launch shapes with separately tuned threadgroup sizes: decoding a single token, where kernels are bound by weight
+// bandwidth, and processing a batch of prompt tokens, where the same weights are reused across the batch.
+enum gptoss_launch_shape {
+    gptoss_launch_shape_decode = 0,
+    gptoss_launch_shape_prefill = 1,
+};
+
+#define GPTOSS_LAUNCH_SHAPE_COUNT 2
+
+static inline enum gptoss_launch_shape gptoss_get_launch_shape(size_t num_tokens) {
+    return num_tokens > 1 ? gptoss_launch_shape_prefill : gptoss_launch_shape_decode;
+}
+
+// Default and maximum number of threadgroups per GPU core for kernels launched with a grid bounded by
+// max_threadgroups. The maximum also bounds the size of the per-threadgroup partial sums of a context.
+#define GPTOSS_DEFAULT_THREADGROUPS_PER_CORE 3
+#define GPTOSS_MAX_THREADGROUPS_PER_CORE 8
+// Upper bound on max_threadgroups, from the 1024 threads of the sampling kernel that reduces the softmax partial sums.
+#define GPTOSS_MAX_THREADGROUPS 1024
+
+// Launch parameters tuned for one device and model shape by gptoss_model_autotune, persisted in the device cache
+// directory.
+struct gptoss_launch_profile {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_threadgroups;
+    uint32_t threadgroup_size[GPTOSS_LAUNCH_SHAPE_COUNT][GPTOSS_LAUNCH_KERNEL_COUNT];
+};
+
+// Threads paging in the weight mapping in the background, and size of the chunks they claim in file order.
+#define GPTOSS_WEIGHT_LOADER_THREADS 4
+#define GPTOSS_WEIGHT_LOADER_CHUNK_SIZE (64 * 1024 * 1024)
+
+// Bytes hashed at each end of every weight region to fingerprint the weights of a model.
+#define GPTOSS_WEIGHTS_FINGERPRINT_SAMPLE_SIZE (16 * 1024)
+
+// Pages the weight mapping into memory (and locks it) from several threads. Chunks are claimed in file order, i.e.
+// embeddings, the expert-shared weights of all blocks, the unembedding, then the MoE weights of block 0, 1, ...
+// Weight regions (region 0: expert-shared weights, region 1 + n: MoE weights of block n) become ready once every chunk
+// up to the end of the region is paged in; the model's event is then signaled with the number of ready regions.
+struct gptoss_weight_loader {
+#ifndef __cplusplus
+    atomic_size_t next_chunk;
+    // Number of weight regions ready for use. SIZE_MAX if the model does not load weights in the background.
+    atomic_size_t num_ready_regions;
+    atomic_bool abort;
+    // Set if mlock failed for any chunk; such chunks are paged in but not locked.
+    atomic_bool lock_failed;
+    // Set if mlock succeeded for any chunk. Folded into the model's lock_memory when the loader stops.
+    atomic_bool lock_succeeded;
+#else
+    size_t next_chunk;
+    size_t num_ready_regions;
+    bool abort;
+    bool lock_failed;
+    bool lock_succeeded;
+#endif
+    pthread_t threads[GPTOSS_WEIGHT_LOADER_THREADS];
+    size_t num_threads;
+    // Duplicate of the model file descriptor for read-ahead hints, and offset of the weight mapping in the file.
+    int fd;
+    size_t file_offset;
+    size_t num_chunks;
+    size_t num_regions;
+    // End offset of each weight region in the mapping.
+    size_t* region_ends;
+    // Protects chunk_done and num_done_chunks; ready_cond is broadcast when num_ready_regions grows.
+    pthread_mutex_t mutex;
+    pthread_cond_t ready_cond;
+    bool* chunk_done;
+    // Length of the prefix of chunks that are all paged in.
+    size_t num_done_chunks;
+    struct gptoss_metal_shared_event event;
 };
 
 struct gptoss_model {
 #ifndef __cplusplus
     atomic_uint_least64_t ref_count;
+    // Index of the command queue for the next context, modulo GPTOSS_NUM_COMMAND_QUEUES.
+    atomic_uint_least32_t next_command_queue;
+    // Number of committed single-token decoding command buffers not yet retired, over all contexts. Prefill yields
+    // the GPU to them between batches.
+    atomic_uint_least32_t num_pending_decode_steps;
 #else
     uint_least64_t ref_count;
+    uint_least32_t next_command_queue;
+    uint_least32_t num_pending_decode_steps;
 #endif
 
+    struct gptoss_runtime_counters counters;
+
+    // Protects the free lists of the KV cache pools and the expert statistics and residency state, which are shared by
+    // all contexts.
+    pthread_mutex_t lock;
+    // Held for reading while a command buffer that may reference a KV cache pool buffer is encoded, or while the CPU
+    // accesses pool memory, and for writing while a pool buffer is replaced. Acquired before lock.
+    pthread_rwlock_t kvcache_pool_lock;
+
     struct gptoss_tokenizer* tokenizer;
 
     void* mapping_ptr;
@@ -47,6 +302,10 @@ struct gptoss_model {
     uint32_t num_active_experts;
     uint32_t embedding_dim;
     uint32_t mlp_dim;
+    // Layout of MXFP4 expert weights, one of GPTOSS_EXPERT_WEIGHT_LAYOUT_*
+    uint32_t expert_weight_layout;
+    // Whether the unembedding is stored as int8 with per-row scales rather than bf16
+    bool i8_unembedding;
     float swiglu_limit;
     uint32_t head_dim;
     uint32_t num_heads;
@@ -65,29 +324,96 @@ struct gptoss_model {
     // Once the batch size is reached, we process it to fill the KV cache.
     size_t max_batch_tokens;
 
+    // Whether mlock succeeded for any part of the weight mapping, which then must be unlocked on release.
     bool lock_memory;
 
+    // Whether only max_resident_experts experts per block are kept resident in memory, chosen by routing frequency.
+    bool manage_expert_residency;
+    uint32_t max_resident_experts;
+    // Whether mlock failed for an expert, which is then left out of the resident set. Only the first failure is logged.
+    bool expert_lock_failed;
+    // num_blocks * num_experts cumulative uint32 counters of tokens routed to each expert, updated on the GPU if the
+    // model manages expert residency or count_expert_usage is set. The counters wrap around, so their increments are
+    // folded into expert_stats after every command buffer if the model manages expert residency, and otherwise
+    // whenever the statistics are queried.
+    struct gptoss_metal_buffer expert_usage_buffer;
+    // Set between gptoss_model_start_expert_stats and gptoss_model_stop_expert_stats.
+#ifndef __cplusplus
+    atomic_bool count_expert_usage;
+#else
+    bool count_expert_usage;
+#endif
+    // num_blocks * num_experts routing statistics, in the same order as the usage counters.
+    struct gptoss_expert_stats* expert_stats;
+    // num_blocks * num_experts residency states, in the same order as the usage counters, or NULL if the model does
+    // not manage expert residency.
+    struct gptoss_expert_residency* expert_residency;
+
     size_t weights_size;
     size_t allocation_size;
+    // Hash of the model header and of samples of the weights, which identifies the model in saved contexts.
+    uint64_t weights_fingerprint;
+
+    // Breakdown of gptoss_model_create_from_file time: file mapping, wrapping of weights into Metal buffers, Metal
+    // pipeline state creation (which overlaps with the background weight loader), and the remaining wait for the
+    // weight loader (zero for lazily loaded models).
+    double load_mapping_seconds;
+    double load_buffer_seconds;
+    double load_pipeline_seconds;
+    double load_wait_seconds;
+
+    struct gptoss_weight_loader weight_loader;
 
     // Metal objects
     struct gptoss_metal_device device;
+    // Number of threadgroups for kernels with a grid bounded by the device size, at most max_threadgroups_limit.
     size_t max_threadgroups;
-    struct gptoss_metal_command_queue command_queue;
+    size_t max_threadgroups_limit;
+    // Threadgroup size of each kernel in enum gptoss_launch_kernel for each enum gptoss_launch_shape, from the launch
+    // profile of the device.
+    uint32_t threadgroup_size[GPTOSS_LAUNCH_SHAPE_COUNT][GPTOSS_LAUNCH_KERNEL_COUNT];
+    struct gptoss_metal_command_queue command_queues[GPTOSS_NUM_COMMAND_QUEUES];
+    // Weights, expert usage counters, and KV cache pool buffers, attached to all command queues. Empty if the system
+    // doesn't support residency sets.
+    struct gptoss_metal_residency_set residency_set;
     struct gptoss_metal_library library;
     struct gptoss_metal_function bf16_f32_embeddings_fn;
     struct gptoss_metal_function f32_bf16w_rmsnorm_fn;
     struct gptoss_metal_function f32_bf16w_matmul_fn;
+    struct gptoss_metal_function f32_bf16w_rmsnorm_matmul_fn;
     struct gptoss_metal_function f32_bf16w_unembedding_fn;
-    struct gptoss_metal_function f32_rope_fn;
+    struct gptoss_metal_function f32_bf16w_dense_matmul_fn;
+    struct gptoss_metal_function f32_bf16w_rmsnorm_dense_matmul_fn;
+    struct gptoss_metal_function f32_bf16w_dense_unembedding_fn;
+    struct gptoss_metal_function f32_i8w_unembedding_fn;
     struct gptoss_metal_function f32_mf4w_moe_matmul_swiglu_fn;
-    struct gptoss_metal_function f32_mf4w_moe_matmul_fn;
-    struct gptoss_metal_function f32_accumulate_e4_fn;
-    struct gptoss_metal_function f32_topk_softmax_e32_k4_fn;
-    struct gptoss_metal_function f32_topk_softmax_e128_k4_fn;
+    struct gptoss_metal_function f32_mf4w_moe_matmul_accumulate_fn;
+    struct gptoss_metal_function expert_route_fn;
+    struct gptoss_metal_function expert_usage_fn;
+    struct gptoss_metal_function f32_mf4w_moe_dense_matmul_swiglu_fn;
+    struct gptoss_metal_function f32_mf4w_moe_dense_matmul_fn;
+    // Variants of the grouped MoE kernels with half-precision SwiGLU activations
+    struct gptoss_metal_function f16_mf4w_moe_dense_matmul_swiglu_fn;
+    struct gptoss_metal_function f16_mf4w_moe_dense_matmul_fn;
+    struct gptoss_metal_function f32_accumulate_fn;
+    struct gptoss_metal_function f32_topk_softmax_fn;
+    struct gptoss_metal_function f32_rope_kv_store_fn;
+    struct gptoss_metal_function f32_rope_bf16kv_store_fn;
+    struct gptoss_metal_function f32_rope_i8kv_store_fn;
+    struct gptoss_metal_function kv_rope_shift_fn;
+    struct gptoss_metal_function bf16kv_rope_shift_fn;
+    struct gptoss_metal_function i8kv_rope_shift_fn;
     struct gptoss_metal_function f32_sdpa_q8_d64_fn;
+    struct gptoss_metal_function f32_bf16kv_sdpa_q8_d64_fn;
+    struct gptoss_metal_function f32_i8kv_sdpa_q8_d64_fn;
+    struct gptoss_metal_function f32_sdpa_reduce_q8_d64_fn;
     struct gptoss_metal_function f32_softmax_fn;
     struct gptoss_metal_function f32_sample_fn;
+    struct gptoss_metal_function f32_topk_sample_fn;
+    struct gptoss_metal_function f32_gather_logprob_fn;
+    struct gptoss_metal_function f32_top_logprobs_fn;
+    struct gptoss_metal_function u32_check_stop_tokens_fn;
+    struct gptoss_metal_function u32_advance_token_automaton_fn;
 
     size_t per_block_shared_weights_size;
     size_t per_expert_block_weight_size;
@@ -109,6 +435,9 @@ struct gptoss_model {
     size_t rmsnorm_weight_offset;
     size_t unembedding_weight_offset;
 
+    // Pools of KV cache pages for full-attention blocks, one per KV cache storage format.
+    struct gptoss_kvcache_pool kvcache_pools[GPTOSS_KVCACHE_TYPE_COUNT];
+
     // Buffer with non-MoE weights. Includes MoE gates, embeddings/unembeddings.
     struct gptoss_metal_buffer shared_weight_buffer;
     // num_blocks per-block buffers with MoE weights to follow.
@@ -117,6 +446,73 @@ struct gptoss_model {
 
 #define GPTOSS_DEFAULT_BATCH_SIZE 128
 
+// Minimum number of tokens in a batch for the MoE MLP to run as per-expert grouped matmuls rather than per-token.
+#define GPTOSS_MOE_GROUPED_MIN_TOKENS 32
+
+// Maximum number of kernel launches timed per command buffer while profiling a context.
+#define GPTOSS_PROFILE_MAX_LAUNCHES 2048
+
+// Block index of kernel launches outside of transformer blocks in a context profile.
+#define GPTOSS_PROFILE_NO_BLOCK UINT32_MAX
+
+// Accumulated GPU time of the launches of one kernel in one transformer block.
+struct gptoss_profile_entry {
+    const char* kernel_name;
+    uint32_t block;
+    uint64_t num_launches;
+    double gpu_seconds;
+};
+
+// Maximum number of decoding steps in flight while streaming tokens.
+#define GPTOSS_STREAM_DEPTH 2
+
+// A streaming context that runs out of room evicts at least 1/GPTOSS_STREAMING_EVICT_DIVISOR of its tokens after the
+// attention sinks, so that re-rotating the keys of the remaining tokens is amortized over many new tokens.
+#define GPTOSS_STREAMING_EVICT_DIVISOR 4
+
+// State of a streaming sampling session started with gptoss_context_stream_begin.
+struct gptoss_context_stream {
+    bool active;
+    float temperature;
+    uint64_t seed;
+    size_t num_stop_tokens;
+    uint32_t stop_tokens[GPTOSS_MAX_STOP_TOKENS];
+    // Number of tokens in the context when the stream began.
+    size_t num_original_tokens;
+    // State of the token automaton (if any) when the stream began. Steps in flight advance the state on the GPU, so
+    // finishing the stream recomputes it from the delivered tokens.
+    uint32_t original_token_state;
+    // Number of generated tokens returned by gptoss_context_stream_next.
+    size_t num_delivered_tokens;
+    // Number of decoding steps not yet submitted to the GPU.
+    size_t num_remaining_steps;
+    // Ring of committed command buffers, one per decoding step, oldest at next_command_buffer.
+    struct gptoss_metal_command_buffer command_buffers[GPTOSS_STREAM_DEPTH];
+    size_t num_inflight_steps;
+    size_t next_command_buffer;
+};
+
+// Read-only snapshot of the KV cache for the first num_tokens tokens of a context, shared by the contexts created
+// from it with gptoss_context_create_from_prefix.
+struct gptoss_prefix {
+#ifndef __cplusplus
+    atomic_uint_least64_t ref_count;
+#else
+    uint_least64_t ref_count;
+#endif
+
+    struct gptoss_model* model;
+    size_t num_tokens;
+    uint32_t* tokens;
+    // Storage format of the KV cache snapshot.
+    enum gptoss_kvcache_type kvcache_type;
+    // Number of token slots in the snapshot of each sliding-window attention block: the ring buffer of the source
+    // context is copied verbatim, so token t is stored in slot t % num_window_kv_slots. Full-attention blocks store
+    // all num_tokens tokens.
+    size_t num_window_kv_slots;
+    struct gptoss_metal_buffer kvcache_buffer;
+};
+
 struct gptoss_context {
 #ifndef __cplusplus
     atomic_uint_least64_t ref_count;
@@ -125,33 +521,196 @@ struct gptoss_context {
 #endif
 
     struct gptoss_model* model;
+    // One of the model's command queues, used for all work on the context.
+    const struct gptoss_metal_command_queue* command_queue;
+    // Activation heap, KV cache (including the prefix KV cache), and input/output buffers of the context, used by all
+    // of its command buffers. Empty if the system doesn't support residency sets.
+    struct gptoss_metal_residency_set residency_set;
+    // Whether a command buffer of the context is being encoded, with a read lock on the model's kvcache_pool_lock.
+    bool encoding;
     // Number of tokens processed in the context.
     size_t num_tokens;
-    // Number of tokens in the KV cache.
+    // Number of tokens in the KV cache. Atomic, like num_kv_pages and allocation_size, so that
+    // gptoss_context_get_stats may read it while the context is in use on another thread.
+#ifndef __cplusplus
+    atomic_size_t num_kv_tokens;
+#else
     size_t num_kv_tokens;
+#endif
     // Length of the context.
     size_t max_tokens;
+    // Number of token slots in the KV cache of each sliding-window attention block.
+    // KV cache of sliding-window blocks is a ring buffer in kvcache_buffer, while full-attention blocks store their
+    // KV cache in pages drawn from the model's KV cache pool as the context grows.
+    size_t num_window_kv_slots;
+    // One past the highest token position written to the KV cache.
+    size_t kvcache_watermark;
+    // Storage format of the KV cache.
+    enum gptoss_kvcache_type kvcache_type;
+    // Page table of full-attention blocks: for the i-th full-attention block, max_kv_pages page indices in the model's
+    // KV cache pool, of which the first num_kv_pages are allocated.
+    struct gptoss_metal_buffer kvcache_page_table_buffer;
+    size_t max_kv_pages;
+#ifndef __cplusplus
+    atomic_size_t num_kv_pages;
+#else
+    size_t num_kv_pages;
+#endif
+    // Shared KV cache of the first num_prefix_tokens tokens, or NULL if the context was not created from a prefix.
+    // The private KV cache stores token t >= num_prefix_tokens at position t - num_prefix_tokens, and full-attention
+    // blocks have only max_tokens - num_prefix_tokens private slots.
+    struct gptoss_prefix* prefix;
+    size_t num_prefix_tokens;
+    // Number of leading tokens a streaming context keeps when it evicts tokens to make room, or 0 if the context does
+    // not evict tokens. See gptoss_context_create_streaming.
+    size_t num_sink_tokens;
+
+    // Truncation of the sampling distribution: top_k = 0 disables top-k truncation, and top_p = 1 disables top-p
+    // truncation. Set with gptoss_context_set_sampling_params.
+    uint32_t top_k;
+    float top_p;
+
+    // Storage format of the MoE activations in batches processed by the grouped MoE kernels. Set with
+    // gptoss_context_set_prefill_activation_type.
+    enum gptoss_activation_type prefill_activation_type;
+
+    // Token automaton constraining sampling, set with gptoss_context_set_token_automaton; num_token_states is 0 if
+    // sampling is unconstrained. The current state is kept in control->token_state on the GPU, and returns to
+    // initial_token_state when the context is reset.
+    uint32_t num_token_states;
+    uint32_t num_token_transitions;
+    uint32_t initial_token_state;
+    struct gptoss_metal_buffer token_mask_buffer;  // allow mask bitsets, one per state
+    struct gptoss_metal_buffer token_transition_buffer;  // transition table, see gptoss_token_automaton_args
+
+    // GPU timestamps (in seconds) of the command buffers submitted by the last prefill, for profiling.
+    // gpu_busy_time sums the execution time of individual command buffers; when CPU encoding overlaps GPU
+    // execution, it approaches gpu_end_time - gpu_start_time.
+    double gpu_start_time;
+    double gpu_end_time;
+    double gpu_busy_time;
+
+    // Per-kernel, per-block GPU time profile, collected while profiling is enabled with gptoss_context_start_profiling.
+    bool profiling;
+    struct gptoss_profile_entry* profile_entries;
+    size_t num_profile_entries;
+    size_t max_profile_entries;
+    // Number of kernel launches not timed because a command buffer exceeded GPTOSS_PROFILE_MAX_LAUNCHES launches.
+    uint64_t num_untimed_launches;
+
+    struct gptoss_context_stream stream;
+
+    struct gptoss_runtime_counters counters;
 
     size_t kvcache_size;
+#ifndef __cplusplus
+    atomic_size_t allocation_size;
+#else
     size_t allocation_size;
+#endif
 
-    // Activation buffers.
-    // TODO: merge into a single buffer.
+    // Activation buffers, placed in a single heap. Buffers that are never live at the same time within a block share
+    // memory: QKV with MoE output, SDPA with RMSNorm output, and MoE gating with SwiGLU output.
+    struct gptoss_metal_heap activation_heap;
     struct gptoss_metal_buffer residual_activation_buffer;  // Residual stream
     struct gptoss_metal_buffer rmsnorm_activation_buffer;  // Both attention & MLP RMSNorm output
     struct gptoss_metal_buffer qkv_activation_buffer;  // QKV projection output
     struct gptoss_metal_buffer sdpa_activation_buffer;  // SDPA output
+    struct gptoss_metal_buffer sdpa_partial_buffer;  // SDPA partial results of KV range splits
     struct gptoss_metal_buffer gate_activation_buffer;  // MoE gating output
     struct gptoss_metal_buffer expert_activation_buffer;  // MoE expert predictions
+    struct gptoss_metal_buffer expert_route_buffer;  // MoE expert group offsets, followed by assignments grouped by expert
     struct gptoss_metal_buffer swiglu_activation_buffer;  // MLP+SwiGLU output
-    struct gptoss_metal_buffer moe_activation_buffer;  // MoE MLP output (per-active expert)
+    struct gptoss_metal_buffer moe_activation_buffer;  // MoE MLP output (per-active expert) of the grouped MoE kernels
 
     // Input/output buffers.
     struct gptoss_metal_buffer control_buffer;
     struct gptoss_metal_buffer token_buffer;  // uint32 token IDs
+    // Most likely tokens of each step of gptoss_context_sample_with_top_logprobs: the token IDs of all steps, followed
+    // by their log-probabilities. Allocated on first use.
+    struct gptoss_metal_buffer top_logprob_buffer;
+    // Score and prob buffers hold num_output_rows rows of vocabulary_size floats, and grow on demand up to
+    // max_batch_tokens rows.
+    size_t num_output_rows;
     struct gptoss_metal_buffer score_buffer;  // unembedding outputs
     struct gptoss_metal_buffer prob_buffer;
     struct gptoss_metal_buffer sum_buffer;
     struct gptoss_metal_buffer argmax_buffer;
     struct gptoss_metal_buffer kvcache_buffer;
 };
+
+// Updates which MoE experts are resident in memory from the expert usage counters. Must be called only after command
+// buffers that update the counters have completed. Does nothing unless the model manages expert residency.
+void gptoss_model_update_expert_residency(struct gptoss_model* model);
+
+// Initializes the launch parameters of the model to their defaults, then overrides them with the launch profile saved
+// by gptoss_model_autotune for the device and model shape, if there is a valid one.
+void gptoss_model_load_launch_profile(struct gptoss_model* model);
+
+// Encodes text into text tokens with the pre-tokenization regex and BPE merges of the tokenizer. On success, stores a
+// malloc-allocated array of tokens in tokens_out; the caller is responsible for freeing it.
+enum gptoss_status gptoss_tokenizer_encode_text(
+    const struct gptoss_tokenizer* tokenizer,
+    const char* text,
+    size_t text_length,
+    uint32_t** tokens_out,
+    size_t* num_tokens_out);
+
+// Generation request of a scheduler, holding a reference to its context.
+struct gptoss_scheduler_request {
+    uint64_t id;
+    struct gptoss_context* context;
+    float temperature;
+    uint64_t seed;
+    size_t max_tokens;
+    size_t num_generated_tokens;
+    size_t num_stop_tokens;
+    uint32_t* stop_tokens;
+};
+
+struct gptoss_scheduler {
+#ifndef __cplusplus
+    atomic_uint_least64_t ref_count;
+#else
+    uint_least64_t ref_count;
+#endif
+
+    struct gptoss_model* model;
+    // Maximum number of tokens processed in one step, at most the maximum batch size of the model.
+    size_t max_batch_tokens;
+    // Requests in submission order. The first min(num_requests, max_batch_tokens) requests are admitted: each of them
+    // either prefills a chunk of its prompt or decodes a token in every step.
+    struct gptoss_scheduler_request* requests;
+    size_t num_requests;
+    size_t max_requests;
+    uint64_t next_request_id;
+
+    // Scratch arrays of max_batch_tokens elements for assembling a step.
+    struct gptoss_context** prefill_contexts;
+    size_t* num_prefill_tokens;
+    struct gptoss_context** sample_contexts;
+    size_t* sample_requests;
+    float* temperatures;
+    uint64_t* seeds;
+    uint32_t* sampled_tokens;
+};
+
+// Processes one continuous-batching step over contexts of the same model in a single pass: the next
+// num_prefill_tokens[i] tokens of prefill_contexts[i] after its KV cache are pre-filled, then one token is sampled for
+// each of sample_contexts, with temperatures[i] and seeds[i], stored in tokens_out[i], and appended to the context.
+// Prefill chunks must leave at least the last token of their context unprocessed, and a context may appear among both
+// prefill and sample contexts only if its prefill chunk ends right before its last token. The total number of tokens
+// must not exceed the maximum batch size of the model.
+enum gptoss_status gptoss_context_batch_step(
+    size_t num_prefill_contexts,
+    const gptoss_context_t* prefill_contexts,
+    const size_t* num_prefill_tokens,
+    size_t num_sample_contexts,
+    const gptoss_context_t* sample_contexts,
+    const float* temperatures,
+    const uint64_t* seeds,
+    uint32_t* tokens_out);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
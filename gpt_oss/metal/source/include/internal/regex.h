@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <gpt-oss/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gptoss_regex {
+    void* object; // NSRegularExpression*
+};
+
+// Compiles a regular expression in ICU syntax. The pattern is a NUL-terminated UTF-8 string.
+enum gptoss_status gptoss_regex_create(
+    const char* pattern,
+    struct gptoss_regex* regex_out);
+
+// Splits UTF-8 text into pieces at the boundaries of non-overlapping regex matches. Text between matches forms
+// pieces of its own, so the pieces always cover the whole text.
+// On success, stores a malloc-allocated array with the end offset (in bytes) of each piece in piece_ends_out. The
+// caller is responsible for freeing it.
+// Returns gptoss_status_invalid_argument if the text is not valid UTF-8.
+enum gptoss_status gptoss_regex_split(
+    const struct gptoss_regex* regex,
+    const char* text,
+    size_t text_length,
+    size_t** piece_ends_out,
+    size_t* num_pieces_out);
+
+enum gptoss_status gptoss_regex_release(
+    struct gptoss_regex* regex);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
@@ -34,3 +34,23 @@ struct gptoss_tiktoken_tokenizer_header {
     uint32_t regex_size;
     uint32_t tokens_size;
 };
+
+// Header of a Context saved with gptoss_context_save. It is followed by num_tokens uint32 token IDs and the KV cache
+// of each block in order: the last num_window_kv_tokens tokens before num_kv_tokens for sliding-window blocks, and
+// all num_kv_tokens tokens for full-attention blocks, with one row of K and V heads per token.
+struct gptoss_context_file_header {
+    char magic[12];
+    uint32_t version;
+    uint32_t kvcache_type;
+    uint32_t num_blocks;
+    uint32_t num_kv_heads;
+    uint32_t head_dim;
+    uint32_t attention_window;
+    uint32_t vocabulary_size;
+    uint64_t weights_fingerprint;
+    uint64_t num_tokens;
+    uint64_t num_kv_tokens;
+    uint64_t num_window_kv_tokens;
+};
+
+#define GPTOSS_CONTEXT_FILE_VERSION 2
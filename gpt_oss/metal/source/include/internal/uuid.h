@@ -32,6 +32,30 @@ static inline bool gptoss_is_applegpu_layout_uuid(const struct gptoss_uuid* uuid
         sizeof(struct gptoss_uuid)) == 0;
 }
 
+static inline bool gptoss_is_applegpu_tiled_layout_uuid(const struct gptoss_uuid* uuid) {
+    return memcmp(
+        &(struct gptoss_uuid) {0x6B, 0x3E, 0x0C, 0x51, 0xD2, 0x47, 0x4A, 0x9F, 0x8E, 0x15, 0x3A, 0xC4, 0x72, 0x9D, 0xB0, 0x18},
+        uuid,
+        sizeof(struct gptoss_uuid)) == 0;
+}
+
+// Variants of the two layouts above with an int8 unembedding. For gpt-oss-20b this halves the unembedding read on
+// every decoded token from 1.16 GB to 0.58 GB. The QKV and attention output weights stay bf16, and at 1.27 GB per
+// token over all blocks remain the largest dense weight read, next to about 1.3 GB of MXFP4 weights of active experts.
+static inline bool gptoss_is_applegpu_i8_unembedding_layout_uuid(const struct gptoss_uuid* uuid) {
+    return memcmp(
+        &(struct gptoss_uuid) {0x3C, 0x85, 0x1F, 0x2A, 0x90, 0x6D, 0x4E, 0x31, 0xB7, 0x4A, 0x0E, 0xD2, 0x58, 0xC9, 0x16, 0x7B},
+        uuid,
+        sizeof(struct gptoss_uuid)) == 0;
+}
+
+static inline bool gptoss_is_applegpu_tiled_i8_unembedding_layout_uuid(const struct gptoss_uuid* uuid) {
+    return memcmp(
+        &(struct gptoss_uuid) {0xA4, 0x07, 0xE9, 0x63, 0x5B, 0x12, 0x47, 0xC8, 0x9D, 0x2F, 0x81, 0x4B, 0xE6, 0x30, 0xD5, 0x9A},
+        uuid,
+        sizeof(struct gptoss_uuid)) == 0;
+}
+
 static inline bool gptoss_is_tiktoken_tokenizer_uuid(const struct gptoss_uuid* uuid) {
     return memcmp(
         &(struct gptoss_uuid) {0x74, 0x01, 0xAD, 0xED, 0x2A, 0x95, 0x40, 0xCB, 0xB7, 0x82, 0x9C, 0xCE, 0xBA, 0xAF, 0xE7, 0x2B},
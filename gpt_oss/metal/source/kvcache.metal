@@ -0,0 +1,325 @@
+#include <metal_common>
+#include <metal_compute>
+#include <metal_integer>
+#include <metal_math>
+#include <metal_simdgroup>
+
+#include <internal/kernel-args.h>
+
+#pragma METAL fp math_mode(safe)
+#pragma METAL fp contract(off)
+
+
+static inline uint gptoss_kv_slot(
+    uint kv_capacity,
+    uint paged,
+    const device uint* page_table,
+    uint i)
+{
+    if (paged != 0) {
+        return page_table[i / GPTOSS_KVCACHE_PAGE_TOKENS] * GPTOSS_KVCACHE_PAGE_TOKENS + i % GPTOSS_KVCACHE_PAGE_TOKENS;
+    } else {
+        return i % kv_capacity;
+    }
+}
+
+// Each simdgroup stores one K or V head (64 elements) of one token into the KV cache slot of the token.
+// Each thread handles 2 head elements.
+// Threadgroup grid: (2 * num_kv_heads, num_tokens).
+
+kernel void gptoss_f32_kv_store(
+    constant gptoss_kv_store_args& args [[ buffer(0) ]],
+    const device float* input [[ buffer(1) ]],
+    device float* kvcache [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    const device uint* page_table [[ buffer(4) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    const uint head_dim = 64;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint slot = gptoss_kv_slot(args.kv_capacity, args.paged, page_table, args.token_offset + gid.y);
+    const float2 val = reinterpret_cast<const device float2*>(input + gid.y * args.token_stride + gid.x * head_dim)[simdgroup_tid];
+
+    device float* head = kvcache + (slot * num_threadgroups.x + gid.x) * head_dim;
+    reinterpret_cast<device float2*>(head)[simdgroup_tid] = val;
+}
+
+kernel void gptoss_f32_bf16kv_store(
+    constant gptoss_kv_store_args& args [[ buffer(0) ]],
+    const device float* input [[ buffer(1) ]],
+    device bfloat* kvcache [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    const device uint* page_table [[ buffer(4) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    const uint head_dim = 64;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint slot = gptoss_kv_slot(args.kv_capacity, args.paged, page_table, args.token_offset + gid.y);
+    const float2 val = reinterpret_cast<const device float2*>(input + gid.y * args.token_stride + gid.x * head_dim)[simdgroup_tid];
+
+    device bfloat* head = kvcache + (slot * num_threadgroups.x + gid.x) * head_dim;
+    reinterpret_cast<device bfloat2*>(head)[simdgroup_tid] = static_cast<bfloat2>(val);
+}
+
+// Each head is stored as 64 int8 values followed by a float scale, with symmetric quantization by the head's max-abs.
+kernel void gptoss_f32_i8kv_store(
+    constant gptoss_kv_store_args& args [[ buffer(0) ]],
+    const device float* input [[ buffer(1) ]],
+    device uchar* kvcache [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    const device uint* page_table [[ buffer(4) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    const uint head_dim = 64;
+    const uint head_size = head_dim * sizeof(char) + sizeof(float);
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint slot = gptoss_kv_slot(args.kv_capacity, args.paged, page_table, args.token_offset + gid.y);
+    const float2 val = reinterpret_cast<const device float2*>(input + gid.y * args.token_stride + gid.x * head_dim)[simdgroup_tid];
+
+    const float max_abs = metal::simd_max(metal::max(metal::abs(val.x), metal::abs(val.y)));
+    const float scale = max_abs * (1.0f / 127.0f);
+    const float inv_scale = max_abs != 0.0f ? 127.0f / max_abs : 0.0f;
+    const float2 qval = metal::clamp(metal::rint(val * inv_scale), -127.0f, 127.0f);
+
+    device uchar* head = kvcache + (slot * num_threadgroups.x + gid.x) * head_size;
+    reinterpret_cast<device char2*>(head)[simdgroup_tid] = static_cast<char2>(qval);
+    if (metal::simd_is_first()) {
+        *reinterpret_cast<device float*>(head + head_dim * sizeof(char)) = scale;
+    }
+}
+
+// KV cache storage formats for the fused RoPE + KV cache write. Each thread stores 2 head elements.
+
+struct gptoss_f32_kv_store {
+    static constexpr uint head_size = 64 * sizeof(float);
+
+    static inline void store(device uchar* head, float2 val, uint simdgroup_tid) {
+        reinterpret_cast<device float2*>(head)[simdgroup_tid] = val;
+    }
+
+    static inline float2 load(const device uchar* head, uint simdgroup_tid) {
+        return reinterpret_cast<const device float2*>(head)[simdgroup_tid];
+    }
+};
+
+struct gptoss_bf16_kv_store {
+    static constexpr uint head_size = 64 * sizeof(bfloat);
+
+    static inline void store(device uchar* head, float2 val, uint simdgroup_tid) {
+        reinterpret_cast<device bfloat2*>(head)[simdgroup_tid] = static_cast<bfloat2>(val);
+    }
+
+    static inline float2 load(const device uchar* head, uint simdgroup_tid) {
+        return static_cast<float2>(reinterpret_cast<const device bfloat2*>(head)[simdgroup_tid]);
+    }
+};
+
+struct gptoss_i8_kv_store {
+    static constexpr uint head_size = 64 * sizeof(char) + sizeof(float);
+
+    static inline void store(device uchar* head, float2 val, uint simdgroup_tid) {
+        const float max_abs = metal::simd_max(metal::max(metal::abs(val.x), metal::abs(val.y)));
+        const float scale = max_abs * (1.0f / 127.0f);
+        const float inv_scale = max_abs != 0.0f ? 127.0f / max_abs : 0.0f;
+        const float2 qval = metal::clamp(metal::rint(val * inv_scale), -127.0f, 127.0f);
+        reinterpret_cast<device char2*>(head)[simdgroup_tid] = static_cast<char2>(qval);
+        if (metal::simd_is_first()) {
+            *reinterpret_cast<device float*>(head + 64 * sizeof(char)) = scale;
+        }
+    }
+
+    static inline float2 load(const device uchar* head, uint simdgroup_tid) {
+        const float scale = *reinterpret_cast<const device float*>(head + 64 * sizeof(char));
+        return static_cast<float2>(reinterpret_cast<const device char2*>(head)[simdgroup_tid]) * scale;
+    }
+};
+
+// Applies RoPE to the Q and K heads of the QKV activations, writes the rotated Q heads back in place, and stores the
+// rotated K heads and the V heads into the KV cache slot of the token. Same math as gptoss_f32_rope.
+// Each simdgroup handles one Q, K, or V head of one token, each thread handles 2 head elements.
+// Threadgroup grid: (num_q_heads + 2 * num_kv_heads, num_tokens).
+
+template <typename kv_type>
+static inline void gptoss_f32_rope_kv_store_impl(
+    constant gptoss_rope_kv_store_args& args,
+    device float2* activations,
+    device uchar* kvcache,
+    const device gptoss_control* control,
+    const device uint* page_table,
+    uint2 gid,
+    uint2 num_threadgroups,
+    uint simdgroup_tid)
+{
+    const uint num_head_dims = 64;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint head = gid.x;
+    const uint token_idx = args.token_offset + gid.y;
+    const uint num_kv_heads = (num_threadgroups.x - args.num_q_heads) / 2;
+    activations += gid.y * args.token_stride + head * (num_head_dims / 2) + simdgroup_tid;
+
+    float2 vals = *activations;
+    if (head < args.num_q_heads + num_kv_heads) {
+        const float head_idx = static_cast<float>(simdgroup_tid);
+        const float inv_extrapolation_freq = metal::precise::exp(head_idx * args.freq_scale);
+        const float inv_interpolation_freq = inv_extrapolation_freq * args.interpolation_scale;
+        const float alpha = metal::saturate(metal::fma(head_idx, args.yarn_scale, args.yarn_offset));
+        const float inv_freq = metal::mix(inv_extrapolation_freq, inv_interpolation_freq, alpha);
+
+        const float phi = static_cast<float>(token_idx) * inv_freq;
+        const float yarn_multiplier = args.yarn_multiplier;
+        float cosphi;
+        const float sinphi = metal::precise::sincos(phi, cosphi) * yarn_multiplier;
+        cosphi *= yarn_multiplier;
+
+        const float output_re = metal::fma(-vals.y, sinphi, vals.x * cosphi);
+        const float output_im = metal::fma(vals.y, cosphi, vals.x * sinphi);
+        vals = (float2) { output_re, output_im };
+    }
+
+    if (head < args.num_q_heads) {
+        *activations = vals;
+    } else if (token_idx >= args.kv_token_offset) {
+        const uint slot = gptoss_kv_slot(args.kv_capacity, args.paged, page_table, token_idx - args.kv_token_offset);
+        const uint kv_head = head - args.num_q_heads;
+        kv_type::store(kvcache + (slot * 2 * num_kv_heads + kv_head) * kv_type::head_size, vals, simdgroup_tid);
+    }
+}
+
+kernel void gptoss_f32_rope_kv_store(
+    constant gptoss_rope_kv_store_args& args [[ buffer(0) ]],
+    device float2* activations [[ buffer(1) ]],
+    device uchar* kvcache [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    const device uint* page_table [[ buffer(4) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    gptoss_f32_rope_kv_store_impl<gptoss_f32_kv_store>(
+        args, activations, kvcache, control, page_table, gid, num_threadgroups, simdgroup_tid);
+}
+
+kernel void gptoss_f32_rope_bf16kv_store(
+    constant gptoss_rope_kv_store_args& args [[ buffer(0) ]],
+    device float2* activations [[ buffer(1) ]],
+    device uchar* kvcache [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    const device uint* page_table [[ buffer(4) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    gptoss_f32_rope_kv_store_impl<gptoss_bf16_kv_store>(
+        args, activations, kvcache, control, page_table, gid, num_threadgroups, simdgroup_tid);
+}
+
+kernel void gptoss_f32_rope_i8kv_store(
+    constant gptoss_rope_kv_store_args& args [[ buffer(0) ]],
+    device float2* activations [[ buffer(1) ]],
+    device uchar* kvcache [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    const device uint* page_table [[ buffer(4) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    gptoss_f32_rope_kv_store_impl<gptoss_i8_kv_store>(
+        args, activations, kvcache, control, page_table, gid, num_threadgroups, simdgroup_tid);
+}
+
+// Rotates the K heads stored in the KV cache by args.position_shift positions, so that a key stored by
+// gptoss_f32_rope_kv_store_impl for position i becomes the key for position i + args.position_shift. Rotations compose,
+// so the YaRN frequencies are the same as in gptoss_f32_rope_kv_store_impl, but the YaRN multiplier is already applied.
+// Each simdgroup handles one K head of one token, each thread handles 2 head elements.
+// Threadgroup grid: (num_kv_heads, num_tokens).
+
+template <typename kv_type>
+static inline void gptoss_kv_rope_shift_impl(
+    constant gptoss_kv_rope_shift_args& args,
+    device uchar* kvcache,
+    const device gptoss_control* control,
+    const device uint* page_table,
+    uint2 gid,
+    uint2 num_threadgroups,
+    uint simdgroup_tid)
+{
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint num_kv_heads = num_threadgroups.x;
+    const uint slot = gptoss_kv_slot(args.kv_capacity, args.paged, page_table, args.token_offset + gid.y);
+    device uchar* head = kvcache + (slot * 2 * num_kv_heads + gid.x) * kv_type::head_size;
+
+    const float head_idx = static_cast<float>(simdgroup_tid);
+    const float inv_extrapolation_freq = metal::precise::exp(head_idx * args.freq_scale);
+    const float inv_interpolation_freq = inv_extrapolation_freq * args.interpolation_scale;
+    const float alpha = metal::saturate(metal::fma(head_idx, args.yarn_scale, args.yarn_offset));
+    const float inv_freq = metal::mix(inv_extrapolation_freq, inv_interpolation_freq, alpha);
+
+    const float phi = static_cast<float>(args.position_shift) * inv_freq;
+    float cosphi;
+    const float sinphi = metal::precise::sincos(phi, cosphi);
+
+    const float2 vals = kv_type::load(head, simdgroup_tid);
+    const float output_re = metal::fma(-vals.y, sinphi, vals.x * cosphi);
+    const float output_im = metal::fma(vals.y, cosphi, vals.x * sinphi);
+    kv_type::store(head, (float2) { output_re, output_im }, simdgroup_tid);
+}
+
+kernel void gptoss_kv_rope_shift(
+    constant gptoss_kv_rope_shift_args& args [[ buffer(0) ]],
+    device uchar* kvcache [[ buffer(1) ]],
+    const device gptoss_control* control [[ buffer(2) ]],
+    const device uint* page_table [[ buffer(3) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    gptoss_kv_rope_shift_impl<gptoss_f32_kv_store>(
+        args, kvcache, control, page_table, gid, num_threadgroups, simdgroup_tid);
+}
+
+kernel void gptoss_bf16kv_rope_shift(
+    constant gptoss_kv_rope_shift_args& args [[ buffer(0) ]],
+    device uchar* kvcache [[ buffer(1) ]],
+    const device gptoss_control* control [[ buffer(2) ]],
+    const device uint* page_table [[ buffer(3) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    gptoss_kv_rope_shift_impl<gptoss_bf16_kv_store>(
+        args, kvcache, control, page_table, gid, num_threadgroups, simdgroup_tid);
+}
+
+kernel void gptoss_i8kv_rope_shift(
+    constant gptoss_kv_rope_shift_args& args [[ buffer(0) ]],
+    device uchar* kvcache [[ buffer(1) ]],
+    const device gptoss_control* control [[ buffer(2) ]],
+    const device uint* page_table [[ buffer(3) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    gptoss_kv_rope_shift_impl<gptoss_i8_kv_store>(
+        args, kvcache, control, page_table, gid, num_threadgroups, simdgroup_tid);
+}
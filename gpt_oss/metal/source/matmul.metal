@@ -3,6 +3,7 @@
 #include <metal_integer>
 #include <metal_math>
 #include <metal_simdgroup>
+#include <metal_simdgroup_matrix>
 
 #include <internal/kernel-args.h>
 
@@ -66,43 +67,131 @@ kernel void gptoss_f32_bf16w_matmul(
     }
 }
 
-kernel void gptoss_f32_bf16w_unembedding(
-    constant gptoss_unembedding_args& args [[ buffer(0) ]],
+// Same as gptoss_f32_bf16w_matmul, but applies RMSNorm with bf16 gain to the input on the fly:
+//   output = rsqrt(mean(input^2) + epsilon) * dot(weight, gain * input) + bias
+// Each simdgroup reads the whole input row anyway, so it accumulates the sum of squares alongside the dot product,
+// which avoids a separate RMSNorm launch and a round-trip of the normalized activations through device memory.
+
+kernel void gptoss_f32_bf16w_rmsnorm_matmul(
+    constant gptoss_rmsnorm_matmul_args& args [[ buffer(0) ]],
     const device float4* input [[ buffer(1) ]],
-    const device bfloat4* weight [[ buffer(2) ]],
-    device float* output [[ buffer(3) ]],
-    device metal::atomic_ulong* argmax [[ buffer(4) ]],
-    const device gptoss_control* control [[ buffer(5) ]],
+    const device bfloat4* gain [[ buffer(2) ]],
+    const device bfloat4* weight [[ buffer(3) ]],
+    const device bfloat* bias [[ buffer(4) ]],
+    device float* output [[ buffer(5) ]],
+    const device gptoss_control* control [[ buffer(6) ]],
     uint2 gid [[threadgroup_position_in_grid]],
     uint simdgroup_tid [[thread_index_in_simdgroup]],
     uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
     uint num_simdgroups [[simdgroups_per_threadgroup]])
 {
     const uint simdgroup_size = 32;
-    threadgroup uint2 threadgroup_buffer[32];
     if (control->abort != 0) {
         return;
     }
 
     const uint num_column_vecs = args.num_column_vecs;
+    const uint row = gid.x * num_simdgroups + simdgroup_idx;
+
+    input += gid.y * num_column_vecs + simdgroup_tid;
+    gain += simdgroup_tid;
+    weight += num_column_vecs * row + simdgroup_tid;
+    bias += row;
+    output += gid.y * args.num_rows + row;
+
+    uint num_iter = (num_column_vecs - simdgroup_tid + (simdgroup_size - 1)) / simdgroup_size;
+
+    float4 sum4 = 0.0f;
+    float4 sumsq4 = 0.0f;
+    do {
+        const bfloat4 w = *weight;
+        const float4 g = static_cast<float4>(*gain);
+        const float4 i = *input;
+        sum4 = metal::fma(static_cast<float4>(w), i * g, sum4);
+        sumsq4 = metal::fma(i, i, sumsq4);
+
+        weight += simdgroup_size;
+        gain += simdgroup_size;
+        input += simdgroup_size;
+    } while (--num_iter != 0);
+    const float2 sum2 = sum4.xy + sum4.zw;
+    float sum = sum2.x + sum2.y;
+    sum = metal::simd_sum(sum);
+    const float2 sumsq2 = sumsq4.xy + sumsq4.zw;
+    float sumsq = sumsq2.x + sumsq2.y;
+    sumsq = metal::simd_sum(sumsq);
+    if (metal::simd_is_first()) {
+        const float avgsq = sumsq / args.num_channels;
+        const float scale = metal::precise::rsqrt(avgsq + args.epsilon);
+        *output = metal::fma(sum, scale, static_cast<float>(*bias));
+    }
+}
+
+// Unembedding weights are either bf16, or int8 with a float scale after the int8 values of each row.
+static inline uint gptoss_unembedding_row_stride(const device bfloat4*, uint num_column_vecs) {
+    return num_column_vecs;
+}
+
+static inline uint gptoss_unembedding_row_stride(const device char4*, uint num_column_vecs) {
+    return num_column_vecs + 1;
+}
+
+static inline float gptoss_unembedding_row_scale(const device bfloat4*) {
+    return 1.0f;
+}
+
+static inline float gptoss_unembedding_row_scale(const device char4* row_end) {
+    return *reinterpret_cast<const device float*>(row_end);
+}
+
+template <typename WeightVec>
+static inline void gptoss_f32_unembedding_impl(
+    constant gptoss_unembedding_args& args,
+    const device float4* input,
+    const device WeightVec* weight,
+    device float* output,
+    device metal::atomic_ulong* argmax,
+    const device gptoss_control* control,
+    const device uint* mask,
+    threadgroup uint2* threadgroup_buffer,
+    uint2 gid,
+    uint simdgroup_tid,
+    uint simdgroup_idx,
+    uint num_simdgroups)
+{
+    const uint simdgroup_size = 32;
+
+    const uint num_column_vecs = args.num_column_vecs;
+    const uint row_stride = gptoss_unembedding_row_stride(weight, num_column_vecs);
     const uint row_start = gid.x * args.num_rows_per_threadgroup + simdgroup_idx;
     const uint row_end = metal::min(gid.x * args.num_rows_per_threadgroup + args.num_rows_per_threadgroup, args.num_rows);
     const uint num_iter = (num_column_vecs - simdgroup_tid + (simdgroup_size - 1)) / simdgroup_size;
 
     input += gid.y * num_column_vecs + simdgroup_tid;
-    weight += num_column_vecs * row_start + simdgroup_tid;
+    weight += row_stride * row_start + simdgroup_tid;
     output += gid.y * args.num_rows + row_start;
+    mask += control->token_state * args.num_mask_words;
 
     uint2 row_sum{0xFFFFFFFFul, 0xFFFFFFFFul};
     for (uint row = row_start; row < row_end; row += num_simdgroups) {
+        if (args.num_mask_words != 0 && (mask[row / 32] & (1u << (row % 32))) == 0) {
+            // Disallowed token: skip the dot product. A score of -INFINITY never wins the argmax below.
+            if (metal::simd_is_first()) {
+                *output = -INFINITY;
+            }
+            weight += row_stride * num_simdgroups;
+            output += num_simdgroups;
+            continue;
+        }
+
         uint n = num_iter;
 
         float4 sum4 = 0.0f;
         do {
-            const bfloat4 w = *weight;
+            const float4 w = static_cast<float4>(*weight);
             const float4 i = *input;
 
-            sum4 = metal::fma(static_cast<float4>(w), i, sum4);
+            sum4 = metal::fma(w, i, sum4);
 
             weight += simdgroup_size;
             input += simdgroup_size;
@@ -112,7 +201,7 @@ kernel void gptoss_f32_bf16w_unembedding(
 
         const float2 sum2 = sum4.xy + sum4.zw;
         float sum = sum2.x + sum2.y;
-        sum = metal::simd_sum(sum);
+        sum = metal::simd_sum(sum) * gptoss_unembedding_row_scale(weight - simdgroup_tid + num_column_vecs);
         uint sum_bits = as_type<uint>(sum);
         if (static_cast<int>(sum_bits) >= 0) {
             sum_bits ^= 0x7FFFFFFFu;
@@ -122,7 +211,7 @@ kernel void gptoss_f32_bf16w_unembedding(
             *output = sum;
         }
 
-        weight += num_column_vecs * num_simdgroups;
+        weight += row_stride * num_simdgroups;
         output += num_simdgroups;
     }
     if (metal::simd_is_first()) {
@@ -143,3 +232,274 @@ kernel void gptoss_f32_bf16w_unembedding(
         }
     }
 }
+
+kernel void gptoss_f32_bf16w_unembedding(
+    constant gptoss_unembedding_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device bfloat4* weight [[ buffer(2) ]],
+    device float* output [[ buffer(3) ]],
+    device metal::atomic_ulong* argmax [[ buffer(4) ]],
+    const device gptoss_control* control [[ buffer(5) ]],
+    const device uint* mask [[ buffer(6) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    threadgroup uint2 threadgroup_buffer[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    gptoss_f32_unembedding_impl(args, input, weight, output, argmax, control, mask, threadgroup_buffer,
+        gid, simdgroup_tid, simdgroup_idx, num_simdgroups);
+}
+
+// Int8 weights: each row of num_column_vecs * 4 int8 values is followed by the float scale of the row.
+// Halves the weight traffic of the bf16 kernel, which dominates decoding with a large vocabulary.
+kernel void gptoss_f32_i8w_unembedding(
+    constant gptoss_unembedding_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device char4* weight [[ buffer(2) ]],
+    device float* output [[ buffer(3) ]],
+    device metal::atomic_ulong* argmax [[ buffer(4) ]],
+    const device gptoss_control* control [[ buffer(5) ]],
+    const device uint* mask [[ buffer(6) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    threadgroup uint2 threadgroup_buffer[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    gptoss_f32_unembedding_impl(args, input, weight, output, argmax, control, mask, threadgroup_buffer,
+        gid, simdgroup_tid, simdgroup_idx, num_simdgroups);
+}
+
+// Dense (GEMM) variants of the kernels above for prefill-size batches of tokens.
+// Each threadgroup of 4 simdgroups computes a 32 (tokens) x 32 (output rows) tile of the output with 8x8 simdgroup
+// matrix multiply-accumulates; each simdgroup owns a 16x16 quadrant of the tile. The input and the weights are staged
+// in threadgroup memory 32 columns at a time, so every weight element is read once per 32 tokens rather than once per
+// token. Requires num_rows and the number of columns to be divisible by 32; a partial tile of tokens is zero-padded.
+// + RMSNorm: the gain is applied when staging the input, and the sum of squares of each token accumulates on the way
+// + Unembedding: no bias, and the argmax of each token is reduced as in gptoss_f32_bf16w_unembedding
+
+template <bool rmsnorm, bool unembedding>
+static inline void gptoss_f32_bf16w_dense_matmul_impl(
+    constant gptoss_dense_matmul_args& args,
+    const device float4* input,
+    const device bfloat4* gain,
+    const device bfloat4* weight,
+    const device bfloat* bias,
+    device float* output,
+    device metal::atomic_ulong* argmax,
+    threadgroup float* input_tile,
+    threadgroup float* weight_tile,
+    threadgroup float* output_tile,
+    threadgroup float* scale_tile,
+    uint2 gid,
+    uint tid,
+    uint simdgroup_tid,
+    uint simdgroup_idx)
+{
+    const uint tile = GPTOSS_DENSE_MATMUL_TILE;
+    const uint tile_vecs = tile / 4;
+    const uint num_column_vecs = args.num_column_vecs;
+    const uint token_start = gid.y * tile;
+    const uint row_start = gid.x * tile;
+    const uint num_tile_tokens = metal::min(args.num_tokens - token_start, tile);
+
+    // Thread tid stages column vector (tid % 8) of tile rows (tid / 8) and (tid / 8 + 16) of the input and weights.
+    const uint stage_row = tid / tile_vecs;
+    const uint stage_col = tid % tile_vecs;
+    const bool stage_lo = stage_row < num_tile_tokens;
+    const bool stage_hi = stage_row + tile / 2 < num_tile_tokens;
+    input += (token_start + stage_row) * num_column_vecs + stage_col;
+    weight += (row_start + stage_row) * num_column_vecs + stage_col;
+    gain += stage_col;
+    threadgroup float4* input_tile4 = reinterpret_cast<threadgroup float4*>(input_tile);
+    threadgroup float4* weight_tile4 = reinterpret_cast<threadgroup float4*>(weight_tile);
+
+    const uint simdgroup_token = (simdgroup_idx / 2) * (tile / 2);
+    const uint simdgroup_row = (simdgroup_idx % 2) * (tile / 2);
+    metal::simdgroup_float8x8 acc[2][2];
+    for (uint i = 0; i < 2; i++) {
+        for (uint j = 0; j < 2; j++) {
+            acc[i][j] = metal::make_filled_simdgroup_matrix<float, 8, 8>(0.0f);
+        }
+    }
+
+    float4 sumsq_lo = 0.0f;
+    float4 sumsq_hi = 0.0f;
+    for (uint k = 0; k < num_column_vecs; k += tile_vecs) {
+        float4 input_lo = stage_lo ? input[k] : 0.0f;
+        float4 input_hi = stage_hi ? input[k + (tile / 2) * num_column_vecs] : 0.0f;
+        if (rmsnorm) {
+            sumsq_lo = metal::fma(input_lo, input_lo, sumsq_lo);
+            sumsq_hi = metal::fma(input_hi, input_hi, sumsq_hi);
+            const float4 g = static_cast<float4>(gain[k]);
+            input_lo *= g;
+            input_hi *= g;
+        }
+        const float4 weight_lo = static_cast<float4>(weight[k]);
+        const float4 weight_hi = static_cast<float4>(weight[k + (tile / 2) * num_column_vecs]);
+
+        // Wait until all simdgroups are done with the previous slice
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        input_tile4[tid] = input_lo;
+        input_tile4[tid + tile * tile_vecs / 2] = input_hi;
+        weight_tile4[tid] = weight_lo;
+        weight_tile4[tid + tile * tile_vecs / 2] = weight_hi;
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+        for (uint kk = 0; kk < tile; kk += 8) {
+            metal::simdgroup_float8x8 a[2];
+            metal::simdgroup_float8x8 b[2];
+            for (uint i = 0; i < 2; i++) {
+                metal::simdgroup_load(a[i], input_tile + (simdgroup_token + i * 8) * tile + kk, tile);
+            }
+            for (uint j = 0; j < 2; j++) {
+                // Weights are stored row-major (output row x column), so load them transposed
+                metal::simdgroup_load(b[j], weight_tile + (simdgroup_row + j * 8) * tile + kk, tile, ulong2(0, 0), /*transpose_matrix=*/true);
+            }
+            for (uint i = 0; i < 2; i++) {
+                for (uint j = 0; j < 2; j++) {
+                    metal::simdgroup_multiply_accumulate(acc[i][j], a[i], b[j], acc[i][j]);
+                }
+            }
+        }
+    }
+
+    for (uint i = 0; i < 2; i++) {
+        for (uint j = 0; j < 2; j++) {
+            metal::simdgroup_store(acc[i][j], output_tile + (simdgroup_token + i * 8) * tile + simdgroup_row + j * 8, tile);
+        }
+    }
+    if (rmsnorm) {
+        // The 8 threads staging a tile row are consecutive lanes of a simdgroup
+        const float2 sumsq2_lo = sumsq_lo.xy + sumsq_lo.zw;
+        const float2 sumsq2_hi = sumsq_hi.xy + sumsq_hi.zw;
+        float2 sumsq = float2(sumsq2_lo.x + sumsq2_lo.y, sumsq2_hi.x + sumsq2_hi.y);
+        for (uint offset = 1; offset < tile_vecs; offset *= 2) {
+            sumsq += metal::simd_shuffle_xor(sumsq, offset);
+        }
+        if (stage_col == 0) {
+            const float2 avgsq = sumsq / args.num_channels;
+            scale_tile[stage_row] = metal::precise::rsqrt(avgsq.x + args.epsilon);
+            scale_tile[stage_row + tile / 2] = metal::precise::rsqrt(avgsq.y + args.epsilon);
+        }
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    // Each simdgroup writes whole tokens of the tile, one output row per thread
+    const uint row = row_start + simdgroup_tid;
+    for (uint t = simdgroup_idx; t < num_tile_tokens; t += 4) {
+        float sum = output_tile[t * tile + simdgroup_tid];
+        device float* token_output = output + (token_start + t) * args.num_rows + row;
+        if (unembedding) {
+            *token_output = sum;
+
+            uint sum_bits = as_type<uint>(sum);
+            if (static_cast<int>(sum_bits) >= 0) {
+                sum_bits ^= 0x7FFFFFFFu;
+            }
+            const uint sum_bits_min = metal::simd_min(sum_bits);
+            const uint row_min = metal::simd_min(sum_bits == sum_bits_min ? row : 0xFFFFFFFFu);
+            if (metal::simd_is_first()) {
+                const uint2 threadgroup_output{row_min, sum_bits_min};
+                atomic_min_explicit(&argmax[token_start + t], as_type<ulong>(threadgroup_output), metal::memory_order_relaxed);
+            }
+        } else {
+            if (rmsnorm) {
+                sum = metal::fma(sum, scale_tile[t], static_cast<float>(bias[row]));
+            } else {
+                sum += static_cast<float>(bias[row]);
+            }
+            if (args.add) {
+                *token_output += sum;
+            } else {
+                *token_output = sum;
+            }
+        }
+    }
+}
+
+kernel void gptoss_f32_bf16w_dense_matmul(
+    constant gptoss_dense_matmul_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device bfloat4* weight [[ buffer(2) ]],
+    const device bfloat* bias [[ buffer(3) ]],
+    device float* output [[ buffer(4) ]],
+    const device gptoss_control* control [[ buffer(5) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_index_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]])
+{
+    threadgroup float input_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    threadgroup float weight_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    threadgroup float output_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    if (control->abort != 0) {
+        return;
+    }
+
+    gptoss_f32_bf16w_dense_matmul_impl</*rmsnorm=*/false, /*unembedding=*/false>(
+        args, input, /*gain=*/nullptr, weight, bias, output, /*argmax=*/nullptr,
+        input_tile, weight_tile, output_tile, /*scale_tile=*/nullptr,
+        gid, tid, simdgroup_tid, simdgroup_idx);
+}
+
+kernel void gptoss_f32_bf16w_rmsnorm_dense_matmul(
+    constant gptoss_dense_matmul_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device bfloat4* gain [[ buffer(2) ]],
+    const device bfloat4* weight [[ buffer(3) ]],
+    const device bfloat* bias [[ buffer(4) ]],
+    device float* output [[ buffer(5) ]],
+    const device gptoss_control* control [[ buffer(6) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_index_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]])
+{
+    threadgroup float input_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    threadgroup float weight_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    threadgroup float output_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    threadgroup float scale_tile[GPTOSS_DENSE_MATMUL_TILE];
+    if (control->abort != 0) {
+        return;
+    }
+
+    gptoss_f32_bf16w_dense_matmul_impl</*rmsnorm=*/true, /*unembedding=*/false>(
+        args, input, gain, weight, bias, output, /*argmax=*/nullptr,
+        input_tile, weight_tile, output_tile, scale_tile,
+        gid, tid, simdgroup_tid, simdgroup_idx);
+}
+
+kernel void gptoss_f32_bf16w_dense_unembedding(
+    constant gptoss_dense_matmul_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device bfloat4* weight [[ buffer(2) ]],
+    device float* output [[ buffer(3) ]],
+    device metal::atomic_ulong* argmax [[ buffer(4) ]],
+    const device gptoss_control* control [[ buffer(5) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_index_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]])
+{
+    threadgroup float input_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    threadgroup float weight_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    threadgroup float output_tile[GPTOSS_DENSE_MATMUL_TILE * GPTOSS_DENSE_MATMUL_TILE];
+    if (control->abort != 0) {
+        return;
+    }
+
+    gptoss_f32_bf16w_dense_matmul_impl</*rmsnorm=*/false, /*unembedding=*/true>(
+        args, input, /*gain=*/nullptr, weight, /*bias=*/nullptr, output, argmax,
+        input_tile, weight_tile, output_tile, /*scale_tile=*/nullptr,
+        gid, tid, simdgroup_tid, simdgroup_idx);
+}
@@ -1,6 +1,8 @@
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 
 #include <internal/kernel-args.h>
@@ -281,9 +283,52 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
         /*threadgroup_buffer_size=*/0);
 }
 
+static bool should_use_dense_matmul(
+    const struct gptoss_metal_function* dense_fn,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows)
+{
+    return dense_fn != NULL && dense_fn->pipeline_state_object != NULL &&
+        dense_fn->simdgroup_threads == 32 && dense_fn->max_threadgroup_threads >= 4 * 32 &&
+        num_tokens >= GPTOSS_DENSE_MATMUL_MIN_TOKENS &&
+        num_cols % GPTOSS_DENSE_MATMUL_TILE == 0 && num_rows % GPTOSS_DENSE_MATMUL_TILE == 0;
+}
+
+static enum gptoss_status encode_launch_f32_bf16w_dense_matmul(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* dense_fn,
+    size_t num_buffers,
+    const struct gptoss_metal_buffer** buffers,
+    const size_t* buffer_offsets,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows,
+    uint32_t add,
+    float epsilon)
+{
+    const struct gptoss_dense_matmul_args args = {
+        .num_tokens = num_tokens,
+        .num_column_vecs = num_cols / 4,
+        .num_rows = num_rows,
+        .add = add,
+        .num_channels = (float) num_cols,
+        .epsilon = epsilon,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, dense_fn,
+        /*threadgroup_size=*/4 * dense_fn->simdgroup_threads, 1, 1,
+        num_rows / GPTOSS_DENSE_MATMUL_TILE, math_ceil_div(num_tokens, GPTOSS_DENSE_MATMUL_TILE), 1,
+        sizeof(args), &args,
+        num_buffers, buffers, buffer_offsets,
+        /*threadgroup_buffer_size=*/0);
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
+    const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -304,6 +349,15 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
         return gptoss_status_invalid_state;
     }
 
+    if (should_use_dense_matmul(f32_bf16w_dense_matmul_fn, num_tokens, num_cols, num_rows)) {
+        return encode_launch_f32_bf16w_dense_matmul(
+            command_buffer, f32_bf16w_dense_matmul_fn,
+            5,
+            (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, bias_buffer, output_buffer, control_buffer},
+            (const size_t[]) {input_offset, weight_offset, bias_offset, output_offset, control_offset},
+            num_tokens, num_cols, num_rows, /*add=*/0, /*epsilon=*/0.0f);
+    }
+
     if (threadgroup_size == 0) {
         threadgroup_size = f32_bf16w_matmul_fn->simdgroup_threads;
     } else if (threadgroup_size > f32_bf16w_matmul_fn->max_threadgroup_threads) {
@@ -341,9 +395,84 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
         /*threadgroup_buffer_size=*/0);
 }
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_matmul(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_bf16w_rmsnorm_matmul_fn,
+    const struct gptoss_metal_function* f32_bf16w_rmsnorm_dense_matmul_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* gain_buffer,
+    size_t gain_offset,
+    const struct gptoss_metal_buffer* weight_buffer,
+    size_t weight_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows,
+    float epsilon)
+{
+    if (command_buffer->object == NULL || f32_bf16w_rmsnorm_matmul_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_matmul kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (should_use_dense_matmul(f32_bf16w_rmsnorm_dense_matmul_fn, num_tokens, num_cols, num_rows)) {
+        return encode_launch_f32_bf16w_dense_matmul(
+            command_buffer, f32_bf16w_rmsnorm_dense_matmul_fn,
+            6,
+            (const struct gptoss_metal_buffer *[]) {input_buffer, gain_buffer, weight_buffer, bias_buffer, output_buffer, control_buffer},
+            (const size_t[]) {input_offset, gain_offset, weight_offset, bias_offset, output_offset, control_offset},
+            num_tokens, num_cols, num_rows, /*add=*/0, epsilon);
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_bf16w_rmsnorm_matmul_fn->simdgroup_threads;
+    } else if (threadgroup_size > f32_bf16w_rmsnorm_matmul_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_matmul kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_bf16w_rmsnorm_matmul_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_cols % 4 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_matmul kernel launch: number of columns (%" PRIu32 ") is not divisible by 4",
+            num_cols);
+        return gptoss_status_invalid_argument;
+    }
+    const size_t num_simdgroups = threadgroup_size / f32_bf16w_rmsnorm_matmul_fn->simdgroup_threads;
+    if (num_rows % num_simdgroups != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_matmul kernel launch: number of rows (%" PRIu32 ") is not divisible by the number of simdgroups (%zu)",
+            num_rows, num_simdgroups);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_rmsnorm_matmul_args args = {
+        .num_column_vecs = num_cols / 4,
+        .num_rows = num_rows,
+        .num_channels = (float) num_cols,
+        .epsilon = epsilon,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_bf16w_rmsnorm_matmul_fn,
+        threadgroup_size, 1, 1,
+        num_rows / num_simdgroups, num_tokens, 1,
+        sizeof(args), &args,
+        6,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, gain_buffer, weight_buffer, bias_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, gain_offset, weight_offset, bias_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
+    const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -364,6 +493,15 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_ad
         return gptoss_status_invalid_state;
     }
 
+    if (should_use_dense_matmul(f32_bf16w_dense_matmul_fn, num_tokens, num_cols, num_rows)) {
+        return encode_launch_f32_bf16w_dense_matmul(
+            command_buffer, f32_bf16w_dense_matmul_fn,
+            5,
+            (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, bias_buffer, output_buffer, control_buffer},
+            (const size_t[]) {input_offset, weight_offset, bias_offset, output_offset, control_offset},
+            num_tokens, num_cols, num_rows, /*add=*/1, /*epsilon=*/0.0f);
+    }
+
     if (threadgroup_size == 0) {
         threadgroup_size = f32_bf16w_matmul_fn->simdgroup_threads;
     } else if (threadgroup_size > f32_bf16w_matmul_fn->max_threadgroup_threads) {
@@ -401,9 +539,10 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_ad
         /*threadgroup_buffer_size=*/0);
 }
 
-enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
+// Simdgroup-per-row unembedding with bf16 or int8 weights.
+static enum gptoss_status encode_launch_f32_unembedding(
     const struct gptoss_metal_command_buffer* command_buffer,
-    const struct gptoss_metal_function* f32_bf16w_unembedding_fn,
+    const struct gptoss_metal_function* f32_unembedding_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
     const struct gptoss_metal_buffer* input_buffer,
@@ -416,49 +555,136 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembeddi
     size_t argmax_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
+    const struct gptoss_metal_buffer* mask_buffer,
+    size_t mask_offset,
     uint32_t num_tokens,
     uint32_t num_cols,
     uint32_t num_rows)
 {
-    if (command_buffer->object == NULL || f32_bf16w_unembedding_fn->pipeline_state_object == NULL) {
-        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch: invalid command buffer or pipeline state object");
-        return gptoss_status_invalid_state;
-    }
-
     if (threadgroup_size == 0) {
-        threadgroup_size = f32_bf16w_unembedding_fn->simdgroup_threads;
-    } else if (threadgroup_size > f32_bf16w_unembedding_fn->max_threadgroup_threads) {
-        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
-            threadgroup_size, f32_bf16w_unembedding_fn->max_threadgroup_threads);
+        threadgroup_size = f32_unembedding_fn->simdgroup_threads;
+    } else if (threadgroup_size > f32_unembedding_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode unembedding kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_unembedding_fn->max_threadgroup_threads);
         return gptoss_status_invalid_argument;
     }
 
     if (num_cols % 4 != 0) {
-        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch: number of columns (%" PRIu32 ") is not divisible by 4",
+        GPTOSS_LOG_ERROR("failed to encode unembedding kernel launch: number of columns (%" PRIu32 ") is not divisible by 4",
             num_cols);
         return gptoss_status_invalid_argument;
     }
 
-    const size_t num_simdgroups = threadgroup_size / f32_bf16w_unembedding_fn->simdgroup_threads;
+    const size_t num_simdgroups = threadgroup_size / f32_unembedding_fn->simdgroup_threads;
     const size_t num_rows_per_threadgroup = math_ceil_div(num_rows, max_threadgroups * num_simdgroups) * num_simdgroups;
     const size_t num_threadgroups = math_min(max_threadgroups, math_ceil_div(num_rows, num_rows_per_threadgroup));
     const struct gptoss_unembedding_args args = {
         .num_column_vecs = num_cols / 4,
         .num_rows_per_threadgroup = num_rows_per_threadgroup,
         .num_rows = num_rows,
+        .num_mask_words = mask_buffer != NULL ? math_ceil_div(num_rows, 32) : 0,
     };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
-        command_buffer, f32_bf16w_unembedding_fn,
+        command_buffer, f32_unembedding_fn,
         threadgroup_size, 1, 1,
         num_threadgroups, num_tokens, 1,
         sizeof(args), &args,
-        5,
-        (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, output_buffer, argmax_buffer, control_buffer},
-        (const size_t[]) {input_offset, weight_offset, output_offset, argmax_offset, control_offset},
+        6,
+        // Without a mask, the (unused) mask binding is aliased to the control buffer.
+        (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, output_buffer, argmax_buffer, control_buffer,
+            mask_buffer != NULL ? mask_buffer : control_buffer},
+        (const size_t[]) {input_offset, weight_offset, output_offset, argmax_offset, control_offset,
+            mask_buffer != NULL ? mask_offset : control_offset},
         /*threadgroup_buffer_size=*/0);
 }
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_bf16w_unembedding_fn,
+    const struct gptoss_metal_function* f32_bf16w_dense_unembedding_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* weight_buffer,
+    size_t weight_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* mask_buffer,
+    size_t mask_offset,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows)
+{
+    if (command_buffer->object == NULL || f32_bf16w_unembedding_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (mask_buffer == NULL && should_use_dense_matmul(f32_bf16w_dense_unembedding_fn, num_tokens, num_cols, num_rows)) {
+        return encode_launch_f32_bf16w_dense_matmul(
+            command_buffer, f32_bf16w_dense_unembedding_fn,
+            5,
+            (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, output_buffer, argmax_buffer, control_buffer},
+            (const size_t[]) {input_offset, weight_offset, output_offset, argmax_offset, control_offset},
+            num_tokens, num_cols, num_rows, /*add=*/0, /*epsilon=*/0.0f);
+    }
+
+    return encode_launch_f32_unembedding(
+        command_buffer, f32_bf16w_unembedding_fn,
+        threadgroup_size, max_threadgroups,
+        input_buffer, input_offset,
+        weight_buffer, weight_offset,
+        output_buffer, output_offset,
+        argmax_buffer, argmax_offset,
+        control_buffer, control_offset,
+        mask_buffer, mask_offset,
+        num_tokens, num_cols, num_rows);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_i8w_unembedding(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_i8w_unembedding_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* weight_buffer,
+    size_t weight_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* mask_buffer,
+    size_t mask_offset,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows)
+{
+    if (command_buffer->object == NULL || f32_i8w_unembedding_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_i8w_unembedding kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    return encode_launch_f32_unembedding(
+        command_buffer, f32_i8w_unembedding_fn,
+        threadgroup_size, max_threadgroups,
+        input_buffer, input_offset,
+        weight_buffer, weight_offset,
+        output_buffer, output_offset,
+        argmax_buffer, argmax_offset,
+        control_buffer, control_offset,
+        mask_buffer, mask_offset,
+        num_tokens, num_cols, num_rows);
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_mf4w_moe_matmul_swiglu_fn,
@@ -609,156 +835,683 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
         /*threadgroup_buffer_size=*/0);
 }
 
-enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope(
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_accumulate(
     const struct gptoss_metal_command_buffer* command_buffer,
-    const struct gptoss_metal_function* f32_rope_fn,
+    const struct gptoss_metal_function* f32_mf4w_moe_matmul_accumulate_fn,
     size_t threadgroup_size,
-    const struct gptoss_metal_buffer* activations_buffer,
-    size_t activations_offset,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
-    float rope_base,
-    float interpolation_scale,
-    float yarn_offset,
-    float yarn_scale,
-    float yarn_multiplier,
+    uint32_t expert_stride,
     uint32_t num_tokens,
-    uint32_t num_q_heads,
-    uint32_t num_kv_heads,
-    uint32_t attn_head_dim,
-    uint32_t token_offset)
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows)
 {
-    if (command_buffer->object == NULL || f32_rope_fn->pipeline_state_object == NULL) {
+    if (command_buffer->object == NULL || f32_mf4w_moe_matmul_accumulate_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_accumulate kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
 
     if (threadgroup_size == 0) {
-        threadgroup_size = f32_rope_fn->max_threadgroup_threads;
-    } else if (threadgroup_size > f32_rope_fn->max_threadgroup_threads) {
+        threadgroup_size = f32_mf4w_moe_matmul_accumulate_fn->simdgroup_threads;
+    } else if (threadgroup_size > f32_mf4w_moe_matmul_accumulate_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_accumulate kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_mf4w_moe_matmul_accumulate_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    } else if (threadgroup_size % f32_mf4w_moe_matmul_accumulate_fn->simdgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_accumulate kernel launch: threadgroup size (%zu) is not divisible by simdgroup size (%zu)",
+            threadgroup_size, f32_mf4w_moe_matmul_accumulate_fn->simdgroup_threads);
         return gptoss_status_invalid_argument;
     }
 
-    const size_t num_simdgroups = threadgroup_size / f32_rope_fn->simdgroup_threads;
-    const uint32_t num_qk_heads = num_q_heads + num_kv_heads;
-    if (num_qk_heads % num_simdgroups != 0) {
+    if (num_cols % 32 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_accumulate kernel launch: number of columns (%" PRIu32 ") is not divisible by 32",
+            num_cols);
+        return gptoss_status_invalid_argument;
+    }
+    const size_t num_simdgroups = threadgroup_size / f32_mf4w_moe_matmul_accumulate_fn->simdgroup_threads;
+    if (num_rows % num_simdgroups != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_accumulate kernel launch: "
+            "the number of rows (%" PRIu32 ") is not divisible by the number of simdgroups (%zu)",
+            num_rows, num_simdgroups);
         return gptoss_status_invalid_argument;
     }
 
-    const struct gptoss_rope_args args = {
-        .token_stride = (num_q_heads + 2 * num_kv_heads) * (attn_head_dim / 2),
-        .token_offset = token_offset,
-        .freq_scale = -logf(rope_base) / (float) (int32_t) (attn_head_dim / 2),
-        .interpolation_scale = interpolation_scale,
-        .yarn_offset = yarn_offset,
-        .yarn_scale = yarn_scale,
-        .yarn_multiplier = yarn_multiplier,
+    const struct gptoss_moe_matmul_args args = {
+        .num_column_vecs = num_cols / 32,
+        .num_rows = num_rows,
+        .num_active_experts = num_active_experts,
+        .input_expert_stride = num_tokens * (num_cols / 32),
+        .weight_expert_stride = expert_stride,
+        .output_expert_stride = 0,
     };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
-        command_buffer, f32_rope_fn,
+        command_buffer, f32_mf4w_moe_matmul_accumulate_fn,
         threadgroup_size, 1, 1,
-        num_qk_heads / num_simdgroups, num_tokens, 1,
+        num_rows / num_simdgroups, num_tokens, 1,
         sizeof(args), &args,
-        2,
-        (const struct gptoss_metal_buffer *[]) {activations_buffer, control_buffer},
-        (const size_t[]) {activations_offset, control_offset},
+        7,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, expert_buffer, weight_block_buffer, weight_scale_buffer, bias_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, expert_offset, weight_block_offset, weight_scale_offset, bias_offset, output_offset, control_offset},
         /*threadgroup_buffer_size=*/0);
 }
 
-enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_expert_route(
     const struct gptoss_metal_command_buffer* command_buffer,
-    const struct gptoss_metal_function* f32_accumulate_fn,
-    size_t threadgroup_size,
-    size_t max_threadgroups,
-    const struct gptoss_metal_buffer* input_buffer,
-    size_t input_offset,
+    const struct gptoss_metal_function* expert_route_fn,
     const struct gptoss_metal_buffer* expert_buffer,
     size_t expert_offset,
-    const struct gptoss_metal_buffer* output_buffer,
-    size_t output_offset,
+    const struct gptoss_metal_buffer* expert_offsets_buffer,
+    size_t expert_offsets_offset,
+    const struct gptoss_metal_buffer* assignment_buffer,
+    size_t assignment_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
-    uint32_t num_channels,
     uint32_t num_tokens,
-    uint32_t num_experts)
+    uint32_t num_experts,
+    uint32_t num_active_experts)
 {
-    if (command_buffer->object == NULL || f32_accumulate_fn->pipeline_state_object == NULL) {
+    if (command_buffer->object == NULL || expert_route_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode expert_route kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
 
-    if (num_channels% 4 != 0) {
-        return gptoss_status_invalid_argument;
-    }
-
-    if (threadgroup_size == 0) {
-        threadgroup_size = f32_accumulate_fn->max_threadgroup_threads;
-    } else if (threadgroup_size > f32_accumulate_fn->max_threadgroup_threads) {
+    if (num_experts > GPTOSS_EXPERT_ROUTE_MAX_EXPERTS) {
+        GPTOSS_LOG_ERROR("failed to encode expert_route kernel launch: number of experts (%" PRIu32 ") exceeds supported maximum (%u)",
+            num_experts, GPTOSS_EXPERT_ROUTE_MAX_EXPERTS);
         return gptoss_status_invalid_argument;
     }
 
-    const size_t num_vecs = num_channels / 4;
-    const size_t num_vecs_per_expert = num_vecs * num_tokens;
-    const size_t num_vecs_per_threadgroup = math_ceil_div(num_vecs, max_threadgroups * threadgroup_size) * threadgroup_size;
-    const size_t num_threadgroups = math_min(max_threadgroups, math_ceil_div(num_vecs, num_vecs_per_threadgroup));
-    const struct gptoss_accumulate_args args = {
-        .num_vecs_per_expert = num_vecs_per_expert,
-        .num_vecs_per_threadgroup = num_vecs_per_threadgroup,
-        .num_vecs = num_vecs,
+    const struct gptoss_expert_route_args args = {
+        .num_experts = num_experts,
+        .num_assignments = num_tokens * num_active_experts,
     };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
-        command_buffer, f32_accumulate_fn,
-        threadgroup_size, 1, 1,
-        num_threadgroups, num_tokens, 1,
+        command_buffer, expert_route_fn,
+        math_min(expert_route_fn->max_threadgroup_threads, 1024), 1, 1,
+        1, 1, 1,
         sizeof(args), &args,
         4,
-        (const struct gptoss_metal_buffer *[]) {input_buffer, expert_buffer, output_buffer, control_buffer},
-        (const size_t[]) {input_offset, expert_offset, output_offset, control_offset},
+        (const struct gptoss_metal_buffer *[]) {expert_buffer, expert_offsets_buffer, assignment_buffer, control_buffer},
+        (const size_t[]) {expert_offset, expert_offsets_offset, assignment_offset, control_offset},
         /*threadgroup_buffer_size=*/0);
 }
 
-enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_expert_usage(
     const struct gptoss_metal_command_buffer* command_buffer,
-    const struct gptoss_metal_function* f32_topk_fn,
-    const struct gptoss_metal_buffer* input_buffer,
-    size_t input_offset,
-    const struct gptoss_metal_buffer* output_buffer,
-    size_t output_offset,
+    const struct gptoss_metal_function* expert_usage_fn,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* usage_buffer,
+    size_t usage_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
     uint32_t num_tokens,
     uint32_t num_experts,
     uint32_t num_active_experts)
 {
-    if (command_buffer->object == NULL || f32_topk_fn->pipeline_state_object == NULL) {
+    if (command_buffer->object == NULL || expert_usage_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode expert_usage kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
 
-    if (num_experts != 32  && num_experts != 128) {
-        return gptoss_status_invalid_argument;
-    }
-
-    if (num_active_experts != 4) {
+    if (num_experts > GPTOSS_EXPERT_ROUTE_MAX_EXPERTS) {
+        GPTOSS_LOG_ERROR("failed to encode expert_usage kernel launch: number of experts (%" PRIu32 ") exceeds supported maximum (%u)",
+            num_experts, GPTOSS_EXPERT_ROUTE_MAX_EXPERTS);
         return gptoss_status_invalid_argument;
     }
 
-    const struct gptoss_topk_args args = { 0 };
+    const struct gptoss_expert_usage_args args = {
+        .num_experts = num_experts,
+        .num_assignments = num_tokens * num_active_experts,
+    };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
-        command_buffer, f32_topk_fn,
-        /*threadgroup_size=*/32, 1, 1,
-        num_tokens, 1, 1,
+        command_buffer, expert_usage_fn,
+        math_min(expert_usage_fn->max_threadgroup_threads, 1024), 1, 1,
+        1, 1, 1,
         sizeof(args), &args,
         3,
-        (const struct gptoss_metal_buffer *[]) {input_buffer, output_buffer, control_buffer},
-        (const size_t[]) {input_offset, output_offset, control_offset},
+        (const struct gptoss_metal_buffer *[]) {expert_buffer, usage_buffer, control_buffer},
+        (const size_t[]) {expert_offset, usage_offset, control_offset},
         /*threadgroup_buffer_size=*/0);
 }
 
-enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
+static enum gptoss_status encode_launch_f32_mf4w_moe_dense_matmul(
     const struct gptoss_metal_command_buffer* command_buffer,
-    const struct gptoss_metal_function* f32_sdpa_fn,
-    const struct gptoss_metal_buffer* q_buffer,
+    const struct gptoss_metal_function* moe_dense_matmul_fn,
+    const char* kernel_name,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_offsets_buffer,
+    size_t expert_offsets_offset,
+    const struct gptoss_metal_buffer* assignment_buffer,
+    size_t assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_moe_dense_matmul_args* args,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_cols)
+{
+    if (command_buffer->object == NULL || moe_dense_matmul_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode %s kernel launch: invalid command buffer or pipeline state object", kernel_name);
+        return gptoss_status_invalid_state;
+    }
+
+    if (moe_dense_matmul_fn->simdgroup_threads != 32 || moe_dense_matmul_fn->max_threadgroup_threads < 4 * 32) {
+        GPTOSS_LOG_ERROR("failed to encode %s kernel launch: unsupported simdgroup size (%zu) or maximum threadgroup size (%zu)",
+            kernel_name, moe_dense_matmul_fn->simdgroup_threads, moe_dense_matmul_fn->max_threadgroup_threads);
+        return gptoss_status_unsupported_system;
+    }
+
+    if (num_cols % 32 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode %s kernel launch: number of columns (%" PRIu32 ") is not divisible by 32",
+            kernel_name, num_cols);
+        return gptoss_status_invalid_argument;
+    }
+    if (args->num_rows % 32 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode %s kernel launch: number of weight rows (%" PRIu32 ") is not divisible by 32",
+            kernel_name, args->num_rows);
+        return gptoss_status_invalid_argument;
+    }
+
+    // An expert is assigned to at most num_tokens tokens, but most tiles past the end of their group exit early.
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, moe_dense_matmul_fn,
+        4 * moe_dense_matmul_fn->simdgroup_threads, 1, 1,
+        args->num_rows / 32, math_ceil_div(num_tokens, 32), num_experts,
+        sizeof(*args), args,
+        8,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, expert_offsets_buffer, assignment_buffer, weight_block_buffer, weight_scale_buffer, bias_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, expert_offsets_offset, assignment_offset, weight_block_offset, weight_scale_offset, bias_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul_swiglu(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_dense_matmul_swiglu_fn,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_offsets_buffer,
+    size_t expert_offsets_offset,
+    const struct gptoss_metal_buffer* assignment_buffer,
+    size_t assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    float swiglu_limit,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows)
+{
+    const struct gptoss_moe_dense_matmul_args args = {
+        .num_column_vecs = num_cols / 32,
+        .num_rows = 2 * num_rows,
+        .num_active_experts = num_active_experts,
+        .input_expert_stride = 0,
+        .weight_expert_stride = expert_stride,
+        .output_expert_stride = num_rows * num_tokens,
+        .swiglu_min = -swiglu_limit,
+        .swiglu_max = swiglu_limit,
+    };
+
+    return encode_launch_f32_mf4w_moe_dense_matmul(
+        command_buffer, f32_mf4w_moe_dense_matmul_swiglu_fn, "f32_mf4w_moe_dense_matmul_swiglu",
+        input_buffer, input_offset,
+        expert_offsets_buffer, expert_offsets_offset,
+        assignment_buffer, assignment_offset,
+        weight_block_buffer, weight_block_offset,
+        weight_scale_buffer, weight_scale_offset,
+        bias_buffer, bias_offset,
+        output_buffer, output_offset,
+        control_buffer, control_offset,
+        &args, num_tokens, num_experts, num_cols);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_dense_matmul_fn,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_offsets_buffer,
+    size_t expert_offsets_offset,
+    const struct gptoss_metal_buffer* assignment_buffer,
+    size_t assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows)
+{
+    const struct gptoss_moe_dense_matmul_args args = {
+        .num_column_vecs = num_cols / 32,
+        .num_rows = num_rows,
+        .num_active_experts = num_active_experts,
+        .input_expert_stride = num_tokens * num_cols,
+        .weight_expert_stride = expert_stride,
+        .output_expert_stride = num_rows * num_tokens,
+    };
+
+    return encode_launch_f32_mf4w_moe_dense_matmul(
+        command_buffer, f32_mf4w_moe_dense_matmul_fn, "f32_mf4w_moe_dense_matmul",
+        input_buffer, input_offset,
+        expert_offsets_buffer, expert_offsets_offset,
+        assignment_buffer, assignment_offset,
+        weight_block_buffer, weight_block_offset,
+        weight_scale_buffer, weight_scale_offset,
+        bias_buffer, bias_offset,
+        output_buffer, output_offset,
+        control_buffer, control_offset,
+        &args, num_tokens, num_experts, num_cols);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_rope_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* activations_buffer,
+    size_t activations_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    float rope_base,
+    float interpolation_scale,
+    float yarn_offset,
+    float yarn_scale,
+    float yarn_multiplier,
+    uint32_t num_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset)
+{
+    if (command_buffer->object == NULL || f32_rope_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_rope_fn->max_threadgroup_threads;
+    } else if (threadgroup_size > f32_rope_fn->max_threadgroup_threads) {
+        return gptoss_status_invalid_argument;
+    }
+
+    const size_t num_simdgroups = threadgroup_size / f32_rope_fn->simdgroup_threads;
+    const uint32_t num_qk_heads = num_q_heads + num_kv_heads;
+    if (num_qk_heads % num_simdgroups != 0) {
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_rope_args args = {
+        .token_stride = (num_q_heads + 2 * num_kv_heads) * (attn_head_dim / 2),
+        .token_offset = token_offset,
+        .freq_scale = -logf(rope_base) / (float) (int32_t) (attn_head_dim / 2),
+        .interpolation_scale = interpolation_scale,
+        .yarn_offset = yarn_offset,
+        .yarn_scale = yarn_scale,
+        .yarn_multiplier = yarn_multiplier,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_rope_fn,
+        threadgroup_size, 1, 1,
+        num_qk_heads / num_simdgroups, num_tokens, 1,
+        sizeof(args), &args,
+        2,
+        (const struct gptoss_metal_buffer *[]) {activations_buffer, control_buffer},
+        (const size_t[]) {activations_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_kv_store(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_kv_store_fn,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* kvcache_buffer,
+    size_t kvcache_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
+    uint32_t num_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t kv_capacity)
+{
+    if (command_buffer->object == NULL || f32_kv_store_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (attn_head_dim != 64) {
+        GPTOSS_LOG_ERROR("attention head dimension (%" PRIu32 ") must be 64", attn_head_dim);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (kv_capacity == 0) {
+        GPTOSS_LOG_ERROR("KV cache capacity must be non-zero");
+        return gptoss_status_invalid_argument;
+    }
+
+    if (page_table_buffer != NULL && (size_t) token_offset + (size_t) num_tokens > (size_t) kv_capacity) {
+        GPTOSS_LOG_ERROR("tokens [%" PRIu32 ", %zu) exceed paged KV cache capacity (%" PRIu32 ")",
+            token_offset, (size_t) token_offset + (size_t) num_tokens, kv_capacity);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_kv_store_args args = {
+        .token_stride = (num_q_heads + 2 * num_kv_heads) * attn_head_dim,
+        .token_offset = token_offset,
+        .kv_capacity = kv_capacity,
+        .paged = page_table_buffer != NULL,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_kv_store_fn,
+        f32_kv_store_fn->simdgroup_threads, 1, 1,
+        2 * num_kv_heads, num_tokens, 1,
+        sizeof(args), &args,
+        4,
+        // Without a page table, the (unused) page table binding is aliased to the control buffer.
+        (const struct gptoss_metal_buffer *[]) {input_buffer, kvcache_buffer, control_buffer, page_table_buffer != NULL ? page_table_buffer : control_buffer},
+        (const size_t[]) {input_offset, kvcache_offset, control_offset, page_table_buffer != NULL ? page_table_offset : control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope_kv_store(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_rope_kv_store_fn,
+    const struct gptoss_metal_buffer* activations_buffer,
+    size_t activations_offset,
+    const struct gptoss_metal_buffer* kvcache_buffer,
+    size_t kvcache_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
+    float rope_base,
+    float interpolation_scale,
+    float yarn_offset,
+    float yarn_scale,
+    float yarn_multiplier,
+    uint32_t num_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t kv_token_offset,
+    uint32_t kv_capacity)
+{
+    if (command_buffer->object == NULL || f32_rope_kv_store_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (f32_rope_kv_store_fn->simdgroup_threads != 32) {
+        return gptoss_status_unsupported_system;
+    }
+
+    if (attn_head_dim != 64) {
+        GPTOSS_LOG_ERROR("attention head dimension (%" PRIu32 ") must be 64", attn_head_dim);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (kv_capacity == 0) {
+        GPTOSS_LOG_ERROR("KV cache capacity must be non-zero");
+        return gptoss_status_invalid_argument;
+    }
+
+    const size_t kv_tokens_end = math_sub_sat((size_t) token_offset + (size_t) num_tokens, kv_token_offset);
+    if (page_table_buffer != NULL && kv_tokens_end > (size_t) kv_capacity) {
+        GPTOSS_LOG_ERROR("KV cache position %zu exceeds paged KV cache capacity (%" PRIu32 ")",
+            kv_tokens_end, kv_capacity);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_rope_kv_store_args args = {
+        .token_stride = (num_q_heads + 2 * num_kv_heads) * (attn_head_dim / 2),
+        .token_offset = token_offset,
+        .freq_scale = -logf(rope_base) / (float) (int32_t) (attn_head_dim / 2),
+        .interpolation_scale = interpolation_scale,
+        .yarn_offset = yarn_offset,
+        .yarn_scale = yarn_scale,
+        .yarn_multiplier = yarn_multiplier,
+        .num_q_heads = num_q_heads,
+        .kv_token_offset = kv_token_offset,
+        .kv_capacity = kv_capacity,
+        .paged = page_table_buffer != NULL,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_rope_kv_store_fn,
+        f32_rope_kv_store_fn->simdgroup_threads, 1, 1,
+        num_q_heads + 2 * num_kv_heads, num_tokens, 1,
+        sizeof(args), &args,
+        4,
+        // Without a page table, the (unused) page table binding is aliased to the control buffer.
+        (const struct gptoss_metal_buffer *[]) {activations_buffer, kvcache_buffer, control_buffer, page_table_buffer != NULL ? page_table_buffer : control_buffer},
+        (const size_t[]) {activations_offset, kvcache_offset, control_offset, page_table_buffer != NULL ? page_table_offset : control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_kv_rope_shift(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* kv_rope_shift_fn,
+    const struct gptoss_metal_buffer* kvcache_buffer,
+    size_t kvcache_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
+    float rope_base,
+    float interpolation_scale,
+    float yarn_offset,
+    float yarn_scale,
+    uint32_t num_tokens,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    int32_t position_shift,
+    uint32_t kv_capacity)
+{
+    if (command_buffer->object == NULL || kv_rope_shift_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (kv_rope_shift_fn->simdgroup_threads != 32) {
+        return gptoss_status_unsupported_system;
+    }
+
+    if (attn_head_dim != 64) {
+        GPTOSS_LOG_ERROR("attention head dimension (%" PRIu32 ") must be 64", attn_head_dim);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (kv_capacity == 0) {
+        GPTOSS_LOG_ERROR("KV cache capacity must be non-zero");
+        return gptoss_status_invalid_argument;
+    }
+
+    const size_t kv_tokens_end = (size_t) token_offset + (size_t) num_tokens;
+    if (page_table_buffer != NULL && kv_tokens_end > (size_t) kv_capacity) {
+        GPTOSS_LOG_ERROR("KV cache position %zu exceeds paged KV cache capacity (%" PRIu32 ")",
+            kv_tokens_end, kv_capacity);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_tokens == 0) {
+        return gptoss_status_success;
+    }
+
+    const struct gptoss_kv_rope_shift_args args = {
+        .token_offset = token_offset,
+        .position_shift = position_shift,
+        .freq_scale = -logf(rope_base) / (float) (int32_t) (attn_head_dim / 2),
+        .interpolation_scale = interpolation_scale,
+        .yarn_offset = yarn_offset,
+        .yarn_scale = yarn_scale,
+        .kv_capacity = kv_capacity,
+        .paged = page_table_buffer != NULL,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, kv_rope_shift_fn,
+        kv_rope_shift_fn->simdgroup_threads, 1, 1,
+        num_kv_heads, num_tokens, 1,
+        sizeof(args), &args,
+        3,
+        // Without a page table, the (unused) page table binding is aliased to the control buffer.
+        (const struct gptoss_metal_buffer *[]) {kvcache_buffer, control_buffer, page_table_buffer != NULL ? page_table_buffer : control_buffer},
+        (const size_t[]) {kvcache_offset, control_offset, page_table_buffer != NULL ? page_table_offset : control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_accumulate_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_channels,
+    uint32_t num_tokens,
+    uint32_t num_experts)
+{
+    if (command_buffer->object == NULL || f32_accumulate_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (num_channels% 4 != 0) {
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_experts > GPTOSS_MAX_ACTIVE_EXPERTS) {
+        return gptoss_status_invalid_argument;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_accumulate_fn->max_threadgroup_threads;
+    } else if (threadgroup_size > f32_accumulate_fn->max_threadgroup_threads) {
+        return gptoss_status_invalid_argument;
+    }
+
+    const size_t num_vecs = num_channels / 4;
+    const size_t num_vecs_per_expert = num_vecs * num_tokens;
+    const size_t num_vecs_per_threadgroup = math_ceil_div(num_vecs, max_threadgroups * threadgroup_size) * threadgroup_size;
+    const size_t num_threadgroups = math_min(max_threadgroups, math_ceil_div(num_vecs, num_vecs_per_threadgroup));
+    const struct gptoss_accumulate_args args = {
+        .num_vecs_per_expert = num_vecs_per_expert,
+        .num_vecs_per_threadgroup = num_vecs_per_threadgroup,
+        .num_vecs = num_vecs,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_accumulate_fn,
+        threadgroup_size, 1, 1,
+        num_threadgroups, num_tokens, 1,
+        sizeof(args), &args,
+        4,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, expert_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, expert_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_topk_fn,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts)
+{
+    if (command_buffer->object == NULL || f32_topk_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (num_experts > GPTOSS_TOPK_MAX_EXPERTS) {
+        GPTOSS_LOG_ERROR("number of experts (%" PRIu32 ") exceeds the limit of %d", num_experts, GPTOSS_TOPK_MAX_EXPERTS);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_active_experts == 0 || num_active_experts > math_min(num_experts, GPTOSS_MAX_ACTIVE_EXPERTS)) {
+        GPTOSS_LOG_ERROR("invalid number of active experts (%" PRIu32 ") for %" PRIu32 " experts",
+            num_active_experts, num_experts);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_topk_args args = { 0 };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_topk_fn,
+        /*threadgroup_size=*/32, 1, 1,
+        num_tokens, 1, 1,
+        sizeof(args), &args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sdpa_fn,
+    const struct gptoss_metal_function* f32_sdpa_reduce_fn,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* q_buffer,
     size_t q_offset,
     const struct gptoss_metal_buffer* k_buffer,
     size_t k_offset,
@@ -768,9 +1521,20 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
     size_t s_offset,
     const struct gptoss_metal_buffer* output_buffer,
     size_t output_offset,
+    const struct gptoss_metal_buffer* partial_buffer,
+    size_t partial_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
+    const struct gptoss_metal_buffer* prefix_k_buffer,
+    size_t prefix_k_offset,
+    const struct gptoss_metal_buffer* prefix_v_buffer,
+    size_t prefix_v_offset,
+    const struct gptoss_metal_buffer* page_table_buffer,
+    size_t page_table_offset,
     uint32_t window,
+    uint32_t kv_capacity,
+    uint32_t num_prefix_tokens,
+    uint32_t prefix_capacity,
     uint32_t num_q_tokens,
     uint32_t num_kv_tokens,
     uint32_t num_q_heads,
@@ -792,26 +1556,82 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
         return gptoss_status_invalid_argument;
     }
 
+    // KV tokens attended by any of the Q tokens must not alias in the KV cache.
+    const size_t num_attended_kv_tokens = math_min((size_t) num_q_tokens + math_sub_sat(num_kv_tokens, num_prefix_tokens), (size_t) window + (size_t) num_q_tokens - 1);
+    if (kv_capacity < num_attended_kv_tokens) {
+        GPTOSS_LOG_ERROR("KV cache capacity (%" PRIu32 ") is insufficient for %zu attended tokens",
+            kv_capacity, num_attended_kv_tokens);
+        return gptoss_status_invalid_argument;
+    }
+    const size_t num_attended_prefix_tokens = math_min((size_t) num_prefix_tokens, (size_t) window);
+    if (num_prefix_tokens != 0 && prefix_capacity < num_attended_prefix_tokens) {
+        GPTOSS_LOG_ERROR("prefix KV cache capacity (%" PRIu32 ") is insufficient for %zu attended tokens",
+            prefix_capacity, num_attended_prefix_tokens);
+        return gptoss_status_invalid_argument;
+    }
+
+    // With few Q tokens (decoding), one threadgroup per Q token and KV head would leave most GPU cores idle while each
+    // threadgroup walks the whole KV range alone, so the range is split across more threadgroups.
     const size_t max_context_tokens = math_min(num_q_tokens + num_kv_tokens + 1, window);
+    size_t num_splits = 1;
+    if (f32_sdpa_reduce_fn != NULL && num_q_tokens <= GPTOSS_SDPA_SPLIT_MAX_TOKENS) {
+        num_splits = math_min(math_min(max_context_tokens / GPTOSS_SDPA_MIN_SPLIT_TOKENS, GPTOSS_SDPA_MAX_SPLITS),
+            max_threadgroups / ((size_t) num_q_tokens * num_kv_heads));
+        num_splits = math_max(num_splits, 1);
+    }
+    const size_t split_tokens = num_splits > 1 ? math_ceil_div(max_context_tokens, num_splits) : UINT32_MAX;
+    if (num_splits > 1 && (f32_sdpa_reduce_fn->pipeline_state_object == NULL || partial_buffer == NULL)) {
+        return gptoss_status_invalid_state;
+    }
+
     const size_t threadgroup_size = math_min(f32_sdpa_fn->max_threadgroup_threads,
-        max_context_tokens * f32_sdpa_fn->simdgroup_threads);
+        math_min(max_context_tokens, split_tokens) * f32_sdpa_fn->simdgroup_threads);
     const size_t half_threadgroup_size = math_round_down_po2(threadgroup_size / 2, f32_sdpa_fn->simdgroup_threads);
 
     const struct gptoss_sdpa_args args = {
         .qkv_dim = head_dim * (num_q_heads + 2 * num_kv_heads),
         .num_kv_tokens = num_kv_tokens,
         .window = window,
+        .kv_capacity = kv_capacity,
+        .paged = page_table_buffer != NULL,
+        .num_prefix_tokens = num_prefix_tokens,
+        // Avoid division by zero in the kernel when there is no prefix.
+        .prefix_capacity = math_max(prefix_capacity, 1),
+        .num_splits = num_splits,
+        .split_tokens = split_tokens,
     };
 
-    return gptoss_metal_command_buffer_encode_launch_kernel(
+    enum gptoss_status status = gptoss_metal_command_buffer_encode_launch_kernel(
         command_buffer, f32_sdpa_fn,
         threadgroup_size, 1, 1,
-        num_q_tokens, num_kv_heads, 1,
+        num_q_tokens, num_kv_heads, num_splits,
         sizeof(args), &args,
-        6,
-        (const struct gptoss_metal_buffer *[]) {q_buffer, k_buffer, v_buffer, s_buffer, output_buffer, control_buffer},
-        (const size_t[]) {q_offset, k_offset, v_offset, s_offset, output_offset, control_offset},
+        9,
+        // Without a page table, the (unused) page table binding is aliased to the control buffer.
+        (const struct gptoss_metal_buffer *[]) {q_buffer, k_buffer, v_buffer, s_buffer,
+            num_splits > 1 ? partial_buffer : output_buffer, control_buffer, prefix_k_buffer, prefix_v_buffer,
+            page_table_buffer != NULL ? page_table_buffer : control_buffer},
+        (const size_t[]) {q_offset, k_offset, v_offset, s_offset,
+            num_splits > 1 ? partial_offset : output_offset, control_offset, prefix_k_offset, prefix_v_offset,
+            page_table_buffer != NULL ? page_table_offset : control_offset},
         /*threadgroup_buffer_size=*/half_threadgroup_size * 8 * 4 * sizeof(float));
+    if (status != gptoss_status_success || num_splits == 1) {
+        return status;
+    }
+
+    const struct gptoss_sdpa_reduce_args reduce_args = {
+        .num_splits = num_splits,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_sdpa_reduce_fn,
+        /*threadgroup_size=*/8 * f32_sdpa_reduce_fn->simdgroup_threads, 1, 1,
+        num_q_tokens, num_kv_heads, 1,
+        sizeof(reduce_args), &reduce_args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {partial_buffer, output_buffer, control_buffer},
+        (const size_t[]) {partial_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_softmax(
@@ -918,3 +1738,218 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample(
         (const size_t[]) {prob_offset, sum_offset, token_offset, control_offset},
         /*threadgroup_buffer_size=*/0);
 }
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk_sample(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_topk_sample_fn,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    uint32_t num_channels,
+    uint32_t top_k,
+    float top_p,
+    float temperature)
+{
+    if (command_buffer->object == NULL || f32_topk_sample_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (top_k > GPTOSS_MAX_TOP_K) {
+        return gptoss_status_invalid_argument;
+    }
+
+    if (!(top_p > 0.0f && top_p <= 1.0f)) {
+        return gptoss_status_invalid_argument;
+    }
+
+    // top_k = 0 disables top-k truncation, and top-p sampling then considers the GPTOSS_MAX_TOP_K most likely tokens.
+    if (top_k == 0) {
+        top_k = GPTOSS_MAX_TOP_K;
+    }
+    const struct gptoss_topk_sample_args args = {
+        .rng_seed = rng_seed,
+        .rng_offset = rng_offset,
+        .num_vecs = num_channels,
+        .top_k = (uint32_t) math_min(top_k, num_channels),
+        .top_p = top_p,
+        .temperature = temperature,
+    };
+
+    const size_t threadgroup_size = math_min(f32_topk_sample_fn->max_threadgroup_threads, 1024);
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_topk_sample_fn,
+        threadgroup_size, 1, 1,
+        1, 1, 1,
+        sizeof(args), &args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {score_buffer, token_buffer, control_buffer},
+        (const size_t[]) {score_offset, token_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_gather_logprob(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_gather_logprob_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* logprob_buffer,
+    size_t logprob_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_channels,
+    uint32_t num_tokens)
+{
+    if (command_buffer->object == NULL || f32_gather_logprob_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size > f32_gather_logprob_fn->max_threadgroup_threads) {
+        return gptoss_status_invalid_argument;
+    }
+
+    if (threadgroup_size % f32_gather_logprob_fn->simdgroup_threads != 0) {
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_gather_logprob_args args = {
+        .num_vecs = num_channels,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_gather_logprob_fn,
+        threadgroup_size, 1, 1,
+        num_tokens, 1, 1,
+        sizeof(args), &args,
+        5,
+        (const struct gptoss_metal_buffer *[]) {score_buffer, argmax_buffer, token_buffer, logprob_buffer, control_buffer},
+        (const size_t[]) {score_offset, argmax_offset, token_offset, logprob_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_top_logprobs(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_top_logprobs_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* top_token_buffer,
+    size_t top_token_offset,
+    const struct gptoss_metal_buffer* top_logprob_buffer,
+    size_t top_logprob_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_channels,
+    uint32_t num_tokens,
+    uint32_t num_top)
+{
+    if (command_buffer->object == NULL || f32_top_logprobs_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size > f32_top_logprobs_fn->max_threadgroup_threads) {
+        return gptoss_status_invalid_argument;
+    }
+
+    if (threadgroup_size % f32_top_logprobs_fn->simdgroup_threads != 0) {
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_top == 0 || num_top > GPTOSS_MAX_TOP_LOGPROBS || num_top > num_channels) {
+        GPTOSS_LOG_ERROR("number of top log-probabilities (%" PRIu32 ") must be between 1 and %d, and not exceed %" PRIu32,
+            num_top, GPTOSS_MAX_TOP_LOGPROBS, num_channels);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_top_logprobs_args args = {
+        .num_vecs = num_channels,
+        .num_top = num_top,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_top_logprobs_fn,
+        threadgroup_size, 1, 1,
+        num_tokens, 1, 1,
+        sizeof(args), &args,
+        5,
+        (const struct gptoss_metal_buffer *[]) {score_buffer, argmax_buffer, top_token_buffer, top_logprob_buffer, control_buffer},
+        (const size_t[]) {score_offset, argmax_offset, top_token_offset, top_logprob_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_advance_token_automaton(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* u32_advance_token_automaton_fn,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* transition_buffer,
+    size_t transition_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_states,
+    uint32_t num_transitions)
+{
+    if (command_buffer->object == NULL || u32_advance_token_automaton_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    const struct gptoss_token_automaton_args args = {
+        .num_states = num_states,
+        .num_transitions = num_transitions,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, u32_advance_token_automaton_fn,
+        u32_advance_token_automaton_fn->simdgroup_threads, 1, 1,
+        1, 1, 1,
+        sizeof(args), &args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {token_buffer, transition_buffer, control_buffer},
+        (const size_t[]) {token_offset, transition_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_check_stop_tokens(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* u32_check_stop_tokens_fn,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens)
+{
+    if (command_buffer->object == NULL || u32_check_stop_tokens_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (num_stop_tokens > GPTOSS_MAX_STOP_TOKENS) {
+        return gptoss_status_invalid_argument;
+    }
+
+    struct gptoss_check_stop_tokens_args args = {
+        .num_stop_tokens = (uint32_t) num_stop_tokens,
+    };
+    memcpy(args.stop_tokens, stop_tokens, num_stop_tokens * sizeof(uint32_t));
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, u32_check_stop_tokens_fn,
+        u32_check_stop_tokens_fn->simdgroup_threads, 1, 1,
+        1, 1, 1,
+        sizeof(args), &args,
+        2,
+        (const struct gptoss_metal_buffer *[]) {token_buffer, control_buffer},
+        (const size_t[]) {token_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
@@ -2,13 +2,25 @@
 #import <Metal/Metal.h>
 
 #include <dispatch/dispatch.h>
+#include <errno.h>
 #include <mach-o/getsect.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <gpt-oss/types.h>
 
 #include <internal/log.h>
 #include <internal/metal.h>
 
+// MTLResidencySet is declared by the macOS 15 SDK; builds with older SDKs don't use residency sets.
+#if defined(MAC_OS_VERSION_15_0)
+    #define GPTOSS_METAL_RESIDENCY_SETS 1
+#else
+    #define GPTOSS_METAL_RESIDENCY_SETS 0
+#endif
+
 
 static size_t gptoss_metal_device_get_core_count(id<MTLDevice> device) {
     if (!device) {
@@ -87,6 +99,17 @@ enum gptoss_status gptoss_metal_device_release(
     return gptoss_status_success;
 }
 
+size_t gptoss_metal_device_get_allocated_size(
+    const struct gptoss_metal_device* device)
+{
+    if (device->object == NULL) {
+        return 0;
+    }
+
+    id<MTLDevice> device_obj = (id<MTLDevice>) device->object;
+    return (size_t) [device_obj currentAllocatedSize];
+}
+
 extern const struct mach_header_64 __dso_handle;
 
 enum gptoss_status gptoss_metal_library_create_default(
@@ -98,12 +121,19 @@ enum gptoss_status gptoss_metal_library_create_default(
     id<MTLLibrary> library_obj = nil;
     NSAutoreleasePool* autorelease_pool = nil;
     dispatch_data_t library_blob = NULL;
+    uint64_t library_hash = 0;
 
     unsigned long library_size = 0;
     uint8_t* library_data = getsectiondata(&__dso_handle, "__METAL", "__shaders", &library_size);
     if (library_data != NULL) {
         library_blob = dispatch_data_create(library_data, library_size, NULL, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
 
+        // FNV-1a hash of the library binary
+        library_hash = UINT64_C(0xCBF29CE484222325);
+        for (unsigned long i = 0; i < library_size; i++) {
+            library_hash = (library_hash ^ (uint64_t) library_data[i]) * UINT64_C(0x100000001B3);
+        }
+
         autorelease_pool = [[NSAutoreleasePool alloc] init];
         NSError* error_obj = nil;
         library_obj = [device_obj newLibraryWithData:library_blob error:&error_obj];
@@ -124,6 +154,7 @@ enum gptoss_status gptoss_metal_library_create_default(
 
     *library_out = (struct gptoss_metal_library) {
         .object = (void*) library_obj,
+        .hash = library_hash,
     };
 
 cleanup:
@@ -147,88 +178,344 @@ enum gptoss_status gptoss_metal_library_release(
     return gptoss_status_success;
 }
 
-enum gptoss_status gptoss_metal_function_create(
+// Returns the path of a per-device cache file "<prefix>-<device name>-<key>.bin", or nil if caching is disabled.
+// The cache directory is created if it doesn't exist.
+static NSString* get_cache_file_path(id<MTLDevice> device_obj, NSString* prefix, uint64_t key) {
+    NSString* cache_dir = nil;
+    const char* cache_dir_env = getenv("GPTOSS_PIPELINE_CACHE_DIR");
+    if (cache_dir_env != NULL) {
+        if (*cache_dir_env == '\0') {
+            return nil;
+        }
+        cache_dir = [NSString stringWithUTF8String:cache_dir_env];
+    } else {
+        NSArray<NSString*>* caches_dirs = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+        if ([caches_dirs count] == 0) {
+            return nil;
+        }
+        cache_dir = [[caches_dirs firstObject] stringByAppendingPathComponent:@"gpt-oss"];
+    }
+
+    NSError* error_obj = nil;
+    if (![[NSFileManager defaultManager] createDirectoryAtPath:cache_dir
+                                   withIntermediateDirectories:YES
+                                                    attributes:nil
+                                                         error:&error_obj])
+    {
+        GPTOSS_LOG_WARNING("failed to create cache directory %s: %s",
+            [cache_dir UTF8String], [[error_obj localizedDescription] UTF8String]);
+        return nil;
+    }
+
+    NSCharacterSet* allowed_chars = [NSCharacterSet alphanumericCharacterSet];
+    NSMutableString* device_name = [NSMutableString stringWithString:[device_obj name]];
+    for (NSUInteger i = 0; i < [device_name length]; i++) {
+        if (![allowed_chars characterIsMember:[device_name characterAtIndex:i]]) {
+            [device_name replaceCharactersInRange:NSMakeRange(i, 1) withString:@"-"];
+        }
+    }
+    NSString* file_name = [NSString stringWithFormat:@"%@-%@-%016llx.bin", prefix, device_name, (unsigned long long) key];
+    return [cache_dir stringByAppendingPathComponent:file_name];
+}
+
+// Returns the URL of the on-disk pipeline cache for the device and library, or nil if caching is disabled.
+static NSURL* get_pipeline_cache_url(id<MTLDevice> device_obj, uint64_t library_hash) {
+    if (library_hash == 0) {
+        return nil;
+    }
+
+    NSString* cache_path = get_cache_file_path(device_obj, @"pipelines", library_hash);
+    if (cache_path == nil) {
+        return nil;
+    }
+    return [NSURL fileURLWithPath:cache_path];
+}
+
+enum gptoss_status gptoss_metal_device_get_cache_path(
+    const struct gptoss_metal_device* device,
+    const char* prefix,
+    uint64_t key,
+    char* path_out,
+    size_t path_size)
+{
+    if (device->object == NULL) {
+        return gptoss_status_invalid_argument;
+    }
+
+    id<MTLDevice> device_obj = (id<MTLDevice>) device->object;
+    NSString* cache_path = get_cache_file_path(device_obj, [NSString stringWithUTF8String:prefix], key);
+    if (cache_path == nil) {
+        return gptoss_status_unsupported_system;
+    }
+    const char* cache_path_utf8 = [cache_path fileSystemRepresentation];
+    const size_t cache_path_length = strlen(cache_path_utf8);
+    if (cache_path_length >= path_size) {
+        GPTOSS_LOG_WARNING("cache path %s exceeds the %zu-byte buffer", cache_path_utf8, path_size);
+        return gptoss_status_insufficient_memory;
+    }
+    memcpy(path_out, cache_path_utf8, cache_path_length + 1);
+    return gptoss_status_success;
+}
+
+// Builds pipeline states for the functions with a NULL entry in pipeline_state_objs, all concurrently.
+static void build_pipeline_states(
+    id<MTLDevice> device_obj,
+    size_t num_functions,
+    MTLComputePipelineDescriptor* const* pipeline_descriptor_objs,
+    MTLPipelineOption options,
+    id<MTLComputePipelineState>* pipeline_state_objs,
+    NSString** error_string_objs)
+{
+    dispatch_group_t pipeline_build_group = dispatch_group_create();
+    for (size_t i = 0; i < num_functions; i++) {
+        if (pipeline_state_objs[i] != nil) {
+            continue;
+        }
+
+        dispatch_group_enter(pipeline_build_group);
+        [device_obj newComputePipelineStateWithDescriptor:pipeline_descriptor_objs[i]
+                                                  options:options
+                                        completionHandler:^(id<MTLComputePipelineState> _Nullable new_state,
+                                                            MTLComputePipelineReflection* _Nullable reflection,
+                                                            NSError* _Nullable error_obj) {
+            if (new_state != nil) {
+                pipeline_state_objs[i] = [new_state retain];
+            }
+            if (error_obj != nil) {
+                [error_string_objs[i] release];
+                error_string_objs[i] = [[error_obj localizedDescription] copy];
+            }
+            dispatch_group_leave(pipeline_build_group);
+        }];
+    }
+    dispatch_group_wait(pipeline_build_group, DISPATCH_TIME_FOREVER);
+    dispatch_release(pipeline_build_group);
+}
+
+// Adds the pipelines to the binary archive and saves it to archive_url, on a background queue so that it doesn't delay
+// the caller: adding a pipeline to an archive compiles it again. Saves run one at a time, as they share the name of the
+// temporary file. Takes ownership of the arguments.
+static void save_pipeline_cache_async(
+    id<MTLBinaryArchive> archive_obj,
+    NSURL* archive_url,
+    NSArray<MTLComputePipelineDescriptor*>* pipeline_descriptor_objs)
+{
+    static dispatch_once_t save_queue_once;
+    static dispatch_queue_t save_queue;
+    dispatch_once(&save_queue_once, ^{
+        save_queue = dispatch_queue_create("gpt-oss.pipeline-cache",
+            dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+    });
+    dispatch_async(save_queue, ^{
+        NSAutoreleasePool* autorelease_pool = [[NSAutoreleasePool alloc] init];
+        bool archive_dirty = false;
+        for (MTLComputePipelineDescriptor* pipeline_descriptor_obj in pipeline_descriptor_objs) {
+            NSError* error_obj = nil;
+            if ([archive_obj addComputePipelineFunctionsWithDescriptor:pipeline_descriptor_obj error:&error_obj]) {
+                archive_dirty = true;
+            } else {
+                GPTOSS_LOG_WARNING("failed to add function %s to pipeline cache: %s",
+                    [[[pipeline_descriptor_obj computeFunction] name] UTF8String],
+                    [[error_obj localizedDescription] UTF8String]);
+            }
+        }
+
+        if (archive_dirty) {
+            // Serialize to a temporary file and atomically replace the cache, as other processes may read it concurrently
+            NSURL* temp_url = [NSURL fileURLWithPath:[NSString stringWithFormat:@"%@.%d.tmp", [archive_url path], (int) getpid()]];
+            NSError* error_obj = nil;
+            if ([archive_obj serializeToURL:temp_url error:&error_obj]) {
+                if (rename([[temp_url path] fileSystemRepresentation], [[archive_url path] fileSystemRepresentation]) != 0) {
+                    GPTOSS_LOG_WARNING("failed to rename pipeline cache to %s: error %d", [[archive_url path] UTF8String], errno);
+                    unlink([[temp_url path] fileSystemRepresentation]);
+                }
+            } else {
+                GPTOSS_LOG_WARNING("failed to save pipeline cache %s: %s",
+                    [[archive_url path] UTF8String], [[error_obj localizedDescription] UTF8String]);
+            }
+        }
+
+        [pipeline_descriptor_objs release];
+        [archive_url release];
+        [archive_obj release];
+        [autorelease_pool drain];
+    });
+}
+
+enum gptoss_status gptoss_metal_function_create_multiple(
     const struct gptoss_metal_library* library,
-    const char* name,
-    struct gptoss_metal_function* function_out)
+    size_t num_functions,
+    const struct gptoss_metal_function_descriptor* function_descriptors)
 {
-    __block NSString* error_string_obj = nil;
-    id<MTLFunction> function_obj = nil;
-    MTLComputePipelineDescriptor* pipeline_descriptor_obj = nil;
-    __block id<MTLComputePipelineState> pipeline_state_obj = nil;
-    dispatch_semaphore_t pipeline_build_semaphore = NULL;
     enum gptoss_status status = gptoss_status_success;
+    id<MTLBinaryArchive> archive_obj = nil;
+    bool archive_loaded = false;
+    NSMutableArray<MTLComputePipelineDescriptor*>* archive_miss_objs = nil;
 
     NSAutoreleasePool* autorelease_pool = [[NSAutoreleasePool alloc] init];
     id<MTLLibrary> library_obj = (id<MTLLibrary>) library->object;
-    NSString* name_obj = [NSString stringWithUTF8String:name];
-    function_obj = [library_obj newFunctionWithName:name_obj];
-    if (function_obj == nil) {
-        GPTOSS_LOG_ERROR("failed to create Metal function %s", name);
-        status = gptoss_status_unsupported_system;
-        goto cleanup;
-    }
     id<MTLDevice> device_obj = [library_obj device];
-    pipeline_descriptor_obj = [[MTLComputePipelineDescriptor alloc] init];
-    [pipeline_descriptor_obj setComputeFunction:function_obj];
-    [pipeline_descriptor_obj setThreadGroupSizeIsMultipleOfThreadExecutionWidth:YES];
-
-    pipeline_build_semaphore = dispatch_semaphore_create(/*value=*/0);
-    [device_obj newComputePipelineStateWithDescriptor:pipeline_descriptor_obj
-                                              options:MTLPipelineOptionNone
-                                    completionHandler:^(id<MTLComputePipelineState> _Nullable new_state,
-                                                        MTLComputePipelineReflection* _Nullable reflection,
-                                                        NSError* _Nullable error_obj) {
-        if (new_state != nil) {
-            pipeline_state_obj = [new_state retain];
-        }
-        if (error_obj != nil) {
-            error_string_obj = [[error_obj localizedDescription] copy];
-        }
-        dispatch_semaphore_signal(pipeline_build_semaphore);
-    }];
-    dispatch_semaphore_wait(pipeline_build_semaphore, DISPATCH_TIME_FOREVER);
-
-    if (pipeline_state_obj == nil) {
-        const char* error_string = "unknown error";
-        if (error_string_obj != nil) {
-            error_string = [error_string_obj UTF8String];
-        }
-        GPTOSS_LOG_ERROR("failed to create Metal compute pipeline state for function %s: %s",
-            name, error_string);
-        status = gptoss_status_unsupported_system;
+
+    id<MTLFunction>* function_objs = calloc(num_functions, sizeof(id<MTLFunction>));
+    MTLComputePipelineDescriptor** pipeline_descriptor_objs = calloc(num_functions, sizeof(MTLComputePipelineDescriptor*));
+    id<MTLComputePipelineState>* pipeline_state_objs = calloc(num_functions, sizeof(id<MTLComputePipelineState>));
+    NSString** error_string_objs = calloc(num_functions, sizeof(NSString*));
+    if (function_objs == NULL || pipeline_descriptor_objs == NULL || pipeline_state_objs == NULL || error_string_objs == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate pipeline state descriptors for %zu functions", num_functions);
+        status = gptoss_status_insufficient_memory;
         goto cleanup;
     }
 
-    // Commit
-    function_out->function_object = function_obj;
-    function_out->pipeline_state_object = pipeline_state_obj;
-    function_out->max_threadgroup_threads = (size_t) [pipeline_state_obj maxTotalThreadsPerThreadgroup];
-    function_out->simdgroup_threads = (size_t) [pipeline_state_obj threadExecutionWidth];
-    function_out->static_threadgroup_memory = (size_t) [pipeline_state_obj staticThreadgroupMemoryLength];
+    NSURL* archive_url = get_pipeline_cache_url(device_obj, library->hash);
+    if (archive_url != nil) {
+        MTLBinaryArchiveDescriptor* archive_descriptor_obj = [[MTLBinaryArchiveDescriptor alloc] init];
+        NSError* error_obj = nil;
+        if ([[NSFileManager defaultManager] fileExistsAtPath:[archive_url path]]) {
+            [archive_descriptor_obj setUrl:archive_url];
+            archive_obj = [device_obj newBinaryArchiveWithDescriptor:archive_descriptor_obj error:&error_obj];
+            if (archive_obj != nil) {
+                archive_loaded = true;
+            } else {
+                GPTOSS_LOG_WARNING("failed to load pipeline cache %s: %s",
+                    [[archive_url path] UTF8String], [[error_obj localizedDescription] UTF8String]);
+                [archive_descriptor_obj setUrl:nil];
+            }
+        }
+        if (archive_obj == nil) {
+            archive_obj = [device_obj newBinaryArchiveWithDescriptor:archive_descriptor_obj error:&error_obj];
+        }
+        [archive_descriptor_obj release];
+    }
 
-    function_obj = nil;
-    pipeline_state_obj = nil;
+    for (size_t i = 0; i < num_functions; i++) {
+        const char* name = function_descriptors[i].name;
+        const size_t num_constants = function_descriptors[i].num_constants;
+        if (num_constants != 0) {
+            MTLFunctionConstantValues* constant_values_obj = [[MTLFunctionConstantValues alloc] init];
+            for (size_t c = 0; c < num_constants; c++) {
+                const struct gptoss_metal_function_constant* constant = &function_descriptors[i].constants[c];
+                [constant_values_obj setConstantValue:&constant->value
+                                                 type:MTLDataTypeUInt
+                                              atIndex:(NSUInteger) constant->index];
+            }
+            NSError* error_obj = nil;
+            function_objs[i] = [library_obj newFunctionWithName:[NSString stringWithUTF8String:name]
+                                                 constantValues:constant_values_obj
+                                                          error:&error_obj];
+            [constant_values_obj release];
+            if (function_objs[i] == nil) {
+                GPTOSS_LOG_ERROR("failed to create specialized Metal function %s: %s",
+                    name, error_obj != nil ? [[error_obj localizedDescription] UTF8String] : "unknown error");
+                status = gptoss_status_unsupported_system;
+                goto cleanup;
+            }
+        } else {
+            function_objs[i] = [library_obj newFunctionWithName:[NSString stringWithUTF8String:name]];
+            if (function_objs[i] == nil) {
+                GPTOSS_LOG_ERROR("failed to create Metal function %s", name);
+                status = gptoss_status_unsupported_system;
+                goto cleanup;
+            }
+        }
 
-cleanup:
-    if (function_obj != nil) {
-        [function_obj release];
+        pipeline_descriptor_objs[i] = [[MTLComputePipelineDescriptor alloc] init];
+        [pipeline_descriptor_objs[i] setComputeFunction:function_objs[i]];
+        [pipeline_descriptor_objs[i] setThreadGroupSizeIsMultipleOfThreadExecutionWidth:YES];
+        if (archive_obj != nil) {
+            [pipeline_descriptor_objs[i] setBinaryArchives:@[archive_obj]];
+        }
+    }
+
+    if (archive_loaded) {
+        // First, try to load all pipeline states from the cache without compilation...
+        build_pipeline_states(device_obj, num_functions, pipeline_descriptor_objs,
+            MTLPipelineOptionFailOnBinaryArchiveMiss, pipeline_state_objs, error_string_objs);
     }
-    if (pipeline_descriptor_obj != nil) {
-        [pipeline_descriptor_obj release];
+    if (archive_obj != nil) {
+        archive_miss_objs = [[NSMutableArray alloc] init];
+        for (size_t i = 0; i < num_functions; i++) {
+            if (pipeline_state_objs[i] == nil) {
+                [archive_miss_objs addObject:pipeline_descriptor_objs[i]];
+            }
+        }
     }
-    if (error_string_obj != nil) {
-        [error_string_obj release];
+    // ...then compile the pipeline states missing from the cache, all concurrently. They are added to the cache after
+    // all pipeline states are created.
+    build_pipeline_states(device_obj, num_functions, pipeline_descriptor_objs,
+        MTLPipelineOptionNone, pipeline_state_objs, error_string_objs);
+
+    for (size_t i = 0; i < num_functions; i++) {
+        if (pipeline_state_objs[i] == nil) {
+            const char* error_string = "unknown error";
+            if (error_string_objs[i] != nil) {
+                error_string = [error_string_objs[i] UTF8String];
+            }
+            GPTOSS_LOG_ERROR("failed to create Metal compute pipeline state for function %s: %s",
+                function_descriptors[i].name, error_string);
+            status = gptoss_status_unsupported_system;
+            goto cleanup;
+        }
     }
-    if (pipeline_build_semaphore != NULL) {
-        dispatch_release(pipeline_build_semaphore);
+
+    if ([archive_miss_objs count] != 0) {
+        save_pipeline_cache_async([archive_obj retain], [archive_url retain], archive_miss_objs);
+        archive_miss_objs = nil;
     }
-    if (autorelease_pool != nil) {
-        [autorelease_pool drain];
+
+    // Commit
+    for (size_t i = 0; i < num_functions; i++) {
+        id<MTLComputePipelineState> pipeline_state_obj = pipeline_state_objs[i];
+        struct gptoss_metal_function* function_out = function_descriptors[i].function_out;
+        function_out->name = function_descriptors[i].name;
+        function_out->function_object = function_objs[i];
+        function_out->pipeline_state_object = pipeline_state_obj;
+        function_out->max_threadgroup_threads = (size_t) [pipeline_state_obj maxTotalThreadsPerThreadgroup];
+        function_out->simdgroup_threads = (size_t) [pipeline_state_obj threadExecutionWidth];
+        function_out->static_threadgroup_memory = (size_t) [pipeline_state_obj staticThreadgroupMemoryLength];
+
+        function_objs[i] = nil;
+        pipeline_state_objs[i] = nil;
+    }
+
+cleanup:
+    for (size_t i = 0; i < num_functions; i++) {
+        if (function_objs != NULL) {
+            [function_objs[i] release];
+        }
+        if (pipeline_descriptor_objs != NULL) {
+            [pipeline_descriptor_objs[i] release];
+        }
+        if (pipeline_state_objs != NULL) {
+            [pipeline_state_objs[i] release];
+        }
+        if (error_string_objs != NULL) {
+            [error_string_objs[i] release];
+        }
     }
+    free(function_objs);
+    free(pipeline_descriptor_objs);
+    free(pipeline_state_objs);
+    free(error_string_objs);
+    [archive_miss_objs release];
+    if (archive_obj != nil) {
+        [archive_obj release];
+    }
+    [autorelease_pool drain];
     return status;
 }
 
+enum gptoss_status gptoss_metal_function_create(
+    const struct gptoss_metal_library* library,
+    const char* name,
+    struct gptoss_metal_function* function_out)
+{
+    const struct gptoss_metal_function_descriptor function_descriptor = {
+        .name = name,
+        .function_out = function_out,
+    };
+    return gptoss_metal_function_create_multiple(library, 1, &function_descriptor);
+}
+
 enum gptoss_status gptoss_metal_function_release(
     struct gptoss_metal_function* function)
 {
@@ -296,6 +583,202 @@ enum gptoss_status gptoss_metal_buffer_release(
     return gptoss_status_success;
 }
 
+enum gptoss_status gptoss_metal_heap_create(
+    const struct gptoss_metal_device* device,
+    size_t size,
+    struct gptoss_metal_heap* heap_out)
+{
+    id<MTLDevice> device_obj = (id<MTLDevice>) device->object;
+    MTLHeapDescriptor* heap_descriptor_obj = [[MTLHeapDescriptor alloc] init];
+    heap_descriptor_obj.type = MTLHeapTypePlacement;
+    heap_descriptor_obj.storageMode = MTLStorageModeShared;
+    // Metal tracks hazards of a tracked heap as a whole, which orders the kernels touching aliased buffers.
+    heap_descriptor_obj.hazardTrackingMode = MTLHazardTrackingModeTracked;
+    heap_descriptor_obj.size = (NSUInteger) size;
+    id<MTLHeap> heap_obj = [device_obj newHeapWithDescriptor:heap_descriptor_obj];
+    [heap_descriptor_obj release];
+    if (heap_obj == nil) {
+        GPTOSS_LOG_ERROR("failed to create Metal heap of size %zu", size);
+        return gptoss_status_unsupported_system;
+    }
+    heap_out->object = (void*) heap_obj;
+    heap_out->size = size;
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_metal_heap_create_buffer(
+    const struct gptoss_metal_heap* heap,
+    size_t offset,
+    size_t size,
+    struct gptoss_metal_buffer* buffer_out)
+{
+    if (heap->object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+    if (offset % GPTOSS_METAL_HEAP_ALIGNMENT != 0 || offset + size > heap->size) {
+        GPTOSS_LOG_ERROR("invalid buffer range [%zu, %zu) in Metal heap of size %zu", offset, offset + size, heap->size);
+        return gptoss_status_invalid_argument;
+    }
+
+    id<MTLHeap> heap_obj = (id<MTLHeap>) heap->object;
+    id<MTLBuffer> buffer_obj = [heap_obj newBufferWithLength:(NSUInteger) size
+                                                     options:MTLResourceStorageModeShared | MTLResourceHazardTrackingModeTracked
+                                                      offset:(NSUInteger) offset];
+    if (buffer_obj == nil) {
+        GPTOSS_LOG_ERROR("failed to create Metal buffer of size %zu at offset %zu in heap", size, offset);
+        return gptoss_status_unsupported_system;
+    }
+    buffer_out->object = (void*) buffer_obj;
+    buffer_out->size = size;
+    buffer_out->ptr = [buffer_obj contents];
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_metal_heap_release(
+    struct gptoss_metal_heap* heap)
+{
+    if (heap->object != NULL) {
+        id<MTLHeap> heap_obj = (id<MTLHeap>) heap->object;
+        [heap_obj release];
+    }
+    memset(heap, 0, sizeof(struct gptoss_metal_heap));
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_metal_residency_set_create(
+    const struct gptoss_metal_device* device,
+    size_t initial_capacity,
+    struct gptoss_metal_residency_set* residency_set_out)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        id<MTLDevice> device_obj = (id<MTLDevice>) device->object;
+        MTLResidencySetDescriptor* residency_set_descriptor_obj = [[MTLResidencySetDescriptor alloc] init];
+        residency_set_descriptor_obj.initialCapacity = (NSUInteger) initial_capacity;
+        NSError* error_obj = nil;
+        id<MTLResidencySet> residency_set_obj =
+            [device_obj newResidencySetWithDescriptor:residency_set_descriptor_obj error:&error_obj];
+        [residency_set_descriptor_obj release];
+        if (residency_set_obj == nil) {
+            GPTOSS_LOG_ERROR("failed to create Metal residency set: %s",
+                error_obj != nil ? [[error_obj localizedDescription] UTF8String] : "unknown error");
+            return gptoss_status_unsupported_system;
+        }
+        residency_set_out->object = (void*) residency_set_obj;
+        return gptoss_status_success;
+    }
+#endif
+    return gptoss_status_unsupported_system;
+}
+
+void gptoss_metal_residency_set_add_buffer(
+    const struct gptoss_metal_residency_set* residency_set,
+    const struct gptoss_metal_buffer* buffer)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (residency_set->object != NULL && buffer->object != NULL) {
+            id<MTLResidencySet> residency_set_obj = (id<MTLResidencySet>) residency_set->object;
+            [residency_set_obj addAllocation:(id<MTLBuffer>) buffer->object];
+        }
+    }
+#endif
+}
+
+void gptoss_metal_residency_set_add_heap(
+    const struct gptoss_metal_residency_set* residency_set,
+    const struct gptoss_metal_heap* heap)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (residency_set->object != NULL && heap->object != NULL) {
+            id<MTLResidencySet> residency_set_obj = (id<MTLResidencySet>) residency_set->object;
+            [residency_set_obj addAllocation:(id<MTLHeap>) heap->object];
+        }
+    }
+#endif
+}
+
+void gptoss_metal_residency_set_remove_buffer(
+    const struct gptoss_metal_residency_set* residency_set,
+    const struct gptoss_metal_buffer* buffer)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (residency_set->object != NULL && buffer->object != NULL) {
+            id<MTLResidencySet> residency_set_obj = (id<MTLResidencySet>) residency_set->object;
+            [residency_set_obj removeAllocation:(id<MTLBuffer>) buffer->object];
+        }
+    }
+#endif
+}
+
+void gptoss_metal_residency_set_commit(
+    const struct gptoss_metal_residency_set* residency_set)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (residency_set->object != NULL) {
+            id<MTLResidencySet> residency_set_obj = (id<MTLResidencySet>) residency_set->object;
+            [residency_set_obj commit];
+        }
+    }
+#endif
+}
+
+enum gptoss_status gptoss_metal_residency_set_release(
+    struct gptoss_metal_residency_set* residency_set)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (residency_set->object != NULL) {
+            id<MTLResidencySet> residency_set_obj = (id<MTLResidencySet>) residency_set->object;
+            [residency_set_obj release];
+        }
+    }
+#endif
+    memset(residency_set, 0, sizeof(struct gptoss_metal_residency_set));
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_metal_shared_event_create(
+    const struct gptoss_metal_device* device,
+    struct gptoss_metal_shared_event* event_out)
+{
+    id<MTLDevice> device_obj = (id<MTLDevice>) device->object;
+    id<MTLSharedEvent> event_obj = [device_obj newSharedEvent];
+    if (event_obj == nil) {
+        GPTOSS_LOG_ERROR("failed to create Metal shared event");
+        return gptoss_status_unsupported_system;
+    }
+    event_out->object = (void*) event_obj;
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_metal_shared_event_signal(
+    const struct gptoss_metal_shared_event* event,
+    uint64_t value)
+{
+    if (event->object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    id<MTLSharedEvent> event_obj = (id<MTLSharedEvent>) event->object;
+    event_obj.signaledValue = value;
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_metal_shared_event_release(
+    struct gptoss_metal_shared_event* event)
+{
+    if (event->object != NULL) {
+        id<MTLSharedEvent> event_obj = (id<MTLSharedEvent>) event->object;
+        [event_obj release];
+    }
+    memset(event, 0, sizeof(struct gptoss_metal_shared_event));
+    return gptoss_status_success;
+}
+
 enum gptoss_status gptoss_metal_command_queue_create(
     const struct gptoss_metal_device* device,
     struct gptoss_metal_command_queue* command_queue_out)
@@ -321,6 +804,34 @@ enum gptoss_status gptoss_metal_command_queue_release(
     return gptoss_status_success;
 }
 
+void gptoss_metal_command_queue_add_residency_set(
+    const struct gptoss_metal_command_queue* command_queue,
+    const struct gptoss_metal_residency_set* residency_set)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (command_queue->object != NULL && residency_set->object != NULL) {
+            id<MTLCommandQueue> command_queue_obj = (id<MTLCommandQueue>) command_queue->object;
+            [command_queue_obj addResidencySet:(id<MTLResidencySet>) residency_set->object];
+        }
+    }
+#endif
+}
+
+void gptoss_metal_command_queue_remove_residency_set(
+    const struct gptoss_metal_command_queue* command_queue,
+    const struct gptoss_metal_residency_set* residency_set)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (command_queue->object != NULL && residency_set->object != NULL) {
+            id<MTLCommandQueue> command_queue_obj = (id<MTLCommandQueue>) command_queue->object;
+            [command_queue_obj removeResidencySet:(id<MTLResidencySet>) residency_set->object];
+        }
+    }
+#endif
+}
+
 enum gptoss_status gptoss_metal_command_buffer_create(
     const struct gptoss_metal_command_queue* command_queue,
     struct gptoss_metal_command_buffer* command_buffer_out)
@@ -333,9 +844,82 @@ enum gptoss_status gptoss_metal_command_buffer_create(
     }
     [command_buffer_obj retain];
     command_buffer_out->object = (void*) command_buffer_obj;
+    command_buffer_out->compute_encoder_object = NULL;
+    command_buffer_out->concurrent_dispatch = false;
+    command_buffer_out->overlap_next_launch = false;
+    command_buffer_out->num_encoder_dispatches = 0;
     return gptoss_status_success;
 }
 
+void gptoss_metal_command_buffer_use_residency_set(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_residency_set* residency_set)
+{
+#if GPTOSS_METAL_RESIDENCY_SETS
+    if (@available(macOS 15.0, *)) {
+        if (command_buffer->object != NULL && residency_set->object != NULL) {
+            id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+            [command_buffer_obj useResidencySet:(id<MTLResidencySet>) residency_set->object];
+        }
+    }
+#endif
+}
+
+// Ends the compute encoder shared by consecutive kernel launches, if one is open. Command buffers are passed around by
+// const pointer, but never live in const storage: the open encoder is encoding state rather than part of the handle.
+static void end_compute_encoder(
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    struct gptoss_metal_command_buffer* mutable_command_buffer = (struct gptoss_metal_command_buffer*) command_buffer;
+    if (mutable_command_buffer->compute_encoder_object != NULL) {
+        id<MTLComputeCommandEncoder> command_encoder_obj = (id<MTLComputeCommandEncoder>) mutable_command_buffer->compute_encoder_object;
+        [command_encoder_obj endEncoding];
+        [command_encoder_obj release];
+        mutable_command_buffer->compute_encoder_object = NULL;
+        mutable_command_buffer->num_encoder_dispatches = 0;
+    }
+}
+
+// Returns the compute encoder shared by consecutive kernel launches, opening it if necessary. Its dispatches run
+// serially, like dispatches in separate encoders, but without the CPU and GPU overhead of an encoder per launch, unless
+// the command buffer is in concurrent dispatch mode.
+static id<MTLComputeCommandEncoder> get_compute_encoder(
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    struct gptoss_metal_command_buffer* mutable_command_buffer = (struct gptoss_metal_command_buffer*) command_buffer;
+    if (mutable_command_buffer->compute_encoder_object == NULL) {
+        id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+        id<MTLComputeCommandEncoder> command_encoder_obj =
+            [command_buffer_obj computeCommandEncoderWithDispatchType:
+                command_buffer->concurrent_dispatch ? MTLDispatchTypeConcurrent : MTLDispatchTypeSerial];
+        [command_encoder_obj retain];
+        mutable_command_buffer->compute_encoder_object = (void*) command_encoder_obj;
+    }
+    return (id<MTLComputeCommandEncoder>) mutable_command_buffer->compute_encoder_object;
+}
+
+void gptoss_metal_command_buffer_end_compute_encoder(
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    end_compute_encoder(command_buffer);
+}
+
+void gptoss_metal_command_buffer_enable_concurrent_dispatch(
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    if (!command_buffer->concurrent_dispatch) {
+        end_compute_encoder(command_buffer);
+        command_buffer->concurrent_dispatch = true;
+    }
+}
+
+void gptoss_metal_command_buffer_overlap_next_launch(
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    struct gptoss_metal_command_buffer* mutable_command_buffer = (struct gptoss_metal_command_buffer*) command_buffer;
+    mutable_command_buffer->overlap_next_launch = true;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_fill_buffer(
     const struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_buffer* buffer,
@@ -353,6 +937,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_fill_buffer(
     id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
     id<MTLBuffer> buffer_obj = (id<MTLBuffer>) buffer->object;
 
+    end_compute_encoder(command_buffer);
     id<MTLBlitCommandEncoder> command_encoder_obj = [command_buffer_obj blitCommandEncoder];
 
     const NSRange range = NSMakeRange((NSUInteger) offset, (NSUInteger) size);
@@ -384,6 +969,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_copy_buffer(
     id<MTLBuffer> input_buffer_obj = (id<MTLBuffer>) input_buffer->object;
     id<MTLBuffer> output_buffer_obj = (id<MTLBuffer>) output_buffer->object;
 
+    end_compute_encoder(command_buffer);
     id<MTLBlitCommandEncoder> command_encoder_obj = [command_buffer_obj blitCommandEncoder];
 
     [command_encoder_obj copyFromBuffer:input_buffer_obj sourceOffset:(NSUInteger) input_offset
@@ -417,7 +1003,40 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
     id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
     id<MTLComputePipelineState> pipeline_state_obj = (id<MTLComputePipelineState>) function->pipeline_state_object;
 
-    id<MTLComputeCommandEncoder> command_encoder_obj = [command_buffer_obj computeCommandEncoder];
+    struct gptoss_metal_command_buffer* mutable_command_buffer = (struct gptoss_metal_command_buffer*) command_buffer;
+    id<MTLComputeCommandEncoder> command_encoder_obj = nil;
+    struct gptoss_metal_command_buffer_timings* timings = command_buffer->timings;
+    if (timings != NULL && timings->num_launches < timings->max_launches) {
+        const size_t launch_index = timings->num_launches++;
+        timings->launches[launch_index] = (struct gptoss_metal_launch_timing) {
+            .kernel_name = function->name,
+            .tag = timings->tag,
+        };
+
+        MTLComputePassDescriptor* compute_pass_descriptor_obj = [MTLComputePassDescriptor computePassDescriptor];
+        MTLComputePassSampleBufferAttachmentDescriptor* attachment_obj = compute_pass_descriptor_obj.sampleBufferAttachments[0];
+        attachment_obj.sampleBuffer = (id<MTLCounterSampleBuffer>) timings->sample_buffer_object;
+        attachment_obj.startOfEncoderSampleIndex = 2 * launch_index;
+        attachment_obj.endOfEncoderSampleIndex = 2 * launch_index + 1;
+        // Timestamps are sampled at encoder boundaries, so timed launches get an encoder each
+        end_compute_encoder(command_buffer);
+        command_encoder_obj = [command_buffer_obj computeCommandEncoderWithDescriptor:compute_pass_descriptor_obj];
+    } else {
+        if (timings != NULL) {
+            timings->num_untimed_launches += 1;
+        }
+        command_encoder_obj = get_compute_encoder(command_buffer);
+
+        // Dispatches in a concurrent encoder are ordered only by barriers. The first dispatch of an encoder is ordered
+        // after the previous encoders by hazard tracking.
+        if (command_buffer->concurrent_dispatch && command_buffer->num_encoder_dispatches != 0 &&
+            !command_buffer->overlap_next_launch)
+        {
+            [command_encoder_obj memoryBarrierWithScope:MTLBarrierScopeBuffers];
+        }
+        mutable_command_buffer->num_encoder_dispatches += 1;
+    }
+    mutable_command_buffer->overlap_next_launch = false;
 
     // Set kernel arguments
     [command_encoder_obj setComputePipelineState:pipeline_state_obj];
@@ -435,11 +1054,29 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
     const MTLSize threadgroup_size = MTLSizeMake(threadgroup_size_x, threadgroup_size_y, threadgroup_size_z);
     const MTLSize num_threadgroups = MTLSizeMake(num_threadgroups_x, num_threadgroups_y, num_threadgroups_z);
     [command_encoder_obj dispatchThreadgroups:num_threadgroups threadsPerThreadgroup:threadgroup_size];
-    [command_encoder_obj endEncoding];
+    if (command_encoder_obj != (id<MTLComputeCommandEncoder>) command_buffer->compute_encoder_object) {
+        [command_encoder_obj endEncoding];
+    }
 
     return gptoss_status_success;
 }
 
+enum gptoss_status gptoss_metal_command_buffer_encode_wait_event(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_shared_event* event,
+    uint64_t value)
+{
+    if (command_buffer->object == NULL || event->object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    id<MTLSharedEvent> event_obj = (id<MTLSharedEvent>) event->object;
+    end_compute_encoder(command_buffer);
+    [command_buffer_obj encodeWaitForEvent:event_obj value:value];
+    return gptoss_status_success;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_commit(
     const struct gptoss_metal_command_buffer* command_buffer)
 {
@@ -448,6 +1085,7 @@ enum gptoss_status gptoss_metal_command_buffer_commit(
     }
 
     id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    end_compute_encoder(command_buffer);
     [command_buffer_obj commit];
     return gptoss_status_success;
 }
@@ -470,13 +1108,160 @@ enum gptoss_status gptoss_metal_command_buffer_wait_completion(
     return gptoss_status_success;
 }
 
+enum gptoss_status gptoss_metal_command_buffer_get_gpu_timestamps(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    double* gpu_start_time_out,
+    double* gpu_end_time_out)
+{
+    if (command_buffer->object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    *gpu_start_time_out = (double) [command_buffer_obj GPUStartTime];
+    *gpu_end_time_out = (double) [command_buffer_obj GPUEndTime];
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_metal_command_buffer_enable_timing(
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t max_launches)
+{
+    if (command_buffer->object == NULL || command_buffer->timings != NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    id<MTLDevice> device_obj = [command_buffer_obj device];
+    if (![device_obj supportsCounterSampling:MTLCounterSamplingPointAtStageBoundary]) {
+        GPTOSS_LOG_ERROR("Metal device does not support timestamp sampling at compute encoder boundaries");
+        return gptoss_status_unsupported_system;
+    }
+
+    id<MTLCounterSet> timestamp_counter_set_obj = nil;
+    for (id<MTLCounterSet> counter_set_obj in [device_obj counterSets]) {
+        if ([[counter_set_obj name] isEqualToString:MTLCommonCounterSetTimestamp]) {
+            timestamp_counter_set_obj = counter_set_obj;
+            break;
+        }
+    }
+    if (timestamp_counter_set_obj == nil) {
+        GPTOSS_LOG_ERROR("Metal device does not expose a timestamp counter set");
+        return gptoss_status_unsupported_system;
+    }
+
+    struct gptoss_metal_command_buffer_timings* timings = calloc(1, sizeof(struct gptoss_metal_command_buffer_timings));
+    if (timings == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate command buffer timings");
+        return gptoss_status_insufficient_memory;
+    }
+    timings->launches = calloc(max_launches, sizeof(struct gptoss_metal_launch_timing));
+    if (timings->launches == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate timings for %zu kernel launches", max_launches);
+        free(timings);
+        return gptoss_status_insufficient_memory;
+    }
+
+    MTLCounterSampleBufferDescriptor* sample_buffer_descriptor_obj = [[MTLCounterSampleBufferDescriptor alloc] init];
+    sample_buffer_descriptor_obj.counterSet = timestamp_counter_set_obj;
+    sample_buffer_descriptor_obj.storageMode = MTLStorageModeShared;
+    sample_buffer_descriptor_obj.sampleCount = 2 * max_launches;
+    NSError* error_obj = nil;
+    id<MTLCounterSampleBuffer> sample_buffer_obj =
+        [device_obj newCounterSampleBufferWithDescriptor:sample_buffer_descriptor_obj error:&error_obj];
+    [sample_buffer_descriptor_obj release];
+    if (sample_buffer_obj == nil) {
+        GPTOSS_LOG_ERROR("failed to create Metal counter sample buffer for %zu samples: %s",
+            2 * max_launches, [[error_obj localizedDescription] UTF8String]);
+        free(timings->launches);
+        free(timings);
+        return gptoss_status_unsupported_system;
+    }
+
+    MTLTimestamp cpu_timestamp = 0, gpu_timestamp = 0;
+    [device_obj sampleTimestamps:&cpu_timestamp gpuTimestamp:&gpu_timestamp];
+    timings->sample_buffer_object = (void*) sample_buffer_obj;
+    timings->cpu_timestamp = (uint64_t) cpu_timestamp;
+    timings->gpu_timestamp = (uint64_t) gpu_timestamp;
+    timings->max_launches = max_launches;
+    command_buffer->timings = timings;
+    return gptoss_status_success;
+}
+
+void gptoss_metal_command_buffer_set_timing_tag(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    uint32_t tag)
+{
+    if (command_buffer->timings != NULL) {
+        command_buffer->timings->tag = tag;
+    }
+}
+
+enum gptoss_status gptoss_metal_command_buffer_get_launch_timings(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_launch_timing** launches_out,
+    size_t* num_launches_out,
+    size_t* num_untimed_launches_out)
+{
+    struct gptoss_metal_command_buffer_timings* timings = command_buffer->timings;
+    if (command_buffer->object == NULL || timings == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    if ([command_buffer_obj status] != MTLCommandBufferStatusCompleted) {
+        return gptoss_status_invalid_state;
+    }
+
+    if (timings->num_launches != 0) {
+        // GPU timestamps are in device-specific units: calibrate them against CPU timestamps (nanoseconds) sampled
+        // before encoding and now.
+        MTLTimestamp cpu_timestamp = 0, gpu_timestamp = 0;
+        [[command_buffer_obj device] sampleTimestamps:&cpu_timestamp gpuTimestamp:&gpu_timestamp];
+        double seconds_per_tick = 1.0e-9;
+        if (gpu_timestamp > timings->gpu_timestamp && cpu_timestamp > timings->cpu_timestamp) {
+            seconds_per_tick = (double) (cpu_timestamp - timings->cpu_timestamp) /
+                (double) (gpu_timestamp - timings->gpu_timestamp) * 1.0e-9;
+        }
+
+        NSAutoreleasePool* autorelease_pool = [[NSAutoreleasePool alloc] init];
+        id<MTLCounterSampleBuffer> sample_buffer_obj = (id<MTLCounterSampleBuffer>) timings->sample_buffer_object;
+        NSData* samples_obj = [sample_buffer_obj resolveCounterRange:NSMakeRange(0, 2 * timings->num_launches)];
+        if (samples_obj == nil) {
+            GPTOSS_LOG_ERROR("failed to resolve Metal counter samples");
+            [autorelease_pool drain];
+            return gptoss_status_unsupported_system;
+        }
+        const MTLCounterResultTimestamp* samples = (const MTLCounterResultTimestamp*) [samples_obj bytes];
+        for (size_t i = 0; i < timings->num_launches; i++) {
+            const uint64_t start = samples[2 * i].timestamp;
+            const uint64_t end = samples[2 * i + 1].timestamp;
+            const bool valid = start != MTLCounterErrorValue && end != MTLCounterErrorValue && end >= start;
+            timings->launches[i].gpu_seconds = valid ? (double) (end - start) * seconds_per_tick : 0.0;
+        }
+        [autorelease_pool drain];
+    }
+
+    *launches_out = timings->launches;
+    *num_launches_out = timings->num_launches;
+    *num_untimed_launches_out = timings->num_untimed_launches;
+    return gptoss_status_success;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_release(
     struct gptoss_metal_command_buffer* command_buffer)
 {
+    end_compute_encoder(command_buffer);
     if (command_buffer->object != NULL) {
         id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
         [command_buffer_obj release];
     }
+    if (command_buffer->timings != NULL) {
+        id<MTLCounterSampleBuffer> sample_buffer_obj = (id<MTLCounterSampleBuffer>) command_buffer->timings->sample_buffer_object;
+        [sample_buffer_obj release];
+        free(command_buffer->timings->launches);
+        free(command_buffer->timings);
+    }
     memset(command_buffer, 0, sizeof(struct gptoss_metal_command_buffer));
     return gptoss_status_success;
 }
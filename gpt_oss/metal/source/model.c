@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -7,6 +8,7 @@
 
 #include <errno.h>  // errno, EISDIR, ENOENT, ENOTDIR
 #include <fcntl.h>  // open
+#include <mach/mach_time.h>  // mach_continuous_time, mach_timebase_info
 #include <mach/vm_page_size.h>  // vm_page_size
 #include <sys/mman.h>  // mmap, PROT_READ, MAP_PRIVATE
 #include <sys/stat.h>  // fstat, stat
@@ -38,6 +40,44 @@ static size_t round_down_to_page_size(size_t bytes) {
     return bytes & ~page_size_mask;
 }
 
+// FNV-1a hash of size bytes, continuing from hash.
+static uint64_t hash_bytes(
+    uint64_t hash,
+    const void* data,
+    size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+// Hashes the first and the last GPTOSS_WEIGHTS_FINGERPRINT_SAMPLE_SIZE bytes of a weight region.
+static uint64_t hash_weight_region(
+    uint64_t hash,
+    const char* region_ptr,
+    size_t region_size)
+{
+    const size_t sample_size = math_min(region_size, GPTOSS_WEIGHTS_FINGERPRINT_SAMPLE_SIZE);
+    hash = hash_bytes(hash, region_ptr, sample_size);
+    return hash_bytes(hash, region_ptr + region_size - sample_size, sample_size);
+}
+
+// Initialized once, as models may be created on several threads at a time.
+static pthread_once_t timebase_info_once = PTHREAD_ONCE_INIT;
+static mach_timebase_info_data_t timebase_info;
+
+static void init_timebase_info(void) {
+    mach_timebase_info(&timebase_info);
+}
+
+static double mach_timestamp_diff_to_seconds(uint64_t start_timestamp, uint64_t end_timestamp) {
+    pthread_once(&timebase_info_once, init_timebase_info);
+    const uint64_t elapsed_mach_time = end_timestamp - start_timestamp;
+    return ((double) elapsed_mach_time * (double) timebase_info.numer) / ((double) timebase_info.denom * 1.0e+9);
+}
+
 static enum gptoss_status read_fd(int fd, void* data, size_t size, const char* path) {
     assert(fd != -1);
     assert(data != NULL);
@@ -77,10 +117,335 @@ static void prefetch_fd(int fd, size_t offset, size_t size, const char* path) {
     } while (size != 0);
 }
 
+// Marks a chunk as paged in, and signals the weight regions that became ready.
+static void complete_weight_chunk(struct gptoss_model* model, size_t chunk) {
+    struct gptoss_weight_loader* loader = &model->weight_loader;
+    pthread_mutex_lock(&loader->mutex);
+    loader->chunk_done[chunk] = true;
+    while (loader->num_done_chunks < loader->num_chunks && loader->chunk_done[loader->num_done_chunks]) {
+        loader->num_done_chunks += 1;
+    }
+    const size_t ready_size = math_min(loader->num_done_chunks * (size_t) GPTOSS_WEIGHT_LOADER_CHUNK_SIZE, model->mapping_size);
+    const size_t old_num_ready_regions = atomic_load_explicit(&loader->num_ready_regions, memory_order_relaxed);
+    size_t num_ready_regions = old_num_ready_regions;
+    while (num_ready_regions < loader->num_regions && loader->region_ends[num_ready_regions] <= ready_size) {
+        num_ready_regions += 1;
+    }
+    if (num_ready_regions != old_num_ready_regions) {
+        atomic_store_explicit(&loader->num_ready_regions, num_ready_regions, memory_order_release);
+        gptoss_metal_shared_event_signal(&loader->event, (uint64_t) num_ready_regions);
+        pthread_cond_broadcast(&loader->ready_cond);
+    }
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+static void* weight_loader_thread(void* arg) {
+    struct gptoss_model* model = (struct gptoss_model*) arg;
+    struct gptoss_weight_loader* loader = &model->weight_loader;
+    const size_t page_size = (size_t) vm_page_size;
+    while (!atomic_load_explicit(&loader->abort, memory_order_relaxed)) {
+        const size_t chunk = atomic_fetch_add_explicit(&loader->next_chunk, 1, memory_order_relaxed);
+        if (chunk >= loader->num_chunks) {
+            break;
+        }
+
+        const size_t offset = chunk * (size_t) GPTOSS_WEIGHT_LOADER_CHUNK_SIZE;
+        const size_t size = math_min((size_t) GPTOSS_WEIGHT_LOADER_CHUNK_SIZE, model->mapping_size - offset);
+        char* ptr = (char*) model->mapping_ptr + offset;
+        prefetch_fd(loader->fd, loader->file_offset + offset, size, "model file");
+        if (mlock(ptr, size) != 0) {
+            if (!atomic_exchange_explicit(&loader->lock_failed, true, memory_order_relaxed)) {
+                GPTOSS_LOG_WARNING("mlock(size=%zu) for model weights failed with error %d", size, errno);
+            }
+            // Page in without locking
+            for (size_t i = 0; i < size; i += page_size) {
+                (void) *(volatile const char*) (ptr + i);
+            }
+        } else {
+            atomic_store_explicit(&loader->lock_succeeded, true, memory_order_relaxed);
+        }
+        complete_weight_chunk(model, chunk);
+    }
+    return NULL;
+}
+
+// Starts paging in the weight mapping in the background. Weight regions end at the given offsets of the mapping.
+static enum gptoss_status start_weight_loader(
+    struct gptoss_model* model,
+    int fd,
+    size_t file_offset,
+    size_t num_regions,
+    const size_t* region_ends)
+{
+    struct gptoss_weight_loader* loader = &model->weight_loader;
+    loader->num_chunks = math_ceil_div(model->mapping_size, (size_t) GPTOSS_WEIGHT_LOADER_CHUNK_SIZE);
+    loader->chunk_done = calloc(loader->num_chunks, sizeof(bool));
+    loader->region_ends = malloc(num_regions * sizeof(size_t));
+    if (loader->chunk_done == NULL || loader->region_ends == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate weight loader state for %zu chunks", loader->num_chunks);
+        return gptoss_status_insufficient_memory;
+    }
+    memcpy(loader->region_ends, region_ends, num_regions * sizeof(size_t));
+    loader->num_regions = num_regions;
+    loader->file_offset = file_offset;
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->ready_cond, NULL);
+
+    enum gptoss_status status = gptoss_metal_shared_event_create(&model->device, &loader->event);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    loader->fd = dup(fd);
+    if (loader->fd == -1) {
+        GPTOSS_LOG_ERROR("failed to duplicate model file descriptor: error %d", errno);
+        return gptoss_status_io_error;
+    }
+    atomic_store_explicit(&loader->num_ready_regions, 0, memory_order_relaxed);
+
+    for (size_t i = 0; i < GPTOSS_WEIGHT_LOADER_THREADS; i++) {
+        const int error = pthread_create(&loader->threads[i], NULL, weight_loader_thread, model);
+        if (error != 0) {
+            GPTOSS_LOG_WARNING("failed to start weight loader thread #%zu: error %d", i, error);
+            break;
+        }
+        loader->num_threads += 1;
+    }
+    if (loader->num_threads == 0) {
+        // Load synchronously instead
+        weight_loader_thread(model);
+    }
+    return gptoss_status_success;
+}
+
+// Waits until all weight regions are ready.
+static void wait_for_weight_loader(struct gptoss_model* model) {
+    struct gptoss_weight_loader* loader = &model->weight_loader;
+    if (loader->num_regions == 0) {
+        return;
+    }
+    pthread_mutex_lock(&loader->mutex);
+    while (atomic_load_explicit(&loader->num_ready_regions, memory_order_relaxed) < loader->num_regions) {
+        pthread_cond_wait(&loader->ready_cond, &loader->mutex);
+    }
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+// Stops the weight loader threads, if any, and releases the loader state.
+static void stop_weight_loader(struct gptoss_model* model) {
+    struct gptoss_weight_loader* loader = &model->weight_loader;
+    atomic_store_explicit(&loader->abort, true, memory_order_relaxed);
+    for (size_t i = 0; i < loader->num_threads; i++) {
+        pthread_join(loader->threads[i], NULL);
+    }
+    if (atomic_load_explicit(&loader->lock_succeeded, memory_order_relaxed)) {
+        model->lock_memory = true;
+    }
+    if (loader->num_regions != 0) {
+        pthread_cond_destroy(&loader->ready_cond);
+        pthread_mutex_destroy(&loader->mutex);
+    }
+    if (loader->fd != -1) {
+        close(loader->fd);
+    }
+    gptoss_metal_shared_event_release(&loader->event);
+    free(loader->chunk_done);
+    free(loader->region_ends);
+}
+
+static enum gptoss_status build_tokenizer_offsets(struct gptoss_tokenizer* tokenizer, size_t tokens_size) {
+    uint32_t* offsets = malloc(tokenizer->num_text_tokens * sizeof(uint32_t));
+    if (offsets == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for tokenizer offset table",
+            tokenizer->num_text_tokens * sizeof(uint32_t));
+        return gptoss_status_insufficient_memory;
+    }
+
+    size_t offset = 0;
+    for (uint32_t t = 0; t < tokenizer->num_text_tokens; t++) {
+        if (tokens_size - offset < sizeof(uint16_t)) {
+            GPTOSS_LOG_ERROR("tokenizer data is truncated at text token %" PRIu32, t);
+            free(offsets);
+            return gptoss_status_invalid_argument;
+        }
+        // Reading unaligned uint16_t
+        uint16_t token_length;
+        memcpy(&token_length, tokenizer->tokens_ptr + offset, sizeof(token_length));
+        if (token_length == 0 || tokens_size - offset - sizeof(uint16_t) < (size_t) token_length) {
+            GPTOSS_LOG_ERROR("invalid length %" PRIu16 " of text token %" PRIu32, token_length, t);
+            free(offsets);
+            return gptoss_status_invalid_argument;
+        }
+        offsets[t] = (uint32_t) offset;
+        offset += sizeof(uint16_t) + (size_t) token_length;
+    }
+    tokenizer->token_offsets = offsets;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status build_tokenizer_trie(struct gptoss_tokenizer* tokenizer, size_t tokens_size) {
+    assert(tokenizer->token_offsets != NULL);
+
+    // Each trie node (except the root) corresponds to at least one byte of token data, so the number of nodes is
+    // bounded by the size of the token table.
+    const size_t max_trie_nodes = tokens_size + 1;
+    struct gptoss_tokenizer_trie_node* nodes = malloc(max_trie_nodes * sizeof(struct gptoss_tokenizer_trie_node));
+    if (nodes == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for tokenizer trie",
+            max_trie_nodes * sizeof(struct gptoss_tokenizer_trie_node));
+        return gptoss_status_insufficient_memory;
+    }
+    memset(tokenizer->trie_root_children, 0, sizeof(tokenizer->trie_root_children));
+    // Node 0 is reserved as the "no node" marker
+    nodes[0] = (struct gptoss_tokenizer_trie_node) { .token_id = UINT32_MAX };
+    size_t num_nodes = 1;
+
+    for (uint32_t t = 0; t < tokenizer->num_text_tokens; t++) {
+        const char* tokens = tokenizer->tokens_ptr + tokenizer->token_offsets[t];
+        // Reading unaligned uint16_t
+        uint16_t token_length;
+        memcpy(&token_length, tokens, sizeof(token_length));
+        tokens += sizeof(uint16_t);
+
+        uint32_t* link = &tokenizer->trie_root_children[(uint8_t) tokens[0]];
+        for (uint16_t i = 0; ; ) {
+            const uint8_t byte = (uint8_t) tokens[i];
+            while (*link != 0 && nodes[*link].byte != byte) {
+                link = &nodes[*link].next_sibling;
+            }
+            if (*link == 0) {
+                assert(num_nodes < max_trie_nodes);
+                nodes[num_nodes] = (struct gptoss_tokenizer_trie_node) {
+                    .token_id = UINT32_MAX,
+                    .byte = byte,
+                };
+                *link = (uint32_t) num_nodes++;
+            }
+            struct gptoss_tokenizer_trie_node* node = &nodes[*link];
+            if (++i == token_length) {
+                // On duplicate tokens, keep the one with the lowest ID
+                if (node->token_id == UINT32_MAX) {
+                    node->token_id = t;
+                }
+                break;
+            }
+            link = &node->first_child;
+        }
+    }
+
+    // Release the unused tail of the allocation
+    struct gptoss_tokenizer_trie_node* shrunk_nodes = realloc(nodes, num_nodes * sizeof(struct gptoss_tokenizer_trie_node));
+    if (shrunk_nodes != NULL) {
+        nodes = shrunk_nodes;
+    }
+    tokenizer->trie_nodes = nodes;
+    tokenizer->num_trie_nodes = num_nodes;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status build_tokenizer_hash_table(struct gptoss_tokenizer* tokenizer) {
+    assert(tokenizer->token_offsets != NULL);
+
+    // Keep the load factor at or below 1/2
+    size_t num_slots = 1;
+    while (num_slots < 2 * (size_t) tokenizer->num_text_tokens) {
+        num_slots *= 2;
+    }
+    uint32_t* table = malloc(num_slots * sizeof(uint32_t));
+    if (table == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for tokenizer hash table", num_slots * sizeof(uint32_t));
+        return gptoss_status_insufficient_memory;
+    }
+    memset(table, 0xFF, num_slots * sizeof(uint32_t));
+    const uint32_t mask = (uint32_t) (num_slots - 1);
+
+    for (uint32_t t = 0; t < tokenizer->num_text_tokens; t++) {
+        const char* token_ptr = tokenizer->tokens_ptr + tokenizer->token_offsets[t];
+        // Reading unaligned uint16_t
+        uint16_t token_length;
+        memcpy(&token_length, token_ptr, sizeof(token_length));
+        token_ptr += sizeof(uint16_t);
+
+        uint32_t slot = (uint32_t) gptoss_tokenizer_hash(token_ptr, token_length) & mask;
+        for (;; slot = (slot + 1) & mask) {
+            const uint32_t other_token = table[slot];
+            if (other_token == UINT32_MAX) {
+                table[slot] = t;
+                break;
+            }
+            const char* other_token_ptr = tokenizer->tokens_ptr + tokenizer->token_offsets[other_token];
+            uint16_t other_token_length;
+            memcpy(&other_token_length, other_token_ptr, sizeof(other_token_length));
+            if (other_token_length == token_length &&
+                memcmp(other_token_ptr + sizeof(uint16_t), token_ptr, token_length) == 0)
+            {
+                // On duplicate tokens, keep the one with the lowest ID
+                break;
+            }
+        }
+    }
+    tokenizer->token_hash_table = table;
+    tokenizer->token_hash_mask = mask;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status create_tokenizer_cache(struct gptoss_tokenizer* tokenizer) {
+    const size_t cache_size = GPTOSS_TOKENIZER_CACHE_SHARDS * sizeof(struct gptoss_tokenizer_cache_shard);
+    struct gptoss_tokenizer_cache_shard* shards = malloc(cache_size);
+    if (shards == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for tokenizer word cache", cache_size);
+        return gptoss_status_insufficient_memory;
+    }
+    for (size_t i = 0; i < GPTOSS_TOKENIZER_CACHE_SHARDS; i++) {
+        struct gptoss_tokenizer_cache_shard* shard = &shards[i];
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->lru_head = UINT16_MAX;
+        shard->lru_tail = UINT16_MAX;
+        shard->num_entries = 0;
+        memset(shard->buckets, 0xFF, sizeof(shard->buckets));
+    }
+    tokenizer->cache_shards = shards;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status create_model_from_file(
+    const char* path,
+    gptoss_model_t* model_out,
+    size_t max_batch_tokens,
+    size_t expert_budget_bytes,
+    bool lazy);
+
 enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     const char* path,
     gptoss_model_t* model_out,
     size_t max_batch_tokens)
+{
+    return create_model_from_file(path, model_out, max_batch_tokens, /*expert_budget_bytes=*/0, /*lazy=*/false);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file_lazy(
+    const char* path,
+    gptoss_model_t* model_out,
+    size_t max_batch_tokens)
+{
+    return create_model_from_file(path, model_out, max_batch_tokens, /*expert_budget_bytes=*/0, /*lazy=*/true);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file_with_expert_budget(
+    const char* path,
+    gptoss_model_t* model_out,
+    size_t max_batch_tokens,
+    size_t expert_budget_bytes)
+{
+    return create_model_from_file(path, model_out, max_batch_tokens, expert_budget_bytes, /*lazy=*/false);
+}
+
+static enum gptoss_status create_model_from_file(
+    const char* path,
+    gptoss_model_t* model_out,
+    size_t max_batch_tokens,
+    size_t expert_budget_bytes,
+    bool lazy)
 {
     *model_out = NULL;
 
@@ -89,6 +454,7 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     struct gptoss_tokenizer* tokenizer = NULL;
     int fd = -1;
     size_t file_offset = 0;
+    const uint64_t load_start_time = mach_continuous_time();
 
     fd = open(path, O_RDONLY);
     if (fd == -1) {
@@ -159,11 +525,46 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     }
     file_offset += sizeof(layout_uuid);
 
-    if (!gptoss_is_applegpu_layout_uuid(&layout_uuid)) {
+    uint32_t expert_weight_layout = GPTOSS_EXPERT_WEIGHT_LAYOUT_ROW_MAJOR;
+    bool i8_unembedding = false;
+    if (gptoss_is_applegpu_i8_unembedding_layout_uuid(&layout_uuid)) {
+        i8_unembedding = true;
+    } else if (gptoss_is_applegpu_tiled_i8_unembedding_layout_uuid(&layout_uuid)) {
+        expert_weight_layout = GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED;
+        i8_unembedding = true;
+    } else if (gptoss_is_applegpu_tiled_layout_uuid(&layout_uuid)) {
+        expert_weight_layout = GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED;
+    } else if (!gptoss_is_applegpu_layout_uuid(&layout_uuid)) {
         GPTOSS_LOG_ERROR("unsupported layout UUID " UUID_FORMAT, UUID_ARGS(layout_uuid));
         status = gptoss_status_invalid_argument;
         goto cleanup;
     }
+    if (expert_weight_layout == GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED) {
+        // Tiles span GPTOSS_MF4_TILE_ROWS rows of every expert weight matrix
+        if ((2 * model_header.mlp_dim) % GPTOSS_MF4_TILE_ROWS != 0 || model_header.embedding_dim % GPTOSS_MF4_TILE_ROWS != 0) {
+            GPTOSS_LOG_ERROR("tiled layout requires MLP dimension %" PRIu32 " and embedding dimension %" PRIu32 " to be multiples of %d",
+                model_header.mlp_dim, model_header.embedding_dim, GPTOSS_MF4_TILE_ROWS);
+            status = gptoss_status_invalid_argument;
+            goto cleanup;
+        }
+    }
+
+    // Kernels are specialized to the model shape, within these limits
+    if (model_header.num_experts > GPTOSS_TOPK_MAX_EXPERTS ||
+        model_header.num_active_experts == 0 || model_header.num_active_experts > GPTOSS_MAX_ACTIVE_EXPERTS ||
+        model_header.num_active_experts > model_header.num_experts)
+    {
+        GPTOSS_LOG_ERROR("unsupported MoE configuration: %" PRIu32 " active experts out of %" PRIu32 " experts",
+            model_header.num_active_experts, model_header.num_experts);
+        status = gptoss_status_unsupported_argument;
+        goto cleanup;
+    }
+    if (model_header.head_dim != 64 || model_header.num_heads != model_header.num_kv_heads * 8) {
+        GPTOSS_LOG_ERROR("unsupported attention configuration: %" PRIu32 " Q heads and %" PRIu32 " KV heads of dimension %" PRIu32,
+            model_header.num_heads, model_header.num_kv_heads, model_header.head_dim);
+        status = gptoss_status_unsupported_argument;
+        goto cleanup;
+    }
 
     const size_t model_size = sizeof(struct gptoss_model) + model_header.num_blocks * sizeof(struct gptoss_metal_buffer);
     model = malloc(model_size);
@@ -175,12 +576,18 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     memset(model, 0, model_size);
 
     atomic_store_explicit(&model->ref_count, 1, memory_order_relaxed);
+    pthread_mutex_init(&model->lock, NULL);
+    pthread_rwlock_init(&model->kvcache_pool_lock, NULL);
+    model->weight_loader.fd = -1;
+    atomic_store_explicit(&model->weight_loader.num_ready_regions, SIZE_MAX, memory_order_relaxed);
     model->context_length = model_header.context_length;
     model->num_blocks = model_header.num_blocks;
     model->num_experts = model_header.num_experts;
     model->num_active_experts = model_header.num_active_experts;
     model->embedding_dim = model_header.embedding_dim;
     model->mlp_dim = model_header.mlp_dim;
+    model->expert_weight_layout = expert_weight_layout;
+    model->i8_unembedding = i8_unembedding;
     model->swiglu_limit = model_header.swiglu_limit;
     model->head_dim = model_header.head_dim;
     model->num_heads = model_header.num_heads;
@@ -265,6 +672,34 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
 
     prefetch_fd(fd, tokenizer_mapping_start, tokenizer_mapping_size, path);
 
+    status = build_tokenizer_offsets(tokenizer, tokenizer_header.tokens_size);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = build_tokenizer_trie(tokenizer, tokenizer_header.tokens_size);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = build_tokenizer_hash_table(tokenizer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = create_tokenizer_cache(tokenizer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    if (tokenizer_header.regex_size > 1 && tokenizer->regex_ptr[tokenizer_header.regex_size - 1] == '\0') {
+        if (gptoss_regex_create(tokenizer->regex_ptr, &tokenizer->regex) != gptoss_status_success) {
+            GPTOSS_LOG_WARNING("failed to compile pre-tokenization regex, falling back to longest-match encoding");
+        }
+    } else {
+        GPTOSS_LOG_WARNING("tokenizer has no pre-tokenization regex, falling back to longest-match encoding");
+    }
+
     struct stat model_stat = {0};
     int stat_result = fstat(fd, &model_stat);
     if (stat_result != 0) {
@@ -285,85 +720,29 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     model->mapping_ptr = model_mapping_ptr;
     model->mapping_size = model_mapping_size;
 
-    if (madvise(model_mapping_ptr, model_mapping_size, MADV_SEQUENTIAL | MADV_WILLNEED) != 0) {
-        GPTOSS_LOG_WARNING("madvise(%s, size=%zu) failed with error %d", path, model_mapping_size, errno);
+    // Without an expert budget, the weight loader pages in and locks the whole mapping in the background once the
+    // weight regions are known. With an expert budget, only the expert-shared weights are prefetched and locked;
+    // expert weights are paged in on demand.
+    model->manage_expert_residency = expert_budget_bytes != 0;
+    if (!model->manage_expert_residency) {
+        if (madvise(model_mapping_ptr, model_mapping_size, MADV_SEQUENTIAL | MADV_WILLNEED) != 0) {
+            GPTOSS_LOG_WARNING("madvise(%s, size=%zu) failed with error %d", path, model_mapping_size, errno);
+        }
     }
 
-    prefetch_fd(fd, model_mapping_start, model_mapping_size, path);
-
-    if (mlock(model_mapping_ptr, model_mapping_size) != 0) {
-        GPTOSS_LOG_WARNING("mlock(%s, size=%zu) failed with error %d", path, model_mapping_size, errno);
-    } else {
-        model->lock_memory = true;
-    }
+    const uint64_t mapping_end_time = mach_continuous_time();
+    model->load_mapping_seconds = mach_timestamp_diff_to_seconds(load_start_time, mapping_end_time);
 
     // Initialize Metal
     status = gptoss_metal_device_create_system_default(&model->device);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    model->max_threadgroups = model->device.num_cores * 3;
-    status = gptoss_metal_command_queue_create(&model->device, &model->command_queue);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-
-    // Metal kernels
-    status = gptoss_metal_library_create_default(&model->device, &model->library);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_bf16_f32_embeddings", &model->bf16_f32_embeddings_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_bf16w_rmsnorm", &model->f32_bf16w_rmsnorm_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_bf16w_matmul", &model->f32_bf16w_matmul_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_bf16w_unembedding", &model->f32_bf16w_unembedding_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_rope", &model->f32_rope_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_mf4w_moe_matmul_swiglu", &model->f32_mf4w_moe_matmul_swiglu_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_mf4w_moe_matmul", &model->f32_mf4w_moe_matmul_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_accumulate_e4", &model->f32_accumulate_e4_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_topk_softmax_e32_k4", &model->f32_topk_softmax_e32_k4_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_topk_softmax_e128_k4", &model->f32_topk_softmax_e128_k4_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_softmax", &model->f32_softmax_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_sample", &model->f32_sample_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
-    }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_sdpa_q8_d64", &model->f32_sdpa_q8_d64_fn);
-    if (status != gptoss_status_success) {
-        goto cleanup;
+    for (size_t i = 0; i < GPTOSS_NUM_COMMAND_QUEUES; i++) {
+        status = gptoss_metal_command_queue_create(&model->device, &model->command_queues[i]);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
     }
 
     // Weight buffers
@@ -393,7 +772,10 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
         rmsnorm_weight_size + mlp_gate_weight_size + mlp_gate_bias_size;
     model->rmsnorm_weight_offset = embedding_weight_size + model->num_blocks * per_block_shared_weights_size;
     model->unembedding_weight_offset = model->rmsnorm_weight_offset + rmsnorm_weight_size;
-    const size_t unembedding_weight_size = math_round_up_po2(model->vocabulary_size * model->embedding_dim * sizeof(gptoss_bfloat16), 16);
+    // Int8 unembedding rows are followed by their float scales
+    const size_t unembedding_row_size = model->i8_unembedding ?
+        model->embedding_dim * sizeof(int8_t) + sizeof(float) : model->embedding_dim * sizeof(gptoss_bfloat16);
+    const size_t unembedding_weight_size = math_round_up_po2(model->vocabulary_size * unembedding_row_size, 16);
 
     model->per_block_shared_weights_size = per_block_shared_weights_size;
     const size_t shared_weights_size =
@@ -407,16 +789,46 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     current_ptr += shared_weights_size;
     model->weights_size += shared_weights_size;
 
-    const size_t mlp_swiglu_weight_block_size = math_round_up_po2(2 * model->mlp_dim * model->embedding_dim / 2, 16);
-    model->mlp_swiglu_scale_offset = mlp_swiglu_weight_block_size;
-    const size_t mlp_swiglu_weight_scale_size = math_round_up_po2(2 * model->mlp_dim * model->embedding_dim / 32, 16);
-    model->mlp_swiglu_bias_offset = model->mlp_swiglu_scale_offset + mlp_swiglu_weight_scale_size;
+    if (model->manage_expert_residency) {
+        if (madvise(model->mapping_ptr, shared_weights_size, MADV_WILLNEED) != 0) {
+            GPTOSS_LOG_WARNING("madvise(%s, size=%zu) failed with error %d", path, shared_weights_size, errno);
+        }
+
+        prefetch_fd(fd, model_mapping_start, shared_weights_size, path);
+
+        if (mlock(model->mapping_ptr, shared_weights_size) != 0) {
+            GPTOSS_LOG_WARNING("mlock(%s, size=%zu) failed with error %d", path, shared_weights_size, errno);
+        } else {
+            model->lock_memory = true;
+        }
+    }
+
+    size_t mlp_swiglu_weight_block_size, mlp_swiglu_weight_scale_size, mlp_out_weight_block_size, mlp_out_weight_scale_size;
+    if (model->expert_weight_layout == GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED) {
+        // Blocks and scales are interleaved tile by tile; scales are addressed from the end of the first tile's blocks
+        mlp_swiglu_weight_block_size = math_round_up_po2(2 * model->mlp_dim * model->embedding_dim / 32 * 17, 16);
+        model->mlp_swiglu_scale_offset = GPTOSS_MF4_TILE_ROWS * 16;
+        mlp_swiglu_weight_scale_size = 0;
+        model->mlp_swiglu_bias_offset = mlp_swiglu_weight_block_size;
+    } else {
+        mlp_swiglu_weight_block_size = math_round_up_po2(2 * model->mlp_dim * model->embedding_dim / 2, 16);
+        model->mlp_swiglu_scale_offset = mlp_swiglu_weight_block_size;
+        mlp_swiglu_weight_scale_size = math_round_up_po2(2 * model->mlp_dim * model->embedding_dim / 32, 16);
+        model->mlp_swiglu_bias_offset = model->mlp_swiglu_scale_offset + mlp_swiglu_weight_scale_size;
+    }
     const size_t mlp_swiglu_bias_size = math_round_up_po2(2 * model->mlp_dim * sizeof(gptoss_bfloat16), 16);
     model->mlp_out_block_offset = model->mlp_swiglu_bias_offset + mlp_swiglu_bias_size;
-    const size_t mlp_out_weight_block_size = math_round_up_po2(model->embedding_dim * model->mlp_dim / 2, 16);
-    model->mlp_out_scale_offset = model->mlp_out_block_offset + mlp_out_weight_block_size;
-    const size_t mlp_out_weight_scale_size = math_round_up_po2(model->embedding_dim * model->mlp_dim / 32, 16);
-    model->mlp_out_bias_offset = model->mlp_out_scale_offset + mlp_out_weight_scale_size;
+    if (model->expert_weight_layout == GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED) {
+        mlp_out_weight_block_size = math_round_up_po2(model->embedding_dim * model->mlp_dim / 32 * 17, 16);
+        model->mlp_out_scale_offset = model->mlp_out_block_offset + GPTOSS_MF4_TILE_ROWS * 16;
+        mlp_out_weight_scale_size = 0;
+        model->mlp_out_bias_offset = model->mlp_out_block_offset + mlp_out_weight_block_size;
+    } else {
+        mlp_out_weight_block_size = math_round_up_po2(model->embedding_dim * model->mlp_dim / 2, 16);
+        model->mlp_out_scale_offset = model->mlp_out_block_offset + mlp_out_weight_block_size;
+        mlp_out_weight_scale_size = math_round_up_po2(model->embedding_dim * model->mlp_dim / 32, 16);
+        model->mlp_out_bias_offset = model->mlp_out_scale_offset + mlp_out_weight_scale_size;
+    }
     const size_t mlp_out_bias_size = math_round_up_po2(model->embedding_dim * sizeof(gptoss_bfloat16), 16);
     model->per_expert_block_weight_size =
         mlp_swiglu_weight_block_size + mlp_swiglu_weight_scale_size + mlp_swiglu_bias_size + mlp_out_weight_block_size + mlp_out_weight_scale_size + mlp_out_bias_size;
@@ -432,6 +844,188 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
         model->weights_size += moe_block_weight_size;
     }
 
+    // Hashing all weights would take longer than loading them, but models of the same shape differ in every region,
+    // so a few pages of each identify them. The sampled pages of expert weights are paged in early.
+    uint64_t weights_fingerprint = hash_bytes(UINT64_C(0xCBF29CE484222325), &model_header, sizeof(model_header));
+    weights_fingerprint = hash_bytes(weights_fingerprint, &layout_uuid, sizeof(layout_uuid));
+    weights_fingerprint = hash_weight_region(weights_fingerprint, model->shared_weight_buffer.ptr, shared_weights_size);
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        weights_fingerprint = hash_weight_region(weights_fingerprint, model->block_weight_buffers[n].ptr, moe_block_weight_size);
+    }
+    model->weights_fingerprint = weights_fingerprint;
+
+    if (model->manage_expert_residency) {
+        const size_t expert_weights_size = model->mapping_size - shared_weights_size;
+        void* expert_weights_ptr = (char*) model->mapping_ptr + shared_weights_size;
+        const size_t max_resident_experts = expert_budget_bytes / (model->num_blocks * model->per_expert_block_weight_size);
+        if (max_resident_experts >= model->num_experts) {
+            // The budget fits all experts: load them the same way as without a budget.
+            model->manage_expert_residency = false;
+            if (madvise(expert_weights_ptr, expert_weights_size, MADV_SEQUENTIAL | MADV_WILLNEED) != 0) {
+                GPTOSS_LOG_WARNING("madvise(%s, size=%zu) failed with error %d", path, expert_weights_size, errno);
+            }
+
+            prefetch_fd(fd, model_mapping_start + shared_weights_size, expert_weights_size, path);
+
+            if (mlock(expert_weights_ptr, expert_weights_size) != 0) {
+                GPTOSS_LOG_WARNING("mlock(%s, size=%zu) failed with error %d", path, expert_weights_size, errno);
+            } else {
+                model->lock_memory = true;
+            }
+        } else {
+            model->max_resident_experts = (uint32_t) max_resident_experts;
+            if (madvise(expert_weights_ptr, expert_weights_size, MADV_RANDOM) != 0) {
+                GPTOSS_LOG_WARNING("madvise(%s, size=%zu) failed with error %d", path, expert_weights_size, errno);
+            }
+
+            const size_t num_block_experts = (size_t) model->num_blocks * (size_t) model->num_experts;
+            model->expert_residency = calloc(num_block_experts, sizeof(struct gptoss_expert_residency));
+            if (model->expert_residency == NULL) {
+                GPTOSS_LOG_ERROR("failed to allocate %zu bytes for expert residency state",
+                    num_block_experts * sizeof(struct gptoss_expert_residency));
+                status = gptoss_status_insufficient_memory;
+                goto cleanup;
+            }
+        }
+    }
+
+    // Expert usage counters are collected for routing statistics even if the model doesn't manage expert residency.
+    const size_t num_block_experts = (size_t) model->num_blocks * (size_t) model->num_experts;
+    status = gptoss_metal_buffer_create(&model->device, num_block_experts * sizeof(uint32_t), NULL, &model->expert_usage_buffer);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to allocate expert usage buffer of size %zu", num_block_experts * sizeof(uint32_t));
+        goto cleanup;
+    }
+    memset(model->expert_usage_buffer.ptr, 0, num_block_experts * sizeof(uint32_t));
+    model->expert_stats = calloc(num_block_experts, sizeof(struct gptoss_expert_stats));
+    if (model->expert_stats == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for expert statistics",
+            num_block_experts * sizeof(struct gptoss_expert_stats));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    // Weights are made resident through a residency set attached to every command queue, so that submissions don't
+    // revalidate the residency of each weight buffer. KV cache pool buffers join the set as the pools grow. The MoE
+    // weights of models managing expert residency are left out, so that evicted experts can be paged out. Without
+    // residency set support, command buffers make the buffers they reference resident as before.
+    if (gptoss_metal_residency_set_create(&model->device, 2 + model->num_blocks + GPTOSS_KVCACHE_TYPE_COUNT,
+            &model->residency_set) == gptoss_status_success)
+    {
+        gptoss_metal_residency_set_add_buffer(&model->residency_set, &model->shared_weight_buffer);
+        if (!model->manage_expert_residency) {
+            for (uint32_t n = 0; n < model->num_blocks; n++) {
+                gptoss_metal_residency_set_add_buffer(&model->residency_set, &model->block_weight_buffers[n]);
+            }
+        }
+        gptoss_metal_residency_set_add_buffer(&model->residency_set, &model->expert_usage_buffer);
+        gptoss_metal_residency_set_commit(&model->residency_set);
+        for (size_t i = 0; i < GPTOSS_NUM_COMMAND_QUEUES; i++) {
+            gptoss_metal_command_queue_add_residency_set(&model->command_queues[i], &model->residency_set);
+        }
+    }
+
+    if (expert_budget_bytes == 0) {
+        // Weight regions in file order: expert-shared weights, then the MoE weights of each block
+        size_t* region_ends = malloc((1 + model->num_blocks) * sizeof(size_t));
+        if (region_ends == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate weight region offsets for %" PRIu32 " blocks", model->num_blocks);
+            status = gptoss_status_insufficient_memory;
+            goto cleanup;
+        }
+        region_ends[0] = shared_weights_size;
+        for (uint32_t n = 0; n < model->num_blocks; n++) {
+            region_ends[1 + n] = shared_weights_size + (n + 1) * moe_block_weight_size;
+        }
+        status = start_weight_loader(model, fd, model_mapping_start, 1 + model->num_blocks, region_ends);
+        free(region_ends);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    const uint64_t buffer_end_time = mach_continuous_time();
+    model->load_buffer_seconds = mach_timestamp_diff_to_seconds(mapping_end_time, buffer_end_time);
+
+    // Metal kernels
+    status = gptoss_metal_library_create_default(&model->device, &model->library);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    // Kernels specialized to the model shape through function constants
+    const struct gptoss_metal_function_constant expert_constants[] = {
+        {GPTOSS_FUNCTION_CONSTANT_NUM_EXPERTS, model->num_experts},
+        {GPTOSS_FUNCTION_CONSTANT_NUM_ACTIVE_EXPERTS, model->num_active_experts},
+    };
+    const struct gptoss_metal_function_constant attention_constants[] = {
+        {GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS, model->num_kv_heads},
+    };
+    const struct gptoss_metal_function_constant expert_weight_constants[] = {
+        {GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT, model->expert_weight_layout},
+    };
+    const size_t num_expert_constants = sizeof(expert_constants) / sizeof(expert_constants[0]);
+    const size_t num_attention_constants = sizeof(attention_constants) / sizeof(attention_constants[0]);
+    const struct gptoss_metal_function_constant half_expert_weight_constants[] = {
+        {GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT, model->expert_weight_layout},
+        {GPTOSS_FUNCTION_CONSTANT_ACTIVATION_TYPE, GPTOSS_ACTIVATION_TYPE_F16},
+    };
+    const size_t num_expert_weight_constants = sizeof(expert_weight_constants) / sizeof(expert_weight_constants[0]);
+    const size_t num_half_expert_weight_constants = sizeof(half_expert_weight_constants) / sizeof(half_expert_weight_constants[0]);
+    const struct gptoss_metal_function_descriptor function_descriptors[] = {
+        {"gptoss_bf16_f32_embeddings", &model->bf16_f32_embeddings_fn},
+        {"gptoss_f32_bf16w_rmsnorm", &model->f32_bf16w_rmsnorm_fn},
+        {"gptoss_f32_bf16w_matmul", &model->f32_bf16w_matmul_fn},
+        {"gptoss_f32_bf16w_rmsnorm_matmul", &model->f32_bf16w_rmsnorm_matmul_fn},
+        {"gptoss_f32_bf16w_unembedding", &model->f32_bf16w_unembedding_fn},
+        {"gptoss_f32_bf16w_dense_matmul", &model->f32_bf16w_dense_matmul_fn},
+        {"gptoss_f32_bf16w_rmsnorm_dense_matmul", &model->f32_bf16w_rmsnorm_dense_matmul_fn},
+        {"gptoss_f32_bf16w_dense_unembedding", &model->f32_bf16w_dense_unembedding_fn},
+        {"gptoss_f32_i8w_unembedding", &model->f32_i8w_unembedding_fn},
+        {"gptoss_f32_mf4w_moe_matmul_swiglu", &model->f32_mf4w_moe_matmul_swiglu_fn, num_expert_weight_constants, expert_weight_constants},
+        {"gptoss_f32_mf4w_moe_matmul_accumulate", &model->f32_mf4w_moe_matmul_accumulate_fn, num_expert_weight_constants, expert_weight_constants},
+        {"gptoss_expert_route", &model->expert_route_fn},
+        {"gptoss_expert_usage", &model->expert_usage_fn},
+        {"gptoss_f32_mf4w_moe_dense_matmul_swiglu", &model->f32_mf4w_moe_dense_matmul_swiglu_fn, num_expert_weight_constants, expert_weight_constants},
+        {"gptoss_f32_mf4w_moe_dense_matmul", &model->f32_mf4w_moe_dense_matmul_fn, num_expert_weight_constants, expert_weight_constants},
+        {"gptoss_f32_mf4w_moe_dense_matmul_swiglu", &model->f16_mf4w_moe_dense_matmul_swiglu_fn, num_half_expert_weight_constants, half_expert_weight_constants},
+        {"gptoss_f32_mf4w_moe_dense_matmul", &model->f16_mf4w_moe_dense_matmul_fn, num_half_expert_weight_constants, half_expert_weight_constants},
+        {"gptoss_f32_accumulate", &model->f32_accumulate_fn, num_expert_constants, expert_constants},
+        {"gptoss_f32_topk_softmax", &model->f32_topk_softmax_fn, num_expert_constants, expert_constants},
+        {"gptoss_f32_softmax", &model->f32_softmax_fn},
+        {"gptoss_f32_sample", &model->f32_sample_fn},
+        {"gptoss_f32_topk_sample", &model->f32_topk_sample_fn},
+        {"gptoss_f32_gather_logprob", &model->f32_gather_logprob_fn},
+        {"gptoss_f32_top_logprobs", &model->f32_top_logprobs_fn},
+        {"gptoss_u32_check_stop_tokens", &model->u32_check_stop_tokens_fn},
+        {"gptoss_u32_advance_token_automaton", &model->u32_advance_token_automaton_fn},
+        {"gptoss_f32_rope_kv_store", &model->f32_rope_kv_store_fn},
+        {"gptoss_f32_rope_bf16kv_store", &model->f32_rope_bf16kv_store_fn},
+        {"gptoss_f32_rope_i8kv_store", &model->f32_rope_i8kv_store_fn},
+        {"gptoss_kv_rope_shift", &model->kv_rope_shift_fn},
+        {"gptoss_bf16kv_rope_shift", &model->bf16kv_rope_shift_fn},
+        {"gptoss_i8kv_rope_shift", &model->i8kv_rope_shift_fn},
+        {"gptoss_f32_sdpa_q8_d64", &model->f32_sdpa_q8_d64_fn, num_attention_constants, attention_constants},
+        {"gptoss_f32_bf16kv_sdpa_q8_d64", &model->f32_bf16kv_sdpa_q8_d64_fn, num_attention_constants, attention_constants},
+        {"gptoss_f32_i8kv_sdpa_q8_d64", &model->f32_i8kv_sdpa_q8_d64_fn, num_attention_constants, attention_constants},
+        {"gptoss_f32_sdpa_reduce_q8_d64", &model->f32_sdpa_reduce_q8_d64_fn, num_attention_constants, attention_constants},
+    };
+    status = gptoss_metal_function_create_multiple(
+        &model->library,
+        sizeof(function_descriptors) / sizeof(function_descriptors[0]),
+        function_descriptors);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    gptoss_model_load_launch_profile(model);
+    const uint64_t pipeline_end_time = mach_continuous_time();
+    model->load_pipeline_seconds = mach_timestamp_diff_to_seconds(buffer_end_time, pipeline_end_time);
+
+    // Lazily loaded models return right away: command buffers wait on the weight loader's event per weight region.
+    if (!lazy) {
+        wait_for_weight_loader(model);
+    }
+    model->load_wait_seconds = mach_timestamp_diff_to_seconds(pipeline_end_time, mach_continuous_time());
+
     // Commit tokenizer
     model->tokenizer = tokenizer;
     tokenizer = NULL;
@@ -468,6 +1062,227 @@ enum gptoss_status GPTOSS_ABI gptoss_model_get_max_context_length(
     return gptoss_status_success;
 }
 
+// Updates which experts of block n are resident, given the number of tokens routed to each of them since the last
+// update. Must be called with the model lock held.
+static void update_block_expert_residency(
+    struct gptoss_model* model,
+    uint32_t n,
+    const uint32_t* num_routed)
+{
+    const uint32_t num_experts = model->num_experts;
+    const size_t expert_size = model->per_expert_block_weight_size;
+    uint32_t ranked_experts[GPTOSS_EXPERT_ROUTE_MAX_EXPERTS];
+    float priority[GPTOSS_EXPERT_ROUTE_MAX_EXPERTS];
+    struct gptoss_expert_residency* residency = model->expert_residency + (size_t) n * num_experts;
+
+    for (uint32_t e = 0; e < num_experts; e++) {
+        if (residency[e].resident) {
+            residency[e].hits += num_routed[e];
+        } else {
+            residency[e].misses += num_routed[e];
+        }
+    }
+
+    // Rank experts by decayed routing frequency, favouring the resident ones to avoid churn between experts of
+    // similar popularity.
+    for (uint32_t e = 0; e < num_experts; e++) {
+        residency[e].score = residency[e].score * GPTOSS_EXPERT_USAGE_DECAY + (float) num_routed[e];
+        priority[e] = residency[e].resident ? residency[e].score * GPTOSS_EXPERT_RESIDENCY_HYSTERESIS : residency[e].score;
+
+        uint32_t i = e;
+        for (; i != 0 && priority[ranked_experts[i - 1]] < priority[e]; i--) {
+            ranked_experts[i] = ranked_experts[i - 1];
+        }
+        ranked_experts[i] = e;
+    }
+
+    char* block_weights = (char*) model->block_weight_buffers[n].ptr;
+    for (uint32_t i = 0; i < num_experts; i++) {
+        const uint32_t e = ranked_experts[i];
+        const bool keep_resident = i < model->max_resident_experts && priority[e] > 0.0f;
+        if (keep_resident == residency[e].resident) {
+            continue;
+        }
+
+        const size_t expert_start = (size_t) e * expert_size;
+        const size_t expert_end = expert_start + expert_size;
+        if (keep_resident) {
+            // Lock every page holding the expert's weights; pages shared with a neighbouring expert may be locked
+            // twice, which is harmless.
+            void* lock_ptr = block_weights + round_down_to_page_size(expert_start);
+            const size_t lock_size = round_up_to_page_size(expert_end) - round_down_to_page_size(expert_start);
+            if (madvise(lock_ptr, lock_size, MADV_WILLNEED) != 0) {
+                GPTOSS_LOG_WARNING("madvise(size=%zu) for block #%" PRIu32 " expert #%" PRIu32 " failed with error %d",
+                    lock_size, n, e, errno);
+            }
+            if (mlock(lock_ptr, lock_size) != 0) {
+                // The expert stays paged in until the system reclaims it, but isn't counted as resident.
+                if (!model->expert_lock_failed) {
+                    GPTOSS_LOG_WARNING("mlock(size=%zu) for block #%" PRIu32 " expert #%" PRIu32 " failed with error %d",
+                        lock_size, n, e, errno);
+                    model->expert_lock_failed = true;
+                }
+                continue;
+            }
+            model->lock_memory = true;
+        } else {
+            // Only release pages that hold no other expert's weights.
+            const size_t evict_start = round_up_to_page_size(expert_start);
+            const size_t evict_end = round_down_to_page_size(expert_end);
+            if (evict_end > evict_start) {
+                void* evict_ptr = block_weights + evict_start;
+                const size_t evict_size = evict_end - evict_start;
+                if (munlock(evict_ptr, evict_size) != 0) {
+                    GPTOSS_LOG_WARNING("munlock(size=%zu) for block #%" PRIu32 " expert #%" PRIu32 " failed with error %d",
+                        evict_size, n, e, errno);
+                }
+                if (madvise(evict_ptr, evict_size, MADV_DONTNEED) != 0) {
+                    GPTOSS_LOG_WARNING("madvise(size=%zu) for block #%" PRIu32 " expert #%" PRIu32 " failed with error %d",
+                        evict_size, n, e, errno);
+                }
+            }
+        }
+        residency[e].resident = keep_resident;
+    }
+}
+
+// Folds the increments of the expert usage counters since the last call into the expert statistics, and updates
+// expert residency if the model manages it. Must be called with the model lock held.
+static void update_expert_usage(
+    struct gptoss_model* model)
+{
+    const uint32_t num_experts = model->num_experts;
+    const uint32_t* usage = (const uint32_t*) model->expert_usage_buffer.ptr;
+    uint32_t num_routed[GPTOSS_EXPERT_ROUTE_MAX_EXPERTS];
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        struct gptoss_expert_stats* stats = model->expert_stats + (size_t) n * num_experts;
+        const uint32_t* block_usage = usage + (size_t) n * num_experts;
+
+        bool any_routed = false;
+        for (uint32_t e = 0; e < num_experts; e++) {
+            // Counters wrap around, unsigned subtraction recovers the increment.
+            num_routed[e] = block_usage[e] - stats[e].last_usage;
+            stats[e].last_usage = block_usage[e];
+            stats[e].num_selections += num_routed[e];
+            any_routed |= num_routed[e] != 0;
+        }
+        if (any_routed && model->manage_expert_residency) {
+            update_block_expert_residency(model, n, num_routed);
+        }
+    }
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_get_expert_residency_stats(
+    gptoss_model_t model,
+    uint64_t* hits_out,
+    uint64_t* misses_out,
+    size_t max_experts,
+    size_t* num_experts_out)
+{
+    if (!model->manage_expert_residency) {
+        GPTOSS_LOG_ERROR("model does not manage expert residency");
+        return gptoss_status_invalid_state;
+    }
+
+    const size_t num_block_experts = (size_t) model->num_blocks * (size_t) model->num_experts;
+    *num_experts_out = num_block_experts;
+    if (max_experts < num_block_experts) {
+        return gptoss_status_insufficient_memory;
+    }
+
+    pthread_mutex_lock(&model->lock);
+    update_expert_usage(model);
+    for (size_t i = 0; i < num_block_experts; i++) {
+        hits_out[i] = model->expert_residency[i].hits;
+        misses_out[i] = model->expert_residency[i].misses;
+    }
+    pthread_mutex_unlock(&model->lock);
+    return gptoss_status_success;
+}
+
+void gptoss_model_update_expert_residency(
+    struct gptoss_model* model)
+{
+    if (!model->manage_expert_residency) {
+        return;
+    }
+
+    pthread_mutex_lock(&model->lock);
+    update_expert_usage(model);
+    pthread_mutex_unlock(&model->lock);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_start_expert_stats(
+    gptoss_model_t model)
+{
+    atomic_store_explicit(&model->count_expert_usage, true, memory_order_relaxed);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_stop_expert_stats(
+    gptoss_model_t model)
+{
+    atomic_store_explicit(&model->count_expert_usage, false, memory_order_relaxed);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_get_expert_stats(
+    gptoss_model_t model,
+    uint64_t* num_selections_out,
+    size_t max_experts,
+    size_t* num_experts_out)
+{
+    const size_t num_block_experts = (size_t) model->num_blocks * (size_t) model->num_experts;
+    *num_experts_out = num_block_experts;
+    if (max_experts < num_block_experts) {
+        return gptoss_status_insufficient_memory;
+    }
+
+    pthread_mutex_lock(&model->lock);
+    update_expert_usage(model);
+    for (size_t i = 0; i < num_block_experts; i++) {
+        num_selections_out[i] = model->expert_stats[i].num_selections;
+    }
+    pthread_mutex_unlock(&model->lock);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_model_get_stats(
+    gptoss_model_t model,
+    struct gptoss_model_stats* stats_out)
+{
+    const struct gptoss_runtime_counters* counters = &model->counters;
+    *stats_out = (struct gptoss_model_stats) {
+        .num_prefill_tokens = atomic_load_explicit(&counters->num_prefill_tokens, memory_order_relaxed),
+        .num_decode_tokens = atomic_load_explicit(&counters->num_decode_tokens, memory_order_relaxed),
+        .num_command_buffers = atomic_load_explicit(&counters->num_command_buffers, memory_order_relaxed),
+        .gpu_busy_seconds = (double) atomic_load_explicit(&counters->gpu_busy_nanoseconds, memory_order_relaxed) * 1.0e-9,
+        .wait_seconds = (double) atomic_load_explicit(&counters->wait_nanoseconds, memory_order_relaxed) * 1.0e-9,
+        .weights_size = model->weights_size,
+        .metal_allocation_size = gptoss_metal_device_get_allocated_size(&model->device),
+    };
+
+    // Pool pages are shared by all full-attention blocks, one page per block for every GPTOSS_KVCACHE_PAGE_TOKENS
+    // tokens.
+    const size_t num_full_blocks = math_max(model->num_blocks / 2, 1);
+    pthread_mutex_lock(&model->lock);
+    for (size_t i = 0; i < GPTOSS_KVCACHE_TYPE_COUNT; i++) {
+        const struct gptoss_kvcache_pool* pool = &model->kvcache_pools[i];
+        stats_out->num_kvcache_pool_tokens += pool->num_pages / num_full_blocks * GPTOSS_KVCACHE_PAGE_TOKENS;
+        stats_out->num_used_kvcache_pool_tokens +=
+            (pool->num_pages - pool->num_free_pages) / num_full_blocks * GPTOSS_KVCACHE_PAGE_TOKENS;
+        stats_out->kvcache_pool_size += pool->buffer.size;
+    }
+    if (model->manage_expert_residency) {
+        const size_t num_block_experts = (size_t) model->num_blocks * (size_t) model->num_experts;
+        for (size_t i = 0; i < num_block_experts; i++) {
+            stats_out->num_resident_experts += model->expert_residency[i].resident;
+        }
+    }
+    pthread_mutex_unlock(&model->lock);
+    return gptoss_status_success;
+}
+
 enum gptoss_status GPTOSS_ABI gptoss_model_retain(
     gptoss_model_t model)
 {
@@ -482,6 +1297,18 @@ enum gptoss_status GPTOSS_ABI gptoss_model_release(
         if (atomic_fetch_sub_explicit(&model->ref_count, 1, memory_order_acq_rel) == 1) {
             gptoss_tokenizer_release(model->tokenizer);
 
+            // Stop paging in weights before the mapping goes away
+            stop_weight_loader(model);
+
+            for (size_t i = 0; i < GPTOSS_KVCACHE_TYPE_COUNT; i++) {
+                gptoss_metal_buffer_release(&model->kvcache_pools[i].buffer);
+                free(model->kvcache_pools[i].free_pages);
+            }
+
+            gptoss_metal_buffer_release(&model->expert_usage_buffer);
+            free(model->expert_stats);
+            free(model->expert_residency);
+
             // Weight buffers
             gptoss_metal_buffer_release(&model->shared_weight_buffer);
             for (uint32_t n = 0; n < model->num_blocks; n++) {
@@ -492,19 +1319,46 @@ enum gptoss_status GPTOSS_ABI gptoss_model_release(
             gptoss_metal_function_release(&model->bf16_f32_embeddings_fn);
             gptoss_metal_function_release(&model->f32_bf16w_rmsnorm_fn);
             gptoss_metal_function_release(&model->f32_bf16w_matmul_fn);
+            gptoss_metal_function_release(&model->f32_bf16w_rmsnorm_matmul_fn);
             gptoss_metal_function_release(&model->f32_bf16w_unembedding_fn);
-            gptoss_metal_function_release(&model->f32_rope_fn);
+            gptoss_metal_function_release(&model->f32_bf16w_dense_matmul_fn);
+            gptoss_metal_function_release(&model->f32_bf16w_rmsnorm_dense_matmul_fn);
+            gptoss_metal_function_release(&model->f32_bf16w_dense_unembedding_fn);
+            gptoss_metal_function_release(&model->f32_i8w_unembedding_fn);
             gptoss_metal_function_release(&model->f32_mf4w_moe_matmul_swiglu_fn);
-            gptoss_metal_function_release(&model->f32_mf4w_moe_matmul_fn);
-            gptoss_metal_function_release(&model->f32_accumulate_e4_fn);
-            gptoss_metal_function_release(&model->f32_topk_softmax_e32_k4_fn);
-            gptoss_metal_function_release(&model->f32_topk_softmax_e128_k4_fn);
+            gptoss_metal_function_release(&model->f32_mf4w_moe_matmul_accumulate_fn);
+            gptoss_metal_function_release(&model->expert_route_fn);
+            gptoss_metal_function_release(&model->expert_usage_fn);
+            gptoss_metal_function_release(&model->f32_mf4w_moe_dense_matmul_swiglu_fn);
+            gptoss_metal_function_release(&model->f32_mf4w_moe_dense_matmul_fn);
+            gptoss_metal_function_release(&model->f16_mf4w_moe_dense_matmul_swiglu_fn);
+            gptoss_metal_function_release(&model->f16_mf4w_moe_dense_matmul_fn);
+            gptoss_metal_function_release(&model->f32_accumulate_fn);
+            gptoss_metal_function_release(&model->f32_topk_softmax_fn);
             gptoss_metal_function_release(&model->f32_softmax_fn);
             gptoss_metal_function_release(&model->f32_sample_fn);
+            gptoss_metal_function_release(&model->f32_topk_sample_fn);
+            gptoss_metal_function_release(&model->f32_gather_logprob_fn);
+            gptoss_metal_function_release(&model->f32_top_logprobs_fn);
+            gptoss_metal_function_release(&model->u32_check_stop_tokens_fn);
+            gptoss_metal_function_release(&model->u32_advance_token_automaton_fn);
+            gptoss_metal_function_release(&model->f32_rope_kv_store_fn);
+            gptoss_metal_function_release(&model->f32_rope_bf16kv_store_fn);
+            gptoss_metal_function_release(&model->f32_rope_i8kv_store_fn);
+            gptoss_metal_function_release(&model->kv_rope_shift_fn);
+            gptoss_metal_function_release(&model->bf16kv_rope_shift_fn);
+            gptoss_metal_function_release(&model->i8kv_rope_shift_fn);
             gptoss_metal_function_release(&model->f32_sdpa_q8_d64_fn);
+            gptoss_metal_function_release(&model->f32_bf16kv_sdpa_q8_d64_fn);
+            gptoss_metal_function_release(&model->f32_i8kv_sdpa_q8_d64_fn);
+            gptoss_metal_function_release(&model->f32_sdpa_reduce_q8_d64_fn);
             gptoss_metal_library_release(&model->library);
 
-            gptoss_metal_command_queue_release(&model->command_queue);
+            for (size_t i = 0; i < GPTOSS_NUM_COMMAND_QUEUES; i++) {
+                gptoss_metal_command_queue_remove_residency_set(&model->command_queues[i], &model->residency_set);
+                gptoss_metal_command_queue_release(&model->command_queues[i]);
+            }
+            gptoss_metal_residency_set_release(&model->residency_set);
             gptoss_metal_device_release(&model->device);
             // Weight buffers
 
@@ -520,6 +1374,9 @@ enum gptoss_status GPTOSS_ABI gptoss_model_release(
                 }
             }
 
+            pthread_rwlock_destroy(&model->kvcache_pool_lock);
+            pthread_mutex_destroy(&model->lock);
+
             const size_t model_size = sizeof(struct gptoss_model) + model->num_blocks * sizeof(struct gptoss_metal_buffer);
             memset(model, 0, model_size);
             free(model);
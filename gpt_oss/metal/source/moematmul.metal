@@ -2,6 +2,7 @@
 #include <metal_compute>
 #include <metal_math>
 #include <metal_simdgroup>
+#include <metal_simdgroup_matrix>
 
 #include <internal/kernel-args.h>
 
@@ -9,6 +10,35 @@
 #pragma METAL fp contract(off)
 
 
+// Without the function constant, the kernels read the row-major layout.
+constant uint gptoss_fc_expert_weight_layout [[function_constant(GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT)]];
+constant bool gptoss_tiled_weights = is_function_constant_defined(gptoss_fc_expert_weight_layout) &&
+    gptoss_fc_expert_weight_layout == GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED;
+
+// Distances between the MXFP4 blocks (in 16-byte units) and between the scales (in bytes) of consecutive column vectors
+// of a weight row.
+constant uint gptoss_mf4_block_stride = gptoss_tiled_weights ? GPTOSS_MF4_TILE_SIZE / 16 : 1;
+constant uint gptoss_mf4_scale_stride = gptoss_tiled_weights ? GPTOSS_MF4_TILE_SIZE : 1;
+
+// Index of the MXFP4 block (in 16-byte units) with column vector col_vec of weight row `row`.
+static inline uint gptoss_mf4_block_index(uint row, uint col_vec, uint num_column_vecs) {
+    if (gptoss_tiled_weights) {
+        return ((row / GPTOSS_MF4_TILE_ROWS) * num_column_vecs + col_vec) * (GPTOSS_MF4_TILE_SIZE / 16) + row % GPTOSS_MF4_TILE_ROWS;
+    } else {
+        return row * num_column_vecs + col_vec;
+    }
+}
+
+// Index of the scale (in bytes) of the same block. In the tiled layout, scales are addressed from the first scale of
+// the first tile, GPTOSS_MF4_TILE_ROWS * 16 bytes after the first block.
+static inline uint gptoss_mf4_scale_index(uint row, uint col_vec, uint num_column_vecs) {
+    if (gptoss_tiled_weights) {
+        return ((row / GPTOSS_MF4_TILE_ROWS) * num_column_vecs + col_vec) * GPTOSS_MF4_TILE_SIZE + row % GPTOSS_MF4_TILE_ROWS;
+    } else {
+        return row * num_column_vecs + col_vec;
+    }
+}
+
 // Each simdgroup reduces all channels of the input and computes a single channel of the output
 // + Efficient synchronization
 // + Sequential memory access within a warp
@@ -42,8 +72,8 @@ kernel void gptoss_f32_mf4w_moe_matmul_swiglu(
     const uint expert_id = expert[gid.y * args.num_active_experts + gid.z].expert_id;
 
     input += 8 * (gid.y * num_column_vecs + simdgroup_tid);
-    weight_blocks = (const device uint4*) ((uintptr_t) (weight_blocks + num_column_vecs * row + simdgroup_tid) + expert_id * args.weight_expert_stride);
-    weight_scales = (const device uchar*) ((uintptr_t) (weight_scales + num_column_vecs * row + simdgroup_tid) + expert_id * args.weight_expert_stride);
+    weight_blocks = (const device uint4*) ((uintptr_t) (weight_blocks + gptoss_mf4_block_index(row, simdgroup_tid, num_column_vecs)) + expert_id * args.weight_expert_stride);
+    weight_scales = (const device uchar*) ((uintptr_t) (weight_scales + gptoss_mf4_scale_index(row, simdgroup_tid, num_column_vecs)) + expert_id * args.weight_expert_stride);
     bias = (const device bfloat*) ((uintptr_t) (bias + row) + expert_id * args.weight_expert_stride);
     output += gid.y * args.num_rows + gid.x * (num_simdgroups / 2) + gid.z * args.output_expert_stride;
 
@@ -103,8 +133,8 @@ kernel void gptoss_f32_mf4w_moe_matmul_swiglu(
         sum4 = metal::fma(psum0, wscale, sum4);
         sum4 = metal::fma(psum1, wscale, sum4);
 
-        weight_blocks += simdgroup_size;
-        weight_scales += simdgroup_size;
+        weight_blocks += simdgroup_size * gptoss_mf4_block_stride;
+        weight_scales += simdgroup_size * gptoss_mf4_scale_stride;
         input += 8 * simdgroup_size;
     } while (--num_iter != 0);
     const float2 sum2 = sum4.xy + sum4.zw;
@@ -126,38 +156,15 @@ kernel void gptoss_f32_mf4w_moe_matmul_swiglu(
     }
 }
 
-kernel void gptoss_f32_mf4w_moe_matmul(
-    constant gptoss_moe_matmul_args& args [[ buffer(0) ]],
-    const device float4* input [[ buffer(1) ]],
-    const device gptoss_expert_prediction* expert [[ buffer(2) ]],
-    const device uint4* weight_blocks [[ buffer(3) ]],
-    const device uchar* weight_scales [[ buffer(4) ]],
-    const device bfloat* bias [[ buffer(5) ]],
-    device float* output [[ buffer(6) ]],
-    const device gptoss_control* control [[ buffer(7) ]],
-    uint3 gid [[threadgroup_position_in_grid]],
-    uint tid [[thread_index_in_threadgroup]],
-    uint simdgroup_tid [[thread_index_in_simdgroup]],
-    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
-    uint num_simdgroups [[simdgroups_per_threadgroup]])
+// Partial dot product of the MXFP4 weight row with the input accumulated by one thread of a simdgroup; the pointers
+// point to the thread's first block, scale, and input column vector.
+static inline float gptoss_f32_mf4w_row_dot(
+    const device float4* input,
+    const device uint4* weight_blocks,
+    const device uchar* weight_scales,
+    uint num_iter)
 {
     const uint simdgroup_size = 32;
-    if (control->abort != 0) {
-        return;
-    }
-
-    const uint num_column_vecs = args.num_column_vecs;
-    const uint row = gid.x * num_simdgroups + simdgroup_idx;
-    const uint expert_id = expert[gid.y * args.num_active_experts + gid.z].expert_id;
-
-    input += 8 * (gid.y * num_column_vecs + simdgroup_tid + gid.z * args.input_expert_stride);
-    weight_blocks = (const device uint4*) ((uintptr_t) (weight_blocks + num_column_vecs * row + simdgroup_tid) + expert_id * args.weight_expert_stride);
-    weight_scales = (const device uchar*) ((uintptr_t) (weight_scales + num_column_vecs * row + simdgroup_tid) + expert_id * args.weight_expert_stride);
-    bias = (const device bfloat*) ((uintptr_t) (bias + row) + expert_id * args.weight_expert_stride);
-    output += gid.y * args.num_rows + row + gid.z * args.output_expert_stride;
-
-    uint num_iter = (num_column_vecs - simdgroup_tid + (simdgroup_size - 1)) / simdgroup_size;
-
     float4 sum4 = 0.0f;
     do {
         const uint4 wblock = *weight_blocks;
@@ -212,15 +219,329 @@ kernel void gptoss_f32_mf4w_moe_matmul(
         sum4 = metal::fma(psum0, wscale, sum4);
         sum4 = metal::fma(psum1, wscale, sum4);
 
-        weight_blocks += simdgroup_size;
-        weight_scales += simdgroup_size;
+        weight_blocks += simdgroup_size * gptoss_mf4_block_stride;
+        weight_scales += simdgroup_size * gptoss_mf4_scale_stride;
         input += 8 * simdgroup_size;
     } while (--num_iter != 0);
     const float2 sum2 = sum4.xy + sum4.zw;
-    float sum = sum2.x + sum2.y;
+    return sum2.x + sum2.y;
+}
+
+kernel void gptoss_f32_mf4w_moe_matmul(
+    constant gptoss_moe_matmul_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device gptoss_expert_prediction* expert [[ buffer(2) ]],
+    const device uint4* weight_blocks [[ buffer(3) ]],
+    const device uchar* weight_scales [[ buffer(4) ]],
+    const device bfloat* bias [[ buffer(5) ]],
+    device float* output [[ buffer(6) ]],
+    const device gptoss_control* control [[ buffer(7) ]],
+    uint3 gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_index_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    const uint simdgroup_size = 32;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint num_column_vecs = args.num_column_vecs;
+    const uint row = gid.x * num_simdgroups + simdgroup_idx;
+    const uint expert_id = expert[gid.y * args.num_active_experts + gid.z].expert_id;
+
+    input += 8 * (gid.y * num_column_vecs + simdgroup_tid + gid.z * args.input_expert_stride);
+    weight_blocks = (const device uint4*) ((uintptr_t) (weight_blocks + gptoss_mf4_block_index(row, simdgroup_tid, num_column_vecs)) + expert_id * args.weight_expert_stride);
+    weight_scales = (const device uchar*) ((uintptr_t) (weight_scales + gptoss_mf4_scale_index(row, simdgroup_tid, num_column_vecs)) + expert_id * args.weight_expert_stride);
+    bias = (const device bfloat*) ((uintptr_t) (bias + row) + expert_id * args.weight_expert_stride);
+    output += gid.y * args.num_rows + row + gid.z * args.output_expert_stride;
+
+    uint num_iter = (num_column_vecs - simdgroup_tid + (simdgroup_size - 1)) / simdgroup_size;
+
+    float sum = gptoss_f32_mf4w_row_dot(input, weight_blocks, weight_scales, num_iter);
     sum = metal::simd_sum(sum);
     if (metal::simd_is_first()) {
         sum += static_cast<float>(*bias);
         *output = sum;
     }
 }
+
+// Fused MoE output projection and accumulation for small batches of tokens: each simdgroup computes one output channel
+// for all num_active_experts experts of a token and adds their score-weighted sum to the residual stream in place, in
+// the same order as gptoss_f32_accumulate.
+kernel void gptoss_f32_mf4w_moe_matmul_accumulate(
+    constant gptoss_moe_matmul_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device gptoss_expert_prediction* expert [[ buffer(2) ]],
+    const device uint4* weight_blocks [[ buffer(3) ]],
+    const device uchar* weight_scales [[ buffer(4) ]],
+    const device bfloat* bias [[ buffer(5) ]],
+    device float* output [[ buffer(6) ]],
+    const device gptoss_control* control [[ buffer(7) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    const uint simdgroup_size = 32;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint num_column_vecs = args.num_column_vecs;
+    const uint row = gid.x * num_simdgroups + simdgroup_idx;
+    const uint num_iter = (num_column_vecs - simdgroup_tid + (simdgroup_size - 1)) / simdgroup_size;
+
+    input += 8 * (gid.y * num_column_vecs + simdgroup_tid);
+    weight_blocks += gptoss_mf4_block_index(row, simdgroup_tid, num_column_vecs);
+    weight_scales += gptoss_mf4_scale_index(row, simdgroup_tid, num_column_vecs);
+    bias += row;
+    output += gid.y * args.num_rows + row;
+    expert += gid.y * args.num_active_experts;
+
+    float acc = *output;
+    for (uint e = 0; e < args.num_active_experts; e++) {
+        const gptoss_expert_prediction prediction = expert[e];
+        const uint weight_offset = prediction.expert_id * args.weight_expert_stride;
+        float sum = gptoss_f32_mf4w_row_dot(
+            input + 8 * e * args.input_expert_stride,
+            (const device uint4*) ((uintptr_t) weight_blocks + weight_offset),
+            (const device uchar*) ((uintptr_t) weight_scales + weight_offset),
+            num_iter);
+        sum = metal::simd_sum(sum);
+        sum += static_cast<float>(*((const device bfloat*) ((uintptr_t) bias + weight_offset)));
+        acc = metal::fma(sum, prediction.score, acc);
+    }
+    if (metal::simd_is_first()) {
+        *output = acc;
+    }
+}
+
+// Grouped (per-expert GEMM) variants of the kernels above for prefill-size batches of tokens.
+// The assignments of tokens to experts are grouped by expert with gptoss_expert_route. Each threadgroup of 4
+// simdgroups computes a 32 (assignments of one expert) x 32 (weight rows) tile with 8x8 simdgroup matrix
+// multiply-accumulates, so the MXFP4 weights of an expert are read once per 32 tokens routed to it rather than once per
+// token. The weights are decoded into threadgroup memory one 32-element block per row at a time.
+// Results go to the same [slot][token] layout as the kernels above, so gptoss_f32_accumulate applies unchanged.
+// Threadgroup grid: (num_rows / 32, ceil(num_tokens / 32), num_experts); tiles past the end of a group exit early.
+
+constant float gptoss_mf4_values[16] = {
+    +0.0f, +0.5f, +1.0f, +1.5f, +2.0f, +3.0f, +4.0f, +6.0f,
+    -0.0f, -0.5f, -1.0f, -1.5f, -2.0f, -3.0f, -4.0f, -6.0f,
+};
+
+// With GPTOSS_ACTIVATION_TYPE_F16, the SwiGLU kernel stores its output, and the output projection kernel loads its
+// input, in half precision, which halves the traffic of the largest MoE activations. Without the function constant,
+// both use single precision.
+constant uint gptoss_fc_activation_type [[function_constant(GPTOSS_FUNCTION_CONSTANT_ACTIVATION_TYPE)]];
+constant bool gptoss_half_activations = is_function_constant_defined(gptoss_fc_activation_type) &&
+    gptoss_fc_activation_type == GPTOSS_ACTIVATION_TYPE_F16;
+
+template <bool swiglu, typename InputVec, typename Output>
+static inline void gptoss_f32_mf4w_moe_dense_matmul_impl(
+    constant gptoss_moe_dense_matmul_args& args,
+    const device InputVec* input,
+    const device uint* expert_offsets,
+    const device uint* assignments,
+    const device uint* weight_blocks,
+    const device uchar* weight_scales,
+    const device bfloat* bias,
+    device Output* output,
+    threadgroup float* input_tile,
+    threadgroup float* weight_tile,
+    threadgroup float* output_tile,
+    threadgroup uint* assignment_tile,
+    uint3 gid,
+    uint tid,
+    uint simdgroup_tid,
+    uint simdgroup_idx)
+{
+    const uint tile = 32;
+    const uint tile_vecs = tile / 4;
+    const uint expert_id = gid.z;
+    const uint group_start = expert_offsets[expert_id] + gid.y * tile;
+    const uint group_end = expert_offsets[expert_id + 1];
+    if (group_start >= group_end) {
+        return;
+    }
+    const uint num_tile_assignments = metal::min(group_end - group_start, tile);
+    const uint row_start = gid.x * tile;
+    const uint num_active_experts = args.num_active_experts;
+    const uint num_column_vecs = args.num_column_vecs;
+    const uint num_cols = num_column_vecs * 32;
+
+    if (tid < tile) {
+        assignment_tile[tid] = assignments[group_start + metal::min(tid, num_tile_assignments - 1)];
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    // Thread tid stages column vector (tid % 8) of the inputs of tile rows (tid / 8) and (tid / 8 + 16) ...
+    const uint stage_row = tid / tile_vecs;
+    const uint stage_col = tid % tile_vecs;
+    const bool stage_lo = stage_row < num_tile_assignments;
+    const bool stage_hi = stage_row + tile / 2 < num_tile_assignments;
+    const uint assignment_lo = assignment_tile[stage_row];
+    const uint assignment_hi = assignment_tile[stage_row + tile / 2];
+    const device InputVec* input_lo = input +
+        ((assignment_lo % num_active_experts) * args.input_expert_stride + (assignment_lo / num_active_experts) * num_cols) / 4 + stage_col;
+    const device InputVec* input_hi = input +
+        ((assignment_hi % num_active_experts) * args.input_expert_stride + (assignment_hi / num_active_experts) * num_cols) / 4 + stage_col;
+    // ... and decodes 8 weights (a quarter of a block) of weight row (tid / 4).
+    const uint weight_row = tid / 4;
+    const uint weight_quarter = tid % 4;
+    // In the tiled layout, the threadgroup reads each column vector of its 32 weight rows from one contiguous tile.
+    weight_blocks = (const device uint*) ((uintptr_t) (weight_blocks + gptoss_mf4_block_index(row_start + weight_row, 0, num_column_vecs) * 4 + weight_quarter) + expert_id * args.weight_expert_stride);
+    weight_scales = (const device uchar*) ((uintptr_t) (weight_scales + gptoss_mf4_scale_index(row_start + weight_row, 0, num_column_vecs)) + expert_id * args.weight_expert_stride);
+    bias = (const device bfloat*) ((uintptr_t) bias + expert_id * args.weight_expert_stride);
+    threadgroup float4* input_tile4 = reinterpret_cast<threadgroup float4*>(input_tile);
+    threadgroup float2* weight_tile2 = reinterpret_cast<threadgroup float2*>(weight_tile + weight_row * tile + weight_quarter * 8);
+
+    const uint simdgroup_token = (simdgroup_idx / 2) * (tile / 2);
+    const uint simdgroup_row = (simdgroup_idx % 2) * (tile / 2);
+    metal::simdgroup_float8x8 acc[2][2];
+    for (uint i = 0; i < 2; i++) {
+        for (uint j = 0; j < 2; j++) {
+            acc[i][j] = metal::make_filled_simdgroup_matrix<float, 8, 8>(0.0f);
+        }
+    }
+
+    for (uint k = 0; k < num_column_vecs; k++) {
+        const float4 value_lo = stage_lo ? static_cast<float4>(input_lo[k * tile_vecs]) : 0.0f;
+        const float4 value_hi = stage_hi ? static_cast<float4>(input_hi[k * tile_vecs]) : 0.0f;
+        const uint wblock = weight_blocks[k * gptoss_mf4_block_stride * 4];
+        // Block scales in the model file are biased by 14, which the (half-precision) decoding above accounts for
+        const float wscale = as_type<float>(static_cast<uint>(weight_scales[k * gptoss_mf4_scale_stride]) << 23) * 0x1.0p-14f;
+
+        // Wait until all simdgroups are done with the previous block
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        input_tile4[tid] = value_lo;
+        input_tile4[tid + tile * tile_vecs / 2] = value_hi;
+        for (uint b = 0; b < 4; b++) {
+            const uint wbyte = (wblock >> (b * 8)) & 0xFFu;
+            weight_tile2[b] = float2(gptoss_mf4_values[wbyte & 0x0Fu], gptoss_mf4_values[wbyte >> 4]) * wscale;
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+        for (uint kk = 0; kk < tile; kk += 8) {
+            metal::simdgroup_float8x8 a[2];
+            metal::simdgroup_float8x8 b[2];
+            for (uint i = 0; i < 2; i++) {
+                metal::simdgroup_load(a[i], input_tile + (simdgroup_token + i * 8) * tile + kk, tile);
+            }
+            for (uint j = 0; j < 2; j++) {
+                // Weights are stored row-major (weight row x column), so load them transposed
+                metal::simdgroup_load(b[j], weight_tile + (simdgroup_row + j * 8) * tile + kk, tile, ulong2(0, 0), /*transpose_matrix=*/true);
+            }
+            for (uint i = 0; i < 2; i++) {
+                for (uint j = 0; j < 2; j++) {
+                    metal::simdgroup_multiply_accumulate(acc[i][j], a[i], b[j], acc[i][j]);
+                }
+            }
+        }
+    }
+
+    for (uint i = 0; i < 2; i++) {
+        for (uint j = 0; j < 2; j++) {
+            metal::simdgroup_store(acc[i][j], output_tile + (simdgroup_token + i * 8) * tile + simdgroup_row + j * 8, tile);
+        }
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    // Each simdgroup scatters whole assignments of the tile back to their [slot][token] rows
+    for (uint t = simdgroup_idx; t < num_tile_assignments; t += 4) {
+        const uint assignment = assignment_tile[t];
+        const uint slot = assignment % num_active_experts;
+        const uint token = assignment / num_active_experts;
+        if (swiglu) {
+            // Weight rows 2i and 2i + 1 are the swish and linear parts of output channel i
+            if (simdgroup_tid < tile / 2) {
+                const uint row = row_start + 2 * simdgroup_tid;
+                const float2 x = reinterpret_cast<const threadgroup float2*>(output_tile + t * tile)[simdgroup_tid] +
+                    float2(static_cast<float>(bias[row]), static_cast<float>(bias[row + 1]));
+                const float swish_x = metal::min(x.x, args.swiglu_max);
+                const float linear_x = metal::clamp(x.y, args.swiglu_min, args.swiglu_max);
+                const float alpha = 1.702f;
+                const float swish_y = swish_x / (1.0f + metal::precise::exp(-alpha * swish_x));
+                const float swiglu_y = metal::fma(swish_y, linear_x, swish_y);
+                output[slot * args.output_expert_stride + token * (args.num_rows / 2) + row_start / 2 + simdgroup_tid] = static_cast<Output>(swiglu_y);
+            }
+        } else {
+            const uint row = row_start + simdgroup_tid;
+            const float sum = output_tile[t * tile + simdgroup_tid] + static_cast<float>(bias[row]);
+            output[slot * args.output_expert_stride + token * args.num_rows + row] = static_cast<Output>(sum);
+        }
+    }
+}
+
+kernel void gptoss_f32_mf4w_moe_dense_matmul_swiglu(
+    constant gptoss_moe_dense_matmul_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device uint* expert_offsets [[ buffer(2) ]],
+    const device uint* assignments [[ buffer(3) ]],
+    const device uint* weight_blocks [[ buffer(4) ]],
+    const device uchar* weight_scales [[ buffer(5) ]],
+    const device bfloat* bias [[ buffer(6) ]],
+    device float* output [[ buffer(7) ]],
+    const device gptoss_control* control [[ buffer(8) ]],
+    uint3 gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_index_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]])
+{
+    threadgroup float input_tile[32 * 32];
+    threadgroup float weight_tile[32 * 32];
+    threadgroup float output_tile[32 * 32];
+    threadgroup uint assignment_tile[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    if (gptoss_half_activations) {
+        gptoss_f32_mf4w_moe_dense_matmul_impl</*swiglu=*/true, float4, half>(
+            args, input, expert_offsets, assignments, weight_blocks, weight_scales, bias, reinterpret_cast<device half*>(output),
+            input_tile, weight_tile, output_tile, assignment_tile,
+            gid, tid, simdgroup_tid, simdgroup_idx);
+    } else {
+        gptoss_f32_mf4w_moe_dense_matmul_impl</*swiglu=*/true, float4, float>(
+            args, input, expert_offsets, assignments, weight_blocks, weight_scales, bias, output,
+            input_tile, weight_tile, output_tile, assignment_tile,
+            gid, tid, simdgroup_tid, simdgroup_idx);
+    }
+}
+
+kernel void gptoss_f32_mf4w_moe_dense_matmul(
+    constant gptoss_moe_dense_matmul_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device uint* expert_offsets [[ buffer(2) ]],
+    const device uint* assignments [[ buffer(3) ]],
+    const device uint* weight_blocks [[ buffer(4) ]],
+    const device uchar* weight_scales [[ buffer(5) ]],
+    const device bfloat* bias [[ buffer(6) ]],
+    device float* output [[ buffer(7) ]],
+    const device gptoss_control* control [[ buffer(8) ]],
+    uint3 gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_index_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]])
+{
+    threadgroup float input_tile[32 * 32];
+    threadgroup float weight_tile[32 * 32];
+    threadgroup float output_tile[32 * 32];
+    threadgroup uint assignment_tile[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    if (gptoss_half_activations) {
+        gptoss_f32_mf4w_moe_dense_matmul_impl</*swiglu=*/false, half4, float>(
+            args, reinterpret_cast<const device half4*>(input), expert_offsets, assignments, weight_blocks, weight_scales, bias, output,
+            input_tile, weight_tile, output_tile, assignment_tile,
+            gid, tid, simdgroup_tid, simdgroup_idx);
+    } else {
+        gptoss_f32_mf4w_moe_dense_matmul_impl</*swiglu=*/false, float4, float>(
+            args, input, expert_offsets, assignments, weight_blocks, weight_scales, bias, output,
+            input_tile, weight_tile, output_tile, assignment_tile,
+            gid, tid, simdgroup_tid, simdgroup_idx);
+    }
+}
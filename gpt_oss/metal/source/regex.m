@@ -0,0 +1,179 @@
+#import <Foundation/Foundation.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gpt-oss/types.h>
+
+#include <internal/log.h>
+#include <internal/regex.h>
+
+
+enum gptoss_status gptoss_regex_create(
+    const char* pattern,
+    struct gptoss_regex* regex_out)
+{
+    NSString* pattern_obj = [[NSString alloc] initWithUTF8String:pattern];
+    if (pattern_obj == nil) {
+        GPTOSS_LOG_ERROR("regular expression pattern is not a valid UTF-8 string");
+        return gptoss_status_invalid_argument;
+    }
+
+    NSError* error_obj = nil;
+    NSRegularExpression* regex_obj =
+        [[NSRegularExpression alloc] initWithPattern:pattern_obj options:0 error:&error_obj];
+    [pattern_obj release];
+    if (regex_obj == nil) {
+        GPTOSS_LOG_ERROR("failed to compile regular expression: %s",
+            error_obj != nil ? [[error_obj localizedDescription] UTF8String] : "unknown error");
+        return gptoss_status_invalid_argument;
+    }
+
+    regex_out->object = (void*) regex_obj;
+    return gptoss_status_success;
+}
+
+struct piece_list {
+    size_t* ends;
+    size_t num_pieces;
+    size_t capacity;
+    // Current position of the conversion from UTF-16 to UTF-8 offsets. Matches are reported in order, so the
+    // conversion only ever walks forward.
+    size_t utf8_offset;
+    size_t utf16_offset;
+};
+
+static size_t utf8_advance(struct piece_list* list, const char* text, size_t utf16_offset) {
+    while (list->utf16_offset < utf16_offset) {
+        const uint8_t lead_byte = (uint8_t) text[list->utf8_offset];
+        if (lead_byte < 0x80) {
+            list->utf8_offset += 1;
+            list->utf16_offset += 1;
+        } else if (lead_byte < 0xE0) {
+            list->utf8_offset += 2;
+            list->utf16_offset += 1;
+        } else if (lead_byte < 0xF0) {
+            list->utf8_offset += 3;
+            list->utf16_offset += 1;
+        } else {
+            // Characters outside of the BMP take a surrogate pair in UTF-16
+            list->utf8_offset += 4;
+            list->utf16_offset += 2;
+        }
+    }
+    return list->utf8_offset;
+}
+
+static bool append_piece(struct piece_list* list, size_t end) {
+    if (list->num_pieces != 0 && list->ends[list->num_pieces - 1] == end) {
+        return true;
+    }
+    if (list->num_pieces == list->capacity) {
+        const size_t new_capacity = list->capacity * 2;
+        size_t* new_ends = realloc(list->ends, new_capacity * sizeof(size_t));
+        if (new_ends == NULL) {
+            return false;
+        }
+        list->ends = new_ends;
+        list->capacity = new_capacity;
+    }
+    list->ends[list->num_pieces++] = end;
+    return true;
+}
+
+enum gptoss_status gptoss_regex_split(
+    const struct gptoss_regex* regex,
+    const char* text,
+    size_t text_length,
+    size_t** piece_ends_out,
+    size_t* num_pieces_out)
+{
+    if (text_length == 0) {
+        *piece_ends_out = NULL;
+        *num_pieces_out = 0;
+        return gptoss_status_success;
+    }
+
+    // Wraps the text without copying; fails if the text is not valid UTF-8.
+    CFStringRef string_ref = CFStringCreateWithBytesNoCopy(
+        kCFAllocatorDefault, (const UInt8*) text, (CFIndex) text_length, kCFStringEncodingUTF8,
+        /*isExternalRepresentation=*/false, kCFAllocatorNull);
+    if (string_ref == NULL) {
+        return gptoss_status_invalid_argument;
+    }
+    NSString* string_obj = (NSString*) string_ref;
+
+    // Cross-check the UTF-16 length of the string against the UTF-8 input. The offset conversion assumes that every
+    // byte of the input maps to exactly one character of the string.
+    size_t utf16_length = 0;
+    for (size_t i = 0; i < text_length; i++) {
+        const uint8_t byte = (uint8_t) text[i];
+        if ((byte & 0xC0) != 0x80) {
+            utf16_length += byte >= 0xF0 ? 2 : 1;
+        }
+    }
+    if ((size_t) [string_obj length] != utf16_length) {
+        CFRelease(string_ref);
+        return gptoss_status_invalid_argument;
+    }
+
+    struct piece_list list = {
+        .ends = malloc(64 * sizeof(size_t)),
+        .capacity = 64,
+    };
+    if (list.ends == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate regex match list");
+        CFRelease(string_ref);
+        return gptoss_status_insufficient_memory;
+    }
+    struct piece_list* list_ptr = &list;
+    __block bool out_of_memory = false;
+
+    NSRegularExpression* regex_obj = (NSRegularExpression*) regex->object;
+    @autoreleasepool {
+        [regex_obj enumerateMatchesInString:string_obj
+                                    options:0
+                                      range:NSMakeRange(0, (NSUInteger) utf16_length)
+                                 usingBlock:^(NSTextCheckingResult* result, NSMatchingFlags flags, BOOL* stop) {
+            const NSRange range = [result range];
+            if (range.length == 0) {
+                return;
+            }
+            // Text before the match (if any) forms a separate piece
+            const size_t match_start = utf8_advance(list_ptr, text, (size_t) range.location);
+            const size_t match_end = utf8_advance(list_ptr, text, (size_t) (range.location + range.length));
+            if ((match_start != 0 && !append_piece(list_ptr, match_start)) || !append_piece(list_ptr, match_end)) {
+                out_of_memory = true;
+                *stop = YES;
+            }
+        }];
+    }
+    CFRelease(string_ref);
+
+    if (!out_of_memory && !append_piece(&list, text_length)) {
+        out_of_memory = true;
+    }
+    if (out_of_memory) {
+        GPTOSS_LOG_ERROR("failed to grow regex match list to %zu entries", list.capacity * 2);
+        free(list.ends);
+        return gptoss_status_insufficient_memory;
+    }
+
+    *piece_ends_out = list.ends;
+    *num_pieces_out = list.num_pieces;
+    return gptoss_status_success;
+}
+
+enum gptoss_status gptoss_regex_release(
+    struct gptoss_regex* regex)
+{
+    if (regex->object != NULL) {
+        NSRegularExpression* regex_obj = (NSRegularExpression*) regex->object;
+        [regex_obj release];
+    }
+    memset(regex, 0, sizeof(struct gptoss_regex));
+    return gptoss_status_success;
+}
@@ -1,3 +1,4 @@
+#include <metal_atomic>
 #include <metal_compute>
 #include <metal_integer>
 #include <metal_math>
@@ -207,3 +208,422 @@ kernel void gptoss_f32_sample(
         *prediction = sample_idx;
     }
 }
+
+// Maps a float to an unsigned integer key with the same ordering.
+inline static uint f32_order_key(float value) {
+    const uint bits = as_type<uint>(value);
+    return static_cast<int>(bits) < 0 ? ~bits : bits | 0x80000000u;
+}
+
+// Exclusive prefix sum across the threadgroup. Must be called by all threads in the threadgroup.
+template <typename T>
+inline static T threadgroup_prefix_exclusive_sum(
+    T value,
+    threadgroup T* simdgroup_sums,
+    uint simdgroup_tid,
+    uint simdgroup_size,
+    uint simdgroup_idx)
+{
+    const T simdgroup_prefix = metal::simd_prefix_exclusive_sum(value);
+    if (simdgroup_tid == simdgroup_size - 1) {
+        simdgroup_sums[simdgroup_idx] = simdgroup_prefix + value;
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    T prefix = simdgroup_prefix;
+    for (uint i = 0; i < simdgroup_idx; i++) {
+        prefix += simdgroup_sums[i];
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    return prefix;
+}
+
+// Samples a token among the top_k highest-scoring ones, further restricted to the smallest prefix of them (in the
+// order of decreasing score) with probability mass of at least top_p. The top_k candidates are found with a radix
+// select over the bits of the scores, so neither the probabilities of the whole vocabulary nor a full sort are needed:
+// the scores are read four times by a single threadgroup, and only the candidates are sorted.
+[[max_total_threads_per_threadgroup(1024)]]
+kernel void gptoss_f32_topk_sample(
+    constant gptoss_topk_sample_args& args [[ buffer(0) ]],
+    device const float* score [[ buffer(1) ]],
+    device uint* prediction [[ buffer(2) ]],
+    device gptoss_control* control [[ buffer(3) ]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_size [[threads_per_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]])
+{
+    threadgroup metal::atomic_uint threadgroup_histogram[2048];
+    threadgroup float threadgroup_candidate_score[GPTOSS_MAX_TOP_K];
+    threadgroup uint threadgroup_candidate_token[GPTOSS_MAX_TOP_K];
+    threadgroup uint threadgroup_uint_sums[32];
+    threadgroup float threadgroup_float_sums[32];
+    threadgroup uint threadgroup_selection[2];
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint num_candidates = args.top_k;
+
+    // Radix select of the key of the num_candidates-th highest score, 11 + 11 + 10 bits at a time.
+    uint key_prefix = 0;
+    uint key_prefix_mask = 0;
+    uint num_greater = 0;
+    uint num_remaining = num_candidates;
+    for (uint pass = 0; pass < 3; pass++) {
+        const uint shift = pass == 0 ? 21 : pass == 1 ? 10 : 0;
+        const uint num_bins = pass == 2 ? 1024 : 2048;
+        for (uint bin = tid; bin < num_bins; bin += threadgroup_size) {
+            metal::atomic_store_explicit(&threadgroup_histogram[bin], 0u, metal::memory_order_relaxed);
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        for (uint i = tid; i < args.num_vecs; i += threadgroup_size) {
+            const uint key = f32_order_key(score[i]);
+            if ((key & key_prefix_mask) == key_prefix) {
+                metal::atomic_fetch_add_explicit(&threadgroup_histogram[(key >> shift) & (num_bins - 1)], 1u, metal::memory_order_relaxed);
+            }
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+        // Each thread counts a contiguous range of bins in order of decreasing key, and the thread whose range contains
+        // the num_remaining-th key finds its bin.
+        const uint bins_per_thread = (num_bins + threadgroup_size - 1) / threadgroup_size;
+        uint bin_count = 0;
+        for (uint j = 0; j < bins_per_thread; j++) {
+            const uint bin_rank = tid * bins_per_thread + j;
+            if (bin_rank < num_bins) {
+                bin_count += metal::atomic_load_explicit(&threadgroup_histogram[num_bins - 1 - bin_rank], metal::memory_order_relaxed);
+            }
+        }
+        const uint count_before = threadgroup_prefix_exclusive_sum(
+            bin_count, threadgroup_uint_sums, simdgroup_tid, simdgroup_size, simdgroup_idx);
+        if (count_before < num_remaining && count_before + bin_count >= num_remaining) {
+            uint count = count_before;
+            for (uint j = 0; j < bins_per_thread; j++) {
+                const uint bin = num_bins - 1 - (tid * bins_per_thread + j);
+                const uint bin_size = metal::atomic_load_explicit(&threadgroup_histogram[bin], metal::memory_order_relaxed);
+                if (count + bin_size >= num_remaining) {
+                    threadgroup_selection[0] = bin;
+                    threadgroup_selection[1] = count;
+                    break;
+                }
+                count += bin_size;
+            }
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        const uint selected_bin = threadgroup_selection[0];
+        const uint num_selected_greater = threadgroup_selection[1];
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+        num_greater += num_selected_greater;
+        num_remaining -= num_selected_greater;
+        key_prefix |= selected_bin << shift;
+        key_prefix_mask |= (num_bins - 1) << shift;
+    }
+
+    // Gather candidates: num_greater scores strictly above the threshold key, and num_remaining of the scores equal
+    // to it. Unused slots up to the next power of 2 are padded for the sort.
+    const uint num_sorted = 1u << (32 - metal::clz(num_candidates - 1));
+    for (uint i = num_candidates + tid; i < num_sorted; i += threadgroup_size) {
+        threadgroup_candidate_score[i] = -INFINITY;
+        threadgroup_candidate_token[i] = 0;
+    }
+    if (tid == 0) {
+        metal::atomic_store_explicit(&threadgroup_histogram[0], 0u, metal::memory_order_relaxed);
+        metal::atomic_store_explicit(&threadgroup_histogram[1], 0u, metal::memory_order_relaxed);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    for (uint i = tid; i < args.num_vecs; i += threadgroup_size) {
+        const float score_val = score[i];
+        const uint key = f32_order_key(score_val);
+        uint slot = num_candidates;
+        if (key > key_prefix) {
+            slot = metal::atomic_fetch_add_explicit(&threadgroup_histogram[0], 1u, metal::memory_order_relaxed);
+        } else if (key == key_prefix) {
+            const uint tie_idx = metal::atomic_fetch_add_explicit(&threadgroup_histogram[1], 1u, metal::memory_order_relaxed);
+            if (tie_idx < num_remaining) {
+                slot = num_greater + tie_idx;
+            }
+        }
+        if (slot < num_candidates) {
+            threadgroup_candidate_score[slot] = score_val;
+            threadgroup_candidate_token[slot] = i;
+        }
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    // Bitonic sort of the candidates in order of decreasing score.
+    for (uint k = 2; k <= num_sorted; k <<= 1) {
+        for (uint j = k >> 1; j != 0; j >>= 1) {
+            for (uint i = tid; i < num_sorted; i += threadgroup_size) {
+                const uint l = i ^ j;
+                if (l > i) {
+                    const float score_i = threadgroup_candidate_score[i];
+                    const float score_l = threadgroup_candidate_score[l];
+                    const bool descending = (i & k) == 0;
+                    if (descending ? score_i < score_l : score_i > score_l) {
+                        const uint token_i = threadgroup_candidate_token[i];
+                        threadgroup_candidate_score[i] = score_l;
+                        threadgroup_candidate_score[l] = score_i;
+                        threadgroup_candidate_token[i] = threadgroup_candidate_token[l];
+                        threadgroup_candidate_token[l] = token_i;
+                    }
+                }
+            }
+            metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        }
+    }
+
+    // Replace candidate scores with the cumulative unnormalized probabilities.
+    const float max_score = threadgroup_candidate_score[0];
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    const uint candidates_per_thread = (num_candidates + threadgroup_size - 1) / threadgroup_size;
+    const uint chunk_start = metal::min(tid * candidates_per_thread, num_candidates);
+    const uint chunk_end = metal::min(chunk_start + candidates_per_thread, num_candidates);
+    float cumsum = 0.0f;
+    for (uint i = chunk_start; i < chunk_end; i++) {
+        cumsum += metal::precise::exp((threadgroup_candidate_score[i] - max_score) * args.temperature);
+        threadgroup_candidate_score[i] = cumsum;
+    }
+    const float cumsum_before = threadgroup_prefix_exclusive_sum(
+        cumsum, threadgroup_float_sums, simdgroup_tid, simdgroup_size, simdgroup_idx);
+    for (uint i = chunk_start; i < chunk_end; i++) {
+        threadgroup_candidate_score[i] += cumsum_before;
+    }
+    if (tid == 0) {
+        threadgroup_selection[0] = num_candidates;
+        threadgroup_selection[1] = num_candidates;
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    // Nucleus: the smallest number of candidates with cumulative probability of at least top_p.
+    uint num_nucleus = num_candidates;
+    if (args.top_p < 1.0f) {
+        const float nucleus_mass = args.top_p * threadgroup_candidate_score[num_candidates - 1];
+        for (uint i = chunk_start; i < chunk_end; i++) {
+            if (threadgroup_candidate_score[i] >= nucleus_mass && (i == 0 || threadgroup_candidate_score[i - 1] < nucleus_mass)) {
+                threadgroup_selection[0] = i + 1;
+            }
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        num_nucleus = threadgroup_selection[0];
+    }
+
+    const uint sample_word = rng_squares32(args.rng_offset, args.rng_seed);
+    const float sample_cdf = static_cast<float>(sample_word & 0x00FFFFFFu) * 0x1.0p-24f * threadgroup_candidate_score[num_nucleus - 1];
+    for (uint i = chunk_start; i < metal::min(chunk_end, num_nucleus); i++) {
+        if (threadgroup_candidate_score[i] > sample_cdf && (i == 0 || threadgroup_candidate_score[i - 1] <= sample_cdf)) {
+            threadgroup_selection[1] = i;
+        }
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    if (tid == 0) {
+        const uint sample_idx = metal::min(threadgroup_selection[1], num_nucleus - 1);
+        *prediction = threadgroup_candidate_token[sample_idx];
+    }
+}
+
+// Computes log-softmax of each row of scores at the position of the corresponding token.
+kernel void gptoss_f32_gather_logprob(
+    constant gptoss_gather_logprob_args& args [[ buffer(0) ]],
+    const device float* score [[ buffer(1) ]],
+    const device uint2* argmax [[ buffer(2) ]],
+    const device uint* token [[ buffer(3) ]],
+    device float* logprob [[ buffer(4) ]],
+    const device gptoss_control* control [[ buffer(5) ]],
+    uint gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    threadgroup float threadgroup_sumexp[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    score += gid * args.num_vecs;
+
+    uint max_bits = argmax[gid].y;
+    if (static_cast<int>(max_bits) >= 0) {
+        max_bits ^= 0x7FFFFFFFu;
+    }
+    const float max_val = as_type<float>(max_bits);
+    float sum_exp = 0.0f;
+    for (uint i = tid; i < args.num_vecs; i += threadgroup_size) {
+        sum_exp += metal::precise::exp(score[i] - max_val);
+    }
+    sum_exp = metal::simd_sum(sum_exp);
+    if (metal::simd_is_first()) {
+        threadgroup_sumexp[simdgroup_idx] = sum_exp;
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    if (simdgroup_idx == 0) {
+        sum_exp = 0.0f;
+        if (simdgroup_tid < num_simdgroups) {
+            sum_exp = threadgroup_sumexp[simdgroup_tid];
+        }
+        sum_exp = metal::simd_sum(sum_exp);
+        if (metal::simd_is_first()) {
+            logprob[gid] = (score[token[gid]] - max_val) - metal::precise::log(sum_exp);
+        }
+    }
+}
+
+// Finds the args.num_top highest scores of each row, and computes their log-softmax. A single pass over the scores
+// computes the softmax denominator, with the maximum from the unembedding argmax, while each thread keeps its own
+// top args.num_top scores in decreasing order. The per-thread lists are then merged with args.num_top threadgroup-wide
+// max reductions, one per reported token. Ties go to the lower token ID.
+[[max_total_threads_per_threadgroup(1024)]]
+kernel void gptoss_f32_top_logprobs(
+    constant gptoss_top_logprobs_args& args [[ buffer(0) ]],
+    const device float* score [[ buffer(1) ]],
+    const device uint2* argmax [[ buffer(2) ]],
+    device uint* top_token [[ buffer(3) ]],
+    device float* top_logprob [[ buffer(4) ]],
+    const device gptoss_control* control [[ buffer(5) ]],
+    uint gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    threadgroup float threadgroup_sumexp[32];
+    threadgroup uint threadgroup_key[32];
+    threadgroup uint threadgroup_token[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    score += gid * args.num_vecs;
+    top_token += gid * args.num_top;
+    top_logprob += gid * args.num_top;
+
+    uint max_bits = argmax[gid].y;
+    if (static_cast<int>(max_bits) >= 0) {
+        max_bits ^= 0x7FFFFFFFu;
+    }
+    const float max_val = as_type<float>(max_bits);
+
+    const uint num_top = args.num_top;
+    float local_score[GPTOSS_MAX_TOP_LOGPROBS];
+    uint local_token[GPTOSS_MAX_TOP_LOGPROBS];
+    uint num_local = 0;
+    float sum_exp = 0.0f;
+    for (uint i = tid; i < args.num_vecs; i += threadgroup_size) {
+        const float score_val = score[i];
+        sum_exp += metal::precise::exp(score_val - max_val);
+        // Tokens are visited in increasing order, so a tie keeps the earlier token ahead.
+        if (num_local < num_top || score_val > local_score[num_local - 1]) {
+            uint j = num_local < num_top ? num_local++ : num_top - 1;
+            for (; j != 0 && local_score[j - 1] < score_val; j--) {
+                local_score[j] = local_score[j - 1];
+                local_token[j] = local_token[j - 1];
+            }
+            local_score[j] = score_val;
+            local_token[j] = i;
+        }
+    }
+    sum_exp = metal::simd_sum(sum_exp);
+    if (metal::simd_is_first()) {
+        threadgroup_sumexp[simdgroup_idx] = sum_exp;
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    sum_exp = 0.0f;
+    if (simdgroup_tid < num_simdgroups) {
+        sum_exp = threadgroup_sumexp[simdgroup_tid];
+    }
+    const float log_sum_exp = metal::precise::log(metal::simd_sum(sum_exp));
+
+    uint head = 0;
+    for (uint r = 0; r < num_top; r++) {
+        uint key = 0;
+        uint token = 0xFFFFFFFFu;
+        if (head < num_local) {
+            key = f32_order_key(local_score[head]);
+            token = local_token[head];
+        }
+        uint max_key = metal::simd_max(key);
+        uint max_token = metal::simd_min(key == max_key ? token : 0xFFFFFFFFu);
+        if (metal::simd_is_first()) {
+            threadgroup_key[simdgroup_idx] = max_key;
+            threadgroup_token[simdgroup_idx] = max_token;
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        uint simdgroup_key = 0;
+        uint simdgroup_token = 0xFFFFFFFFu;
+        if (simdgroup_tid < num_simdgroups) {
+            simdgroup_key = threadgroup_key[simdgroup_tid];
+            simdgroup_token = threadgroup_token[simdgroup_tid];
+        }
+        max_key = metal::simd_max(simdgroup_key);
+        max_token = metal::simd_min(simdgroup_key == max_key ? simdgroup_token : 0xFFFFFFFFu);
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+        // Token IDs are unique, so only the thread holding the winner advances.
+        if (token == max_token) {
+            head += 1;
+        }
+        if (tid == 0) {
+            top_token[r] = max_token;
+            top_logprob[r] = (score[max_token] - max_val) - log_sum_exp;
+        }
+    }
+}
+
+kernel void gptoss_u32_check_stop_tokens(
+    constant gptoss_check_stop_tokens_args& args [[ buffer(0) ]],
+    const device uint* token [[ buffer(1) ]],
+    device gptoss_control* control [[ buffer(2) ]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_size [[threads_per_simdgroup]])
+{
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint token_id = *token;
+    bool is_stop_token = false;
+    for (uint i = simdgroup_tid; i < args.num_stop_tokens; i += simdgroup_size) {
+        is_stop_token |= args.stop_tokens[i] == token_id;
+    }
+    // Turn all kernels encoded after this one into no-ops
+    if (metal::simd_any(is_stop_token) && metal::simd_is_first()) {
+        control->abort = 1;
+    }
+}
+
+// Moves the token automaton of a context to its next state after the token was sampled. Runs on a single thread.
+kernel void gptoss_u32_advance_token_automaton(
+    constant gptoss_token_automaton_args& args [[ buffer(0) ]],
+    const device uint* token [[ buffer(1) ]],
+    const device uint* transitions [[ buffer(2) ]],
+    device gptoss_control* control [[ buffer(3) ]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]])
+{
+    if (control->abort != 0 || simdgroup_tid != 0) {
+        return;
+    }
+
+    const device uint* row_offsets = transitions;
+    const device uint* default_states = row_offsets + args.num_states + 1;
+    const device uint* transition_tokens = default_states + args.num_states;
+    const device uint* transition_states = transition_tokens + args.num_transitions;
+
+    const uint token_id = *token;
+    const uint state = control->token_state;
+    uint lo = row_offsets[state];
+    uint hi = row_offsets[state + 1];
+    while (lo < hi) {
+        const uint mid = lo + (hi - lo) / 2;
+        if (transition_tokens[mid] < token_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const bool explicit_transition = lo < row_offsets[state + 1] && transition_tokens[lo] == token_id;
+    control->token_state = explicit_transition ? transition_states[lo] : default_states[state];
+}
@@ -0,0 +1,333 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gpt-oss.h>
+
+#include "internal/log.h"
+#include "internal/macros.h"
+#include "internal/math.h"
+#include "internal/model.h"
+
+
+static void release_request(
+    struct gptoss_scheduler_request* request)
+{
+    gptoss_context_release(request->context);
+    free(request->stop_tokens);
+    memset(request, 0, sizeof(struct gptoss_scheduler_request));
+}
+
+// Removes the request at the given index, keeping the others in submission order.
+static void retire_request(
+    gptoss_scheduler_t scheduler,
+    size_t index)
+{
+    assert(index < scheduler->num_requests);
+    release_request(&scheduler->requests[index]);
+    memmove(&scheduler->requests[index], &scheduler->requests[index + 1],
+        (scheduler->num_requests - index - 1) * sizeof(struct gptoss_scheduler_request));
+    scheduler->num_requests -= 1;
+}
+
+static bool is_stop_token(
+    const struct gptoss_scheduler_request* request,
+    uint32_t token)
+{
+    for (size_t i = 0; i < request->num_stop_tokens; i++) {
+        if (request->stop_tokens[i] == token) {
+            return true;
+        }
+    }
+    return false;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_create(
+    gptoss_model_t model,
+    size_t max_batch_tokens,
+    gptoss_scheduler_t* scheduler_out)
+{
+    *scheduler_out = NULL;
+
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_scheduler* scheduler = NULL;
+
+    if (max_batch_tokens == 0) {
+        max_batch_tokens = model->max_batch_tokens;
+    }
+    if (max_batch_tokens > model->max_batch_tokens) {
+        GPTOSS_LOG_ERROR("maximum number of tokens per step (%zu) exceeds the maximum batch size of the model (%zu)",
+            max_batch_tokens, model->max_batch_tokens);
+        return gptoss_status_invalid_argument;
+    }
+
+    scheduler = malloc(sizeof(struct gptoss_scheduler));
+    if (scheduler == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for Scheduler object", sizeof(struct gptoss_scheduler));
+        return gptoss_status_insufficient_memory;
+    }
+    memset(scheduler, 0, sizeof(struct gptoss_scheduler));
+
+    atomic_store_explicit(&scheduler->ref_count, 1, memory_order_relaxed);
+    scheduler->max_batch_tokens = max_batch_tokens;
+    scheduler->prefill_contexts = malloc(max_batch_tokens * sizeof(struct gptoss_context*));
+    scheduler->num_prefill_tokens = malloc(max_batch_tokens * sizeof(size_t));
+    scheduler->sample_contexts = malloc(max_batch_tokens * sizeof(struct gptoss_context*));
+    scheduler->sample_requests = malloc(max_batch_tokens * sizeof(size_t));
+    scheduler->temperatures = malloc(max_batch_tokens * sizeof(float));
+    scheduler->seeds = malloc(max_batch_tokens * sizeof(uint64_t));
+    scheduler->sampled_tokens = malloc(max_batch_tokens * sizeof(uint32_t));
+    if (scheduler->prefill_contexts == NULL || scheduler->num_prefill_tokens == NULL ||
+        scheduler->sample_contexts == NULL || scheduler->sample_requests == NULL ||
+        scheduler->temperatures == NULL || scheduler->seeds == NULL || scheduler->sampled_tokens == NULL)
+    {
+        GPTOSS_LOG_ERROR("failed to allocate scratch arrays for %zu tokens per step", max_batch_tokens);
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    scheduler->model = model;
+    gptoss_model_retain(model);
+    *scheduler_out = scheduler;
+    scheduler = NULL;
+
+cleanup:
+    gptoss_scheduler_release(scheduler);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_submit(
+    gptoss_scheduler_t scheduler,
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens,
+    uint64_t* request_id_out)
+{
+    if (context->model != scheduler->model) {
+        GPTOSS_LOG_ERROR("context was created for a different model than the scheduler");
+        return gptoss_status_invalid_argument;
+    }
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("context is empty");
+        return gptoss_status_invalid_argument;
+    }
+    if (context->num_tokens < context->num_prefix_tokens) {
+        GPTOSS_LOG_ERROR("context does not contain all shared prefix tokens");
+        return gptoss_status_invalid_state;
+    }
+    if (context->num_tokens == context->max_tokens) {
+        GPTOSS_LOG_ERROR("context is full");
+        return gptoss_status_context_overflow;
+    }
+    if (context->num_token_states != 0) {
+        GPTOSS_LOG_ERROR("context is constrained by a token automaton, which the scheduler does not support");
+        return gptoss_status_unsupported_argument;
+    }
+    if (!(temperature >= 0.0f)) {
+        GPTOSS_LOG_ERROR("temperature (%f) must be non-negative", temperature);
+        return gptoss_status_invalid_argument;
+    }
+    if (max_tokens == 0) {
+        GPTOSS_LOG_ERROR("maximum number of tokens to generate must be positive");
+        return gptoss_status_invalid_argument;
+    }
+    for (size_t i = 0; i < scheduler->num_requests; i++) {
+        if (scheduler->requests[i].context == context) {
+            GPTOSS_LOG_ERROR("context is already used by request %" PRIu64, scheduler->requests[i].id);
+            return gptoss_status_invalid_argument;
+        }
+    }
+
+    if (scheduler->num_requests == scheduler->max_requests) {
+        const size_t max_requests = math_max(2 * scheduler->max_requests, 16);
+        struct gptoss_scheduler_request* requests =
+            realloc(scheduler->requests, max_requests * sizeof(struct gptoss_scheduler_request));
+        if (requests == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for scheduler requests",
+                max_requests * sizeof(struct gptoss_scheduler_request));
+            return gptoss_status_insufficient_memory;
+        }
+        scheduler->requests = requests;
+        scheduler->max_requests = max_requests;
+    }
+
+    uint32_t* stop_tokens_copy = NULL;
+    if (num_stop_tokens != 0) {
+        stop_tokens_copy = malloc(num_stop_tokens * sizeof(uint32_t));
+        if (stop_tokens_copy == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for stop tokens", num_stop_tokens * sizeof(uint32_t));
+            return gptoss_status_insufficient_memory;
+        }
+        memcpy(stop_tokens_copy, stop_tokens, num_stop_tokens * sizeof(uint32_t));
+    }
+
+    const uint64_t request_id = scheduler->next_request_id++;
+    gptoss_context_retain(context);
+    scheduler->requests[scheduler->num_requests++] = (struct gptoss_scheduler_request) {
+        .id = request_id,
+        .context = context,
+        .temperature = temperature,
+        .seed = seed,
+        .max_tokens = max_tokens,
+        .num_stop_tokens = num_stop_tokens,
+        .stop_tokens = stop_tokens_copy,
+    };
+    *request_id_out = request_id;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_cancel(
+    gptoss_scheduler_t scheduler,
+    uint64_t request_id)
+{
+    for (size_t i = 0; i < scheduler->num_requests; i++) {
+        if (scheduler->requests[i].id == request_id) {
+            retire_request(scheduler, i);
+            return gptoss_status_success;
+        }
+    }
+
+    GPTOSS_LOG_ERROR("scheduler has no request %" PRIu64, request_id);
+    return gptoss_status_invalid_argument;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_get_num_requests(
+    gptoss_scheduler_t scheduler,
+    size_t* num_requests_out)
+{
+    *num_requests_out = scheduler->num_requests;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_step(
+    gptoss_scheduler_t scheduler,
+    size_t max_outputs,
+    uint64_t* request_ids_out,
+    uint32_t* tokens_out,
+    uint8_t* finished_out,
+    size_t* num_outputs_out)
+{
+    *num_outputs_out = 0;
+
+    // Running requests whose prompt is fully processed decode a token. The remaining budget goes to prefill chunks of
+    // the other admitted requests in submission order; a request whose prefill completes within the budget also
+    // samples its first token in the same step.
+    const size_t num_admitted_requests = math_min(scheduler->num_requests, scheduler->max_batch_tokens);
+    const size_t max_samples = math_min(max_outputs, scheduler->max_batch_tokens);
+    size_t num_budget_tokens = scheduler->max_batch_tokens;
+    size_t num_prefill_contexts = 0;
+    size_t num_sample_contexts = 0;
+    for (size_t i = 0; i < num_admitted_requests && num_sample_contexts < max_samples; i++) {
+        const struct gptoss_scheduler_request* request = &scheduler->requests[i];
+        if (request->context->num_kv_tokens + 1 >= request->context->num_tokens) {
+            scheduler->sample_contexts[num_sample_contexts] = request->context;
+            scheduler->sample_requests[num_sample_contexts] = i;
+            num_sample_contexts += 1;
+            num_budget_tokens -= 1;
+        }
+    }
+    for (size_t i = 0; i < num_admitted_requests && num_budget_tokens != 0; i++) {
+        const struct gptoss_scheduler_request* request = &scheduler->requests[i];
+        const size_t num_pending_tokens = math_sub_sat(request->context->num_tokens - 1, request->context->num_kv_tokens);
+        if (num_pending_tokens == 0) {
+            continue;
+        }
+
+        const size_t num_chunk_tokens = math_min(num_pending_tokens, num_budget_tokens);
+        scheduler->prefill_contexts[num_prefill_contexts] = request->context;
+        scheduler->num_prefill_tokens[num_prefill_contexts] = num_chunk_tokens;
+        num_prefill_contexts += 1;
+        num_budget_tokens -= num_chunk_tokens;
+        if (num_chunk_tokens == num_pending_tokens && num_budget_tokens != 0 && num_sample_contexts < max_samples) {
+            scheduler->sample_contexts[num_sample_contexts] = request->context;
+            scheduler->sample_requests[num_sample_contexts] = i;
+            num_sample_contexts += 1;
+            num_budget_tokens -= 1;
+        }
+    }
+    if (num_prefill_contexts + num_sample_contexts == 0) {
+        return gptoss_status_success;
+    }
+
+    for (size_t i = 0; i < num_sample_contexts; i++) {
+        const struct gptoss_scheduler_request* request = &scheduler->requests[scheduler->sample_requests[i]];
+        scheduler->temperatures[i] = request->temperature;
+        scheduler->seeds[i] = request->seed;
+    }
+
+    const enum gptoss_status status = gptoss_context_batch_step(
+        num_prefill_contexts,
+        (const gptoss_context_t*) scheduler->prefill_contexts,
+        scheduler->num_prefill_tokens,
+        num_sample_contexts,
+        (const gptoss_context_t*) scheduler->sample_contexts,
+        scheduler->temperatures,
+        scheduler->seeds,
+        scheduler->sampled_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    // Finished requests are retired right away, so that waiting requests are admitted in the next step. Sampled
+    // requests are visited in decreasing index order, so that retiring a request doesn't shift those not yet visited.
+    for (size_t i = 0; i < num_sample_contexts; i++) {
+        struct gptoss_scheduler_request* request = &scheduler->requests[scheduler->sample_requests[i]];
+        const uint32_t token = scheduler->sampled_tokens[i];
+        request->num_generated_tokens += 1;
+        request_ids_out[i] = request->id;
+        tokens_out[i] = token;
+        finished_out[i] = (uint8_t) (is_stop_token(request, token) ||
+            request->num_generated_tokens == request->max_tokens ||
+            request->context->num_tokens == request->context->max_tokens);
+    }
+    *num_outputs_out = num_sample_contexts;
+    for (size_t i = scheduler->num_requests; i-- != 0;) {
+        for (size_t j = 0; j < num_sample_contexts; j++) {
+            if (scheduler->sample_requests[j] == i && finished_out[j] != 0) {
+                retire_request(scheduler, i);
+                break;
+            }
+        }
+    }
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_retain(
+    gptoss_scheduler_t scheduler)
+{
+    atomic_fetch_add_explicit(&scheduler->ref_count, 1, memory_order_relaxed);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_scheduler_release(
+    gptoss_scheduler_t scheduler)
+{
+    if (scheduler != NULL) {
+        if (atomic_fetch_sub_explicit(&scheduler->ref_count, 1, memory_order_acq_rel) == 1) {
+            for (size_t i = 0; i < scheduler->num_requests; i++) {
+                release_request(&scheduler->requests[i]);
+            }
+            free(scheduler->requests);
+            free(scheduler->prefill_contexts);
+            free(scheduler->num_prefill_tokens);
+            free(scheduler->sample_contexts);
+            free(scheduler->sample_requests);
+            free(scheduler->temperatures);
+            free(scheduler->seeds);
+            free(scheduler->sampled_tokens);
+            gptoss_model_release(scheduler->model);
+
+            memset(scheduler, 0, sizeof(struct gptoss_scheduler));
+            free(scheduler);
+        }
+    }
+    return gptoss_status_success;
+}
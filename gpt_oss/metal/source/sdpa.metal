@@ -9,42 +9,84 @@
 #pragma METAL fp math_mode(safe)
 #pragma METAL fp contract(off)
 
-// Each threadgroup handles 8 Q heads / 1 KV head for 1 token
+// KV cache storage formats. Each K or V head of a token is stored as a contiguous record of head_size bytes.
 
-kernel void gptoss_f32_sdpa_q8_d64(
-    constant gptoss_sdpa_args& args [[ buffer(0) ]],
-    const device float* q [[ buffer(1) ]],
-    const device float* k [[ buffer(2) ]],
-    const device float* v [[ buffer(3) ]],
-    const device bfloat* s [[ buffer(4) ]],
-    device float* output [[ buffer(5) ]],
-    const device gptoss_control* control [[ buffer(6) ]],
-    threadgroup void* threadgroup_buffer [[ threadgroup(0) ]],
-    uint2 gid [[threadgroup_position_in_grid]],
-    uint2 tid [[thread_position_in_threadgroup]],
-    uint simdgroup_tid [[thread_index_in_simdgroup]],
-    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
-    uint num_simdgroups [[simdgroups_per_threadgroup]])
+struct gptoss_f32_kv {
+    static constexpr uint head_size = 64 * sizeof(float);
+
+    static inline float2 load(const device uchar* head, uint simdgroup_tid) {
+        return reinterpret_cast<const device float2*>(head)[simdgroup_tid];
+    }
+};
+
+struct gptoss_bf16_kv {
+    static constexpr uint head_size = 64 * sizeof(bfloat);
+
+    static inline float2 load(const device uchar* head, uint simdgroup_tid) {
+        return static_cast<float2>(reinterpret_cast<const device bfloat2*>(head)[simdgroup_tid]);
+    }
+};
+
+// 64 int8 values followed by a float scale.
+struct gptoss_i8_kv {
+    static constexpr uint head_size = 64 * sizeof(char) + sizeof(float);
+
+    static inline float2 load(const device uchar* head, uint simdgroup_tid) {
+        const float scale = *reinterpret_cast<const device float*>(head + 64 * sizeof(char));
+        return static_cast<float2>(reinterpret_cast<const device char2*>(head)[simdgroup_tid]) * scale;
+    }
+};
+
+constant uint gptoss_fc_num_kv_heads [[function_constant(GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS)]];
+
+// Each threadgroup handles 8 Q heads / 1 KV head for 1 token. With args.num_splits > 1, the threadgroup only covers
+// the gid.z-th chunk of args.split_tokens KV tokens, and writes an unnormalized partial result for gptoss_f32_sdpa_reduce_q8_d64.
+
+template <typename kv_type>
+static inline void gptoss_f32_sdpa_q8_d64_impl(
+    constant gptoss_sdpa_args& args,
+    const device float* q,
+    const device uchar* k,
+    const device uchar* v,
+    const device bfloat* s,
+    device float* output,
+    const device gptoss_control* control,
+    const device uchar* prefix_k,
+    const device uchar* prefix_v,
+    const device uint* page_table,
+    threadgroup void* threadgroup_buffer,
+    uint3 gid,
+    uint2 tid,
+    uint simdgroup_tid,
+    uint simdgroup_idx,
+    uint num_simdgroups)
 {
     const uint simdgroup_size = 32;
     if (control->abort != 0) {
         return;
     }
 
-    const uint num_q_heads = 64;
-    const uint num_kv_heads = 8;
-    const uint head_dim = 64;
+    const uint num_kv_heads = gptoss_fc_num_kv_heads;
     const uint qmul = 8;
+    const uint num_q_heads = num_kv_heads * qmul;
+    const uint head_dim = 64;
 
-    const uint token_stride = 2 * num_kv_heads * head_dim;
+    const uint token_stride = 2 * num_kv_heads * kv_type::head_size;
 
     const uint qt = gid.x;  // Q token index
     const uint h = gid.y;   // KV head index
+    const uint split = gid.z;  // KV range split index
 
     q += qt * args.qkv_dim + h * (qmul * head_dim);
-    k += h * head_dim;
-    v += h * head_dim;
-    output += qt * (num_q_heads * head_dim) + h * (qmul * head_dim);
+    k += h * kv_type::head_size;
+    v += h * kv_type::head_size;
+    prefix_k += h * kv_type::head_size;
+    prefix_v += h * kv_type::head_size;
+    if (args.num_splits > 1) {
+        output += ((qt * num_kv_heads + h) * args.num_splits + split) * (qmul * head_dim + 2 * qmul);
+    } else {
+        output += qt * (num_q_heads * head_dim) + h * (qmul * head_dim);
+    }
 
     float m0 = static_cast<float>(s[h * qmul + 0]);
     float m1 = static_cast<float>(s[h * qmul + 1]);
@@ -55,14 +97,15 @@ kernel void gptoss_f32_sdpa_q8_d64(
     float m6 = static_cast<float>(s[h * qmul + 6]);
     float m7 = static_cast<float>(s[h * qmul + 7]);
 
-    float l0 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l1 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l2 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l3 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l4 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l5 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l6 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l7 = simdgroup_idx == 0 ? 1.0f : 0.0f;
+    // The attention sink is accounted for once, by the first simdgroup of the first split.
+    float l0 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float l1 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float l2 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float l3 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float l4 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float l5 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float l6 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float l7 = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
 
     float2 out0 = 0.0f;
     float2 out1 = 0.0f;
@@ -82,13 +125,29 @@ kernel void gptoss_f32_sdpa_q8_d64(
     float2 q6 = reinterpret_cast<const device float2*>(q + 6 * head_dim)[simdgroup_tid];
     float2 q7 = reinterpret_cast<const device float2*>(q + 7 * head_dim)[simdgroup_tid];
 
-    const uint kt_end = qt + args.num_kv_tokens + 1;
-    const uint kt_start = metal::subsat(kt_end, args.window) + simdgroup_idx;
-    k += token_stride * kt_start;
-    v += token_stride * kt_start;
+    // This split attends to KV tokens [kv_start, kt_end) of the window ending at Q token qt.
+    const uint kv_end = qt + args.num_kv_tokens + 1;
+    const uint kv_start = metal::subsat(kv_end, args.window) + split * args.split_tokens;
+    const uint kt_end = kv_start + metal::min(args.split_tokens, metal::subsat(kv_end, kv_start));
+    const uint kt_start = kv_start + simdgroup_idx;
     for (uint kt = kt_start; kt < kt_end; kt += num_simdgroups) {
-        const float2 kval = reinterpret_cast<const device float2*>(k)[simdgroup_tid];
-        k += token_stride * num_simdgroups;
+        // Tokens before num_prefix_tokens come from the shared prefix KV cache, the rest from the private KV cache.
+        // For sliding-window blocks both are ring buffers, while the private KV cache of full-attention blocks is paged.
+        const device uchar* kt_k;
+        const device uchar* kt_v;
+        if (kt < args.num_prefix_tokens) {
+            const uint prefix_slot = kt % args.prefix_capacity;
+            kt_k = prefix_k + token_stride * prefix_slot;
+            kt_v = prefix_v + token_stride * prefix_slot;
+        } else {
+            const uint i = kt - args.num_prefix_tokens;
+            const uint kv_slot = args.paged != 0 ?
+                page_table[i / GPTOSS_KVCACHE_PAGE_TOKENS] * GPTOSS_KVCACHE_PAGE_TOKENS + i % GPTOSS_KVCACHE_PAGE_TOKENS :
+                i % args.kv_capacity;
+            kt_k = k + token_stride * kv_slot;
+            kt_v = v + token_stride * kv_slot;
+        }
+        const float2 kval = kv_type::load(kt_k, simdgroup_tid);
 
         float qk0 = metal::dot(q0, kval);
         float qk1 = metal::dot(q1, kval);
@@ -153,8 +212,7 @@ kernel void gptoss_f32_sdpa_q8_d64(
         m6 = new_m6;
         m7 = new_m7;
 
-        const float2 vval = reinterpret_cast<const device float2*>(v)[simdgroup_tid];
-        v += token_stride * num_simdgroups;
+        const float2 vval = kv_type::load(kt_v, simdgroup_tid);
         out0 = metal::fma(vval, qk0, out0 * alpha0);
         out1 = metal::fma(vval, qk1, out1 * alpha1);
         out2 = metal::fma(vval, qk2, out2 * alpha2);
@@ -223,6 +281,15 @@ kernel void gptoss_f32_sdpa_q8_d64(
         out6 *= metal::fast::exp(m6 - threadgroup_m6);
         out7 *= metal::fast::exp(m7 - threadgroup_m7);
 
+        m0 = threadgroup_m0;
+        m1 = threadgroup_m1;
+        m2 = threadgroup_m2;
+        m3 = threadgroup_m3;
+        m4 = threadgroup_m4;
+        m5 = threadgroup_m5;
+        m6 = threadgroup_m6;
+        m7 = threadgroup_m7;
+
         if (simdgroup_idx == 0) {
             l0 = 0.0f;
             l1 = 0.0f;
@@ -285,7 +352,22 @@ kernel void gptoss_f32_sdpa_q8_d64(
             num_threads = num_half_threads;
         } while (num_threads > simdgroup_size);
     }
-    if (simdgroup_idx == 0) {
+    if (simdgroup_idx == 0 && args.num_splits > 1) {
+        reinterpret_cast<device float2*>(output + 0 * head_dim)[simdgroup_tid] = out0;
+        reinterpret_cast<device float2*>(output + 1 * head_dim)[simdgroup_tid] = out1;
+        reinterpret_cast<device float2*>(output + 2 * head_dim)[simdgroup_tid] = out2;
+        reinterpret_cast<device float2*>(output + 3 * head_dim)[simdgroup_tid] = out3;
+        reinterpret_cast<device float2*>(output + 4 * head_dim)[simdgroup_tid] = out4;
+        reinterpret_cast<device float2*>(output + 5 * head_dim)[simdgroup_tid] = out5;
+        reinterpret_cast<device float2*>(output + 6 * head_dim)[simdgroup_tid] = out6;
+        reinterpret_cast<device float2*>(output + 7 * head_dim)[simdgroup_tid] = out7;
+        if (metal::simd_is_first()) {
+            reinterpret_cast<device float4*>(output + qmul * head_dim)[0] = float4(m0, m1, m2, m3);
+            reinterpret_cast<device float4*>(output + qmul * head_dim)[1] = float4(m4, m5, m6, m7);
+            reinterpret_cast<device float4*>(output + qmul * head_dim)[2] = float4(l0, l1, l2, l3);
+            reinterpret_cast<device float4*>(output + qmul * head_dim)[3] = float4(l4, l5, l6, l7);
+        }
+    } else if (simdgroup_idx == 0) {
         reinterpret_cast<device float2*>(output + 0 * head_dim)[simdgroup_tid] = out0 / l0;
         reinterpret_cast<device float2*>(output + 1 * head_dim)[simdgroup_tid] = out1 / l1;
         reinterpret_cast<device float2*>(output + 2 * head_dim)[simdgroup_tid] = out2 / l2;
@@ -296,3 +378,120 @@ kernel void gptoss_f32_sdpa_q8_d64(
         reinterpret_cast<device float2*>(output + 7 * head_dim)[simdgroup_tid] = out7 / l7;
     }
 }
+
+kernel void gptoss_f32_sdpa_q8_d64(
+    constant gptoss_sdpa_args& args [[ buffer(0) ]],
+    const device float* q [[ buffer(1) ]],
+    const device uchar* k [[ buffer(2) ]],
+    const device uchar* v [[ buffer(3) ]],
+    const device bfloat* s [[ buffer(4) ]],
+    device float* output [[ buffer(5) ]],
+    const device gptoss_control* control [[ buffer(6) ]],
+    const device uchar* prefix_k [[ buffer(7) ]],
+    const device uchar* prefix_v [[ buffer(8) ]],
+    const device uint* page_table [[ buffer(9) ]],
+    threadgroup void* threadgroup_buffer [[ threadgroup(0) ]],
+    uint3 gid [[threadgroup_position_in_grid]],
+    uint2 tid [[thread_position_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    gptoss_f32_sdpa_q8_d64_impl<gptoss_f32_kv>(
+        args, q, k, v, s, output, control, prefix_k, prefix_v, page_table, threadgroup_buffer,
+        gid, tid, simdgroup_tid, simdgroup_idx, num_simdgroups);
+}
+
+kernel void gptoss_f32_bf16kv_sdpa_q8_d64(
+    constant gptoss_sdpa_args& args [[ buffer(0) ]],
+    const device float* q [[ buffer(1) ]],
+    const device uchar* k [[ buffer(2) ]],
+    const device uchar* v [[ buffer(3) ]],
+    const device bfloat* s [[ buffer(4) ]],
+    device float* output [[ buffer(5) ]],
+    const device gptoss_control* control [[ buffer(6) ]],
+    const device uchar* prefix_k [[ buffer(7) ]],
+    const device uchar* prefix_v [[ buffer(8) ]],
+    const device uint* page_table [[ buffer(9) ]],
+    threadgroup void* threadgroup_buffer [[ threadgroup(0) ]],
+    uint3 gid [[threadgroup_position_in_grid]],
+    uint2 tid [[thread_position_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    gptoss_f32_sdpa_q8_d64_impl<gptoss_bf16_kv>(
+        args, q, k, v, s, output, control, prefix_k, prefix_v, page_table, threadgroup_buffer,
+        gid, tid, simdgroup_tid, simdgroup_idx, num_simdgroups);
+}
+
+kernel void gptoss_f32_i8kv_sdpa_q8_d64(
+    constant gptoss_sdpa_args& args [[ buffer(0) ]],
+    const device float* q [[ buffer(1) ]],
+    const device uchar* k [[ buffer(2) ]],
+    const device uchar* v [[ buffer(3) ]],
+    const device bfloat* s [[ buffer(4) ]],
+    device float* output [[ buffer(5) ]],
+    const device gptoss_control* control [[ buffer(6) ]],
+    const device uchar* prefix_k [[ buffer(7) ]],
+    const device uchar* prefix_v [[ buffer(8) ]],
+    const device uint* page_table [[ buffer(9) ]],
+    threadgroup void* threadgroup_buffer [[ threadgroup(0) ]],
+    uint3 gid [[threadgroup_position_in_grid]],
+    uint2 tid [[thread_position_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    gptoss_f32_sdpa_q8_d64_impl<gptoss_i8_kv>(
+        args, q, k, v, s, output, control, prefix_k, prefix_v, page_table, threadgroup_buffer,
+        gid, tid, simdgroup_tid, simdgroup_idx, num_simdgroups);
+}
+
+// Combines the partial results of args.num_splits KV range splits written by the SDPA kernels.
+// Each threadgroup handles 8 Q heads / 1 KV head for 1 token, with one simdgroup per Q head.
+
+kernel void gptoss_f32_sdpa_reduce_q8_d64(
+    constant gptoss_sdpa_reduce_args& args [[ buffer(0) ]],
+    const device float* partial [[ buffer(1) ]],
+    device float* output [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]])
+{
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint num_kv_heads = gptoss_fc_num_kv_heads;
+    const uint qmul = 8;
+    const uint num_q_heads = num_kv_heads * qmul;
+    const uint head_dim = 64;
+    const uint partial_size = qmul * head_dim + 2 * qmul;
+
+    const uint qt = gid.x;  // Q token index
+    const uint h = gid.y;   // KV head index
+    const uint qh = simdgroup_idx;  // Q head index within the KV head group
+
+    partial += (qt * num_kv_heads + h) * args.num_splits * partial_size;
+    output += qt * (num_q_heads * head_dim) + (h * qmul + qh) * head_dim;
+
+    float m = partial[qmul * head_dim + qh];
+    float l = partial[qmul * head_dim + qmul + qh];
+    float2 out = reinterpret_cast<const device float2*>(partial + qh * head_dim)[simdgroup_tid];
+    for (uint split = 1; split < args.num_splits; split++) {
+        partial += partial_size;
+        const float split_m = partial[qmul * head_dim + qh];
+        const float split_l = partial[qmul * head_dim + qmul + qh];
+        const float2 split_out = reinterpret_cast<const device float2*>(partial + qh * head_dim)[simdgroup_tid];
+
+        const float new_m = metal::max(m, split_m);
+        const float alpha = metal::fast::exp(m - new_m);
+        const float beta = metal::fast::exp(split_m - new_m);
+        l = metal::fma(l, alpha, split_l * beta);
+        out = metal::fma(split_out, beta, out * alpha);
+        m = new_m;
+    }
+    reinterpret_cast<device float2*>(output)[simdgroup_tid] = out / l;
+}
@@ -1,17 +1,22 @@
 #include <assert.h>
+#include <inttypes.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include <gpt-oss.h>
 
 #include "internal/log.h"
+#include "internal/math.h"
 #include "internal/model.h"
+#include "internal/regex.h"
 
 
 enum gptoss_status GPTOSS_ABI gptoss_tokenizer_get_special_token_id(
@@ -66,17 +71,545 @@ enum gptoss_status GPTOSS_ABI gptoss_tokenizer_decode(
         return gptoss_status_invalid_argument;
     }
 
-    const char* token_ptr = (const char*) tokenizer->tokens_ptr;
-    for (uint32_t t = 0; t < token_id; t++) {
+    const char* token_ptr = tokenizer->tokens_ptr + tokenizer->token_offsets[token_id];
+    // Reading unaligned uint16_t
+    uint16_t token_length;
+    memcpy(&token_length, token_ptr, sizeof(token_length));
+
+    *token_ptr_out = (const void*) (token_ptr + sizeof(uint16_t));
+    *token_size_out = (size_t) token_length;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_tokenizer_decode_batch(
+    gptoss_tokenizer_t tokenizer,
+    size_t num_tokens,
+    const uint32_t* token_ids,
+    size_t buffer_size,
+    void* buffer,
+    size_t* num_bytes_out)
+{
+    // Validate all tokens and compute the total size of their byte representation
+    size_t num_bytes = 0;
+    for (size_t t = 0; t < num_tokens; t++) {
+        const uint32_t token_id = token_ids[t];
+        if (token_id >= tokenizer->num_text_tokens) {
+            GPTOSS_LOG_ERROR("token %" PRIu32 " at index %zu is not a text token", token_id, t);
+            return gptoss_status_invalid_argument;
+        }
+
         // Reading unaligned uint16_t
         uint16_t token_length;
+        memcpy(&token_length, tokenizer->tokens_ptr + tokenizer->token_offsets[token_id], sizeof(token_length));
+        num_bytes += (size_t) token_length;
+    }
+
+    *num_bytes_out = num_bytes;
+    if (num_bytes > buffer_size) {
+        return gptoss_status_insufficient_memory;
+    }
+
+    char* output = (char*) buffer;
+    for (size_t t = 0; t < num_tokens; t++) {
+        const char* token_ptr = tokenizer->tokens_ptr + tokenizer->token_offsets[token_ids[t]];
+        uint16_t token_length;
         memcpy(&token_length, token_ptr, sizeof(token_length));
 
-        token_ptr += (size_t) token_length + sizeof(uint16_t);
+        memcpy(output, token_ptr + sizeof(uint16_t), (size_t) token_length);
+        output += (size_t) token_length;
     }
+    return gptoss_status_success;
+}
 
-    *token_ptr_out = (const void*) (token_ptr + sizeof(uint16_t));
-    *token_size_out = (size_t) *token_ptr;
+struct token_list {
+    uint32_t* tokens;
+    size_t num_tokens;
+    size_t capacity;
+};
+
+static bool token_list_append(struct token_list* list, const uint32_t* tokens, size_t num_tokens) {
+    if (list->capacity - list->num_tokens < num_tokens) {
+        size_t new_capacity = list->capacity != 0 ? list->capacity : 256;
+        while (new_capacity - list->num_tokens < num_tokens) {
+            new_capacity *= 2;
+        }
+        uint32_t* new_tokens = realloc(list->tokens, new_capacity * sizeof(uint32_t));
+        if (new_tokens == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for encoded tokens", new_capacity * sizeof(uint32_t));
+            return false;
+        }
+        list->tokens = new_tokens;
+        list->capacity = new_capacity;
+    }
+    memcpy(list->tokens + list->num_tokens, tokens, num_tokens * sizeof(uint32_t));
+    list->num_tokens += num_tokens;
+    return true;
+}
+
+// Returns the ID of the text token with exactly the given bytes, or UINT32_MAX if there is no such token.
+static uint32_t lookup_token(const struct gptoss_tokenizer* tokenizer, const char* bytes, size_t length) {
+    if (length > UINT16_MAX) {
+        return UINT32_MAX;
+    }
+    const uint32_t mask = tokenizer->token_hash_mask;
+    for (uint32_t slot = (uint32_t) gptoss_tokenizer_hash(bytes, length) & mask; ; slot = (slot + 1) & mask) {
+        const uint32_t token_id = tokenizer->token_hash_table[slot];
+        if (token_id == UINT32_MAX) {
+            return UINT32_MAX;
+        }
+        const char* token_ptr = tokenizer->tokens_ptr + tokenizer->token_offsets[token_id];
+        // Reading unaligned uint16_t
+        uint16_t token_length;
+        memcpy(&token_length, token_ptr, sizeof(token_length));
+        if (token_length == length && memcmp(token_ptr + sizeof(uint16_t), bytes, length) == 0) {
+            return token_id;
+        }
+    }
+}
+
+struct bpe_part {
+    // Offset of the part within the piece
+    size_t start;
+    // Rank of the token formed by merging this part with the next one, or UINT32_MAX if they can't be merged
+    uint32_t rank;
+};
+
+static uint32_t bpe_merge_rank(
+    const struct gptoss_tokenizer* tokenizer,
+    const char* piece,
+    const struct bpe_part* parts,
+    size_t num_parts,
+    size_t i)
+{
+    // The last entry of parts is a sentinel marking the end of the piece
+    if (i + 2 >= num_parts) {
+        return UINT32_MAX;
+    }
+    return lookup_token(tokenizer, piece + parts[i].start, parts[i + 2].start - parts[i].start);
+}
+
+// Encodes a pre-tokenized piece by repeatedly merging the adjacent pair of parts that forms the lowest-rank token,
+// starting from single bytes. Text token IDs are the merge ranks.
+static enum gptoss_status bpe_encode_piece(
+    const struct gptoss_tokenizer* tokenizer,
+    const char* piece,
+    size_t length,
+    struct token_list* output)
+{
+    const uint32_t piece_token = lookup_token(tokenizer, piece, length);
+    if (piece_token != UINT32_MAX) {
+        return token_list_append(output, &piece_token, 1) ? gptoss_status_success : gptoss_status_insufficient_memory;
+    }
+
+    struct bpe_part local_parts[64];
+    struct bpe_part* parts = local_parts;
+    size_t num_parts = length + 1;
+    if (num_parts > sizeof(local_parts) / sizeof(local_parts[0])) {
+        parts = malloc(num_parts * sizeof(struct bpe_part));
+        if (parts == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for BPE state", num_parts * sizeof(struct bpe_part));
+            return gptoss_status_insufficient_memory;
+        }
+    }
+    for (size_t i = 0; i < num_parts; i++) {
+        parts[i].start = i;
+    }
+    for (size_t i = 0; i < num_parts; i++) {
+        parts[i].rank = bpe_merge_rank(tokenizer, piece, parts, num_parts, i);
+    }
+
+    for (;;) {
+        uint32_t min_rank = UINT32_MAX;
+        size_t min_index = 0;
+        for (size_t i = 0; i + 1 < num_parts; i++) {
+            if (parts[i].rank < min_rank) {
+                min_rank = parts[i].rank;
+                min_index = i;
+            }
+        }
+        if (min_rank == UINT32_MAX) {
+            break;
+        }
+
+        // Merge part min_index with the next one
+        memmove(&parts[min_index + 1], &parts[min_index + 2], (num_parts - min_index - 2) * sizeof(struct bpe_part));
+        num_parts -= 1;
+        parts[min_index].rank = bpe_merge_rank(tokenizer, piece, parts, num_parts, min_index);
+        if (min_index != 0) {
+            parts[min_index - 1].rank = bpe_merge_rank(tokenizer, piece, parts, num_parts, min_index - 1);
+        }
+    }
+
+    enum gptoss_status status = gptoss_status_success;
+    for (size_t i = 0; i + 1 < num_parts; i++) {
+        const uint32_t token = lookup_token(tokenizer, piece + parts[i].start, parts[i + 1].start - parts[i].start);
+        if (token == UINT32_MAX) {
+            GPTOSS_LOG_ERROR("failed to tokenize byte 0x%02" PRIX8, (uint8_t) piece[parts[i].start]);
+            status = gptoss_status_invalid_argument;
+            break;
+        }
+        if (!token_list_append(output, &token, 1)) {
+            status = gptoss_status_insufficient_memory;
+            break;
+        }
+    }
+    if (parts != local_parts) {
+        free(parts);
+    }
+    return status;
+}
+
+static void cache_lru_unlink(struct gptoss_tokenizer_cache_shard* shard, uint16_t index) {
+    struct gptoss_tokenizer_cache_entry* entry = &shard->entries[index];
+    if (entry->lru_prev != UINT16_MAX) {
+        shard->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != UINT16_MAX) {
+        shard->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void cache_lru_push_front(struct gptoss_tokenizer_cache_shard* shard, uint16_t index) {
+    struct gptoss_tokenizer_cache_entry* entry = &shard->entries[index];
+    entry->lru_prev = UINT16_MAX;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != UINT16_MAX) {
+        shard->entries[shard->lru_head].lru_prev = index;
+    } else {
+        shard->lru_tail = index;
+    }
+    shard->lru_head = index;
+}
+
+// Finds the word in the shard and marks it as most recently used. Must be called with the shard mutex held.
+static uint16_t cache_find(
+    struct gptoss_tokenizer_cache_shard* shard,
+    uint64_t hash,
+    const char* word,
+    size_t length)
+{
+    const size_t bucket = (size_t) (hash >> 32) % GPTOSS_TOKENIZER_CACHE_SHARD_BUCKETS;
+    for (uint16_t index = shard->buckets[bucket]; index != UINT16_MAX; index = shard->entries[index].bucket_next) {
+        const struct gptoss_tokenizer_cache_entry* entry = &shard->entries[index];
+        if (entry->hash == hash && entry->word_length == length && memcmp(entry->word, word, length) == 0) {
+            if (shard->lru_head != index) {
+                cache_lru_unlink(shard, index);
+                cache_lru_push_front(shard, index);
+            }
+            return index;
+        }
+    }
+    return UINT16_MAX;
+}
+
+// Adds the word to the shard, evicting the least recently used entry if the shard is full. Must be called with the
+// shard mutex held.
+static void cache_insert(
+    struct gptoss_tokenizer_cache_shard* shard,
+    uint64_t hash,
+    const char* word,
+    size_t length,
+    const uint32_t* tokens,
+    size_t num_tokens)
+{
+    uint16_t index;
+    if (shard->num_entries < GPTOSS_TOKENIZER_CACHE_SHARD_ENTRIES) {
+        index = shard->num_entries++;
+    } else {
+        index = shard->lru_tail;
+        cache_lru_unlink(shard, index);
+
+        // Remove the evicted entry from its hash bucket
+        const size_t old_bucket = (size_t) (shard->entries[index].hash >> 32) % GPTOSS_TOKENIZER_CACHE_SHARD_BUCKETS;
+        uint16_t* link = &shard->buckets[old_bucket];
+        while (*link != index) {
+            link = &shard->entries[*link].bucket_next;
+        }
+        *link = shard->entries[index].bucket_next;
+    }
+
+    struct gptoss_tokenizer_cache_entry* entry = &shard->entries[index];
+    entry->hash = hash;
+    entry->word_length = (uint8_t) length;
+    entry->num_tokens = (uint8_t) num_tokens;
+    memcpy(entry->word, word, length);
+    memcpy(entry->tokens, tokens, num_tokens * sizeof(uint32_t));
+
+    const size_t bucket = (size_t) (hash >> 32) % GPTOSS_TOKENIZER_CACHE_SHARD_BUCKETS;
+    entry->bucket_next = shard->buckets[bucket];
+    shard->buckets[bucket] = index;
+    cache_lru_push_front(shard, index);
+}
+
+// Encodes a pre-tokenized piece, using the word cache for short pieces.
+static enum gptoss_status encode_piece(
+    const struct gptoss_tokenizer* tokenizer,
+    const char* piece,
+    size_t length,
+    struct token_list* output)
+{
+    if (length > GPTOSS_TOKENIZER_CACHE_MAX_WORD_BYTES) {
+        return bpe_encode_piece(tokenizer, piece, length, output);
+    }
+
+    const uint64_t hash = gptoss_tokenizer_hash(piece, length);
+    struct gptoss_tokenizer_cache_shard* shard = &tokenizer->cache_shards[hash % GPTOSS_TOKENIZER_CACHE_SHARDS];
+    uint32_t cached_tokens[GPTOSS_TOKENIZER_CACHE_MAX_WORD_TOKENS];
+    size_t num_cached_tokens = 0;
+    pthread_mutex_lock(&shard->mutex);
+    const uint16_t index = cache_find(shard, hash, piece, length);
+    if (index != UINT16_MAX) {
+        num_cached_tokens = shard->entries[index].num_tokens;
+        memcpy(cached_tokens, shard->entries[index].tokens, num_cached_tokens * sizeof(uint32_t));
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (index != UINT16_MAX) {
+        return token_list_append(output, cached_tokens, num_cached_tokens) ?
+            gptoss_status_success : gptoss_status_insufficient_memory;
+    }
+
+    const size_t output_offset = output->num_tokens;
+    const enum gptoss_status status = bpe_encode_piece(tokenizer, piece, length, output);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    const size_t num_tokens = output->num_tokens - output_offset;
+    if (num_tokens <= GPTOSS_TOKENIZER_CACHE_MAX_WORD_TOKENS) {
+        pthread_mutex_lock(&shard->mutex);
+        // Another thread might have added the same word in the meantime
+        if (cache_find(shard, hash, piece, length) == UINT16_MAX) {
+            cache_insert(shard, hash, piece, length, output->tokens + output_offset, num_tokens);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return gptoss_status_success;
+}
+
+// Encodes text by repeatedly taking the longest text token that prefixes the remaining text.
+static enum gptoss_status encode_longest_match(
+    const struct gptoss_tokenizer* tokenizer,
+    const char* text,
+    size_t text_length,
+    struct token_list* output)
+{
+    while (text_length != 0) {
+        // Walk the prefix trie along the text, remembering the longest complete token seen so far.
+        uint32_t best_token = UINT32_MAX;
+        size_t best_token_length = 0;
+        uint32_t node_index = tokenizer->trie_root_children[(uint8_t) text[0]];
+        size_t prefix_length = 1;
+        while (node_index != 0) {
+            const struct gptoss_tokenizer_trie_node* node = &tokenizer->trie_nodes[node_index];
+            if (node->token_id != UINT32_MAX) {
+                best_token = node->token_id;
+                best_token_length = prefix_length;
+            }
+            if (prefix_length == text_length) {
+                break;
+            }
+            const uint8_t next_byte = (uint8_t) text[prefix_length++];
+            node_index = node->first_child;
+            while (node_index != 0 && tokenizer->trie_nodes[node_index].byte != next_byte) {
+                node_index = tokenizer->trie_nodes[node_index].next_sibling;
+            }
+        }
+
+        if (best_token == UINT32_MAX) {
+            GPTOSS_LOG_ERROR("failed to tokenize text \"%.*s\"", (int) text_length, text);
+            return gptoss_status_invalid_argument;
+        }
+        if (!token_list_append(output, &best_token, 1)) {
+            return gptoss_status_insufficient_memory;
+        }
+        text += best_token_length;
+        text_length -= best_token_length;
+    }
+    return gptoss_status_success;
+}
+
+// Splits the pieces of a long text into chunks, which are encoded by several threads into separate token lists.
+struct parallel_encoder {
+    const struct gptoss_tokenizer* tokenizer;
+    const char* text;
+    const size_t* piece_ends;
+    // First piece of each chunk, with an extra entry for the end of the last chunk
+    const size_t* chunk_pieces;
+    size_t num_chunks;
+    struct token_list* chunk_tokens;
+    atomic_size_t next_chunk;
+    // First error of any thread (as enum gptoss_status), or gptoss_status_success
+    atomic_int status;
+};
+
+static void* parallel_encoder_thread(void* arg) {
+    struct parallel_encoder* encoder = (struct parallel_encoder*) arg;
+    while (atomic_load_explicit(&encoder->status, memory_order_relaxed) == gptoss_status_success) {
+        const size_t chunk = atomic_fetch_add_explicit(&encoder->next_chunk, 1, memory_order_relaxed);
+        if (chunk >= encoder->num_chunks) {
+            break;
+        }
+
+        for (size_t p = encoder->chunk_pieces[chunk]; p < encoder->chunk_pieces[chunk + 1]; p++) {
+            const size_t piece_start = p != 0 ? encoder->piece_ends[p - 1] : 0;
+            const enum gptoss_status status = encode_piece(encoder->tokenizer, encoder->text + piece_start,
+                encoder->piece_ends[p] - piece_start, &encoder->chunk_tokens[chunk]);
+            if (status != gptoss_status_success) {
+                int expected = gptoss_status_success;
+                atomic_compare_exchange_strong_explicit(&encoder->status, &expected, (int) status,
+                    memory_order_relaxed, memory_order_relaxed);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static enum gptoss_status encode_pieces_parallel(
+    const struct gptoss_tokenizer* tokenizer,
+    const char* text,
+    const size_t* piece_ends,
+    size_t num_pieces,
+    struct token_list* output)
+{
+    enum gptoss_status status = gptoss_status_success;
+    const size_t max_chunks = math_ceil_div(piece_ends[num_pieces - 1], (size_t) GPTOSS_TOKENIZER_PARALLEL_CHUNK_BYTES) + 1;
+    size_t* chunk_pieces = malloc((max_chunks + 1) * sizeof(size_t));
+    struct token_list* chunk_tokens = calloc(max_chunks, sizeof(struct token_list));
+    pthread_t threads[GPTOSS_TOKENIZER_ENCODER_THREADS - 1];
+    size_t num_threads = 0;
+    if (chunk_pieces == NULL || chunk_tokens == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate parallel encoder state for %zu chunks", max_chunks);
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    // Chunks end at piece boundaries once they reach the target size
+    size_t num_chunks = 0;
+    size_t chunk_start = 0;
+    chunk_pieces[0] = 0;
+    for (size_t p = 0; p < num_pieces; p++) {
+        if (piece_ends[p] - chunk_start >= GPTOSS_TOKENIZER_PARALLEL_CHUNK_BYTES || p + 1 == num_pieces) {
+            chunk_pieces[++num_chunks] = p + 1;
+            chunk_start = piece_ends[p];
+        }
+    }
+    assert(num_chunks <= max_chunks);
+
+    struct parallel_encoder encoder = {
+        .tokenizer = tokenizer,
+        .text = text,
+        .piece_ends = piece_ends,
+        .chunk_pieces = chunk_pieces,
+        .num_chunks = num_chunks,
+        .chunk_tokens = chunk_tokens,
+    };
+    atomic_init(&encoder.next_chunk, 0);
+    atomic_init(&encoder.status, gptoss_status_success);
+
+    // The calling thread encodes chunks too
+    for (size_t i = 0; i + 1 < math_min(num_chunks, (size_t) GPTOSS_TOKENIZER_ENCODER_THREADS); i++) {
+        const int error = pthread_create(&threads[i], NULL, parallel_encoder_thread, &encoder);
+        if (error != 0) {
+            GPTOSS_LOG_WARNING("failed to start tokenizer thread #%zu: error %d", i, error);
+            break;
+        }
+        num_threads += 1;
+    }
+    parallel_encoder_thread(&encoder);
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    status = (enum gptoss_status) atomic_load_explicit(&encoder.status, memory_order_relaxed);
+    for (size_t c = 0; c < num_chunks && status == gptoss_status_success; c++) {
+        if (!token_list_append(output, chunk_tokens[c].tokens, chunk_tokens[c].num_tokens)) {
+            status = gptoss_status_insufficient_memory;
+        }
+    }
+
+cleanup:
+    if (chunk_tokens != NULL) {
+        for (size_t c = 0; c < max_chunks; c++) {
+            free(chunk_tokens[c].tokens);
+        }
+    }
+    free(chunk_tokens);
+    free(chunk_pieces);
+    return status;
+}
+
+enum gptoss_status gptoss_tokenizer_encode_text(
+    const struct gptoss_tokenizer* tokenizer,
+    const char* text,
+    size_t text_length,
+    uint32_t** tokens_out,
+    size_t* num_tokens_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct token_list output = { 0 };
+    size_t* piece_ends = NULL;
+    size_t num_pieces = 0;
+
+    if (tokenizer->regex.object != NULL) {
+        status = gptoss_regex_split(&tokenizer->regex, text, text_length, &piece_ends, &num_pieces);
+        if (status == gptoss_status_invalid_argument) {
+            GPTOSS_LOG_WARNING("text is not valid UTF-8, falling back to longest-match encoding");
+            status = encode_longest_match(tokenizer, text, text_length, &output);
+        } else if (status == gptoss_status_success) {
+            if (text_length >= GPTOSS_TOKENIZER_PARALLEL_MIN_BYTES) {
+                status = encode_pieces_parallel(tokenizer, text, piece_ends, num_pieces, &output);
+            } else {
+                for (size_t p = 0; p < num_pieces; p++) {
+                    const size_t piece_start = p != 0 ? piece_ends[p - 1] : 0;
+                    status = encode_piece(tokenizer, text + piece_start, piece_ends[p] - piece_start, &output);
+                    if (status != gptoss_status_success) {
+                        break;
+                    }
+                }
+            }
+        }
+    } else {
+        status = encode_longest_match(tokenizer, text, text_length, &output);
+    }
+    free(piece_ends);
+
+    if (status != gptoss_status_success) {
+        free(output.tokens);
+        return status;
+    }
+    *tokens_out = output.tokens;
+    *num_tokens_out = output.num_tokens;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_tokenizer_encode(
+    gptoss_tokenizer_t tokenizer,
+    const char* text,
+    size_t text_length,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    uint32_t* tokens = NULL;
+    size_t num_tokens = 0;
+    const enum gptoss_status status = gptoss_tokenizer_encode_text(tokenizer, text, text_length, &tokens, &num_tokens);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    *num_tokens_out = num_tokens;
+    if (num_tokens > max_tokens) {
+        free(tokens);
+        return gptoss_status_insufficient_memory;
+    }
+    if (num_tokens != 0) {
+        memcpy(tokens_out, tokens, num_tokens * sizeof(uint32_t));
+    }
+    free(tokens);
     return gptoss_status_success;
 }
 
@@ -98,6 +631,17 @@ enum gptoss_status GPTOSS_ABI gptoss_tokenizer_release(
                 }
             }
 
+            free(tokenizer->token_offsets);
+            free(tokenizer->trie_nodes);
+            free(tokenizer->token_hash_table);
+            gptoss_regex_release(&tokenizer->regex);
+            if (tokenizer->cache_shards != NULL) {
+                for (size_t i = 0; i < GPTOSS_TOKENIZER_CACHE_SHARDS; i++) {
+                    pthread_mutex_destroy(&tokenizer->cache_shards[i].mutex);
+                }
+                free(tokenizer->cache_shards);
+            }
+
             memset(tokenizer, 0, sizeof(struct gptoss_tokenizer));
             free(tokenizer);
         }
@@ -1,3 +1,4 @@
+#include <metal_atomic>
 #include <metal_compute>
 #include <metal_integer>
 #include <metal_math>
@@ -9,197 +10,166 @@
 #pragma METAL fp contract(off)
 
 
+constant uint gptoss_fc_num_experts [[function_constant(GPTOSS_FUNCTION_CONSTANT_NUM_EXPERTS)]];
+constant uint gptoss_fc_num_active_experts [[function_constant(GPTOSS_FUNCTION_CONSTANT_NUM_ACTIVE_EXPERTS)]];
+
+// Selects the top num_active_experts of num_experts gating scores of a token, ties broken towards the lower expert
+// index, and writes their softmax-normalized scores in descending order. Each threadgroup (one simdgroup) handles
+// one token. Both counts are function constants, so all loops below are fully unrolled.
+
 [[max_total_threads_per_threadgroup(32)]]
-kernel void gptoss_f32_topk_softmax_e128_k4(
+kernel void gptoss_f32_topk_softmax(
     constant gptoss_topk_args& args [[ buffer(0) ]],
-    const device float4* input [[ buffer(1) ]],
+    const device float* input [[ buffer(1) ]],
     device gptoss_expert_prediction* output [[ buffer(2) ]],
     const device gptoss_control* control [[ buffer(3) ]],
     uint gid [[threadgroup_position_in_grid]],
     uint tid [[thread_position_in_threadgroup]])
 {
-    const uint num_experts = 128;
-    const uint num_active_experts = 4;
+    const uint simdgroup_size = 32;
+    const uint num_experts = gptoss_fc_num_experts;
+    const uint num_active_experts = gptoss_fc_num_active_experts;
+    const uint num_experts_per_thread = (num_experts + simdgroup_size - 1) / simdgroup_size;
     if (control->abort != 0) {
         return;
     }
 
-    input += gid * (num_experts / 4);
+    input += gid * num_experts;
     output += gid * num_active_experts;
 
-    uint4 idx = tid * 4 + (uint4) {0, 1, 2, 3};
-    float4 val = input[tid];
-
-    const float topval0 = metal::simd_max(metal::max3(metal::max(val.x, val.y), val.z, val.w));
-    uint idx0 = 0xFFFFFFFFu;
-    if (val.w == topval0) {
-        idx0 = idx.w;
-    }
-    if (val.z == topval0) {
-        idx0 = idx.z;
-    }
-    if (val.y == topval0) {
-        idx0 = idx.y;
-    }
-    if (val.x == topval0) {
-        idx0 = idx.x;
-    }
-    const uint topidx0 = metal::simd_min(idx0);
-    const bool4 is_topidx0 = idx == topidx0;
-    val = metal::select(val, -INFINITY, is_topidx0);
-    idx = metal::select(idx, 0xFFFFFFFFu, is_topidx0);
-
-    const float topval1 = metal::simd_max(metal::max3(metal::max(val.x, val.y), val.z, val.w));
-    uint idx1 = 0xFFFFFFFFu;
-    if (val.w == topval1) {
-        idx1 = idx.w;
-    }
-    if (val.z == topval1) {
-        idx1 = idx.z;
-    }
-    if (val.y == topval1) {
-        idx1 = idx.y;
+    float val[GPTOSS_TOPK_MAX_EXPERTS / 32];
+    uint idx[GPTOSS_TOPK_MAX_EXPERTS / 32];
+    for (uint i = 0; i < num_experts_per_thread; i++) {
+        const uint e = tid * num_experts_per_thread + i;
+        val[i] = e < num_experts ? input[e] : -INFINITY;
+        idx[i] = e < num_experts ? e : 0xFFFFFFFFu;
+    }
+
+    float topval[GPTOSS_MAX_ACTIVE_EXPERTS];
+    uint topidx[GPTOSS_MAX_ACTIVE_EXPERTS];
+    for (uint k = 0; k < num_active_experts; k++) {
+        float thread_max = val[0];
+        for (uint i = 1; i < num_experts_per_thread; i++) {
+            thread_max = metal::max(thread_max, val[i]);
+        }
+        topval[k] = metal::simd_max(thread_max);
+
+        uint thread_idx = 0xFFFFFFFFu;
+        for (uint i = 0; i < num_experts_per_thread; i++) {
+            if (val[i] == topval[k]) {
+                thread_idx = metal::min(thread_idx, idx[i]);
+            }
+        }
+        topidx[k] = metal::simd_min(thread_idx);
+
+        for (uint i = 0; i < num_experts_per_thread; i++) {
+            if (idx[i] == topidx[k]) {
+                val[i] = -INFINITY;
+                idx[i] = 0xFFFFFFFFu;
+            }
+        }
     }
-    if (val.x == topval1) {
-        idx1 = idx.x;
-    }
-    const uint topidx1 = metal::simd_min(idx1);
-    const bool4 is_topidx1 = idx == topidx1;
-    val = metal::select(val, -INFINITY, is_topidx1);
-    idx = metal::select(idx, 0xFFFFFFFFu, is_topidx1);
-
-    const float topval2 = metal::simd_max(metal::max3(metal::max(val.x, val.y), val.z, val.w));
-    uint idx2 = 0xFFFFFFFFu;
-    if (val.w == topval2) {
-        idx2 = idx.w;
-    }
-    if (val.z == topval2) {
-        idx2 = idx.z;
-    }
-    if (val.y == topval2) {
-        idx2 = idx.y;
-    }
-    if (val.x == topval2) {
-        idx2 = idx.x;
-    }
-    const uint topidx2 = metal::simd_min(idx2);
-    const bool4 is_topidx2 = idx == topidx2;
-    val = metal::select(val, -INFINITY, is_topidx2);
-    idx = metal::select(idx, 0xFFFFFFFFu, is_topidx2);
-
-    const float topval3 = metal::simd_max(metal::max3(metal::max(val.x, val.y), val.z, val.w));
-    uint idx3 = 0xFFFFFFFFu;
-    if (val.w == topval3) {
-        idx3 = idx.w;
-    }
-    if (val.z == topval3) {
-        idx3 = idx.z;
-    }
-    if (val.y == topval3) {
-        idx3 = idx.y;
-    }
-    if (val.x == topval3) {
-        idx3 = idx.x;
-    }
-    const uint topidx3 = metal::simd_min(idx3);
 
     if (metal::simd_is_first()) {
-        const float topexp0 = 1.0f;
-        const float topexp1 = metal::precise::exp(topval1 - topval0);
-        const float topexp2 = metal::precise::exp(topval2 - topval0);
-        const float topexp3 = metal::precise::exp(topval3 - topval0);
-
-        const float sum = (topexp0 + topexp1) + (topexp2 + topexp3);
+        float topexp[GPTOSS_MAX_ACTIVE_EXPERTS];
+        float sum = 0.0f;
+        for (uint k = 0; k < num_active_experts; k++) {
+            topexp[k] = k == 0 ? 1.0f : metal::precise::exp(topval[k] - topval[0]);
+            sum += topexp[k];
+        }
         const float scale = 1.0 / sum;
 
-        output[0] = (gptoss_expert_prediction) {
-            .expert_id = topidx0,
-            .score = topexp0 * scale,
-        };
-        output[1] = (gptoss_expert_prediction) {
-            .expert_id = topidx1,
-            .score = topexp1 * scale,
-        };
-        output[2] = (gptoss_expert_prediction) {
-            .expert_id = topidx2,
-            .score = topexp2 * scale,
-        };
-        output[3] = (gptoss_expert_prediction) {
-            .expert_id = topidx3,
-            .score = topexp3 * scale,
-        };
+        for (uint k = 0; k < num_active_experts; k++) {
+            output[k] = (gptoss_expert_prediction) {
+                .expert_id = topidx[k],
+                .score = topexp[k] * scale,
+            };
+        }
     }
 }
 
-[[max_total_threads_per_threadgroup(32)]]
-kernel void gptoss_f32_topk_softmax_e32_k4(
-    constant gptoss_topk_args& args [[ buffer(0) ]],
-    const device float* input [[ buffer(1) ]],
-    device gptoss_expert_prediction* output [[ buffer(2) ]],
-    const device gptoss_control* control [[ buffer(3) ]],
-    uint gid [[threadgroup_position_in_grid]],
-    uint tid [[thread_position_in_threadgroup]])
+// Groups the expert assignments of a batch of tokens by expert, for the grouped MoE matmul kernels.
+// Assignment i = token * num_active_experts + slot refers to the slot-th prediction of the token. Writes the start of
+// each expert's group in the assignment list (num_experts + 1 offsets, the last one is the number of assignments),
+// and the assignments of each group. Assignments within a group are in no particular order.
+// Runs as a single threadgroup.
+
+kernel void gptoss_expert_route(
+    constant gptoss_expert_route_args& args [[ buffer(0) ]],
+    const device gptoss_expert_prediction* expert [[ buffer(1) ]],
+    device uint* expert_offsets [[ buffer(2) ]],
+    device uint* assignments [[ buffer(3) ]],
+    const device gptoss_control* control [[ buffer(4) ]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]])
 {
-    const uint num_experts = 32;
-    const uint num_active_experts = 4;
+    threadgroup metal::atomic_uint counters[GPTOSS_EXPERT_ROUTE_MAX_EXPERTS];
     if (control->abort != 0) {
         return;
     }
 
-    input += gid * num_experts;
-    output += gid * num_active_experts;
-
-    float val = input[tid];
-    uint idx = tid;
+    const uint num_experts = args.num_experts;
+    const uint num_assignments = args.num_assignments;
+    for (uint e = tid; e < num_experts; e += threadgroup_size) {
+        metal::atomic_store_explicit(&counters[e], 0, metal::memory_order_relaxed);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
 
-    const float topval0 = metal::simd_max(val);
-    const uint topidx0 = metal::simd_min(val == topval0 ? idx : 0xFFFFFFFFu);
-    if (idx == topidx0) {
-        val = -INFINITY;
-        idx = 0xFFFFFFFFu;
+    // Histogram of expert assignments
+    for (uint i = tid; i < num_assignments; i += threadgroup_size) {
+        metal::atomic_fetch_add_explicit(&counters[expert[i].expert_id], 1, metal::memory_order_relaxed);
     }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
 
-    const float topval1 = metal::simd_max(val);
-    const uint topidx1 = metal::simd_min(val == topval1 ? idx : 0xFFFFFFFFu);
-    if (idx == topidx1) {
-        val = -INFINITY;
-        idx = 0xFFFFFFFFu;
+    // Exclusive prefix sum; the counters become the next free position in each group
+    if (tid == 0) {
+        uint offset = 0;
+        for (uint e = 0; e < num_experts; e++) {
+            const uint count = metal::atomic_load_explicit(&counters[e], metal::memory_order_relaxed);
+            expert_offsets[e] = offset;
+            metal::atomic_store_explicit(&counters[e], offset, metal::memory_order_relaxed);
+            offset += count;
+        }
+        expert_offsets[num_experts] = offset;
     }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
 
-    const float topval2 = metal::simd_max(val);
-    const uint topidx2 = metal::simd_min(val == topval2 ? idx : 0xFFFFFFFFu);
-    if (idx == topidx2) {
-        val = -INFINITY;
-        idx = 0xFFFFFFFFu;
+    for (uint i = tid; i < num_assignments; i += threadgroup_size) {
+        const uint position = metal::atomic_fetch_add_explicit(&counters[expert[i].expert_id], 1, metal::memory_order_relaxed);
+        assignments[position] = i;
     }
+}
 
-    const float topval3 = metal::simd_max(val);
-    const uint topidx3 = metal::simd_min(val == topval3 ? idx : 0xFFFFFFFFu);
+// Adds the number of tokens routed to each expert in a batch to the cumulative per-expert usage counters.
+// The counters wrap around on overflow. Runs as a single threadgroup. The counters are shared by all contexts of the
+// model, which may run concurrently on different command queues, so they are updated atomically.
+kernel void gptoss_expert_usage(
+    constant gptoss_expert_usage_args& args [[ buffer(0) ]],
+    const device gptoss_expert_prediction* expert [[ buffer(1) ]],
+    device metal::atomic_uint* usage [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]])
+{
+    threadgroup metal::atomic_uint counters[GPTOSS_EXPERT_ROUTE_MAX_EXPERTS];
+    if (control->abort != 0) {
+        return;
+    }
 
-    if (metal::simd_is_first()) {
-        const float topexp0 = 1.0f;
-        const float topexp1 = metal::precise::exp(topval1 - topval0);
-        const float topexp2 = metal::precise::exp(topval2 - topval0);
-        const float topexp3 = metal::precise::exp(topval3 - topval0);
+    const uint num_experts = args.num_experts;
+    const uint num_assignments = args.num_assignments;
+    for (uint e = tid; e < num_experts; e += threadgroup_size) {
+        metal::atomic_store_explicit(&counters[e], 0, metal::memory_order_relaxed);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
 
-        const float sum = (topexp0 + topexp1) + (topexp2 + topexp3);
-        const float scale = 1.0 / sum;
+    for (uint i = tid; i < num_assignments; i += threadgroup_size) {
+        metal::atomic_fetch_add_explicit(&counters[expert[i].expert_id], 1, metal::memory_order_relaxed);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
 
-        output[0] = (gptoss_expert_prediction) {
-            .expert_id = topidx0,
-            .score = topexp0 * scale,
-        };
-        output[1] = (gptoss_expert_prediction) {
-            .expert_id = topidx1,
-            .score = topexp1 * scale,
-        };
-        output[2] = (gptoss_expert_prediction) {
-            .expert_id = topidx2,
-            .score = topexp2 * scale,
-        };
-        output[3] = (gptoss_expert_prediction) {
-            .expert_id = topidx3,
-            .score = topexp3 * scale,
-        };
+    for (uint e = tid; e < num_experts; e += threadgroup_size) {
+        metal::atomic_fetch_add_explicit(&usage[e],
+            metal::atomic_load_explicit(&counters[e], metal::memory_order_relaxed), metal::memory_order_relaxed);
     }
 }
@@ -0,0 +1,152 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextBatchSampleTest : public ModelTest {
+protected:
+    static std::vector<gptoss_context_t> GetHandles(const std::vector<Context>& contexts) {
+        std::vector<gptoss_context_t> handles;
+        handles.reserve(contexts.size());
+        for (const Context& context : contexts) {
+            handles.push_back(context.get());
+        }
+        return handles;
+    }
+
+    // Greedily samples num_steps tokens for all contexts with gptoss_context_batch_sample, and returns the tokens of each
+    // context.
+    static std::vector<std::vector<std::uint32_t>> BatchSample(const std::vector<Context>& contexts, std::size_t num_steps) {
+        const std::vector<gptoss_context_t> handles = GetHandles(contexts);
+        std::vector<std::vector<std::uint32_t>> tokens(contexts.size());
+        std::vector<std::uint32_t> step_tokens(contexts.size());
+        for (std::size_t s = 0; s < num_steps; s++) {
+            gptoss::Check(gptoss_context_batch_sample(handles.data(), handles.size(), /*temperature=*/0.0f, /*seed=*/0,
+                    step_tokens.data()),
+                "batch sample tokens");
+            for (std::size_t i = 0; i < contexts.size(); i++) {
+                tokens[i].push_back(step_tokens[i]);
+            }
+        }
+        return tokens;
+    }
+
+    static constexpr std::size_t kNumSteps = 16;
+    // Prompts of different lengths, so that the contexts of a batch are at different positions.
+    static constexpr const char* kPrompts[] = {
+        "Once upon a time",
+        kPrompt,
+        "The capital of France is",
+        "In the beginning God created the heaven and the earth. And the earth was without form, and void; and darkness "
+        "was upon the face of the deep.",
+    };
+};
+
+}  // namespace
+
+TEST_F(ContextBatchSampleTest, greedy_matches_per_context_sample) {
+    std::vector<Context> contexts;
+    std::vector<std::vector<std::uint32_t>> expected_tokens;
+    for (const char* prompt : kPrompts) {
+        contexts.push_back(CreateContext(prompt));
+        Context reference_context = CreateContext(prompt);
+        expected_tokens.push_back(Sample(reference_context.get(), kNumSteps));
+        ASSERT_EQ(expected_tokens.back().size(), kNumSteps);
+    }
+
+    const std::vector<std::vector<std::uint32_t>> tokens = BatchSample(contexts, kNumSteps);
+    for (std::size_t i = 0; i < contexts.size(); i++) {
+        SCOPED_TRACE(kPrompts[i]);
+        EXPECT_EQ(tokens[i], expected_tokens[i]);
+    }
+}
+
+TEST_F(ContextBatchSampleTest, appends_sampled_tokens) {
+    std::vector<Context> contexts;
+    std::vector<std::vector<std::uint32_t>> prompt_tokens;
+    for (const char* prompt : kPrompts) {
+        contexts.push_back(CreateContext(prompt));
+        prompt_tokens.push_back(GetTokens(contexts.back().get()));
+    }
+
+    const std::vector<std::vector<std::uint32_t>> tokens = BatchSample(contexts, kNumSteps);
+    for (std::size_t i = 0; i < contexts.size(); i++) {
+        SCOPED_TRACE(kPrompts[i]);
+        std::vector<std::uint32_t> expected_tokens = prompt_tokens[i];
+        expected_tokens.insert(expected_tokens.end(), tokens[i].begin(), tokens[i].end());
+        EXPECT_EQ(GetTokens(contexts[i].get()), expected_tokens);
+    }
+}
+
+TEST_F(ContextBatchSampleTest, processes_pending_tokens) {
+    std::vector<Context> contexts;
+    std::vector<std::vector<std::uint32_t>> expected_tokens;
+    for (const char* prompt : kPrompts) {
+        // Appended, but not processed: batched sampling pre-fills the prompt first.
+        contexts.push_back(CreateContext());
+        gptoss::Check(gptoss_context_append_chars(contexts.back().get(), prompt, std::strlen(prompt),
+                /*num_tokens_out=*/nullptr),
+            "append prompt");
+        Context reference_context = CreateContext(prompt);
+        expected_tokens.push_back(Sample(reference_context.get(), kNumSteps));
+    }
+
+    const std::vector<std::vector<std::uint32_t>> tokens = BatchSample(contexts, kNumSteps);
+    for (std::size_t i = 0; i < contexts.size(); i++) {
+        SCOPED_TRACE(kPrompts[i]);
+        EXPECT_EQ(tokens[i], expected_tokens[i]);
+    }
+}
+
+TEST_F(ContextBatchSampleTest, rejects_empty_context) {
+    std::vector<Context> contexts;
+    contexts.push_back(CreateContext(kPrompt));
+    contexts.push_back(CreateContext());
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(contexts[0].get());
+
+    const std::vector<gptoss_context_t> handles = GetHandles(contexts);
+    std::vector<std::uint32_t> tokens(handles.size());
+    EXPECT_EQ(gptoss_context_batch_sample(handles.data(), handles.size(), /*temperature=*/0.0f, /*seed=*/0, tokens.data()),
+        gptoss_status_invalid_argument);
+    EXPECT_EQ(GetTokens(contexts[0].get()), prompt_tokens);
+    EXPECT_TRUE(GetTokens(contexts[1].get()).empty());
+}
+
+TEST_F(ContextBatchSampleTest, rejects_full_context) {
+    const std::size_t num_prompt_tokens = GetTokens(CreateContext(kPrompt).get()).size();
+    std::vector<Context> contexts;
+    contexts.push_back(CreateContext(kPrompts[0]));
+    contexts.push_back(CreateContext(kPrompt, /*context_length=*/num_prompt_tokens));
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(contexts[0].get());
+
+    const std::vector<gptoss_context_t> handles = GetHandles(contexts);
+    std::vector<std::uint32_t> tokens(handles.size());
+    EXPECT_EQ(gptoss_context_batch_sample(handles.data(), handles.size(), /*temperature=*/0.0f, /*seed=*/0, tokens.data()),
+        gptoss_status_context_overflow);
+    EXPECT_EQ(GetTokens(contexts[0].get()), prompt_tokens);
+    EXPECT_EQ(GetTokens(contexts[1].get()).size(), num_prompt_tokens);
+
+    // The other context still samples on its own afterwards.
+    Context reference_context = CreateContext(kPrompts[0]);
+    EXPECT_EQ(Sample(contexts[0].get(), kNumSteps), Sample(reference_context.get(), kNumSteps));
+}
+
+TEST_F(ContextBatchSampleTest, rejects_duplicate_context) {
+    Context context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(context.get());
+
+    const gptoss_context_t handles[2] = {context.get(), context.get()};
+    std::uint32_t tokens[2];
+    EXPECT_EQ(gptoss_context_batch_sample(handles, 2, /*temperature=*/0.0f, /*seed=*/0, tokens),
+        gptoss_status_invalid_argument);
+    EXPECT_EQ(GetTokens(context.get()), prompt_tokens);
+}
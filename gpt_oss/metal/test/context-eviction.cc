@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <internal/kernel-args.h>
+#include <internal/math.h>
+#include <internal/model.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextEvictionTest : public ModelTest {
+protected:
+    // Creates a streaming Context with the prompt appended and processed. The Context is one eviction quantum longer
+    // than the minimum for its attention sinks.
+    static Context CreateStreamingContext(const char* prompt) {
+        const std::size_t num_window_kv_slots =
+            math_round_up_po2(model()->attention_window + model()->max_batch_tokens, GPTOSS_KVCACHE_PAGE_TOKENS);
+        gptoss_context_t context = nullptr;
+        gptoss::Check(gptoss_context_create_streaming(model(), kNumSinkTokens + 3 * num_window_kv_slots,
+                gptoss_kvcache_type_f32, kNumSinkTokens, &context),
+            "create streaming Context");
+        Context context_ptr(context, gptoss_context_release);
+        gptoss::Check(gptoss_context_append_chars(context, prompt, std::strlen(prompt), /*num_tokens_out=*/nullptr),
+            "append prompt");
+        gptoss::Check(gptoss_context_process(context), "process prompt");
+        return context_ptr;
+    }
+
+    static std::size_t GetMaxTokens(gptoss_context_t context) {
+        std::size_t max_tokens = 0;
+        gptoss::Check(gptoss_context_get_max_tokens(context, &max_tokens), "get maximum number of tokens");
+        return max_tokens;
+    }
+
+    // Greedily generates from the streaming Context until twice its maximum number of tokens were generated, checking
+    // that the Context stays bounded, and returns all tokens ever in the Context.
+    static std::vector<std::uint32_t> GeneratePastMaxTokens(gptoss_context_t context) {
+        const std::size_t max_tokens = GetMaxTokens(context);
+        std::vector<std::uint32_t> history = GetTokens(context);
+        while (history.size() < 2 * max_tokens) {
+            const std::vector<std::uint32_t> tokens = Sample(context, kNumTokensPerCall);
+            EXPECT_FALSE(tokens.empty());
+            if (tokens.empty()) {
+                break;
+            }
+            history.insert(history.end(), tokens.begin(), tokens.end());
+            EXPECT_LE(GetTokens(context).size(), max_tokens);
+        }
+        return history;
+    }
+
+    // Tokens kept by a streaming Context after the history: the sinks followed by the most recent tokens.
+    static std::vector<std::uint32_t> GetExpectedTokens(const std::vector<std::uint32_t>& history, std::size_t num_tokens) {
+        std::vector<std::uint32_t> tokens(history.begin(), history.begin() + kNumSinkTokens);
+        tokens.insert(tokens.end(), history.end() - (num_tokens - kNumSinkTokens), history.end());
+        return tokens;
+    }
+
+    static constexpr std::size_t kNumSinkTokens = GPTOSS_KVCACHE_PAGE_TOKENS;
+    static constexpr std::size_t kNumTokensPerCall = 64;
+    static constexpr std::size_t kNumCompareTokens = 8;
+};
+
+}  // namespace
+
+TEST_F(ContextEvictionTest, stays_bounded_and_keeps_sinks) {
+    Context context = CreateStreamingContext(kPrompt);
+    const std::size_t max_tokens = GetMaxTokens(context.get());
+    const std::vector<std::uint32_t> history = GeneratePastMaxTokens(context.get());
+    ASSERT_GE(history.size(), 2 * max_tokens);
+
+    const std::vector<std::uint32_t> tokens = GetTokens(context.get());
+    ASSERT_LE(tokens.size(), max_tokens);
+    ASSERT_GT(tokens.size(), kNumSinkTokens);
+    EXPECT_EQ(tokens, GetExpectedTokens(history, tokens.size()));
+}
+
+TEST_F(ContextEvictionTest, matches_context_rebuilt_from_sinks_and_window) {
+    Context context = CreateStreamingContext(kPrompt);
+    const std::size_t max_tokens = GetMaxTokens(context.get());
+    std::vector<std::uint32_t> history = GeneratePastMaxTokens(context.get());
+    // Make room for the compared tokens, so that comparing them doesn't evict more tokens.
+    while (max_tokens - GetTokens(context.get()).size() < kNumCompareTokens) {
+        const std::vector<std::uint32_t> tokens = Sample(context.get(), /*max_tokens=*/1);
+        ASSERT_EQ(tokens.size(), 1);
+        history.push_back(tokens[0]);
+    }
+    const std::vector<std::uint32_t> tokens = GetTokens(context.get());
+    ASSERT_EQ(tokens, GetExpectedTokens(history, tokens.size()));
+
+    // Keys of the window were rotated to their new positions in place; the reference computes them at those positions.
+    Context reference_context = CreateContext();
+    gptoss::Check(gptoss_context_append_tokens(reference_context.get(), tokens.size(), tokens.data()), "append tokens");
+    gptoss::Check(gptoss_context_process(reference_context.get()), "process tokens");
+    EXPECT_EQ(Sample(context.get(), kNumCompareTokens), Sample(reference_context.get(), kNumCompareTokens));
+}
+
+TEST_F(ContextEvictionTest, evicts_appended_tokens) {
+    Context context = CreateStreamingContext(kPrompt);
+    const std::size_t max_tokens = GetMaxTokens(context.get());
+    std::vector<std::uint32_t> history = GetTokens(context.get());
+    // Appending more tokens than fit evicts tokens after the sinks instead of overflowing.
+    const std::vector<std::uint32_t> continuation = Sample(CreateContext(kPrompt).get(), kNumTokensPerCall);
+    while (history.size() < 2 * max_tokens) {
+        ASSERT_EQ(gptoss_context_append_tokens(context.get(), continuation.size(), continuation.data()),
+            gptoss_status_success);
+        history.insert(history.end(), continuation.begin(), continuation.end());
+        ASSERT_LE(GetTokens(context.get()).size(), max_tokens);
+    }
+
+    const std::vector<std::uint32_t> tokens = GetTokens(context.get());
+    EXPECT_EQ(tokens, GetExpectedTokens(history, tokens.size()));
+}
+
+TEST_F(ContextEvictionTest, rejects_too_short_context) {
+    gptoss_context_t context = nullptr;
+    EXPECT_EQ(gptoss_context_create_streaming(model(), /*context_length=*/2 * kNumSinkTokens, gptoss_kvcache_type_f32,
+            kNumSinkTokens, &context),
+        gptoss_status_invalid_argument);
+    EXPECT_EQ(context, nullptr);
+}
@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <internal/model.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextPrefillActivationTest : public ModelTest {
+protected:
+    // Creates a Context with the given prefill activation type, and the prompt appended and processed.
+    static Context CreatePrefillContext(gptoss_activation_type activation_type, const std::string& prompt) {
+        Context context = CreateContext();
+        gptoss::Check(gptoss_context_set_prefill_activation_type(context.get(), activation_type),
+            "set prefill activation type");
+        gptoss::Check(gptoss_context_append_chars(context.get(), prompt.data(), prompt.size(), /*num_tokens_out=*/nullptr),
+            "append prompt");
+        gptoss::Check(gptoss_context_process(context.get()), "process prompt");
+        return context;
+    }
+
+    // A prompt long enough to be processed by the grouped MoE kernels, which store activations in the prefill type.
+    static std::string GetGroupedPrompt() {
+        std::string prompt;
+        for (std::size_t i = 0; i < kNumPromptRepeats; i++) {
+            prompt += kPrompt;
+            prompt += ' ';
+        }
+        EXPECT_GE(GetTokens(CreateContext(prompt.c_str()).get()).size(), GPTOSS_MOE_GROUPED_MIN_TOKENS);
+        return prompt;
+    }
+
+    static std::vector<float> Score(gptoss_context_t context, const std::vector<std::uint32_t>& tokens) {
+        std::vector<float> logprobs(tokens.size());
+        gptoss::Check(gptoss_context_score(context, tokens.size(), tokens.data(), logprobs.data()), "score tokens");
+        return logprobs;
+    }
+
+    static constexpr std::size_t kNumPromptRepeats = 6;
+    static constexpr std::size_t kNumTokens = 8;
+    static constexpr std::size_t kNumScoredTokens = 64;
+    // Half-precision activations round the inputs of the MoE output projections.
+    static constexpr float kLogprobTolerance = 0.1f;
+};
+
+}  // namespace
+
+TEST_F(ContextPrefillActivationTest, f16_matches_f32_greedy) {
+    const std::string prompt = GetGroupedPrompt();
+    Context f32_context = CreatePrefillContext(gptoss_activation_type_f32, prompt);
+    Context f16_context = CreatePrefillContext(gptoss_activation_type_f16, prompt);
+    EXPECT_EQ(Sample(f16_context.get(), kNumTokens), Sample(f32_context.get(), kNumTokens));
+}
+
+TEST_F(ContextPrefillActivationTest, f16_scores_close_to_f32) {
+    // Scoring processes the continuation in a batch, with the prefill activation type.
+    const std::string prompt = GetGroupedPrompt();
+    Context reference_context = CreatePrefillContext(gptoss_activation_type_f32, prompt);
+    const std::vector<std::uint32_t> continuation = Sample(reference_context.get(), kNumScoredTokens);
+    ASSERT_EQ(continuation.size(), kNumScoredTokens);
+
+    Context f32_context = CreatePrefillContext(gptoss_activation_type_f32, prompt);
+    Context f16_context = CreatePrefillContext(gptoss_activation_type_f16, prompt);
+    const std::vector<float> f32_logprobs = Score(f32_context.get(), continuation);
+    const std::vector<float> f16_logprobs = Score(f16_context.get(), continuation);
+    for (std::size_t t = 0; t < kNumScoredTokens; t++) {
+        EXPECT_NEAR(f16_logprobs[t], f32_logprobs[t], kLogprobTolerance) << "token #" << t;
+    }
+}
+
+TEST_F(ContextPrefillActivationTest, small_batches_are_unaffected) {
+    // The prompt is too short for the grouped MoE kernels, and decoding processes single tokens.
+    ASSERT_LT(GetTokens(CreateContext(kPrompt).get()).size(), GPTOSS_MOE_GROUPED_MIN_TOKENS);
+    Context f32_context = CreatePrefillContext(gptoss_activation_type_f32, kPrompt);
+    Context f16_context = CreatePrefillContext(gptoss_activation_type_f16, kPrompt);
+    EXPECT_EQ(Sample(f16_context.get(), kNumTokens), Sample(f32_context.get(), kNumTokens));
+}
+
+TEST_F(ContextPrefillActivationTest, defaults_to_f32) {
+    const std::string prompt = GetGroupedPrompt();
+    Context default_context = CreateContext(prompt.c_str());
+    Context f32_context = CreatePrefillContext(gptoss_activation_type_f32, prompt);
+    const std::vector<std::uint32_t> continuation = Sample(f32_context.get(), kNumScoredTokens);
+
+    Context f32_score_context = CreatePrefillContext(gptoss_activation_type_f32, prompt);
+    EXPECT_EQ(Score(default_context.get(), continuation), Score(f32_score_context.get(), continuation));
+}
+
+TEST_F(ContextPrefillActivationTest, rejects_invalid_type) {
+    Context context = CreateContext();
+    EXPECT_EQ(gptoss_context_set_prefill_activation_type(context.get(), static_cast<gptoss_activation_type>(2)),
+        gptoss_status_invalid_argument);
+    EXPECT_EQ(gptoss_context_set_prefill_activation_type(context.get(), gptoss_activation_type_f16),
+        gptoss_status_success);
+}
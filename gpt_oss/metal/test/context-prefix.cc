@@ -0,0 +1,153 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextPrefixTest : public ModelTest {
+protected:
+    using Prefix = std::unique_ptr<std::remove_pointer_t<gptoss_prefix_t>, decltype(&gptoss_prefix_release)>;
+
+    static Prefix CreatePrefix(gptoss_context_t context) {
+        gptoss_prefix_t prefix = nullptr;
+        gptoss::Check(gptoss_context_create_prefix(context, &prefix), "create Prefix");
+        return Prefix(prefix, gptoss_prefix_release);
+    }
+
+    static Context CreateContextFromPrefix(gptoss_prefix_t prefix, std::size_t context_length = kContextLength) {
+        gptoss_context_t context = nullptr;
+        gptoss::Check(gptoss_context_create_from_prefix(prefix, context_length, &context), "create Context from Prefix");
+        return Context(context, gptoss_context_release);
+    }
+
+    static void AppendAndProcess(gptoss_context_t context, const char* text) {
+        gptoss::Check(gptoss_context_append_chars(context, text, std::strlen(text), /*num_tokens_out=*/nullptr),
+            "append text");
+        gptoss::Check(gptoss_context_process(context), "process Context");
+    }
+};
+
+}  // namespace
+
+TEST_F(ContextPrefixTest, starts_with_prefix_tokens) {
+    Context source_context = CreateContext(kPrompt);
+    Prefix prefix = CreatePrefix(source_context.get());
+    std::size_t num_prefix_tokens = 0;
+    gptoss::Check(gptoss_prefix_get_num_tokens(prefix.get(), &num_prefix_tokens), "get number of Prefix tokens");
+    EXPECT_EQ(num_prefix_tokens, GetTokens(source_context.get()).size());
+
+    Context context = CreateContextFromPrefix(prefix.get());
+    EXPECT_EQ(GetTokens(context.get()), GetTokens(source_context.get()));
+    // The source Context is not modified by creating the Prefix.
+    EXPECT_EQ(GetTokens(source_context.get()).size(), num_prefix_tokens);
+}
+
+TEST_F(ContextPrefixTest, greedy_matches_unshared_context) {
+    Context source_context = CreateContext(kPrompt);
+    Prefix prefix = CreatePrefix(source_context.get());
+    Context context = CreateContextFromPrefix(prefix.get());
+
+    Context reference_context = CreateContext(kPrompt);
+    EXPECT_EQ(Sample(context.get(), /*max_tokens=*/32), Sample(reference_context.get(), /*max_tokens=*/32));
+}
+
+TEST_F(ContextPrefixTest, shared_by_contexts_with_different_suffixes) {
+    static constexpr const char* kSuffixes[] = {" there was a dragon", " in a land far away", " a cat sat"};
+
+    Context source_context = CreateContext(kPrompt);
+    Prefix prefix = CreatePrefix(source_context.get());
+    std::vector<Context> contexts;
+    for (const char* suffix : kSuffixes) {
+        contexts.push_back(CreateContextFromPrefix(prefix.get()));
+        AppendAndProcess(contexts.back().get(), suffix);
+    }
+
+    // Each Context reads the shared prefix KV cache, but writes the KV cache of its suffix privately.
+    for (std::size_t i = 0; i < contexts.size(); i++) {
+        SCOPED_TRACE(kSuffixes[i]);
+        Context reference_context = CreateContext(kPrompt);
+        AppendAndProcess(reference_context.get(), kSuffixes[i]);
+        EXPECT_EQ(GetTokens(contexts[i].get()), GetTokens(reference_context.get()));
+        EXPECT_EQ(Sample(contexts[i].get(), /*max_tokens=*/16), Sample(reference_context.get(), /*max_tokens=*/16));
+    }
+}
+
+TEST_F(ContextPrefixTest, prefix_past_attention_window) {
+    // Enough tokens for the prefix to hold a full sliding-window ring buffer.
+    Context source_context = CreateContext(kPrompt);
+    Sample(source_context.get(), /*max_tokens=*/200);
+    Prefix prefix = CreatePrefix(source_context.get());
+    Context context = CreateContextFromPrefix(prefix.get());
+    EXPECT_EQ(GetTokens(context.get()), GetTokens(source_context.get()));
+    EXPECT_EQ(Sample(context.get(), /*max_tokens=*/16), Sample(source_context.get(), /*max_tokens=*/16));
+}
+
+TEST_F(ContextPrefixTest, contexts_keep_prefix_alive) {
+    Context reference_context = CreateContext(kPrompt);
+    Context context{nullptr, gptoss_context_release};
+    {
+        Context source_context = CreateContext(kPrompt);
+        Prefix prefix = CreatePrefix(source_context.get());
+        context = CreateContextFromPrefix(prefix.get());
+        // Releasing both the source Context and the last reference to the Prefix leaves the shared KV cache intact.
+    }
+    EXPECT_EQ(Sample(context.get(), /*max_tokens=*/16), Sample(reference_context.get(), /*max_tokens=*/16));
+}
+
+TEST_F(ContextPrefixTest, retained_prefix_outlives_release) {
+    Context source_context = CreateContext(kPrompt);
+    Prefix prefix = CreatePrefix(source_context.get());
+    gptoss::Check(gptoss_prefix_retain(prefix.get()), "retain Prefix");
+    Prefix retained_prefix(prefix.get(), gptoss_prefix_release);
+    prefix.reset();
+
+    Context context = CreateContextFromPrefix(retained_prefix.get());
+    EXPECT_EQ(GetTokens(context.get()), GetTokens(source_context.get()));
+}
+
+TEST_F(ContextPrefixTest, rejects_tokens_diverging_from_prefix) {
+    Context source_context = CreateContext(kPrompt);
+    Prefix prefix = CreatePrefix(source_context.get());
+    Context context = CreateContextFromPrefix(prefix.get());
+    const std::vector<std::uint32_t> prefix_tokens = GetTokens(context.get());
+
+    gptoss::Check(gptoss_context_reset(context.get()), "reset Context");
+    const std::uint32_t divergent_token = prefix_tokens[0] + 1;
+    EXPECT_EQ(gptoss_context_append_tokens(context.get(), 1, &divergent_token), gptoss_status_invalid_argument);
+
+    // Appending the prefix tokens again reuses the shared KV cache.
+    gptoss::Check(gptoss_context_reset(context.get()), "reset Context");
+    gptoss::Check(gptoss_context_append_tokens(context.get(), prefix_tokens.size(), prefix_tokens.data()),
+        "append prefix tokens");
+    Context reference_context = CreateContext(kPrompt);
+    EXPECT_EQ(Sample(context.get(), /*max_tokens=*/8), Sample(reference_context.get(), /*max_tokens=*/8));
+}
+
+TEST_F(ContextPrefixTest, rejects_invalid_prefixes) {
+    Context empty_context = CreateContext();
+    gptoss_prefix_t prefix = nullptr;
+    EXPECT_EQ(gptoss_context_create_prefix(empty_context.get(), &prefix), gptoss_status_invalid_argument);
+    EXPECT_EQ(prefix, nullptr);
+
+    Context source_context = CreateContext(kPrompt);
+    Prefix source_prefix = CreatePrefix(source_context.get());
+    Context context = CreateContextFromPrefix(source_prefix.get());
+    EXPECT_EQ(gptoss_context_create_prefix(context.get(), &prefix), gptoss_status_invalid_argument);
+    EXPECT_EQ(prefix, nullptr);
+
+    // The Context must have room for tokens after the prefix.
+    gptoss_context_t short_context = nullptr;
+    EXPECT_EQ(gptoss_context_create_from_prefix(source_prefix.get(), GetTokens(source_context.get()).size(), &short_context),
+        gptoss_status_invalid_argument);
+    EXPECT_EQ(short_context, nullptr);
+}
@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <internal/model.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextProcessPartialTest : public ModelTest {
+protected:
+    // Creates a Context with a prompt of a few batches appended, but not processed.
+    static Context CreateUnprocessedContext() {
+        std::string prompt;
+        for (std::size_t i = 0; i < kNumPromptRepeats; i++) {
+            prompt += kPrompt;
+            prompt += ' ';
+        }
+        Context context = CreateContext();
+        gptoss::Check(gptoss_context_append_chars(context.get(), prompt.data(), prompt.size(), /*num_tokens_out=*/nullptr),
+            "append prompt");
+        return context;
+    }
+
+    static std::size_t ProcessPartial(gptoss_context_t context, std::size_t max_tokens) {
+        std::size_t num_remaining_tokens = 0;
+        gptoss::Check(gptoss_context_process_partial(context, max_tokens, &num_remaining_tokens),
+            "partially process tokens");
+        return num_remaining_tokens;
+    }
+
+    // Processes the Context in calls of at most max_tokens tokens, checking the number of remaining tokens after each.
+    static void ProcessInChunks(gptoss_context_t context, std::size_t max_tokens) {
+        std::size_t num_remaining_tokens = GetTokens(context).size();
+        std::size_t num_calls = 0;
+        while (num_remaining_tokens != 0) {
+            const std::size_t num_expected_remaining_tokens = num_remaining_tokens - std::min(num_remaining_tokens, max_tokens);
+            num_remaining_tokens = ProcessPartial(context, max_tokens);
+            ASSERT_EQ(num_remaining_tokens, num_expected_remaining_tokens) << "after call " << num_calls;
+            num_calls += 1;
+        }
+        EXPECT_GT(num_calls, 1);
+    }
+
+    static constexpr std::size_t kNumPromptRepeats = 24;
+    static constexpr std::size_t kNumTokens = 8;
+};
+
+}  // namespace
+
+TEST_F(ContextProcessPartialTest, matches_process_within_batch) {
+    Context context = CreateUnprocessedContext();
+    ProcessInChunks(context.get(), /*max_tokens=*/50);
+
+    Context reference_context = CreateUnprocessedContext();
+    gptoss::Check(gptoss_context_process(reference_context.get()), "process prompt");
+    EXPECT_EQ(Sample(context.get(), kNumTokens), Sample(reference_context.get(), kNumTokens));
+}
+
+TEST_F(ContextProcessPartialTest, matches_process_across_batches) {
+    // More than a batch per call, so that calls span batches and stop within one.
+    Context context = CreateUnprocessedContext();
+    ProcessInChunks(context.get(), model()->max_batch_tokens + 1);
+
+    Context reference_context = CreateUnprocessedContext();
+    gptoss::Check(gptoss_context_process(reference_context.get()), "process prompt");
+    EXPECT_EQ(Sample(context.get(), kNumTokens), Sample(reference_context.get(), kNumTokens));
+}
+
+TEST_F(ContextProcessPartialTest, accepts_null_remaining_tokens) {
+    Context context = CreateUnprocessedContext();
+    const std::size_t num_tokens = GetTokens(context.get()).size();
+    gptoss::Check(gptoss_context_process_partial(context.get(), /*max_tokens=*/50, /*num_remaining_tokens_out=*/nullptr),
+        "partially process tokens");
+    EXPECT_EQ(ProcessPartial(context.get(), /*max_tokens=*/50), num_tokens - 100);
+}
+
+TEST_F(ContextProcessPartialTest, processed_context_has_no_remaining_tokens) {
+    Context context = CreateContext(kPrompt);
+    EXPECT_EQ(ProcessPartial(context.get(), /*max_tokens=*/1), 0);
+    EXPECT_EQ(ProcessPartial(CreateContext().get(), /*max_tokens=*/1), 0);
+}
+
+TEST_F(ContextProcessPartialTest, rejects_zero_max_tokens) {
+    Context context = CreateUnprocessedContext();
+    const std::size_t num_tokens = GetTokens(context.get()).size();
+    std::size_t num_remaining_tokens = 0;
+    EXPECT_EQ(gptoss_context_process_partial(context.get(), /*max_tokens=*/0, &num_remaining_tokens),
+        gptoss_status_invalid_argument);
+    EXPECT_EQ(ProcessPartial(context.get(), num_tokens), 0);
+}
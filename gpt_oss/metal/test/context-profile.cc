@@ -0,0 +1,141 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <internal/model.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextProfileTest : public ModelTest {
+protected:
+    struct Profile {
+        std::vector<const char*> kernel_names;
+        std::vector<std::uint32_t> blocks;
+        std::vector<std::uint64_t> num_launches;
+        std::vector<double> gpu_seconds;
+        std::uint64_t num_untimed_launches = 0;
+    };
+
+    static Profile GetProfile(gptoss_context_t context) {
+        Profile profile;
+        std::size_t num_entries = 0;
+        const gptoss_status status = gptoss_context_get_profile(context, /*kernel_names_out=*/nullptr,
+            /*blocks_out=*/nullptr, /*num_launches_out=*/nullptr, /*gpu_seconds_out=*/nullptr, /*max_entries=*/0,
+            &num_entries, &profile.num_untimed_launches);
+        EXPECT_EQ(status, num_entries == 0 ? gptoss_status_success : gptoss_status_insufficient_memory);
+
+        profile.kernel_names.resize(num_entries);
+        profile.blocks.resize(num_entries);
+        profile.num_launches.resize(num_entries);
+        profile.gpu_seconds.resize(num_entries);
+        gptoss::Check(gptoss_context_get_profile(context, profile.kernel_names.data(), profile.blocks.data(),
+                profile.num_launches.data(), profile.gpu_seconds.data(), num_entries, &num_entries,
+                &profile.num_untimed_launches),
+            "get profile");
+        EXPECT_EQ(num_entries, profile.kernel_names.size());
+        return profile;
+    }
+
+    // Starts profiling, or skips the test if the GPU can't sample timestamps at kernel boundaries.
+    void StartProfiling(gptoss_context_t context) {
+        const gptoss_status status = gptoss_context_start_profiling(context);
+        if (status == gptoss_status_unsupported_system) {
+            GTEST_SKIP() << "GPU does not support timestamp sampling at kernel boundaries";
+        }
+        gptoss::Check(status, "start profiling");
+    }
+
+    static constexpr std::size_t kNumTokens = 4;
+};
+
+}  // namespace
+
+TEST_F(ContextProfileTest, empty_before_start) {
+    Context context = CreateContext(kPrompt);
+    Sample(context.get(), kNumTokens);
+
+    const Profile profile = GetProfile(context.get());
+    EXPECT_TRUE(profile.kernel_names.empty());
+    EXPECT_EQ(profile.num_untimed_launches, 0);
+}
+
+TEST_F(ContextProfileTest, collects_entries_per_kernel_and_block) {
+    Context context = CreateContext();
+    StartProfiling(context.get());
+    if (IsSkipped()) {
+        return;
+    }
+    gptoss::Check(gptoss_context_append_chars(context.get(), kPrompt, std::strlen(kPrompt), /*num_tokens_out=*/nullptr),
+        "append prompt");
+    gptoss::Check(gptoss_context_process(context.get()), "process prompt");
+    Sample(context.get(), kNumTokens);
+    gptoss::Check(gptoss_context_stop_profiling(context.get()), "stop profiling");
+
+    const Profile profile = GetProfile(context.get());
+    ASSERT_FALSE(profile.kernel_names.empty());
+    std::set<std::pair<std::string, std::uint32_t>> entries;
+    bool has_block_entries = false;
+    bool has_non_block_entries = false;
+    for (std::size_t i = 0; i < profile.kernel_names.size(); i++) {
+        ASSERT_NE(profile.kernel_names[i], nullptr);
+        EXPECT_NE(profile.kernel_names[i][0], '\0');
+        EXPECT_TRUE(profile.blocks[i] == UINT32_MAX || profile.blocks[i] < model()->num_blocks) << profile.blocks[i];
+        EXPECT_GT(profile.num_launches[i], 0);
+        EXPECT_GE(profile.gpu_seconds[i], 0.0);
+        // Each kernel appears once per block.
+        EXPECT_TRUE(entries.emplace(profile.kernel_names[i], profile.blocks[i]).second)
+            << profile.kernel_names[i] << " in block " << profile.blocks[i];
+        has_block_entries |= profile.blocks[i] != UINT32_MAX;
+        has_non_block_entries |= profile.blocks[i] == UINT32_MAX;
+    }
+    EXPECT_TRUE(has_block_entries);
+    EXPECT_TRUE(has_non_block_entries);
+}
+
+TEST_F(ContextProfileTest, stop_ends_collection) {
+    Context context = CreateContext(kPrompt);
+    StartProfiling(context.get());
+    if (IsSkipped()) {
+        return;
+    }
+    Sample(context.get(), kNumTokens);
+    gptoss::Check(gptoss_context_stop_profiling(context.get()), "stop profiling");
+    const Profile profile = GetProfile(context.get());
+    ASSERT_FALSE(profile.kernel_names.empty());
+
+    // The profile collected so far remains available, and doesn't grow anymore.
+    Sample(context.get(), kNumTokens);
+    const Profile stopped_profile = GetProfile(context.get());
+    EXPECT_EQ(stopped_profile.kernel_names, profile.kernel_names);
+    EXPECT_EQ(stopped_profile.blocks, profile.blocks);
+    EXPECT_EQ(stopped_profile.num_launches, profile.num_launches);
+    EXPECT_EQ(stopped_profile.gpu_seconds, profile.gpu_seconds);
+    EXPECT_EQ(stopped_profile.num_untimed_launches, profile.num_untimed_launches);
+}
+
+TEST_F(ContextProfileTest, start_discards_previous_profile) {
+    Context context = CreateContext(kPrompt);
+    StartProfiling(context.get());
+    if (IsSkipped()) {
+        return;
+    }
+    Sample(context.get(), kNumTokens);
+    gptoss::Check(gptoss_context_stop_profiling(context.get()), "stop profiling");
+    ASSERT_FALSE(GetProfile(context.get()).kernel_names.empty());
+
+    StartProfiling(context.get());
+    const Profile profile = GetProfile(context.get());
+    EXPECT_TRUE(profile.kernel_names.empty());
+    EXPECT_EQ(profile.num_untimed_launches, 0);
+}
@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <internal/kernel-args.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextSamplingParamsTest : public ModelTest {
+protected:
+    static std::vector<std::uint32_t> SampleGreedy(const char* prompt) {
+        Context reference_context = CreateContext(prompt);
+        return Sample(reference_context.get(), kNumTokens);
+    }
+
+    static constexpr std::size_t kNumTokens = 16;
+    static constexpr float kTemperatures[] = {0.5f, 1.0f, 2.0f};
+};
+
+}  // namespace
+
+TEST_F(ContextSamplingParamsTest, top_k_one_matches_greedy) {
+    const std::vector<std::uint32_t> expected_tokens = SampleGreedy(kPrompt);
+    for (float temperature : kTemperatures) {
+        SCOPED_TRACE(temperature);
+        Context context = CreateContext(kPrompt);
+        gptoss::Check(gptoss_context_set_sampling_params(context.get(), /*top_k=*/1, /*top_p=*/1.0f),
+            "set sampling params");
+        EXPECT_EQ(Sample(context.get(), kNumTokens, temperature, /*seed=*/42), expected_tokens);
+    }
+}
+
+TEST_F(ContextSamplingParamsTest, tiny_top_p_matches_greedy) {
+    // The most likely token alone always covers the smallest top-p.
+    const std::vector<std::uint32_t> expected_tokens = SampleGreedy(kPrompt);
+    for (float temperature : kTemperatures) {
+        SCOPED_TRACE(temperature);
+        Context context = CreateContext(kPrompt);
+        gptoss::Check(gptoss_context_set_sampling_params(context.get(), /*top_k=*/0,
+                /*top_p=*/std::numeric_limits<float>::min()),
+            "set sampling params");
+        EXPECT_EQ(Sample(context.get(), kNumTokens, temperature, /*seed=*/42), expected_tokens);
+    }
+}
+
+TEST_F(ContextSamplingParamsTest, disabled_truncation_matches_default) {
+    Context reference_context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> expected_tokens =
+        Sample(reference_context.get(), kNumTokens, /*temperature=*/1.0f, /*seed=*/42);
+
+    Context context = CreateContext(kPrompt);
+    gptoss::Check(gptoss_context_set_sampling_params(context.get(), /*top_k=*/1, /*top_p=*/0.5f), "set sampling params");
+    gptoss::Check(gptoss_context_set_sampling_params(context.get(), /*top_k=*/0, /*top_p=*/1.0f), "set sampling params");
+    EXPECT_EQ(Sample(context.get(), kNumTokens, /*temperature=*/1.0f, /*seed=*/42), expected_tokens);
+}
+
+TEST_F(ContextSamplingParamsTest, fork_keeps_sampling_params) {
+    const std::vector<std::uint32_t> expected_tokens = SampleGreedy(kPrompt);
+    Context context = CreateContext(kPrompt);
+    gptoss::Check(gptoss_context_set_sampling_params(context.get(), /*top_k=*/1, /*top_p=*/1.0f), "set sampling params");
+
+    gptoss_context_t fork = nullptr;
+    gptoss::Check(gptoss_context_fork(context.get(), &fork), "fork Context");
+    Context fork_ptr(fork, gptoss_context_release);
+    EXPECT_EQ(Sample(fork, kNumTokens, /*temperature=*/1.0f, /*seed=*/42), expected_tokens);
+}
+
+TEST_F(ContextSamplingParamsTest, accepts_bounds) {
+    Context context = CreateContext(kPrompt);
+    EXPECT_EQ(gptoss_context_set_sampling_params(context.get(), /*top_k=*/GPTOSS_MAX_TOP_K, /*top_p=*/1.0f),
+        gptoss_status_success);
+    EXPECT_EQ(gptoss_context_set_sampling_params(context.get(), /*top_k=*/0, /*top_p=*/1.0f), gptoss_status_success);
+    EXPECT_EQ(Sample(context.get(), kNumTokens, /*temperature=*/1.0f, /*seed=*/42).size(), kNumTokens);
+}
+
+TEST_F(ContextSamplingParamsTest, rejects_invalid_params) {
+    Context context = CreateContext(kPrompt);
+    gptoss::Check(gptoss_context_set_sampling_params(context.get(), /*top_k=*/1, /*top_p=*/1.0f), "set sampling params");
+
+    EXPECT_EQ(gptoss_context_set_sampling_params(context.get(), /*top_k=*/GPTOSS_MAX_TOP_K + 1, /*top_p=*/1.0f),
+        gptoss_status_unsupported_argument);
+    for (float top_p : {0.0f, -0.5f, 1.5f, std::numeric_limits<float>::quiet_NaN(),
+            std::numeric_limits<float>::infinity()})
+    {
+        SCOPED_TRACE(top_p);
+        EXPECT_EQ(gptoss_context_set_sampling_params(context.get(), /*top_k=*/0, top_p), gptoss_status_invalid_argument);
+    }
+
+    // Rejected params leave the previous ones in effect.
+    EXPECT_EQ(Sample(context.get(), kNumTokens, /*temperature=*/1.0f, /*seed=*/42), SampleGreedy(kPrompt));
+}
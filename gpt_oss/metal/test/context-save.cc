@@ -0,0 +1,102 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include <unistd.h>
+
+#include <internal/storage.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextSaveTest : public ModelTest {
+protected:
+    using File = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+    // Saves the Context to a temporary file, and rewinds the file for loading.
+    static File Save(gptoss_context_t context) {
+        File file(std::tmpfile(), std::fclose);
+        if (file == nullptr) {
+            ADD_FAILURE() << "failed to create a temporary file";
+            return file;
+        }
+        gptoss::Check(gptoss_context_save(context, fileno(file.get())), "save Context");
+        Rewind(file.get());
+        return file;
+    }
+
+    static void Rewind(std::FILE* file) {
+        ASSERT_EQ(lseek(fileno(file), 0, SEEK_SET), 0);
+    }
+
+    // Overwrites a field of the saved header.
+    template <typename T>
+    static void PatchHeader(std::FILE* file, std::size_t offset, T value) {
+        ASSERT_EQ(pwrite(fileno(file), &value, sizeof(value), static_cast<off_t>(offset)), sizeof(value));
+    }
+};
+
+}  // namespace
+
+TEST_F(ContextSaveTest, roundtrip_restores_tokens_and_kvcache) {
+    Context context = CreateContext(kPrompt);
+    Sample(context.get(), /*max_tokens=*/16);
+    File file = Save(context.get());
+
+    Context restored_context = CreateContext();
+    gptoss::Check(gptoss_context_load(restored_context.get(), fileno(file.get())), "load Context");
+    EXPECT_EQ(GetTokens(restored_context.get()), GetTokens(context.get()));
+
+    // Continuing from the restored KV cache matches continuing in the original Context.
+    EXPECT_EQ(Sample(restored_context.get(), /*max_tokens=*/16), Sample(context.get(), /*max_tokens=*/16));
+}
+
+TEST_F(ContextSaveTest, roundtrip_past_attention_window) {
+    // Enough tokens for the sliding-window ring buffers to wrap around.
+    Context context = CreateContext(kPrompt);
+    Sample(context.get(), /*max_tokens=*/200);
+    File file = Save(context.get());
+
+    Context restored_context = CreateContext();
+    gptoss::Check(gptoss_context_load(restored_context.get(), fileno(file.get())), "load Context");
+    EXPECT_EQ(Sample(restored_context.get(), /*max_tokens=*/16), Sample(context.get(), /*max_tokens=*/16));
+}
+
+TEST_F(ContextSaveTest, rejects_file_for_different_weights) {
+    Context context = CreateContext(kPrompt);
+    File file = Save(context.get());
+    PatchHeader(file.get(), offsetof(gptoss_context_file_header, weights_fingerprint), std::uint64_t{0});
+
+    Context restored_context = CreateContext("Unrelated");
+    const std::vector<std::uint32_t> tokens = GetTokens(restored_context.get());
+    EXPECT_EQ(gptoss_context_load(restored_context.get(), fileno(file.get())), gptoss_status_invalid_argument);
+    EXPECT_EQ(GetTokens(restored_context.get()), tokens);
+}
+
+TEST_F(ContextSaveTest, rejects_invalid_magic) {
+    Context context = CreateContext(kPrompt);
+    File file = Save(context.get());
+    PatchHeader(file.get(), offsetof(gptoss_context_file_header, magic), '\0');
+
+    Context restored_context = CreateContext();
+    EXPECT_EQ(gptoss_context_load(restored_context.get(), fileno(file.get())), gptoss_status_invalid_argument);
+    EXPECT_TRUE(GetTokens(restored_context.get()).empty());
+}
+
+TEST_F(ContextSaveTest, rejects_shorter_context) {
+    Context context = CreateContext(kPrompt);
+    Sample(context.get(), /*max_tokens=*/64);
+    File file = Save(context.get());
+
+    Context restored_context = CreateContext(/*context_length=*/32);
+    EXPECT_EQ(gptoss_context_load(restored_context.get(), fileno(file.get())), gptoss_status_context_overflow);
+    EXPECT_TRUE(GetTokens(restored_context.get()).empty());
+}
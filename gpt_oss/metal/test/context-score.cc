@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextScoreTest : public ModelTest {
+protected:
+    static std::vector<float> Score(gptoss_context_t context, const std::vector<std::uint32_t>& tokens) {
+        std::vector<float> logprobs(tokens.size());
+        gptoss::Check(gptoss_context_score(context, tokens.size(), tokens.data(), logprobs.data()), "score tokens");
+        return logprobs;
+    }
+
+    // Greedy continuation of the prompt, long enough to span several batches and the sliding attention window.
+    static const std::vector<std::uint32_t>& GetContinuation() {
+        static const std::vector<std::uint32_t> continuation = [] {
+            Context context = CreateContext(kPrompt);
+            return Sample(context.get(), kNumContinuationTokens);
+        }();
+        return continuation;
+    }
+
+    static constexpr std::size_t kNumContinuationTokens = 300;
+    // Batched and per-token kernels accumulate in different orders.
+    static constexpr float kLogprobTolerance = 0.05f;
+};
+
+}  // namespace
+
+TEST_F(ContextScoreTest, appends_scored_tokens) {
+    Context context = CreateContext(kPrompt);
+    std::vector<std::uint32_t> expected_tokens = GetTokens(context.get());
+    const std::vector<std::uint32_t>& continuation = GetContinuation();
+    const std::vector<float> logprobs = Score(context.get(), continuation);
+
+    expected_tokens.insert(expected_tokens.end(), continuation.begin(), continuation.end());
+    EXPECT_EQ(GetTokens(context.get()), expected_tokens);
+    for (std::size_t t = 0; t < logprobs.size(); t++) {
+        EXPECT_TRUE(std::isfinite(logprobs[t])) << "token #" << t;
+        EXPECT_LE(logprobs[t], 0.0f) << "token #" << t;
+    }
+}
+
+TEST_F(ContextScoreTest, greedy_token_is_most_likely) {
+    const std::vector<std::uint32_t>& continuation = GetContinuation();
+    Context greedy_context = CreateContext(kPrompt);
+    const float greedy_logprob = Score(greedy_context.get(), {continuation[0]})[0];
+
+    Context other_context = CreateContext(kPrompt);
+    const float other_logprob = Score(other_context.get(), {continuation[0] == 0 ? 1u : continuation[0] - 1})[0];
+    EXPECT_GE(greedy_logprob, other_logprob);
+}
+
+TEST_F(ContextScoreTest, batched_matches_incremental) {
+    const std::vector<std::uint32_t>& continuation = GetContinuation();
+    Context batched_context = CreateContext(kPrompt);
+    const std::vector<float> batched_logprobs = Score(batched_context.get(), continuation);
+
+    Context incremental_context = CreateContext(kPrompt);
+    std::vector<float> incremental_logprobs;
+    for (std::size_t t = 0; t < continuation.size(); t += 7) {
+        const std::vector<std::uint32_t> chunk(
+            continuation.begin() + t, continuation.begin() + std::min(t + 7, continuation.size()));
+        const std::vector<float> chunk_logprobs = Score(incremental_context.get(), chunk);
+        incremental_logprobs.insert(incremental_logprobs.end(), chunk_logprobs.begin(), chunk_logprobs.end());
+    }
+
+    ASSERT_EQ(incremental_logprobs.size(), batched_logprobs.size());
+    for (std::size_t t = 0; t < batched_logprobs.size(); t++) {
+        EXPECT_NEAR(incremental_logprobs[t], batched_logprobs[t], kLogprobTolerance) << "token #" << t;
+    }
+}
+
+TEST_F(ContextScoreTest, continues_like_sampled_context) {
+    // The KV cache after scoring must be the same as after sampling the scored tokens.
+    const std::vector<std::uint32_t>& continuation = GetContinuation();
+    const std::vector<std::uint32_t> prefix(continuation.begin(), continuation.begin() + kNumContinuationTokens / 2);
+    Context context = CreateContext(kPrompt);
+    Score(context.get(), prefix);
+    EXPECT_EQ(Sample(context.get(), /*max_tokens=*/16),
+        std::vector<std::uint32_t>(continuation.begin() + prefix.size(), continuation.begin() + prefix.size() + 16));
+}
+
+TEST_F(ContextScoreTest, failure_leaves_context_unchanged) {
+    Context context = CreateContext(kPrompt, /*context_length=*/64);
+    const std::vector<std::uint32_t> tokens = GetTokens(context.get());
+    const std::vector<std::uint32_t>& continuation = GetContinuation();
+
+    std::vector<float> logprobs(continuation.size());
+    EXPECT_EQ(gptoss_context_score(context.get(), continuation.size(), continuation.data(), logprobs.data()),
+        gptoss_status_context_overflow);
+    EXPECT_EQ(GetTokens(context.get()), tokens);
+
+    const std::uint32_t invalid_tokens[2] = {continuation[0], UINT32_MAX};
+    EXPECT_EQ(gptoss_context_score(context.get(), 2, invalid_tokens, logprobs.data()), gptoss_status_invalid_argument);
+    EXPECT_EQ(GetTokens(context.get()), tokens);
+
+    EXPECT_EQ(Sample(context.get(), /*max_tokens=*/8),
+        std::vector<std::uint32_t>(continuation.begin(), continuation.begin() + 8));
+}
+
+TEST_F(ContextScoreTest, rejects_empty_context) {
+    Context context = CreateContext();
+    const std::uint32_t token = 0;
+    float logprob = 0.0f;
+    EXPECT_EQ(gptoss_context_score(context.get(), 1, &token, &logprob), gptoss_status_invalid_state);
+    EXPECT_TRUE(GetTokens(context.get()).empty());
+}
@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextSpeculativeTest : public ModelTest {
+protected:
+    // Speculatively samples from a target and a draft Context of the same model, which thus accept all draft tokens.
+    static std::vector<std::uint32_t> SampleSpeculative(
+        std::size_t num_draft_tokens,
+        std::size_t max_tokens,
+        float temperature,
+        std::uint64_t seed)
+    {
+        Context target_context = CreateContext(kPrompt);
+        Context draft_context = CreateContext(kPrompt);
+        std::vector<std::uint32_t> tokens(max_tokens);
+        std::size_t num_tokens = 0;
+        gptoss::Check(gptoss_context_sample_speculative(target_context.get(), draft_context.get(), num_draft_tokens,
+                temperature, seed, max_tokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, tokens.data(), &num_tokens),
+            "sample speculatively");
+        tokens.resize(num_tokens);
+
+        // Both contexts end with the generated tokens.
+        const std::vector<std::uint32_t> target_tokens = GetTokens(target_context.get());
+        EXPECT_EQ(target_tokens, GetTokens(draft_context.get()));
+        EXPECT_EQ(std::vector<std::uint32_t>(target_tokens.end() - num_tokens, target_tokens.end()), tokens);
+        return tokens;
+    }
+};
+
+}  // namespace
+
+TEST_F(ContextSpeculativeTest, greedy_matches_sample) {
+    Context context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> expected_tokens = Sample(context.get(), /*max_tokens=*/32);
+
+    for (std::size_t num_draft_tokens : {1, 4, 7}) {
+        EXPECT_EQ(SampleSpeculative(num_draft_tokens, /*max_tokens=*/32, /*temperature=*/0.0f, /*seed=*/0), expected_tokens)
+            << num_draft_tokens << " draft tokens";
+    }
+}
+
+TEST_F(ContextSpeculativeTest, deterministic_with_temperature) {
+    const std::vector<std::uint32_t> tokens =
+        SampleSpeculative(/*num_draft_tokens=*/4, /*max_tokens=*/32, /*temperature=*/1.0f, /*seed=*/42);
+    EXPECT_EQ(tokens.size(), 32);
+    EXPECT_EQ(SampleSpeculative(/*num_draft_tokens=*/4, /*max_tokens=*/32, /*temperature=*/1.0f, /*seed=*/42), tokens);
+}
+
+TEST_F(ContextSpeculativeTest, rejects_same_context) {
+    Context context = CreateContext(kPrompt);
+    std::uint32_t token = 0;
+    std::size_t num_tokens = 0;
+    EXPECT_EQ(gptoss_context_sample_speculative(context.get(), context.get(), /*num_draft_tokens=*/4,
+            /*temperature=*/0.0f, /*seed=*/0, /*max_tokens=*/1, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr,
+            &token, &num_tokens),
+        gptoss_status_invalid_argument);
+    EXPECT_EQ(num_tokens, 0);
+}
+
+TEST_F(ContextSpeculativeTest, rejects_mismatched_tokens) {
+    Context target_context = CreateContext(kPrompt);
+    Context draft_context = CreateContext("A different prompt");
+    std::uint32_t token = 0;
+    std::size_t num_tokens = 0;
+    EXPECT_EQ(gptoss_context_sample_speculative(target_context.get(), draft_context.get(), /*num_draft_tokens=*/4,
+            /*temperature=*/0.0f, /*seed=*/0, /*max_tokens=*/1, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr,
+            &token, &num_tokens),
+        gptoss_status_invalid_argument);
+}
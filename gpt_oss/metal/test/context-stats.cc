@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextStatsTest : public ModelTest {
+protected:
+    static std::uint64_t GetTotalExpertSelections() {
+        std::size_t num_experts = 0;
+        gptoss_model_get_expert_stats(model(), /*num_selections_out=*/nullptr, /*max_experts=*/0, &num_experts);
+        std::vector<std::uint64_t> num_selections(num_experts);
+        gptoss::Check(gptoss_model_get_expert_stats(model(), num_selections.data(), num_selections.size(), &num_experts),
+            "get expert stats");
+        return std::accumulate(num_selections.begin(), num_selections.end(), std::uint64_t{0});
+    }
+
+    static gptoss_context_stats GetStats(gptoss_context_t context) {
+        gptoss_context_stats stats;
+        gptoss::Check(gptoss_context_get_stats(context, &stats), "get Context stats");
+        return stats;
+    }
+};
+
+}  // namespace
+
+TEST_F(ContextStatsTest, counts_prefill_and_decode_tokens) {
+    Context context = CreateContext(kPrompt);
+    const std::size_t num_prompt_tokens = GetTokens(context.get()).size();
+    const gptoss_context_stats prefill_stats = GetStats(context.get());
+    EXPECT_EQ(prefill_stats.num_prefill_tokens, num_prompt_tokens);
+    EXPECT_EQ(prefill_stats.num_decode_tokens, 0);
+    EXPECT_EQ(prefill_stats.num_kv_tokens, num_prompt_tokens);
+    EXPECT_GE(prefill_stats.num_allocated_kv_tokens, prefill_stats.num_kv_tokens);
+    EXPECT_LE(prefill_stats.num_allocated_kv_tokens, prefill_stats.max_kv_tokens);
+
+    const std::vector<std::uint32_t> tokens = Sample(context.get(), /*max_tokens=*/8);
+    const gptoss_context_stats decode_stats = GetStats(context.get());
+    EXPECT_EQ(decode_stats.num_decode_tokens, tokens.size());
+    EXPECT_GT(decode_stats.num_command_buffers, prefill_stats.num_command_buffers);
+    EXPECT_GE(decode_stats.gpu_busy_seconds, prefill_stats.gpu_busy_seconds);
+}
+
+TEST_F(ContextStatsTest, expert_stats_counted_only_while_started) {
+    const std::uint64_t initial_selections = GetTotalExpertSelections();
+    CreateContext(kPrompt);
+    EXPECT_EQ(GetTotalExpertSelections(), initial_selections);
+
+    gptoss::Check(gptoss_model_start_expert_stats(model()), "start expert stats");
+    Context context = CreateContext(kPrompt);
+    const std::uint64_t counted_selections = GetTotalExpertSelections();
+    // Every block routes each prompt token to the same number of experts.
+    const std::size_t num_prompt_tokens = GetTokens(context.get()).size();
+    EXPECT_GT(counted_selections, initial_selections);
+    EXPECT_EQ((counted_selections - initial_selections) % num_prompt_tokens, 0);
+
+    gptoss::Check(gptoss_model_stop_expert_stats(model()), "stop expert stats");
+    Sample(context.get(), /*max_tokens=*/4);
+    EXPECT_EQ(GetTotalExpertSelections(), counted_selections);
+}
+
+TEST_F(ContextStatsTest, read_while_sampling_on_another_thread) {
+    Context context = CreateContext(kPrompt);
+    std::atomic<bool> done{false};
+    std::thread sampler([&] {
+        Sample(context.get(), /*max_tokens=*/64);
+        done.store(true, std::memory_order_release);
+    });
+
+    gptoss_context_stats previous_stats = GetStats(context.get());
+    while (!done.load(std::memory_order_acquire)) {
+        const gptoss_context_stats stats = GetStats(context.get());
+        EXPECT_GE(stats.num_decode_tokens, previous_stats.num_decode_tokens);
+        EXPECT_GE(stats.num_kv_tokens, previous_stats.num_kv_tokens);
+        EXPECT_LE(stats.num_kv_tokens, stats.max_kv_tokens);
+        EXPECT_LE(stats.num_allocated_kv_tokens, stats.max_kv_tokens);
+        previous_stats = stats;
+    }
+    sampler.join();
+    EXPECT_EQ(GetStats(context.get()).num_decode_tokens, 64);
+}
@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextStreamTest : public ModelTest {
+protected:
+    // Returns the next token of the stream, or nothing if the stream has ended.
+    static std::vector<std::uint32_t> StreamNext(gptoss_context_t context) {
+        std::uint32_t token = 0;
+        std::size_t num_tokens = 0;
+        gptoss::Check(gptoss_context_stream_next(context, &token, &num_tokens), "get next streamed token");
+        return std::vector<std::uint32_t>(num_tokens, token);
+    }
+
+    // Streams max_tokens tokens from the Context until the stream ends, and returns the streamed tokens.
+    static std::vector<std::uint32_t> Stream(
+        gptoss_context_t context,
+        std::size_t max_tokens,
+        float temperature = 0.0f,
+        std::uint64_t seed = 0)
+    {
+        gptoss::Check(gptoss_context_stream_begin(context, temperature, seed, max_tokens, /*num_stop_tokens=*/0,
+                /*stop_tokens=*/nullptr),
+            "begin stream");
+        std::vector<std::uint32_t> tokens;
+        for (std::vector<std::uint32_t> token = StreamNext(context); !token.empty(); token = StreamNext(context)) {
+            tokens.push_back(token[0]);
+        }
+        return tokens;
+    }
+
+    // Begins a greedy stream of kNumSteps tokens and consumes only num_consumed_tokens of them, leaving the remaining
+    // steps in flight.
+    static std::vector<std::uint32_t> StreamPartially(gptoss_context_t context, std::size_t num_consumed_tokens) {
+        gptoss::Check(gptoss_context_stream_begin(context, /*temperature=*/0.0f, /*seed=*/0, kNumSteps,
+                /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr),
+            "begin stream");
+        std::vector<std::uint32_t> tokens;
+        for (std::size_t i = 0; i < num_consumed_tokens; i++) {
+            const std::vector<std::uint32_t> token = StreamNext(context);
+            EXPECT_EQ(token.size(), 1);
+            tokens.insert(tokens.end(), token.begin(), token.end());
+        }
+        return tokens;
+    }
+
+    // Expects that the stream ended after the consumed tokens: the Context holds exactly the prompt and the consumed
+    // tokens, and continues greedily like a Context which generated only the consumed tokens.
+    static void ExpectRolledBack(
+        gptoss_context_t context,
+        const std::vector<std::uint32_t>& prompt_tokens,
+        const std::vector<std::uint32_t>& consumed_tokens)
+    {
+        EXPECT_TRUE(StreamNext(context).empty());
+
+        std::vector<std::uint32_t> expected_tokens = prompt_tokens;
+        expected_tokens.insert(expected_tokens.end(), consumed_tokens.begin(), consumed_tokens.end());
+        EXPECT_EQ(GetTokens(context), expected_tokens);
+
+        Context reference_context = CreateContext(kPrompt);
+        EXPECT_EQ(Sample(reference_context.get(), consumed_tokens.size()), consumed_tokens);
+        EXPECT_EQ(Sample(context, kNumSteps), Sample(reference_context.get(), kNumSteps));
+    }
+
+    // Sets an automaton which allows every token and counts generated tokens in its state, up to kNumCounterStates - 1.
+    static void SetCountingAutomaton(gptoss_context_t context) {
+        const std::size_t num_mask_words = (GetNumVocabularyTokens() + 31) / 32;
+        const std::vector<std::uint32_t> allow_masks(kNumCounterStates * num_mask_words, UINT32_C(0xFFFFFFFF));
+        std::vector<std::uint32_t> default_states(kNumCounterStates);
+        for (std::uint32_t s = 0; s < kNumCounterStates; s++) {
+            default_states[s] = std::min(s + 1, kNumCounterStates - 1);
+        }
+        gptoss::Check(gptoss_context_set_token_automaton(context, kNumCounterStates, /*initial_state=*/0, allow_masks.data(),
+                default_states.data(), /*num_transitions=*/0, /*transitions=*/nullptr),
+            "set token automaton");
+    }
+
+    static std::uint32_t GetTokenAutomatonState(gptoss_context_t context) {
+        std::uint32_t state = 0;
+        gptoss::Check(gptoss_context_get_token_automaton_state(context, &state), "get token automaton state");
+        return state;
+    }
+
+    static constexpr std::size_t kNumSteps = 16;
+    static constexpr std::size_t kNumConsumedTokens = 3;
+    static constexpr std::uint32_t kNumCounterStates = 64;
+};
+
+}  // namespace
+
+TEST_F(ContextStreamTest, greedy_matches_sample) {
+    Context context = CreateContext(kPrompt);
+    Context reference_context = CreateContext(kPrompt);
+    EXPECT_EQ(Stream(context.get(), kNumSteps), Sample(reference_context.get(), kNumSteps));
+}
+
+TEST_F(ContextStreamTest, seeded_matches_sample) {
+    Context context = CreateContext(kPrompt);
+    Context reference_context = CreateContext(kPrompt);
+    EXPECT_EQ(Stream(context.get(), kNumSteps, /*temperature=*/1.0f, /*seed=*/42),
+        Sample(reference_context.get(), kNumSteps, /*temperature=*/1.0f, /*seed=*/42));
+}
+
+TEST_F(ContextStreamTest, appends_streamed_tokens) {
+    Context context = CreateContext(kPrompt);
+    std::vector<std::uint32_t> expected_tokens = GetTokens(context.get());
+    const std::vector<std::uint32_t> tokens = Stream(context.get(), kNumSteps);
+    ASSERT_EQ(tokens.size(), kNumSteps);
+    expected_tokens.insert(expected_tokens.end(), tokens.begin(), tokens.end());
+    EXPECT_EQ(GetTokens(context.get()), expected_tokens);
+}
+
+TEST_F(ContextStreamTest, end_discards_unconsumed_tokens) {
+    Context context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(context.get());
+    const std::vector<std::uint32_t> tokens = StreamPartially(context.get(), kNumConsumedTokens);
+    gptoss::Check(gptoss_context_stream_end(context.get()), "end stream");
+    ExpectRolledBack(context.get(), prompt_tokens, tokens);
+}
+
+TEST_F(ContextStreamTest, end_rolls_back_token_automaton_state) {
+    Context context = CreateContext(kPrompt);
+    SetCountingAutomaton(context.get());
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(context.get());
+    const std::vector<std::uint32_t> tokens = StreamPartially(context.get(), kNumConsumedTokens);
+    gptoss::Check(gptoss_context_stream_end(context.get()), "end stream");
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), kNumConsumedTokens);
+    EXPECT_EQ(GetTokens(context.get()).size(), prompt_tokens.size() + kNumConsumedTokens);
+
+    // A stream consumed to the end advances the automaton by every streamed token.
+    EXPECT_EQ(Stream(context.get(), kNumSteps).size(), kNumSteps);
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), kNumConsumedTokens + kNumSteps);
+}
+
+TEST_F(ContextStreamTest, set_sampling_params_ends_stream) {
+    Context context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(context.get());
+    const std::vector<std::uint32_t> tokens = StreamPartially(context.get(), kNumConsumedTokens);
+    gptoss::Check(gptoss_context_set_sampling_params(context.get(), /*top_k=*/0, /*top_p=*/1.0f), "set sampling params");
+    ExpectRolledBack(context.get(), prompt_tokens, tokens);
+}
+
+TEST_F(ContextStreamTest, process_ends_stream) {
+    Context context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(context.get());
+    const std::vector<std::uint32_t> tokens = StreamPartially(context.get(), kNumConsumedTokens);
+    gptoss::Check(gptoss_context_process(context.get()), "process tokens");
+    ExpectRolledBack(context.get(), prompt_tokens, tokens);
+}
+
+TEST_F(ContextStreamTest, next_without_stream_returns_no_tokens) {
+    Context context = CreateContext(kPrompt);
+    EXPECT_TRUE(StreamNext(context.get()).empty());
+    EXPECT_EQ(Stream(context.get(), kNumSteps).size(), kNumSteps);
+    EXPECT_TRUE(StreamNext(context.get()).empty());
+}
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <internal/model.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextThreadsTest : public ModelTest {
+protected:
+    static std::vector<std::uint32_t> Generate(const char* prompt, std::size_t max_tokens) {
+        Context context = CreateContext(prompt);
+        return Sample(context.get(), max_tokens);
+    }
+
+    // Runs fn(i) on num_threads threads at once.
+    template <typename Fn>
+    static void RunThreads(std::size_t num_threads, Fn fn) {
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads);
+        for (std::size_t i = 0; i < num_threads; i++) {
+            threads.emplace_back(fn, i);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // A prompt of several batches, which grows the KV cache pool while other contexts run.
+    static std::string GetLongPrompt() {
+        std::string prompt;
+        for (std::size_t i = 0; i < 40; i++) {
+            prompt += kPrompt;
+            prompt += ' ';
+        }
+        return prompt;
+    }
+
+    // More threads than the model has command queues, so that some contexts share a queue.
+    static constexpr std::size_t kNumThreads = 2 * GPTOSS_NUM_COMMAND_QUEUES;
+};
+
+}  // namespace
+
+TEST_F(ContextThreadsTest, concurrent_decode_matches_sequential) {
+    const std::vector<std::uint32_t> expected_tokens = Generate(kPrompt, /*max_tokens=*/32);
+
+    std::vector<std::vector<std::uint32_t>> tokens(kNumThreads);
+    RunThreads(kNumThreads, [&](std::size_t i) {
+        tokens[i] = Generate(kPrompt, /*max_tokens=*/32);
+    });
+    for (std::size_t i = 0; i < kNumThreads; i++) {
+        EXPECT_EQ(tokens[i], expected_tokens) << "thread #" << i;
+    }
+}
+
+TEST_F(ContextThreadsTest, concurrent_prefill_and_decode_match_sequential) {
+    const std::string long_prompt = GetLongPrompt();
+    const std::vector<std::uint32_t> expected_long_tokens = Generate(long_prompt.c_str(), /*max_tokens=*/16);
+    const std::vector<std::uint32_t> expected_tokens = Generate(kPrompt, /*max_tokens=*/64);
+
+    // Thread 0 prefills a long prompt while the others decode.
+    std::vector<std::vector<std::uint32_t>> tokens(kNumThreads);
+    RunThreads(kNumThreads, [&](std::size_t i) {
+        tokens[i] = i == 0 ? Generate(long_prompt.c_str(), /*max_tokens=*/16) : Generate(kPrompt, /*max_tokens=*/64);
+    });
+    EXPECT_EQ(tokens[0], expected_long_tokens);
+    for (std::size_t i = 1; i < kNumThreads; i++) {
+        EXPECT_EQ(tokens[i], expected_tokens) << "thread #" << i;
+    }
+}
+
+TEST_F(ContextThreadsTest, concurrent_create_and_release_return_kvcache_pages) {
+    const std::string long_prompt = GetLongPrompt();
+    RunThreads(kNumThreads, [&](std::size_t i) {
+        for (std::size_t iteration = 0; iteration < 4; iteration++) {
+            Context context = CreateContext(i % 2 == 0 ? long_prompt.c_str() : kPrompt);
+            Sample(context.get(), /*max_tokens=*/4);
+        }
+    });
+
+    gptoss_model_stats stats;
+    gptoss::Check(gptoss_model_get_stats(model(), &stats), "get Model stats");
+    EXPECT_EQ(stats.num_used_kvcache_pool_tokens, 0);
+}
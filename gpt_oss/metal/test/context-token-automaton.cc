@@ -0,0 +1,249 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <set>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextTokenAutomatonTest : public ModelTest {
+protected:
+    // Token automaton in the layout of gptoss_context_set_token_automaton. States allow no tokens and loop to
+    // themselves until set otherwise.
+    struct TokenAutomaton {
+        explicit TokenAutomaton(std::uint32_t num_states) :
+            num_states(num_states),
+            num_mask_words((GetNumVocabularyTokens() + 31) / 32),
+            allow_masks(num_states * num_mask_words),
+            default_states(num_states)
+        {
+            for (std::uint32_t s = 0; s < num_states; s++) {
+                default_states[s] = s;
+            }
+        }
+
+        void Allow(std::uint32_t state, std::uint32_t token) {
+            allow_masks[state * num_mask_words + token / 32] |= UINT32_C(1) << (token % 32);
+        }
+
+        void AllowAll(std::uint32_t state) {
+            std::fill_n(allow_masks.begin() + state * num_mask_words, num_mask_words, UINT32_C(0xFFFFFFFF));
+        }
+
+        bool IsAllowed(std::uint32_t state, std::uint32_t token) const {
+            return (allow_masks[state * num_mask_words + token / 32] >> (token % 32)) & 1;
+        }
+
+        void AddTransition(std::uint32_t state, std::uint32_t token, std::uint32_t next_state) {
+            transitions.insert(transitions.end(), {state, token, next_state});
+        }
+
+        std::uint32_t GetNextState(std::uint32_t state, std::uint32_t token) const {
+            for (std::size_t i = 0; i < transitions.size(); i += 3) {
+                if (transitions[i] == state && transitions[i + 1] == token) {
+                    return transitions[i + 2];
+                }
+            }
+            return default_states[state];
+        }
+
+        gptoss_status Set(gptoss_context_t context, std::uint32_t initial_state) const {
+            return gptoss_context_set_token_automaton(context, num_states, initial_state, allow_masks.data(),
+                default_states.data(), transitions.size() / 3, transitions.data());
+        }
+
+        std::uint32_t num_states;
+        std::size_t num_mask_words;
+        std::vector<std::uint32_t> allow_masks;
+        std::vector<std::uint32_t> default_states;
+        std::vector<std::uint32_t> transitions;
+    };
+
+    // Automaton which allows every token and counts sampled tokens in its state, up to kNumCounterStates - 1.
+    static TokenAutomaton CreateCountingAutomaton() {
+        TokenAutomaton automaton(kNumCounterStates);
+        for (std::uint32_t s = 0; s < kNumCounterStates; s++) {
+            automaton.AllowAll(s);
+            automaton.default_states[s] = std::min(s + 1, kNumCounterStates - 1);
+        }
+        return automaton;
+    }
+
+    static std::uint32_t GetTokenAutomatonState(gptoss_context_t context) {
+        std::uint32_t state = 0;
+        gptoss::Check(gptoss_context_get_token_automaton_state(context, &state), "get token automaton state");
+        return state;
+    }
+
+    static constexpr std::size_t kNumTokens = 16;
+    static constexpr std::uint32_t kNumCounterStates = 64;
+};
+
+}  // namespace
+
+TEST_F(ContextTokenAutomatonTest, samples_only_allowed_tokens) {
+    Context reference_context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> unconstrained_tokens = Sample(reference_context.get(), kNumTokens);
+    ASSERT_FALSE(unconstrained_tokens.empty());
+
+    // Allow the tokens of the prompt, except the one the model would pick first.
+    Context context = CreateContext(kPrompt);
+    TokenAutomaton automaton(/*num_states=*/1);
+    for (std::uint32_t token : GetTokens(context.get())) {
+        if (token != unconstrained_tokens[0]) {
+            automaton.Allow(/*state=*/0, token);
+        }
+    }
+    gptoss::Check(automaton.Set(context.get(), /*initial_state=*/0), "set token automaton");
+
+    const std::vector<std::uint32_t> tokens = Sample(context.get(), kNumTokens);
+    ASSERT_EQ(tokens.size(), kNumTokens);
+    for (std::uint32_t token : tokens) {
+        EXPECT_TRUE(automaton.IsAllowed(/*state=*/0, token)) << token;
+    }
+    EXPECT_NE(tokens[0], unconstrained_tokens[0]);
+
+    const std::vector<std::uint32_t> random_tokens = Sample(context.get(), kNumTokens, /*temperature=*/1.0f, /*seed=*/7);
+    for (std::uint32_t token : random_tokens) {
+        EXPECT_TRUE(automaton.IsAllowed(/*state=*/0, token)) << token;
+    }
+}
+
+TEST_F(ContextTokenAutomatonTest, follows_transitions) {
+    // With three distinct tokens A, B, C of the prompt, state 0 allows A and B, and A moves to state 1, which allows
+    // only C and moves back to state 0.
+    Context context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(context.get());
+    const std::set<std::uint32_t> distinct_tokens(prompt_tokens.begin(), prompt_tokens.end());
+    ASSERT_GE(distinct_tokens.size(), 3);
+    const std::array<std::uint32_t, 3> tokens_abc = {
+        *distinct_tokens.begin(), *std::next(distinct_tokens.begin()), *std::next(distinct_tokens.begin(), 2)};
+    TokenAutomaton automaton(/*num_states=*/2);
+    automaton.Allow(/*state=*/0, tokens_abc[0]);
+    automaton.Allow(/*state=*/0, tokens_abc[1]);
+    automaton.Allow(/*state=*/1, tokens_abc[2]);
+    automaton.AddTransition(/*state=*/0, tokens_abc[0], /*next_state=*/1);
+    automaton.default_states[1] = 0;
+    gptoss::Check(automaton.Set(context.get(), /*initial_state=*/0), "set token automaton");
+
+    const std::vector<std::uint32_t> tokens = Sample(context.get(), kNumTokens, /*temperature=*/1.0f, /*seed=*/42);
+    ASSERT_EQ(tokens.size(), kNumTokens);
+    std::uint32_t state = 0;
+    for (std::size_t i = 0; i < tokens.size(); i++) {
+        EXPECT_TRUE(automaton.IsAllowed(state, tokens[i])) << "token " << tokens[i] << " at index " << i;
+        state = automaton.GetNextState(state, tokens[i]);
+    }
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), state);
+}
+
+TEST_F(ContextTokenAutomatonTest, state_advances_with_sampled_tokens_only) {
+    Context context = CreateContext(kPrompt);
+    gptoss::Check(CreateCountingAutomaton().Set(context.get(), /*initial_state=*/0), "set token automaton");
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), 0);
+
+    const std::vector<std::uint32_t> tokens = Sample(context.get(), kNumTokens);
+    ASSERT_EQ(tokens.size(), kNumTokens);
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), kNumTokens);
+
+    gptoss::Check(gptoss_context_append_tokens(context.get(), tokens.size(), tokens.data()), "append tokens");
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), kNumTokens);
+}
+
+TEST_F(ContextTokenAutomatonTest, reset_restores_initial_state) {
+    constexpr std::uint32_t kInitialState = 2;
+    Context context = CreateContext(kPrompt);
+    gptoss::Check(CreateCountingAutomaton().Set(context.get(), kInitialState), "set token automaton");
+    ASSERT_EQ(Sample(context.get(), kNumTokens).size(), kNumTokens);
+    ASSERT_EQ(GetTokenAutomatonState(context.get()), kInitialState + kNumTokens);
+
+    gptoss::Check(gptoss_context_reset(context.get()), "reset Context");
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), kInitialState);
+
+    // Reusing the KV cache of the same prompt after the reset doesn't carry the old state over.
+    gptoss::Check(gptoss_context_append_chars(context.get(), kPrompt, std::strlen(kPrompt), /*num_tokens_out=*/nullptr),
+        "append prompt");
+    ASSERT_EQ(Sample(context.get(), kNumTokens).size(), kNumTokens);
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), kInitialState + kNumTokens);
+}
+
+TEST_F(ContextTokenAutomatonTest, stream_end_rolls_back_state) {
+    // Ending a stream truncates the Context to the consumed tokens, and the state to the last consumed step.
+    constexpr std::size_t kNumConsumedTokens = 3;
+    Context context = CreateContext(kPrompt);
+    gptoss::Check(CreateCountingAutomaton().Set(context.get(), /*initial_state=*/0), "set token automaton");
+    gptoss::Check(gptoss_context_stream_begin(context.get(), /*temperature=*/0.0f, /*seed=*/0, kNumTokens,
+            /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr),
+        "begin stream");
+    for (std::size_t i = 0; i < kNumConsumedTokens; i++) {
+        std::uint32_t token = 0;
+        std::size_t num_tokens = 0;
+        gptoss::Check(gptoss_context_stream_next(context.get(), &token, &num_tokens), "get next streamed token");
+        ASSERT_EQ(num_tokens, 1);
+    }
+    gptoss::Check(gptoss_context_stream_end(context.get()), "end stream");
+    EXPECT_EQ(GetTokenAutomatonState(context.get()), kNumConsumedTokens);
+}
+
+TEST_F(ContextTokenAutomatonTest, fork_keeps_state_and_initial_state) {
+    constexpr std::uint32_t kInitialState = 5;
+    Context context = CreateContext(kPrompt);
+    gptoss::Check(CreateCountingAutomaton().Set(context.get(), kInitialState), "set token automaton");
+    ASSERT_EQ(Sample(context.get(), kNumTokens).size(), kNumTokens);
+
+    gptoss_context_t fork = nullptr;
+    gptoss::Check(gptoss_context_fork(context.get(), &fork), "fork Context");
+    Context fork_ptr(fork, gptoss_context_release);
+    EXPECT_EQ(GetTokenAutomatonState(fork), kInitialState + kNumTokens);
+    gptoss::Check(gptoss_context_reset(fork), "reset fork");
+    EXPECT_EQ(GetTokenAutomatonState(fork), kInitialState);
+}
+
+TEST_F(ContextTokenAutomatonTest, removing_automaton_lifts_constraints) {
+    Context context = CreateContext(kPrompt);
+    TokenAutomaton automaton(/*num_states=*/1);
+    automaton.Allow(/*state=*/0, GetTokens(context.get())[0]);
+    gptoss::Check(automaton.Set(context.get(), /*initial_state=*/0), "set token automaton");
+    gptoss::Check(gptoss_context_set_token_automaton(context.get(), /*num_states=*/0, /*initial_state=*/0,
+            /*allow_masks=*/nullptr, /*default_states=*/nullptr, /*num_transitions=*/0, /*transitions=*/nullptr),
+        "remove token automaton");
+
+    std::uint32_t state = 0;
+    EXPECT_EQ(gptoss_context_get_token_automaton_state(context.get(), &state), gptoss_status_invalid_state);
+    Context reference_context = CreateContext(kPrompt);
+    EXPECT_EQ(Sample(context.get(), kNumTokens), Sample(reference_context.get(), kNumTokens));
+}
+
+TEST_F(ContextTokenAutomatonTest, rejects_invalid_automata) {
+    Context context = CreateContext(kPrompt);
+    std::uint32_t state = 0;
+    EXPECT_EQ(gptoss_context_get_token_automaton_state(context.get(), &state), gptoss_status_invalid_state);
+
+    TokenAutomaton automaton = CreateCountingAutomaton();
+    EXPECT_EQ(automaton.Set(context.get(), /*initial_state=*/kNumCounterStates), gptoss_status_invalid_argument);
+
+    TokenAutomaton empty_state_automaton = CreateCountingAutomaton();
+    std::fill_n(empty_state_automaton.allow_masks.begin(), empty_state_automaton.num_mask_words, 0);
+    EXPECT_EQ(empty_state_automaton.Set(context.get(), /*initial_state=*/0), gptoss_status_invalid_argument);
+
+    TokenAutomaton unsorted_automaton = CreateCountingAutomaton();
+    unsorted_automaton.AddTransition(/*state=*/1, /*token=*/0, /*next_state=*/0);
+    unsorted_automaton.AddTransition(/*state=*/0, /*token=*/0, /*next_state=*/0);
+    EXPECT_EQ(unsorted_automaton.Set(context.get(), /*initial_state=*/0), gptoss_status_invalid_argument);
+
+    TokenAutomaton out_of_range_automaton = CreateCountingAutomaton();
+    out_of_range_automaton.default_states[0] = kNumCounterStates;
+    EXPECT_EQ(out_of_range_automaton.Set(context.get(), /*initial_state=*/0), gptoss_status_invalid_argument);
+
+    // Rejected automata leave the Context unconstrained.
+    EXPECT_EQ(gptoss_context_get_token_automaton_state(context.get(), &state), gptoss_status_invalid_state);
+}
@@ -0,0 +1,151 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include <internal/kernel-args.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ContextTopLogprobsTest : public ModelTest {
+protected:
+    struct TopLogprobs {
+        std::vector<std::uint32_t> tokens;
+        // num_top_logprobs entries per generated token, in order of decreasing probability.
+        std::vector<std::uint32_t> top_tokens;
+        std::vector<float> top_logprobs;
+    };
+
+    static TopLogprobs SampleWithTopLogprobs(
+        gptoss_context_t context,
+        std::size_t max_tokens,
+        std::size_t num_top_logprobs,
+        float temperature = 0.0f,
+        std::uint64_t seed = 0)
+    {
+        TopLogprobs result;
+        result.tokens.resize(max_tokens);
+        result.top_tokens.resize(max_tokens * num_top_logprobs);
+        result.top_logprobs.resize(max_tokens * num_top_logprobs);
+        std::size_t num_tokens = 0;
+        gptoss::Check(gptoss_context_sample_with_top_logprobs(context, temperature, seed, max_tokens,
+                /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, num_top_logprobs, result.tokens.data(),
+                result.top_tokens.data(), result.top_logprobs.data(), &num_tokens),
+            "sample tokens with top logprobs");
+        result.tokens.resize(num_tokens);
+        result.top_tokens.resize(num_tokens * num_top_logprobs);
+        result.top_logprobs.resize(num_tokens * num_top_logprobs);
+        return result;
+    }
+
+    // Log-probabilities of the tokens after the prompt, computed by gptoss_context_score on a fresh Context.
+    static std::vector<float> Score(const std::vector<std::uint32_t>& tokens) {
+        Context context = CreateContext(kPrompt);
+        std::vector<float> logprobs(tokens.size());
+        gptoss::Check(gptoss_context_score(context.get(), tokens.size(), tokens.data(), logprobs.data()), "score tokens");
+        return logprobs;
+    }
+
+    static constexpr std::size_t kNumTokens = 8;
+    static constexpr std::size_t kNumTopLogprobs = GPTOSS_MAX_TOP_LOGPROBS;
+    // Decoding processes single tokens, and scoring processes a batch, with different kernels.
+    static constexpr float kLogprobTolerance = 0.05f;
+};
+
+}  // namespace
+
+TEST_F(ContextTopLogprobsTest, sorted_by_decreasing_logprob) {
+    Context context = CreateContext(kPrompt);
+    const TopLogprobs result = SampleWithTopLogprobs(context.get(), kNumTokens, kNumTopLogprobs);
+    ASSERT_EQ(result.tokens.size(), kNumTokens);
+    for (std::size_t i = 0; i < kNumTokens; i++) {
+        SCOPED_TRACE(i);
+        const std::uint32_t* top_tokens = result.top_tokens.data() + i * kNumTopLogprobs;
+        const float* top_logprobs = result.top_logprobs.data() + i * kNumTopLogprobs;
+        EXPECT_EQ(std::set<std::uint32_t>(top_tokens, top_tokens + kNumTopLogprobs).size(), kNumTopLogprobs);
+        EXPECT_LE(top_logprobs[0], 0.0f);
+        for (std::size_t k = 1; k < kNumTopLogprobs; k++) {
+            EXPECT_GE(top_logprobs[k - 1], top_logprobs[k]) << "at rank " << k;
+            if (top_logprobs[k - 1] == top_logprobs[k]) {
+                EXPECT_LT(top_tokens[k - 1], top_tokens[k]) << "at rank " << k;
+            }
+        }
+        // Greedy sampling picks the most likely token.
+        EXPECT_EQ(result.tokens[i], top_tokens[0]);
+    }
+}
+
+TEST_F(ContextTopLogprobsTest, tokens_match_sample) {
+    for (float temperature : {0.0f, 1.0f}) {
+        SCOPED_TRACE(temperature);
+        Context context = CreateContext(kPrompt);
+        Context reference_context = CreateContext(kPrompt);
+        EXPECT_EQ(SampleWithTopLogprobs(context.get(), kNumTokens, kNumTopLogprobs, temperature, /*seed=*/42).tokens,
+            Sample(reference_context.get(), kNumTokens, temperature, /*seed=*/42));
+    }
+}
+
+TEST_F(ContextTopLogprobsTest, sampled_logprob_matches_score) {
+    for (float temperature : {0.0f, 1.0f}) {
+        SCOPED_TRACE(temperature);
+        Context context = CreateContext(kPrompt);
+        const TopLogprobs result = SampleWithTopLogprobs(context.get(), kNumTokens, kNumTopLogprobs, temperature,
+            /*seed=*/42);
+        ASSERT_EQ(result.tokens.size(), kNumTokens);
+        const std::vector<float> logprobs = Score(result.tokens);
+        std::size_t num_compared_tokens = 0;
+        for (std::size_t i = 0; i < kNumTokens; i++) {
+            // A randomly sampled token may be less likely than all reported ones.
+            const auto top_tokens = result.top_tokens.begin() + i * kNumTopLogprobs;
+            const auto top_token = std::find(top_tokens, top_tokens + kNumTopLogprobs, result.tokens[i]);
+            if (top_token != top_tokens + kNumTopLogprobs) {
+                EXPECT_NEAR(result.top_logprobs[top_token - result.top_tokens.begin()], logprobs[i], kLogprobTolerance)
+                    << "at index " << i;
+                num_compared_tokens += 1;
+            }
+        }
+        EXPECT_GT(num_compared_tokens, 0);
+    }
+}
+
+TEST_F(ContextTopLogprobsTest, fewer_logprobs_are_a_prefix) {
+    constexpr std::size_t kNumFewerTopLogprobs = 5;
+    Context context = CreateContext(kPrompt);
+    const TopLogprobs result = SampleWithTopLogprobs(context.get(), kNumTokens, kNumTopLogprobs);
+    Context fewer_context = CreateContext(kPrompt);
+    const TopLogprobs fewer_result = SampleWithTopLogprobs(fewer_context.get(), kNumTokens, kNumFewerTopLogprobs);
+    ASSERT_EQ(fewer_result.tokens, result.tokens);
+    for (std::size_t i = 0; i < kNumTokens; i++) {
+        SCOPED_TRACE(i);
+        for (std::size_t k = 0; k < kNumFewerTopLogprobs; k++) {
+            EXPECT_EQ(fewer_result.top_tokens[i * kNumFewerTopLogprobs + k], result.top_tokens[i * kNumTopLogprobs + k]);
+            EXPECT_EQ(fewer_result.top_logprobs[i * kNumFewerTopLogprobs + k], result.top_logprobs[i * kNumTopLogprobs + k]);
+        }
+    }
+}
+
+TEST_F(ContextTopLogprobsTest, rejects_invalid_count) {
+    Context context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> prompt_tokens = GetTokens(context.get());
+    for (std::size_t num_top_logprobs : {std::size_t(0), kNumTopLogprobs + 1}) {
+        SCOPED_TRACE(num_top_logprobs);
+        std::vector<std::uint32_t> tokens(kNumTokens);
+        std::vector<std::uint32_t> top_tokens(kNumTokens * (kNumTopLogprobs + 1));
+        std::vector<float> top_logprobs(kNumTokens * (kNumTopLogprobs + 1));
+        std::size_t num_tokens = 1;
+        EXPECT_EQ(gptoss_context_sample_with_top_logprobs(context.get(), /*temperature=*/0.0f, /*seed=*/0, kNumTokens,
+                /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, num_top_logprobs, tokens.data(), top_tokens.data(),
+                top_logprobs.data(), &num_tokens),
+            gptoss_status_invalid_argument);
+        EXPECT_EQ(num_tokens, 0);
+        EXPECT_EQ(GetTokens(context.get()), prompt_tokens);
+    }
+}
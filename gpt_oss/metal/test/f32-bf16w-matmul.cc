@@ -58,3 +58,70 @@ TEST(F32_BF16W_MATMUL, multiple_tokens) {
         .threadgroup_size(threadgroup_size)
         .TestF32_BF16W();
 }
+
+TEST(F32_BF16W_RMSNORM_MATMUL, single_simdgroup_multiple_iteration) {
+    MatMulKernelTester()
+        .num_rows(1)
+        .num_cols((2 * kSimdgroupSize + 1) * 4)
+        .threadgroup_size(kSimdgroupSize)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_MATMUL, multiple_threadgroups) {
+    constexpr std::size_t threadgroup_size = 2 * kSimdgroupSize;
+    constexpr std::uint32_t num_threadgroups = 3;
+
+    MatMulKernelTester()
+        .num_rows(num_threadgroups * threadgroup_size / kSimdgroupSize)
+        .num_cols((2 * kSimdgroupSize + 1) * 4)
+        .threadgroup_size(threadgroup_size)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_MATMUL, multiple_tokens) {
+    constexpr std::size_t threadgroup_size = 2 * kSimdgroupSize;
+    constexpr std::uint32_t num_threadgroups = 3;
+
+    MatMulKernelTester()
+        .num_rows(num_threadgroups * threadgroup_size / kSimdgroupSize)
+        .num_cols((2 * kSimdgroupSize + 1) * 4)
+        .num_tokens(2)
+        .threadgroup_size(threadgroup_size)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_DENSE_MATMUL, single_tile) {
+    MatMulKernelTester()
+        .num_rows(GPTOSS_DENSE_MATMUL_TILE)
+        .num_cols(GPTOSS_DENSE_MATMUL_TILE)
+        .num_tokens(GPTOSS_DENSE_MATMUL_TILE)
+        .dense(true)
+        .TestF32_BF16W();
+}
+
+TEST(F32_BF16W_DENSE_MATMUL, partial_token_tile) {
+    MatMulKernelTester()
+        .num_rows(3 * GPTOSS_DENSE_MATMUL_TILE)
+        .num_cols(5 * GPTOSS_DENSE_MATMUL_TILE)
+        .num_tokens(GPTOSS_DENSE_MATMUL_TILE + 5)
+        .dense(true)
+        .TestF32_BF16W();
+}
+
+TEST(F32_BF16W_DENSE_MATMUL, min_tokens) {
+    MatMulKernelTester()
+        .num_rows(2 * GPTOSS_DENSE_MATMUL_TILE)
+        .num_cols(3 * GPTOSS_DENSE_MATMUL_TILE)
+        .num_tokens(GPTOSS_DENSE_MATMUL_MIN_TOKENS)
+        .dense(true)
+        .TestF32_BF16W();
+}
+
+TEST(F32_BF16W_RMSNORM_DENSE_MATMUL, partial_token_tile) {
+    MatMulKernelTester()
+        .num_rows(3 * GPTOSS_DENSE_MATMUL_TILE)
+        .num_cols(5 * GPTOSS_DENSE_MATMUL_TILE)
+        .num_tokens(GPTOSS_DENSE_MATMUL_TILE + 5)
+        .dense(true)
+        .TestF32_BF16W_RMSNorm();
+}
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "matmul-kernel-tester.hpp"
+
+
+using gptoss::MatMulKernelTester;
+
+constexpr size_t kSimdgroupSize = 32;  // fixed in the kernel
+
+TEST(F32_I8W_UNEMBEDDING, single_simdgroup) {
+    MatMulKernelTester()
+        .num_rows(7)
+        .num_cols((2 * kSimdgroupSize + 1) * 4)
+        .threadgroup_size(kSimdgroupSize)
+        .TestF32_I8W_Unembedding();
+}
+
+TEST(F32_I8W_UNEMBEDDING, multiple_threadgroups) {
+    constexpr std::size_t threadgroup_size = 8 * kSimdgroupSize;
+
+    MatMulKernelTester()
+        .num_rows(1001)
+        .num_cols(2880)
+        .threadgroup_size(threadgroup_size)
+        .TestF32_I8W_Unembedding();
+}
+
+TEST(F32_I8W_UNEMBEDDING, multiple_tokens) {
+    constexpr std::size_t threadgroup_size = 8 * kSimdgroupSize;
+
+    MatMulKernelTester()
+        .num_rows(1001)
+        .num_cols(2880)
+        .num_tokens(5)
+        .threadgroup_size(threadgroup_size)
+        .TestF32_I8W_Unembedding();
+}
+
+TEST(F32_I8W_UNEMBEDDING, token_mask) {
+    constexpr std::size_t threadgroup_size = 8 * kSimdgroupSize;
+
+    MatMulKernelTester()
+        .num_rows(1001)
+        .num_cols(2880)
+        .num_tokens(3)
+        .num_token_states(4)
+        .token_state(3)
+        .threadgroup_size(threadgroup_size)
+        .TestF32_I8W_Unembedding();
+}
@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "kv-store-kernel-tester.hpp"
+
+
+using gptoss::KVStoreKernelTester;
+
+constexpr std::uint32_t kHeadDim = 64;  // fixed in the kernel
+constexpr std::uint32_t kNumQHeads = 64;
+constexpr std::uint32_t kNumKVHeads = 8;
+
+
+TEST(F32_KV_STORE, single_token) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(1)
+        .token_offset(5)
+        .kv_capacity(16)
+        .TestF32();
+}
+
+TEST(F32_KV_STORE, ring_buffer_wraparound) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(13)
+        .kv_capacity(16)
+        .TestF32();
+}
+
+TEST(F32_KV_STORE, page_boundary) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS - 3)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .TestF32();
+}
+
+TEST(F32_BF16KV_STORE, single_token) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(1)
+        .token_offset(5)
+        .kv_capacity(16)
+        .TestBF16();
+}
+
+TEST(F32_BF16KV_STORE, ring_buffer_wraparound) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(13)
+        .kv_capacity(16)
+        .TestBF16();
+}
+
+TEST(F32_BF16KV_STORE, page_boundary) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS - 3)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .TestBF16();
+}
+
+TEST(F32_I8KV_STORE, single_token) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(1)
+        .token_offset(5)
+        .kv_capacity(16)
+        .TestI8();
+}
+
+TEST(F32_I8KV_STORE, ring_buffer_wraparound) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(13)
+        .kv_capacity(16)
+        .TestI8();
+}
+
+TEST(F32_I8KV_STORE, page_boundary) {
+    KVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS - 3)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .TestI8();
+}
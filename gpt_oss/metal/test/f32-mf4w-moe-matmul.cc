@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "moe-matmul-kernel-tester.hpp"
+
+
+using gptoss::MoEMatMulKernelTester;
+
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL_SWIGLU, single_tile) {
+    MoEMatMulKernelTester()
+        .num_rows(16)
+        .num_cols(64)
+        .num_tokens(8)
+        .num_experts(32)
+        .TestF32_MF4W_SwiGLU();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL_SWIGLU, multiple_tiles) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(77)
+        .num_experts(32)
+        .TestF32_MF4W_SwiGLU();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL_SWIGLU, e128) {
+    MoEMatMulKernelTester()
+        .num_rows(64)
+        .num_cols(96)
+        .num_tokens(128)
+        .num_experts(128)
+        .TestF32_MF4W_SwiGLU();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL, single_tile) {
+    MoEMatMulKernelTester()
+        .num_rows(32)
+        .num_cols(64)
+        .num_tokens(8)
+        .num_experts(32)
+        .TestF32_MF4W();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL, multiple_tiles) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(77)
+        .num_experts(32)
+        .TestF32_MF4W();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL, e128) {
+    MoEMatMulKernelTester()
+        .num_rows(64)
+        .num_cols(96)
+        .num_tokens(128)
+        .num_experts(128)
+        .TestF32_MF4W();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL_SWIGLU, tiled_layout) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(77)
+        .num_experts(32)
+        .tiled(true)
+        .TestF32_MF4W_SwiGLU();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL, tiled_layout) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(77)
+        .num_experts(32)
+        .tiled(true)
+        .TestF32_MF4W();
+}
+
+TEST(F32_MF4W_MOE_MATMUL_ACCUMULATE, single_token) {
+    MoEMatMulKernelTester()
+        .num_rows(64)
+        .num_cols(96)
+        .num_tokens(1)
+        .num_experts(32)
+        .TestF32_MF4W_Accumulate();
+}
+
+TEST(F32_MF4W_MOE_MATMUL_ACCUMULATE, multiple_tokens) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(7)
+        .num_experts(32)
+        .TestF32_MF4W_Accumulate();
+}
+
+TEST(F32_MF4W_MOE_MATMUL_ACCUMULATE, k1) {
+    MoEMatMulKernelTester()
+        .num_rows(64)
+        .num_cols(96)
+        .num_tokens(3)
+        .num_experts(32)
+        .num_active_experts(1)
+        .TestF32_MF4W_Accumulate();
+}
+
+TEST(F32_MF4W_MOE_MATMUL_ACCUMULATE, k8) {
+    MoEMatMulKernelTester()
+        .num_rows(64)
+        .num_cols(96)
+        .num_tokens(3)
+        .num_experts(128)
+        .num_active_experts(8)
+        .TestF32_MF4W_Accumulate();
+}
+
+TEST(F32_MF4W_MOE_MATMUL_ACCUMULATE, tiled_layout) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(7)
+        .num_experts(32)
+        .tiled(true)
+        .TestF32_MF4W_Accumulate();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL, k2) {
+    MoEMatMulKernelTester()
+        .num_rows(64)
+        .num_cols(96)
+        .num_tokens(77)
+        .num_experts(32)
+        .num_active_experts(2)
+        .TestF32_MF4W();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL_SWIGLU, half_activations) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(77)
+        .num_experts(32)
+        .half_activations(true)
+        .TestF32_MF4W_SwiGLU();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL, half_activations) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(77)
+        .num_experts(32)
+        .half_activations(true)
+        .TestF32_MF4W();
+}
+
+TEST(F32_MF4W_MOE_DENSE_MATMUL, half_activations_tiled_layout) {
+    MoEMatMulKernelTester()
+        .num_rows(96)
+        .num_cols(160)
+        .num_tokens(77)
+        .num_experts(32)
+        .tiled(true)
+        .half_activations(true)
+        .TestF32_MF4W();
+}
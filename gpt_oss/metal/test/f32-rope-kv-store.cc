@@ -0,0 +1,160 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "rope-kv-store-kernel-tester.hpp"
+
+
+using gptoss::RoPEKVStoreKernelTester;
+
+constexpr std::uint32_t kHeadDim = 64;  // fixed in the kernel
+constexpr std::uint32_t kNumQHeads = 64;
+constexpr std::uint32_t kNumKVHeads = 8;
+
+
+TEST(F32_ROPE_KV_STORE, single_token) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(1)
+        .token_offset(5)
+        .kv_capacity(16)
+        .TestF32();
+}
+
+TEST(F32_ROPE_KV_STORE, ring_buffer_wraparound) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(13)
+        .kv_capacity(16)
+        .TestF32();
+}
+
+TEST(F32_ROPE_KV_STORE, kv_token_offset) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(3)
+        .kv_token_offset(6)
+        .kv_capacity(16)
+        .TestF32();
+}
+
+TEST(F32_ROPE_KV_STORE, page_boundary) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS - 3)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .TestF32();
+}
+
+TEST(F32_ROPE_BF16KV_STORE, ring_buffer_wraparound) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(13)
+        .kv_capacity(16)
+        .TestBF16();
+}
+
+TEST(F32_ROPE_BF16KV_STORE, page_boundary) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS - 3)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .TestBF16();
+}
+
+TEST(F32_ROPE_I8KV_STORE, ring_buffer_wraparound) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(13)
+        .kv_capacity(16)
+        .TestI8();
+}
+
+TEST(F32_ROPE_I8KV_STORE, page_boundary) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(7)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS - 3)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .TestI8();
+}
+
+TEST(KV_ROPE_SHIFT, ring_buffer) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(16)
+        .token_offset(16)
+        .kv_capacity(16)
+        .position_shift(-256)
+        .TestF32();
+}
+
+TEST(KV_ROPE_SHIFT, pages) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS)
+        .kv_token_offset(GPTOSS_KVCACHE_PAGE_TOKENS)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .position_shift(-2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .TestF32();
+}
+
+TEST(BF16KV_ROPE_SHIFT, pages) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS)
+        .kv_token_offset(GPTOSS_KVCACHE_PAGE_TOKENS)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .position_shift(-2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .TestBF16();
+}
+
+TEST(I8KV_ROPE_SHIFT, pages) {
+    RoPEKVStoreKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(kNumQHeads)
+        .num_kv_heads(kNumKVHeads)
+        .num_tokens(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .token_offset(GPTOSS_KVCACHE_PAGE_TOKENS)
+        .kv_token_offset(GPTOSS_KVCACHE_PAGE_TOKENS)
+        .kv_capacity(2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .paged(true)
+        .position_shift(-2 * GPTOSS_KVCACHE_PAGE_TOKENS)
+        .TestI8();
+}
@@ -0,0 +1,138 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "sdpa-kernel-tester.hpp"
+
+
+using gptoss::SDPAKernelTester;
+
+TEST(F32_SDPA, single_token) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(100)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode_split) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(8 * GPTOSS_SDPA_MIN_SPLIT_TOKENS + 3)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode_no_split) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(8 * GPTOSS_SDPA_MIN_SPLIT_TOKENS + 3)
+        .split(false)
+        .TestF32();
+}
+
+TEST(F32_SDPA, multiple_tokens_split) {
+    SDPAKernelTester()
+        .num_q_tokens(GPTOSS_SDPA_SPLIT_MAX_TOKENS)
+        .num_kv_tokens(4 * GPTOSS_SDPA_MIN_SPLIT_TOKENS)
+        .TestF32();
+}
+
+TEST(F32_SDPA, prefill) {
+    SDPAKernelTester()
+        .num_q_tokens(37)
+        .TestF32();
+}
+
+TEST(F32_SDPA, prefill_continuation) {
+    SDPAKernelTester()
+        .num_q_tokens(17)
+        .num_kv_tokens(100)
+        .TestF32();
+}
+
+TEST(F32_SDPA, sliding_window) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(1000)
+        .window(128)
+        .TestF32();
+}
+
+TEST(F32_SDPA, sliding_window_prefill) {
+    SDPAKernelTester()
+        .num_q_tokens(61)
+        .num_kv_tokens(300)
+        .window(128)
+        .TestF32();
+}
+
+TEST(F32_SDPA, sliding_window_split) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(5000)
+        .window(4 * GPTOSS_SDPA_MIN_SPLIT_TOKENS)
+        .TestF32();
+}
+
+TEST(F32_SDPA, multiple_kv_heads) {
+    SDPAKernelTester()
+        .num_kv_heads(8)
+        .num_q_tokens(3)
+        .num_kv_tokens(700)
+        .TestF32();
+}
+
+TEST(F32_SDPA, paged_decode) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(3 * GPTOSS_KVCACHE_PAGE_TOKENS + 5)
+        .paged(true)
+        .TestF32();
+}
+
+TEST(F32_SDPA, paged_decode_split) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(8 * GPTOSS_SDPA_MIN_SPLIT_TOKENS + 3)
+        .paged(true)
+        .TestF32();
+}
+
+TEST(F32_SDPA, paged_prefill_across_pages) {
+    SDPAKernelTester()
+        .num_q_tokens(61)
+        .num_kv_tokens(GPTOSS_KVCACHE_PAGE_TOKENS - 7)
+        .paged(true)
+        .TestF32();
+}
+
+TEST(F32_BF16KV_SDPA, paged_decode) {
+    SDPAKernelTester()
+        .num_kv_heads(8)
+        .num_q_tokens(1)
+        .num_kv_tokens(2 * GPTOSS_KVCACHE_PAGE_TOKENS + 17)
+        .paged(true)
+        .TestBF16KV();
+}
+
+TEST(F32_BF16KV_SDPA, decode_split) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(8 * GPTOSS_SDPA_MIN_SPLIT_TOKENS + 3)
+        .TestBF16KV();
+}
+
+TEST(F32_BF16KV_SDPA, sliding_window_prefill) {
+    SDPAKernelTester()
+        .num_kv_heads(8)
+        .num_q_tokens(61)
+        .num_kv_tokens(300)
+        .window(128)
+        .TestBF16KV();
+}
@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <internal/kernel-args.h>
+
+#include "top-logprobs-kernel-tester.hpp"
+
+
+using gptoss::TopLogprobsKernelTester;
+using ScorePattern = TopLogprobsKernelTester::ScorePattern;
+
+TEST(F32_TOP_LOGPROBS, single) {
+    TopLogprobsKernelTester()
+        .num_top(1)
+        .TestF32();
+}
+
+TEST(F32_TOP_LOGPROBS, max_top_logprobs) {
+    TopLogprobsKernelTester()
+        .num_top(GPTOSS_MAX_TOP_LOGPROBS)
+        .TestF32();
+}
+
+TEST(F32_TOP_LOGPROBS, multiple_rows) {
+    TopLogprobsKernelTester()
+        .num_rows(3)
+        .num_top(5)
+        .TestF32();
+}
+
+TEST(F32_TOP_LOGPROBS, ties) {
+    TopLogprobsKernelTester()
+        .num_top(8)
+        .score_pattern(ScorePattern::ties)
+        .TestF32();
+}
+
+TEST(F32_TOP_LOGPROBS, clustered) {
+    TopLogprobsKernelTester()
+        .num_top(GPTOSS_MAX_TOP_LOGPROBS)
+        .score_pattern(ScorePattern::clustered)
+        .TestF32();
+}
+
+TEST(F32_TOP_LOGPROBS, gpt_oss_vocabulary) {
+    TopLogprobsKernelTester()
+        .num_channels(201088)
+        .num_top(5)
+        .TestF32();
+}
+
+TEST(F32_TOP_LOGPROBS, threadgroup_sizes) {
+    for (std::size_t threadgroup_size : {64, 128, 256, 1024}) {
+        SCOPED_TRACE(threadgroup_size);
+        TopLogprobsKernelTester()
+            .num_rows(2)
+            .num_top(GPTOSS_MAX_TOP_LOGPROBS)
+            .threadgroup_size(threadgroup_size)
+            .TestF32();
+    }
+}
+
+TEST(F32_TOP_LOGPROBS, clustered_threadgroup_sizes) {
+    for (std::size_t threadgroup_size : {64, 128, 256}) {
+        SCOPED_TRACE(threadgroup_size);
+        TopLogprobsKernelTester()
+            .num_top(GPTOSS_MAX_TOP_LOGPROBS)
+            .threadgroup_size(threadgroup_size)
+            .score_pattern(ScorePattern::clustered)
+            .TestF32();
+    }
+}
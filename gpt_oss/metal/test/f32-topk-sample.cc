@@ -0,0 +1,135 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <set>
+#include <vector>
+
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+#include <internal/rng.hpp>
+
+using gptoss::Check;
+using namespace gptoss::metal;
+
+
+constexpr uint64_t kSeed = UINT64_C(1019827666124465388);
+constexpr uint32_t kNumChannels = 10007;
+constexpr uint32_t kNumSamples = 256;
+
+namespace {
+
+std::vector<float> RandomScores(std::uint32_t num_channels) {
+    std::vector<float> scores(num_channels);
+    for (std::uint32_t i = 0; i < num_channels; i++) {
+        scores[i] = static_cast<float>(gptoss::rng::squares32(i, kSeed) >> 8) * 0x1.0p-23f - 1.0f;
+    }
+    return scores;
+}
+
+std::set<std::uint32_t> TopTokens(const std::vector<float>& scores, std::size_t k) {
+    std::vector<std::uint32_t> tokens(scores.size());
+    std::iota(tokens.begin(), tokens.end(), 0);
+    std::partial_sort(tokens.begin(), tokens.begin() + k, tokens.end(),
+        [&scores](std::uint32_t a, std::uint32_t b) { return scores[a] > scores[b]; });
+    return std::set<std::uint32_t>(tokens.begin(), tokens.begin() + k);
+}
+
+std::vector<std::uint32_t> SampleTokens(const std::vector<float>& scores, std::uint32_t top_k, float top_p, float temperature) {
+    Device device;
+    CommandQueue command_queue{device};
+    CommandBuffer command_buffer{command_queue};
+    Library library{device};
+    Function f32_topk_sample_fn{library, "gptoss_f32_topk_sample"};
+    Buffer score_buffer{device, scores.size() * sizeof(float), scores.data()};
+    Buffer token_buffer{device, kNumSamples * sizeof(std::uint32_t)};
+    Buffer control_buffer{device, sizeof(gptoss_control)};
+    std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+    for (std::uint32_t s = 0; s < kNumSamples; s++) {
+        Check(gptoss_metal_command_buffer_encode_launch_f32_topk_sample(
+                command_buffer.handle(),
+                f32_topk_sample_fn.handle(),
+                score_buffer.handle(),
+                /*score_offset=*/0,
+                token_buffer.handle(),
+                /*token_offset=*/s * sizeof(std::uint32_t),
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                kSeed,
+                /*rng_offset=*/s,
+                static_cast<std::uint32_t>(scores.size()),
+                top_k,
+                top_p,
+                temperature),
+            "gptoss_metal_command_buffer_encode_launch_f32_topk_sample");
+    }
+
+    command_buffer.commit();
+    command_buffer.wait_completion();
+
+    const std::uint32_t* token_ptr = static_cast<const std::uint32_t*>(token_buffer.ptr());
+    return std::vector<std::uint32_t>(token_ptr, token_ptr + kNumSamples);
+}
+
+}  // namespace
+
+TEST(F32_TOPK_SAMPLE, top_k_1) {
+    const std::vector<float> scores = RandomScores(kNumChannels);
+    const std::uint32_t argmax = std::max_element(scores.begin(), scores.end()) - scores.begin();
+
+    for (std::uint32_t token : SampleTokens(scores, /*top_k=*/1, /*top_p=*/1.0f, /*temperature=*/1.0f)) {
+        ASSERT_EQ(token, argmax);
+    }
+}
+
+TEST(F32_TOPK_SAMPLE, top_k) {
+    constexpr std::uint32_t kTopK = 20;
+    const std::vector<float> scores = RandomScores(kNumChannels);
+    const std::set<std::uint32_t> top_tokens = TopTokens(scores, kTopK);
+
+    std::set<std::uint32_t> sampled_tokens;
+    for (std::uint32_t token : SampleTokens(scores, kTopK, /*top_p=*/1.0f, /*temperature=*/1.0f)) {
+        ASSERT_TRUE(top_tokens.count(token)) << "token " << token << " is not among the top " << kTopK;
+        sampled_tokens.insert(token);
+    }
+    EXPECT_GT(sampled_tokens.size(), 1);
+}
+
+TEST(F32_TOPK_SAMPLE, max_top_k) {
+    const std::vector<float> scores = RandomScores(kNumChannels);
+    const std::set<std::uint32_t> top_tokens = TopTokens(scores, GPTOSS_MAX_TOP_K);
+
+    for (std::uint32_t token : SampleTokens(scores, GPTOSS_MAX_TOP_K, /*top_p=*/1.0f, /*temperature=*/1.0f)) {
+        ASSERT_TRUE(top_tokens.count(token)) << "token " << token << " is not among the top " << GPTOSS_MAX_TOP_K;
+    }
+}
+
+TEST(F32_TOPK_SAMPLE, top_p) {
+    // Three tokens hold almost all of the probability mass: ~0.51, ~0.31, and ~0.19.
+    std::vector<float> scores(kNumChannels, -10.0f);
+    scores[17] = 10.0f;
+    scores[4242] = 9.5f;
+    scores[9999] = 9.0f;
+
+    std::set<std::uint32_t> sampled_tokens;
+    for (std::uint32_t token : SampleTokens(scores, /*top_k=*/0, /*top_p=*/0.7f, /*temperature=*/1.0f)) {
+        ASSERT_TRUE(token == 17 || token == 4242) << "token " << token << " is outside of the nucleus";
+        sampled_tokens.insert(token);
+    }
+    EXPECT_EQ(sampled_tokens.size(), 2);
+}
+
+TEST(F32_TOPK_SAMPLE, ties) {
+    // Which of the tied tokens become candidates is unspecified, but the sampled token must be one of them.
+    std::vector<float> scores(kNumChannels, 0.5f);
+    scores[123] = 1.0f;
+
+    for (std::uint32_t token : SampleTokens(scores, /*top_k=*/8, /*top_p=*/1.0f, /*temperature=*/1.0f)) {
+        ASSERT_LT(token, kNumChannels);
+    }
+}
@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "topk-kernel-tester.hpp"
+
+
+using gptoss::TopKKernelTester;
+
+TEST(F32_TOPK_SOFTMAX, gpt_oss_20b) {
+    TopKKernelTester()
+        .num_experts(32)
+        .num_active_experts(4)
+        .num_tokens(1)
+        .TestF32_Softmax();
+}
+
+TEST(F32_TOPK_SOFTMAX, gpt_oss_120b) {
+    TopKKernelTester()
+        .num_experts(128)
+        .num_active_experts(4)
+        .num_tokens(1)
+        .TestF32_Softmax();
+}
+
+TEST(F32_TOPK_SOFTMAX, multiple_tokens) {
+    TopKKernelTester()
+        .num_experts(128)
+        .num_active_experts(4)
+        .num_tokens(77)
+        .TestF32_Softmax();
+}
+
+TEST(F32_TOPK_SOFTMAX, partial_simdgroup) {
+    TopKKernelTester()
+        .num_experts(45)
+        .num_active_experts(3)
+        .num_tokens(5)
+        .TestF32_Softmax();
+}
+
+TEST(F32_TOPK_SOFTMAX, max_active_experts) {
+    TopKKernelTester()
+        .num_experts(64)
+        .num_active_experts(GPTOSS_MAX_ACTIVE_EXPERTS)
+        .num_tokens(9)
+        .TestF32_Softmax();
+}
+
+TEST(F32_TOPK_SOFTMAX, ties) {
+    TopKKernelTester()
+        .num_experts(128)
+        .num_active_experts(4)
+        .num_tokens(33)
+        .ties(true)
+        .TestF32_Softmax();
+}
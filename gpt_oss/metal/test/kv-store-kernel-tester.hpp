@@ -0,0 +1,293 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <internal/datatype.hpp>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+
+namespace gptoss {
+
+// Parameters and fixture shared by the testers of kernels that write the KV cache.
+template <typename Tester>
+class KVStoreKernelTesterBase {
+public:
+    KVStoreKernelTesterBase() { }
+
+    KVStoreKernelTesterBase(const KVStoreKernelTesterBase&) = delete;
+    KVStoreKernelTesterBase(KVStoreKernelTesterBase&&) = delete;
+    KVStoreKernelTesterBase& operator=(const KVStoreKernelTesterBase&) = delete;
+    KVStoreKernelTesterBase& operator=(KVStoreKernelTesterBase&&) = delete;
+
+    [[nodiscard]]
+    Tester& head_dim(std::uint32_t head_dim) {
+        head_dim_ = head_dim;
+        return static_cast<Tester&>(*this);
+    }
+
+    std::uint32_t head_dim() const {
+        return head_dim_;
+    }
+
+    [[nodiscard]]
+    Tester& num_q_heads(std::uint32_t num_q_heads) {
+        num_q_heads_ = num_q_heads;
+        return static_cast<Tester&>(*this);
+    }
+
+    std::uint32_t num_q_heads() const {
+        return num_q_heads_;
+    }
+
+    [[nodiscard]]
+    Tester& num_kv_heads(std::uint32_t num_kv_heads) {
+        num_kv_heads_ = num_kv_heads;
+        return static_cast<Tester&>(*this);
+    }
+
+    std::uint32_t num_kv_heads() const {
+        return num_kv_heads_;
+    }
+
+    std::uint32_t num_qkv_heads() const {
+        return num_q_heads() + 2 * num_kv_heads();
+    }
+
+    [[nodiscard]]
+    Tester& num_tokens(std::uint32_t num_tokens) {
+        num_tokens_ = num_tokens;
+        return static_cast<Tester&>(*this);
+    }
+
+    std::uint32_t num_tokens() const {
+        return num_tokens_;
+    }
+
+    [[nodiscard]]
+    Tester& token_offset(std::uint32_t token_offset) {
+        token_offset_ = token_offset;
+        return static_cast<Tester&>(*this);
+    }
+
+    std::uint32_t token_offset() const {
+        return token_offset_;
+    }
+
+    [[nodiscard]]
+    Tester& kv_capacity(std::uint32_t kv_capacity) {
+        kv_capacity_ = kv_capacity;
+        return static_cast<Tester&>(*this);
+    }
+
+    std::uint32_t kv_capacity() const {
+        return kv_capacity_;
+    }
+
+    // In paged mode, kv_capacity is the number of tokens in the pages of the page table, which maps pages in reverse
+    // order.
+    [[nodiscard]]
+    Tester& paged(bool paged) {
+        paged_ = paged;
+        return static_cast<Tester&>(*this);
+    }
+
+    bool paged() const {
+        return paged_;
+    }
+
+    std::uint32_t num_pages() const {
+        return kv_capacity() / GPTOSS_KVCACHE_PAGE_TOKENS;
+    }
+
+protected:
+    // Returns a page table of num_pages() pages in reverse order, with at least one entry.
+    metal::Buffer CreatePageTable() const {
+        metal::Buffer page_table_buffer{device_, std::max<std::size_t>(num_pages(), 1) * sizeof(std::uint32_t)};
+        std::uint32_t* page_table_ptr = static_cast<std::uint32_t*>(page_table_buffer.ptr());
+        for (std::uint32_t p = 0; p < num_pages(); p++) {
+            page_table_ptr[p] = num_pages() - 1 - p;
+        }
+        return page_table_buffer;
+    }
+
+    // Fills the QKV activations of num_tokens() tokens with random values in [-1.0, 1.0).
+    void EncodeFillQKV(metal::CommandBuffer& command_buffer, const metal::Buffer& qkv_buffer) const {
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/qkv_buffer,
+            /*output_offset=*/0,
+            num_tokens() * num_qkv_heads() * head_dim(),
+            kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+    }
+
+    static constexpr uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
+    metal::Function f32_kv_store_fn_{library_, "gptoss_f32_kv_store"};
+    metal::Function f32_bf16kv_store_fn_{library_, "gptoss_f32_bf16kv_store"};
+    metal::Function f32_i8kv_store_fn_{library_, "gptoss_f32_i8kv_store"};
+
+private:
+    std::uint32_t head_dim_{64};
+    std::uint32_t num_q_heads_{8};
+    std::uint32_t num_kv_heads_{1};
+    std::uint32_t num_tokens_{1};
+    std::uint32_t token_offset_{0};
+    std::uint32_t kv_capacity_{1};
+    bool paged_{false};
+};
+
+class KVStoreKernelTester : public KVStoreKernelTesterBase<KVStoreKernelTester> {
+public:
+    void Validate() const {
+        ASSERT_EQ(head_dim(), 64);
+        ASSERT_NE(num_kv_heads(), 0);
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_GE(kv_capacity(), num_tokens());
+        if (paged()) {
+            ASSERT_EQ(kv_capacity() % GPTOSS_KVCACHE_PAGE_TOKENS, 0);
+            ASSERT_LE(token_offset() + num_tokens(), kv_capacity());
+        }
+    }
+
+    void TestF32() const {
+        Validate();
+
+        const std::size_t head_size = head_dim() * sizeof(float);
+        metal::Buffer input_buffer{device_, num_tokens() * num_qkv_heads() * head_dim() * sizeof(float)};
+        metal::Buffer kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+
+        Run(f32_kv_store_fn_, input_buffer, kvcache_buffer);
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const char* kvcache_ptr = static_cast<const char*>(kvcache_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            const std::uint32_t slot = Slot(token_offset() + t);
+            for (std::uint32_t h = 0; h < 2 * num_kv_heads(); h++) {
+                const float* ref_head = input_ptr + (t * num_qkv_heads() + num_q_heads() + h) * head_dim();
+                const float* head = reinterpret_cast<const float*>(kvcache_ptr + (slot * 2 * num_kv_heads() + h) * head_size);
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    ASSERT_EQ(head[d], ref_head[d])
+                        << "at token " << t << ", head " << h << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+    void TestBF16() const {
+        Validate();
+
+        const std::size_t head_size = head_dim() * sizeof(gptoss_bfloat16);
+        metal::Buffer input_buffer{device_, num_tokens() * num_qkv_heads() * head_dim() * sizeof(float)};
+        metal::Buffer kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+
+        Run(f32_bf16kv_store_fn_, input_buffer, kvcache_buffer);
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const char* kvcache_ptr = static_cast<const char*>(kvcache_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            const std::uint32_t slot = Slot(token_offset() + t);
+            for (std::uint32_t h = 0; h < 2 * num_kv_heads(); h++) {
+                const float* ref_head = input_ptr + (t * num_qkv_heads() + num_q_heads() + h) * head_dim();
+                const gptoss_bfloat16* head = reinterpret_cast<const gptoss_bfloat16*>(kvcache_ptr + (slot * 2 * num_kv_heads() + h) * head_size);
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    const double ref_value = static_cast<double>(ref_head[d]);
+                    ASSERT_NEAR(upcast<double>(head[d]), ref_value, std::abs(ref_value) * 0x1.0p-8)
+                        << "at token " << t << ", head " << h << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+    void TestI8() const {
+        Validate();
+
+        const std::size_t head_size = head_dim() * sizeof(std::int8_t) + sizeof(float);
+        metal::Buffer input_buffer{device_, num_tokens() * num_qkv_heads() * head_dim() * sizeof(float)};
+        metal::Buffer kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+
+        Run(f32_i8kv_store_fn_, input_buffer, kvcache_buffer);
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const char* kvcache_ptr = static_cast<const char*>(kvcache_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            const std::uint32_t slot = Slot(token_offset() + t);
+            for (std::uint32_t h = 0; h < 2 * num_kv_heads(); h++) {
+                const float* ref_head = input_ptr + (t * num_qkv_heads() + num_q_heads() + h) * head_dim();
+                const char* head = kvcache_ptr + (slot * 2 * num_kv_heads() + h) * head_size;
+                float scale;
+                std::memcpy(&scale, head + head_dim() * sizeof(std::int8_t), sizeof(float));
+
+                double max_abs = 0.0;
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    max_abs = std::max(max_abs, std::abs(static_cast<double>(ref_head[d])));
+                }
+                ASSERT_NEAR(static_cast<double>(scale), max_abs / 127.0, max_abs * 1.0e-6)
+                    << "at token " << t << ", head " << h;
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    const double value = static_cast<double>(static_cast<std::int8_t>(head[d])) * static_cast<double>(scale);
+                    ASSERT_NEAR(value, static_cast<double>(ref_head[d]), max_abs / 254.0 * (1.0 + 1.0e-5))
+                        << "at token " << t << ", head " << h << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+private:
+    std::uint32_t Slot(std::uint32_t t) const {
+        if (paged()) {
+            const std::uint32_t page = num_pages() - 1 - t / GPTOSS_KVCACHE_PAGE_TOKENS;
+            return page * GPTOSS_KVCACHE_PAGE_TOKENS + t % GPTOSS_KVCACHE_PAGE_TOKENS;
+        } else {
+            return t % kv_capacity();
+        }
+    }
+
+    void Run(const metal::Function& kv_store_fn, const metal::Buffer& input_buffer, const metal::Buffer& kvcache_buffer) const {
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        const metal::Buffer page_table_buffer = CreatePageTable();
+
+        metal::CommandBuffer command_buffer{command_queue_};
+
+        EncodeFillQKV(command_buffer, input_buffer);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_kv_store(
+                command_buffer.handle(),
+                kv_store_fn.handle(),
+                input_buffer.handle(),
+                /*input_offset=*/num_q_heads() * head_dim() * sizeof(float),
+                kvcache_buffer.handle(),
+                /*kvcache_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                paged() ? page_table_buffer.handle() : nullptr,
+                /*page_table_offset=*/0,
+                num_tokens(),
+                num_q_heads(),
+                num_kv_heads(),
+                head_dim(),
+                token_offset(),
+                kv_capacity()),
+            "gptoss_metal_command_buffer_encode_launch_f32_kv_store");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+    }
+};
+
+}  // namespace gptoss
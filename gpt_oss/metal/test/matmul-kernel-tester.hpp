@@ -2,9 +2,12 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <random>
 
 #include <internal/datatype.hpp>
 #include <internal/metal.hpp>
@@ -13,19 +16,21 @@
 
 namespace gptoss {
 
-class MatMulKernelTester {
+// Parameters and fixture shared by the testers of matrix multiplication kernels.
+template <typename Tester>
+class MatMulKernelTesterBase {
 public:
-    MatMulKernelTester() { }
+    MatMulKernelTesterBase() { }
 
-    MatMulKernelTester(const MatMulKernelTester&) = delete;
-    MatMulKernelTester(MatMulKernelTester&&) = delete;
-    MatMulKernelTester& operator=(const MatMulKernelTester&) = delete;
-    MatMulKernelTester& operator=(MatMulKernelTester&&) = delete;
+    MatMulKernelTesterBase(const MatMulKernelTesterBase&) = delete;
+    MatMulKernelTesterBase(MatMulKernelTesterBase&&) = delete;
+    MatMulKernelTesterBase& operator=(const MatMulKernelTesterBase&) = delete;
+    MatMulKernelTesterBase& operator=(MatMulKernelTesterBase&&) = delete;
 
     [[nodiscard]]
-    MatMulKernelTester& num_rows(std::uint32_t num_rows) {
+    Tester& num_rows(std::uint32_t num_rows) {
         num_rows_ = num_rows;
-        return *this;
+        return static_cast<Tester&>(*this);
     }
 
     std::uint32_t num_rows() const {
@@ -33,9 +38,9 @@ public:
     }
 
     [[nodiscard]]
-    MatMulKernelTester& num_cols(std::uint32_t num_cols) {
+    Tester& num_cols(std::uint32_t num_cols) {
         num_cols_ = num_cols;
-        return *this;
+        return static_cast<Tester&>(*this);
     }
 
     std::uint32_t num_cols() const {
@@ -43,15 +48,32 @@ public:
     }
 
     [[nodiscard]]
-    MatMulKernelTester& num_tokens(std::uint32_t num_tokens) {
+    Tester& num_tokens(std::uint32_t num_tokens) {
         num_tokens_ = num_tokens;
-        return *this;
+        return static_cast<Tester&>(*this);
     }
 
     std::uint32_t num_tokens() const {
         return num_tokens_;
     }
 
+protected:
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
+
+private:
+    std::uint32_t num_tokens_{1};
+    std::uint32_t num_rows_{1};
+    std::uint32_t num_cols_{32};
+};
+
+class MatMulKernelTester : public MatMulKernelTesterBase<MatMulKernelTester> {
+public:
     [[nodiscard]]
     MatMulKernelTester& threadgroup_size(std::size_t threadgroup_size) {
         threadgroup_size_ = threadgroup_size;
@@ -62,12 +84,63 @@ public:
         return threadgroup_size_;
     }
 
+    // Lets the launcher pick the dense (simdgroup matrix) kernel for launches of at least
+    // GPTOSS_DENSE_MATMUL_MIN_TOKENS tokens.
+    [[nodiscard]]
+    MatMulKernelTester& dense(bool dense) {
+        dense_ = dense;
+        return *this;
+    }
+
+    bool dense() const {
+        return dense_;
+    }
+
+    [[nodiscard]]
+    MatMulKernelTester& epsilon(float epsilon) {
+        epsilon_ = epsilon;
+        return *this;
+    }
+
+    float epsilon() const {
+        return epsilon_;
+    }
+
+    // Restricts the unembedding to the tokens allowed by random token masks of num_token_states automaton states, of
+    // which token_state is the current one. 0 states disable the masks.
+    [[nodiscard]]
+    MatMulKernelTester& num_token_states(std::uint32_t num_token_states) {
+        num_token_states_ = num_token_states;
+        return *this;
+    }
+
+    std::uint32_t num_token_states() const {
+        return num_token_states_;
+    }
+
+    [[nodiscard]]
+    MatMulKernelTester& token_state(std::uint32_t token_state) {
+        token_state_ = token_state;
+        return *this;
+    }
+
+    std::uint32_t token_state() const {
+        return token_state_;
+    }
+
+    std::uint32_t num_mask_words() const {
+        return (num_rows() + 31) / 32;
+    }
+
     void Validate(std::uint32_t vec_size) const {
         ASSERT_NE(num_rows(), 0);
         ASSERT_NE(num_cols(), 0);
         ASSERT_EQ(num_cols() % vec_size, 0);
         ASSERT_NE(num_tokens(), 0);
         ASSERT_NE(threadgroup_size(), 0);
+        if (num_token_states() != 0) {
+            ASSERT_LT(token_state(), num_token_states());
+        }
     }
 
     void TestF32_BF16W() const {
@@ -108,6 +181,7 @@ public:
         Check(gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
                 command_buffer.handle(),
                 f32_bf16w_matmul_fn_.handle(),
+                dense() ? f32_bf16w_dense_matmul_fn_.handle() : nullptr,
                 /*threadgroup_size=*/threadgroup_size(),
                 input_buffer.handle(),
                 /*input_offset=*/0,
@@ -145,24 +219,329 @@ public:
         }
     }
 
+    // RMSNorm with per-channel gain, fused into the input of the matrix multiplication.
+    void TestF32_BF16W_RMSNorm() const {
+        Validate(/*vec_size=*/4);
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        metal::Buffer input_buffer{device_, num_tokens() * num_cols() * sizeof(float)};
+        metal::Buffer gain_buffer{device_, num_cols() * sizeof(gptoss_bfloat16)};
+        metal::Buffer weight_buffer{device_, num_rows() * num_cols() * sizeof(gptoss_bfloat16)};
+        metal::Buffer bias_buffer{device_, num_rows() * sizeof(gptoss_bfloat16)};
+        metal::Buffer output_buffer{device_, num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_tokens() * num_cols(), kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/gain_buffer,
+            /*output_offset=*/0,
+            num_cols(), kSeed + 3, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/weight_buffer,
+            /*output_offset=*/0,
+            num_rows() * num_cols(), kSeed + 1, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/bias_buffer,
+            /*output_offset=*/0,
+            num_rows(), kSeed + 2, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_matmul(
+                command_buffer.handle(),
+                f32_bf16w_rmsnorm_matmul_fn_.handle(),
+                dense() ? f32_bf16w_rmsnorm_dense_matmul_fn_.handle() : nullptr,
+                /*threadgroup_size=*/threadgroup_size(),
+                input_buffer.handle(),
+                /*input_offset=*/0,
+                gain_buffer.handle(),
+                /*gain_offset=*/0,
+                weight_buffer.handle(),
+                /*weight_offset=*/0,
+                bias_buffer.handle(),
+                /*bias_offset=*/0,
+                output_buffer.handle(),
+                /*output_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                num_tokens(),
+                num_cols(),
+                num_rows(),
+                epsilon()),
+            "gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_matmul");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const gptoss_bfloat16* gain_ptr = static_cast<const gptoss_bfloat16*>(gain_buffer.ptr());
+        const gptoss_bfloat16* weight_ptr = static_cast<const gptoss_bfloat16*>(weight_buffer.ptr());
+        const gptoss_bfloat16* bias_ptr = static_cast<const gptoss_bfloat16*>(bias_buffer.ptr());
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        for (size_t t = 0; t < num_tokens(); t++) {
+            double sumsq = 0.0;
+            for (size_t c = 0; c < num_cols(); c++) {
+                const double input_value = upcast<double>(input_ptr[t * num_cols() + c]);
+                sumsq = std::fma(input_value, input_value, sumsq);
+            }
+            const double scale = 1.0 / std::sqrt(sumsq / static_cast<double>(num_cols()) + static_cast<double>(epsilon()));
+            for (size_t r = 0; r < num_rows(); r++) {
+                double ref_sum = 0.0;
+                for (size_t c = 0; c < num_cols(); c++) {
+                    const double ref_weight = upcast<double>(weight_ptr[r * num_cols() + c]);
+                    const double ref_gain = upcast<double>(gain_ptr[c]);
+                    const double input_value = upcast<double>(input_ptr[t * num_cols() + c]);
+                    ref_sum = std::fma(input_value * scale * ref_gain, ref_weight, ref_sum);
+                }
+                ref_sum += upcast<double>(bias_ptr[r]);
+                ASSERT_NEAR(upcast<double>(output_ptr[t * num_rows() + r]), ref_sum, std::abs(ref_sum) * 1.0e-5)
+                    << "token " << t;
+            }
+        }
+    }
+
+    // Unembedding with bf16 weights: no bias, and the argmax of the outputs of each token is reduced alongside.
+    void TestF32_BF16W_Unembedding() const {
+        Validate(/*vec_size=*/4);
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        metal::Buffer input_buffer{device_, num_tokens() * num_cols() * sizeof(float)};
+        metal::Buffer weight_buffer{device_, num_rows() * num_cols() * sizeof(gptoss_bfloat16)};
+        metal::Buffer output_buffer{device_, num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer argmax_buffer{device_, num_tokens() * sizeof(std::uint64_t)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        metal::Buffer mask_buffer{device_, std::max<std::size_t>(num_token_states() * num_mask_words(), 1) * sizeof(std::uint32_t)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        std::memset(argmax_buffer.ptr(), 0xFF, num_tokens() * sizeof(std::uint64_t));
+        FillTokenMasks(mask_buffer, control_buffer);
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_tokens() * num_cols(), kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/weight_buffer,
+            /*output_offset=*/0,
+            num_rows() * num_cols(), kSeed + 1, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
+                command_buffer.handle(),
+                f32_bf16w_unembedding_fn_.handle(),
+                dense() ? f32_bf16w_dense_unembedding_fn_.handle() : nullptr,
+                /*threadgroup_size=*/threadgroup_size(),
+                /*max_threadgroups=*/kUnembeddingMaxThreadgroups,
+                input_buffer.handle(),
+                /*input_offset=*/0,
+                weight_buffer.handle(),
+                /*weight_offset=*/0,
+                output_buffer.handle(),
+                /*output_offset=*/0,
+                argmax_buffer.handle(),
+                /*argmax_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                /*mask_buffer=*/num_token_states() != 0 ? mask_buffer.handle() : nullptr,
+                /*mask_offset=*/0,
+                num_tokens(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const gptoss_bfloat16* weight_ptr = static_cast<const gptoss_bfloat16*>(weight_buffer.ptr());
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        const std::uint64_t* argmax_ptr = static_cast<const std::uint64_t*>(argmax_buffer.ptr());
+        for (size_t t = 0; t < num_tokens(); t++) {
+            double max_output = -INFINITY;
+            for (size_t r = 0; r < num_rows(); r++) {
+                if (!IsAllowed(mask_buffer, r)) {
+                    ASSERT_EQ(output_ptr[t * num_rows() + r], -INFINITY) << "token " << t << ", row " << r;
+                    continue;
+                }
+                double ref_sum = 0.0;
+                for (size_t c = 0; c < num_cols(); c++) {
+                    const double ref_weight = upcast<double>(weight_ptr[r * num_cols() + c]);
+                    const double input_value = upcast<double>(input_ptr[t * num_cols() + c]);
+                    ref_sum = std::fma(input_value, ref_weight, ref_sum);
+                }
+                const float output_value = output_ptr[t * num_rows() + r];
+                ASSERT_NEAR(upcast<double>(output_value), ref_sum, std::max(std::abs(ref_sum), 1.0) * 1.0e-5)
+                    << "token " << t << ", row " << r;
+                max_output = std::max(max_output, upcast<double>(output_value));
+            }
+            // The argmax is packed with the row index in the low 32 bits
+            const std::uint32_t argmax_row = static_cast<std::uint32_t>(argmax_ptr[t]);
+            ASSERT_LT(argmax_row, num_rows()) << "token " << t;
+            ASSERT_EQ(upcast<double>(output_ptr[t * num_rows() + argmax_row]), max_output) << "token " << t;
+        }
+    }
+
+    // Unembedding with int8 weights: each row of num_cols() int8 values is followed by its float scale.
+    void TestF32_I8W_Unembedding() const {
+        Validate(/*vec_size=*/4);
+
+        const std::size_t row_size = num_cols() * sizeof(std::int8_t) + sizeof(float);
+        metal::CommandBuffer command_buffer{command_queue_};
+        metal::Buffer input_buffer{device_, num_tokens() * num_cols() * sizeof(float)};
+        metal::Buffer weight_buffer{device_, num_rows() * row_size};
+        metal::Buffer output_buffer{device_, num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer argmax_buffer{device_, num_tokens() * sizeof(std::uint64_t)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        metal::Buffer mask_buffer{device_, std::max<std::size_t>(num_token_states() * num_mask_words(), 1) * sizeof(std::uint32_t)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        std::memset(argmax_buffer.ptr(), 0xFF, num_tokens() * sizeof(std::uint64_t));
+        FillTokenMasks(mask_buffer, control_buffer);
+
+        std::mt19937 rng(kSeed + 1);
+        std::uniform_int_distribution<int> weight_distribution(-127, 127);
+        std::uniform_real_distribution<float> scale_distribution(0.5f / 127.0f, 2.0f / 127.0f);
+        char* weight_ptr = static_cast<char*>(weight_buffer.ptr());
+        for (std::size_t r = 0; r < num_rows(); r++) {
+            std::int8_t* row_ptr = reinterpret_cast<std::int8_t*>(weight_ptr + r * row_size);
+            for (std::size_t c = 0; c < num_cols(); c++) {
+                row_ptr[c] = static_cast<std::int8_t>(weight_distribution(rng));
+            }
+            const float scale = scale_distribution(rng);
+            std::memcpy(row_ptr + num_cols(), &scale, sizeof(scale));
+        }
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_tokens() * num_cols(), kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_i8w_unembedding(
+                command_buffer.handle(),
+                f32_i8w_unembedding_fn_.handle(),
+                /*threadgroup_size=*/threadgroup_size(),
+                /*max_threadgroups=*/kUnembeddingMaxThreadgroups,
+                input_buffer.handle(),
+                /*input_offset=*/0,
+                weight_buffer.handle(),
+                /*weight_offset=*/0,
+                output_buffer.handle(),
+                /*output_offset=*/0,
+                argmax_buffer.handle(),
+                /*argmax_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                /*mask_buffer=*/num_token_states() != 0 ? mask_buffer.handle() : nullptr,
+                /*mask_offset=*/0,
+                num_tokens(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_i8w_unembedding");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        const std::uint64_t* argmax_ptr = static_cast<const std::uint64_t*>(argmax_buffer.ptr());
+        for (size_t t = 0; t < num_tokens(); t++) {
+            double max_output = -INFINITY;
+            for (size_t r = 0; r < num_rows(); r++) {
+                if (!IsAllowed(mask_buffer, r)) {
+                    ASSERT_EQ(output_ptr[t * num_rows() + r], -INFINITY) << "token " << t << ", row " << r;
+                    continue;
+                }
+                const std::int8_t* row_ptr = reinterpret_cast<const std::int8_t*>(weight_ptr + r * row_size);
+                float scale;
+                std::memcpy(&scale, row_ptr + num_cols(), sizeof(scale));
+                double ref_sum = 0.0;
+                for (size_t c = 0; c < num_cols(); c++) {
+                    const double input_value = upcast<double>(input_ptr[t * num_cols() + c]);
+                    ref_sum = std::fma(input_value, static_cast<double>(row_ptr[c]), ref_sum);
+                }
+                ref_sum *= static_cast<double>(scale);
+                const float output_value = output_ptr[t * num_rows() + r];
+                ASSERT_NEAR(upcast<double>(output_value), ref_sum, std::max(std::abs(ref_sum), 1.0) * 1.0e-5)
+                    << "token " << t << ", row " << r;
+                max_output = std::max(max_output, upcast<double>(output_value));
+            }
+            // The argmax is packed with the row index in the low 32 bits
+            const std::uint32_t argmax_row = static_cast<std::uint32_t>(argmax_ptr[t]);
+            ASSERT_LT(argmax_row, num_rows()) << "token " << t;
+            ASSERT_EQ(upcast<double>(output_ptr[t * num_rows() + argmax_row]), max_output) << "token " << t;
+        }
+    }
+
 private:
-    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
-    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+    // Fills the token masks with random bits, making sure that every state allows at least one token, and sets the
+    // current state in the control structure.
+    void FillTokenMasks(metal::Buffer& mask_buffer, metal::Buffer& control_buffer) const {
+        if (num_token_states() == 0) {
+            return;
+        }
+        std::mt19937 rng(kSeed + 2);
+        std::uint32_t* mask_ptr = static_cast<std::uint32_t*>(mask_buffer.ptr());
+        for (std::uint32_t s = 0; s < num_token_states(); s++) {
+            for (std::uint32_t w = 0; w < num_mask_words(); w++) {
+                mask_ptr[s * num_mask_words() + w] = static_cast<std::uint32_t>(rng());
+            }
+            const std::uint32_t allowed_row = s % num_rows();
+            mask_ptr[s * num_mask_words() + allowed_row / 32] |= UINT32_C(1) << (allowed_row % 32);
+        }
+        static_cast<gptoss_control*>(control_buffer.ptr())->token_state = token_state();
+    }
+
+    bool IsAllowed(const metal::Buffer& mask_buffer, std::size_t row) const {
+        if (num_token_states() == 0) {
+            return true;
+        }
+        const std::uint32_t* mask_ptr = static_cast<const std::uint32_t*>(mask_buffer.ptr()) + token_state() * num_mask_words();
+        return (mask_ptr[row / 32] & (UINT32_C(1) << (row % 32))) != 0;
+    }
+
+    static constexpr std::size_t kUnembeddingMaxThreadgroups = 16;
     static constexpr float fp4e2m1_to_fp32[16] = {
         +0.0f, +0.5f, +1.0f, +1.5f, +2.0f, +3.0f, +4.0f, +6.0f,
         -0.0f, -0.5f, -1.0f, -1.5f, -2.0f, -3.0f, -4.0f, -6.0f,
     };
 
-    metal::Device device_{};
-    metal::CommandQueue command_queue_{device_};
-    metal::Library library_{device_};
-    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
     metal::Function bf16_fill_random_fn_{library_, "gptoss_bf16_fill_random"};
     metal::Function f32_bf16w_matmul_fn_{library_, "gptoss_f32_bf16w_matmul"};
-    std::uint32_t num_tokens_{1};
-    std::uint32_t num_rows_{1};
-    std::uint32_t num_cols_{32};
+    metal::Function f32_bf16w_rmsnorm_matmul_fn_{library_, "gptoss_f32_bf16w_rmsnorm_matmul"};
+    metal::Function f32_bf16w_dense_matmul_fn_{library_, "gptoss_f32_bf16w_dense_matmul"};
+    metal::Function f32_bf16w_rmsnorm_dense_matmul_fn_{library_, "gptoss_f32_bf16w_rmsnorm_dense_matmul"};
+    metal::Function f32_bf16w_unembedding_fn_{library_, "gptoss_f32_bf16w_unembedding"};
+    metal::Function f32_bf16w_dense_unembedding_fn_{library_, "gptoss_f32_bf16w_dense_unembedding"};
+    metal::Function f32_i8w_unembedding_fn_{library_, "gptoss_f32_i8w_unembedding"};
     std::size_t threadgroup_size_{32};
+    float epsilon_{1.0e-5f};
+    bool dense_{false};
+    std::uint32_t num_token_states_{0};
+    std::uint32_t token_state_{0};
 };
 
 }  // namespace gptoss
@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <internal/model.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ModelAutotuneTest : public ModelTest {
+protected:
+    // Redirects the device cache, and with it the launch profiles, to a temporary directory for the test.
+    void SetUp() override {
+        ModelTest::SetUp();
+        if (IsSkipped()) {
+            return;
+        }
+        if (const char* cache_dir = std::getenv(kCacheDirVariable); cache_dir != nullptr) {
+            saved_cache_dir_ = cache_dir;
+        }
+        std::string cache_dir_template = (std::filesystem::temp_directory_path() / "gptoss-autotune-XXXXXX").string();
+        ASSERT_NE(mkdtemp(cache_dir_template.data()), nullptr);
+        cache_dir_ = cache_dir_template;
+        setenv(kCacheDirVariable, cache_dir_.c_str(), /*overwrite=*/1);
+    }
+
+    void TearDown() override {
+        if (cache_dir_.empty()) {
+            return;
+        }
+        if (saved_cache_dir_.has_value()) {
+            setenv(kCacheDirVariable, saved_cache_dir_->c_str(), /*overwrite=*/1);
+        } else {
+            unsetenv(kCacheDirVariable);
+        }
+        std::filesystem::remove_all(cache_dir_);
+    }
+
+    // Saved launch profiles in the cache directory of the test.
+    std::vector<std::filesystem::path> GetLaunchProfiles() const {
+        std::vector<std::filesystem::path> profiles;
+        for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(cache_dir_)) {
+            if (entry.path().filename().string().starts_with("launch-") && entry.path().extension() == ".bin") {
+                profiles.push_back(entry.path());
+            }
+        }
+        return profiles;
+    }
+
+    static Model CreateModel() {
+        gptoss_model_t model = nullptr;
+        gptoss::Check(gptoss_model_create_from_file(model_path(), &model, /*max_batch_tokens=*/0), "load Model");
+        return Model(model, gptoss_model_release);
+    }
+
+    static void ExpectSameLaunchParameters(const gptoss_model* model, const gptoss_model* expected_model) {
+        EXPECT_EQ(model->max_threadgroups, expected_model->max_threadgroups);
+        for (std::size_t s = 0; s < GPTOSS_LAUNCH_SHAPE_COUNT; s++) {
+            for (std::size_t k = 0; k < GPTOSS_LAUNCH_KERNEL_COUNT; k++) {
+                EXPECT_EQ(model->threadgroup_size[s][k], expected_model->threadgroup_size[s][k])
+                    << "shape " << s << ", kernel " << k;
+            }
+        }
+    }
+
+    static constexpr const char* kCacheDirVariable = "GPTOSS_PIPELINE_CACHE_DIR";
+    static constexpr std::size_t kNumTokens = 16;
+
+    std::string cache_dir_;
+    std::optional<std::string> saved_cache_dir_;
+};
+
+}  // namespace
+
+TEST_F(ModelAutotuneTest, preserves_output) {
+    Context reference_context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> expected_tokens = Sample(reference_context.get(), kNumTokens);
+    reference_context.reset();
+
+    ASSERT_EQ(gptoss_model_autotune(model()), gptoss_status_success);
+    Context context = CreateContext(kPrompt);
+    EXPECT_EQ(Sample(context.get(), kNumTokens), expected_tokens);
+}
+
+TEST_F(ModelAutotuneTest, saved_profile_is_loaded_by_same_model_shape) {
+    if (model()->library.hash == 0) {
+        GTEST_SKIP() << "launch profiles are not saved without a library hash";
+    }
+    ASSERT_EQ(gptoss_model_autotune(model()), gptoss_status_success);
+    EXPECT_EQ(GetLaunchProfiles().size(), 1);
+
+    const Model second_model = CreateModel();
+    ExpectSameLaunchParameters(second_model.get(), model());
+}
+
+TEST_F(ModelAutotuneTest, empty_cache_dir_skips_save) {
+    setenv(kCacheDirVariable, "", /*overwrite=*/1);
+    // Tuning still succeeds, and applies to the model only.
+    EXPECT_EQ(gptoss_model_autotune(model()), gptoss_status_success);
+    setenv(kCacheDirVariable, cache_dir_.c_str(), /*overwrite=*/1);
+    EXPECT_TRUE(GetLaunchProfiles().empty());
+}
@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ModelExpertResidencyTest : public ModelTest {
+protected:
+    static gptoss_model_stats GetStats(gptoss_model_t model) {
+        gptoss_model_stats stats;
+        gptoss::Check(gptoss_model_get_stats(model, &stats), "get Model stats");
+        return stats;
+    }
+
+    // Loads a second copy of the model which keeps about an eighth of its weights resident.
+    static Model CreateBudgetModel() {
+        const std::size_t expert_budget_bytes = GetStats(model()).weights_size / 8;
+        gptoss_model_t budget_model = nullptr;
+        gptoss::Check(gptoss_model_create_from_file_with_expert_budget(model_path(), &budget_model,
+                /*max_batch_tokens=*/0, expert_budget_bytes),
+            "load Model with expert budget");
+        return Model(budget_model, gptoss_model_release);
+    }
+};
+
+}  // namespace
+
+TEST_F(ModelExpertResidencyTest, without_budget_nothing_is_managed) {
+    EXPECT_EQ(GetStats(model()).num_resident_experts, 0);
+
+    std::size_t num_experts = 0;
+    EXPECT_EQ(gptoss_model_get_expert_residency_stats(model(), /*hits_out=*/nullptr, /*misses_out=*/nullptr,
+            /*max_experts=*/0, &num_experts),
+        gptoss_status_invalid_state);
+}
+
+TEST_F(ModelExpertResidencyTest, routings_split_into_hits_and_misses) {
+    Model budget_model = CreateBudgetModel();
+    Context context = CreateContext(budget_model.get(), kPrompt);
+    Sample(context.get(), /*max_tokens=*/32);
+
+    std::size_t num_experts = 0;
+    gptoss_model_get_expert_stats(budget_model.get(), /*num_selections_out=*/nullptr, /*max_experts=*/0, &num_experts);
+    std::vector<std::uint64_t> num_selections(num_experts);
+    gptoss::Check(gptoss_model_get_expert_stats(budget_model.get(), num_selections.data(), num_selections.size(),
+            &num_experts),
+        "get expert stats");
+    std::vector<std::uint64_t> hits(num_experts);
+    std::vector<std::uint64_t> misses(num_experts);
+    gptoss::Check(gptoss_model_get_expert_residency_stats(budget_model.get(), hits.data(), misses.data(), num_experts,
+            &num_experts),
+        "get expert residency stats");
+
+    // Every routing is counted once, either while the expert was resident or while it wasn't.
+    for (std::size_t i = 0; i < num_experts; i++) {
+        EXPECT_EQ(hits[i] + misses[i], num_selections[i]) << "expert #" << i;
+    }
+    // The budget doesn't fit every routed expert, so some routings miss.
+    EXPECT_GT(std::accumulate(misses.begin(), misses.end(), std::uint64_t{0}), 0);
+}
+
+TEST_F(ModelExpertResidencyTest, residency_stays_within_budget) {
+    Model budget_model = CreateBudgetModel();
+    Context context = CreateContext(budget_model.get(), kPrompt);
+    Sample(context.get(), /*max_tokens=*/64);
+
+    std::size_t num_experts = 0;
+    gptoss_model_get_expert_stats(budget_model.get(), /*num_selections_out=*/nullptr, /*max_experts=*/0, &num_experts);
+    std::vector<std::uint64_t> num_selections(num_experts);
+    gptoss::Check(gptoss_model_get_expert_stats(budget_model.get(), num_selections.data(), num_selections.size(),
+            &num_experts),
+        "get expert stats");
+    const std::size_t num_routed_experts = num_experts -
+        static_cast<std::size_t>(std::count(num_selections.begin(), num_selections.end(), std::uint64_t{0}));
+
+    // The budget covers about an eighth of the experts, so most of the routed experts were evicted or never admitted.
+    const std::size_t num_resident_experts = GetStats(budget_model.get()).num_resident_experts;
+    EXPECT_GT(num_resident_experts, 0);
+    EXPECT_LE(num_resident_experts, num_experts / 4);
+    EXPECT_LT(num_resident_experts, num_routed_experts);
+}
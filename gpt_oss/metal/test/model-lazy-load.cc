@@ -0,0 +1,51 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class ModelLazyLoadTest : public ModelTest {
+protected:
+    // Loads another copy of the model, which returns before its weights are resident.
+    static Model CreateLazyModel() {
+        gptoss_model_t lazy_model = nullptr;
+        gptoss::Check(gptoss_model_create_from_file_lazy(model_path(), &lazy_model, /*max_batch_tokens=*/0),
+            "lazily load Model");
+        return Model(lazy_model, gptoss_model_release);
+    }
+
+    static constexpr std::size_t kNumTokens = 16;
+};
+
+}  // namespace
+
+TEST_F(ModelLazyLoadTest, greedy_matches_eager_model) {
+    const Model lazy_model = CreateLazyModel();
+    // Process the prompt right away, while later blocks are likely still loading.
+    Context context = CreateContext(lazy_model.get(), kPrompt);
+    Context reference_context = CreateContext(kPrompt);
+    EXPECT_EQ(Sample(context.get(), kNumTokens), Sample(reference_context.get(), kNumTokens));
+}
+
+TEST_F(ModelLazyLoadTest, release_while_loading) {
+    // Releasing the model must stop the weight loader before unmapping the weights.
+    CreateLazyModel().reset();
+
+    // Contexts which retain the model keep it alive until they finish.
+    Model lazy_model = CreateLazyModel();
+    Context context = CreateContext(lazy_model.get());
+    lazy_model.reset();
+    gptoss::Check(gptoss_context_append_chars(context.get(), kPrompt, std::strlen(kPrompt), /*num_tokens_out=*/nullptr),
+        "append prompt");
+    gptoss::Check(gptoss_context_process(context.get()), "process prompt");
+    Context reference_context = CreateContext(kPrompt);
+    EXPECT_EQ(Sample(context.get(), kNumTokens), Sample(reference_context.get(), kNumTokens));
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include <gpt-oss.h>
+#include <internal/metal.hpp>
+
+
+namespace gptoss {
+
+// Base fixture for tests of the public API on a real model. The model is loaded once per test suite from the file in
+// the GPT_OSS_20B_PATH environment variable, and tests are skipped if the variable is not set.
+class ModelTest : public ::testing::Test {
+public:
+    using Model = std::unique_ptr<std::remove_pointer_t<gptoss_model_t>, decltype(&gptoss_model_release)>;
+    using Context = std::unique_ptr<std::remove_pointer_t<gptoss_context_t>, decltype(&gptoss_context_release)>;
+
+    static void SetUpTestSuite() {
+        if (model_path() != nullptr) {
+            Check(gptoss_model_create_from_file(model_path(), &model_, /*max_batch_tokens=*/0), "load Model");
+        }
+    }
+
+    static void TearDownTestSuite() {
+        gptoss_model_release(model_);
+        model_ = nullptr;
+    }
+
+protected:
+    void SetUp() override {
+        if (model_ == nullptr) {
+            GTEST_SKIP() << "environment variable GPT_OSS_20B_PATH is not set";
+        }
+    }
+
+    static gptoss_model_t model() {
+        return model_;
+    }
+
+    // Path to the file of the model, for tests which load more copies of it.
+    static const char* model_path() {
+        return std::getenv("GPT_OSS_20B_PATH");
+    }
+
+    static Context CreateContext(std::size_t context_length = kContextLength) {
+        return CreateContext(model_, context_length);
+    }
+
+    static Context CreateContext(gptoss_model_t model, std::size_t context_length = kContextLength) {
+        gptoss_context_t context = nullptr;
+        Check(gptoss_context_create(model, context_length, &context), "create Context");
+        return Context(context, gptoss_context_release);
+    }
+
+    // Creates a Context with the prompt appended and processed.
+    static Context CreateContext(const char* prompt, std::size_t context_length = kContextLength) {
+        return CreateContext(model_, prompt, context_length);
+    }
+
+    static Context CreateContext(gptoss_model_t model, const char* prompt, std::size_t context_length = kContextLength) {
+        Context context = CreateContext(model, context_length);
+        Check(gptoss_context_append_chars(context.get(), prompt, std::strlen(prompt), /*num_tokens_out=*/nullptr),
+            "append prompt");
+        Check(gptoss_context_process(context.get()), "process prompt");
+        return context;
+    }
+
+    static std::vector<std::uint32_t> GetTokens(gptoss_context_t context) {
+        std::size_t num_tokens = 0;
+        Check(gptoss_context_get_num_tokens(context, &num_tokens), "get number of tokens");
+        std::vector<std::uint32_t> tokens(num_tokens);
+        Check(gptoss_context_get_tokens(context, tokens.data(), tokens.size(), &num_tokens), "get tokens");
+        return tokens;
+    }
+
+    // Number of text and special tokens in the vocabulary of the model.
+    static std::uint32_t GetNumVocabularyTokens() {
+        gptoss_tokenizer_t tokenizer = nullptr;
+        Check(gptoss_model_get_tokenizer(model_, &tokenizer), "get Tokenizer");
+        std::uint32_t num_tokens = 0;
+        const gptoss_status status = gptoss_tokenizer_get_num_tokens(tokenizer, &num_tokens);
+        gptoss_tokenizer_release(tokenizer);
+        Check(status, "get number of tokens");
+        return num_tokens;
+    }
+
+    static std::vector<std::uint32_t> Sample(
+        gptoss_context_t context,
+        std::size_t max_tokens,
+        float temperature = 0.0f,
+        std::uint64_t seed = 0)
+    {
+        std::vector<std::uint32_t> tokens(max_tokens);
+        std::size_t num_tokens = 0;
+        Check(gptoss_context_sample(context, temperature, seed, max_tokens, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr,
+                tokens.data(), &num_tokens),
+            "sample tokens");
+        tokens.resize(num_tokens);
+        return tokens;
+    }
+
+    static constexpr std::size_t kContextLength = 4096;
+    static constexpr const char* kPrompt = "The quick brown fox jumps over the lazy dog. Once upon a time";
+
+private:
+    static inline gptoss_model_t model_{nullptr};
+};
+
+}  // namespace gptoss
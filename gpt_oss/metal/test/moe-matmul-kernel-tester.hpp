@@ -0,0 +1,523 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include <internal/datatype.hpp>
+#include <internal/kernel-args.h>
+#include <internal/math.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include "matmul-kernel-tester.hpp"
+
+
+namespace gptoss {
+
+// Validates the grouped (per-expert GEMM) MoE matmul kernels and the fused MoE output projection and accumulation
+// against the per-token MoE matmul kernels.
+class MoEMatMulKernelTester : public MatMulKernelTesterBase<MoEMatMulKernelTester> {
+public:
+    [[nodiscard]]
+    MoEMatMulKernelTester& num_experts(std::uint32_t num_experts) {
+        num_experts_ = num_experts;
+        return *this;
+    }
+
+    std::uint32_t num_experts() const {
+        return num_experts_;
+    }
+
+    [[nodiscard]]
+    MoEMatMulKernelTester& num_active_experts(std::uint32_t num_active_experts) {
+        num_active_experts_ = num_active_experts;
+        return *this;
+    }
+
+    std::uint32_t num_active_experts() const {
+        return num_active_experts_;
+    }
+
+    // Runs the grouped and fused kernels on weights in the tiled layout; the per-token reference kernels read the
+    // row-major layout.
+    [[nodiscard]]
+    MoEMatMulKernelTester& tiled(bool tiled) {
+        tiled_ = tiled;
+        return *this;
+    }
+
+    bool tiled() const {
+        return tiled_;
+    }
+
+    // Runs the grouped kernels with half-precision SwiGLU activations: the SwiGLU kernel writes halves, and the output
+    // projection kernel reads halves (rounded from the same inputs the per-token reference kernels read).
+    [[nodiscard]]
+    MoEMatMulKernelTester& half_activations(bool half_activations) {
+        half_activations_ = half_activations;
+        return *this;
+    }
+
+    bool half_activations() const {
+        return half_activations_;
+    }
+
+    void Validate(std::uint32_t num_weight_rows) const {
+        ASSERT_NE(num_rows(), 0);
+        ASSERT_EQ(num_weight_rows % 32, 0);
+        ASSERT_NE(num_cols(), 0);
+        ASSERT_EQ(num_cols() % 32, 0);
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_NE(num_active_experts(), 0);
+        ASSERT_LE(num_active_experts(), GPTOSS_MAX_ACTIVE_EXPERTS);
+        ASSERT_GE(num_experts(), num_active_experts());
+        ASSERT_LE(num_experts(), GPTOSS_EXPERT_ROUTE_MAX_EXPERTS);
+    }
+
+    void TestF32_MF4W_SwiGLU() const {
+        Validate(/*num_weight_rows=*/2 * num_rows());
+
+        // Weight rows interleave the swish and linear parts of each output channel
+        const Weights weights{device_, num_experts(), 2 * num_rows(), num_cols()};
+        const std::optional<Weights> tiled_weights = tiled() ? std::optional<Weights>{weights.Tile(device_)} : std::nullopt;
+        const Weights& grouped_weights = tiled() ? *tiled_weights : weights;
+        metal::Buffer input_buffer{device_, num_tokens() * num_cols() * sizeof(float)};
+        metal::Buffer output_buffer{device_, num_active_experts() * num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer ref_output_buffer{device_, num_active_experts() * num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer expert_buffer{device_, num_tokens() * num_active_experts() * sizeof(gptoss_expert_prediction)};
+        metal::Buffer route_buffer{device_, RouteBufferSize()};
+        const metal::Function& dense_matmul_swiglu_fn = half_activations() ?
+            (tiled() ? tiled_f16_mf4w_moe_dense_matmul_swiglu_fn_ : f16_mf4w_moe_dense_matmul_swiglu_fn_) :
+            (tiled() ? tiled_f32_mf4w_moe_dense_matmul_swiglu_fn_ : f32_mf4w_moe_dense_matmul_swiglu_fn_);
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        FillExperts(expert_buffer);
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_tokens() * num_cols(), kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
+                command_buffer.handle(),
+                f32_mf4w_moe_matmul_swiglu_fn_.handle(),
+                /*threadgroup_size=*/64,
+                input_buffer.handle(), /*input_offset=*/0,
+                expert_buffer.handle(), /*expert_offset=*/0,
+                weights.buffer.handle(), /*weight_block_offset=*/0,
+                weights.buffer.handle(), weights.scale_offset,
+                weights.buffer.handle(), weights.bias_offset,
+                ref_output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                kSwiGLULimit,
+                weights.expert_stride,
+                num_tokens(),
+                num_active_experts(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu");
+
+        EncodeRoute(command_buffer, expert_buffer, route_buffer, control_buffer);
+        Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul_swiglu(
+                command_buffer.handle(),
+                dense_matmul_swiglu_fn.handle(),
+                input_buffer.handle(), /*input_offset=*/0,
+                route_buffer.handle(), /*expert_offsets_offset=*/0,
+                route_buffer.handle(), AssignmentOffset(),
+                grouped_weights.buffer.handle(), /*weight_block_offset=*/0,
+                grouped_weights.buffer.handle(), grouped_weights.scale_offset,
+                grouped_weights.buffer.handle(), grouped_weights.bias_offset,
+                output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                kSwiGLULimit,
+                grouped_weights.expert_stride,
+                num_tokens(),
+                num_experts(),
+                num_active_experts(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul_swiglu");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        if (half_activations()) {
+            CompareHalfOutputs(output_buffer, ref_output_buffer, num_rows());
+        } else {
+            CompareOutputs(output_buffer, ref_output_buffer, num_rows());
+        }
+    }
+
+    void TestF32_MF4W() const {
+        Validate(/*num_weight_rows=*/num_rows());
+
+        const Weights weights{device_, num_experts(), num_rows(), num_cols()};
+        const std::optional<Weights> tiled_weights = tiled() ? std::optional<Weights>{weights.Tile(device_)} : std::nullopt;
+        const Weights& grouped_weights = tiled() ? *tiled_weights : weights;
+        const std::size_t num_inputs = num_active_experts() * num_tokens() * num_cols();
+        metal::Buffer input_buffer{device_, num_inputs * sizeof(float)};
+        metal::Buffer half_input_buffer{device_, num_inputs * sizeof(gptoss_float16)};
+        metal::Buffer output_buffer{device_, num_active_experts() * num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer ref_output_buffer{device_, num_active_experts() * num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer expert_buffer{device_, num_tokens() * num_active_experts() * sizeof(gptoss_expert_prediction)};
+        metal::Buffer route_buffer{device_, RouteBufferSize()};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        FillExperts(expert_buffer);
+
+        metal::CommandBuffer fill_command_buffer{command_queue_};
+        fill_command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_inputs, kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+        fill_command_buffer.commit();
+        fill_command_buffer.wait_completion();
+        if (half_activations()) {
+            // Round the inputs to half precision, so that the reference kernel reads the same values
+            float* input_ptr = static_cast<float*>(input_buffer.ptr());
+            gptoss_float16* half_input_ptr = static_cast<gptoss_float16*>(half_input_buffer.ptr());
+            for (std::size_t i = 0; i < num_inputs; i++) {
+                half_input_ptr[i].bits = std::bit_cast<std::uint16_t>(static_cast<_Float16>(input_ptr[i]));
+                input_ptr[i] = upcast<float>(half_input_ptr[i]);
+            }
+        }
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
+                command_buffer.handle(),
+                f32_mf4w_moe_matmul_fn_.handle(),
+                /*threadgroup_size=*/64,
+                input_buffer.handle(), /*input_offset=*/0,
+                expert_buffer.handle(), /*expert_offset=*/0,
+                weights.buffer.handle(), /*weight_block_offset=*/0,
+                weights.buffer.handle(), weights.scale_offset,
+                weights.buffer.handle(), weights.bias_offset,
+                ref_output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                weights.expert_stride,
+                num_tokens(),
+                num_active_experts(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul");
+
+        EncodeRoute(command_buffer, expert_buffer, route_buffer, control_buffer);
+        Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul(
+                command_buffer.handle(),
+                (half_activations() ?
+                    (tiled() ? tiled_f16_mf4w_moe_dense_matmul_fn_ : f16_mf4w_moe_dense_matmul_fn_) :
+                    (tiled() ? tiled_f32_mf4w_moe_dense_matmul_fn_ : f32_mf4w_moe_dense_matmul_fn_)).handle(),
+                (half_activations() ? half_input_buffer : input_buffer).handle(), /*input_offset=*/0,
+                route_buffer.handle(), /*expert_offsets_offset=*/0,
+                route_buffer.handle(), AssignmentOffset(),
+                grouped_weights.buffer.handle(), /*weight_block_offset=*/0,
+                grouped_weights.buffer.handle(), grouped_weights.scale_offset,
+                grouped_weights.buffer.handle(), grouped_weights.bias_offset,
+                output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                grouped_weights.expert_stride,
+                num_tokens(),
+                num_experts(),
+                num_active_experts(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_dense_matmul");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        CompareOutputs(output_buffer, ref_output_buffer, num_rows());
+    }
+
+    void TestF32_MF4W_Accumulate() const {
+        Validate(/*num_weight_rows=*/num_rows());
+
+        const Weights weights{device_, num_experts(), num_rows(), num_cols()};
+        const std::optional<Weights> tiled_weights = tiled() ? std::optional<Weights>{weights.Tile(device_)} : std::nullopt;
+        const Weights& fused_weights = tiled() ? *tiled_weights : weights;
+        metal::Buffer input_buffer{device_, num_active_experts() * num_tokens() * num_cols() * sizeof(float)};
+        metal::Buffer expert_output_buffer{device_, num_active_experts() * num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer output_buffer{device_, num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer ref_output_buffer{device_, num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer expert_buffer{device_, num_tokens() * num_active_experts() * sizeof(gptoss_expert_prediction)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        FillExperts(expert_buffer);
+        const metal::Function f32_accumulate_fn{library_, "gptoss_f32_accumulate",
+            {{GPTOSS_FUNCTION_CONSTANT_NUM_EXPERTS, num_experts()}, {GPTOSS_FUNCTION_CONSTANT_NUM_ACTIVE_EXPERTS, num_active_experts()}}};
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer,
+            /*output_offset=*/0,
+            num_active_experts() * num_tokens() * num_cols(), kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+        // The output starts as a residual stream to accumulate into
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/output_buffer,
+            /*output_offset=*/0,
+            num_tokens() * num_rows(), kSeed + 1, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/ref_output_buffer,
+            /*output_offset=*/0,
+            num_tokens() * num_rows(), kSeed + 1, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
+                command_buffer.handle(),
+                f32_mf4w_moe_matmul_fn_.handle(),
+                /*threadgroup_size=*/64,
+                input_buffer.handle(), /*input_offset=*/0,
+                expert_buffer.handle(), /*expert_offset=*/0,
+                weights.buffer.handle(), /*weight_block_offset=*/0,
+                weights.buffer.handle(), weights.scale_offset,
+                weights.buffer.handle(), weights.bias_offset,
+                expert_output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                weights.expert_stride,
+                num_tokens(),
+                num_active_experts(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul");
+        Check(gptoss_metal_command_buffer_encode_launch_f32_accumulate(
+                command_buffer.handle(),
+                f32_accumulate_fn.handle(),
+                /*threadgroup_size=*/256,
+                /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+                expert_output_buffer.handle(), /*input_offset=*/0,
+                expert_buffer.handle(), /*expert_offset=*/0,
+                ref_output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                num_rows(),
+                num_tokens(),
+                num_active_experts()),
+            "gptoss_metal_command_buffer_encode_launch_f32_accumulate");
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_accumulate(
+                command_buffer.handle(),
+                (tiled() ? tiled_f32_mf4w_moe_matmul_accumulate_fn_ : f32_mf4w_moe_matmul_accumulate_fn_).handle(),
+                /*threadgroup_size=*/64,
+                input_buffer.handle(), /*input_offset=*/0,
+                expert_buffer.handle(), /*expert_offset=*/0,
+                fused_weights.buffer.handle(), /*weight_block_offset=*/0,
+                fused_weights.buffer.handle(), fused_weights.scale_offset,
+                fused_weights.buffer.handle(), fused_weights.bias_offset,
+                output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                fused_weights.expert_stride,
+                num_tokens(),
+                num_active_experts(),
+                num_cols(),
+                num_rows()),
+            "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_accumulate");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        const float* ref_output_ptr = static_cast<const float*>(ref_output_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            for (std::uint32_t r = 0; r < num_rows(); r++) {
+                const std::size_t idx = t * num_rows() + r;
+                const double ref_value = static_cast<double>(ref_output_ptr[idx]);
+                ASSERT_NEAR(static_cast<double>(output_ptr[idx]), ref_value, std::max(std::abs(ref_value), 1.0) * 1.0e-4)
+                    << "at token " << t << ", output " << r;
+            }
+        }
+    }
+
+private:
+    // Per-expert MXFP4 weight blocks, block scales, and bf16 biases, laid out like an MoE block of the model file.
+    struct Weights {
+        Weights(const metal::Device& device, std::uint32_t num_experts, std::uint32_t num_rows, std::uint32_t num_cols) :
+            num_experts(num_experts),
+            num_rows(num_rows),
+            num_column_vecs(num_cols / 32),
+            scale_offset(num_rows * (num_cols / 32) * 16),
+            bias_offset(scale_offset + num_rows * (num_cols / 32)),
+            expert_stride(math_round_up_po2(bias_offset + num_rows * sizeof(gptoss_bfloat16), 16)),
+            buffer(device, num_experts * expert_stride)
+        {
+            std::mt19937 rng(kSeed);
+            std::uniform_int_distribution<int> byte_distribution(0, 255);
+            // Block scales are biased by 14 in the model file; keep the weights within a few powers of 2 of 1.0
+            std::uniform_int_distribution<int> scale_distribution(127 + 14 - 2, 127 + 14);
+            // bf16 biases in [-1.0, 1.0): exponents 0x3F00 or 0xBF00 plus any 7-bit mantissa, i.e. [0.5, 1.0) of either sign
+            std::uniform_int_distribution<int> bias_distribution(0, 255);
+            char* ptr = static_cast<char*>(buffer.ptr());
+            for (std::uint32_t e = 0; e < num_experts; e++) {
+                char* expert_ptr = ptr + e * expert_stride;
+                for (std::size_t i = 0; i < scale_offset; i++) {
+                    expert_ptr[i] = static_cast<char>(byte_distribution(rng));
+                }
+                for (std::size_t i = scale_offset; i < bias_offset; i++) {
+                    expert_ptr[i] = static_cast<char>(scale_distribution(rng));
+                }
+                gptoss_bfloat16* bias_ptr = reinterpret_cast<gptoss_bfloat16*>(expert_ptr + bias_offset);
+                for (std::uint32_t r = 0; r < num_rows; r++) {
+                    const int bias_bits = bias_distribution(rng);
+                    bias_ptr[r].bits = static_cast<std::uint16_t>((bias_bits & 0x80 ? 0xBF00 : 0x3F00) | (bias_bits & 0x7F));
+                }
+            }
+        }
+
+        // Copy of the weights in the tiled layout: for each group of 32 rows and each block column, the 16-byte blocks of
+        // the 32 rows followed by their 32 scales. Scales are addressed from the end of the first tile's blocks.
+        Weights Tile(const metal::Device& device) const {
+            Weights tiled{device, num_experts, num_rows, num_column_vecs * 32};
+            tiled.scale_offset = GPTOSS_MF4_TILE_ROWS * 16;
+
+            const char* src_ptr = static_cast<const char*>(buffer.ptr());
+            char* dst_ptr = static_cast<char*>(tiled.buffer.ptr());
+            for (std::uint32_t e = 0; e < num_experts; e++) {
+                const char* src_expert_ptr = src_ptr + e * expert_stride;
+                char* dst_expert_ptr = dst_ptr + e * expert_stride;
+                for (std::uint32_t r = 0; r < num_rows; r++) {
+                    for (std::uint32_t k = 0; k < num_column_vecs; k++) {
+                        char* tile_ptr = dst_expert_ptr + ((r / GPTOSS_MF4_TILE_ROWS) * num_column_vecs + k) * GPTOSS_MF4_TILE_SIZE;
+                        std::memcpy(tile_ptr + (r % GPTOSS_MF4_TILE_ROWS) * 16, src_expert_ptr + (r * num_column_vecs + k) * 16, 16);
+                        tile_ptr[GPTOSS_MF4_TILE_ROWS * 16 + r % GPTOSS_MF4_TILE_ROWS] = src_expert_ptr[scale_offset + r * num_column_vecs + k];
+                    }
+                }
+                std::memcpy(dst_expert_ptr + bias_offset, src_expert_ptr + bias_offset, expert_stride - bias_offset);
+            }
+            return tiled;
+        }
+
+        std::uint32_t num_experts;
+        std::uint32_t num_rows;
+        std::uint32_t num_column_vecs;
+        std::uint32_t scale_offset;
+        std::uint32_t bias_offset;
+        std::uint32_t expert_stride;
+        metal::Buffer buffer;
+    };
+
+    std::size_t AssignmentOffset() const {
+        return (num_experts() + 1) * sizeof(std::uint32_t);
+    }
+
+    std::size_t RouteBufferSize() const {
+        return AssignmentOffset() + num_tokens() * num_active_experts() * sizeof(std::uint32_t);
+    }
+
+    // Each token picks distinct experts, skewed towards low expert IDs so that groups span several tiles, with random
+    // scores.
+    void FillExperts(const metal::Buffer& expert_buffer) const {
+        std::mt19937 rng(kSeed + 1);
+        std::uniform_real_distribution<float> score_distribution(0.0f, 1.0f);
+        std::vector<std::uint32_t> experts(num_experts());
+        gptoss_expert_prediction* expert_ptr = static_cast<gptoss_expert_prediction*>(expert_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            std::iota(experts.begin(), experts.end(), 0);
+            std::shuffle(experts.begin() + num_active_experts() / 2, experts.end(), rng);
+            for (std::uint32_t k = 0; k < num_active_experts(); k++) {
+                expert_ptr[t * num_active_experts() + k] = gptoss_expert_prediction{
+                    .expert_id = experts[k],
+                    .score = score_distribution(rng),
+                };
+            }
+        }
+    }
+
+    void EncodeRoute(const metal::CommandBuffer& command_buffer, const metal::Buffer& expert_buffer,
+        const metal::Buffer& route_buffer, const metal::Buffer& control_buffer) const
+    {
+        Check(gptoss_metal_command_buffer_encode_launch_expert_route(
+                command_buffer.handle(),
+                expert_route_fn_.handle(),
+                expert_buffer.handle(), /*expert_offset=*/0,
+                route_buffer.handle(), /*expert_offsets_offset=*/0,
+                route_buffer.handle(), AssignmentOffset(),
+                control_buffer.handle(), /*control_offset=*/0,
+                num_tokens(),
+                num_experts(),
+                num_active_experts()),
+            "gptoss_metal_command_buffer_encode_launch_expert_route");
+    }
+
+    void CompareOutputs(const metal::Buffer& output_buffer, const metal::Buffer& ref_output_buffer, std::uint32_t num_outputs) const {
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        const float* ref_output_ptr = static_cast<const float*>(ref_output_buffer.ptr());
+        for (std::uint32_t k = 0; k < num_active_experts(); k++) {
+            for (std::uint32_t t = 0; t < num_tokens(); t++) {
+                for (std::uint32_t r = 0; r < num_outputs; r++) {
+                    const std::size_t idx = (k * num_tokens() + t) * num_outputs + r;
+                    const double ref_value = static_cast<double>(ref_output_ptr[idx]);
+                    ASSERT_NEAR(static_cast<double>(output_ptr[idx]), ref_value, std::max(std::abs(ref_value), 1.0) * 1.0e-4)
+                        << "at slot " << k << ", token " << t << ", output " << r;
+                }
+            }
+        }
+    }
+
+    // Compares half-precision outputs of the grouped kernels with single-precision reference outputs.
+    void CompareHalfOutputs(const metal::Buffer& output_buffer, const metal::Buffer& ref_output_buffer, std::uint32_t num_outputs) const {
+        const gptoss_float16* output_ptr = static_cast<const gptoss_float16*>(output_buffer.ptr());
+        const float* ref_output_ptr = static_cast<const float*>(ref_output_buffer.ptr());
+        for (std::uint32_t k = 0; k < num_active_experts(); k++) {
+            for (std::uint32_t t = 0; t < num_tokens(); t++) {
+                for (std::uint32_t r = 0; r < num_outputs; r++) {
+                    const std::size_t idx = (k * num_tokens() + t) * num_outputs + r;
+                    const double ref_value = static_cast<double>(ref_output_ptr[idx]);
+                    ASSERT_NEAR(upcast<double>(output_ptr[idx]), ref_value, std::max(std::abs(ref_value), 1.0) * 1.0e-3)
+                        << "at slot " << k << ", token " << t << ", output " << r;
+                }
+            }
+        }
+    }
+
+    static constexpr float kSwiGLULimit = 7.0f;
+
+    metal::Function f32_mf4w_moe_matmul_swiglu_fn_{library_, "gptoss_f32_mf4w_moe_matmul_swiglu"};
+    metal::Function f32_mf4w_moe_matmul_fn_{library_, "gptoss_f32_mf4w_moe_matmul"};
+    metal::Function expert_route_fn_{library_, "gptoss_expert_route"};
+    metal::Function f32_mf4w_moe_dense_matmul_swiglu_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul_swiglu"};
+    metal::Function f32_mf4w_moe_dense_matmul_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul"};
+    metal::Function tiled_f32_mf4w_moe_dense_matmul_swiglu_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul_swiglu",
+        {{GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT, GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED}}};
+    metal::Function tiled_f32_mf4w_moe_dense_matmul_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul",
+        {{GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT, GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED}}};
+    metal::Function f16_mf4w_moe_dense_matmul_swiglu_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul_swiglu",
+        {{GPTOSS_FUNCTION_CONSTANT_ACTIVATION_TYPE, GPTOSS_ACTIVATION_TYPE_F16}}};
+    metal::Function f16_mf4w_moe_dense_matmul_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul",
+        {{GPTOSS_FUNCTION_CONSTANT_ACTIVATION_TYPE, GPTOSS_ACTIVATION_TYPE_F16}}};
+    metal::Function tiled_f16_mf4w_moe_dense_matmul_swiglu_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul_swiglu",
+        {{GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT, GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED}, {GPTOSS_FUNCTION_CONSTANT_ACTIVATION_TYPE, GPTOSS_ACTIVATION_TYPE_F16}}};
+    metal::Function tiled_f16_mf4w_moe_dense_matmul_fn_{library_, "gptoss_f32_mf4w_moe_dense_matmul",
+        {{GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT, GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED}, {GPTOSS_FUNCTION_CONSTANT_ACTIVATION_TYPE, GPTOSS_ACTIVATION_TYPE_F16}}};
+    metal::Function f32_mf4w_moe_matmul_accumulate_fn_{library_, "gptoss_f32_mf4w_moe_matmul_accumulate"};
+    metal::Function tiled_f32_mf4w_moe_matmul_accumulate_fn_{library_, "gptoss_f32_mf4w_moe_matmul_accumulate",
+        {{GPTOSS_FUNCTION_CONSTANT_EXPERT_WEIGHT_LAYOUT, GPTOSS_EXPERT_WEIGHT_LAYOUT_TILED}}};
+    std::uint32_t num_experts_{32};
+    std::uint32_t num_active_experts_{4};
+    bool tiled_{false};
+    bool half_activations_{false};
+};
+
+}  // namespace gptoss
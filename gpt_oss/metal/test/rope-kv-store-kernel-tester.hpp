@@ -0,0 +1,298 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <internal/datatype.hpp>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+#include "kv-store-kernel-tester.hpp"
+
+
+namespace gptoss {
+
+// Validates the fused RoPE + KV cache store kernels against the separate gptoss_f32_rope and KV store kernels. With a
+// position shift, also validates the KV cache RoPE shift kernels: keys are stored for position t - position_shift,
+// then rotated by position_shift to match keys stored for position t.
+class RoPEKVStoreKernelTester : public KVStoreKernelTesterBase<RoPEKVStoreKernelTester> {
+public:
+    // Tokens before kv_token_offset are rotated, but their KV is not stored; KV of token t goes to slot of
+    // t - kv_token_offset.
+    [[nodiscard]]
+    RoPEKVStoreKernelTester& kv_token_offset(std::uint32_t kv_token_offset) {
+        kv_token_offset_ = kv_token_offset;
+        return *this;
+    }
+
+    std::uint32_t kv_token_offset() const {
+        return kv_token_offset_;
+    }
+
+    [[nodiscard]]
+    RoPEKVStoreKernelTester& frequency_base(float frequency_base) {
+        frequency_base_ = frequency_base;
+        return *this;
+    }
+
+    float frequency_base() const {
+        return frequency_base_;
+    }
+
+    [[nodiscard]]
+    RoPEKVStoreKernelTester& position_shift(std::int32_t position_shift) {
+        position_shift_ = position_shift;
+        return *this;
+    }
+
+    std::int32_t position_shift() const {
+        return position_shift_;
+    }
+
+    void Validate() const {
+        ASSERT_EQ(head_dim(), 64);
+        ASSERT_NE(num_q_heads(), 0);
+        ASSERT_NE(num_kv_heads(), 0);
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_NE(kv_capacity(), 0);
+        ASSERT_LE(kv_token_offset(), token_offset() + num_tokens());
+        if (paged()) {
+            ASSERT_EQ(kv_capacity() % GPTOSS_KVCACHE_PAGE_TOKENS, 0);
+            ASSERT_LE(token_offset() + num_tokens() - kv_token_offset(), kv_capacity());
+        }
+        ASSERT_GE(static_cast<std::int64_t>(kv_token_offset()), static_cast<std::int64_t>(position_shift()));
+    }
+
+    void TestF32() const {
+        Validate();
+
+        const std::size_t head_size = head_dim() * sizeof(float);
+        metal::Buffer kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+        metal::Buffer ref_kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+        Run(f32_rope_kv_store_fn_, f32_kv_store_fn_, kv_rope_shift_fn_, kvcache_buffer, ref_kvcache_buffer);
+        // Rotating twice rounds the rotation angles twice.
+        const double shift_tolerance = position_shift() != 0 ? 1.0e-4 : 0.0;
+
+        const char* kvcache_ptr = static_cast<const char*>(kvcache_buffer.ptr());
+        const char* ref_kvcache_ptr = static_cast<const char*>(ref_kvcache_buffer.ptr());
+        for (std::uint32_t s = 0; s < kv_capacity(); s++) {
+            for (std::uint32_t h = 0; h < 2 * num_kv_heads(); h++) {
+                const float* head = reinterpret_cast<const float*>(kvcache_ptr + (s * 2 * num_kv_heads() + h) * head_size);
+                const float* ref_head = reinterpret_cast<const float*>(ref_kvcache_ptr + (s * 2 * num_kv_heads() + h) * head_size);
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    const double ref_value = static_cast<double>(ref_head[d]);
+                    ASSERT_NEAR(static_cast<double>(head[d]), ref_value, std::abs(ref_value) * 1.0e-5 + shift_tolerance)
+                        << "at slot " << s << ", head " << h << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+    void TestBF16() const {
+        Validate();
+
+        const std::size_t head_size = head_dim() * sizeof(gptoss_bfloat16);
+        metal::Buffer kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+        metal::Buffer ref_kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+        Run(f32_rope_bf16kv_store_fn_, f32_bf16kv_store_fn_, bf16kv_rope_shift_fn_, kvcache_buffer, ref_kvcache_buffer);
+        // Shifted keys are rounded to bfloat16 twice, and the rounding error of one element spreads to its pair.
+        const double shift_tolerance = position_shift() != 0 ? 0x1.0p-7 : 0.0;
+
+        const char* kvcache_ptr = static_cast<const char*>(kvcache_buffer.ptr());
+        const char* ref_kvcache_ptr = static_cast<const char*>(ref_kvcache_buffer.ptr());
+        for (std::uint32_t s = 0; s < kv_capacity(); s++) {
+            for (std::uint32_t h = 0; h < 2 * num_kv_heads(); h++) {
+                const gptoss_bfloat16* head = reinterpret_cast<const gptoss_bfloat16*>(kvcache_ptr + (s * 2 * num_kv_heads() + h) * head_size);
+                const gptoss_bfloat16* ref_head = reinterpret_cast<const gptoss_bfloat16*>(ref_kvcache_ptr + (s * 2 * num_kv_heads() + h) * head_size);
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    const double ref_value = upcast<double>(ref_head[d]);
+                    ASSERT_NEAR(upcast<double>(head[d]), ref_value, std::abs(ref_value) * 0x1.0p-7 + shift_tolerance)
+                        << "at slot " << s << ", head " << h << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+    void TestI8() const {
+        Validate();
+
+        const std::size_t head_size = head_dim() * sizeof(std::int8_t) + sizeof(float);
+        metal::Buffer kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+        metal::Buffer ref_kvcache_buffer{device_, kv_capacity() * 2 * num_kv_heads() * head_size};
+        Run(f32_rope_i8kv_store_fn_, f32_i8kv_store_fn_, i8kv_rope_shift_fn_, kvcache_buffer, ref_kvcache_buffer);
+        // Shifted keys are quantized twice, so their max-abs, and thus the scale, may be off by one quantization step.
+        const bool shifted = position_shift() != 0;
+        const double scale_tolerance = shifted ? 2.0e-2 : 1.0e-5;
+        const double value_tolerance = shifted ? 2.0 : 1.0;
+
+        const char* kvcache_ptr = static_cast<const char*>(kvcache_buffer.ptr());
+        const char* ref_kvcache_ptr = static_cast<const char*>(ref_kvcache_buffer.ptr());
+        for (std::uint32_t s = 0; s < kv_capacity(); s++) {
+            for (std::uint32_t h = 0; h < 2 * num_kv_heads(); h++) {
+                const char* head = kvcache_ptr + (s * 2 * num_kv_heads() + h) * head_size;
+                const char* ref_head = ref_kvcache_ptr + (s * 2 * num_kv_heads() + h) * head_size;
+                float scale, ref_scale;
+                std::memcpy(&scale, head + head_dim() * sizeof(std::int8_t), sizeof(float));
+                std::memcpy(&ref_scale, ref_head + head_dim() * sizeof(std::int8_t), sizeof(float));
+                ASSERT_NEAR(static_cast<double>(scale), static_cast<double>(ref_scale), std::abs(ref_scale) * scale_tolerance)
+                    << "at slot " << s << ", head " << h;
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    const double value = static_cast<double>(static_cast<std::int8_t>(head[d])) * static_cast<double>(scale);
+                    const double ref_value = static_cast<double>(static_cast<std::int8_t>(ref_head[d])) * static_cast<double>(ref_scale);
+                    // Allow a rounding flip of one quantization step (two for shifted keys).
+                    ASSERT_NEAR(value, ref_value, static_cast<double>(ref_scale) * (value_tolerance + scale_tolerance))
+                        << "at slot " << s << ", head " << h << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+private:
+    void Run(const metal::Function& rope_kv_store_fn, const metal::Function& kv_store_fn,
+        const metal::Function& kv_rope_shift_fn, const metal::Buffer& kvcache_buffer,
+        const metal::Buffer& ref_kvcache_buffer) const
+    {
+        const std::size_t activations_size = num_tokens() * num_qkv_heads() * head_dim() * sizeof(float);
+        metal::Buffer activations_buffer{device_, activations_size};
+        metal::Buffer ref_activations_buffer{device_, activations_size};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        std::memset(kvcache_buffer.ptr(), 0, kvcache_buffer.size());
+        std::memset(ref_kvcache_buffer.ptr(), 0, ref_kvcache_buffer.size());
+
+        const metal::Buffer page_table_buffer = CreatePageTable();
+
+        metal::CommandBuffer command_buffer{command_queue_};
+
+        EncodeFillQKV(command_buffer, activations_buffer);
+        EncodeFillQKV(command_buffer, ref_activations_buffer);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_rope_kv_store(
+                command_buffer.handle(),
+                rope_kv_store_fn.handle(),
+                activations_buffer.handle(),
+                /*activations_offset=*/0,
+                kvcache_buffer.handle(),
+                /*kvcache_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                paged() ? page_table_buffer.handle() : nullptr,
+                /*page_table_offset=*/0,
+                frequency_base(),
+                /*interpolation_scale=*/1.0f,
+                /*yarn_offset=*/0.0f,
+                /*yarn_scale=*/1.0f,
+                /*yarn_multiplier=*/1.0f,
+                num_tokens(),
+                num_q_heads(),
+                num_kv_heads(),
+                head_dim(),
+                /*token_offset=*/token_offset() - position_shift(),
+                /*kv_token_offset=*/kv_token_offset() - position_shift(),
+                kv_capacity()),
+            "gptoss_metal_command_buffer_encode_launch_f32_rope_kv_store");
+
+        const std::uint32_t num_skipped_tokens = kv_token_offset() - std::min(kv_token_offset(), token_offset());
+        if (position_shift() != 0 && num_skipped_tokens < num_tokens()) {
+            Check(gptoss_metal_command_buffer_encode_launch_kv_rope_shift(
+                    command_buffer.handle(),
+                    kv_rope_shift_fn.handle(),
+                    kvcache_buffer.handle(),
+                    /*kvcache_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    paged() ? page_table_buffer.handle() : nullptr,
+                    /*page_table_offset=*/0,
+                    frequency_base(),
+                    /*interpolation_scale=*/1.0f,
+                    /*yarn_offset=*/0.0f,
+                    /*yarn_scale=*/1.0f,
+                    num_tokens() - num_skipped_tokens,
+                    num_kv_heads(),
+                    head_dim(),
+                    /*token_offset=*/token_offset() + num_skipped_tokens - kv_token_offset(),
+                    position_shift(),
+                    kv_capacity()),
+                "gptoss_metal_command_buffer_encode_launch_kv_rope_shift");
+        }
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_rope(
+                command_buffer.handle(),
+                f32_rope_fn_.handle(),
+                /*threadgroup_size=*/32,
+                ref_activations_buffer.handle(),
+                /*activations_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                frequency_base(),
+                /*interpolation_scale=*/1.0f,
+                /*yarn_offset=*/0.0f,
+                /*yarn_scale=*/1.0f,
+                /*yarn_multiplier=*/1.0f,
+                num_tokens(),
+                num_q_heads(),
+                num_kv_heads(),
+                head_dim(),
+                token_offset()),
+            "gptoss_metal_command_buffer_encode_launch_f32_rope");
+
+        if (num_skipped_tokens < num_tokens()) {
+            Check(gptoss_metal_command_buffer_encode_launch_f32_kv_store(
+                    command_buffer.handle(),
+                    kv_store_fn.handle(),
+                    ref_activations_buffer.handle(),
+                    /*input_offset=*/(num_skipped_tokens * num_qkv_heads() + num_q_heads()) * head_dim() * sizeof(float),
+                    ref_kvcache_buffer.handle(),
+                    /*kvcache_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    paged() ? page_table_buffer.handle() : nullptr,
+                    /*page_table_offset=*/0,
+                    num_tokens() - num_skipped_tokens,
+                    num_q_heads(),
+                    num_kv_heads(),
+                    head_dim(),
+                    token_offset() + num_skipped_tokens - kv_token_offset(),
+                    kv_capacity()),
+                "gptoss_metal_command_buffer_encode_launch_f32_kv_store");
+        }
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        // Rotated Q heads stay in the activations, in place. Shifting moves only the keys in the KV cache.
+        if (position_shift() != 0) {
+            return;
+        }
+        const float* activations_ptr = static_cast<const float*>(activations_buffer.ptr());
+        const float* ref_activations_ptr = static_cast<const float*>(ref_activations_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            for (std::uint32_t h = 0; h < num_q_heads(); h++) {
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    const std::size_t idx = (t * num_qkv_heads() + h) * head_dim() + d;
+                    const double ref_value = static_cast<double>(ref_activations_ptr[idx]);
+                    ASSERT_NEAR(static_cast<double>(activations_ptr[idx]), ref_value, std::abs(ref_value) * 1.0e-5)
+                        << "at token " << t << ", Q head " << h << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+    metal::Function f32_rope_fn_{library_, "gptoss_f32_rope"};
+    metal::Function f32_rope_kv_store_fn_{library_, "gptoss_f32_rope_kv_store"};
+    metal::Function f32_rope_bf16kv_store_fn_{library_, "gptoss_f32_rope_bf16kv_store"};
+    metal::Function f32_rope_i8kv_store_fn_{library_, "gptoss_f32_rope_i8kv_store"};
+    metal::Function kv_rope_shift_fn_{library_, "gptoss_kv_rope_shift"};
+    metal::Function bf16kv_rope_shift_fn_{library_, "gptoss_bf16kv_rope_shift"};
+    metal::Function i8kv_rope_shift_fn_{library_, "gptoss_i8kv_rope_shift"};
+    std::uint32_t kv_token_offset_{0};
+    float frequency_base_{50000.0f};
+    std::int32_t position_shift_{0};
+};
+
+}  // namespace gptoss
@@ -0,0 +1,211 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include <internal/model.h>
+
+#include "model-tester.hpp"
+
+
+using gptoss::ModelTest;
+
+namespace {
+
+class SchedulerTest : public ModelTest {
+protected:
+    using Scheduler = std::unique_ptr<std::remove_pointer_t<gptoss_scheduler_t>, decltype(&gptoss_scheduler_release)>;
+
+    static Scheduler CreateScheduler(std::size_t max_batch_tokens) {
+        gptoss_scheduler_t scheduler = nullptr;
+        gptoss::Check(gptoss_scheduler_create(model(), max_batch_tokens, &scheduler), "create Scheduler");
+        return Scheduler(scheduler, gptoss_scheduler_release);
+    }
+
+    // Creates a Context with the prompt appended, but not processed.
+    static Context CreatePendingContext(const char* prompt) {
+        Context context = CreateContext();
+        gptoss::Check(gptoss_context_append_chars(context.get(), prompt, std::strlen(prompt), /*num_tokens_out=*/nullptr),
+            "append prompt");
+        return context;
+    }
+
+    static std::uint64_t Submit(
+        gptoss_scheduler_t scheduler,
+        gptoss_context_t context,
+        std::size_t max_tokens,
+        const std::vector<std::uint32_t>& stop_tokens = {})
+    {
+        std::uint64_t request_id = 0;
+        gptoss::Check(gptoss_scheduler_submit(scheduler, context, /*temperature=*/0.0f, /*seed=*/0, max_tokens,
+                stop_tokens.size(), stop_tokens.data(), &request_id),
+            "submit request");
+        return request_id;
+    }
+
+    // Steps the Scheduler until it has no requests, and returns the generated tokens of each request.
+    static std::map<std::uint64_t, std::vector<std::uint32_t>> RunToCompletion(gptoss_scheduler_t scheduler) {
+        std::map<std::uint64_t, std::vector<std::uint32_t>> tokens;
+        std::vector<std::uint64_t> request_ids(kMaxOutputs);
+        std::vector<std::uint32_t> step_tokens(kMaxOutputs);
+        std::vector<std::uint8_t> finished(kMaxOutputs);
+        for (;;) {
+            std::size_t num_requests = 0;
+            gptoss::Check(gptoss_scheduler_get_num_requests(scheduler, &num_requests), "get number of requests");
+            if (num_requests == 0) {
+                return tokens;
+            }
+
+            std::size_t num_outputs = 0;
+            gptoss::Check(gptoss_scheduler_step(scheduler, kMaxOutputs, request_ids.data(), step_tokens.data(),
+                    finished.data(), &num_outputs),
+                "run Scheduler step");
+            for (std::size_t i = 0; i < num_outputs; i++) {
+                tokens[request_ids[i]].push_back(step_tokens[i]);
+            }
+        }
+    }
+
+    static constexpr const char* kPrompts[] = {
+        "The quick brown fox jumps over the lazy dog. Once upon a time",
+        "Hello",
+        "In a hole in the ground there lived a hobbit. Not a nasty, dirty, wet hole, filled with the ends of worms",
+    };
+    static constexpr std::size_t kMaxOutputs = 64;
+};
+
+}  // namespace
+
+TEST_F(SchedulerTest, greedy_matches_sequential) {
+    // A small step forces prompts to be pre-filled in chunks, interleaved with the decoding of other requests.
+    for (std::size_t max_batch_tokens : {0, 16, 5}) {
+        Scheduler scheduler = CreateScheduler(max_batch_tokens);
+        std::vector<Context> contexts;
+        std::vector<std::uint64_t> request_ids;
+        for (const char* prompt : kPrompts) {
+            contexts.push_back(CreatePendingContext(prompt));
+            request_ids.push_back(Submit(scheduler.get(), contexts.back().get(), /*max_tokens=*/16));
+        }
+
+        const std::map<std::uint64_t, std::vector<std::uint32_t>> tokens = RunToCompletion(scheduler.get());
+        for (std::size_t i = 0; i < std::size(kPrompts); i++) {
+            Context sequential_context = CreateContext(kPrompts[i]);
+            const std::vector<std::uint32_t> expected_tokens = Sample(sequential_context.get(), /*max_tokens=*/16);
+            EXPECT_EQ(tokens.at(request_ids[i]), expected_tokens) << "prompt #" << i << ", step of " << max_batch_tokens;
+            // The generated tokens are appended to the Context.
+            EXPECT_EQ(GetTokens(contexts[i].get()), GetTokens(sequential_context.get()));
+        }
+    }
+}
+
+TEST_F(SchedulerTest, admits_waiting_requests) {
+    // Only two requests are admitted at a time; the others wait until a request is retired.
+    Scheduler scheduler = CreateScheduler(/*max_batch_tokens=*/2);
+    std::vector<Context> contexts;
+    std::vector<std::uint64_t> request_ids;
+    for (std::size_t i = 0; i < 5; i++) {
+        contexts.push_back(CreatePendingContext(kPrompts[i % std::size(kPrompts)]));
+        request_ids.push_back(Submit(scheduler.get(), contexts.back().get(), /*max_tokens=*/4 + i));
+    }
+
+    std::size_t num_requests = 0;
+    gptoss::Check(gptoss_scheduler_get_num_requests(scheduler.get(), &num_requests), "get number of requests");
+    EXPECT_EQ(num_requests, 5);
+
+    const std::map<std::uint64_t, std::vector<std::uint32_t>> tokens = RunToCompletion(scheduler.get());
+    for (std::size_t i = 0; i < request_ids.size(); i++) {
+        EXPECT_EQ(tokens.at(request_ids[i]).size(), 4 + i) << "request #" << i;
+    }
+}
+
+TEST_F(SchedulerTest, stop_token_finishes_request) {
+    Context sequential_context = CreateContext(kPrompt);
+    const std::vector<std::uint32_t> expected_tokens = Sample(sequential_context.get(), /*max_tokens=*/4);
+
+    Scheduler scheduler = CreateScheduler(/*max_batch_tokens=*/0);
+    Context context = CreatePendingContext(kPrompt);
+    const std::uint64_t request_id = Submit(scheduler.get(), context.get(), /*max_tokens=*/16, {expected_tokens[2]});
+    const std::map<std::uint64_t, std::vector<std::uint32_t>> tokens = RunToCompletion(scheduler.get());
+    EXPECT_EQ(tokens.at(request_id), std::vector<std::uint32_t>(expected_tokens.begin(), expected_tokens.begin() + 3));
+}
+
+TEST_F(SchedulerTest, cancel_keeps_generated_tokens) {
+    Scheduler scheduler = CreateScheduler(/*max_batch_tokens=*/0);
+    Context context = CreateContext(kPrompt);
+    const std::size_t num_prompt_tokens = GetTokens(context.get()).size();
+    const std::uint64_t request_id = Submit(scheduler.get(), context.get(), /*max_tokens=*/16);
+
+    std::uint64_t step_request_id = 0;
+    std::uint32_t token = 0;
+    std::uint8_t finished = 0;
+    std::size_t num_outputs = 0;
+    gptoss::Check(gptoss_scheduler_step(scheduler.get(), 1, &step_request_id, &token, &finished, &num_outputs),
+        "run Scheduler step");
+    ASSERT_EQ(num_outputs, 1);
+    EXPECT_EQ(step_request_id, request_id);
+
+    gptoss::Check(gptoss_scheduler_cancel(scheduler.get(), request_id), "cancel request");
+    EXPECT_EQ(gptoss_scheduler_cancel(scheduler.get(), request_id), gptoss_status_invalid_argument);
+    std::size_t num_requests = 0;
+    gptoss::Check(gptoss_scheduler_get_num_requests(scheduler.get(), &num_requests), "get number of requests");
+    EXPECT_EQ(num_requests, 0);
+    EXPECT_EQ(GetTokens(context.get()).size(), num_prompt_tokens + 1);
+    EXPECT_EQ(GetTokens(context.get()).back(), token);
+}
+
+TEST_F(SchedulerTest, rejects_invalid_requests) {
+    Scheduler scheduler = CreateScheduler(/*max_batch_tokens=*/0);
+    std::uint64_t request_id = 0;
+
+    Context empty_context = CreateContext();
+    EXPECT_EQ(gptoss_scheduler_submit(scheduler.get(), empty_context.get(), /*temperature=*/0.0f, /*seed=*/0,
+            /*max_tokens=*/1, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, &request_id),
+        gptoss_status_invalid_argument);
+
+    Context context = CreatePendingContext(kPrompt);
+    EXPECT_EQ(gptoss_scheduler_submit(scheduler.get(), context.get(), /*temperature=*/0.0f, /*seed=*/0,
+            /*max_tokens=*/0, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, &request_id),
+        gptoss_status_invalid_argument);
+    Submit(scheduler.get(), context.get(), /*max_tokens=*/1);
+    EXPECT_EQ(gptoss_scheduler_submit(scheduler.get(), context.get(), /*temperature=*/0.0f, /*seed=*/0,
+            /*max_tokens=*/1, /*num_stop_tokens=*/0, /*stop_tokens=*/nullptr, &request_id),
+        gptoss_status_invalid_argument);
+}
+
+TEST_F(SchedulerTest, batch_step_matches_sequential) {
+    // One step pre-fills a prompt while decoding a token of another Context, then both continue decoding together.
+    Context prefill_context = CreatePendingContext(kPrompts[2]);
+    Context sample_context = CreateContext(kPrompts[0]);
+    const std::size_t num_prefill_tokens = GetTokens(prefill_context.get()).size() - 1;
+
+    std::vector<std::uint32_t> prefill_tokens;
+    std::vector<std::uint32_t> sample_tokens;
+    std::uint32_t token = 0;
+    const gptoss_context_t prefill_contexts[1] = {prefill_context.get()};
+    const gptoss_context_t sample_contexts[1] = {sample_context.get()};
+    const float temperatures[2] = {0.0f, 0.0f};
+    const std::uint64_t seeds[2] = {0, 0};
+    gptoss::Check(gptoss_context_batch_step(1, prefill_contexts, &num_prefill_tokens, 1, sample_contexts,
+            temperatures, seeds, &token),
+        "run batch step");
+    sample_tokens.push_back(token);
+
+    const gptoss_context_t both_contexts[2] = {prefill_context.get(), sample_context.get()};
+    std::uint32_t tokens[2];
+    for (std::size_t t = 0; t < 8; t++) {
+        gptoss::Check(gptoss_context_batch_step(0, nullptr, nullptr, 2, both_contexts, temperatures, seeds, tokens),
+            "run batch step");
+        prefill_tokens.push_back(tokens[0]);
+        sample_tokens.push_back(tokens[1]);
+    }
+
+    Context sequential_prefill_context = CreateContext(kPrompts[2]);
+    EXPECT_EQ(prefill_tokens, Sample(sequential_prefill_context.get(), /*max_tokens=*/8));
+    Context sequential_sample_context = CreateContext(kPrompts[0]);
+    EXPECT_EQ(sample_tokens, Sample(sequential_sample_context.get(), /*max_tokens=*/9));
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <internal/datatype.hpp>
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+
+namespace gptoss {
+
+// Validates the SDPA kernels (8 Q heads per KV head, head dimension 64, with attention sinks) against a reference
+// computed in double precision. Q tokens follow num_kv_tokens tokens already in the KV cache, and the KV cache is a
+// ring buffer of kv_capacity tokens, or paged like the KV cache of full-attention blocks.
+class SDPAKernelTester {
+public:
+    SDPAKernelTester() { }
+
+    SDPAKernelTester(const SDPAKernelTester&) = delete;
+    SDPAKernelTester(SDPAKernelTester&&) = delete;
+    SDPAKernelTester& operator=(const SDPAKernelTester&) = delete;
+    SDPAKernelTester& operator=(SDPAKernelTester&&) = delete;
+
+    [[nodiscard]]
+    SDPAKernelTester& num_kv_heads(std::uint32_t num_kv_heads) {
+        num_kv_heads_ = num_kv_heads;
+        return *this;
+    }
+
+    std::uint32_t num_kv_heads() const {
+        return num_kv_heads_;
+    }
+
+    std::uint32_t num_q_heads() const {
+        return num_kv_heads() * kQMul;
+    }
+
+    std::uint32_t qkv_dim() const {
+        return kHeadDim * (num_q_heads() + 2 * num_kv_heads());
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& num_q_tokens(std::uint32_t num_q_tokens) {
+        num_q_tokens_ = num_q_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_q_tokens() const {
+        return num_q_tokens_;
+    }
+
+    // Number of tokens in the KV cache before the Q tokens.
+    [[nodiscard]]
+    SDPAKernelTester& num_kv_tokens(std::uint32_t num_kv_tokens) {
+        num_kv_tokens_ = num_kv_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_kv_tokens() const {
+        return num_kv_tokens_;
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& window(std::uint32_t window) {
+        window_ = window;
+        return *this;
+    }
+
+    std::uint32_t window() const {
+        return window_;
+    }
+
+    // Defaults to the smallest capacity that holds all attended tokens, so that sliding windows wrap around.
+    [[nodiscard]]
+    SDPAKernelTester& kv_capacity(std::uint32_t kv_capacity) {
+        kv_capacity_ = kv_capacity;
+        return *this;
+    }
+
+    std::uint32_t kv_capacity() const {
+        if (kv_capacity_ != 0) {
+            return kv_capacity_;
+        }
+        const std::uint64_t num_attended_tokens = std::min<std::uint64_t>(
+            static_cast<std::uint64_t>(num_q_tokens()) + num_kv_tokens(),
+            static_cast<std::uint64_t>(window()) + num_q_tokens() - 1);
+        return static_cast<std::uint32_t>(num_attended_tokens);
+    }
+
+    // Lets the launcher split the KV range of up to GPTOSS_SDPA_SPLIT_MAX_TOKENS Q tokens across threadgroups.
+    [[nodiscard]]
+    SDPAKernelTester& split(bool split) {
+        split_ = split;
+        return *this;
+    }
+
+    bool split() const {
+        return split_;
+    }
+
+    // Stores the KV cache in pages of GPTOSS_KVCACHE_PAGE_TOKENS tokens, scattered in a pool with twice as many pages.
+    [[nodiscard]]
+    SDPAKernelTester& paged(bool paged) {
+        paged_ = paged;
+        return *this;
+    }
+
+    bool paged() const {
+        return paged_;
+    }
+
+    std::uint32_t num_pages() const {
+        return (num_kv_tokens() + num_q_tokens() + GPTOSS_KVCACHE_PAGE_TOKENS - 1) / GPTOSS_KVCACHE_PAGE_TOKENS;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_kv_heads(), 0);
+        ASSERT_NE(num_q_tokens(), 0);
+        ASSERT_NE(window(), 0);
+        ASSERT_NE(kv_capacity(), 0);
+        if (paged()) {
+            ASSERT_EQ(kv_capacity_, 0) << "paged KV cache has no ring buffer capacity";
+        }
+    }
+
+    void TestF32() const {
+        Validate();
+
+        const metal::Function sdpa_fn{library_, "gptoss_f32_sdpa_q8_d64",
+            {{GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS, num_kv_heads()}}};
+        Run(sdpa_fn, /*bf16_kv=*/false);
+    }
+
+    // KV cache values are rounded to bf16 before the reference is computed.
+    void TestBF16KV() const {
+        Validate();
+
+        const metal::Function sdpa_fn{library_, "gptoss_f32_bf16kv_sdpa_q8_d64",
+            {{GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS, num_kv_heads()}}};
+        Run(sdpa_fn, /*bf16_kv=*/true);
+    }
+
+private:
+    void Run(const metal::Function& sdpa_fn, bool bf16_kv) const {
+        const metal::Function sdpa_reduce_fn{library_, "gptoss_f32_sdpa_reduce_q8_d64",
+            {{GPTOSS_FUNCTION_CONSTANT_NUM_KV_HEADS, num_kv_heads()}}};
+        const std::size_t head_size = kHeadDim * (bf16_kv ? sizeof(gptoss_bfloat16) : sizeof(float));
+        const std::uint32_t num_tokens = num_kv_tokens() + num_q_tokens();
+        const std::size_t token_stride = 2 * num_kv_heads() * head_size;
+        const std::uint32_t num_pool_pages = 2 * num_pages();
+        // Like the context, a paged KV cache passes the capacity of its pages.
+        const std::uint32_t kv_slots = paged() ? num_pages() * GPTOSS_KVCACHE_PAGE_TOKENS : kv_capacity();
+        metal::Buffer q_buffer{device_, num_q_tokens() * qkv_dim() * sizeof(float)};
+        metal::Buffer kvcache_buffer{device_, (paged() ? num_pool_pages * GPTOSS_KVCACHE_PAGE_TOKENS : kv_slots) * token_stride};
+        metal::Buffer page_table_buffer{device_, num_pages() * sizeof(std::uint32_t)};
+        metal::Buffer sink_buffer{device_, num_q_heads() * sizeof(gptoss_bfloat16)};
+        metal::Buffer output_buffer{device_, num_q_tokens() * num_q_heads() * kHeadDim * sizeof(float)};
+        metal::Buffer partial_buffer{device_, GPTOSS_SDPA_PARTIAL_SIZE(num_kv_heads(), kHeadDim)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        std::mt19937 rng(kSeed);
+        std::uniform_real_distribution<float> value_distribution(-1.0f, 1.0f);
+        std::uniform_real_distribution<float> sink_distribution(-2.0f, 2.0f);
+
+        // Pages are a random subset of the pool, in random order.
+        std::vector<std::uint32_t> pool_pages(num_pool_pages);
+        std::iota(pool_pages.begin(), pool_pages.end(), 0);
+        std::shuffle(pool_pages.begin(), pool_pages.end(), rng);
+        std::uint32_t* page_table_ptr = static_cast<std::uint32_t*>(page_table_buffer.ptr());
+        std::copy_n(pool_pages.begin(), num_pages(), page_table_ptr);
+
+        // Q is scaled like in the model, which folds the 1/sqrt(head_dim) factor of SDPA into the Q and K projections.
+        float* q_ptr = static_cast<float*>(q_buffer.ptr());
+        for (std::size_t i = 0; i < num_q_tokens() * qkv_dim(); i++) {
+            q_ptr[i] = value_distribution(rng) * 0.125f;
+        }
+
+        // Reference K and V of every token, as stored in the KV cache. Later tokens overwrite earlier ones in the ring
+        // buffer, but never ones that are still attended.
+        std::vector<float> k(static_cast<std::size_t>(num_tokens) * num_kv_heads() * kHeadDim);
+        std::vector<float> v(static_cast<std::size_t>(num_tokens) * num_kv_heads() * kHeadDim);
+        char* kvcache_ptr = static_cast<char*>(kvcache_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens; t++) {
+            const std::uint32_t slot = paged() ?
+                page_table_ptr[t / GPTOSS_KVCACHE_PAGE_TOKENS] * GPTOSS_KVCACHE_PAGE_TOKENS + t % GPTOSS_KVCACHE_PAGE_TOKENS :
+                t % kv_capacity();
+            char* slot_ptr = kvcache_ptr + slot * token_stride;
+            for (std::uint32_t h = 0; h < num_kv_heads(); h++) {
+                StoreHead(slot_ptr + h * head_size, k.data() + (t * num_kv_heads() + h) * kHeadDim, bf16_kv, rng);
+                StoreHead(slot_ptr + (num_kv_heads() + h) * head_size, v.data() + (t * num_kv_heads() + h) * kHeadDim, bf16_kv, rng);
+            }
+        }
+
+        gptoss_bfloat16* sink_ptr = static_cast<gptoss_bfloat16*>(sink_buffer.ptr());
+        for (std::uint32_t h = 0; h < num_q_heads(); h++) {
+            sink_ptr[h].bits = static_cast<std::uint16_t>(std::bit_cast<std::uint32_t>(sink_distribution(rng)) >> 16);
+        }
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        Check(gptoss_metal_command_buffer_encode_launch_f32_sdpa(
+                command_buffer.handle(),
+                sdpa_fn.handle(),
+                split() ? sdpa_reduce_fn.handle() : nullptr,
+                /*max_threadgroups=*/kMaxThreadgroups,
+                q_buffer.handle(), /*q_offset=*/0,
+                kvcache_buffer.handle(), /*k_offset=*/0,
+                kvcache_buffer.handle(), /*v_offset=*/num_kv_heads() * head_size,
+                sink_buffer.handle(), /*s_offset=*/0,
+                output_buffer.handle(), /*output_offset=*/0,
+                partial_buffer.handle(), /*partial_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                // Without a prefix, the KV cache stands in for the (unused) prefix KV cache bindings.
+                kvcache_buffer.handle(), /*prefix_k_offset=*/0,
+                kvcache_buffer.handle(), /*prefix_v_offset=*/num_kv_heads() * head_size,
+                paged() ? page_table_buffer.handle() : nullptr, /*page_table_offset=*/0,
+                window(),
+                kv_slots,
+                /*num_prefix_tokens=*/0,
+                /*prefix_capacity=*/0,
+                num_q_tokens(),
+                num_kv_tokens(),
+                num_q_heads(),
+                num_kv_heads(),
+                kHeadDim),
+            "gptoss_metal_command_buffer_encode_launch_f32_sdpa");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        std::vector<double> scores;
+        for (std::uint32_t qt = 0; qt < num_q_tokens(); qt++) {
+            const std::uint32_t kv_end = qt + num_kv_tokens() + 1;
+            const std::uint32_t kv_start = kv_end - std::min(kv_end, window());
+            for (std::uint32_t qh = 0; qh < num_q_heads(); qh++) {
+                const std::uint32_t h = qh / kQMul;
+                const float* q_head = q_ptr + qt * qkv_dim() + qh * kHeadDim;
+
+                // The sink logit only contributes to the softmax denominator.
+                const double sink = upcast<double>(sink_ptr[qh]);
+                double max_score = sink;
+                scores.resize(kv_end - kv_start);
+                for (std::uint32_t kt = kv_start; kt < kv_end; kt++) {
+                    const float* k_head = k.data() + (kt * num_kv_heads() + h) * kHeadDim;
+                    double score = 0.0;
+                    for (std::uint32_t d = 0; d < kHeadDim; d++) {
+                        score = std::fma(static_cast<double>(q_head[d]), static_cast<double>(k_head[d]), score);
+                    }
+                    scores[kt - kv_start] = score;
+                    max_score = std::max(max_score, score);
+                }
+                double denominator = std::exp(sink - max_score);
+                for (double& score : scores) {
+                    score = std::exp(score - max_score);
+                    denominator += score;
+                }
+
+                for (std::uint32_t d = 0; d < kHeadDim; d++) {
+                    double ref_value = 0.0;
+                    for (std::uint32_t kt = kv_start; kt < kv_end; kt++) {
+                        const float* v_head = v.data() + (kt * num_kv_heads() + h) * kHeadDim;
+                        ref_value = std::fma(scores[kt - kv_start], static_cast<double>(v_head[d]), ref_value);
+                    }
+                    ref_value /= denominator;
+                    const float output_value = output_ptr[(qt * num_q_heads() + qh) * kHeadDim + d];
+                    ASSERT_NEAR(static_cast<double>(output_value), ref_value, std::max(std::abs(ref_value), 1.0) * 1.0e-4)
+                        << "at Q token " << qt << ", Q head " << qh << ", dimension " << d;
+                }
+            }
+        }
+    }
+
+    // Stores a random K or V head into the KV cache record at head, and the values the kernel reads back into values.
+    static void StoreHead(char* head, float* values, bool bf16_kv, std::mt19937& rng) {
+        std::uniform_real_distribution<float> value_distribution(-1.0f, 1.0f);
+        for (std::uint32_t d = 0; d < kHeadDim; d++) {
+            const float value = value_distribution(rng);
+            if (bf16_kv) {
+                const gptoss_bfloat16 bf16_value{.bits = static_cast<std::uint16_t>(std::bit_cast<std::uint32_t>(value) >> 16)};
+                reinterpret_cast<gptoss_bfloat16*>(head)[d] = bf16_value;
+                values[d] = upcast<float>(bf16_value);
+            } else {
+                reinterpret_cast<float*>(head)[d] = value;
+                values[d] = value;
+            }
+        }
+    }
+
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::uint32_t kQMul = 8;
+    static constexpr std::uint32_t kHeadDim = 64;
+    static constexpr std::size_t kMaxThreadgroups = 1024;
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    std::uint32_t num_kv_heads_{1};
+    std::uint32_t num_q_tokens_{1};
+    std::uint32_t num_kv_tokens_{0};
+    std::uint32_t window_{UINT32_MAX};
+    std::uint32_t kv_capacity_{0};
+    bool split_{true};
+    bool paged_{false};
+};
+
+}  // namespace gptoss
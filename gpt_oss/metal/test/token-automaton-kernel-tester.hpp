@@ -0,0 +1,184 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+
+namespace gptoss {
+
+// Validates the token automaton kernel on a random automaton: every (state, token) pair of the test is advanced by a
+// separate launch with its own control structure, and compared with a reference transition on the CPU.
+class TokenAutomatonKernelTester {
+public:
+    TokenAutomatonKernelTester() { }
+
+    TokenAutomatonKernelTester(const TokenAutomatonKernelTester&) = delete;
+    TokenAutomatonKernelTester(TokenAutomatonKernelTester&&) = delete;
+    TokenAutomatonKernelTester& operator=(const TokenAutomatonKernelTester&) = delete;
+    TokenAutomatonKernelTester& operator=(TokenAutomatonKernelTester&&) = delete;
+
+    [[nodiscard]]
+    TokenAutomatonKernelTester& num_states(std::uint32_t num_states) {
+        num_states_ = num_states;
+        return *this;
+    }
+
+    std::uint32_t num_states() const {
+        return num_states_;
+    }
+
+    [[nodiscard]]
+    TokenAutomatonKernelTester& num_tokens(std::uint32_t num_tokens) {
+        num_tokens_ = num_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_tokens() const {
+        return num_tokens_;
+    }
+
+    // Number of explicit transitions out of each state; the other tokens lead to the default next state.
+    [[nodiscard]]
+    TokenAutomatonKernelTester& num_state_transitions(std::uint32_t num_state_transitions) {
+        num_state_transitions_ = num_state_transitions;
+        return *this;
+    }
+
+    std::uint32_t num_state_transitions() const {
+        return num_state_transitions_;
+    }
+
+    // Raises the abort flag before the launches, which must then leave the state unchanged.
+    [[nodiscard]]
+    TokenAutomatonKernelTester& aborted(bool aborted) {
+        aborted_ = aborted;
+        return *this;
+    }
+
+    bool aborted() const {
+        return aborted_;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_states(), 0);
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_LE(num_state_transitions(), num_tokens());
+    }
+
+    void TestU32_AdvanceTokenAutomaton() const {
+        Validate();
+
+        // Random transitions, sorted by state, then by token, as required by gptoss_context_set_token_automaton.
+        std::mt19937 rng(kSeed);
+        std::uniform_int_distribution<std::uint32_t> state_distribution(0, num_states() - 1);
+        std::uniform_int_distribution<std::uint32_t> token_distribution(0, num_tokens() - 1);
+        std::vector<std::uint32_t> default_states(num_states());
+        std::vector<std::uint32_t> row_offsets(num_states() + 1);
+        std::vector<std::uint32_t> transition_tokens;
+        std::vector<std::uint32_t> transition_states;
+        for (std::uint32_t s = 0; s < num_states(); s++) {
+            default_states[s] = state_distribution(rng);
+            row_offsets[s] = static_cast<std::uint32_t>(transition_tokens.size());
+            std::set<std::uint32_t> tokens;
+            while (tokens.size() < num_state_transitions()) {
+                tokens.insert(token_distribution(rng));
+            }
+            for (std::uint32_t token : tokens) {
+                transition_tokens.push_back(token);
+                transition_states.push_back(state_distribution(rng));
+            }
+        }
+        const std::uint32_t num_transitions = static_cast<std::uint32_t>(transition_tokens.size());
+        row_offsets[num_states()] = num_transitions;
+
+        std::vector<std::uint32_t> transition_table;
+        transition_table.insert(transition_table.end(), row_offsets.begin(), row_offsets.end());
+        transition_table.insert(transition_table.end(), default_states.begin(), default_states.end());
+        transition_table.insert(transition_table.end(), transition_tokens.begin(), transition_tokens.end());
+        transition_table.insert(transition_table.end(), transition_states.begin(), transition_states.end());
+
+        // Every state with each of its explicit transition tokens, the first and last token, and a random token.
+        std::vector<std::uint32_t> case_states;
+        std::vector<std::uint32_t> case_tokens;
+        for (std::uint32_t s = 0; s < num_states(); s++) {
+            for (std::uint32_t i = row_offsets[s]; i < row_offsets[s + 1]; i++) {
+                case_states.push_back(s);
+                case_tokens.push_back(transition_tokens[i]);
+            }
+            for (std::uint32_t token : {0u, num_tokens() - 1, token_distribution(rng)}) {
+                case_states.push_back(s);
+                case_tokens.push_back(token);
+            }
+        }
+        const std::size_t num_cases = case_states.size();
+
+        metal::Buffer transition_buffer{device_, transition_table.size() * sizeof(std::uint32_t), transition_table.data()};
+        metal::Buffer token_buffer{device_, num_cases * sizeof(std::uint32_t), case_tokens.data()};
+        metal::Buffer control_buffer{device_, num_cases * sizeof(gptoss_control)};
+        gptoss_control* control_ptr = static_cast<gptoss_control*>(control_buffer.ptr());
+        for (std::size_t i = 0; i < num_cases; i++) {
+            control_ptr[i].abort = aborted() ? 1 : 0;
+            control_ptr[i].token_state = case_states[i];
+        }
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        for (std::size_t i = 0; i < num_cases; i++) {
+            Check(gptoss_metal_command_buffer_encode_launch_u32_advance_token_automaton(
+                    command_buffer.handle(),
+                    u32_advance_token_automaton_fn_.handle(),
+                    token_buffer.handle(),
+                    /*token_offset=*/i * sizeof(std::uint32_t),
+                    transition_buffer.handle(),
+                    /*transition_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/i * sizeof(gptoss_control),
+                    num_states(),
+                    num_transitions),
+                "gptoss_metal_command_buffer_encode_launch_u32_advance_token_automaton");
+        }
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        for (std::size_t i = 0; i < num_cases; i++) {
+            const std::uint32_t state = case_states[i];
+            const std::uint32_t token = case_tokens[i];
+            std::uint32_t ref_next_state = default_states[state];
+            const auto row_begin = transition_tokens.begin() + row_offsets[state];
+            const auto row_end = transition_tokens.begin() + row_offsets[state + 1];
+            const auto transition = std::lower_bound(row_begin, row_end, token);
+            if (transition != row_end && *transition == token) {
+                ref_next_state = transition_states[transition - transition_tokens.begin()];
+            }
+            if (aborted()) {
+                ref_next_state = state;
+            }
+            ASSERT_EQ(control_ptr[i].token_state, ref_next_state) << "at state " << state << ", token " << token;
+        }
+    }
+
+private:
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function u32_advance_token_automaton_fn_{library_, "gptoss_u32_advance_token_automaton"};
+    std::uint32_t num_states_{1};
+    std::uint32_t num_tokens_{1024};
+    std::uint32_t num_state_transitions_{0};
+    bool aborted_{false};
+};
+
+}  // namespace gptoss
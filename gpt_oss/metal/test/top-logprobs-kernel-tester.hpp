@@ -0,0 +1,214 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+#include <internal/rng.hpp>
+
+
+namespace gptoss {
+
+// Validates the kernel reporting the most likely tokens and their log-probabilities against a reference computed on
+// the CPU.
+class TopLogprobsKernelTester {
+public:
+    enum class ScorePattern {
+        // Uniformly distributed scores.
+        random,
+        // All scores equal but one, so that the selection has to break ties in order of increasing token ID.
+        ties,
+        // Top scores spaced by the threadgroup size, so that all of the top tokens are visited by the same thread.
+        clustered,
+    };
+
+    TopLogprobsKernelTester() { }
+
+    TopLogprobsKernelTester(const TopLogprobsKernelTester&) = delete;
+    TopLogprobsKernelTester(TopLogprobsKernelTester&&) = delete;
+    TopLogprobsKernelTester& operator=(const TopLogprobsKernelTester&) = delete;
+    TopLogprobsKernelTester& operator=(TopLogprobsKernelTester&&) = delete;
+
+    [[nodiscard]]
+    TopLogprobsKernelTester& num_rows(std::uint32_t num_rows) {
+        num_rows_ = num_rows;
+        return *this;
+    }
+
+    std::uint32_t num_rows() const {
+        return num_rows_;
+    }
+
+    [[nodiscard]]
+    TopLogprobsKernelTester& num_channels(std::uint32_t num_channels) {
+        num_channels_ = num_channels;
+        return *this;
+    }
+
+    std::uint32_t num_channels() const {
+        return num_channels_;
+    }
+
+    [[nodiscard]]
+    TopLogprobsKernelTester& num_top(std::uint32_t num_top) {
+        num_top_ = num_top;
+        return *this;
+    }
+
+    std::uint32_t num_top() const {
+        return num_top_;
+    }
+
+    [[nodiscard]]
+    TopLogprobsKernelTester& threadgroup_size(std::size_t threadgroup_size) {
+        threadgroup_size_ = threadgroup_size;
+        return *this;
+    }
+
+    std::size_t threadgroup_size() const {
+        return threadgroup_size_;
+    }
+
+    [[nodiscard]]
+    TopLogprobsKernelTester& score_pattern(ScorePattern score_pattern) {
+        score_pattern_ = score_pattern;
+        return *this;
+    }
+
+    ScorePattern score_pattern() const {
+        return score_pattern_;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_rows(), 0);
+        ASSERT_NE(num_channels(), 0);
+        ASSERT_NE(num_top(), 0);
+        ASSERT_LE(num_top(), std::min<std::uint32_t>(num_channels(), GPTOSS_MAX_TOP_LOGPROBS));
+        ASSERT_NE(threadgroup_size(), 0);
+        if (score_pattern() == ScorePattern::clustered) {
+            ASSERT_LT(threadgroup_size() * (num_top() - 1) + 7, num_channels());
+        }
+    }
+
+    void TestF32() const {
+        Validate();
+
+        const metal::Function f32_top_logprobs_fn{library_, "gptoss_f32_top_logprobs"};
+        metal::Buffer score_buffer{device_, num_rows() * num_channels() * sizeof(float)};
+        metal::Buffer argmax_buffer{device_, num_rows() * sizeof(std::uint64_t)};
+        metal::Buffer output_buffer{device_, num_rows() * num_top() * (sizeof(std::uint32_t) + sizeof(float))};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        float* score_ptr = static_cast<float*>(score_buffer.ptr());
+        std::uint64_t* argmax_ptr = static_cast<std::uint64_t*>(argmax_buffer.ptr());
+        for (std::uint32_t r = 0; r < num_rows(); r++) {
+            float* row = score_ptr + r * num_channels();
+            InitializeScores(row, r);
+            argmax_ptr[r] = EncodeArgmax(row);
+        }
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        Check(gptoss_metal_command_buffer_encode_launch_f32_top_logprobs(
+                command_buffer.handle(),
+                f32_top_logprobs_fn.handle(),
+                threadgroup_size(),
+                score_buffer.handle(),
+                /*score_offset=*/0,
+                argmax_buffer.handle(),
+                /*argmax_offset=*/0,
+                output_buffer.handle(),
+                /*top_token_offset=*/0,
+                output_buffer.handle(),
+                /*top_logprob_offset=*/num_rows() * num_top() * sizeof(std::uint32_t),
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                num_channels(),
+                num_rows(),
+                num_top()),
+            "gptoss_metal_command_buffer_encode_launch_f32_top_logprobs");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const std::uint32_t* top_token_ptr = static_cast<const std::uint32_t*>(output_buffer.ptr());
+        const float* top_logprob_ptr = reinterpret_cast<const float*>(top_token_ptr + num_rows() * num_top());
+        std::vector<std::uint32_t> tokens(num_channels());
+        for (std::uint32_t r = 0; r < num_rows(); r++) {
+            const float* row = score_ptr + r * num_channels();
+            const double max_score = static_cast<double>(*std::max_element(row, row + num_channels()));
+            double sum_exp = 0.0;
+            for (std::uint32_t i = 0; i < num_channels(); i++) {
+                sum_exp += std::exp(static_cast<double>(row[i]) - max_score);
+            }
+            const double log_sum_exp = std::log(sum_exp);
+
+            // Decreasing score, ties in order of increasing token ID.
+            std::iota(tokens.begin(), tokens.end(), 0);
+            std::stable_sort(tokens.begin(), tokens.end(),
+                [row](std::uint32_t a, std::uint32_t b) { return row[a] > row[b]; });
+            for (std::uint32_t k = 0; k < num_top(); k++) {
+                ASSERT_EQ(top_token_ptr[r * num_top() + k], tokens[k]) << "at row " << r << ", rank " << k;
+                const double ref_logprob = static_cast<double>(row[tokens[k]]) - max_score - log_sum_exp;
+                ASSERT_NEAR(static_cast<double>(top_logprob_ptr[r * num_top() + k]), ref_logprob, 1.0e-4)
+                    << "at row " << r << ", rank " << k;
+            }
+        }
+    }
+
+private:
+    void InitializeScores(float* row, std::uint32_t row_index) const {
+        switch (score_pattern()) {
+            case ScorePattern::random:
+                for (std::uint32_t i = 0; i < num_channels(); i++) {
+                    const std::uint64_t offset = static_cast<std::uint64_t>(row_index) * num_channels() + i;
+                    row[i] = static_cast<float>(rng::squares32(offset, kSeed) >> 8) * 0x1.0p-20f - 8.0f;
+                }
+                break;
+            case ScorePattern::ties:
+                std::fill(row, row + num_channels(), 0.5f);
+                row[(123 + row_index) % num_channels()] = 1.0f;
+                break;
+            case ScorePattern::clustered:
+                std::fill(row, row + num_channels(), -1.0f);
+                for (std::uint32_t k = 0; k < num_top(); k++) {
+                    row[threadgroup_size() * k + 7] = static_cast<float>(k);
+                }
+                break;
+        }
+    }
+
+    // Argmax of a row in the format produced by the unembedding kernels: the index, then the score bits remapped so
+    // that the maximum score has the minimum key.
+    std::uint64_t EncodeArgmax(const float* row) const {
+        const std::uint32_t index = std::max_element(row, row + num_channels()) - row;
+        std::uint32_t bits;
+        std::memcpy(&bits, &row[index], sizeof(bits));
+        if (static_cast<std::int32_t>(bits) >= 0) {
+            bits ^= UINT32_C(0x7FFFFFFF);
+        }
+        return static_cast<std::uint64_t>(index) | (static_cast<std::uint64_t>(bits) << 32);
+    }
+
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    std::uint32_t num_rows_{1};
+    std::uint32_t num_channels_{10007};
+    std::uint32_t num_top_{1};
+    std::size_t threadgroup_size_{512};
+    ScorePattern score_pattern_{ScorePattern::random};
+};
+
+}  // namespace gptoss
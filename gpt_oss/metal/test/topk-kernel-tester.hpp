@@ -0,0 +1,149 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+
+namespace gptoss {
+
+// Validates the MoE router top-k + softmax kernel against a reference computed on the CPU.
+class TopKKernelTester {
+public:
+    TopKKernelTester() { }
+
+    TopKKernelTester(const TopKKernelTester&) = delete;
+    TopKKernelTester(TopKKernelTester&&) = delete;
+    TopKKernelTester& operator=(const TopKKernelTester&) = delete;
+    TopKKernelTester& operator=(TopKKernelTester&&) = delete;
+
+    [[nodiscard]]
+    TopKKernelTester& num_tokens(std::uint32_t num_tokens) {
+        num_tokens_ = num_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_tokens() const {
+        return num_tokens_;
+    }
+
+    [[nodiscard]]
+    TopKKernelTester& num_experts(std::uint32_t num_experts) {
+        num_experts_ = num_experts;
+        return *this;
+    }
+
+    std::uint32_t num_experts() const {
+        return num_experts_;
+    }
+
+    [[nodiscard]]
+    TopKKernelTester& num_active_experts(std::uint32_t num_active_experts) {
+        num_active_experts_ = num_active_experts;
+        return *this;
+    }
+
+    std::uint32_t num_active_experts() const {
+        return num_active_experts_;
+    }
+
+    // Draws the gating scores from a few distinct values, so that the selection has to break ties.
+    [[nodiscard]]
+    TopKKernelTester& ties(bool ties) {
+        ties_ = ties;
+        return *this;
+    }
+
+    bool ties() const {
+        return ties_;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_NE(num_experts(), 0);
+        ASSERT_LE(num_experts(), GPTOSS_TOPK_MAX_EXPERTS);
+        ASSERT_NE(num_active_experts(), 0);
+        ASSERT_LE(num_active_experts(), std::min<std::uint32_t>(num_experts(), GPTOSS_MAX_ACTIVE_EXPERTS));
+    }
+
+    void TestF32_Softmax() const {
+        Validate();
+
+        const metal::Function f32_topk_softmax_fn{library_, "gptoss_f32_topk_softmax",
+            {{GPTOSS_FUNCTION_CONSTANT_NUM_EXPERTS, num_experts()}, {GPTOSS_FUNCTION_CONSTANT_NUM_ACTIVE_EXPERTS, num_active_experts()}}};
+        metal::Buffer input_buffer{device_, num_tokens() * num_experts() * sizeof(float)};
+        metal::Buffer output_buffer{device_, num_tokens() * num_active_experts() * sizeof(gptoss_expert_prediction)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        std::mt19937 rng(kSeed);
+        std::uniform_real_distribution<float> score_distribution(-4.0f, 4.0f);
+        std::uniform_int_distribution<int> tie_distribution(-4, 4);
+        float* input_ptr = static_cast<float*>(input_buffer.ptr());
+        for (std::size_t i = 0; i < num_tokens() * num_experts(); i++) {
+            input_ptr[i] = ties() ? static_cast<float>(tie_distribution(rng)) * 0.5f : score_distribution(rng);
+        }
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        Check(gptoss_metal_command_buffer_encode_launch_f32_topk(
+                command_buffer.handle(),
+                f32_topk_softmax_fn.handle(),
+                input_buffer.handle(), /*input_offset=*/0,
+                output_buffer.handle(), /*output_offset=*/0,
+                control_buffer.handle(), /*control_offset=*/0,
+                num_tokens(),
+                num_experts(),
+                num_active_experts()),
+            "gptoss_metal_command_buffer_encode_launch_f32_topk");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const gptoss_expert_prediction* output_ptr = static_cast<const gptoss_expert_prediction*>(output_buffer.ptr());
+        std::vector<std::uint32_t> experts(num_experts());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            const float* token_input = input_ptr + t * num_experts();
+            // Descending scores, ties broken towards the lower expert index
+            std::iota(experts.begin(), experts.end(), 0);
+            std::stable_sort(experts.begin(), experts.end(),
+                [token_input](std::uint32_t a, std::uint32_t b) { return token_input[a] > token_input[b]; });
+
+            const double max_score = static_cast<double>(token_input[experts[0]]);
+            double sum = 0.0;
+            for (std::uint32_t k = 0; k < num_active_experts(); k++) {
+                sum += std::exp(static_cast<double>(token_input[experts[k]]) - max_score);
+            }
+            for (std::uint32_t k = 0; k < num_active_experts(); k++) {
+                const gptoss_expert_prediction& prediction = output_ptr[t * num_active_experts() + k];
+                ASSERT_EQ(prediction.expert_id, experts[k]) << "at token " << t << ", slot " << k;
+                const double ref_score = std::exp(static_cast<double>(token_input[experts[k]]) - max_score) / sum;
+                ASSERT_NEAR(static_cast<double>(prediction.score), ref_score, ref_score * 1.0e-5)
+                    << "at token " << t << ", slot " << k;
+            }
+        }
+    }
+
+private:
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    std::uint32_t num_tokens_{1};
+    std::uint32_t num_experts_{32};
+    std::uint32_t num_active_experts_{4};
+    bool ties_{false};
+};
+
+}  // namespace gptoss
@@ -0,0 +1,39 @@
+#include <gtest/gtest.h>
+
+#include "token-automaton-kernel-tester.hpp"
+
+
+using gptoss::TokenAutomatonKernelTester;
+
+TEST(U32_ADVANCE_TOKEN_AUTOMATON, default_transitions) {
+    TokenAutomatonKernelTester()
+        .num_states(5)
+        .num_tokens(1000)
+        .num_state_transitions(0)
+        .TestU32_AdvanceTokenAutomaton();
+}
+
+TEST(U32_ADVANCE_TOKEN_AUTOMATON, single_transition) {
+    TokenAutomatonKernelTester()
+        .num_states(7)
+        .num_tokens(1000)
+        .num_state_transitions(1)
+        .TestU32_AdvanceTokenAutomaton();
+}
+
+TEST(U32_ADVANCE_TOKEN_AUTOMATON, many_transitions) {
+    TokenAutomatonKernelTester()
+        .num_states(16)
+        .num_tokens(201088)
+        .num_state_transitions(97)
+        .TestU32_AdvanceTokenAutomaton();
+}
+
+TEST(U32_ADVANCE_TOKEN_AUTOMATON, aborted) {
+    TokenAutomatonKernelTester()
+        .num_states(4)
+        .num_tokens(1000)
+        .num_state_transitions(10)
+        .aborted(true)
+        .TestU32_AdvanceTokenAutomaton();
+}
@@ -1,5 +1,6 @@
 """Metal backend for :mod:`gpt_oss.responses_api`."""
 
+from collections import OrderedDict
 from typing import Callable
 
 from gpt_oss.metal import Context, Model
@@ -7,37 +8,137 @@ from gpt_oss.metal import Context, Model
 
 # Tunables
 MAX_OUTPUT_TOKENS = 100
+# Memory budget of the context pool, in bytes. Least recently used contexts are released once the pooled contexts use
+# more memory than this, but the pool always keeps the context serving the current request.
+CONTEXT_POOL_BUDGET = 16 * 1024 * 1024 * 1024
+# A request that branches off the prompt of every pooled context gets a fork of the context sharing the longest prefix
+# with it if the shared prefix has at least this many tokens, and a new context otherwise.
+MIN_FORK_PREFIX_TOKENS = 256
+
+
+def _common_prefix_length(a: list[int], b: list[int]) -> int:
+    n = min(len(a), len(b))
+    i = 0
+    while i < n and a[i] == b[i]:
+        i += 1
+    return i
+
+
+def _context_memory(context: Context) -> int:
+    # Both counts include the sliding-window KV cache, so this overestimates slightly.
+    stats = context.stats
+    return stats["allocation_size"] + stats["kvcache_size"]
+
+
+class ContextPool:
+    """LRU pool of contexts, one per conversation, bounded by a memory budget.
+
+    Each request is routed to the context whose tokens share the longest prefix with the request:
+
+    - A request that continues the tokens of the context reuses it.
+    - A request that diverges only from the tokens the context sampled after its last request is the next turn of
+      the same conversation, e.g. with the previous output rendered differently. The context is truncated in place,
+      as no other conversation holds those tokens.
+    - A request that diverges from the tokens of a previous request branches off that conversation. It gets a new
+      context, forked from the matched one if the shared prefix is long, so that the matched conversation keeps its
+      KV cache.
+
+    Interleaved conversations thus only prefill the tokens added since their last turn.
+    """
+
+    def __init__(self, model: Model, budget: int = CONTEXT_POOL_BUDGET):
+        self.model = model
+        self.budget = budget
+        # Ordered from least to most recently used. Keys are only used to identify the contexts.
+        self.contexts: OrderedDict[int, Context] = OrderedDict()
+        # Number of request tokens in each context; later tokens were sampled by the context.
+        self.request_lengths: dict[int, int] = {}
+        self.next_key = 0
+
+    def acquire(self, tokens: list[int]) -> Context:
+        """Return a context for the request after appending its tokens, reusing a pooled context when possible."""
+        best_key, best_length = None, -1
+        for key, context in self.contexts.items():
+            length = _common_prefix_length(context.tokens, tokens)
+            # Ties go to the most recently used context, which comes last.
+            if length >= best_length:
+                best_key, best_length = key, length
+
+        key = best_key
+        if key is not None and best_length < self.request_lengths[key]:
+            if best_length >= MIN_FORK_PREFIX_TOKENS:
+                # The fork gets a GPU copy of all KV cache rows of the matched context, and append_tokens below
+                # truncates it to the common prefix.
+                context = self.contexts[key].fork()
+            else:
+                context = Context(self.model)
+            key = self._add(context)
+        elif key is None:
+            key = self._add(Context(self.model))
+
+        self.contexts.move_to_end(key)
+        self.request_lengths[key] = len(tokens)
+        context = self.contexts[key]
+        # Resetting keeps the KV cache, so append_tokens truncates the context to the common prefix in place.
+        context.reset()
+        context.append_tokens(tokens)
+        self._evict(keep=key)
+        return context
+
+    def _add(self, context: Context) -> int:
+        key = self.next_key
+        self.next_key += 1
+        self.contexts[key] = context
+        return key
+
+    def _evict(self, keep: int) -> None:
+        total = sum(_context_memory(context) for context in self.contexts.values())
+        for key in list(self.contexts):
+            if total <= self.budget:
+                break
+            if key != keep:
+                del self.request_lengths[key]
+                total -= _context_memory(self.contexts.pop(key))
 
 
 def setup_model(checkpoint: str) -> Callable[[list[int], float], int]:
     """Load the Metal model and return an inference function."""
 
     model = Model(checkpoint)
-    context = Context(model)
+    pool = ContextPool(model)
+    tokenizer = model.tokenizer
+    stop_tokens = [
+        tokenizer.encode_special_token("<|return|>"),
+        tokenizer.encode_special_token("<|call|>"),
+    ]
 
     seed = 0
-    output_tokens = []
+    output_stream = None
 
     def infer_next_token(
         tokens: list[int], temperature: float = 0.0, new_request: bool = False
     ) -> int:
-        """Infer next token using incremental LCP caching when possible."""
-        nonlocal output_tokens
+        """Infer next token, reusing the KV cache of the conversation from the context pool."""
+        nonlocal output_stream
 
         if new_request:
-            output_tokens = []
+            output_stream = None
 
-        if len(output_tokens) == 0:
+        token = next(output_stream, None) if output_stream is not None else None
+        if token is None:
+            # End the previous stream first: releasing it later would end the
+            # stream started below if both use the same context.
+            output_stream = None
             # Context handles LCP caching internally; if `tokens` matches the
             # tokens in the KV cache, the KV cache is reused after reset+append.
-            context.reset()
-            for t in tokens:
-                context.append(t)
+            context = pool.acquire(tokens)
 
-            output_tokens = context.sample(max_output_tokens=MAX_OUTPUT_TOKENS,
-                                           temperature=temperature,
-                                           seed=seed)
+            output_stream = context.sample_stream(max_output_tokens=MAX_OUTPUT_TOKENS,
+                                                  temperature=temperature,
+                                                  seed=seed,
+                                                  stop_tokens=stop_tokens)
+            token = next(output_stream)
 
-        return int(output_tokens.pop(0))
+        return int(token)
 
     return infer_next_token
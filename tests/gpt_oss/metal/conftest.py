@@ -0,0 +1,16 @@
+import os
+
+import pytest
+
+
+@pytest.fixture(scope="session")
+def metal():
+    return pytest.importorskip("gpt_oss.metal")
+
+
+@pytest.fixture(scope="session")
+def model(metal):
+    path = os.environ.get("GPT_OSS_20B_PATH")
+    if not path:
+        pytest.skip("GPT_OSS_20B_PATH is not set")
+    return metal.Model(path)
@@ -0,0 +1,37 @@
+import tempfile
+
+import pytest
+
+PROMPT = "The quick brown fox jumps over the lazy dog. Once upon a time"
+
+
+def test_save_load_roundtrip(metal, model):
+    context = metal.Context(model, context_length=4096)
+    context.append(PROMPT)
+    context.process()
+    context.sample(max_output_tokens=16, temperature=0.0)
+
+    with tempfile.TemporaryFile() as file:
+        context.save(file)
+        file.seek(0)
+        restored = metal.Context(model, context_length=4096)
+        restored.load(file)
+
+    assert restored.tokens == context.tokens
+    assert restored.sample(max_output_tokens=16, temperature=0.0) == context.sample(max_output_tokens=16, temperature=0.0)
+
+
+def test_load_rejects_corrupted_file(metal, model):
+    context = metal.Context(model, context_length=4096)
+    context.append(PROMPT)
+    context.process()
+
+    with tempfile.TemporaryFile() as file:
+        context.save(file)
+        file.seek(0)
+        file.write(b"\0")
+        file.seek(0)
+        restored = metal.Context(model, context_length=4096)
+        with pytest.raises(RuntimeError):
+            restored.load(file)
+    assert restored.tokens == []
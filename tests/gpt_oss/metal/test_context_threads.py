@@ -0,0 +1,57 @@
+import copy
+import threading
+
+
+def run_while_busy(context, probe):
+    """Samples from the context in a thread and calls probe on the main thread until the sampling finishes.
+
+    Returns the exceptions raised by probe."""
+    errors = []
+    worker = threading.Thread(
+        target=lambda: context.sample(max_output_tokens=256, temperature=0.0))
+    worker.start()
+    while worker.is_alive():
+        try:
+            probe()
+        except RuntimeError as error:
+            errors.append(error)
+    worker.join()
+    return errors
+
+
+def test_concurrent_use_raises(metal, model):
+    context = metal.Context(model, context_length=1024)
+    context.append("The quick brown fox jumps over the lazy dog")
+    context.process()
+
+    errors = run_while_busy(context, lambda: context.num_tokens)
+    assert errors
+    assert all("in use by another thread" in str(error) for error in errors)
+
+    # The claim is released once the sampling call returns.
+    assert context.num_tokens > 0
+    context.append("again")
+
+
+def test_copy_shares_claim(metal, model):
+    context = metal.Context(model, context_length=1024)
+    context.append("The quick brown fox jumps over the lazy dog")
+    context.process()
+    alias = copy.copy(context)
+
+    errors = run_while_busy(context, lambda: alias.tokens)
+    assert errors
+
+
+def test_fork_is_independent(metal, model):
+    context = metal.Context(model, context_length=1024)
+    context.append("The quick brown fox jumps over the lazy dog")
+    context.process()
+    fork = context.fork()
+
+    worker = threading.Thread(
+        target=lambda: context.sample(max_output_tokens=64, temperature=0.0))
+    worker.start()
+    fork.append(" and runs away")
+    fork.process()
+    worker.join()
@@ -0,0 +1,36 @@
+import os
+
+import pytest
+
+PROMPT = "The quick brown fox jumps over the lazy dog. Once upon a time"
+
+
+@pytest.fixture(scope="module")
+def budget_model(metal, model):
+    # Keeps about an eighth of the weights resident
+    budget = model.stats["weights_size"] // 8
+    return metal.Model(os.environ["GPT_OSS_20B_PATH"], expert_budget_bytes=budget)
+
+
+def test_without_budget_nothing_is_managed(model):
+    assert model.stats["num_resident_experts"] == 0
+    with pytest.raises(RuntimeError):
+        model.expert_residency_stats
+
+
+def test_residency_stays_within_budget(metal, budget_model):
+    context = metal.Context(budget_model, context_length=4096)
+    context.append(PROMPT)
+    context.process()
+    context.sample(max_output_tokens=64, temperature=0.0)
+
+    expert_stats = budget_model.expert_stats
+    residency_stats = budget_model.expert_residency_stats
+    assert len(residency_stats) == len(expert_stats)
+    assert [hits + misses for hits, misses in residency_stats] == expert_stats
+    assert sum(misses for _, misses in residency_stats) > 0
+
+    num_resident = budget_model.stats["num_resident_experts"]
+    num_routed = sum(1 for count in expert_stats if count != 0)
+    assert 0 < num_resident <= len(expert_stats) // 4
+    assert num_resident < num_routed
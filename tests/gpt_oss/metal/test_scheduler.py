@@ -0,0 +1,57 @@
+import pytest
+
+PROMPTS = [
+    "The quick brown fox jumps over the lazy dog. Once upon a time",
+    "Hello",
+    "In a hole in the ground there lived a hobbit.",
+]
+
+
+def make_context(metal, model, prompt):
+    context = metal.Context(model, context_length=1024)
+    context.append(prompt)
+    return context
+
+
+def run_to_completion(scheduler):
+    tokens = {}
+    while scheduler.num_requests != 0:
+        for request_id, token, _ in scheduler.step():
+            tokens.setdefault(request_id, []).append(token)
+    return tokens
+
+
+@pytest.mark.parametrize("max_batch_tokens", [0, 5])
+def test_greedy_matches_sequential(metal, model, max_batch_tokens):
+    scheduler = metal.Scheduler(model, max_batch_tokens=max_batch_tokens)
+    contexts = [make_context(metal, model, prompt) for prompt in PROMPTS]
+    request_ids = [scheduler.submit(context, 16, temperature=0.0) for context in contexts]
+    tokens = run_to_completion(scheduler)
+
+    for prompt, context, request_id in zip(PROMPTS, contexts, request_ids):
+        expected = make_context(metal, model, prompt).sample(max_output_tokens=16, temperature=0.0)
+        assert tokens[request_id] == expected
+        assert context.tokens[-len(expected):] == expected
+
+
+def test_context_is_claimed_until_finished(metal, model):
+    scheduler = metal.Scheduler(model)
+    context = make_context(metal, model, PROMPTS[0])
+    request_id = scheduler.submit(context, 4, temperature=0.0)
+    with pytest.raises(RuntimeError):
+        context.tokens
+
+    outputs = scheduler.step()
+    assert [output[0] for output in outputs] == [request_id]
+    scheduler.cancel(request_id)
+    assert scheduler.num_requests == 0
+    assert context.tokens[-1] == outputs[0][1]
+    with pytest.raises(KeyError):
+        scheduler.cancel(request_id)
+
+
+def test_stop_token_finishes_request(metal, model):
+    expected = make_context(metal, model, PROMPTS[0]).sample(max_output_tokens=4, temperature=0.0)
+    scheduler = metal.Scheduler(model)
+    request_id = scheduler.submit(make_context(metal, model, PROMPTS[0]), 16, temperature=0.0, stop_tokens=[expected[2]])
+    assert run_to_completion(scheduler) == {request_id: expected[:3]}
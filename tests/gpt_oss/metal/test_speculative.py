@@ -0,0 +1,39 @@
+import pytest
+
+PROMPT = "The quick brown fox jumps over the lazy dog. Once upon a time"
+
+
+def make_context(metal, model):
+    context = metal.Context(model, context_length=4096)
+    context.append(PROMPT)
+    context.process()
+    return context
+
+
+def test_greedy_matches_sample(metal, model):
+    expected = make_context(metal, model).sample(max_output_tokens=32, temperature=0.0)
+
+    # A draft of the same model accepts every draft token.
+    target = make_context(metal, model)
+    draft = make_context(metal, model)
+    tokens = target.sample_speculative(draft, 32, num_draft_tokens=4, temperature=0.0)
+    assert tokens == expected
+    assert target.tokens == draft.tokens
+    assert target.tokens[-len(tokens):] == tokens
+
+
+def test_deterministic_with_temperature(metal, model):
+    def sample():
+        target = make_context(metal, model)
+        draft = make_context(metal, model)
+        return target.sample_speculative(draft, 32, num_draft_tokens=4, temperature=1.0, seed=42)
+
+    tokens = sample()
+    assert len(tokens) == 32
+    assert sample() == tokens
+
+
+def test_rejects_same_context(metal, model):
+    context = make_context(metal, model)
+    with pytest.raises(ValueError):
+        context.sample_speculative(context, 1)
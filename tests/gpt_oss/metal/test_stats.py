@@ -0,0 +1,34 @@
+PROMPT = "The quick brown fox jumps over the lazy dog. Once upon a time"
+
+
+def process_prompt(metal, model):
+    context = metal.Context(model, context_length=4096)
+    context.append(PROMPT)
+    context.process()
+    return context
+
+
+def test_expert_stats_counted_only_while_started(metal, model):
+    initial = sum(model.expert_stats)
+    process_prompt(metal, model)
+    assert sum(model.expert_stats) == initial
+
+    model.start_expert_stats()
+    try:
+        context = process_prompt(metal, model)
+    finally:
+        model.stop_expert_stats()
+    counted = sum(model.expert_stats)
+    assert counted > initial
+    assert (counted - initial) % len(context.tokens) == 0
+
+    context.sample(max_output_tokens=4)
+    assert sum(model.expert_stats) == counted
+
+
+def test_context_stats(metal, model):
+    context = process_prompt(metal, model)
+    tokens = context.sample(max_output_tokens=8, temperature=0.0)
+    stats = context.stats
+    assert stats["num_decode_tokens"] == len(tokens)
+    assert stats["num_kv_tokens"] <= stats["num_allocated_kv_tokens"] <= stats["max_kv_tokens"]
@@ -0,0 +1,76 @@
+import pytest
+
+TEXTS = [
+    # Multilingual text
+    "Hello, world! How's it going?",
+    "Привет, мир! Как дела?",
+    "你好，世界！今天天气很好。",
+    "こんにちは世界、カタカナとひらがな。",
+    "مرحبا بالعالم",
+    "नमस्ते दुनिया",
+    "Emoji: 👋🏽🌍🚀 and ZWJ: 👩‍👩‍👧‍👦",
+    "Ünïcödé àccents, ß and ﬁ ligatures",
+    # Digits, which the pattern splits into groups of at most three
+    "1234567890",
+    "Pi is 3.14159265358979, e is 2.71828.",
+    "2024-12-31T23:59:59Z, +1 (555) 010-9999",
+    "x1y22z333w4444",
+    # Whitespace runs
+    "a  b   c    d",
+    "   leading spaces",
+    "trailing spaces   ",
+    "\n\n\nnewlines\n\n",
+    "\t\tindented\r\n\tline",
+    "mixed \t \n whitespace  \n\n  ",
+    " ",
+    # Contractions and case
+    "I'm sure they'll say DON'T, and we'd've agreed.",
+    "camelCase PascalCase snake_case SCREAMING_CASE",
+    # Code
+    "def f(x):\n    return x ** 2  # square\n",
+    "if (a != b && c <= d) { return -1; }",
+    # Special tokens are encoded as regular text
+    "<|start|>user<|message|>hi<|end|>",
+]
+
+SPECIAL_TOKENS = [
+    "<|return|>",
+    "<|start|>",
+    "<|message|>",
+    "<|end|>",
+    "<|constrain|>",
+    "<|channel|>",
+    "<|call|>",
+]
+
+
+@pytest.fixture(scope="module")
+def reference():
+    pytest.importorskip("tiktoken")
+    from gpt_oss.tokenizer import get_tokenizer
+
+    return get_tokenizer()
+
+
+@pytest.fixture(scope="module")
+def tokenizer(model):
+    return model.tokenizer
+
+
+@pytest.mark.parametrize("text", TEXTS)
+def test_encode_matches_tiktoken(tokenizer, reference, text):
+    tokens = tokenizer.encode(text)
+    assert tokens == reference.encode_ordinary(text)
+    assert tokenizer.decode_batch(tokens) == text.encode("utf-8")
+
+
+def test_encode_long_text_matches_tiktoken(tokenizer, reference):
+    # Long enough to be encoded by several threads in chunks
+    text = "\n".join(TEXTS) * 200
+    assert len(text.encode("utf-8")) >= 64 * 1024
+    assert tokenizer.encode(text) == reference.encode_ordinary(text)
+
+
+@pytest.mark.parametrize("name", SPECIAL_TOKENS)
+def test_special_token_ids_match_tiktoken(tokenizer, reference, name):
+    assert tokenizer.encode_special_token(name) == reference.encode_single_token(name)
@@ -0,0 +1,128 @@
+import sys
+import types
+
+import pytest
+
+
+class FakeContext:
+    """Mimics the KV cache reuse of gpt_oss.metal.Context: reset keeps the cached tokens, and append_tokens only
+    prefills the tokens past the common prefix with them."""
+
+    def __init__(self, model=None):
+        self.tokens: list[int] = []
+        self.cached: list[int] = []
+        self.num_prefilled = 0
+        self.forked_from = None
+
+    @property
+    def num_tokens(self) -> int:
+        return len(self.tokens)
+
+    @property
+    def stats(self) -> dict:
+        return {"allocation_size": 0, "kvcache_size": 100 * len(self.cached)}
+
+    def reset(self) -> None:
+        self.tokens = []
+
+    def append_tokens(self, tokens: list[int]) -> None:
+        n = 0
+        while n < min(len(tokens), len(self.cached)) and tokens[n] == self.cached[n]:
+            n += 1
+        self.num_prefilled += len(tokens) - n
+        self.tokens = list(tokens)
+        self.cached = list(tokens)
+
+    def sample(self, tokens: list[int]) -> None:
+        self.tokens += tokens
+        self.cached += tokens
+
+    def fork(self) -> "FakeContext":
+        fork = FakeContext()
+        fork.tokens = list(self.tokens)
+        fork.cached = list(self.cached)
+        fork.forked_from = self
+        return fork
+
+
+@pytest.fixture
+def pool_module(monkeypatch):
+    fake_metal = types.ModuleType("gpt_oss.metal")
+    fake_metal.Context = FakeContext
+    fake_metal.Model = object
+    monkeypatch.setitem(sys.modules, "gpt_oss.metal", fake_metal)
+    monkeypatch.delitem(sys.modules, "gpt_oss.responses_api.inference.metal", raising=False)
+    import gpt_oss.responses_api.inference.metal as module
+    monkeypatch.setattr(module, "MIN_FORK_PREFIX_TOKENS", 4)
+    return module
+
+
+def test_continuation_reuses_context(pool_module):
+    pool = pool_module.ContextPool(model=None)
+    context = pool.acquire([1, 2, 3])
+    context.sample([4, 5])
+
+    # The next turn continues the tokens of the context.
+    assert pool.acquire([1, 2, 3, 4, 5, 6, 7]) is context
+    assert context.num_prefilled == 3 + 2
+    assert len(pool.contexts) == 1
+
+
+def test_divergence_from_sampled_tokens_truncates_in_place(pool_module):
+    pool = pool_module.ContextPool(model=None)
+    context = pool.acquire([1, 2, 3, 4, 5])
+    context.sample([6, 7, 8])
+
+    # The next turn renders the previous output differently.
+    assert pool.acquire([1, 2, 3, 4, 5, 6, 9, 10]) is context
+    assert context.tokens == [1, 2, 3, 4, 5, 6, 9, 10]
+    assert context.num_prefilled == 5 + 2
+    assert len(pool.contexts) == 1
+
+
+def test_divergence_from_request_forks_long_prefix(pool_module):
+    pool = pool_module.ContextPool(model=None)
+    context = pool.acquire([1, 2, 3, 4, 5, 6])
+    context.sample([7])
+
+    branch = pool.acquire([1, 2, 3, 4, 10, 11])
+    assert branch is not context
+    assert branch.forked_from is context
+    assert branch.tokens == [1, 2, 3, 4, 10, 11]
+    assert branch.num_prefilled == 2
+    # The matched conversation keeps its tokens.
+    assert context.tokens == [1, 2, 3, 4, 5, 6, 7]
+    assert len(pool.contexts) == 2
+
+
+def test_divergence_from_request_with_short_prefix_starts_new_context(pool_module):
+    pool = pool_module.ContextPool(model=None)
+    context = pool.acquire([1, 2, 3, 4, 5, 6])
+
+    other = pool.acquire([1, 2, 9])
+    assert other is not context
+    assert other.forked_from is None
+    assert other.num_prefilled == 3
+    assert context.tokens == [1, 2, 3, 4, 5, 6]
+
+
+def test_interleaved_conversations_keep_their_contexts(pool_module):
+    pool = pool_module.ContextPool(model=None)
+    first = pool.acquire([1, 2, 3, 4, 5])
+    second = pool.acquire([1, 2, 3, 4, 6])
+    assert second is not first
+
+    assert pool.acquire([1, 2, 3, 4, 5, 7]) is first
+    assert pool.acquire([1, 2, 3, 4, 6, 8]) is second
+    assert first.num_prefilled == 5 + 1
+    assert second.num_prefilled == 1 + 1
+
+
+def test_eviction_keeps_current_context(pool_module):
+    pool = pool_module.ContextPool(model=None, budget=1000)
+    first = pool.acquire(list(range(8)))
+    second = pool.acquire([100 + t for t in range(8)])
+
+    assert list(pool.contexts.values()) == [second]
+    assert first not in pool.contexts.values()
+    assert list(pool.request_lengths) == list(pool.contexts)